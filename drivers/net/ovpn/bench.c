@@ -0,0 +1,535 @@
+// SPDX-License-Identifier: GPL-2.0
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include <linux/ip.h>
+#include <linux/ktime.h>
+#include <linux/netdevice.h>
+#include <linux/random.h>
+#include <linux/rtnetlink.h>
+#include <linux/skbuff.h>
+#include <linux/slab.h>
+#include <linux/timex.h>
+#include <uapi/linux/ovpn.h>
+
+#include "ovpnstruct.h"
+#include "main.h"
+#include "bench.h"
+#include "crypto_aead.h"
+#include "peer.h"
+#include "pktid.h"
+#include "skb.h"
+
+/* the benchmark runs once when the module is loaded and reports through the
+ * kernel log. Numbers are only meant to be compared between builds running
+ * on the same machine: nothing is done to isolate the CPU running the loops
+ */
+
+/* bytes processed per cipher and packet size, bounded by the iterations */
+#define OVPN_BENCH_CRYPTO_BYTES		(16 << 20)
+#define OVPN_BENCH_CRYPTO_ITERS_MIN	256
+#define OVPN_BENCH_CRYPTO_ITERS_MAX	4096
+/* room left around the packet for the ovpn header and the AEAD tag */
+#define OVPN_BENCH_HEADROOM		(OVPN_HEAD_ROOM + 64)
+#define OVPN_BENCH_TAILROOM		64
+
+#define OVPN_BENCH_PKTID_ITERS		(1 << 20)
+
+#define OVPN_BENCH_LOOKUPS		(1 << 20)
+#define OVPN_BENCH_ADD_BATCH		64
+
+static const unsigned int ovpn_bench_sizes[] = {
+	64, 256, 1024, 1420, 4096, 16384, 65536,
+};
+
+static const unsigned int ovpn_bench_peers[] = {
+	1000, 10000, 100000, 1000000,
+};
+
+struct ovpn_bench_clock {
+	u64 ns;
+	cycles_t cycles;
+};
+
+static void ovpn_bench_start(struct ovpn_bench_clock *clock)
+{
+	clock->cycles = get_cycles();
+	clock->ns = ktime_get_ns();
+}
+
+static void ovpn_bench_stop(struct ovpn_bench_clock *clock)
+{
+	clock->ns = ktime_get_ns() - clock->ns;
+	clock->cycles = get_cycles() - clock->cycles;
+}
+
+/* report n operations timed by clock. Per byte cycles are reported for
+ * operations on packets of size bytes, per operation cycles otherwise
+ */
+static void ovpn_bench_report(const char *what,
+			      const struct ovpn_bench_clock *clock,
+			      unsigned int n, unsigned int bytes)
+{
+	u64 ns = max_t(u64, clock->ns, 1), cycles;
+
+	if (!n)
+		return;
+
+	if (bytes) {
+		cycles = div64_u64((u64)clock->cycles * 100, (u64)n * bytes);
+		pr_info("ovpn bench: %s: %llu pps, %llu ns/pkt, %llu.%02llu cycles/byte\n",
+			what, div64_u64((u64)n * NSEC_PER_SEC, ns),
+			div_u64(ns, n), cycles / 100, cycles % 100);
+	} else {
+		pr_info("ovpn bench: %s: %llu ops/s, %llu ns/op, %llu cycles/op\n",
+			what, div64_u64((u64)n * NSEC_PER_SEC, ns),
+			div_u64(ns, n), div_u64(clock->cycles, n));
+	}
+}
+
+/* restore a linear skb to the data it carried before an in-place crypto
+ * operation pushed or pulled headers
+ */
+static void ovpn_bench_skb_restore(struct sk_buff *skb, u8 *data,
+				   unsigned int len)
+{
+	skb->data = data;
+	skb->len = len;
+	skb_set_tail_pointer(skb, len);
+}
+
+static int ovpn_bench_encrypt(struct ovpn_peer *peer,
+			      struct ovpn_crypto_key_slot *ks,
+			      struct sk_buff *skb, u64 pktid)
+{
+	int ret;
+
+	ovpn_skb_cb(skb)->peer = peer;
+	ovpn_skb_cb(skb)->req = NULL;
+	ret = ovpn_aead_encrypt(ks, &skb, peer->id, pktid);
+	if (ovpn_skb_cb(skb)->req)
+		ovpn_aead_req_put(ks, ovpn_skb_cb(skb)->req);
+
+	return ret;
+}
+
+static int ovpn_bench_decrypt(struct ovpn_peer *peer,
+			      struct ovpn_crypto_key_slot *ks,
+			      struct sk_buff *skb)
+{
+	int ret;
+
+	ovpn_skb_cb(skb)->peer = peer;
+	ovpn_skb_cb(skb)->req = NULL;
+	ret = ovpn_aead_decrypt(ks, &skb);
+	if (ovpn_skb_cb(skb)->req)
+		ovpn_aead_req_put(ks, ovpn_skb_cb(skb)->req);
+
+	return ret;
+}
+
+static struct sk_buff *ovpn_bench_alloc_skb(unsigned int size)
+{
+	struct sk_buff *skb;
+
+	skb = alloc_skb(OVPN_BENCH_HEADROOM + size + OVPN_BENCH_TAILROOM,
+			GFP_KERNEL);
+	if (!skb)
+		return NULL;
+
+	skb_reserve(skb, OVPN_BENCH_HEADROOM);
+	get_random_bytes(skb_put(skb, size), size);
+
+	return skb;
+}
+
+/* encrypt and decrypt packets of the given size over and over. The packet
+ * is linear and owns its data, therefore crypto runs in place and the same
+ * buffer is reused by all iterations
+ */
+static int ovpn_bench_crypto_size(struct ovpn_peer *peer,
+				  struct ovpn_crypto_key_slot *ks,
+				  const char *name, unsigned int size)
+{
+	struct ovpn_bench_clock clock, copy;
+	struct sk_buff *skb, *ct = NULL;
+	unsigned int i, iters, len;
+	char what[64];
+	int ret = -ENOMEM;
+	u8 *data;
+
+	iters = clamp_t(unsigned int, OVPN_BENCH_CRYPTO_BYTES / size,
+			OVPN_BENCH_CRYPTO_ITERS_MIN,
+			OVPN_BENCH_CRYPTO_ITERS_MAX);
+
+	skb = ovpn_bench_alloc_skb(size);
+	if (!skb)
+		goto out;
+
+	/* ciphertext decrypted by every iteration of the decryption loop */
+	ct = ovpn_bench_alloc_skb(size);
+	if (!ct)
+		goto out;
+
+	data = skb->data;
+	len = skb->len;
+
+	local_bh_disable();
+	ret = ovpn_bench_encrypt(peer, ks, ct, 1);
+	if (ret < 0)
+		goto out_bh;
+
+	ovpn_bench_start(&clock);
+	for (i = 0; i < iters; i++) {
+		ret = ovpn_bench_encrypt(peer, ks, skb, i + 2);
+		if (unlikely(ret < 0))
+			goto out_bh;
+
+		ovpn_bench_skb_restore(skb, data, len);
+	}
+	ovpn_bench_stop(&clock);
+
+	snprintf(what, sizeof(what), "%s encrypt %u", name, size);
+	ovpn_bench_report(what, &clock, iters, size);
+
+	/* the ciphertext must be copied back before each decryption, whose
+	 * cost is measured separately and subtracted
+	 */
+	data = skb->data - (ct->len - size);
+	len = ct->len;
+
+	ovpn_bench_start(&copy);
+	for (i = 0; i < iters; i++) {
+		ovpn_bench_skb_restore(skb, data, len);
+		memcpy(skb->data, ct->data, len);
+	}
+	ovpn_bench_stop(&copy);
+
+	ovpn_bench_start(&clock);
+	for (i = 0; i < iters; i++) {
+		ovpn_bench_skb_restore(skb, data, len);
+		memcpy(skb->data, ct->data, len);
+		ret = ovpn_bench_decrypt(peer, ks, skb);
+		if (unlikely(ret < 0))
+			goto out_bh;
+	}
+	ovpn_bench_stop(&clock);
+
+	clock.ns -= min(clock.ns, copy.ns);
+	clock.cycles -= min(clock.cycles, copy.cycles);
+	snprintf(what, sizeof(what), "%s decrypt %u", name, size);
+	ovpn_bench_report(what, &clock, iters, size);
+
+out_bh:
+	local_bh_enable();
+out:
+	if (ret < 0)
+		pr_info("ovpn bench: %s %u failed: %d\n", name, size, ret);
+	kfree_skb(ct);
+	kfree_skb(skb);
+	return ret;
+}
+
+static void ovpn_bench_crypto(struct ovpn_peer *peer,
+			      enum ovpn_cipher_alg alg, bool compact,
+			      const char *name)
+{
+	u8 key[32], nonce[OVPN_NONCE_TAIL_SIZE];
+	struct ovpn_key_config kc = {
+		.cipher_alg = alg,
+		/* the same key in both directions, so that packets can be
+		 * decrypted by the slot that encrypted them
+		 */
+		.encrypt = {
+			.cipher_key = key,
+			.cipher_key_size = sizeof(key),
+			.nonce_tail = nonce,
+			.nonce_tail_size = sizeof(nonce),
+		},
+		.decrypt = {
+			.cipher_key = key,
+			.cipher_key_size = sizeof(key),
+			.nonce_tail = nonce,
+			.nonce_tail_size = sizeof(nonce),
+		},
+		.replay_window = REPLAY_WINDOW_SIZE,
+		.rekey_threshold = OVPN_REKEY_THRESHOLD,
+		.compact = compact,
+		.node = NUMA_NO_NODE,
+	};
+	struct ovpn_crypto_key_slot *ks;
+	unsigned int i;
+
+	get_random_bytes(key, sizeof(key));
+	get_random_bytes(nonce, sizeof(nonce));
+
+	ks = ovpn_aead_crypto_key_slot_new(&kc, peer->ovpn->tfm_pool);
+	memzero_explicit(key, sizeof(key));
+	if (IS_ERR(ks)) {
+		pr_info("ovpn bench: %s unavailable: %ld\n", name, PTR_ERR(ks));
+		return;
+	}
+
+	/* packets completing asynchronously would need the full datapath to
+	 * be released and cannot be timed by a synchronous loop
+	 */
+	if (ks->async) {
+		pr_info("ovpn bench: %s skipped, implementation is async\n",
+			name);
+		goto out;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(ovpn_bench_sizes); i++) {
+		if (ovpn_bench_crypto_size(peer, ks, name,
+					   ovpn_bench_sizes[i]) < 0)
+			break;
+		cond_resched();
+	}
+out:
+	ovpn_aead_crypto_key_slot_destroy(ks);
+}
+
+/* feed the replay protection with packet IDs arriving in blocks of span
+ * packets, each block in reverse order (span 1 means in order)
+ */
+static void ovpn_bench_pktid(unsigned int span)
+{
+	struct ovpn_bench_clock clock;
+	struct ovpn_pktid_recv pr;
+	unsigned int i, rejected = 0;
+	u32 now = jiffies / HZ;
+	char what[64];
+	u64 id;
+
+	if (ovpn_pktid_recv_init(&pr, REPLAY_WINDOW_SIZE, NUMA_NO_NODE) < 0)
+		return;
+
+	ovpn_bench_start(&clock);
+	for (i = 0; i < OVPN_BENCH_PKTID_ITERS; i++) {
+		id = (i / span) * span + (span - 1 - i % span) + 1;
+		if (unlikely(ovpn_pktid_recv(&pr, id, now) < 0))
+			rejected++;
+	}
+	ovpn_bench_stop(&clock);
+
+	snprintf(what, sizeof(what), "replay check span %u (%u rejected)",
+		 span, rejected);
+	ovpn_bench_report(what, &clock, OVPN_BENCH_PKTID_ITERS, 0);
+
+	ovpn_pktid_recv_release(&pr);
+}
+
+static __be32 ovpn_bench_peer_addr(u32 id)
+{
+	return htonl(0x0a000000 | id);
+}
+
+/* add peers with IDs 1..n, each with VPN IPv4 10.0.0.0/8 + ID */
+static int ovpn_bench_add_peers(struct ovpn_struct *ovpn, unsigned int n)
+{
+	struct ovpn_peer *peers[OVPN_BENCH_ADD_BATCH];
+	int errs[OVPN_BENCH_ADD_BATCH];
+	unsigned int i, j, cnt;
+	int ret = 0;
+
+	for (i = 0; i < n && !ret; i += cnt) {
+		cnt = min_t(unsigned int, n - i, OVPN_BENCH_ADD_BATCH);
+		for (j = 0; j < cnt; j++) {
+			peers[j] = ovpn_peer_new(ovpn, i + j + 1,
+						 NUMA_NO_NODE);
+			errs[j] = 0;
+			if (IS_ERR(peers[j])) {
+				ret = PTR_ERR(peers[j]);
+				break;
+			}
+
+			peers[j]->vpn_addrs.ipv4.s_addr =
+				ovpn_bench_peer_addr(i + j + 1);
+			/* nobody is listening for deletion notifications */
+			peers[j]->del_notified = true;
+		}
+		cnt = j;
+
+		ovpn_peer_add_bulk(ovpn, peers, errs, cnt);
+		for (j = 0; j < cnt; j++) {
+			if (!errs[j])
+				continue;
+
+			ret = errs[j];
+			ovpn_peer_release(peers[j]);
+			ovpn_peer_free(peers[j]);
+		}
+		cond_resched();
+	}
+
+	return ret;
+}
+
+static void ovpn_bench_lookup(struct ovpn_struct *ovpn, unsigned int n,
+			      const u32 *ids)
+{
+	struct ovpn_bench_clock clock;
+	unsigned int i, missed = 0;
+	struct ovpn_peer *peer;
+	struct sk_buff *skb;
+	struct iphdr *iph;
+	char what[64];
+
+	ovpn_bench_start(&clock);
+	for (i = 0; i < OVPN_BENCH_LOOKUPS; i++) {
+		peer = ovpn_peer_get_by_id(ovpn, ids[i]);
+		if (unlikely(!peer)) {
+			missed++;
+			continue;
+		}
+		ovpn_peer_put(peer);
+	}
+	ovpn_bench_stop(&clock);
+
+	snprintf(what, sizeof(what), "lookup by id, %u peers (%u missed)", n,
+		 missed);
+	ovpn_bench_report(what, &clock, OVPN_BENCH_LOOKUPS, 0);
+
+	skb = alloc_skb(sizeof(*iph), GFP_KERNEL);
+	if (!skb)
+		return;
+
+	skb->protocol = htons(ETH_P_IP);
+	skb_reset_network_header(skb);
+	iph = skb_put_zero(skb, sizeof(*iph));
+	iph->version = 4;
+	iph->ihl = sizeof(*iph) / 4;
+
+	/* like ndo_start_xmit(), the lookup by destination runs in BH */
+	missed = 0;
+	local_bh_disable();
+	ovpn_bench_start(&clock);
+	for (i = 0; i < OVPN_BENCH_LOOKUPS; i++) {
+		iph->daddr = ovpn_bench_peer_addr(ids[i]);
+		peer = ovpn_peer_get_by_dst(ovpn, skb);
+		if (unlikely(!peer)) {
+			missed++;
+			continue;
+		}
+		ovpn_peer_put(peer);
+	}
+	ovpn_bench_stop(&clock);
+	local_bh_enable();
+
+	snprintf(what, sizeof(what), "lookup by dst, %u peers (%u missed)", n,
+		 missed);
+	ovpn_bench_report(what, &clock, OVPN_BENCH_LOOKUPS, 0);
+
+	kfree_skb(skb);
+}
+
+static struct net_device *ovpn_bench_iface_create(void)
+{
+	const struct ovpn_iface_config conf = {
+		.mode = OVPN_MODE_MP,
+		.txqs = 1,
+		.rxqs = 1,
+		.table_size = OVPN_PEER_TABLE_SIZE,
+	};
+
+	return ovpn_iface_create("ovpnbench%d", &conf, &init_net);
+}
+
+static void ovpn_bench_iface_destroy(struct net_device *dev)
+{
+	rtnl_lock();
+	ovpn_iface_destruct(netdev_priv(dev));
+	unregister_netdevice(dev);
+	rtnl_unlock();
+}
+
+/* time lookups among a growing amount of peers, each run on a new instance
+ * so that tables are not polluted by the previous runs
+ */
+static void ovpn_bench_lookups(void)
+{
+	struct net_device *dev;
+	unsigned int i, j, n;
+	u32 *ids;
+	int ret;
+
+	ids = kvmalloc_array(OVPN_BENCH_LOOKUPS, sizeof(*ids), GFP_KERNEL);
+	if (!ids)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(ovpn_bench_peers); i++) {
+		n = ovpn_bench_peers[i];
+
+		dev = ovpn_bench_iface_create();
+		if (IS_ERR(dev))
+			break;
+
+		ret = ovpn_bench_add_peers(netdev_priv(dev), n);
+		if (ret < 0) {
+			pr_info("ovpn bench: cannot add %u peers: %d\n", n,
+				ret);
+			ovpn_bench_iface_destroy(dev);
+			break;
+		}
+
+		for (j = 0; j < OVPN_BENCH_LOOKUPS; j++)
+			ids[j] = get_random_u32_below(n) + 1;
+
+		ovpn_bench_lookup(netdev_priv(dev), n, ids);
+		ovpn_bench_iface_destroy(dev);
+	}
+
+	kvfree(ids);
+}
+
+/**
+ * ovpn_bench_run - benchmark crypto, replay protection and peer lookups
+ *
+ * Results are printed to the kernel log. Failures are reported and only
+ * interrupt the step they happen in.
+ */
+void ovpn_bench_run(void)
+{
+	struct net_device *dev;
+	struct ovpn_peer *peer;
+	unsigned int span;
+
+	pr_info("ovpn bench: starting\n");
+
+	dev = ovpn_bench_iface_create();
+	if (IS_ERR(dev)) {
+		pr_info("ovpn bench: cannot create interface: %ld\n",
+			PTR_ERR(dev));
+		return;
+	}
+
+	/* crypto only needs a peer for its instance and statistics, it is
+	 * never added to the instance
+	 */
+	peer = ovpn_peer_new(netdev_priv(dev), 1, NUMA_NO_NODE);
+	if (!IS_ERR(peer)) {
+		peer->del_notified = true;
+
+		ovpn_bench_crypto(peer, OVPN_CIPHER_ALG_AES_GCM, false,
+				  "aes-gcm");
+		ovpn_bench_crypto(peer, OVPN_CIPHER_ALG_AES_GCM, true,
+				  "aes-gcm-lib");
+		ovpn_bench_crypto(peer, OVPN_CIPHER_ALG_CHACHA20_POLY1305,
+				  false, "chacha20-poly1305");
+
+		ovpn_peer_release(peer);
+		ovpn_peer_free(peer);
+	}
+	ovpn_bench_iface_destroy(dev);
+
+	for (span = 1; span <= REPLAY_WINDOW_SIZE; span *= 8)
+		ovpn_bench_pktid(span);
+
+	ovpn_bench_lookups();
+
+	pr_info("ovpn bench: done\n");
+}
@@ -0,0 +1,24 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_BENCH_H_
+#define _NET_OVPN_BENCH_H_
+
+#if IS_ENABLED(CONFIG_OVPN_BENCH)
+
+void ovpn_bench_run(void);
+
+#else
+
+static inline void ovpn_bench_run(void)
+{
+}
+
+#endif /* CONFIG_OVPN_BENCH */
+
+#endif /* _NET_OVPN_BENCH_H_ */
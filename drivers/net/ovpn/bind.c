@@ -9,10 +9,14 @@
 
 #include <linux/netdevice.h>
 #include <linux/socket.h>
+#include <net/ipv6.h>
+#include <net/route.h>
+#include <net/sock.h>
 
 #include "ovpnstruct.h"
 #include "bind.h"
 #include "peer.h"
+#include "route.h"
 
 /**
  * ovpn_bind_from_sockaddr - retrieve binding matching sockaddr
@@ -41,6 +45,16 @@ struct ovpn_bind *ovpn_bind_from_sockaddr(const struct sockaddr_storage *ss)
 	return bind;
 }
 
+static void ovpn_bind_release_rcu(struct rcu_head *head)
+{
+	struct ovpn_bind *bind = container_of(head, struct ovpn_bind, rcu);
+
+	if (bind->sk)
+		sock_put(bind->sk);
+	kfree(rcu_dereference_protected(bind->tmpl, true));
+	kfree(bind);
+}
+
 /**
  * ovpn_bind_reset - assign new binding to peer
  * @peer: the peer whose binding has to be replaced
@@ -50,9 +64,320 @@ void ovpn_bind_reset(struct ovpn_peer *peer, struct ovpn_bind *new)
 {
 	struct ovpn_bind *old;
 
-	spin_lock_bh(&peer->lock);
+	ovpn_spin_lock_bh_stat(peer->ovpn, &peer->lock, lock_peer_contended);
 	old = rcu_replace_pointer(peer->bind, new, true);
 	spin_unlock_bh(&peer->lock);
 
-	kfree_rcu(old, rcu);
+	if (old)
+		call_rcu(&old->rcu, ovpn_bind_release_rcu);
+}
+
+/**
+ * ovpn_bind_set_sk - make peer reply from another UDP socket
+ * @peer: the peer whose binding has to be updated
+ * @sk: the UDP socket the peer was lately reached on
+ *
+ * The binding is replaced by a copy carrying the new socket, so that the
+ * transmit path always sees consistent data.
+ *
+ * Return: true if the binding was updated, false otherwise
+ */
+bool ovpn_bind_set_sk(struct ovpn_peer *peer, struct sock *sk)
+{
+	struct ovpn_bind *old, *new = NULL;
+
+	ovpn_spin_lock_bh_stat(peer->ovpn, &peer->lock, lock_peer_contended);
+	old = rcu_dereference_protected(peer->bind,
+					lockdep_is_held(&peer->lock));
+	if (unlikely(!old || old->sk == sk))
+		goto unlock;
+
+	new = kmemdup(old, sizeof(*old), GFP_ATOMIC);
+	if (unlikely(!new))
+		goto unlock;
+
+	sock_hold(sk);
+	new->sk = sk;
+	/* the socket may have another port: the template is built again */
+	RCU_INIT_POINTER(new->tmpl, NULL);
+	rcu_assign_pointer(peer->bind, new);
+unlock:
+	spin_unlock_bh(&peer->lock);
+
+	if (new)
+		call_rcu(&old->rcu, ovpn_bind_release_rcu);
+
+	return !!new;
+}
+
+/* Besides its binding, a UDP peer may be reached over a set of paths, like
+ * the uplinks of a multihomed site. Once a set is configured, packets are
+ * spread over its paths in proportion to their weights: those carrying the
+ * hash of an L4 flow always take the same path, so that flows are not
+ * reordered, while the others are sent over the paths in turn. The binding
+ * is used only when no path is usable.
+ *
+ * A path failing to send a packet is excluded for OVPN_PATH_HOLDDOWN and its
+ * traffic moves to the next path right away. A packet received over an
+ * excluded path brings it back before the time is over.
+ *
+ * A path whose route goes down along with a lower device is excluded for
+ * OVPN_PATH_LINK_HOLDDOWN instead, unless the device comes back earlier:
+ * sending over it would keep failing until then.
+ */
+#define OVPN_PATH_HOLDDOWN	HZ
+#define OVPN_PATH_LINK_HOLDDOWN	(30 * HZ)
+
+/**
+ * ovpn_path_set_new - allocate a set of paths
+ * @num: number of paths of the set
+ *
+ * Return: the new set, with its route caches initialized, or NULL on failure
+ */
+struct ovpn_path_set *ovpn_path_set_new(u8 num)
+{
+	struct ovpn_path_set *set;
+	u8 i;
+
+	set = kzalloc(struct_size(set, paths, num), GFP_KERNEL);
+	if (!set)
+		return NULL;
+
+	set->num = num;
+	for (i = 0; i < num; i++) {
+		if (dst_cache_init(&set->paths[i].dst_cache, GFP_KERNEL) < 0) {
+			ovpn_path_set_free(set);
+			return NULL;
+		}
+	}
+
+	return set;
+}
+
+/**
+ * ovpn_path_set_free - free a set of paths
+ * @set: the set to free, not reachable by any RCU reader
+ */
+void ovpn_path_set_free(struct ovpn_path_set *set)
+{
+	u8 i;
+
+	if (!set)
+		return;
+
+	for (i = 0; i < set->num; i++)
+		dst_cache_destroy(&set->paths[i].dst_cache);
+	kfree(set);
+}
+
+static void ovpn_path_set_release_rcu(struct rcu_head *head)
+{
+	ovpn_path_set_free(container_of(head, struct ovpn_path_set, rcu));
+}
+
+/**
+ * ovpn_path_set_reset - assign a new set of paths to a peer
+ * @peer: the peer whose paths have to be replaced
+ * @new: the new set, NULL to remove all paths
+ */
+void ovpn_path_set_reset(struct ovpn_peer *peer, struct ovpn_path_set *new)
+{
+	struct ovpn_path_set *old;
+	u8 i;
+
+	if (new) {
+		new->total_weight = 0;
+		for (i = 0; i < new->num; i++)
+			new->total_weight += new->paths[i].weight;
+	}
+
+	ovpn_spin_lock_bh_stat(peer->ovpn, &peer->lock, lock_peer_contended);
+	old = rcu_replace_pointer(peer->paths, new, true);
+	spin_unlock_bh(&peer->lock);
+
+	if (old)
+		call_rcu(&old->rcu, ovpn_path_set_release_rcu);
+}
+
+/**
+ * ovpn_path_select - pick the path to send a packet over
+ * @set: the paths of the destination peer
+ * @skb: the packet to send
+ *
+ * Must be called under RCU read lock.
+ *
+ * Return: the path to send skb over or NULL if no path is usable
+ */
+struct ovpn_path *ovpn_path_select(struct ovpn_path_set *set,
+				   const struct sk_buff *skb)
+{
+	struct ovpn_path *path;
+	u32 slot;
+	u8 i, n;
+
+	if (skb->l4_hash)
+		slot = reciprocal_scale(skb->hash, set->total_weight);
+	else
+		slot = (u32)atomic_inc_return(&set->rr) % set->total_weight;
+
+	/* every path owns as many consecutive slots as its weight */
+	for (i = 0; slot >= set->paths[i].weight; i++)
+		slot -= set->paths[i].weight;
+
+	/* the packets of an excluded path move to the next usable one */
+	for (n = 0; n < set->num; n++) {
+		path = &set->paths[(i + n) % set->num];
+		if (ovpn_path_usable(path))
+			return path;
+	}
+
+	return NULL;
+}
+
+/**
+ * ovpn_path_exclude - stop using a path that failed to send a packet
+ * @path: the failing path
+ */
+void ovpn_path_exclude(struct ovpn_path *path)
+{
+	WRITE_ONCE(path->excluded_until, (jiffies + OVPN_PATH_HOLDDOWN) ?: 1);
+}
+
+/* whether the route of a path leaves over a device able to carry packets */
+static bool ovpn_path_routable(struct net *net, const struct ovpn_path *path)
+{
+	const struct ovpn_bind *bind = &path->bind;
+	struct dst_entry *dst;
+	struct rtable *rt;
+	struct flowi4 fl4;
+#if IS_ENABLED(CONFIG_IPV6)
+	struct flowi6 fl6;
+#endif
+	bool up;
+
+	switch (bind->sa.in4.sin_family) {
+	case AF_INET:
+		memset(&fl4, 0, sizeof(fl4));
+		fl4.daddr = bind->sa.in4.sin_addr.s_addr;
+		fl4.saddr = bind->local.ipv4.s_addr;
+		fl4.flowi4_proto = IPPROTO_UDP;
+		rt = ip_route_output_key(net, &fl4);
+		if (IS_ERR(rt))
+			return false;
+		dst = &rt->dst;
+		break;
+#if IS_ENABLED(CONFIG_IPV6)
+	case AF_INET6:
+		memset(&fl6, 0, sizeof(fl6));
+		fl6.daddr = bind->sa.in6.sin6_addr;
+		fl6.saddr = bind->local.ipv6;
+		fl6.flowi6_oif = bind->sa.in6.sin6_scope_id;
+		fl6.flowi6_proto = IPPROTO_UDP;
+		dst = ovpn_route_lookup6(net, NULL, &fl6);
+		if (IS_ERR(dst))
+			return false;
+		break;
+#endif
+	default:
+		return true;
+	}
+
+	up = netif_running(dst->dev) && netif_carrier_ok(dst->dev);
+	dst_release(dst);
+
+	return up;
+}
+
+/**
+ * ovpn_path_set_link_event - re-evaluate the paths of a peer after a lower
+ *			      device changed state
+ * @set: the paths of the peer
+ * @net: the netns the paths are routed in
+ *
+ * The cached routes of all paths are dropped. Paths left with no route, or
+ * with a route over a device that is down or has no carrier, are excluded
+ * right away instead of after failing to send; the others are used again
+ * right away, even if their holddown is not over.
+ *
+ * Must be called under RCU read lock.
+ *
+ * Return: the number of excluded paths
+ */
+unsigned int ovpn_path_set_link_event(struct ovpn_path_set *set,
+				      struct net *net)
+{
+	unsigned int excluded = 0;
+	struct ovpn_path *path;
+	u8 i;
+
+	for (i = 0; i < set->num; i++) {
+		path = &set->paths[i];
+		dst_cache_reset(&path->dst_cache);
+
+		if (ovpn_path_routable(net, path)) {
+			WRITE_ONCE(path->excluded_until, 0);
+		} else {
+			WRITE_ONCE(path->excluded_until,
+				   (jiffies + OVPN_PATH_LINK_HOLDDOWN) ?: 1);
+			excluded++;
+		}
+	}
+
+	return excluded;
+}
+
+/* paths leading to the same remote endpoint may leave from different local
+ * addresses, therefore packets are matched against both endpoints
+ */
+static bool ovpn_path_skb_match(const struct ovpn_path *path,
+				const struct sk_buff *skb)
+{
+	const struct ovpn_bind *bind = &path->bind;
+
+	if (!ovpn_bind_skb_src_match(bind, skb))
+		return false;
+
+	switch (bind->sa.in4.sin_family) {
+	case AF_INET:
+		return !bind->local.ipv4.s_addr ||
+		       bind->local.ipv4.s_addr == ip_hdr(skb)->daddr;
+	case AF_INET6:
+		return ipv6_addr_any(&bind->local.ipv6) ||
+		       ipv6_addr_equal(&bind->local.ipv6,
+				       &ipv6_hdr(skb)->daddr);
+	default:
+		return false;
+	}
+}
+
+/**
+ * ovpn_path_rx - account an authenticated packet to the path it came over
+ * @peer: the peer the packet comes from
+ * @skb: the received packet
+ *
+ * Return: true if skb came over one of the paths of peer, in which case the
+ * peer did not float and the path is usable again
+ */
+bool ovpn_path_rx(struct ovpn_peer *peer, const struct sk_buff *skb)
+{
+	struct ovpn_path_set *set;
+	struct ovpn_path *path;
+	bool ret = false;
+	u8 i;
+
+	rcu_read_lock();
+	set = rcu_dereference(peer->paths);
+	for (i = 0; set && i < set->num; i++) {
+		path = &set->paths[i];
+		if (!ovpn_path_skb_match(path, skb))
+			continue;
+
+		if (unlikely(READ_ONCE(path->excluded_until)))
+			WRITE_ONCE(path->excluded_until, 0);
+		ret = true;
+		break;
+	}
+	rcu_read_unlock();
+
+	return ret;
 }
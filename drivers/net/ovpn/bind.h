@@ -10,9 +10,13 @@
 #ifndef _NET_OVPN_OVPNBIND_H_
 #define _NET_OVPN_OVPNBIND_H_
 
+#include <net/dst_cache.h>
 #include <net/ip.h>
 #include <linux/in.h>
 #include <linux/in6.h>
+#include <linux/ipv6.h>
+#include <linux/netdevice.h>
+#include <linux/udp.h>
 #include <linux/rcupdate.h>
 #include <linux/skbuff.h>
 #include <linux/spinlock.h>
@@ -31,12 +35,66 @@ struct ovpn_sockaddr {
 	};
 };
 
+/**
+ * struct ovpn_hdr_tmpl - outer headers prebuilt for the packets sent to a peer
+ * @rcu: used to free the template in an RCU safe way
+ * @v4: IPv4 and UDP headers, for IPv4 bindings
+ * @v4.iph: the IPv4 header
+ * @v4.uh: the UDP header
+ * @v6: IPv6 and UDP headers, for IPv6 bindings
+ * @v6.ip6h: the IPv6 header
+ * @v6.uh: the UDP header
+ * @dev: lower device @hh was resolved on (compared only, never dereferenced)
+ * @nexthop: next hop @hh was resolved for
+ * @nexthop.ipv4: IPv4 next hop
+ * @nexthop.ipv6: IPv6 next hop
+ * @gen: neighbour generation @hh was resolved at
+ * @hh_stamp: jiffies of the resolution of @hh
+ * @hh_len: length of the link layer header, 0 if none was resolved
+ * @hh: link layer header, aligned to its end like in struct hh_cache
+ *
+ * Only the fields shared by all the packets are set: addresses, ports and
+ * TTL or hop limit. The link layer header is resolved for interfaces using
+ * direct transmission only. A template is never modified once published.
+ */
+struct ovpn_hdr_tmpl {
+	struct rcu_head rcu;
+	union {
+		struct {
+			struct iphdr iph;
+			struct udphdr uh;
+		} v4;
+		struct {
+			struct ipv6hdr ip6h;
+			struct udphdr uh;
+		} v6;
+	};
+	struct net_device *dev;
+	union {
+		__be32 ipv4;
+		struct in6_addr ipv6;
+	} nexthop;
+	u32 gen;
+	unsigned long hh_stamp;
+	unsigned int hh_len;
+	u8 hh[HH_DATA_MOD];
+};
+
 /**
  * struct ovpn_bind - remote peer binding
  * @sa: the remote peer sockaddress
  * @local: local endpoint used to talk to the peer
  * @local.ipv4: local IPv4 used to talk to the peer
  * @local.ipv6: local IPv6 used to talk to the peer
+ * @local_cand: local IP the peer was lately reached on, if different from
+ *		@local
+ * @local_cand.ipv4: candidate local IPv4
+ * @local_cand.ipv6: candidate local IPv6
+ * @local_cand_cnt: consecutive packets received on @local_cand
+ * @sk: UDP socket the peer was lately reached on, if different from the one
+ *	of the peer (a reference is held)
+ * @tmpl: outer headers of the packets sent to @sa, built by the transmit path
+ *	  and replaced once they do not match the route anymore (NULL if none)
  * @rcu: used to schedule RCU cleanup job
  */
 struct ovpn_bind {
@@ -47,9 +105,74 @@ struct ovpn_bind {
 		struct in6_addr ipv6;
 	} local;
 
+	union {
+		struct in_addr ipv4;
+		struct in6_addr ipv6;
+	} local_cand;
+	u8 local_cand_cnt;
+
+	struct sock *sk;
+	struct ovpn_hdr_tmpl __rcu *tmpl;
 	struct rcu_head rcu;
 };
 
+/**
+ * struct ovpn_port_range - range of UDP ports, in host byte order
+ * @min: first port of the range, 0 if the range is empty
+ * @max: last port of the range
+ */
+struct ovpn_port_range {
+	u16 min;
+	u16 max;
+};
+
+/* largest number of paths a peer can be reached over */
+#define OVPN_MAX_PATHS		4
+
+/**
+ * struct ovpn_path - path a peer can be reached over besides its binding
+ * @bind: remote and local endpoint of the path (@bind.sk is never set)
+ * @dst_cache: cache of the route of the path
+ * @weight: share of the traffic of the peer sent over the path
+ * @excluded_until: jiffies until which the path is not used after failing,
+ *		    0 if the path is usable
+ */
+struct ovpn_path {
+	struct ovpn_bind bind;
+	struct dst_cache dst_cache;
+	u32 weight;
+	unsigned long excluded_until;
+};
+
+/**
+ * struct ovpn_path_set - paths a peer is reached over
+ * @rcu: used to free the set in an RCU safe way
+ * @rr: counter spreading the packets that carry no flow hash
+ * @total_weight: sum of the weights of all paths
+ * @num: number of paths
+ * @paths: the paths
+ */
+struct ovpn_path_set {
+	struct rcu_head rcu;
+	atomic_t rr;
+	u32 total_weight;
+	u8 num;
+	struct ovpn_path paths[] __counted_by(num);
+};
+
+/**
+ * ovpn_path_usable - check if a path can be used to send packets
+ * @path: the path to check
+ *
+ * Return: true unless the path was excluded after failing lately
+ */
+static inline bool ovpn_path_usable(const struct ovpn_path *path)
+{
+	unsigned long until = READ_ONCE(path->excluded_until);
+
+	return !until || time_after_eq(jiffies, until);
+}
+
 /**
  * skb_protocol_to_family - translate skb->protocol to AF_INET or AF_INET6
  * @skb: the packet sk_buff to inspect
@@ -115,5 +238,16 @@ static inline bool ovpn_bind_skb_src_match(const struct ovpn_bind *bind,
 
 struct ovpn_bind *ovpn_bind_from_sockaddr(const struct sockaddr_storage *sa);
 void ovpn_bind_reset(struct ovpn_peer *peer, struct ovpn_bind *bind);
+bool ovpn_bind_set_sk(struct ovpn_peer *peer, struct sock *sk);
+
+struct ovpn_path_set *ovpn_path_set_new(u8 num);
+void ovpn_path_set_free(struct ovpn_path_set *set);
+void ovpn_path_set_reset(struct ovpn_peer *peer, struct ovpn_path_set *new);
+struct ovpn_path *ovpn_path_select(struct ovpn_path_set *set,
+				   const struct sk_buff *skb);
+void ovpn_path_exclude(struct ovpn_path *path);
+unsigned int ovpn_path_set_link_event(struct ovpn_path_set *set,
+				      struct net *net);
+bool ovpn_path_rx(struct ovpn_peer *peer, const struct sk_buff *skb);
 
 #endif /* _NET_OVPN_OVPNBIND_H_ */
@@ -0,0 +1,488 @@
+// SPDX-License-Identifier: GPL-2.0
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include <linux/bpf.h>
+#include <linux/btf.h>
+#include <linux/btf_ids.h>
+#include <linux/netdevice.h>
+#include <net/ip.h>
+#include <net/ip6_checksum.h>
+#include <net/ipv6.h>
+#include <net/udp.h>
+#include <net/xdp.h>
+
+#include "ovpnstruct.h"
+#include "main.h"
+#include "bpf.h"
+#include "io.h"
+#include "peer.h"
+#include "proto.h"
+#include "socket.h"
+#include "stats.h"
+
+/* Unstable kfuncs for SCHED_CLS programs attached to the ingress of the
+ * underlay device.
+ *
+ * They let a program hand DATA_V2 packets over to an ovpn interface right
+ * after the packet is received, skipping the IP receive path, the UDP socket
+ * lookup and the encap_rcv indirect call. Packets are checked against the
+ * UDP socket of the peer they belong to, so that only traffic that would
+ * have reached that socket anyway is taken. Note that netfilter hooks of the
+ * underlay are skipped as well.
+ *
+ * Handing packets over from XDP is not supported, as the ovpn datapath is
+ * built around skbs.
+ *
+ * SCHED_CLS and XDP programs can also look up the peers of an ovpn interface,
+ * in order to implement per-peer policies without mirroring the peer tables
+ * into BPF maps. Peers are returned referenced and must be released with
+ * bpf_ovpn_peer_release(). Fields of the peer (i.e. id or vpn_addrs) can be
+ * read directly, while stats are summed up by bpf_ovpn_peer_get_stats().
+ */
+
+/**
+ * enum bpf_ovpn_peer_key_type - how to look up a peer
+ * @BPF_OVPN_KEY_ID: by peer ID
+ * @BPF_OVPN_KEY_VPN_ADDR: by the address assigned to the peer in the VPN
+ * @BPF_OVPN_KEY_TRANSP_ADDR: by remote transport address and port
+ */
+enum bpf_ovpn_peer_key_type {
+	BPF_OVPN_KEY_ID,
+	BPF_OVPN_KEY_VPN_ADDR,
+	BPF_OVPN_KEY_TRANSP_ADDR,
+};
+
+/**
+ * struct bpf_ovpn_peer_key - key to look up a peer with
+ * @type: how to look up the peer (enum bpf_ovpn_peer_key_type)
+ * @family: AF_INET or AF_INET6 (address lookups only)
+ * @port: remote transport port (BPF_OVPN_KEY_TRANSP_ADDR only)
+ * @id: the peer ID (BPF_OVPN_KEY_ID only)
+ * @addr: the address to match (address lookups only)
+ * @addr.ipv4: IPv4 address
+ * @addr.ipv6: IPv6 address
+ */
+struct bpf_ovpn_peer_key {
+	u8 type;
+	u8 family;
+	__be16 port;
+	u32 id;
+	union {
+		__be32 ipv4;
+		struct in6_addr ipv6;
+	} addr;
+};
+
+/**
+ * struct bpf_ovpn_peer_stats - traffic counters of a peer
+ * @vpn: traffic over the tunnel
+ * @link: traffic over the transport
+ */
+struct bpf_ovpn_peer_stats {
+	struct ovpn_peer_stats_sum vpn;
+	struct ovpn_peer_stats_sum link;
+};
+
+/* pull the outer IPv4 header, leaving data at the UDP header */
+static int ovpn_bpf_pull_ip4(struct sk_buff *skb)
+{
+	const struct iphdr *iph;
+	unsigned int hlen;
+
+	if (!pskb_may_pull(skb, sizeof(*iph)))
+		return -EINVAL;
+
+	iph = ip_hdr(skb);
+	hlen = iph->ihl * 4;
+	if (iph->version != 4 || hlen < sizeof(*iph) ||
+	    iph->protocol != IPPROTO_UDP || ip_is_fragment(iph))
+		return -EPROTONOSUPPORT;
+
+	if (!pskb_may_pull(skb, hlen))
+		return -EINVAL;
+
+	iph = ip_hdr(skb);
+	if (ip_fast_csum((const u8 *)iph, iph->ihl) ||
+	    ntohs(iph->tot_len) < hlen || ntohs(iph->tot_len) > skb->len)
+		return -EINVAL;
+
+	if (pskb_trim_rcsum(skb, ntohs(iph->tot_len)))
+		return -ENOMEM;
+
+	skb_set_transport_header(skb, hlen);
+	skb_pull_rcsum(skb, hlen);
+
+	return 0;
+}
+
+#if IS_ENABLED(CONFIG_IPV6)
+/* pull the outer IPv6 header, leaving data at the UDP header */
+static int ovpn_bpf_pull_ip6(struct sk_buff *skb)
+{
+	const struct ipv6hdr *ip6h;
+
+	if (!pskb_may_pull(skb, sizeof(*ip6h)))
+		return -EINVAL;
+
+	ip6h = ipv6_hdr(skb);
+	/* extension headers are left to the IPv6 stack */
+	if (ip6h->version != 6 || ip6h->nexthdr != IPPROTO_UDP)
+		return -EPROTONOSUPPORT;
+
+	if (sizeof(*ip6h) + ntohs(ip6h->payload_len) > skb->len)
+		return -EINVAL;
+
+	if (pskb_trim_rcsum(skb, sizeof(*ip6h) + ntohs(ip6h->payload_len)))
+		return -ENOMEM;
+
+	skb_set_transport_header(skb, sizeof(*ip6h));
+	skb_pull_rcsum(skb, sizeof(*ip6h));
+
+	return 0;
+}
+#endif
+
+/* validate the UDP header, leaving data at the UDP header */
+static int ovpn_bpf_check_udp(struct sk_buff *skb)
+{
+	const struct udphdr *uh;
+	unsigned int ulen;
+	int ret;
+
+	if (!pskb_may_pull(skb, sizeof(*uh) + OVPN_OP_SIZE_V2))
+		return -EINVAL;
+
+	uh = udp_hdr(skb);
+	ulen = ntohs(uh->len);
+	if (ulen < sizeof(*uh) + OVPN_OP_SIZE_V2 || ulen > skb->len)
+		return -EINVAL;
+
+	if (pskb_trim_rcsum(skb, ulen))
+		return -ENOMEM;
+
+	uh = udp_hdr(skb);
+	if (skb->protocol == htons(ETH_P_IP))
+		ret = skb_checksum_init_zero_check(skb, IPPROTO_UDP, uh->check,
+						   inet_compute_pseudo);
+	else
+		ret = skb_checksum_init(skb, IPPROTO_UDP, ip6_compute_pseudo);
+
+	if (ret || udp_lib_checksum_complete(skb))
+		return -EBADMSG;
+
+	return 0;
+}
+
+/* whether the UDP socket used to talk to peer would have received skb */
+static bool ovpn_bpf_sock_match(const struct ovpn_peer *peer,
+				const struct sk_buff *skb)
+{
+	struct sock *sk = peer->sock->sock->sk;
+
+	if (sk->sk_protocol != IPPROTO_UDP ||
+	    !net_eq(sock_net(sk), dev_net(skb->dev)) ||
+	    inet_sk(sk)->inet_sport != udp_hdr(skb)->dest)
+		return false;
+
+	switch (skb->protocol) {
+	case htons(ETH_P_IP):
+		if (sk->sk_family == AF_INET6 && ipv6_only_sock(sk))
+			return false;
+		return !sk->sk_rcv_saddr ||
+		       sk->sk_rcv_saddr == ip_hdr(skb)->daddr;
+#if IS_ENABLED(CONFIG_IPV6)
+	case htons(ETH_P_IPV6):
+		if (sk->sk_family != AF_INET6)
+			return false;
+		return ipv6_addr_any(&sk->sk_v6_rcv_saddr) ||
+		       ipv6_addr_equal(&sk->sk_v6_rcv_saddr,
+				       &ipv6_hdr(skb)->daddr);
+#endif
+	default:
+		return false;
+	}
+}
+
+/* process a private copy of the received packet */
+static int ovpn_bpf_recv(struct ovpn_struct *ovpn, struct sk_buff *skb)
+{
+	struct ovpn_peer *peer;
+	u32 peer_id;
+	int ret;
+
+	switch (skb->protocol) {
+	case htons(ETH_P_IP):
+		ret = ovpn_bpf_pull_ip4(skb);
+		break;
+#if IS_ENABLED(CONFIG_IPV6)
+	case htons(ETH_P_IPV6):
+		ret = ovpn_bpf_pull_ip6(skb);
+		break;
+#endif
+	default:
+		ret = -EPROTONOSUPPORT;
+		break;
+	}
+
+	ret = ret ?: ovpn_bpf_check_udp(skb);
+	if (ret)
+		return ret;
+
+	/* control packets are delivered to userspace via the UDP socket */
+	if (ovpn_opcode_from_skb(skb, sizeof(struct udphdr)) != OVPN_DATA_V2)
+		return -EPROTO;
+
+	/* packets with undefined peer-id need a lookup by transport address,
+	 * which is left to the regular path
+	 */
+	peer_id = ovpn_peer_id_from_skb(skb, sizeof(struct udphdr));
+	if (peer_id == OVPN_PEER_ID_UNDEF)
+		return -ENOENT;
+
+	peer = ovpn_peer_get_by_id(ovpn, peer_id);
+	if (!peer)
+		return -ENOENT;
+
+	if (!ovpn_bpf_sock_match(peer, skb)) {
+		ovpn_peer_put(peer);
+		return -ENOENT;
+	}
+
+	/* pop off outer UDP header */
+	__skb_pull(skb, sizeof(struct udphdr));
+	ovpn_recv(peer, skb);
+
+	return 0;
+}
+
+/* look up a peer of the ovpn interface with index ifindex in net */
+static struct ovpn_peer *ovpn_bpf_peer_lookup(struct net *net, u32 ifindex,
+					      const struct bpf_ovpn_peer_key *key,
+					      u32 key_sz)
+{
+	struct net_device *dev;
+	struct ovpn_struct *ovpn;
+
+	if (key_sz != sizeof(*key))
+		return NULL;
+
+	dev = dev_get_by_index_rcu(net, ifindex);
+	if (!dev || !ovpn_dev_is_valid(dev))
+		return NULL;
+
+	ovpn = netdev_priv(dev);
+
+	switch (key->type) {
+	case BPF_OVPN_KEY_ID:
+		return ovpn_peer_get_by_id(ovpn, key->id);
+	case BPF_OVPN_KEY_VPN_ADDR:
+		return ovpn_peer_get_by_vpn_addr(ovpn, key->family,
+						 &key->addr);
+	case BPF_OVPN_KEY_TRANSP_ADDR:
+		return ovpn_peer_get_by_remote(ovpn, key->family, &key->addr,
+					       key->port);
+	default:
+		return NULL;
+	}
+}
+
+__bpf_kfunc_start_defs();
+
+/* bpf_skb_ovpn_recv - Hand a DATA_V2 packet over to an ovpn interface
+ *
+ * Parameters:
+ * @skb_ctx	- Pointer to ctx (__sk_buff) in TC program attached to the
+ *		  ingress of the underlay device
+ *		    Cannot be NULL
+ * @ifindex	- Index of the ovpn interface the packet is sent to
+ *
+ * Return: 0 if a copy of the packet was taken over by ovpn, in which case
+ * the program should return TC_ACT_STOLEN, or a negative error code if the
+ * packet was left untouched and should continue through the stack
+ */
+__bpf_kfunc int bpf_skb_ovpn_recv(struct __sk_buff *skb_ctx, u32 ifindex)
+{
+	struct sk_buff *skb = (struct sk_buff *)skb_ctx, *nskb;
+	struct ovpn_struct *ovpn;
+	struct net_device *dev;
+	int ret;
+
+	if (skb->pkt_type != PACKET_HOST || skb_is_gso(skb))
+		return -EOPNOTSUPP;
+
+	dev = dev_get_by_index_rcu(dev_net(skb->dev), ifindex);
+	if (!dev || !ovpn_dev_is_valid(dev))
+		return -ENODEV;
+
+	ovpn = netdev_priv(dev);
+
+	/* the packet is stripped and decrypted, which would not be allowed
+	 * on the skb owned by the TC layer
+	 */
+	nskb = skb_clone(skb, GFP_ATOMIC);
+	if (!nskb)
+		return -ENOMEM;
+
+	ret = ovpn_bpf_recv(ovpn, nskb);
+	if (ret)
+		kfree_skb(nskb);
+
+	return ret;
+}
+
+/* bpf_skb_ovpn_peer_lookup - Look up a peer of an ovpn interface
+ *
+ * Parameters:
+ * @skb_ctx	- Pointer to ctx (__sk_buff) in TC program
+ *		    Cannot be NULL
+ * @ifindex	- Index of the ovpn interface, in the netns of the device the
+ *		  program is attached to
+ * @key		- Pointer to the lookup key
+ *		    Cannot be NULL
+ * @key__sz	- Size of the key, must be sizeof(struct bpf_ovpn_peer_key)
+ *
+ * Return: the peer, which must be released with bpf_ovpn_peer_release(), or
+ * NULL if not found
+ */
+__bpf_kfunc struct ovpn_peer *
+bpf_skb_ovpn_peer_lookup(struct __sk_buff *skb_ctx, u32 ifindex,
+			 struct bpf_ovpn_peer_key *key, u32 key__sz)
+{
+	struct sk_buff *skb = (struct sk_buff *)skb_ctx;
+
+	return ovpn_bpf_peer_lookup(dev_net(skb->dev), ifindex, key, key__sz);
+}
+
+/* bpf_xdp_ovpn_peer_lookup - Look up a peer of an ovpn interface
+ *
+ * Parameters:
+ * @xdp_ctx	- Pointer to ctx (xdp_md) in XDP program
+ *		    Cannot be NULL
+ * @ifindex	- Index of the ovpn interface, in the netns of the device the
+ *		  program is attached to
+ * @key		- Pointer to the lookup key
+ *		    Cannot be NULL
+ * @key__sz	- Size of the key, must be sizeof(struct bpf_ovpn_peer_key)
+ *
+ * Return: the peer, which must be released with bpf_ovpn_peer_release(), or
+ * NULL if not found
+ */
+__bpf_kfunc struct ovpn_peer *
+bpf_xdp_ovpn_peer_lookup(struct xdp_md *xdp_ctx, u32 ifindex,
+			 struct bpf_ovpn_peer_key *key, u32 key__sz)
+{
+	struct xdp_buff *ctx = (struct xdp_buff *)xdp_ctx;
+
+	return ovpn_bpf_peer_lookup(dev_net(ctx->rxq->dev), ifindex, key,
+				    key__sz);
+}
+
+/* bpf_ovpn_peer_release - Release a peer returned by a lookup
+ *
+ * Parameters:
+ * @peer	- Pointer to the peer
+ *		    Cannot be NULL
+ */
+__bpf_kfunc void bpf_ovpn_peer_release(struct ovpn_peer *peer)
+{
+	ovpn_peer_put(peer);
+}
+
+/* bpf_ovpn_peer_get_stats - Sum up the traffic counters of a peer
+ *
+ * Parameters:
+ * @peer	- Pointer to the peer returned by a lookup
+ *		    Cannot be NULL
+ * @stats	- Pointer to the counters to fill
+ *		    Cannot be NULL
+ * @stats__sz	- Size of the counters, must be
+ *		  sizeof(struct bpf_ovpn_peer_stats)
+ *
+ * Return: 0 on success or -EINVAL if stats__sz is not valid
+ */
+__bpf_kfunc int bpf_ovpn_peer_get_stats(struct ovpn_peer *peer,
+					struct bpf_ovpn_peer_stats *stats,
+					u32 stats__sz)
+{
+	if (stats__sz != sizeof(*stats))
+		return -EINVAL;
+
+	ovpn_peer_stats_fetch(peer->vpn_stats, &peer->vpn_base,
+			      &stats->vpn);
+	ovpn_peer_stats_fetch(peer->link_stats, &peer->link_base,
+			      &stats->link);
+
+	return 0;
+}
+
+/* bpf_ovpn_peer_get_cookie - Get the value attached to a peer
+ *
+ * Parameters:
+ * @peer	- Pointer to the peer returned by a lookup
+ *		    Cannot be NULL
+ *
+ * Return: the value last set by bpf_ovpn_peer_set_cookie() (0 by default)
+ */
+__bpf_kfunc u64 bpf_ovpn_peer_get_cookie(struct ovpn_peer *peer)
+{
+	return READ_ONCE(peer->bpf_cookie);
+}
+
+/* bpf_ovpn_peer_set_cookie - Attach a value to a peer
+ *
+ * Parameters:
+ * @peer	- Pointer to the peer returned by a lookup
+ *		    Cannot be NULL
+ * @cookie	- The value to attach, shared by all programs
+ */
+__bpf_kfunc void bpf_ovpn_peer_set_cookie(struct ovpn_peer *peer, u64 cookie)
+{
+	WRITE_ONCE(peer->bpf_cookie, cookie);
+}
+
+__bpf_kfunc_end_defs();
+
+BTF_KFUNCS_START(ovpn_kfunc_ids)
+BTF_ID_FLAGS(func, bpf_skb_ovpn_recv)
+BTF_ID_FLAGS(func, bpf_skb_ovpn_peer_lookup, KF_ACQUIRE | KF_RET_NULL)
+BTF_ID_FLAGS(func, bpf_ovpn_peer_release, KF_RELEASE)
+BTF_ID_FLAGS(func, bpf_ovpn_peer_get_stats, KF_TRUSTED_ARGS)
+BTF_ID_FLAGS(func, bpf_ovpn_peer_get_cookie, KF_TRUSTED_ARGS)
+BTF_ID_FLAGS(func, bpf_ovpn_peer_set_cookie, KF_TRUSTED_ARGS)
+BTF_KFUNCS_END(ovpn_kfunc_ids)
+
+static const struct btf_kfunc_id_set ovpn_kfunc_set = {
+	.owner = THIS_MODULE,
+	.set   = &ovpn_kfunc_ids,
+};
+
+BTF_KFUNCS_START(ovpn_xdp_kfunc_ids)
+BTF_ID_FLAGS(func, bpf_xdp_ovpn_peer_lookup, KF_ACQUIRE | KF_RET_NULL)
+BTF_ID_FLAGS(func, bpf_ovpn_peer_release, KF_RELEASE)
+BTF_ID_FLAGS(func, bpf_ovpn_peer_get_stats, KF_TRUSTED_ARGS)
+BTF_ID_FLAGS(func, bpf_ovpn_peer_get_cookie, KF_TRUSTED_ARGS)
+BTF_ID_FLAGS(func, bpf_ovpn_peer_set_cookie, KF_TRUSTED_ARGS)
+BTF_KFUNCS_END(ovpn_xdp_kfunc_ids)
+
+static const struct btf_kfunc_id_set ovpn_xdp_kfunc_set = {
+	.owner = THIS_MODULE,
+	.set   = &ovpn_xdp_kfunc_ids,
+};
+
+/**
+ * ovpn_bpf_init - register the ovpn kfuncs with the BPF subsystem
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_bpf_init(void)
+{
+	return register_btf_kfunc_id_set(BPF_PROG_TYPE_SCHED_CLS,
+					 &ovpn_kfunc_set) ?:
+	       register_btf_kfunc_id_set(BPF_PROG_TYPE_XDP,
+					 &ovpn_xdp_kfunc_set);
+}
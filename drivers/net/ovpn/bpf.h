@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_BPF_H_
+#define _NET_OVPN_BPF_H_
+
+#if (IS_BUILTIN(CONFIG_OVPN) && IS_ENABLED(CONFIG_DEBUG_INFO_BTF)) || \
+    (IS_MODULE(CONFIG_OVPN) && IS_ENABLED(CONFIG_DEBUG_INFO_BTF_MODULES))
+
+int ovpn_bpf_init(void);
+
+#else
+
+static inline int ovpn_bpf_init(void)
+{
+	return 0;
+}
+
+#endif
+
+#endif /* _NET_OVPN_BPF_H_ */
@@ -0,0 +1,130 @@
+// SPDX-License-Identifier: GPL-2.0
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include <linux/skbuff.h>
+#include <uapi/linux/ovpn.h>
+
+#include "comp.h"
+
+/* Peers configured with "compress stub" (or with a compression algorithm
+ * the server refused) frame every packet as if it were compressed, without
+ * ever compressing anything: the framing is a marker telling the receiver
+ * that the packet was left as is. Really compressed packets are not
+ * supported and are dropped.
+ */
+
+/* LZO/LZ4 framing: marker prepended to the packet */
+#define OVPN_COMP_NO_COMPRESS		0xfa
+/* LZ4 framing: marker in place of the first byte, moved to the end */
+#define OVPN_COMP_NO_COMPRESS_SWAP	0xfb
+/* V2 framing: packets are sent as is, unless they start with the escape */
+#define OVPN_COMP_V2_ESCAPE		0x50
+#define OVPN_COMP_V2_NONE		0x00
+
+/**
+ * ovpn_comp_stub_frame - add the compression stub framing to a packet
+ * @skb: the plaintext packet about to be encrypted
+ * @mode: the framing of the peer (enum ovpn_comp_stub)
+ *
+ * The checksum of the packet must be complete already.
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_comp_stub_frame(struct sk_buff *skb, u8 mode)
+{
+	u8 *data;
+
+	switch (mode) {
+	case OVPN_COMP_STUB_LZO:
+		if (unlikely(skb_cow_head(skb, 1)))
+			return -ENOMEM;
+
+		data = __skb_push(skb, 1);
+		data[0] = OVPN_COMP_NO_COMPRESS;
+		return 0;
+	case OVPN_COMP_STUB_SWAP:
+		if (unlikely(!skb->len))
+			return -EINVAL;
+
+		if (unlikely(skb_linearize_cow(skb)) ||
+		    unlikely(!skb_tailroom(skb) &&
+			     pskb_expand_head(skb, 0, 1, GFP_ATOMIC)))
+			return -ENOMEM;
+
+		data = __skb_put(skb, 1);
+		data[0] = skb->data[0];
+		skb->data[0] = OVPN_COMP_NO_COMPRESS_SWAP;
+		return 0;
+	case OVPN_COMP_STUB_V2:
+		/* IP packets never start with the escape, keepalives neither */
+		if (likely(!skb_headlen(skb) ||
+			   skb->data[0] != OVPN_COMP_V2_ESCAPE))
+			return 0;
+
+		if (unlikely(skb_cow_head(skb, 2)))
+			return -ENOMEM;
+
+		data = __skb_push(skb, 2);
+		data[0] = OVPN_COMP_V2_ESCAPE;
+		data[1] = OVPN_COMP_V2_NONE;
+		return 0;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * ovpn_comp_stub_strip - remove the compression stub framing of a packet
+ * @skb: the decrypted packet, pointing to its payload
+ * @mode: the framing of the peer (enum ovpn_comp_stub)
+ *
+ * Return: 0 on success, -EPROTO if the packet is really compressed or
+ * another negative error code otherwise
+ */
+int ovpn_comp_stub_strip(struct sk_buff *skb, u8 mode)
+{
+	u8 last;
+
+	if (mode == OVPN_COMP_STUB_NONE)
+		return 0;
+
+	if (unlikely(!pskb_may_pull(skb, 1)))
+		return -EINVAL;
+
+	switch (mode) {
+	case OVPN_COMP_STUB_LZO:
+		if (unlikely(skb->data[0] != OVPN_COMP_NO_COMPRESS))
+			return -EPROTO;
+
+		__skb_pull(skb, 1);
+		return 0;
+	case OVPN_COMP_STUB_SWAP:
+		if (unlikely(skb->data[0] != OVPN_COMP_NO_COMPRESS_SWAP))
+			return -EPROTO;
+
+		/* the first byte is back in place, the tail goes away */
+		if (unlikely(skb_copy_bits(skb, skb->len - 1, &last, 1)) ||
+		    unlikely(skb_ensure_writable(skb, 1)))
+			return -ENOMEM;
+
+		skb->data[0] = last;
+		return pskb_trim(skb, skb->len - 1);
+	case OVPN_COMP_STUB_V2:
+		if (likely(skb->data[0] != OVPN_COMP_V2_ESCAPE))
+			return 0;
+
+		if (unlikely(!pskb_may_pull(skb, 2) ||
+			     skb->data[1] != OVPN_COMP_V2_NONE))
+			return -EPROTO;
+
+		__skb_pull(skb, 2);
+		return 0;
+	default:
+		return 0;
+	}
+}
@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_COMP_H_
+#define _NET_OVPN_COMP_H_
+
+#include <linux/types.h>
+
+struct sk_buff;
+
+int ovpn_comp_stub_frame(struct sk_buff *skb, u8 mode);
+int ovpn_comp_stub_strip(struct sk_buff *skb, u8 mode);
+
+#endif /* _NET_OVPN_COMP_H_ */
@@ -0,0 +1,114 @@
+// SPDX-License-Identifier: GPL-2.0
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include <linux/netdevice.h>
+
+#include "ovpnstruct.h"
+#include "cputime.h"
+#include "peer.h"
+
+/* enabled as long as at least one interface accounts for CPU time */
+DEFINE_STATIC_KEY_FALSE(ovpn_cputime_enabled);
+
+/**
+ * ovpn_cputime_record - account for the time elapsed since start
+ * @cputime: the per-CPU counters to update
+ * @encrypt: whether the time was spent encrypting rather than decrypting
+ * @start: local_clock() value the work started at
+ */
+void ovpn_cputime_record(struct ovpn_peer_cputime __percpu *cputime,
+			 bool encrypt, u64 start)
+{
+	struct ovpn_peer_cputime *ct;
+	unsigned long flags;
+	u64 ns;
+
+	ct = get_cpu_ptr(cputime);
+	/* local_clock() is only monotonic on the CPU it is read on */
+	ns = local_clock();
+	ns = ns > start ? ns - start : 0;
+	/* the TCP transport may receive from process context */
+	flags = u64_stats_update_begin_irqsave(&ct->syncp);
+	u64_stats_add(encrypt ? &ct->encrypt_ns : &ct->decrypt_ns, ns);
+	u64_stats_update_end_irqrestore(&ct->syncp, flags);
+	put_cpu_ptr(cputime);
+}
+
+/**
+ * ovpn_cputime_init - allocate the CPU time counters of a new peer
+ * @peer: the peer, whose counters are allocated only if its interface
+ *	  accounts for CPU time
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_cputime_init(struct ovpn_peer *peer)
+{
+	if (!peer->ovpn->cputime_acct)
+		return 0;
+
+	peer->cputime = netdev_alloc_pcpu_stats(struct ovpn_peer_cputime);
+	if (!peer->cputime)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/**
+ * ovpn_cputime_fetch - sum up per-CPU CPU time counters
+ * @cputime: the per-CPU counters to read
+ * @encrypt_ns: where to store the time spent encrypting
+ * @decrypt_ns: where to store the time spent decrypting
+ */
+void ovpn_cputime_fetch(const struct ovpn_peer_cputime __percpu *cputime,
+			u64 *encrypt_ns, u64 *decrypt_ns)
+{
+	const struct ovpn_peer_cputime *ct;
+	unsigned int start;
+	u64 enc, dec;
+	int cpu;
+
+	*encrypt_ns = 0;
+	*decrypt_ns = 0;
+
+	for_each_possible_cpu(cpu) {
+		ct = per_cpu_ptr(cputime, cpu);
+		do {
+			start = u64_stats_fetch_begin(&ct->syncp);
+			enc = u64_stats_read(&ct->encrypt_ns);
+			dec = u64_stats_read(&ct->decrypt_ns);
+		} while (u64_stats_fetch_retry(&ct->syncp, start));
+
+		*encrypt_ns += enc;
+		*decrypt_ns += dec;
+	}
+}
+
+/**
+ * ovpn_cputime_enable - start accounting for the CPU time of the peers of an
+ *			 interface
+ * @ovpn: the instance, which must not have any peer yet
+ */
+void ovpn_cputime_enable(struct ovpn_struct *ovpn)
+{
+	ovpn->cputime_acct = true;
+	static_branch_inc(&ovpn_cputime_enabled);
+}
+
+/**
+ * ovpn_cputime_disable - stop accounting for the CPU time of the peers of an
+ *			  interface
+ * @ovpn: the instance, which must not have any peer left
+ */
+void ovpn_cputime_disable(struct ovpn_struct *ovpn)
+{
+	if (!ovpn->cputime_acct)
+		return;
+
+	ovpn->cputime_acct = false;
+	static_branch_dec(&ovpn_cputime_enabled);
+}
@@ -0,0 +1,77 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_CPUTIME_H_
+#define _NET_OVPN_CPUTIME_H_
+
+#include <linux/jump_label.h>
+#include <linux/percpu.h>
+#include <linux/sched/clock.h>
+#include <linux/u64_stats_sync.h>
+
+#include "ovpnstruct.h"
+#include "peer.h"
+
+/* CPU time accounting measures the time spent by each peer encrypting and
+ * decrypting its packets, so that the peers costing the most CPU can be told
+ * apart from those moving the most bytes. Crypto requests completing
+ * asynchronously are accounted for the time it takes to submit them only.
+ */
+
+DECLARE_STATIC_KEY_FALSE(ovpn_cputime_enabled);
+
+/**
+ * struct ovpn_peer_cputime - per-CPU crypto time of a peer
+ * @encrypt_ns: nanoseconds spent encrypting packets sent to the peer
+ * @decrypt_ns: nanoseconds spent decrypting packets received from the peer
+ * @syncp: synchronization point for 64bit counters on 32bit architectures
+ */
+struct ovpn_peer_cputime {
+	u64_stats_t encrypt_ns;
+	u64_stats_t decrypt_ns;
+	struct u64_stats_sync syncp;
+};
+
+void ovpn_cputime_record(struct ovpn_peer_cputime __percpu *cputime,
+			 bool encrypt, u64 start);
+
+/**
+ * ovpn_cputime_start - sample the clock before some work done for a peer
+ * @peer: the peer the work is done for
+ *
+ * Return: the current time in nanoseconds or 0 if the peer does not account
+ * for its CPU time
+ */
+static inline u64 ovpn_cputime_start(const struct ovpn_peer *peer)
+{
+	if (!static_branch_unlikely(&ovpn_cputime_enabled) || !peer->cputime)
+		return 0;
+
+	return local_clock();
+}
+
+/**
+ * ovpn_cputime_end - account for some work done for a peer
+ * @peer: the peer the work was done for
+ * @encrypt: whether the work was encrypting rather than decrypting
+ * @start: the value returned by ovpn_cputime_start() before the work
+ */
+static inline void ovpn_cputime_end(struct ovpn_peer *peer, bool encrypt,
+				    u64 start)
+{
+	if (start)
+		ovpn_cputime_record(peer->cputime, encrypt, start);
+}
+
+int ovpn_cputime_init(struct ovpn_peer *peer);
+void ovpn_cputime_fetch(const struct ovpn_peer_cputime __percpu *cputime,
+			u64 *encrypt_ns, u64 *decrypt_ns);
+void ovpn_cputime_enable(struct ovpn_struct *ovpn);
+void ovpn_cputime_disable(struct ovpn_struct *ovpn);
+
+#endif /* _NET_OVPN_CPUTIME_H_ */
@@ -18,6 +18,9 @@
 #include "pktid.h"
 #include "crypto_aead.h"
 #include "crypto.h"
+#include "epoch.h"
+#include "netlink.h"
+#include "peer.h"
 
 static void ovpn_ks_destroy_rcu(struct rcu_head *head)
 {
@@ -35,12 +38,59 @@ void ovpn_crypto_key_slot_release(struct kref *kref)
 	call_rcu(&ks->rcu, ovpn_ks_destroy_rcu);
 }
 
+/* the crypto state is embedded in its peer, which accounts contention on the
+ * mutex to the interface
+ */
+static void ovpn_crypto_lock(struct ovpn_crypto_state *cs)
+{
+	struct ovpn_peer *peer = container_of(cs, struct ovpn_peer, crypto);
+
+	ovpn_mutex_lock_stat(peer->ovpn, &cs->mutex, lock_crypto_contended);
+}
+
+/* rebuild the table of the slots by key ID after primary or secondary
+ * changed. The primary wins if both slots share the same key ID, like the
+ * lookup used to do by probing the primary first, and the successor of an
+ * epoch key comes last.
+ * Must be called with cs->mutex held, before the replaced slots are put
+ */
+static void ovpn_crypto_key_id_update(struct ovpn_crypto_state *cs)
+{
+	struct ovpn_crypto_key_slot *primary, *secondary, *next, *ks;
+	unsigned int i;
+
+	primary = rcu_dereference_protected(cs->primary,
+					    lockdep_is_held(&cs->mutex));
+	secondary = rcu_dereference_protected(cs->secondary,
+					      lockdep_is_held(&cs->mutex));
+	next = rcu_dereference_protected(cs->next,
+					 lockdep_is_held(&cs->mutex));
+
+	for (i = 0; i < OVPN_KEY_ID_MAX; i++) {
+		if (primary && primary->key_id == i)
+			ks = primary;
+		else if (secondary && secondary->key_id == i)
+			ks = secondary;
+		else if (next && next->key_id == i)
+			ks = next;
+		else
+			ks = NULL;
+
+		if (rcu_access_pointer(cs->by_key_id[i]) != ks)
+			rcu_assign_pointer(cs->by_key_id[i], ks);
+	}
+}
+
 /* can only be invoked when all peer references have been dropped (i.e. RCU
  * release routine)
  */
 void ovpn_crypto_state_release(struct ovpn_crypto_state *cs)
 {
 	struct ovpn_crypto_key_slot *ks;
+	unsigned int i;
+
+	for (i = 0; i < OVPN_KEY_ID_MAX; i++)
+		RCU_INIT_POINTER(cs->by_key_id[i], NULL);
 
 	ks = rcu_access_pointer(cs->primary);
 	if (ks) {
@@ -54,52 +104,190 @@ void ovpn_crypto_state_release(struct ovpn_crypto_state *cs)
 		ovpn_crypto_key_slot_put(ks);
 	}
 
+	ks = rcu_access_pointer(cs->next);
+	if (ks) {
+		RCU_INIT_POINTER(cs->next, NULL);
+		ovpn_crypto_key_slot_put(ks);
+	}
+
 	mutex_destroy(&cs->mutex);
 }
 
+/* derive in advance the successor of an epoch primary key, so that the
+ * packets of a peer having moved on already can be decrypted.
+ * Must be called with cs->mutex held. Returns the replaced successor, to be
+ * put once the table of the slots by key ID is updated
+ */
+static struct ovpn_crypto_key_slot *
+ovpn_crypto_epoch_refresh(struct ovpn_crypto_state *cs)
+{
+	struct ovpn_crypto_key_slot *primary, *next = NULL;
+
+	primary = rcu_dereference_protected(cs->primary,
+					    lockdep_is_held(&cs->mutex));
+	if (primary && primary->epoch) {
+		next = ovpn_epoch_next(primary);
+		if (IS_ERR(next)) {
+			pr_debug("cannot derive the successor of key_id=%u: %ld\n",
+				 primary->key_id, PTR_ERR(next));
+			next = NULL;
+		}
+	}
+
+	return rcu_replace_pointer(cs->next, next,
+				   lockdep_is_held(&cs->mutex));
+}
+
+/**
+ * ovpn_crypto_epoch_advance - move on to the next epoch key
+ * @cs: the crypto state to update
+ * @leave: the epoch the primary key must be in
+ *
+ * The successor of the primary key becomes primary, the primary key is kept
+ * as secondary and the successor of the new primary key is derived. Nothing
+ * happens if the primary key has moved on from @leave already.
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_crypto_epoch_advance(struct ovpn_crypto_state *cs, u32 leave)
+{
+	struct ovpn_crypto_key_slot *primary, *secondary, *next, *new_next;
+
+	ovpn_crypto_lock(cs);
+	primary = rcu_dereference_protected(cs->primary,
+					    lockdep_is_held(&cs->mutex));
+	if (!primary || !primary->epoch || primary->epoch->n != leave) {
+		mutex_unlock(&cs->mutex);
+		return 0;
+	}
+
+	next = rcu_dereference_protected(cs->next,
+					 lockdep_is_held(&cs->mutex));
+	if (!next) {
+		next = ovpn_epoch_next(primary);
+		if (IS_ERR(next)) {
+			mutex_unlock(&cs->mutex);
+			return PTR_ERR(next);
+		}
+	}
+
+	/* a missing successor is retried once the new primary is left */
+	new_next = ovpn_epoch_next(next);
+	if (IS_ERR(new_next))
+		new_next = NULL;
+
+	secondary = rcu_replace_pointer(cs->secondary, primary,
+					lockdep_is_held(&cs->mutex));
+	rcu_assign_pointer(cs->primary, next);
+	rcu_assign_pointer(cs->next, new_next);
+	ovpn_crypto_key_id_update(cs);
+
+	pr_debug("epoch key rotated: key_id=%u -> %u\n", primary->key_id,
+		 next->key_id);
+	mutex_unlock(&cs->mutex);
+
+	if (secondary)
+		ovpn_crypto_key_slot_put(secondary);
+
+	return 0;
+}
+
 /* removes the primary key from the crypto context */
 void ovpn_crypto_kill_primary(struct ovpn_crypto_state *cs)
 {
 	struct ovpn_crypto_key_slot *ks;
 
-	mutex_lock(&cs->mutex);
+	ovpn_crypto_lock(cs);
 	ks = rcu_replace_pointer(cs->primary, NULL,
 				 lockdep_is_held(&cs->mutex));
-	ovpn_crypto_key_slot_put(ks);
+	ovpn_crypto_key_id_update(cs);
+	/* more packets of the same batch may report the exhaustion of the
+	 * same key: only the first one actually finds it still in place
+	 */
+	if (ks)
+		ovpn_crypto_key_slot_put(ks);
+	mutex_unlock(&cs->mutex);
+}
+
+/* removes all the keys from the crypto context, which can be used again */
+void ovpn_crypto_state_flush(struct ovpn_crypto_state *cs)
+{
+	struct ovpn_crypto_key_slot *primary, *secondary, *next;
+
+	ovpn_crypto_lock(cs);
+	primary = rcu_replace_pointer(cs->primary, NULL,
+				      lockdep_is_held(&cs->mutex));
+	secondary = rcu_replace_pointer(cs->secondary, NULL,
+					lockdep_is_held(&cs->mutex));
+	next = rcu_replace_pointer(cs->next, NULL,
+				   lockdep_is_held(&cs->mutex));
+	ovpn_crypto_key_id_update(cs);
 	mutex_unlock(&cs->mutex);
+
+	if (primary)
+		ovpn_crypto_key_slot_put(primary);
+	if (secondary)
+		ovpn_crypto_key_slot_put(secondary);
+	if (next)
+		ovpn_crypto_key_slot_put(next);
+}
+
+/* release the resources the key slots can rebuild on demand, while the peer
+ * is idle. Must be called under RCU read lock
+ */
+void ovpn_crypto_state_compact(struct ovpn_crypto_state *cs)
+{
+	struct ovpn_crypto_key_slot *ks;
+
+	ks = rcu_dereference(cs->primary);
+	if (ks)
+		ovpn_aead_req_cache_trim(ks);
+
+	ks = rcu_dereference(cs->secondary);
+	if (ks)
+		ovpn_aead_req_cache_trim(ks);
+
+	ks = rcu_dereference(cs->next);
+	if (ks)
+		ovpn_aead_req_cache_trim(ks);
 }
 
 /* Reset the ovpn_crypto_state object in a way that is atomic
  * to RCU readers.
  */
 int ovpn_crypto_state_reset(struct ovpn_crypto_state *cs,
-			    const struct ovpn_peer_key_reset *pkr)
+			    const struct ovpn_peer_key_reset *pkr,
+			    struct ovpn_aead_tfm_pool *pool)
 {
-	struct ovpn_crypto_key_slot *old = NULL, *new;
+	struct ovpn_crypto_key_slot *old = NULL, *old_next = NULL, *new;
 
 	if (pkr->slot != OVPN_KEY_SLOT_PRIMARY &&
 	    pkr->slot != OVPN_KEY_SLOT_SECONDARY)
 		return -EINVAL;
 
-	new = ovpn_aead_crypto_key_slot_new(&pkr->key);
+	new = ovpn_aead_crypto_key_slot_new(&pkr->key, pool);
 	if (IS_ERR(new))
 		return PTR_ERR(new);
 
-	mutex_lock(&cs->mutex);
+	ovpn_crypto_lock(cs);
 	switch (pkr->slot) {
 	case OVPN_KEY_SLOT_PRIMARY:
 		old = rcu_replace_pointer(cs->primary, new,
 					  lockdep_is_held(&cs->mutex));
+		old_next = ovpn_crypto_epoch_refresh(cs);
 		break;
 	case OVPN_KEY_SLOT_SECONDARY:
 		old = rcu_replace_pointer(cs->secondary, new,
 					  lockdep_is_held(&cs->mutex));
 		break;
 	}
+	ovpn_crypto_key_id_update(cs);
 	mutex_unlock(&cs->mutex);
 
 	if (old)
 		ovpn_crypto_key_slot_put(old);
+	if (old_next)
+		ovpn_crypto_key_slot_put(old_next);
 
 	return 0;
 }
@@ -107,7 +295,7 @@ int ovpn_crypto_state_reset(struct ovpn_crypto_state *cs,
 void ovpn_crypto_key_slot_delete(struct ovpn_crypto_state *cs,
 				 enum ovpn_key_slot slot)
 {
-	struct ovpn_crypto_key_slot *ks = NULL;
+	struct ovpn_crypto_key_slot *ks = NULL, *old_next = NULL;
 
 	if (slot != OVPN_KEY_SLOT_PRIMARY &&
 	    slot != OVPN_KEY_SLOT_SECONDARY) {
@@ -115,19 +303,24 @@ void ovpn_crypto_key_slot_delete(struct ovpn_crypto_state *cs,
 		return;
 	}
 
-	mutex_lock(&cs->mutex);
+	ovpn_crypto_lock(cs);
 	switch (slot) {
 	case OVPN_KEY_SLOT_PRIMARY:
 		ks = rcu_replace_pointer(cs->primary, NULL,
 					 lockdep_is_held(&cs->mutex));
+		old_next = ovpn_crypto_epoch_refresh(cs);
 		break;
 	case OVPN_KEY_SLOT_SECONDARY:
 		ks = rcu_replace_pointer(cs->secondary, NULL,
 					 lockdep_is_held(&cs->mutex));
 		break;
 	}
+	ovpn_crypto_key_id_update(cs);
 	mutex_unlock(&cs->mutex);
 
+	if (old_next)
+		ovpn_crypto_key_slot_put(old_next);
+
 	if (!ks) {
 		pr_debug("Key slot already released: %u\n", slot);
 		return;
@@ -144,18 +337,77 @@ void ovpn_crypto_key_slot_delete(struct ovpn_crypto_state *cs,
 void ovpn_crypto_key_slots_swap(struct ovpn_crypto_state *cs)
 {
 	const struct ovpn_crypto_key_slot *old_primary, *old_secondary;
+	struct ovpn_crypto_key_slot *old_next;
 
-	mutex_lock(&cs->mutex);
+	ovpn_crypto_lock(cs);
 
 	old_secondary = rcu_dereference_protected(cs->secondary,
 						  lockdep_is_held(&cs->mutex));
 	old_primary = rcu_replace_pointer(cs->primary, old_secondary,
 					  lockdep_is_held(&cs->mutex));
 	rcu_assign_pointer(cs->secondary, old_primary);
+	old_next = ovpn_crypto_epoch_refresh(cs);
+	ovpn_crypto_key_id_update(cs);
 
 	pr_debug("key swapped: %u <-> %u\n",
 		 old_primary ? old_primary->key_id : 0,
 		 old_secondary ? old_secondary->key_id : 0);
 
 	mutex_unlock(&cs->mutex);
+
+	if (old_next)
+		ovpn_crypto_key_slot_put(old_next);
+}
+
+/* whether a counter reached a limit, 0 meaning no limit */
+static bool ovpn_key_volume_reached(u64 count, u64 limit)
+{
+	return limit && count >= limit;
+}
+
+/* whether a counter went past a limit, 0 meaning no limit */
+static bool ovpn_key_volume_exceeded(u64 count, u64 limit)
+{
+	return limit && count > limit;
+}
+
+/**
+ * ovpn_key_volume_account - account for traffic protected by a key slot
+ * @peer: the peer owning the key slot
+ * @ks: the key slot, which must have volume_limited set
+ * @packets: number of packets encrypted or decrypted with the key
+ * @bytes: size of their payload
+ *
+ * Userspace is asked to rekey once a soft limit is crossed. Once a hard limit
+ * is crossed, the key must not protect any more traffic: userspace is told
+ * and the caller drops the packets. Each limit is reported only once.
+ *
+ * Return: 0 if the traffic may be protected with the key or -ERANGE if a
+ * hard limit was crossed
+ */
+int ovpn_key_volume_account(struct ovpn_peer *peer,
+			    struct ovpn_crypto_key_slot *ks,
+			    unsigned int packets, u64 bytes)
+{
+	struct ovpn_key_volume *v = &ks->volume;
+	u64 p = atomic64_add_return(packets, &v->packets);
+	u64 b = atomic64_add_return(bytes, &v->bytes);
+
+	if (unlikely(ovpn_key_volume_exceeded(p, v->hard_packets) ||
+		     ovpn_key_volume_exceeded(b, v->hard_bytes))) {
+		if (!test_bit(OVPN_KEY_VOLUME_HARD, &v->notified) &&
+		    !test_and_set_bit(OVPN_KEY_VOLUME_HARD, &v->notified))
+			ovpn_nl_notify_rekey(peer, ks->key_id,
+					     OVPN_REKEY_REASON_HARD_LIMIT);
+		return -ERANGE;
+	}
+
+	if (unlikely(ovpn_key_volume_reached(p, v->soft_packets) ||
+		     ovpn_key_volume_reached(b, v->soft_bytes)) &&
+	    !test_bit(OVPN_KEY_VOLUME_SOFT, &v->notified) &&
+	    !test_and_set_bit(OVPN_KEY_VOLUME_SOFT, &v->notified))
+		ovpn_nl_notify_rekey(peer, ks->key_id,
+				     OVPN_REKEY_REASON_SOFT_LIMIT);
+
+	return 0;
 }
@@ -10,6 +10,12 @@
 #ifndef _NET_OVPN_OVPNCRYPTO_H_
 #define _NET_OVPN_OVPNCRYPTO_H_
 
+#include <linux/crypto.h>
+
+#include "proto.h"
+
+struct ovpn_aead_lib_keys;
+struct ovpn_epoch;
 struct ovpn_peer;
 struct ovpn_crypto_key_slot;
 
@@ -19,6 +25,9 @@ struct ovpn_key_direction {
 	size_t cipher_key_size;
 	const u8 *nonce_tail; /* only needed for GCM modes */
 	size_t nonce_tail_size; /* only needed for GCM modes */
+	const u8 *epoch_secret; /* only set for keys rotating on their own */
+	const u8 *hmac_key; /* only needed for CBC modes */
+	size_t hmac_key_size; /* only needed for CBC modes */
 };
 
 /* all info for a particular symmetric key (primary or secondary) */
@@ -27,6 +36,18 @@ struct ovpn_key_config {
 	u8 key_id;
 	struct ovpn_key_direction encrypt;
 	struct ovpn_key_direction decrypt;
+	unsigned int replay_window;
+	unsigned int rekey_threshold;
+	/* traffic the key may protect, 0 for no limit */
+	u64 soft_bytes;
+	u64 hard_bytes;
+	u64 soft_packets;
+	u64 hard_packets;
+	bool long_pktid;
+	bool data_v1; /* DATA_V1 framing, for peers not supporting peer IDs */
+	bool compact;
+	unsigned int lib_max_len;
+	int node; /* NUMA node the key slot is allocated on */
 };
 
 /* used to pass settings from netlink to the crypto engine */
@@ -35,23 +56,105 @@ struct ovpn_peer_key_reset {
 	struct ovpn_key_config key;
 };
 
+/* amount of AEAD requests each CPU can keep ready for reuse */
+#define OVPN_AEAD_REQ_CACHE_SIZE 4
+
+/* per-CPU stack of preallocated AEAD requests owned by a key slot */
+struct ovpn_aead_req_cache {
+	void *reqs[OVPN_AEAD_REQ_CACHE_SIZE];
+	unsigned int count;
+};
+
+/* amount of idle transforms an interface keeps per cipher for reuse */
+#define OVPN_AEAD_TFM_POOL_SIZE 32
+
+/**
+ * struct ovpn_aead_tfm_pool - transforms of released keys, ready for reuse
+ * @lock: protects the stacks
+ * @algs: one stack of transforms per cipher algorithm
+ * @algs.tfms: the idle transforms
+ * @algs.count: number of transforms in @algs.tfms
+ * @algs.driver: crypto driver new transforms are allocated from (empty for
+ *		 the highest priority implementation)
+ */
+struct ovpn_aead_tfm_pool {
+	spinlock_t lock; /* protects algs */
+	struct {
+		struct crypto_aead *tfms[OVPN_AEAD_TFM_POOL_SIZE];
+		unsigned int count;
+		char driver[CRYPTO_MAX_ALG_NAME];
+	} algs[OVPN_CIPHER_ALG_CHACHA20_POLY1305 + 1];
+};
+
+/* bits of ovpn_key_volume.notified */
+#define OVPN_KEY_VOLUME_SOFT	0
+#define OVPN_KEY_VOLUME_HARD	1
+
+/**
+ * struct ovpn_key_volume - traffic protected by a key slot with limits
+ * @bytes: payload bytes encrypted and decrypted so far
+ * @packets: packets encrypted and decrypted so far
+ * @soft_bytes: bytes after which userspace is asked to rekey (0 for none)
+ * @hard_bytes: bytes after which the key is not used anymore (0 for none)
+ * @soft_packets: as @soft_bytes, in packets
+ * @hard_packets: as @hard_bytes, in packets
+ * @notified: which limits were reported to userspace already
+ */
+struct ovpn_key_volume {
+	atomic64_t bytes;
+	atomic64_t packets;
+	u64 soft_bytes;
+	u64 hard_bytes;
+	u64 soft_packets;
+	u64 hard_packets;
+	unsigned long notified;
+};
+
 struct ovpn_crypto_key_slot {
+	/* read by the datapath for every packet */
 	u8 key_id;
-
+	u8 nonce_wire_size;
+	u8 op_size;
+	bool async;
+	/* traffic is accounted in volume only if set */
+	bool volume_limited;
+	enum ovpn_cipher_alg cipher_alg;
 	struct crypto_aead *encrypt;
 	struct crypto_aead *decrypt;
+	struct ovpn_aead_lib_keys *lib;
+	unsigned int lib_max_len;
+	unsigned int req_size;
+	unsigned int req_iv_offset;
+	unsigned int req_sg_offset;
+	struct ovpn_aead_req_cache __percpu *req_cache;
 	struct ovpn_nonce_tail nonce_tail_xmit;
 	struct ovpn_nonce_tail nonce_tail_recv;
 
+	/* control path */
+	struct ovpn_aead_tfm_pool *tfm_pool;
+	struct ovpn_epoch *epoch;
+	struct ovpn_aead_req_cache __percpu *req_cache_idle;
+	struct rcu_head trim_rcu;
+	struct rcu_head rcu;
+
+	/* written by the datapath, each on its own cacheline */
+	struct kref refcount ____cacheline_aligned_in_smp;
 	struct ovpn_pktid_recv pid_recv ____cacheline_aligned_in_smp;
 	struct ovpn_pktid_xmit pid_xmit ____cacheline_aligned_in_smp;
-	struct kref refcount;
-	struct rcu_head rcu;
+	struct ovpn_key_volume volume ____cacheline_aligned_in_smp;
 };
 
 struct ovpn_crypto_state {
 	struct ovpn_crypto_key_slot __rcu *primary;
 	struct ovpn_crypto_key_slot __rcu *secondary;
+	/* successor of an epoch primary key, derived in advance */
+	struct ovpn_crypto_key_slot __rcu *next;
+
+	/* primary and secondary indexed by their key ID, for the RX path.
+	 * Entries hold no reference: they are updated together with the slots
+	 * and are only valid under RCU read lock
+	 */
+	struct ovpn_crypto_key_slot __rcu *by_key_id[OVPN_KEY_ID_MAX];
 
 	/* protects primary and secondary slots */
 	struct mutex mutex;
@@ -64,56 +167,48 @@ static inline bool ovpn_crypto_key_slot_hold(struct ovpn_crypto_key_slot *ks)
 
 static inline void ovpn_crypto_state_init(struct ovpn_crypto_state *cs)
 {
+	unsigned int i;
+
 	RCU_INIT_POINTER(cs->primary, NULL);
 	RCU_INIT_POINTER(cs->secondary, NULL);
+	RCU_INIT_POINTER(cs->next, NULL);
+	for (i = 0; i < OVPN_KEY_ID_MAX; i++)
+		RCU_INIT_POINTER(cs->by_key_id[i], NULL);
 	mutex_init(&cs->mutex);
 }
 
+/**
+ * ovpn_crypto_key_id_to_slot - find the key slot matching a key ID
+ * @cs: the crypto state to search
+ * @key_id: the key ID carried by the packet
+ *
+ * Must be called under RCU read lock. No reference is taken: the slot may
+ * be used until the read side critical section ends.
+ *
+ * Return: the matching key slot or NULL if none matches
+ */
 static inline struct ovpn_crypto_key_slot *
 ovpn_crypto_key_id_to_slot(const struct ovpn_crypto_state *cs, u8 key_id)
 {
-	struct ovpn_crypto_key_slot *ks;
-
 	if (unlikely(!cs))
 		return NULL;
 
-	rcu_read_lock();
-	ks = rcu_dereference(cs->primary);
-	if (ks && ks->key_id == key_id) {
-		if (unlikely(!ovpn_crypto_key_slot_hold(ks)))
-			ks = NULL;
-		goto out;
-	}
-
-	ks = rcu_dereference(cs->secondary);
-	if (ks && ks->key_id == key_id) {
-		if (unlikely(!ovpn_crypto_key_slot_hold(ks)))
-			ks = NULL;
-		goto out;
-	}
-
-	/* when both key slots are occupied but no matching key ID is found, ks
-	 * has to be reset to NULL to avoid carrying a stale pointer
-	 */
-	ks = NULL;
-out:
-	rcu_read_unlock();
-
-	return ks;
+	return rcu_dereference(cs->by_key_id[key_id & OVPN_KEY_ID_MASK]);
 }
 
+/**
+ * ovpn_crypto_key_slot_primary - get the primary key slot
+ * @cs: the crypto state to get the slot from
+ *
+ * Must be called under RCU read lock. No reference is taken: the slot may
+ * be used until the read side critical section ends.
+ *
+ * Return: the primary key slot or NULL if none is installed
+ */
 static inline struct ovpn_crypto_key_slot *
 ovpn_crypto_key_slot_primary(const struct ovpn_crypto_state *cs)
 {
-	struct ovpn_crypto_key_slot *ks;
-
-	rcu_read_lock();
-	ks = rcu_dereference(cs->primary);
-	if (unlikely(ks && !ovpn_crypto_key_slot_hold(ks)))
-		ks = NULL;
-	rcu_read_unlock();
-
-	return ks;
+	return rcu_dereference(cs->primary);
 }
 
 void ovpn_crypto_key_slot_release(struct kref *kref);
@@ -124,15 +219,26 @@ static inline void ovpn_crypto_key_slot_put(struct ovpn_crypto_key_slot *ks)
 }
 
 int ovpn_crypto_state_reset(struct ovpn_crypto_state *cs,
-			    const struct ovpn_peer_key_reset *pkr);
+			    const struct ovpn_peer_key_reset *pkr,
+			    struct ovpn_aead_tfm_pool *pool);
 
 void ovpn_crypto_key_slot_delete(struct ovpn_crypto_state *cs,
 				 enum ovpn_key_slot slot);
 
 void ovpn_crypto_state_release(struct ovpn_crypto_state *cs);
 
+int ovpn_key_volume_account(struct ovpn_peer *peer,
+			    struct ovpn_crypto_key_slot *ks,
+			    unsigned int packets, u64 bytes);
+
 void ovpn_crypto_key_slots_swap(struct ovpn_crypto_state *cs);
 
 void ovpn_crypto_kill_primary(struct ovpn_crypto_state *cs);
 
+void ovpn_crypto_state_flush(struct ovpn_crypto_state *cs);
+
+int ovpn_crypto_epoch_advance(struct ovpn_crypto_state *cs, u32 leave);
+
+void ovpn_crypto_state_compact(struct ovpn_crypto_state *cs);
+
 #endif /* _NET_OVPN_OVPNCRYPTO_H_ */
@@ -7,8 +7,21 @@
  *		Antonio Quartulli <antonio@openvpn.net>
  */
 
+#include <asm/unaligned.h>
 #include <crypto/aead.h>
+#include <crypto/aes.h>
+#include <crypto/algapi.h>
+#include <crypto/authenc.h>
+#include <crypto/chacha.h>
+#include <crypto/gcm.h>
+#include <crypto/poly1305.h>
+#include <crypto/sha2.h>
+#include <linux/ktime.h>
+#include <linux/random.h>
+#include <linux/rtnetlink.h>
+#include <linux/scatterlist.h>
 #include <linux/skbuff.h>
+#include <linux/slab.h>
 #include <net/ip.h>
 #include <net/ipv6.h>
 #include <net/udp.h>
@@ -16,252 +29,1797 @@
 #include "ovpnstruct.h"
 #include "main.h"
 #include "io.h"
+#include "epoch.h"
 #include "packet.h"
 #include "pktid.h"
 #include "crypto_aead.h"
 #include "crypto.h"
+#include "peer.h"
 #include "proto.h"
+#include "rxpool.h"
 #include "skb.h"
+#include "stats.h"
 
 #define AUTH_TAG_SIZE	16
 
+/* max number of scatterlist entries used by a request: AD, payload
+ * fragments and auth tag
+ */
+#define OVPN_AEAD_SG_MAX	(MAX_SKB_FRAGS + 2)
+/* scatterlist entries of the destination of an out-of-place operation: AD,
+ * payload and auth tag (encryption only)
+ */
+#define OVPN_AEAD_DST_SG	3
+
+/* fixed layout of the packets of keys using 32bit packet IDs: DATA_V2 opcode
+ * and packet ID (AD), followed by the auth tag and by the payload
+ */
+#define OVPN_AEAD_FAST_AD_SIZE		(OVPN_OP_SIZE_V2 + NONCE_WIRE_SIZE)
+#define OVPN_AEAD_FAST_HEAD_SIZE	(OVPN_AEAD_FAST_AD_SIZE + AUTH_TAG_SIZE)
+/* scatterlist entries of a fast path request: AD, payload and auth tag */
+#define OVPN_AEAD_FAST_SG		3
+
+/* layout of the packets of legacy AES-CBC + HMAC-SHA256 keys: the HMAC
+ * covers IV and ciphertext and is sent in front of them, the packet ID is
+ * encrypted along with the payload, padded to the AES block size (PKCS#7)
+ *
+ * [ OP32 ] [ HMAC ] [ IV ] [ E(packet ID, payload, padding) ]
+ */
+#define OVPN_CBC_ALG_NAME	"authenc(hmac(sha256),cbc(aes))"
+#define OVPN_CBC_HMAC_SIZE	SHA256_DIGEST_SIZE
+#define OVPN_CBC_IV_SIZE	AES_BLOCK_SIZE
+#define OVPN_CBC_HEAD_SIZE	(OVPN_OP_SIZE_V2 + OVPN_CBC_HMAC_SIZE + \
+				 OVPN_CBC_IV_SIZE)
+
+/* bytes encrypted by the ChaCha20 library before being authenticated, so
+ * that Poly1305 reads them back from L1: a multiple of the ChaCha20 block
+ */
+#define OVPN_AEAD_CHACHA_CHUNK	(8 * CHACHA_BLOCK_SIZE)
+
+/**
+ * struct ovpn_aead_lib_keys - keys of a slot using the crypto library
+ * @encrypt: the AES-GCM key used to encrypt outgoing packets
+ * @decrypt: the AES-GCM key used to decrypt incoming packets
+ * @chacha: the ChaCha20-Poly1305 keys, in the CPU order used by ChaCha20
+ * @chacha.encrypt: the key used to encrypt outgoing packets
+ * @chacha.decrypt: the key used to decrypt incoming packets
+ */
+struct ovpn_aead_lib_keys {
+	union {
+		struct {
+			struct aesgcm_ctx encrypt;
+			struct aesgcm_ctx decrypt;
+		};
+		struct {
+			u32 encrypt[CHACHA_KEY_SIZE / sizeof(u32)];
+			u32 decrypt[CHACHA_KEY_SIZE / sizeof(u32)];
+		} chacha;
+	};
+};
+
 static int ovpn_aead_encap_overhead(const struct ovpn_crypto_key_slot *ks)
 {
-	return  OVPN_OP_SIZE_V2 +			/* OP header size */
-		4 +					/* Packet ID */
-		crypto_aead_authsize(ks->encrypt);	/* Auth Tag */
+	return  ks->op_size +				/* OP header size */
+		ks->nonce_wire_size +			/* Packet ID */
+		AUTH_TAG_SIZE;				/* Auth Tag */
+}
+
+/* DATA_V2 packets authenticate their opcode and peer ID along with the
+ * packet ID, DATA_V1 packets of peers not supporting peer IDs only the
+ * packet ID: the AD starts after their one byte opcode
+ */
+static unsigned int ovpn_aead_ad_offset(const struct ovpn_crypto_key_slot *ks)
+{
+	return ks->op_size == OVPN_OP_SIZE_V1 ? OVPN_OP_SIZE_V1 : 0;
+}
+
+static unsigned int ovpn_aead_ad_size(const struct ovpn_crypto_key_slot *ks)
+{
+	return ks->op_size + ks->nonce_wire_size - ovpn_aead_ad_offset(ks);
+}
+
+/* write the opcode of the key slot at the head of a packet */
+static void ovpn_aead_op_write(const struct ovpn_crypto_key_slot *ks,
+			       u8 *data, u32 peer_id)
+{
+	if (ks->op_size == OVPN_OP_SIZE_V1) {
+		*data = (OVPN_DATA_V1 << OVPN_OPCODE_SHIFT) |
+			(ks->key_id & OVPN_KEY_ID_MASK);
+		return;
+	}
+
+	put_unaligned_be32(ovpn_opcode_compose(OVPN_DATA_V2, ks->key_id,
+					       peer_id), data);
+}
+
+/**
+ * ovpn_aead_req_get - obtain an AEAD request for the given key slot
+ * @ks: the key slot the request will be used with
+ * @ovpn: the instance accounting the cache hit or miss
+ *
+ * Requests are first taken from the per-CPU cache of the key slot. Only when
+ * the cache is empty a new request is allocated with GFP_ATOMIC.
+ *
+ * Return: the request or NULL in case of allocation failure
+ */
+static struct aead_request *ovpn_aead_req_get(struct ovpn_crypto_key_slot *ks,
+					      struct ovpn_struct *ovpn)
+{
+	struct ovpn_aead_req_cache __percpu *caches;
+	struct ovpn_aead_req_cache *cache;
+	struct aead_request *req = NULL;
+
+	local_bh_disable();
+	/* detached while the cache of an idle peer is trimmed */
+	caches = READ_ONCE(ks->req_cache);
+	cache = caches ? this_cpu_ptr(caches) : NULL;
+	if (likely(cache && cache->count)) {
+		req = cache->reqs[--cache->count];
+		ovpn_dev_stats_inc(ovpn, aead_req_cache_hit);
+	} else {
+		ovpn_dev_stats_inc(ovpn, aead_req_cache_miss);
+	}
+	local_bh_enable();
+
+	if (unlikely(!req))
+		req = kmalloc(ks->req_size, GFP_ATOMIC);
+
+	return req;
+}
+
+/* Asynchronous engines (e.g. QAT, CAAM or CCP) have a bounded queue: requests
+ * are allowed to wait in the backlog of the engine, rather than failing with
+ * -ENOSPC, so that no packet is lost while the engine is saturated. The
+ * backlog is bounded by the per-peer in-flight limit of the datapath, see
+ * ovpn_encrypt_list()
+ */
+static u32 ovpn_aead_req_flags(const struct ovpn_crypto_key_slot *ks)
+{
+	return ks->async ? CRYPTO_TFM_REQ_MAY_BACKLOG : 0;
+}
+
+/* a backlogged request completes like any other asynchronous request: the
+ * callback is first invoked with -EINPROGRESS once it reaches the engine
+ * queue, then with the final result
+ */
+static int ovpn_aead_submitted(struct ovpn_struct *ovpn, int ret)
+{
+	if (unlikely(ret == -EBUSY)) {
+		ovpn_dev_stats_inc(ovpn, aead_backlogged);
+		return -EINPROGRESS;
+	}
+
+	return ret;
+}
+
+/* the IV and the scatterlist of a request are stored in the same buffer,
+ * right after the transform context, so that they live as long as the
+ * request itself, even when crypto completes asynchronously
+ */
+static u8 *ovpn_aead_req_iv(const struct ovpn_crypto_key_slot *ks,
+			    struct aead_request *req)
+{
+	return (u8 *)req + ks->req_iv_offset;
+}
+
+static struct scatterlist *
+ovpn_aead_req_sg(const struct ovpn_crypto_key_slot *ks,
+		 struct aead_request *req)
+{
+	return (struct scatterlist *)((u8 *)req + ks->req_sg_offset);
+}
+
+/**
+ * ovpn_aead_req_put - return an AEAD request to the key slot cache
+ * @ks: the key slot the request was obtained from
+ * @req: the request to release
+ *
+ * The request is kept in the cache of the current CPU, unless the cache is
+ * already full, in which case it is freed.
+ */
+void ovpn_aead_req_put(struct ovpn_crypto_key_slot *ks,
+		       struct aead_request *req)
+{
+	struct ovpn_aead_req_cache __percpu *caches;
+	struct ovpn_aead_req_cache *cache;
+
+	/* some async engines complete requests from hard IRQ context, where
+	 * the per-CPU cache cannot be accessed safely
+	 */
+	if (unlikely(in_hardirq()))
+		goto free;
+
+	local_bh_disable();
+	caches = READ_ONCE(ks->req_cache);
+	cache = caches ? this_cpu_ptr(caches) : NULL;
+	if (likely(cache && cache->count < OVPN_AEAD_REQ_CACHE_SIZE)) {
+		cache->reqs[cache->count++] = req;
+		req = NULL;
+	}
+	local_bh_enable();
+free:
+	kfree_sensitive(req);
+}
+
+static void ovpn_aead_req_cache_trim_rcu(struct rcu_head *head)
+{
+	struct ovpn_crypto_key_slot *ks;
+	struct ovpn_aead_req_cache *cache;
+	int cpu;
+
+	ks = container_of(head, struct ovpn_crypto_key_slot, trim_rcu);
+	for_each_possible_cpu(cpu) {
+		cache = per_cpu_ptr(ks->req_cache_idle, cpu);
+		while (cache->count)
+			kfree_sensitive(cache->reqs[--cache->count]);
+	}
+
+	/* no CPU uses the cache anymore: attach it again, empty. Pairs with
+	 * READ_ONCE() in ovpn_aead_req_get() and ovpn_aead_req_put()
+	 */
+	smp_store_release(&ks->req_cache, ks->req_cache_idle);
+	ks->req_cache_idle = NULL;
+	ovpn_crypto_key_slot_put(ks);
+}
+
+/**
+ * ovpn_aead_req_cache_trim - release the AEAD requests cached by a key slot
+ * @ks: the key slot of an idle peer
+ *
+ * The requests cached by remote CPUs cannot be freed while those may access
+ * their cache. The cache is rather detached for a grace period, during which
+ * requests are allocated and freed on demand, and is then attached again
+ * empty: the first packets sent or received by the peer refill it.
+ */
+void ovpn_aead_req_cache_trim(struct ovpn_crypto_key_slot *ks)
+{
+	struct ovpn_aead_req_cache __percpu *caches;
+
+	/* keys using the library have no cache */
+	if (!READ_ONCE(ks->req_cache) || !ovpn_crypto_key_slot_hold(ks))
+		return;
+
+	/* a trim still waiting for its grace period finds no cache */
+	caches = xchg(&ks->req_cache, NULL);
+	if (!caches) {
+		ovpn_crypto_key_slot_put(ks);
+		return;
+	}
+
+	ks->req_cache_idle = caches;
+	call_rcu(&ks->trim_rcu, ovpn_aead_req_cache_trim_rcu);
+}
+
+/* release the source of an out-of-place encryption, once crypto is done */
+static void ovpn_aead_encrypt_release_src(struct sk_buff *skb)
+{
+	struct sk_buff *src = ovpn_skb_cb(skb)->skb;
+
+	if (src) {
+		ovpn_skb_cb(skb)->skb = NULL;
+		consume_skb(src);
+	}
+}
+
+static void ovpn_aead_encrypt_done(void *data, int ret)
+{
+	struct sk_buff *skb = data;
+
+	/* a backlogged request was just handed to the engine */
+	if (ret == -EINPROGRESS)
+		return;
+
+	ovpn_dev_stats_inc(ovpn_skb_cb(skb)->peer->ovpn, aead_async_done);
+
+	/* the batch this packet was submitted with lives on the stack of the
+	 * submitter and is gone by now
+	 */
+	if (!ovpn_skb_cb(skb)->parallel)
+		ovpn_skb_cb(skb)->batch = NULL;
+	ovpn_aead_encrypt_release_src(skb);
+	ovpn_encrypt_post_async(skb, ret);
+}
+
+/* A linear skb owning its data and having enough headroom for all the outer
+ * headers is encrypted in place at no extra cost. Any other skb would be
+ * linearized by skb_cow_data() or reallocated by skb_cow_head() first, which
+ * costs a full copy of the payload before encryption: in this case the
+ * payload is rather encrypted out of place into a new linear skb, already
+ * sized for the whole outer packet, so that the copy is done by the cipher
+ * itself and no byte is moved afterwards. Skbs with a frag_list are still
+ * handled in place, as the number of scatterlist entries they need is not
+ * bounded
+ */
+static bool ovpn_aead_encrypt_in_place(const struct sk_buff *skb,
+				       unsigned int headroom)
+{
+	if (skb_has_frag_list(skb))
+		return true;
+
+	return !skb_cloned(skb) && !skb_is_nonlinear(skb) &&
+	       skb_headroom(skb) >= headroom;
+}
+
+/* allocate the destination of an out-of-place encryption and make it take
+ * the place of the source skb, which is referenced by the cb until crypto
+ * is done. The destination reserves room for the ovpn header as well as for
+ * the transport and network headers pushed by the socket output path
+ */
+static struct sk_buff *ovpn_aead_encrypt_dst(struct sk_buff *src,
+					     unsigned int head_size)
+{
+	struct sk_buff *dst;
+
+	dst = alloc_skb(OVPN_HEAD_ROOM + head_size + src->len, GFP_ATOMIC);
+	if (unlikely(!dst))
+		return NULL;
+
+	skb_reserve(dst, OVPN_HEAD_ROOM + head_size);
+	skb_put(dst, src->len);
+	skb_copy_header(dst, src);
+	ovpn_skb_cb(dst)->skb = src;
+
+	return dst;
+}
+
+/**
+ * ovpn_aead_csum_deferrable - check if the checksum of a packet can be
+ *			       computed while it is encrypted
+ * @skb: the CHECKSUM_PARTIAL packet to send
+ *
+ * A cloned skb (i.e. a packet also seen by a packet socket or shared with
+ * its sender) is encrypted out of place, yet skb_checksum_help() would copy
+ * its head beforehand only to write the inner checksum. In this case the
+ * checksum is rather computed from the shared data and fed to the cipher in
+ * place of the field it belongs to, see ovpn_aead_csum_to_sgvec().
+ * Shared frags may still change and are checksummed by skb_checksum_help()
+ * after linearization, as usual.
+ *
+ * Return: true if the checksum can be left to ovpn_aead_encrypt()
+ */
+bool ovpn_aead_csum_deferrable(const struct sk_buff *skb)
+{
+	return skb_cloned(skb) && !skb_has_frag_list(skb) &&
+	       !skb_has_shared_frag(skb);
+}
+
+/* map the payload of src to sg like skb_to_sgvec_nomark(), but with the
+ * checksum field of the CHECKSUM_PARTIAL packet read from csum, where the
+ * checksum the field should carry is stored
+ */
+static int ovpn_aead_csum_to_sgvec(struct sk_buff *src, struct scatterlist *sg,
+				   __sum16 *csum)
+{
+	int start = skb_checksum_start_offset(src);
+	int off = start + src->csum_offset;
+	int n, m = 0;
+
+	if (unlikely(off + sizeof(*csum) > skb_headlen(src)))
+		return -EINVAL;
+
+	*csum = csum_fold(skb_checksum(src, start, src->len - start, 0)) ?:
+		CSUM_MANGLED_0;
+
+	n = skb_to_sgvec_nomark(src, sg, 0, off);
+	if (unlikely(n < 0))
+		return n;
+
+	sg_set_buf(sg + n, csum, sizeof(*csum));
+
+	off += sizeof(*csum);
+	if (off < src->len) {
+		m = skb_to_sgvec_nomark(src, sg + n + 1, off, src->len - off);
+		if (unlikely(m < 0))
+			return m;
+	}
+
+	return n + 1 + m;
+}
+
+static int ovpn_aead_encrypt_submit(struct ovpn_crypto_key_slot *ks,
+				    struct sk_buff **skbp, u32 peer_id,
+				    u64 pktid)
+{
+	const unsigned int tag_size = AUTH_TAG_SIZE;
+	const unsigned int head_size = ovpn_aead_encap_overhead(ks);
+	const unsigned int wire_size = ks->nonce_wire_size;
+	struct sk_buff *skb = *skbp, *src = NULL;
+	struct ovpn_struct *ovpn = ovpn_skb_cb(skb)->peer->ovpn;
+	struct scatterlist *sg, *dsg;
+	struct aead_request *req;
+	struct sk_buff *trailer;
+	int nfrags, ret;
+	u8 *iv;
+
+	/* Sample AEAD header format:
+	 * 48000001 00000005 7e7046bd 444a7e28 cc6387b1 64a4d6c1 380275a...
+	 * [ OP32 ] [seq # ] [             auth tag            ] [ payload ... ]
+	 *          [4-byte
+	 *          IV head]
+	 */
+
+	if (ovpn_aead_encrypt_in_place(skb, OVPN_HEAD_ROOM + head_size)) {
+		/* check that there's enough headroom in the skb for packet
+		 * encapsulation, after adding network header and encryption
+		 * overhead
+		 */
+		if (unlikely(skb_cow_head(skb, OVPN_HEAD_ROOM + head_size)))
+			return -ENOBUFS;
+
+		/* get number of skb frags and ensure that packet data is
+		 * writable
+		 */
+		nfrags = skb_cow_data(skb, 0, &trailer);
+		if (unlikely(nfrags < 0))
+			return nfrags;
+
+		ovpn_dev_stats_inc(ovpn, aead_encrypt_in_place);
+	} else {
+		nfrags = skb_shinfo(skb)->nr_frags + !!skb_headlen(skb);
+
+		/* splitting the head around the checksum field takes two more
+		 * entries
+		 */
+		if (skb->ip_summed == CHECKSUM_PARTIAL) {
+			if (nfrags + 4 <= OVPN_AEAD_SG_MAX) {
+				nfrags += 2;
+			} else if (unlikely(skb_checksum_help(skb))) {
+				return -EINVAL;
+			}
+		}
+
+		src = skb;
+		skb = ovpn_aead_encrypt_dst(src, head_size);
+		if (unlikely(!skb))
+			return -ENOMEM;
+
+		/* from now on the source is released by the caller */
+		*skbp = skb;
+		ovpn_dev_stats_inc(ovpn, aead_encrypt_out_of_place);
+	}
+
+	if (unlikely(nfrags + 2 > OVPN_AEAD_SG_MAX))
+		return -ENOSPC;
+
+	req = ovpn_aead_req_get(ks, ovpn);
+	if (unlikely(!req))
+		return -ENOMEM;
+
+	/* from now on the request is released by ovpn_encrypt_post() */
+	ovpn_skb_cb(skb)->req = req;
+	iv = ovpn_aead_req_iv(ks, req);
+	sg = ovpn_aead_req_sg(ks, req);
+
+	/* sg table:
+	 * 0: op, wire nonce (AD, only the wire nonce for DATA_V1),
+	 * 1, 2, 3, ..., n: payload,
+	 * n+1: auth_tag (len=tag_size)
+	 *
+	 * only the entries being used are initialized
+	 */
+	sg_init_table(sg, nfrags + 2);
+
+	/* build scatterlist to encrypt packet payload. The checksum of a
+	 * deferred packet is kept in the headroom of the destination, which
+	 * is not used before encryption is over
+	 */
+	if (src && src->ip_summed == CHECKSUM_PARTIAL) {
+		ret = ovpn_aead_csum_to_sgvec(src, sg + 1,
+					      (__sum16 *)skb->head);
+		skb->ip_summed = CHECKSUM_NONE;
+		ovpn_dev_stats_inc(ovpn, aead_csum_deferred);
+	} else {
+		ret = skb_to_sgvec_nomark(src ?: skb, sg + 1, 0, skb->len);
+	}
+	/* a head split in fewer entries than expected is fine */
+	if (unlikely(ret < 0 || ret > nfrags))
+		return -EINVAL;
+	nfrags = ret;
+
+	/* append auth_tag onto scatterlist */
+	__skb_push(skb, tag_size);
+	sg_set_buf(sg + nfrags + 1, skb->data, tag_size);
+	sg_mark_end(sg + nfrags + 1);
+
+	/* out of place, the destination table is:
+	 * 0: AD, shared with the source table
+	 * 1: payload, in the linear area of the new skb
+	 * 2: auth_tag
+	 */
+	dsg = sg;
+	if (src) {
+		dsg = sg + OVPN_AEAD_SG_MAX;
+		sg_init_table(dsg, OVPN_AEAD_DST_SG);
+		sg_set_buf(dsg + 1, skb->data + tag_size, src->len);
+		sg_set_buf(dsg + 2, skb->data, tag_size);
+	}
+
+	/* the packet ID is used both as a first 4 bytes of nonce and last 4
+	 * bytes of associated data.
+	 *
+	 * concat 4 bytes packet id and 8 bytes nonce tail into 12 bytes
+	 * nonce (or 8 bytes packet id and 4 bytes of nonce tail, for keys
+	 * using 64bit packet IDs)
+	 */
+	if (wire_size == NONCE_WIRE_SIZE_64)
+		ovpn_pktid_aead_write64(pktid, &ks->nonce_tail_xmit, iv);
+	else
+		ovpn_pktid_aead_write(pktid, &ks->nonce_tail_xmit, iv);
+
+	/* make space for packet id and push it to the front */
+	__skb_push(skb, wire_size);
+	memcpy(skb->data, iv, wire_size);
+
+	/* add packet op as head of additional data */
+	__skb_push(skb, ks->op_size);
+	ovpn_aead_op_write(ks, skb->data, peer_id);
+
+	/* AEAD Additional data */
+	sg_set_buf(sg, skb->data + ovpn_aead_ad_offset(ks),
+		   ovpn_aead_ad_size(ks));
+	if (src)
+		sg_set_buf(dsg, skb->data + ovpn_aead_ad_offset(ks),
+			   ovpn_aead_ad_size(ks));
+
+	/* setup async crypto operation */
+	aead_request_set_tfm(req, ks->encrypt);
+	aead_request_set_callback(req, ovpn_aead_req_flags(ks),
+				  ovpn_aead_encrypt_done, skb);
+	aead_request_set_crypt(req, sg, dsg, skb->len - head_size, iv);
+	aead_request_set_ad(req, ovpn_aead_ad_size(ks));
+
+	ovpn_skb_cb(skb)->ks = ks;
+
+	/* encrypt it */
+	return ovpn_aead_submitted(ovpn, crypto_aead_encrypt(req));
+}
+
+/* The fast path handles the common case of a linear skb owning its data,
+ * with enough headroom for all the outer headers, sent with a key using
+ * 32bit packet IDs: the header layout is known at compile time and the
+ * request always maps AD, payload and auth tag as three entries of the
+ * linear area, so that neither skb_cow_data() nor skb_to_sgvec() have to
+ * walk the skb
+ */
+static bool ovpn_aead_encrypt_fast_ok(const struct ovpn_crypto_key_slot *ks,
+				      const struct sk_buff *skb)
+{
+	return ks->nonce_wire_size == NONCE_WIRE_SIZE &&
+	       ks->op_size == OVPN_OP_SIZE_V2 && !skb_cloned(skb) &&
+	       !skb_is_nonlinear(skb) &&
+	       skb_headroom(skb) >= OVPN_HEAD_ROOM + OVPN_AEAD_FAST_HEAD_SIZE;
+}
+
+static __always_inline int
+ovpn_aead_encrypt_fast(struct ovpn_crypto_key_slot *ks, struct sk_buff *skb,
+		       u32 peer_id, u64 pktid)
+{
+	struct ovpn_struct *ovpn = ovpn_skb_cb(skb)->peer->ovpn;
+	const unsigned int len = skb->len;
+	struct aead_request *req;
+	struct scatterlist *sg;
+	u8 *iv;
+
+	req = ovpn_aead_req_get(ks, ovpn);
+	if (unlikely(!req))
+		return -ENOMEM;
+
+	/* from now on the request is released by ovpn_encrypt_post() */
+	ovpn_skb_cb(skb)->req = req;
+	iv = ovpn_aead_req_iv(ks, req);
+	sg = ovpn_aead_req_sg(ks, req);
+
+	ovpn_pktid_aead_write(pktid, &ks->nonce_tail_xmit, iv);
+
+	/* same layout as ovpn_aead_encrypt_submit() */
+	__skb_push(skb, OVPN_AEAD_FAST_HEAD_SIZE);
+	*((__force __be32 *)skb->data) =
+		htonl(ovpn_opcode_compose(OVPN_DATA_V2, ks->key_id, peer_id));
+	memcpy(skb->data + OVPN_OP_SIZE_V2, iv, NONCE_WIRE_SIZE);
+
+	sg_init_table(sg, OVPN_AEAD_FAST_SG);
+	sg_set_buf(sg, skb->data, OVPN_AEAD_FAST_AD_SIZE);
+	sg_set_buf(sg + 1, skb->data + OVPN_AEAD_FAST_HEAD_SIZE, len);
+	sg_set_buf(sg + 2, skb->data + OVPN_AEAD_FAST_AD_SIZE, AUTH_TAG_SIZE);
+
+	aead_request_set_tfm(req, ks->encrypt);
+	aead_request_set_callback(req, ovpn_aead_req_flags(ks),
+				  ovpn_aead_encrypt_done, skb);
+	aead_request_set_crypt(req, sg, sg, len, iv);
+	aead_request_set_ad(req, OVPN_AEAD_FAST_AD_SIZE);
+
+	ovpn_skb_cb(skb)->ks = ks;
+	ovpn_dev_stats_inc(ovpn, aead_encrypt_in_place);
+
+	return ovpn_aead_submitted(ovpn, crypto_aead_encrypt(req));
+}
+
+/* Keys owning transforms may still use the AES-GCM library for small
+ * linear packets (VoIP, DNS, ...), whose cost is dominated by the request
+ * setup and the indirect calls of the crypto API rather than by AES itself
+ */
+static bool ovpn_aead_use_lib(const struct ovpn_crypto_key_slot *ks,
+			      const struct sk_buff *skb)
+{
+	if (!ks->lib)
+		return false;
+
+	return !ks->encrypt ||
+	       (skb->len <= ks->lib_max_len && !skb_is_nonlinear(skb));
+}
+
+/* The ChaCha20-Poly1305 template makes a pass over the payload for each
+ * primitive, each walking the scatterlist. Linear packets are rather
+ * encrypted (or decrypted) and authenticated by the ChaCha20 and Poly1305
+ * libraries in one pass, chunk by chunk, using the SIMD implementations of
+ * the architecture (e.g. NEON) if any. The 96bit nonce of RFC 7539 is kept,
+ * it does not fit the 64bit one of chacha20poly1305_encrypt()
+ */
+static void ovpn_aead_chachapoly_start(const u32 *key, const u8 *nonce,
+				       u32 *state,
+				       struct poly1305_desc_ctx *poly,
+				       const u8 *ad, unsigned int ad_len)
+{
+	static const u8 pad[POLY1305_BLOCK_SIZE];
+	u8 iv[CHACHA_IV_SIZE], block0[POLY1305_KEY_SIZE] = {};
+
+	/* block 0 gives the Poly1305 key, the payload starts at block 1 */
+	put_unaligned_le32(0, iv);
+	memcpy(iv + sizeof(u32), nonce, NONCE_SIZE);
+	chacha_init(state, key, iv);
+	chacha_crypt(state, block0, block0, sizeof(block0), 20);
+	poly1305_init(poly, block0);
+	memzero_explicit(block0, sizeof(block0));
+
+	poly1305_update(poly, ad, ad_len);
+	if (ad_len % POLY1305_BLOCK_SIZE)
+		poly1305_update(poly, pad, POLY1305_BLOCK_SIZE -
+					   ad_len % POLY1305_BLOCK_SIZE);
+}
+
+static void ovpn_aead_chachapoly_finish(u32 *state,
+					struct poly1305_desc_ctx *poly,
+					unsigned int ad_len, unsigned int len,
+					u8 *tag)
+{
+	static const u8 pad[POLY1305_BLOCK_SIZE];
+	__le64 lens[2];
+
+	if (len % POLY1305_BLOCK_SIZE)
+		poly1305_update(poly, pad, POLY1305_BLOCK_SIZE -
+					   len % POLY1305_BLOCK_SIZE);
+
+	lens[0] = cpu_to_le64(ad_len);
+	lens[1] = cpu_to_le64(len);
+	poly1305_update(poly, (u8 *)lens, sizeof(lens));
+	poly1305_final(poly, tag);
+
+	memzero_explicit(state, CHACHA_STATE_WORDS * sizeof(u32));
+}
+
+static void ovpn_aead_chachapoly_encrypt(const u32 *key, const u8 *nonce,
+					 const u8 *ad, unsigned int ad_len,
+					 u8 *data, unsigned int len, u8 *tag)
+{
+	u32 state[CHACHA_STATE_WORDS];
+	struct poly1305_desc_ctx poly;
+	unsigned int off, chunk;
+
+	ovpn_aead_chachapoly_start(key, nonce, state, &poly, ad, ad_len);
+	for (off = 0; off < len; off += chunk) {
+		chunk = min_t(unsigned int, len - off, OVPN_AEAD_CHACHA_CHUNK);
+		chacha_crypt(state, data + off, data + off, chunk, 20);
+		poly1305_update(&poly, data + off, chunk);
+	}
+	ovpn_aead_chachapoly_finish(state, &poly, ad_len, len, tag);
+}
+
+static bool ovpn_aead_chachapoly_decrypt(const u32 *key, const u8 *nonce,
+					 const u8 *ad, unsigned int ad_len,
+					 u8 *data, unsigned int len,
+					 const u8 *tag)
+{
+	u8 computed[POLY1305_DIGEST_SIZE];
+	u32 state[CHACHA_STATE_WORDS];
+	struct poly1305_desc_ctx poly;
+	unsigned int off, chunk;
+	bool ok;
+
+	ovpn_aead_chachapoly_start(key, nonce, state, &poly, ad, ad_len);
+	for (off = 0; off < len; off += chunk) {
+		chunk = min_t(unsigned int, len - off, OVPN_AEAD_CHACHA_CHUNK);
+		poly1305_update(&poly, data + off, chunk);
+		chacha_crypt(state, data + off, data + off, chunk, 20);
+	}
+	ovpn_aead_chachapoly_finish(state, &poly, ad_len, len, computed);
+
+	ok = !crypto_memneq(computed, tag, sizeof(computed));
+	memzero_explicit(computed, sizeof(computed));
+
+	return ok;
+}
+
+/* encrypt a packet with the crypto library, see
+ * ovpn_aead_key_slot_init_lib()
+ */
+static int ovpn_aead_lib_encrypt(struct ovpn_crypto_key_slot *ks,
+				 struct sk_buff *skb, u32 peer_id, u64 pktid)
+{
+	const unsigned int head_size = ovpn_aead_encap_overhead(ks);
+	const unsigned int wire_size = ks->nonce_wire_size;
+	const unsigned int ad_size = ovpn_aead_ad_size(ks);
+	const unsigned int ad_offset = ovpn_aead_ad_offset(ks);
+	u8 iv[NONCE_SIZE];
+	unsigned int len;
+	u8 *ad;
+
+	/* the library only handles linear buffers */
+	if (unlikely(skb_linearize_cow(skb) ||
+		     skb_cow_head(skb, OVPN_HEAD_ROOM + head_size)))
+		return -ENOBUFS;
+
+	len = skb->len;
+	if (wire_size == NONCE_WIRE_SIZE_64)
+		ovpn_pktid_aead_write64(pktid, &ks->nonce_tail_xmit, iv);
+	else
+		ovpn_pktid_aead_write(pktid, &ks->nonce_tail_xmit, iv);
+
+	/* same layout as ovpn_aead_encrypt_submit(): op, packet ID, auth tag
+	 * and payload
+	 */
+	__skb_push(skb, head_size);
+	ovpn_aead_op_write(ks, skb->data, peer_id);
+	memcpy(skb->data + ks->op_size, iv, wire_size);
+	ad = skb->data + ad_offset;
+
+	if (ks->cipher_alg == OVPN_CIPHER_ALG_CHACHA20_POLY1305)
+		ovpn_aead_chachapoly_encrypt(ks->lib->chacha.encrypt, iv,
+					     ad, ad_size,
+					     skb->data + head_size, len,
+					     ad + ad_size);
+	else
+		aesgcm_encrypt(&ks->lib->encrypt, skb->data + head_size,
+			       skb->data + head_size, len, ad, ad_size,
+			       iv, ad + ad_size);
+	memzero_explicit(iv, sizeof(iv));
+
+	return 0;
+}
+
+/* AES-CBC + HMAC keys serve peers running older OpenVPN versions. Their
+ * transforms are synchronous and handed a single linear buffer: the HMAC is
+ * computed by authenc() at the end of the ciphertext and moved in front of
+ * the IV afterwards, and back again before decryption
+ */
+static bool ovpn_cbc_key_slot(const struct ovpn_crypto_key_slot *ks)
+{
+	return ks->cipher_alg == OVPN_CIPHER_ALG_AES_CBC_HMAC_SHA256;
+}
+
+static int ovpn_cbc_encrypt(struct ovpn_crypto_key_slot *ks,
+			    struct sk_buff *skb, u32 peer_id, u64 pktid)
+{
+	struct ovpn_struct *ovpn = ovpn_skb_cb(skb)->peer->ovpn;
+	unsigned int len, pad, tail;
+	struct aead_request *req;
+	struct scatterlist *sg;
+	u8 *iv, *p;
+	int ret;
+
+	if (unlikely(skb->ip_summed == CHECKSUM_PARTIAL &&
+		     skb_checksum_help(skb)))
+		return -EINVAL;
+
+	len = NONCE_WIRE_SIZE + skb->len;
+	pad = OVPN_CBC_IV_SIZE - len % OVPN_CBC_IV_SIZE;
+	tail = pad + OVPN_CBC_HMAC_SIZE;
+
+	if (unlikely(skb_linearize_cow(skb) ||
+		     skb_cow_head(skb, OVPN_HEAD_ROOM + OVPN_CBC_HEAD_SIZE +
+				  NONCE_WIRE_SIZE)))
+		return -ENOBUFS;
+
+	if (unlikely(skb_tailroom(skb) < tail &&
+		     pskb_expand_head(skb, 0, tail - skb_tailroom(skb),
+				      GFP_ATOMIC)))
+		return -ENOBUFS;
+
+	req = ovpn_aead_req_get(ks, ovpn);
+	if (unlikely(!req))
+		return -ENOMEM;
+
+	iv = ovpn_aead_req_iv(ks, req);
+	sg = ovpn_aead_req_sg(ks, req);
+
+	/* plaintext: packet ID, payload and padding */
+	put_unaligned_be32(pktid, __skb_push(skb, NONCE_WIRE_SIZE));
+	memset(__skb_put(skb, pad), pad, pad);
+	len = skb->len;
+
+	/* the IV is random and authenticated as AD */
+	p = __skb_push(skb, OVPN_CBC_IV_SIZE);
+	get_random_bytes(p, OVPN_CBC_IV_SIZE);
+	memcpy(iv, p, OVPN_CBC_IV_SIZE);
+
+	/* room for the HMAC, written after the ciphertext */
+	__skb_put(skb, OVPN_CBC_HMAC_SIZE);
+	sg_init_one(sg, skb->data, skb->len);
+
+	aead_request_set_tfm(req, ks->encrypt);
+	aead_request_set_callback(req, 0, NULL, NULL);
+	aead_request_set_crypt(req, sg, sg, len, iv);
+	aead_request_set_ad(req, OVPN_CBC_IV_SIZE);
+
+	ret = crypto_aead_encrypt(req);
+	ovpn_aead_req_put(ks, req);
+	if (unlikely(ret < 0))
+		return ret;
+
+	p = __skb_push(skb, OVPN_CBC_HMAC_SIZE);
+	memcpy(p, skb_tail_pointer(skb) - OVPN_CBC_HMAC_SIZE,
+	       OVPN_CBC_HMAC_SIZE);
+	__skb_trim(skb, skb->len - OVPN_CBC_HMAC_SIZE);
+
+	ovpn_aead_op_write(ks, __skb_push(skb, ks->op_size), peer_id);
+	ovpn_skb_cb(skb)->ks = ks;
+
+	return 0;
+}
+
+static int ovpn_cbc_decrypt(struct ovpn_crypto_key_slot *ks,
+			    struct sk_buff *skb)
+{
+	struct ovpn_struct *ovpn = ovpn_skb_cb(skb)->peer->ovpn;
+	struct aead_request *req;
+	struct scatterlist *sg;
+	unsigned int len;
+	int ret;
+	u8 pad;
+
+	const unsigned int head_size = ks->op_size + OVPN_CBC_HMAC_SIZE +
+				       OVPN_CBC_IV_SIZE;
+
+	if (unlikely(skb->len < head_size + OVPN_CBC_IV_SIZE ||
+		     (skb->len - head_size) % OVPN_CBC_IV_SIZE))
+		return -EINVAL;
+
+	if (unlikely(skb_linearize_cow(skb)))
+		return -ENOMEM;
+
+	if (unlikely(skb_tailroom(skb) < OVPN_CBC_HMAC_SIZE &&
+		     pskb_expand_head(skb, 0,
+				      OVPN_CBC_HMAC_SIZE - skb_tailroom(skb),
+				      GFP_ATOMIC)))
+		return -ENOMEM;
+
+	req = ovpn_aead_req_get(ks, ovpn);
+	if (unlikely(!req))
+		return -ENOMEM;
+
+	/* authenc() expects the HMAC after the ciphertext */
+	len = skb->len - head_size;
+	skb_put_data(skb, skb->data + ks->op_size, OVPN_CBC_HMAC_SIZE);
+
+	sg = ovpn_aead_req_sg(ks, req);
+	sg_init_one(sg, skb->data + ks->op_size + OVPN_CBC_HMAC_SIZE,
+		    OVPN_CBC_IV_SIZE + len + OVPN_CBC_HMAC_SIZE);
+	memcpy(ovpn_aead_req_iv(ks, req),
+	       skb->data + ks->op_size + OVPN_CBC_HMAC_SIZE,
+	       OVPN_CBC_IV_SIZE);
+
+	aead_request_set_tfm(req, ks->decrypt);
+	aead_request_set_callback(req, 0, NULL, NULL);
+	aead_request_set_crypt(req, sg, sg, len + OVPN_CBC_HMAC_SIZE,
+			       ovpn_aead_req_iv(ks, req));
+	aead_request_set_ad(req, OVPN_CBC_IV_SIZE);
+
+	ret = crypto_aead_decrypt(req);
+	ovpn_aead_req_put(ks, req);
+	__skb_trim(skb, skb->len - OVPN_CBC_HMAC_SIZE);
+	if (unlikely(ret < 0))
+		return ret;
+
+	/* the padding is authenticated already */
+	pad = skb->data[skb->len - 1];
+	if (unlikely(!pad || pad > OVPN_CBC_IV_SIZE ||
+		     len - pad < NONCE_WIRE_SIZE))
+		return -EBADMSG;
+	__skb_trim(skb, skb->len - pad);
+
+	/* the datapath finds the packet ID right after the opcode */
+	memmove(skb->data + head_size - ks->op_size, skb->data, ks->op_size);
+	__skb_pull(skb, head_size - ks->op_size);
+
+	ovpn_skb_cb(skb)->payload_offset = ks->op_size + NONCE_WIRE_SIZE;
+	ovpn_skb_cb(skb)->ks = ks;
+
+	return 0;
+}
+
+/**
+ * ovpn_aead_encrypt - encrypt a packet and prepend the DATA_V2 header
+ * @ks: the key slot to encrypt with
+ * @skbp: the packet to encrypt. On return it points to the packet carrying
+ *	  the encrypted data, that may be a new skb
+ * @peer_id: the ID of the peer the packet is sent to
+ * @pktid: the packet ID reserved for the packet (see ovpn_pktid_xmit_reserve())
+ *
+ * Return: 0 on success, -EINPROGRESS if encryption will complete
+ * asynchronously or a negative error code otherwise
+ */
+int ovpn_aead_encrypt(struct ovpn_crypto_key_slot *ks, struct sk_buff **skbp,
+		      u32 peer_id, u64 pktid)
+{
+	int ret;
+
+	if (ovpn_cbc_key_slot(ks))
+		return ovpn_cbc_encrypt(ks, *skbp, peer_id, pktid);
+
+	/* only out-of-place requests compute deferred checksums */
+	if (unlikely((*skbp)->ip_summed == CHECKSUM_PARTIAL) &&
+	    (ovpn_aead_use_lib(ks, *skbp) ||
+	     ovpn_aead_encrypt_in_place(*skbp, OVPN_HEAD_ROOM +
+				       ovpn_aead_encap_overhead(ks))) &&
+	    skb_checksum_help(*skbp))
+		return -EINVAL;
+
+	if (ovpn_aead_use_lib(ks, *skbp))
+		return ovpn_aead_lib_encrypt(ks, *skbp, peer_id, pktid);
+
+	if (ovpn_aead_encrypt_fast_ok(ks, *skbp))
+		return ovpn_aead_encrypt_fast(ks, *skbp, peer_id, pktid);
+
+	ret = ovpn_aead_encrypt_submit(ks, skbp, peer_id, pktid);
+
+	/* the completion callback may already be running */
+	if (ret != -EINPROGRESS)
+		ovpn_aead_encrypt_release_src(*skbp);
+
+	return ret;
+}
+
+static void ovpn_aead_decrypt_done(void *data, int ret)
+{
+	struct sk_buff *skb = data;
+
+	if (ret != -EINPROGRESS)
+		ovpn_dev_stats_inc(ovpn_skb_cb(skb)->peer->ovpn,
+				   aead_async_done);
+	ovpn_decrypt_post(skb, ret);
+}
+
+/* As for encryption, a linear skb owning its data is decrypted in place. Any
+ * other skb (typically a clone handed over by the UDP socket) is decrypted
+ * out of place into a linear skb taken from the RX page pool, if it fits one
+ * page, rather than being copied by skb_cow_data() first
+ */
+static bool ovpn_aead_decrypt_in_place(const struct sk_buff *skb)
+{
+	return (!skb_cloned(skb) && !skb_is_nonlinear(skb)) ||
+	       skb_has_frag_list(skb);
+}
+
+/* allocate the destination of an out-of-place decryption and copy the packet
+ * header into it (the payload is written by the cipher). The source skb is
+ * referenced by the cb until its outer headers have been processed by
+ * ovpn_decrypt_post()
+ */
+static struct sk_buff *ovpn_aead_decrypt_dst(struct sk_buff *src,
+					     unsigned int payload_offset)
+{
+	struct ovpn_struct *ovpn = ovpn_skb_cb(src)->peer->ovpn;
+	struct sk_buff *dst;
+
+	dst = ovpn_rx_pool_alloc_skb(ovpn, src->len);
+	if (unlikely(!dst))
+		return NULL;
+
+	/* the header may sit in a page fragment of src, see
+	 * ovpn_aead_payload_nfrags(). src holds at least payload_offset bytes
+	 */
+	skb_copy_bits(src, 0, __skb_put(dst, payload_offset), payload_offset);
+	__skb_put(dst, src->len - payload_offset);
+	skb_copy_header(dst, src);
+	/* header offsets copied from src point outside of the new buffer */
+	skb_reset_mac_header(dst);
+	skb_reset_network_header(dst);
+	skb_reset_transport_header(dst);
+	ovpn_skb_cb(dst)->skb = src;
+
+	return dst;
+}
+
+/* number of scatterlist entries mapping the data of skb from offset on.
+ * Packets of NICs splitting headers from payload may carry the ovpn header
+ * in the same page fragment as the start of the payload, or in fragments of
+ * its own, instead of the linear area
+ */
+static int ovpn_aead_payload_nfrags(const struct sk_buff *skb,
+				    unsigned int offset)
+{
+	const struct skb_shared_info *shinfo = skb_shinfo(skb);
+	unsigned int end = skb_headlen(skb);
+	int i, nfrags = end > offset;
+
+	for (i = 0; i < shinfo->nr_frags; i++) {
+		end += skb_frag_size(&shinfo->frags[i]);
+		nfrags += end > offset;
+	}
+
+	return nfrags;
+}
+
+/* as on TX, a linear skb owning its data and received with a key using
+ * 32bit packet IDs is decrypted in place with a fixed three entries
+ * scatterlist. Empty payloads are left to the generic path
+ */
+static bool ovpn_aead_decrypt_fast_ok(const struct ovpn_crypto_key_slot *ks,
+				      const struct sk_buff *skb)
+{
+	return ks->nonce_wire_size == NONCE_WIRE_SIZE &&
+	       ks->op_size == OVPN_OP_SIZE_V2 && !skb_cloned(skb) &&
+	       !skb_is_nonlinear(skb) && skb->len > OVPN_AEAD_FAST_HEAD_SIZE;
+}
+
+static __always_inline int
+ovpn_aead_decrypt_fast(struct ovpn_crypto_key_slot *ks, struct sk_buff *skb)
+{
+	const unsigned int payload_len = skb->len - OVPN_AEAD_FAST_HEAD_SIZE;
+	struct ovpn_struct *ovpn = ovpn_skb_cb(skb)->peer->ovpn;
+	struct aead_request *req;
+	struct scatterlist *sg;
+	u8 *iv;
+
+	req = ovpn_aead_req_get(ks, ovpn);
+	if (unlikely(!req))
+		return -ENOMEM;
+
+	/* from now on the request is released by ovpn_decrypt_post() */
+	ovpn_skb_cb(skb)->req = req;
+	iv = ovpn_aead_req_iv(ks, req);
+	sg = ovpn_aead_req_sg(ks, req);
+
+	sg_init_table(sg, OVPN_AEAD_FAST_SG);
+	sg_set_buf(sg, skb->data, OVPN_AEAD_FAST_AD_SIZE);
+	sg_set_buf(sg + 1, skb->data + OVPN_AEAD_FAST_HEAD_SIZE, payload_len);
+	sg_set_buf(sg + 2, skb->data + OVPN_AEAD_FAST_AD_SIZE, AUTH_TAG_SIZE);
+
+	memcpy(iv, skb->data + OVPN_OP_SIZE_V2, NONCE_WIRE_SIZE);
+	memcpy(iv + NONCE_WIRE_SIZE, ks->nonce_tail_recv.u8,
+	       NONCE_SIZE - NONCE_WIRE_SIZE);
+
+	aead_request_set_tfm(req, ks->decrypt);
+	aead_request_set_callback(req, ovpn_aead_req_flags(ks),
+				  ovpn_aead_decrypt_done, skb);
+	aead_request_set_crypt(req, sg, sg, payload_len + AUTH_TAG_SIZE, iv);
+	aead_request_set_ad(req, OVPN_AEAD_FAST_AD_SIZE);
+
+	ovpn_skb_cb(skb)->payload_offset = OVPN_AEAD_FAST_HEAD_SIZE;
+	ovpn_skb_cb(skb)->ks = ks;
+	ovpn_dev_stats_inc(ovpn, aead_decrypt_in_place);
+
+	return ovpn_aead_submitted(ovpn, crypto_aead_decrypt(req));
+}
+
+/* decrypt a packet with the crypto library, see
+ * ovpn_aead_key_slot_init_lib()
+ */
+static int ovpn_aead_lib_decrypt(struct ovpn_crypto_key_slot *ks,
+				 struct sk_buff *skb)
+{
+	const unsigned int wire_size = ks->nonce_wire_size;
+	const unsigned int ad_size = ovpn_aead_ad_size(ks);
+	const unsigned int payload_offset = ovpn_aead_encap_overhead(ks);
+	u8 iv[NONCE_SIZE], *ad;
+	bool ok;
+
+	if (unlikely(skb->len < payload_offset))
+		return -EINVAL;
+
+	/* the library only handles linear buffers */
+	if (unlikely(skb_linearize_cow(skb)))
+		return -ENOMEM;
+
+	memcpy(iv, skb->data + ks->op_size, wire_size);
+	memcpy(iv + wire_size, ks->nonce_tail_recv.u8, NONCE_SIZE - wire_size);
+	ad = skb->data + ovpn_aead_ad_offset(ks);
+
+	if (ks->cipher_alg == OVPN_CIPHER_ALG_CHACHA20_POLY1305)
+		ok = ovpn_aead_chachapoly_decrypt(ks->lib->chacha.decrypt, iv,
+						  ad, ad_size,
+						  skb->data + payload_offset,
+						  skb->len - payload_offset,
+						  ad + ad_size);
+	else
+		ok = aesgcm_decrypt(&ks->lib->decrypt,
+				    skb->data + payload_offset,
+				    skb->data + payload_offset,
+				    skb->len - payload_offset, ad,
+				    ad_size, iv, ad + ad_size);
+	memzero_explicit(iv, sizeof(iv));
+	if (unlikely(!ok))
+		return -EBADMSG;
+
+	ovpn_skb_cb(skb)->payload_offset = payload_offset;
+	ovpn_skb_cb(skb)->ks = ks;
+
+	return 0;
+}
+
+/**
+ * ovpn_aead_decrypt - decrypt a DATA_V2 packet
+ * @ks: the key slot to decrypt with
+ * @skbp: the packet to decrypt. On return it points to the packet carrying
+ *	  the decrypted data, that may be a new skb
+ *
+ * Return: 0 on success, -EINPROGRESS if decryption will complete
+ * asynchronously or a negative error code otherwise
+ */
+int ovpn_aead_decrypt(struct ovpn_crypto_key_slot *ks, struct sk_buff **skbp)
+{
+	const unsigned int tag_size = AUTH_TAG_SIZE;
+	const unsigned int wire_size = ks->nonce_wire_size;
+	struct sk_buff *skb = *skbp, *src = NULL, *dst = NULL;
+	struct ovpn_struct *ovpn = ovpn_skb_cb(skb)->peer->ovpn;
+	int ret, payload_len, nfrags;
+	struct scatterlist *sg, *dsg;
+	unsigned int payload_offset;
+	struct aead_request *req;
+	u8 *sg_data, *iv;
+	struct sk_buff *trailer;
+	unsigned int sg_len;
+
+	if (ovpn_cbc_key_slot(ks))
+		return ovpn_cbc_decrypt(ks, skb);
+
+	if (ovpn_aead_use_lib(ks, skb))
+		return ovpn_aead_lib_decrypt(ks, skb);
+
+	if (ovpn_aead_decrypt_fast_ok(ks, skb))
+		return ovpn_aead_decrypt_fast(ks, skb);
+
+	payload_offset = ks->op_size + wire_size + tag_size;
+	payload_len = skb->len - payload_offset;
+
+	/* sanity check on packet size, payload size must be >= 0 */
+	if (unlikely(payload_len < 0))
+		return -EINVAL;
+
+	if (!ovpn_aead_decrypt_in_place(skb))
+		dst = ovpn_aead_decrypt_dst(skb, payload_offset);
+
+	if (dst) {
+		/* The header was copied into the destination, whose copy is
+		 * mapped as AD and auth tag: the source is not pulled, its
+		 * fragments are only read by the cipher. Only the fragments
+		 * holding payload are mapped
+		 */
+		nfrags = ovpn_aead_payload_nfrags(skb, payload_offset);
+
+		src = skb;
+		skb = dst;
+		/* from now on the source is released by ovpn_decrypt_post() */
+		*skbp = skb;
+		ovpn_dev_stats_inc(ovpn, aead_decrypt_out_of_place);
+	} else {
+		/* Prepare the skb data buffer to be accessed up until the auth
+		 * tag. This is required because this area is directly mapped
+		 * into the sg list.
+		 */
+		if (unlikely(!pskb_may_pull(skb, payload_offset)))
+			return -ENODATA;
+
+		/* get number of skb frags and ensure that packet data is
+		 * writable
+		 */
+		nfrags = skb_cow_data(skb, 0, &trailer);
+		if (unlikely(nfrags < 0))
+			return nfrags;
+
+		ovpn_dev_stats_inc(ovpn, aead_decrypt_in_place);
+	}
+
+	if (unlikely(nfrags + 2 > OVPN_AEAD_SG_MAX))
+		return -ENOSPC;
+
+	req = ovpn_aead_req_get(ks, ovpn);
+	if (unlikely(!req))
+		return -ENOMEM;
+
+	/* from now on the request is released by ovpn_decrypt_post() */
+	ovpn_skb_cb(skb)->req = req;
+	iv = ovpn_aead_req_iv(ks, req);
+	sg = ovpn_aead_req_sg(ks, req);
+
+	/* sg table:
+	 * 0: op, wire nonce (AD, only the wire nonce for DATA_V1),
+	 * 1, 2, 3, ..., n: payload,
+	 * n+1: auth_tag (len=tag_size)
+	 *
+	 * only the entries being used are initialized
+	 */
+	sg_init_table(sg, nfrags + 2);
+
+	/* packet op is head of additional data, for DATA_V2 */
+	sg_data = skb->data + ovpn_aead_ad_offset(ks);
+	sg_len = ovpn_aead_ad_size(ks);
+	sg_set_buf(sg, sg_data, sg_len);
+
+	/* build scatterlist to decrypt packet payload */
+	ret = skb_to_sgvec_nomark(src ?: skb, sg + 1, payload_offset,
+				  payload_len);
+	if (unlikely(nfrags != ret))
+		return -EINVAL;
+
+	/* append auth_tag onto scatterlist */
+	sg_set_buf(sg + nfrags + 1, sg_data + sg_len, tag_size);
+
+	/* out of place, the destination table is:
+	 * 0: AD, the same copy in the new skb as in the source table
+	 * 1: payload, in the linear area of the new skb
+	 */
+	dsg = sg;
+	if (src) {
+		dsg = sg + OVPN_AEAD_SG_MAX;
+		sg_init_table(dsg, 2);
+		sg_set_buf(dsg, sg_data, sg_len);
+		sg_set_buf(dsg + 1, skb->data + payload_offset, payload_len);
+	}
+
+	/* copy nonce into IV buffer, found at the end of the AD */
+	memcpy(iv, sg_data + sg_len - wire_size, wire_size);
+	memcpy(iv + wire_size, ks->nonce_tail_recv.u8, NONCE_SIZE - wire_size);
+
+	/* setup async crypto operation */
+	aead_request_set_tfm(req, ks->decrypt);
+	aead_request_set_callback(req, ovpn_aead_req_flags(ks),
+				  ovpn_aead_decrypt_done, skb);
+	aead_request_set_crypt(req, sg, dsg, payload_len + tag_size, iv);
+
+	aead_request_set_ad(req, sg_len);
+
+	ovpn_skb_cb(skb)->payload_offset = payload_offset;
+	ovpn_skb_cb(skb)->ks = ks;
+
+	/* decrypt it */
+	return ovpn_aead_submitted(ovpn, crypto_aead_decrypt(req));
+}
+
+/* Initialize a struct crypto_aead object */
+struct crypto_aead *ovpn_aead_init(const char *title, const char *alg_name,
+				   const unsigned char *key,
+				   unsigned int keylen)
+{
+	struct crypto_aead *aead;
+	int ret;
+
+	aead = crypto_alloc_aead(alg_name, 0, 0);
+	if (IS_ERR(aead)) {
+		ret = PTR_ERR(aead);
+		pr_err("%s crypto_alloc_aead failed, err=%d\n", title, ret);
+		aead = NULL;
+		goto error;
+	}
+
+	ret = crypto_aead_setkey(aead, key, keylen);
+	if (ret) {
+		pr_err("%s crypto_aead_setkey size=%u failed, err=%d\n", title,
+		       keylen, ret);
+		goto error;
+	}
+
+	ret = crypto_aead_setauthsize(aead, AUTH_TAG_SIZE);
+	if (ret) {
+		pr_err("%s crypto_aead_setauthsize failed, err=%d\n", title,
+		       ret);
+		goto error;
+	}
+
+	/* basic AEAD assumption */
+	if (crypto_aead_ivsize(aead) != NONCE_SIZE) {
+		pr_err("%s IV size must be %d\n", title, NONCE_SIZE);
+		ret = -EINVAL;
+		goto error;
+	}
+
+	pr_debug("********* Cipher %s (%s)\n", alg_name, title);
+	pr_debug("*** IV size=%u\n", crypto_aead_ivsize(aead));
+	pr_debug("*** req size=%u\n", crypto_aead_reqsize(aead));
+	pr_debug("*** block size=%u\n", crypto_aead_blocksize(aead));
+	pr_debug("*** auth size=%u\n", crypto_aead_authsize(aead));
+	pr_debug("*** alignmask=0x%x\n", crypto_aead_alignmask(aead));
+
+	return aead;
+
+error:
+	crypto_free_aead(aead);
+	return ERR_PTR(ret);
+}
+
+static void ovpn_aead_req_cache_destroy(struct ovpn_crypto_key_slot *ks)
+{
+	struct ovpn_aead_req_cache *cache;
+	int cpu;
+
+	if (!ks->req_cache)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		cache = per_cpu_ptr(ks->req_cache, cpu);
+		while (cache->count)
+			kfree_sensitive(cache->reqs[--cache->count]);
+	}
+
+	free_percpu(ks->req_cache);
+}
+
+/* Allocating a transform means looking the algorithm up by name and
+ * allocating and initializing its context. Transforms of released keys are
+ * therefore kept by the interface and re-keyed by the next keys using the
+ * same cipher, so that key rotation only pays for crypto_aead_setkey().
+ *
+ * An idle transform still holds the schedule of its previous key until it
+ * is re-keyed or freed (and wiped) along with the pool.
+ */
+
+/**
+ * ovpn_aead_tfm_pool_alloc - allocate an empty transform pool
+ *
+ * Return: the new pool or NULL on allocation failure
+ */
+struct ovpn_aead_tfm_pool *ovpn_aead_tfm_pool_alloc(void)
+{
+	struct ovpn_aead_tfm_pool *pool;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	spin_lock_init(&pool->lock);
+
+	return pool;
+}
+
+/**
+ * ovpn_aead_tfm_pool_free - free a transform pool and all its transforms
+ * @pool: the pool to free (may be NULL)
+ *
+ * All key slots using the pool must have been destroyed already.
+ */
+void ovpn_aead_tfm_pool_free(struct ovpn_aead_tfm_pool *pool)
+{
+	unsigned int i, j;
+
+	if (!pool)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(pool->algs); i++)
+		for (j = 0; j < pool->algs[i].count; j++)
+			crypto_free_aead(pool->algs[i].tfms[j]);
+
+	kfree(pool);
+}
+
+/* generic name of the algorithm implementing a cipher */
+static const char *ovpn_aead_alg_name(enum ovpn_cipher_alg alg)
+{
+	switch (alg) {
+	case OVPN_CIPHER_ALG_AES_GCM:
+		return "gcm(aes)";
+	case OVPN_CIPHER_ALG_CHACHA20_POLY1305:
+		return "rfc7539(chacha20,poly1305)";
+	default:
+		return NULL;
+	}
 }
 
-static void ovpn_aead_encrypt_done(void *data, int ret)
+/**
+ * ovpn_aead_tfm_pool_set_driver - pin the implementation used for a cipher
+ * @pool: the pool of the interface, not in use by any key yet
+ * @alg: the cipher
+ * @driver: name of the crypto driver implementing alg (e.g. "gcm-aesni")
+ *
+ * The driver is checked by allocating a first transform, which is kept in
+ * the pool for the first key using alg.
+ *
+ * Return: 0 on success, -EINVAL if driver does not implement alg or another
+ * negative error code otherwise
+ */
+int ovpn_aead_tfm_pool_set_driver(struct ovpn_aead_tfm_pool *pool,
+				  enum ovpn_cipher_alg alg, const char *driver)
 {
-	struct sk_buff *skb = data;
+	const char *alg_name = ovpn_aead_alg_name(alg);
+	struct crypto_aead *aead;
+	int ret;
+
+	if (!alg_name)
+		return -EOPNOTSUPP;
+
+	if (strscpy(pool->algs[alg].driver, driver,
+		    sizeof(pool->algs[alg].driver)) < 0)
+		return -ENAMETOOLONG;
+
+	aead = crypto_alloc_aead(driver, 0, 0);
+	if (IS_ERR(aead)) {
+		ret = PTR_ERR(aead);
+		goto err;
+	}
+
+	if (strcmp(crypto_tfm_alg_name(crypto_aead_tfm(aead)), alg_name) ||
+	    crypto_aead_ivsize(aead) != NONCE_SIZE) {
+		pr_err("crypto driver %s does not implement %s\n", driver,
+		       alg_name);
+		ret = -EINVAL;
+		goto err_free;
+	}
 
-	aead_request_free(ovpn_skb_cb(skb)->req);
-	ovpn_encrypt_post(skb, ret);
+	ret = crypto_aead_setauthsize(aead, AUTH_TAG_SIZE);
+	if (ret)
+		goto err_free;
+
+	pool->algs[alg].tfms[pool->algs[alg].count++] = aead;
+
+	return 0;
+
+err_free:
+	crypto_free_aead(aead);
+err:
+	pool->algs[alg].driver[0] = '\0';
+	return ret;
 }
 
-int ovpn_aead_encrypt(struct ovpn_crypto_key_slot *ks, struct sk_buff *skb,
-		      u32 peer_id)
-{
-	const unsigned int tag_size = crypto_aead_authsize(ks->encrypt);
-	const unsigned int head_size = ovpn_aead_encap_overhead(ks);
-	struct scatterlist sg[MAX_SKB_FRAGS + 2];
-	DECLARE_CRYPTO_WAIT(wait);
-	struct aead_request *req;
-	struct sk_buff *trailer;
-	u8 iv[NONCE_SIZE];
-	int nfrags, ret;
-	u32 pktid, op;
+/* The implementation the crypto API ranks highest for a cipher is not
+ * always the fastest at the packet sizes of a tunnel: on some CPUs the AVX2
+ * variant of AES-GCM beats the AVX-512 one on 1400 bytes packets, because of
+ * frequency effects. When the module is loaded, the implementations
+ * available for each cipher are therefore timed on full-sized packets and
+ * the fastest one is used by the keys of interfaces that did not pin a
+ * driver. The driver of every key is reported by OVPN_CMD_GET_PEER.
+ *
+ * The crypto API cannot enumerate the implementations of an algorithm:
+ * the candidates are the known drivers, along with the default one.
+ */
 
-	/* Sample AEAD header format:
-	 * 48000001 00000005 7e7046bd 444a7e28 cc6387b1 64a4d6c1 380275a...
-	 * [ OP32 ] [seq # ] [             auth tag            ] [ payload ... ]
-	 *          [4-byte
-	 *          IV head]
-	 */
+/* payload size implementations are compared at: a full-sized packet
+ * tunneled over a path with a 1500 bytes MTU
+ */
+#define OVPN_AEAD_SELECT_SIZE	1420
+#define OVPN_AEAD_SELECT_WARMUP	32
+#define OVPN_AEAD_SELECT_ITERS	256
+#define OVPN_AEAD_SELECT_KEYLEN	32
 
-	/* check that there's enough headroom in the skb for packet
-	 * encapsulation, after adding network header and encryption overhead
-	 */
-	if (unlikely(skb_cow_head(skb, OVPN_HEAD_ROOM + head_size)))
-		return -ENOBUFS;
+static const char * const ovpn_aead_candidates_aes_gcm[] = {
+	"gcm(aes)",
+	"generic-gcm-vaes-avx10_512",
+	"generic-gcm-vaes-avx10_256",
+	"generic-gcm-aesni-avx",
+	"generic-gcm-aesni",
+	"gcm-aes-ce",
+	NULL,
+};
 
-	/* get number of skb frags and ensure that packet data is writable */
-	nfrags = skb_cow_data(skb, 0, &trailer);
-	if (unlikely(nfrags < 0))
-		return nfrags;
+static const char * const ovpn_aead_candidates_chachapoly[] = {
+	"rfc7539(chacha20,poly1305)",
+	"rfc7539(chacha20-simd,poly1305-simd)",
+	"rfc7539(chacha20-neon,poly1305-neon)",
+	NULL,
+};
 
-	if (unlikely(nfrags + 2 > ARRAY_SIZE(sg)))
-		return -ENOSPC;
+/* fastest driver of each cipher, empty to leave the choice to the crypto
+ * API. Written only while the module is loaded
+ */
+static char ovpn_aead_best[OVPN_CIPHER_ALG_CHACHA20_POLY1305 + 1]
+			  [CRYPTO_MAX_ALG_NAME];
 
-	/* sg table:
-	 * 0: op, wire nonce (AD, len=OVPN_OP_SIZE_V2+NONCE_WIRE_SIZE),
-	 * 1, 2, 3, ..., n: payload,
-	 * n+1: auth_tag (len=tag_size)
-	 */
-	sg_init_table(sg, nfrags + 2);
+/* time the encryption of packets with the implementation driver of alg.
+ * Return the time in ns, or a negative error code
+ */
+static s64 ovpn_aead_select_time(const char *driver, const char *alg_name,
+				 u8 *buf, char *driver_name)
+{
+	unsigned int len = OVPN_AEAD_FAST_AD_SIZE + OVPN_AEAD_SELECT_SIZE +
+			   AUTH_TAG_SIZE;
+	u8 key[OVPN_AEAD_SELECT_KEYLEN], iv[NONCE_SIZE];
+	struct aead_request *req = NULL;
+	struct crypto_aead *aead;
+	DECLARE_CRYPTO_WAIT(wait);
+	struct scatterlist sg;
+	unsigned int i;
+	s64 ret;
+	u64 ns;
 
-	/* build scatterlist to encrypt packet payload */
-	ret = skb_to_sgvec_nomark(skb, sg + 1, 0, skb->len);
-	if (unlikely(nfrags != ret))
-		return -EINVAL;
+	aead = crypto_alloc_aead(driver, 0, 0);
+	if (IS_ERR(aead))
+		return PTR_ERR(aead);
 
-	/* append auth_tag onto scatterlist */
-	__skb_push(skb, tag_size);
-	sg_set_buf(sg + nfrags + 1, skb->data, tag_size);
+	if (strcmp(crypto_tfm_alg_name(crypto_aead_tfm(aead)), alg_name) ||
+	    crypto_aead_ivsize(aead) != NONCE_SIZE) {
+		ret = -EINVAL;
+		goto out;
+	}
 
-	/* obtain packet ID, which is used both as a first
-	 * 4 bytes of nonce and last 4 bytes of associated data.
-	 */
-	ret = ovpn_pktid_xmit_next(&ks->pid_xmit, &pktid);
-	if (unlikely(ret < 0))
-		return ret;
+	get_random_bytes(key, sizeof(key));
+	get_random_bytes(iv, sizeof(iv));
+	ret = crypto_aead_setkey(aead, key, sizeof(key)) ?:
+	      crypto_aead_setauthsize(aead, AUTH_TAG_SIZE);
+	memzero_explicit(key, sizeof(key));
+	if (ret)
+		goto out;
 
-	/* concat 4 bytes packet id and 8 bytes nonce tail into 12 bytes
-	 * nonce
+	req = aead_request_alloc(aead, GFP_KERNEL);
+	if (!req) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* like the datapath: the ovpn header is authenticated, the payload
+	 * is encrypted in place and followed by the tag
 	 */
-	ovpn_pktid_aead_write(pktid, &ks->nonce_tail_xmit, iv);
+	sg_init_one(&sg, buf, len);
+	aead_request_set_callback(req, CRYPTO_TFM_REQ_MAY_BACKLOG |
+				  CRYPTO_TFM_REQ_MAY_SLEEP, crypto_req_done,
+				  &wait);
+	aead_request_set_crypt(req, &sg, &sg, OVPN_AEAD_SELECT_SIZE, iv);
+	aead_request_set_ad(req, OVPN_AEAD_FAST_AD_SIZE);
 
-	/* make space for packet id and push it to the front */
-	__skb_push(skb, NONCE_WIRE_SIZE);
-	memcpy(skb->data, iv, NONCE_WIRE_SIZE);
+	/* the first packets rather measure how fast the CPU clocks up */
+	for (i = 0; i < OVPN_AEAD_SELECT_WARMUP; i++) {
+		ret = crypto_wait_req(crypto_aead_encrypt(req), &wait);
+		if (ret)
+			goto out;
+	}
 
-	/* add packet op as head of additional data */
-	op = ovpn_opcode_compose(OVPN_DATA_V2, ks->key_id, peer_id);
-	__skb_push(skb, OVPN_OP_SIZE_V2);
-	BUILD_BUG_ON(sizeof(op) != OVPN_OP_SIZE_V2);
-	*((__force __be32 *)skb->data) = htonl(op);
+	ns = ktime_get_ns();
+	for (i = 0; i < OVPN_AEAD_SELECT_ITERS; i++) {
+		ret = crypto_wait_req(crypto_aead_encrypt(req), &wait);
+		if (ret)
+			goto out;
+	}
+	ret = ktime_get_ns() - ns;
 
-	/* AEAD Additional data */
-	sg_set_buf(sg, skb->data, OVPN_OP_SIZE_V2 + NONCE_WIRE_SIZE);
+	strscpy(driver_name, crypto_tfm_alg_driver_name(crypto_aead_tfm(aead)),
+		CRYPTO_MAX_ALG_NAME);
+out:
+	aead_request_free(req);
+	crypto_free_aead(aead);
+	return ret;
+}
 
-	req = aead_request_alloc(ks->encrypt, GFP_ATOMIC);
-	if (unlikely(!req))
-		return -ENOMEM;
+/* time the candidates of alg and record the fastest one */
+static void ovpn_aead_select_alg(enum ovpn_cipher_alg alg,
+				 const char * const *candidates, u8 *buf)
+{
+	const char *alg_name = ovpn_aead_alg_name(alg);
+	char driver_name[CRYPTO_MAX_ALG_NAME];
+	s64 ns, best_ns = S64_MAX;
 
-	/* setup async crypto operation */
-	aead_request_set_tfm(req, ks->encrypt);
-	aead_request_set_callback(req, 0, ovpn_aead_encrypt_done, NULL);
-	aead_request_set_crypt(req, sg, sg, skb->len - head_size, iv);
-	aead_request_set_ad(req, OVPN_OP_SIZE_V2 + NONCE_WIRE_SIZE);
+	for (; *candidates; candidates++) {
+		ns = ovpn_aead_select_time(*candidates, alg_name, buf,
+					   driver_name);
+		if (ns < 0)
+			continue;
 
-	ovpn_skb_cb(skb)->req = req;
-	ovpn_skb_cb(skb)->ks = ks;
+		pr_debug("ovpn: %s: %lld ns for %u packets of %u bytes\n",
+			 driver_name, ns, OVPN_AEAD_SELECT_ITERS,
+			 OVPN_AEAD_SELECT_SIZE);
+		if (ns < best_ns) {
+			best_ns = ns;
+			strscpy(ovpn_aead_best[alg], driver_name,
+				sizeof(ovpn_aead_best[alg]));
+		}
+	}
 
-	/* encrypt it */
-	return crypto_aead_encrypt(req);
+	if (ovpn_aead_best[alg][0])
+		pr_info("ovpn: using %s for %s\n", ovpn_aead_best[alg],
+			alg_name);
 }
 
-static void ovpn_aead_decrypt_done(void *data, int ret)
+/**
+ * ovpn_aead_select_drivers - pick the fastest implementation of each cipher
+ *
+ * Must be called once, when the module is loaded and before any key is
+ * created. Ciphers without any usable implementation are left to the
+ * crypto API, which reports the error when a key is created.
+ */
+void ovpn_aead_select_drivers(void)
 {
-	struct sk_buff *skb = data;
+	u8 *buf;
 
-	aead_request_free(ovpn_skb_cb(skb)->req);
-	ovpn_decrypt_post(skb, ret);
+	buf = kzalloc(OVPN_AEAD_FAST_AD_SIZE + OVPN_AEAD_SELECT_SIZE +
+		      AUTH_TAG_SIZE, GFP_KERNEL);
+	if (!buf)
+		return;
+
+	ovpn_aead_select_alg(OVPN_CIPHER_ALG_AES_GCM,
+			     ovpn_aead_candidates_aes_gcm, buf);
+	ovpn_aead_select_alg(OVPN_CIPHER_ALG_CHACHA20_POLY1305,
+			     ovpn_aead_candidates_chachapoly, buf);
+
+	kfree(buf);
 }
 
-int ovpn_aead_decrypt(struct ovpn_crypto_key_slot *ks, struct sk_buff *skb)
+/* get a transform keyed with key, reusing an idle one if possible */
+static struct crypto_aead *ovpn_aead_tfm_get(struct ovpn_aead_tfm_pool *pool,
+					     enum ovpn_cipher_alg alg,
+					     const char *title,
+					     const char *alg_name,
+					     const unsigned char *key,
+					     unsigned int keylen)
 {
-	const unsigned int tag_size = crypto_aead_authsize(ks->decrypt);
-	struct scatterlist sg[MAX_SKB_FRAGS + 2];
-	int ret, payload_len, nfrags;
-	u8 *sg_data, iv[NONCE_SIZE];
-	unsigned int payload_offset;
-	DECLARE_CRYPTO_WAIT(wait);
-	struct aead_request *req;
-	struct sk_buff *trailer;
-	unsigned int sg_len;
+	struct crypto_aead *aead = NULL;
+	int ret;
 
-	payload_offset = OVPN_OP_SIZE_V2 + NONCE_WIRE_SIZE + tag_size;
-	payload_len = skb->len - payload_offset;
+	spin_lock_bh(&pool->lock);
+	if (pool->algs[alg].count)
+		aead = pool->algs[alg].tfms[--pool->algs[alg].count];
+	spin_unlock_bh(&pool->lock);
 
-	/* sanity check on packet size, payload size must be >= 0 */
-	if (unlikely(payload_len < 0))
-		return -EINVAL;
+	if (!aead)
+		return ovpn_aead_init(title, alg_name, key, keylen);
 
-	/* Prepare the skb data buffer to be accessed up until the auth tag.
-	 * This is required because this area is directly mapped into the sg
-	 * list.
-	 */
-	if (unlikely(!pskb_may_pull(skb, payload_offset)))
-		return -ENODATA;
+	/* the auth size was set when the transform was first allocated */
+	ret = crypto_aead_setkey(aead, key, keylen);
+	if (ret) {
+		pr_err("%s crypto_aead_setkey size=%u failed, err=%d\n", title,
+		       keylen, ret);
+		crypto_free_aead(aead);
+		return ERR_PTR(ret);
+	}
 
-	/* get number of skb frags and ensure that packet data is writable */
-	nfrags = skb_cow_data(skb, 0, &trailer);
-	if (unlikely(nfrags < 0))
-		return nfrags;
+	return aead;
+}
 
-	if (unlikely(nfrags + 2 > ARRAY_SIZE(sg)))
-		return -ENOSPC;
+/* hand a transform back to the pool, or free it if the pool is full */
+static void ovpn_aead_tfm_put(struct ovpn_aead_tfm_pool *pool,
+			      enum ovpn_cipher_alg alg,
+			      struct crypto_aead *aead)
+{
+	if (!aead)
+		return;
 
-	/* sg table:
-	 * 0: op, wire nonce (AD, len=OVPN_OP_SIZE_V2+NONCE_WIRE_SIZE),
-	 * 1, 2, 3, ..., n: payload,
-	 * n+1: auth_tag (len=tag_size)
-	 */
-	sg_init_table(sg, nfrags + 2);
+	spin_lock_bh(&pool->lock);
+	if (pool->algs[alg].count < OVPN_AEAD_TFM_POOL_SIZE) {
+		pool->algs[alg].tfms[pool->algs[alg].count++] = aead;
+		aead = NULL;
+	}
+	spin_unlock_bh(&pool->lock);
 
-	/* packet op is head of additional data */
-	sg_data = skb->data;
-	sg_len = OVPN_OP_SIZE_V2 + NONCE_WIRE_SIZE;
-	sg_set_buf(sg, sg_data, sg_len);
+	crypto_free_aead(aead);
+}
 
-	/* build scatterlist to decrypt packet payload */
-	ret = skb_to_sgvec_nomark(skb, sg + 1, payload_offset, payload_len);
-	if (unlikely(nfrags != ret))
-		return -EINVAL;
+void ovpn_aead_crypto_key_slot_destroy(struct ovpn_crypto_key_slot *ks)
+{
+	if (!ks)
+		return;
 
-	/* append auth_tag onto scatterlist */
-	sg_set_buf(sg + nfrags + 1, skb->data + sg_len, tag_size);
+	ovpn_aead_req_cache_destroy(ks);
+	ovpn_pktid_recv_release(&ks->pid_recv);
+	if (ovpn_cbc_key_slot(ks)) {
+		crypto_free_aead(ks->encrypt);
+		crypto_free_aead(ks->decrypt);
+	} else {
+		ovpn_aead_tfm_put(ks->tfm_pool, ks->cipher_alg, ks->encrypt);
+		ovpn_aead_tfm_put(ks->tfm_pool, ks->cipher_alg, ks->decrypt);
+	}
+	kfree_sensitive(ks->lib);
+	ovpn_epoch_free(ks);
+	kfree(ks);
+}
 
-	/* copy nonce into IV buffer */
-	memcpy(iv, skb->data + OVPN_OP_SIZE_V2, NONCE_WIRE_SIZE);
-	memcpy(iv + NONCE_WIRE_SIZE, ks->nonce_tail_recv.u8,
-	       sizeof(struct ovpn_nonce_tail));
+/* build the transforms of a key slot and size its AEAD requests */
+static int ovpn_aead_key_slot_init_tfms(struct ovpn_crypto_key_slot *ks,
+					const struct ovpn_key_config *kc,
+					const char *alg_name,
+					struct ovpn_aead_tfm_pool *pool)
+{
+	int ret;
 
-	req = aead_request_alloc(ks->decrypt, GFP_ATOMIC);
-	if (unlikely(!req))
-		return -ENOMEM;
+	ks->encrypt = ovpn_aead_tfm_get(pool, kc->cipher_alg, "encrypt",
+					alg_name, kc->encrypt.cipher_key,
+					kc->encrypt.cipher_key_size);
+	if (IS_ERR(ks->encrypt)) {
+		ret = PTR_ERR(ks->encrypt);
+		ks->encrypt = NULL;
+		return ret;
+	}
 
-	/* setup async crypto operation */
-	aead_request_set_tfm(req, ks->decrypt);
-	aead_request_set_callback(req, 0, ovpn_aead_decrypt_done, NULL);
-	aead_request_set_crypt(req, sg, sg, payload_len + tag_size, iv);
+	ks->decrypt = ovpn_aead_tfm_get(pool, kc->cipher_alg, "decrypt",
+					alg_name, kc->decrypt.cipher_key,
+					kc->decrypt.cipher_key_size);
+	if (IS_ERR(ks->decrypt)) {
+		ret = PTR_ERR(ks->decrypt);
+		ks->decrypt = NULL;
+		return ret;
+	}
 
-	aead_request_set_ad(req, NONCE_WIRE_SIZE + OVPN_OP_SIZE_V2);
+	/* the cache starts empty and is filled by requests returning from
+	 * the datapath, so that no memory is spent on CPUs never handling
+	 * this peer
+	 */
+	ks->req_cache = alloc_percpu(struct ovpn_aead_req_cache);
+	if (!ks->req_cache)
+		return -ENOMEM;
 
-	ovpn_skb_cb(skb)->payload_offset = payload_offset;
-	ovpn_skb_cb(skb)->req = req;
-	ovpn_skb_cb(skb)->ks = ks;
+	/* requests to synchronous transforms complete before the datapath
+	 * leaves its RCU read side section, therefore they need no reference
+	 * to the key slot
+	 */
+	ks->async = (crypto_aead_tfm(ks->encrypt)->__crt_alg->cra_flags |
+		     crypto_aead_tfm(ks->decrypt)->__crt_alg->cra_flags) &
+		    CRYPTO_ALG_ASYNC;
 
-	/* decrypt it */
-	return crypto_aead_decrypt(req);
+	/* requests are shared between directions, therefore size them
+	 * to fit the larger context
+	 */
+	ks->req_size = sizeof(struct aead_request) +
+		       max(crypto_aead_reqsize(ks->encrypt),
+			   crypto_aead_reqsize(ks->decrypt));
+	/* followed by the IV and the scatterlist */
+	ks->req_iv_offset = ALIGN(ks->req_size,
+				  max(crypto_aead_alignmask(ks->encrypt),
+				      crypto_aead_alignmask(ks->decrypt)) + 1);
+	ks->req_sg_offset = ALIGN(ks->req_iv_offset + NONCE_SIZE,
+				  __alignof__(struct scatterlist));
+	ks->req_size = ks->req_sg_offset +
+		       (OVPN_AEAD_SG_MAX + OVPN_AEAD_DST_SG) *
+		       sizeof(struct scatterlist);
+
+	return 0;
 }
 
-/* Initialize a struct crypto_aead object */
-struct crypto_aead *ovpn_aead_init(const char *title, const char *alg_name,
-				   const unsigned char *key,
-				   unsigned int keylen)
+/* allocate a synchronous AES-CBC + HMAC-SHA256 transform, see
+ * ovpn_cbc_encrypt()
+ */
+static struct crypto_aead *ovpn_cbc_init(const char *title,
+					 const struct ovpn_key_direction *kd)
 {
+	struct crypto_authenc_key_param *param;
+	unsigned int head, keylen;
 	struct crypto_aead *aead;
+	struct rtattr *rta;
+	u8 *key;
 	int ret;
 
-	aead = crypto_alloc_aead(alg_name, 0, 0);
+	aead = crypto_alloc_aead(OVPN_CBC_ALG_NAME, 0, CRYPTO_ALG_ASYNC);
 	if (IS_ERR(aead)) {
-		ret = PTR_ERR(aead);
-		pr_err("%s crypto_alloc_aead failed, err=%d\n", title, ret);
-		aead = NULL;
+		pr_err("%s crypto_alloc_aead failed, err=%ld\n", title,
+		       PTR_ERR(aead));
+		return aead;
+	}
+
+	/* authenc() takes both keys in one buffer, after the cipher key size */
+	head = RTA_SPACE(sizeof(*param));
+	keylen = head + kd->hmac_key_size + kd->cipher_key_size;
+	key = kmalloc(keylen, GFP_KERNEL);
+	if (!key) {
+		ret = -ENOMEM;
 		goto error;
 	}
 
+	rta = (struct rtattr *)key;
+	rta->rta_type = CRYPTO_AUTHENC_KEYA_PARAM;
+	rta->rta_len = RTA_LENGTH(sizeof(*param));
+	param = RTA_DATA(rta);
+	param->enckeylen = cpu_to_be32(kd->cipher_key_size);
+	memcpy(key + head, kd->hmac_key, kd->hmac_key_size);
+	memcpy(key + head + kd->hmac_key_size, kd->cipher_key,
+	       kd->cipher_key_size);
+
 	ret = crypto_aead_setkey(aead, key, keylen);
+	kfree_sensitive(key);
 	if (ret) {
 		pr_err("%s crypto_aead_setkey size=%u failed, err=%d\n", title,
-		       keylen, ret);
+		       kd->cipher_key_size, ret);
 		goto error;
 	}
 
-	ret = crypto_aead_setauthsize(aead, AUTH_TAG_SIZE);
+	ret = crypto_aead_setauthsize(aead, OVPN_CBC_HMAC_SIZE);
 	if (ret) {
 		pr_err("%s crypto_aead_setauthsize failed, err=%d\n", title,
 		       ret);
 		goto error;
 	}
 
-	/* basic AEAD assumption */
-	if (crypto_aead_ivsize(aead) != NONCE_SIZE) {
-		pr_err("%s IV size must be %d\n", title, NONCE_SIZE);
-		ret = -EINVAL;
-		goto error;
-	}
-
-	pr_debug("********* Cipher %s (%s)\n", alg_name, title);
-	pr_debug("*** IV size=%u\n", crypto_aead_ivsize(aead));
-	pr_debug("*** req size=%u\n", crypto_aead_reqsize(aead));
-	pr_debug("*** block size=%u\n", crypto_aead_blocksize(aead));
-	pr_debug("*** auth size=%u\n", crypto_aead_authsize(aead));
-	pr_debug("*** alignmask=0x%x\n", crypto_aead_alignmask(aead));
-
 	return aead;
 
 error:
@@ -269,75 +1827,220 @@ struct crypto_aead *ovpn_aead_init(const char *title, const char *alg_name,
 	return ERR_PTR(ret);
 }
 
-void ovpn_aead_crypto_key_slot_destroy(struct ovpn_crypto_key_slot *ks)
+static int ovpn_cbc_key_slot_init(struct ovpn_crypto_key_slot *ks,
+				  const struct ovpn_key_config *kc)
 {
-	if (!ks)
-		return;
+	int ret;
 
-	crypto_free_aead(ks->encrypt);
-	crypto_free_aead(ks->decrypt);
-	kfree(ks);
+	ks->encrypt = ovpn_cbc_init("encrypt", &kc->encrypt);
+	if (IS_ERR(ks->encrypt)) {
+		ret = PTR_ERR(ks->encrypt);
+		ks->encrypt = NULL;
+		return ret;
+	}
+
+	ks->decrypt = ovpn_cbc_init("decrypt", &kc->decrypt);
+	if (IS_ERR(ks->decrypt)) {
+		ret = PTR_ERR(ks->decrypt);
+		ks->decrypt = NULL;
+		return ret;
+	}
+
+	ks->req_cache = alloc_percpu(struct ovpn_aead_req_cache);
+	if (!ks->req_cache)
+		return -ENOMEM;
+
+	/* same request layout as ovpn_aead_key_slot_init_tfms(), with a
+	 * block sized IV
+	 */
+	ks->req_size = sizeof(struct aead_request) +
+		       max(crypto_aead_reqsize(ks->encrypt),
+			   crypto_aead_reqsize(ks->decrypt));
+	ks->req_iv_offset = ALIGN(ks->req_size,
+				  max(crypto_aead_alignmask(ks->encrypt),
+				      crypto_aead_alignmask(ks->decrypt)) + 1);
+	ks->req_sg_offset = ALIGN(ks->req_iv_offset + OVPN_CBC_IV_SIZE,
+				  __alignof__(struct scatterlist));
+	ks->req_size = ks->req_sg_offset + sizeof(struct scatterlist);
+
+	return 0;
+}
+
+/* Key slots of interfaces created with OVPN_A_COMPACT_KEYS only store the
+ * expanded AES-GCM keys and encrypt/decrypt with the AES-GCM library, rather
+ * than owning two transforms each: memory then scales with the key material
+ * only, at the cost of linearizing packets and of using the generic AES
+ * implementation. ChaCha20-Poly1305 keys always own transforms.
+ *
+ * On interfaces created with OVPN_A_LIB_CRYPTO_MAX_LEN, AES-GCM keys with
+ * transforms expand the library keys too, see ovpn_aead_use_lib(). So do
+ * all ChaCha20-Poly1305 keys, for linear packets of any size: the library
+ * skips the two passes of the template. This is not done for keys of a
+ * pinned crypto driver
+ */
+static void ovpn_aead_chachapoly_load_key(u32 *words, const u8 *key)
+{
+	unsigned int i;
+
+	for (i = 0; i < CHACHA_KEY_SIZE / sizeof(u32); i++)
+		words[i] = get_unaligned_le32(key + i * sizeof(u32));
+}
+
+static int ovpn_aead_key_slot_init_lib(struct ovpn_crypto_key_slot *ks,
+				       const struct ovpn_key_config *kc)
+{
+	int ret;
+
+	ks->lib = kzalloc_node(sizeof(*ks->lib), GFP_KERNEL, kc->node);
+	if (!ks->lib)
+		return -ENOMEM;
+
+	if (kc->cipher_alg == OVPN_CIPHER_ALG_CHACHA20_POLY1305) {
+		if (kc->encrypt.cipher_key_size != CHACHA_KEY_SIZE ||
+		    kc->decrypt.cipher_key_size != CHACHA_KEY_SIZE)
+			return -EINVAL;
+
+		ovpn_aead_chachapoly_load_key(ks->lib->chacha.encrypt,
+					      kc->encrypt.cipher_key);
+		ovpn_aead_chachapoly_load_key(ks->lib->chacha.decrypt,
+					      kc->decrypt.cipher_key);
+		return 0;
+	}
+
+	ret = aesgcm_expandkey(&ks->lib->encrypt, kc->encrypt.cipher_key,
+			       kc->encrypt.cipher_key_size, AUTH_TAG_SIZE);
+	if (ret < 0)
+		return ret;
+
+	ret = aesgcm_expandkey(&ks->lib->decrypt, kc->decrypt.cipher_key,
+			       kc->decrypt.cipher_key_size, AUTH_TAG_SIZE);
+	if (ret < 0)
+		return ret;
+
+	return 0;
 }
 
 struct ovpn_crypto_key_slot *
-ovpn_aead_crypto_key_slot_new(const struct ovpn_key_config *kc)
+ovpn_aead_crypto_key_slot_new(const struct ovpn_key_config *kc,
+			      struct ovpn_aead_tfm_pool *pool)
 {
 	struct ovpn_crypto_key_slot *ks = NULL;
 	const char *alg_name;
 	int ret;
 
-	/* validate crypto alg */
-	switch (kc->cipher_alg) {
-	case OVPN_CIPHER_ALG_AES_GCM:
-		alg_name = "gcm(aes)";
-		break;
-	case OVPN_CIPHER_ALG_CHACHA20_POLY1305:
-		alg_name = "rfc7539(chacha20,poly1305)";
-		break;
-	default:
-		return ERR_PTR(-EOPNOTSUPP);
-	}
+	/* AES-CBC keys build their transforms on their own and only
+	 * support the short packet ID, which is encrypted
+	 */
+	if (kc->cipher_alg == OVPN_CIPHER_ALG_AES_CBC_HMAC_SHA256) {
+		if (kc->long_pktid)
+			return ERR_PTR(-EINVAL);
+
+		alg_name = OVPN_CBC_ALG_NAME;
+	} else {
+		/* validate crypto alg */
+		alg_name = ovpn_aead_alg_name(kc->cipher_alg);
+		if (!alg_name)
+			return ERR_PTR(-EOPNOTSUPP);
 
-	if (sizeof(struct ovpn_nonce_tail) != kc->encrypt.nonce_tail_size ||
-	    sizeof(struct ovpn_nonce_tail) != kc->decrypt.nonce_tail_size)
-		return ERR_PTR(-EINVAL);
+		/* the implementation pinned at interface creation, if any,
+		 * or the fastest one
+		 */
+		if (pool->algs[kc->cipher_alg].driver[0])
+			alg_name = pool->algs[kc->cipher_alg].driver;
+		else if (ovpn_aead_best[kc->cipher_alg][0])
+			alg_name = ovpn_aead_best[kc->cipher_alg];
+
+		if (sizeof(struct ovpn_nonce_tail) !=
+		    kc->encrypt.nonce_tail_size ||
+		    sizeof(struct ovpn_nonce_tail) !=
+		    kc->decrypt.nonce_tail_size)
+			return ERR_PTR(-EINVAL);
+	}
 
 	/* build the key slot */
-	ks = kmalloc(sizeof(*ks), GFP_KERNEL);
+	ks = kmalloc_node(sizeof(*ks), GFP_KERNEL, kc->node);
 	if (!ks)
 		return ERR_PTR(-ENOMEM);
 
 	ks->encrypt = NULL;
 	ks->decrypt = NULL;
+	ks->lib = NULL;
+	ks->lib_max_len = 0;
+	/* the library is synchronous, transforms may not be */
+	ks->async = false;
+	ks->req_cache = NULL;
+	ks->req_cache_idle = NULL;
+	ks->pid_recv.history = NULL;
+	ks->pid_recv.reorder = NULL;
 	kref_init(&ks->refcount);
 	ks->key_id = kc->key_id;
+	ks->op_size = kc->data_v1 ? OVPN_OP_SIZE_V1 : OVPN_OP_SIZE_V2;
+	ks->cipher_alg = kc->cipher_alg;
+	ks->tfm_pool = pool;
+	ks->epoch = NULL;
 
-	ks->encrypt = ovpn_aead_init("encrypt", alg_name,
-				     kc->encrypt.cipher_key,
-				     kc->encrypt.cipher_key_size);
-	if (IS_ERR(ks->encrypt)) {
-		ret = PTR_ERR(ks->encrypt);
-		ks->encrypt = NULL;
+	if (ovpn_cbc_key_slot(ks))
+		ret = ovpn_cbc_key_slot_init(ks, kc);
+	else if (kc->compact && kc->cipher_alg == OVPN_CIPHER_ALG_AES_GCM)
+		ret = ovpn_aead_key_slot_init_lib(ks, kc);
+	else
+		ret = ovpn_aead_key_slot_init_tfms(ks, kc, alg_name, pool);
+	if (ret < 0)
 		goto destroy_ks;
+
+	if (!ks->lib && kc->lib_max_len &&
+	    kc->cipher_alg == OVPN_CIPHER_ALG_AES_GCM &&
+	    !pool->algs[kc->cipher_alg].driver[0]) {
+		ret = ovpn_aead_key_slot_init_lib(ks, kc);
+		if (ret < 0)
+			goto destroy_ks;
+
+		ks->lib_max_len = kc->lib_max_len;
 	}
 
-	ks->decrypt = ovpn_aead_init("decrypt", alg_name,
-				     kc->decrypt.cipher_key,
-				     kc->decrypt.cipher_key_size);
-	if (IS_ERR(ks->decrypt)) {
-		ret = PTR_ERR(ks->decrypt);
-		ks->decrypt = NULL;
-		goto destroy_ks;
+	if (!ks->lib && kc->cipher_alg == OVPN_CIPHER_ALG_CHACHA20_POLY1305 &&
+	    !pool->algs[kc->cipher_alg].driver[0]) {
+		ret = ovpn_aead_key_slot_init_lib(ks, kc);
+		if (ret < 0)
+			goto destroy_ks;
+
+		ks->lib_max_len = UINT_MAX;
 	}
 
-	memcpy(ks->nonce_tail_xmit.u8, kc->encrypt.nonce_tail,
-	       sizeof(struct ovpn_nonce_tail));
-	memcpy(ks->nonce_tail_recv.u8, kc->decrypt.nonce_tail,
-	       sizeof(struct ovpn_nonce_tail));
+	/* AES-CBC sends a random IV with every packet instead */
+	if (!ovpn_cbc_key_slot(ks)) {
+		memcpy(ks->nonce_tail_xmit.u8, kc->encrypt.nonce_tail,
+		       sizeof(struct ovpn_nonce_tail));
+		memcpy(ks->nonce_tail_recv.u8, kc->decrypt.nonce_tail,
+		       sizeof(struct ovpn_nonce_tail));
+	}
+
+	ks->nonce_wire_size = kc->long_pktid ? NONCE_WIRE_SIZE_64 :
+					       NONCE_WIRE_SIZE;
 
 	/* init packet ID generation/validation */
-	ovpn_pktid_xmit_init(&ks->pid_xmit);
-	ovpn_pktid_recv_init(&ks->pid_recv);
+	ovpn_pktid_xmit_init(&ks->pid_xmit, kc->long_pktid,
+			     kc->rekey_threshold);
+
+	atomic64_set(&ks->volume.bytes, 0);
+	atomic64_set(&ks->volume.packets, 0);
+	ks->volume.soft_bytes = kc->soft_bytes;
+	ks->volume.hard_bytes = kc->hard_bytes;
+	ks->volume.soft_packets = kc->soft_packets;
+	ks->volume.hard_packets = kc->hard_packets;
+	ks->volume.notified = 0;
+	ks->volume_limited = kc->soft_bytes || kc->hard_bytes ||
+			     kc->soft_packets || kc->hard_packets;
+	ret = ovpn_pktid_recv_init(&ks->pid_recv, kc->replay_window,
+				   kc->node);
+	if (ret < 0)
+		goto destroy_ks;
+
+	if (kc->encrypt.epoch_secret) {
+		ret = ovpn_epoch_init(ks, kc);
+		if (ret < 0)
+			goto destroy_ks;
+	}
 
 	return ks;
 
@@ -345,3 +2048,17 @@ ovpn_aead_crypto_key_slot_new(const struct ovpn_key_config *kc)
 	ovpn_aead_crypto_key_slot_destroy(ks);
 	return ERR_PTR(ret);
 }
+
+/**
+ * ovpn_aead_driver_name - get the crypto driver a key slot encrypts with
+ * @ks: the key slot
+ *
+ * Return: the driver name or NULL if ks uses the AES-GCM library
+ */
+const char *ovpn_aead_driver_name(const struct ovpn_crypto_key_slot *ks)
+{
+	if (!ks->encrypt)
+		return NULL;
+
+	return crypto_tfm_alg_driver_name(crypto_aead_tfm(ks->encrypt));
+}
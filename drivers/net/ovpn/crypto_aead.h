@@ -19,12 +19,24 @@ struct crypto_aead *ovpn_aead_init(const char *title, const char *alg_name,
 				   const unsigned char *key,
 				   unsigned int keylen);
 
-int ovpn_aead_encrypt(struct ovpn_crypto_key_slot *ks, struct sk_buff *skb,
-		      u32 peer_id);
-int ovpn_aead_decrypt(struct ovpn_crypto_key_slot *ks, struct sk_buff *skb);
+struct ovpn_aead_tfm_pool *ovpn_aead_tfm_pool_alloc(void);
+void ovpn_aead_tfm_pool_free(struct ovpn_aead_tfm_pool *pool);
+int ovpn_aead_tfm_pool_set_driver(struct ovpn_aead_tfm_pool *pool,
+				  enum ovpn_cipher_alg alg, const char *driver);
+void ovpn_aead_select_drivers(void);
+
+bool ovpn_aead_csum_deferrable(const struct sk_buff *skb);
+int ovpn_aead_encrypt(struct ovpn_crypto_key_slot *ks, struct sk_buff **skbp,
+		      u32 peer_id, u64 pktid);
+int ovpn_aead_decrypt(struct ovpn_crypto_key_slot *ks, struct sk_buff **skbp);
+void ovpn_aead_req_put(struct ovpn_crypto_key_slot *ks,
+		       struct aead_request *req);
+void ovpn_aead_req_cache_trim(struct ovpn_crypto_key_slot *ks);
 
 struct ovpn_crypto_key_slot *
-ovpn_aead_crypto_key_slot_new(const struct ovpn_key_config *kc);
+ovpn_aead_crypto_key_slot_new(const struct ovpn_key_config *kc,
+			      struct ovpn_aead_tfm_pool *pool);
 void ovpn_aead_crypto_key_slot_destroy(struct ovpn_crypto_key_slot *ks);
+const char *ovpn_aead_driver_name(const struct ovpn_crypto_key_slot *ks);
 
 #endif /* _NET_OVPN_OVPNAEAD_H_ */
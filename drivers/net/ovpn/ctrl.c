@@ -0,0 +1,147 @@
+// SPDX-License-Identifier: GPL-2.0
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include <linux/skbuff.h>
+#include <linux/slab.h>
+#include <net/netlink.h>
+
+#include "ovpnstruct.h"
+#include "main.h"
+#include "ctrl.h"
+#include "drop.h"
+#include "netlink.h"
+#include "peer.h"
+
+/* Servers renegotiating TLS with many peers at once receive a control packet
+ * per peer, each of them would cost a syscall on the transport socket. When
+ * enabled, the control packets of known peers are rather appended to a
+ * netlink message until it is full, and a work item multicasts all the
+ * pending messages: a single recvmsg() hands userspace as many control
+ * packets as fit its buffer, across all peers of the interface.
+ *
+ * Packets from unknown transport addresses (i.e. new clients) still reach
+ * the UDP socket, while replies are sent over the transport sockets as
+ * usual.
+ */
+
+static void ovpn_ctrl_work(struct work_struct *work)
+{
+	struct ovpn_ctrl *ctrl = container_of(work, struct ovpn_ctrl, work);
+	struct sk_buff_head ready;
+	struct sk_buff *msg;
+
+	__skb_queue_head_init(&ready);
+
+	spin_lock_bh(&ctrl->lock);
+	skb_queue_splice_tail_init(&ctrl->ready, &ready);
+	if (ctrl->msg)
+		__skb_queue_tail(&ready, ctrl->msg);
+	ctrl->msg = NULL;
+	spin_unlock_bh(&ctrl->lock);
+
+	while ((msg = __skb_dequeue(&ready)))
+		ovpn_nl_notify_ctrl(ctrl->ovpn, msg);
+}
+
+/**
+ * ovpn_ctrl_init - enable the delivery of control packets over netlink
+ * @ovpn: the instance to enable the delivery for
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_ctrl_init(struct ovpn_struct *ovpn)
+{
+	struct ovpn_ctrl *ctrl;
+
+	ctrl = kzalloc(sizeof(*ctrl), GFP_KERNEL);
+	if (!ctrl)
+		return -ENOMEM;
+
+	spin_lock_init(&ctrl->lock);
+	__skb_queue_head_init(&ctrl->ready);
+	INIT_WORK(&ctrl->work, ovpn_ctrl_work);
+	ctrl->ovpn = ovpn;
+
+	ovpn->ctrl = ctrl;
+
+	return 0;
+}
+
+/**
+ * ovpn_ctrl_destroy - disable the delivery of control packets over netlink
+ * @ovpn: the instance to disable the delivery for
+ *
+ * Control packets not delivered yet are dropped.
+ */
+void ovpn_ctrl_destroy(struct ovpn_struct *ovpn)
+{
+	struct ovpn_ctrl *ctrl = ovpn->ctrl;
+
+	if (!ctrl)
+		return;
+
+	cancel_work_sync(&ctrl->work);
+	__skb_queue_purge(&ctrl->ready);
+	nlmsg_free(ctrl->msg);
+
+	kfree(ctrl);
+	ovpn->ctrl = NULL;
+}
+
+/**
+ * ovpn_ctrl_recv - queue a control packet for delivery over netlink
+ * @peer: the peer the packet was received from
+ * @skb: the packet, consumed
+ * @offset: where the control packet starts in @skb
+ *
+ * Packets are dropped if too many messages are waiting for delivery already.
+ */
+void ovpn_ctrl_recv(struct ovpn_peer *peer, struct sk_buff *skb,
+		    unsigned int offset)
+{
+	struct ovpn_ctrl *ctrl = peer->ovpn->ctrl;
+	enum ovpn_drop_reason reason;
+	struct sk_buff *msg;
+	size_t size;
+
+	spin_lock_bh(&ctrl->lock);
+	msg = ctrl->msg;
+	if (msg && !ovpn_nl_put_ctrl_packet(msg, peer, skb, offset))
+		goto out;
+
+	reason = OVPN_DROP_CTRL_BACKLOG;
+	if (unlikely(skb_queue_len(&ctrl->ready) >= OVPN_CTRL_BACKLOG))
+		goto drop;
+
+	/* the current message is full: start a new one */
+	if (msg)
+		__skb_queue_tail(&ctrl->ready, msg);
+	ctrl->msg = NULL;
+
+	reason = OVPN_DROP_NOMEM;
+	/* room for the packet and its attributes, even if larger than usual */
+	size = max_t(size_t, NLMSG_GOODSIZE, skb->len - offset + 128);
+	msg = nlmsg_new(size, GFP_ATOMIC);
+	if (unlikely(!msg))
+		goto drop;
+
+	if (unlikely(ovpn_nl_put_ctrl_packet(msg, peer, skb, offset))) {
+		nlmsg_free(msg);
+		goto drop;
+	}
+	ctrl->msg = msg;
+out:
+	spin_unlock_bh(&ctrl->lock);
+
+	schedule_work(&ctrl->work);
+	consume_skb(skb);
+	return;
+drop:
+	spin_unlock_bh(&ctrl->lock);
+	ovpn_peer_rx_drop(peer, skb, reason);
+}
@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_CTRL_H_
+#define _NET_OVPN_CTRL_H_
+
+#include <linux/skbuff.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+struct ovpn_peer;
+struct ovpn_struct;
+
+/* netlink messages full of control packets that may wait for delivery */
+#define OVPN_CTRL_BACKLOG 64
+
+/**
+ * struct ovpn_ctrl - batched delivery of control packets over netlink
+ * @lock: protects @msg and @ready
+ * @msg: netlink message control packets are currently appended to
+ * @ready: full netlink messages waiting for delivery
+ * @work: delivers @ready and @msg to the OVPN_NLGRP_CTRL multicast group
+ * @ovpn: the instance the packets are received on
+ */
+struct ovpn_ctrl {
+	spinlock_t lock; /* protects msg and ready */
+	struct sk_buff *msg;
+	struct sk_buff_head ready;
+	struct work_struct work;
+	struct ovpn_struct *ovpn;
+};
+
+int ovpn_ctrl_init(struct ovpn_struct *ovpn);
+void ovpn_ctrl_destroy(struct ovpn_struct *ovpn);
+void ovpn_ctrl_recv(struct ovpn_peer *peer, struct sk_buff *skb,
+		    unsigned int offset);
+
+#endif /* _NET_OVPN_CTRL_H_ */
@@ -0,0 +1,137 @@
+// SPDX-License-Identifier: GPL-2.0
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include <linux/netdevice.h>
+#include <linux/xarray.h>
+#include <net/net_namespace.h>
+#include <net/netns/generic.h>
+#include <net/sock.h>
+
+#include "ovpnstruct.h"
+#include "demux.h"
+#include "peer.h"
+#include "socket.h"
+
+/* Instances created with a shared socket let other such instances of the
+ * netns attach their UDP sockets, so that many tenants are served over one
+ * port. A socket shared this way has no owner: data packets received over it
+ * are demultiplexed by peer ID, which must therefore be unique across all
+ * the instances of the netns sharing sockets.
+ */
+
+static unsigned int ovpn_demux_net_id __read_mostly;
+
+/**
+ * struct ovpn_demux_net - per-netns state of the shared sockets
+ * @peers: the peers of the instances sharing sockets, indexed by ID
+ */
+struct ovpn_demux_net {
+	struct xarray peers;
+};
+
+static struct ovpn_demux_net *ovpn_demux_net(struct net *net)
+{
+	return net_generic(net, ovpn_demux_net_id);
+}
+
+static int __net_init ovpn_demux_net_init(struct net *net)
+{
+	xa_init_flags(&ovpn_demux_net(net)->peers, XA_FLAGS_LOCK_BH);
+	return 0;
+}
+
+static void __net_exit ovpn_demux_net_exit(struct net *net)
+{
+	struct ovpn_demux_net *dn = ovpn_demux_net(net);
+
+	/* the interfaces of the netns are gone already, with their peers */
+	WARN_ON_ONCE(!xa_empty(&dn->peers));
+	xa_destroy(&dn->peers);
+}
+
+static struct pernet_operations ovpn_demux_net_ops = {
+	.init = ovpn_demux_net_init,
+	.exit = ovpn_demux_net_exit,
+	.id = &ovpn_demux_net_id,
+	.size = sizeof(struct ovpn_demux_net),
+};
+
+/**
+ * ovpn_demux_init - register the per-netns state of the shared sockets
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_demux_init(void)
+{
+	return register_pernet_subsys(&ovpn_demux_net_ops);
+}
+
+/**
+ * ovpn_demux_cleanup - unregister the per-netns state of the shared sockets
+ */
+void ovpn_demux_cleanup(void)
+{
+	unregister_pernet_subsys(&ovpn_demux_net_ops);
+}
+
+/**
+ * ovpn_demux_add - index a peer of an instance sharing its sockets
+ * @peer: the peer to index
+ *
+ * Must be called with the peers lock of the instance held.
+ *
+ * Return: 0 on success, -EEXIST if another instance of the netns has a peer
+ * with the same ID or another negative error code otherwise
+ */
+int ovpn_demux_add(struct ovpn_peer *peer)
+{
+	struct ovpn_demux_net *dn = ovpn_demux_net(dev_net(peer->ovpn->dev));
+	int ret;
+
+	ret = xa_insert_bh(&dn->peers, peer->id, peer, GFP_ATOMIC);
+	return ret == -EBUSY ? -EEXIST : ret;
+}
+
+/**
+ * ovpn_demux_del - remove a peer from the index of its netns
+ * @peer: the peer to remove, indexed by ovpn_demux_add()
+ */
+void ovpn_demux_del(struct ovpn_peer *peer)
+{
+	struct ovpn_demux_net *dn = ovpn_demux_net(dev_net(peer->ovpn->dev));
+
+	xa_cmpxchg_bh(&dn->peers, peer->id, peer, NULL, 0);
+}
+
+/**
+ * ovpn_demux_get - retrieve the peer a shared socket received data from
+ * @sk: the shared socket
+ * @peer_id: the peer ID carried by the packet
+ *
+ * Peer IDs are unique across the netns, but several sockets may be shared
+ * in it: only a peer attached to @sk is returned, so that a packet received
+ * over one socket never reaches the peer of another.
+ *
+ * Return: a pointer to the peer, holding a reference, if found or NULL
+ * otherwise
+ */
+struct ovpn_peer *ovpn_demux_get(const struct sock *sk, u32 peer_id)
+{
+	struct ovpn_peer *tmp, *peer = NULL;
+	struct ovpn_socket *ovpn_sock;
+
+	rcu_read_lock();
+	tmp = xa_load(&ovpn_demux_net(sock_net(sk))->peers, peer_id);
+	/* ovpn_socket objects are freed after a grace period */
+	ovpn_sock = tmp ? READ_ONCE(tmp->sock) : NULL;
+	if (ovpn_sock && ovpn_sock->sk == sk && ovpn_peer_hold(tmp))
+		peer = tmp;
+	rcu_read_unlock();
+
+	return peer;
+}
@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_DEMUX_H_
+#define _NET_OVPN_DEMUX_H_
+
+#include <linux/types.h>
+
+struct sock;
+struct ovpn_peer;
+
+int ovpn_demux_init(void);
+void ovpn_demux_cleanup(void);
+int ovpn_demux_add(struct ovpn_peer *peer);
+void ovpn_demux_del(struct ovpn_peer *peer);
+struct ovpn_peer *ovpn_demux_get(const struct sock *sk, u32 peer_id);
+
+#endif /* _NET_OVPN_DEMUX_H_ */
@@ -0,0 +1,172 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_DROP_H_
+#define _NET_OVPN_DROP_H_
+
+#include <linux/skbuff.h>
+#include <net/dropreason.h>
+
+struct ovpn_peer;
+struct ovpn_struct;
+
+/* reasons for dropping a packet, as R(enum suffix, ethtool counter name) */
+#define OVPN_DROP_REASONS(R)					\
+	R(NO_PEER, no_peer)					\
+	R(NO_KEY, no_key)					\
+	R(BAD_OPCODE, bad_opcode)				\
+	R(TOO_SMALL, too_small)					\
+	R(DECRYPT, decrypt)					\
+	R(ENCRYPT, encrypt)					\
+	R(REPLAY, replay)					\
+	R(KEY_EXHAUSTED, key_exhausted)				\
+	R(INNER_PROTO, inner_proto)				\
+	R(RPF, rpf)						\
+	R(CRYPTO_INFLIGHT, crypto_inflight)			\
+	R(RX_BACKLOG, rx_backlog)				\
+	R(IFACE_DOWN, iface_down)				\
+	R(MALFORMED, malformed)					\
+	R(SEGMENT, segment)					\
+	R(CHECKSUM, checksum)					\
+	R(NO_TRANSPORT, no_transport)				\
+	R(TRANSPORT, transport)					\
+	R(TCP_FRAMING, tcp_framing)				\
+	R(NOMEM, nomem)						\
+	R(SCHED_QUEUE, sched_queue)				\
+	R(RATE_LIMIT, rate_limit)				\
+	R(ECN, ecn)						\
+	R(PMTU, pmtu)						\
+	R(CTRL_BACKLOG, ctrl_backlog)				\
+	R(STEER_BACKLOG, steer_backlog)				\
+	R(WORKER_BACKLOG, worker_backlog)			\
+	R(USER_BACKLOG, user_backlog)				\
+	R(DECRYPT_BUDGET, decrypt_budget)			\
+	R(QUARANTINE, quarantine)				\
+	R(MEM_BUDGET, mem_budget)				\
+	/* deliberate comment for trailing \ */
+
+/**
+ * enum ovpn_drop_reason - why the datapath dropped a packet
+ * @__OVPN_DROP_REASON: base of the subsystem, not a reason
+ * @OVPN_DROP_NO_PEER: no peer matches the destination or the peer ID
+ * @OVPN_DROP_NO_KEY: no key slot matches the key ID (or no primary key)
+ * @OVPN_DROP_BAD_OPCODE: data channel opcode not matching the key framing
+ * @OVPN_DROP_TOO_SMALL: packet too short for the ovpn header
+ * @OVPN_DROP_DECRYPT: decryption or authentication failed
+ * @OVPN_DROP_ENCRYPT: encryption failed
+ * @OVPN_DROP_REPLAY: packet ID rejected by the replay protection
+ * @OVPN_DROP_KEY_EXHAUSTED: the key has no packet ID left or exceeded its
+ *			     hard traffic limit
+ * @OVPN_DROP_INNER_PROTO: decrypted payload is not an IP packet
+ * @OVPN_DROP_RPF: source address not routed to the sending peer
+ * @OVPN_DROP_CRYPTO_INFLIGHT: too many packets of the peer pending on an
+ *			       async crypto engine
+ * @OVPN_DROP_RX_BACKLOG: per-CPU queue of decrypted packets full
+ * @OVPN_DROP_IFACE_DOWN: packet received while the interface is down
+ * @OVPN_DROP_MALFORMED: malformed plaintext packet to send
+ * @OVPN_DROP_SEGMENT: GSO/GRO packet could not be segmented
+ * @OVPN_DROP_CHECKSUM: checksum of a packet to send could not be computed
+ * @OVPN_DROP_NO_TRANSPORT: the peer has no usable socket or binding
+ * @OVPN_DROP_TRANSPORT: the transport socket refused the packet
+ * @OVPN_DROP_TCP_FRAMING: the TCP stream of the peer lost framing
+ * @OVPN_DROP_NOMEM: memory allocation failed
+ * @OVPN_DROP_SCHED_QUEUE: queue of the peer in the TX scheduler full
+ * @OVPN_DROP_RATE_LIMIT: packet exceeding the rate limit of the peer
+ * @OVPN_DROP_ECN: congestion experienced on the way by a non-ECT packet
+ * @OVPN_DROP_PMTU: packet exceeding the (path) MTU of the peer, ICMP sent back
+ * @OVPN_DROP_CTRL_BACKLOG: too many control packets waiting for delivery
+ *			    over netlink
+ * @OVPN_DROP_STEER_BACKLOG: queue of the preferred RX CPU of the peer full
+ * @OVPN_DROP_WORKER_BACKLOG: queue of the crypto kthread of the CPU full
+ * @OVPN_DROP_USER_BACKLOG: too many control packets of a TCP peer waiting
+ *			    for userspace
+ * @OVPN_DROP_DECRYPT_BUDGET: packet exceeding the decryption budget of the
+ *			      peer, dropped before decryption
+ * @OVPN_DROP_QUARANTINE: packet of a peer quarantined after repeated
+ *			  authentication failures
+ * @OVPN_DROP_MEM_BUDGET: the interface holds as many packets as its memory
+ *			  budget allows
+ * @OVPN_DROP_MAX: end of the list
+ */
+enum ovpn_drop_reason {
+	__OVPN_DROP_REASON = SKB_DROP_REASON_SUBSYS_OVPN <<
+				SKB_DROP_REASON_SUBSYS_SHIFT,
+#define ENUM(x, y) OVPN_DROP_##x,
+	OVPN_DROP_REASONS(ENUM)
+#undef ENUM
+
+	OVPN_DROP_MAX,
+};
+
+/* number of reasons and index of a reason in the per-reason counters */
+#define OVPN_DROP_NUM		(OVPN_DROP_MAX - __OVPN_DROP_REASON - 1)
+#define OVPN_DROP_IDX(_reason)	((_reason) - __OVPN_DROP_REASON - 1)
+
+void ovpn_drop_count(struct ovpn_struct *ovpn, bool tx,
+		     enum ovpn_drop_reason reason);
+void ovpn_peer_drop_count(struct ovpn_peer *peer, bool tx,
+			  enum ovpn_drop_reason reason);
+
+/**
+ * ovpn_rx_drop - drop a received packet and account for it
+ * @ovpn: the instance the packet was received on
+ * @skb: the packet to drop (NULL to only account for the drop)
+ * @reason: why the packet is dropped
+ */
+static inline void ovpn_rx_drop(struct ovpn_struct *ovpn, struct sk_buff *skb,
+				enum ovpn_drop_reason reason)
+{
+	ovpn_drop_count(ovpn, false, reason);
+	kfree_skb_reason(skb, (enum skb_drop_reason)reason);
+}
+
+/**
+ * ovpn_tx_drop - drop a packet to send and account for it
+ * @ovpn: the instance the packet was sent on
+ * @skb: the packet to drop (NULL to only account for the drop)
+ * @reason: why the packet is dropped
+ */
+static inline void ovpn_tx_drop(struct ovpn_struct *ovpn, struct sk_buff *skb,
+				enum ovpn_drop_reason reason)
+{
+	ovpn_drop_count(ovpn, true, reason);
+	kfree_skb_reason(skb, (enum skb_drop_reason)reason);
+}
+
+/**
+ * ovpn_peer_rx_drop - drop a packet received from a peer and account for it
+ * @peer: the peer the packet was received from
+ * @skb: the packet to drop (NULL to only account for the drop)
+ * @reason: why the packet is dropped
+ */
+static inline void ovpn_peer_rx_drop(struct ovpn_peer *peer,
+				     struct sk_buff *skb,
+				     enum ovpn_drop_reason reason)
+{
+	ovpn_peer_drop_count(peer, false, reason);
+	kfree_skb_reason(skb, (enum skb_drop_reason)reason);
+}
+
+/**
+ * ovpn_peer_tx_drop - drop a packet destined to a peer and account for it
+ * @peer: the peer the packet was destined to
+ * @skb: the packet to drop (NULL to only account for the drop)
+ * @reason: why the packet is dropped
+ */
+static inline void ovpn_peer_tx_drop(struct ovpn_peer *peer,
+				     struct sk_buff *skb,
+				     enum ovpn_drop_reason reason)
+{
+	ovpn_peer_drop_count(peer, true, reason);
+	kfree_skb_reason(skb, (enum skb_drop_reason)reason);
+}
+
+void ovpn_drop_reasons_register(void);
+void ovpn_drop_reasons_unregister(void);
+
+#endif /* _NET_OVPN_DROP_H_ */
@@ -0,0 +1,275 @@
+// SPDX-License-Identifier: GPL-2.0
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include <asm/unaligned.h>
+#include <crypto/hash.h>
+#include <crypto/sha2.h>
+#include <linux/netdevice.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "ovpnstruct.h"
+#include "crypto.h"
+#include "crypto_aead.h"
+#include "epoch.h"
+#include "netlink.h"
+#include "peer.h"
+
+/* Keys installed along with an epoch secret per direction rotate on their
+ * own: the key of the next epoch is derived in-kernel by both peers, rather
+ * than negotiated by userspace over the control channel.
+ *
+ * The secret E(n+1) of each direction is HKDF-Expand-Label(E(n),
+ * "datakey upd"), the key and nonce tail of epoch n are expanded from E(n)
+ * with the "data_key" and "data_iv" labels. The successor of the primary key
+ * is derived as soon as it becomes primary and waits in the next slot,
+ * carrying the following key ID, so that it can decrypt the packets of a
+ * peer having moved on already. The primary key is left behind, kept as
+ * secondary for late packets, once its packet IDs reach the rekey watermark
+ * or once the peer sends with its successor.
+ */
+
+#define OVPN_EPOCH_LABEL_PREFIX	"ovpn "
+/* length, label length, label, context length and HKDF counter */
+#define OVPN_EPOCH_INFO_MAX	(2 + 1 + sizeof(OVPN_EPOCH_LABEL_PREFIX) - 1 + \
+				 16 + 1 + 1)
+
+/**
+ * struct ovpn_epoch_dir - key material of one direction of an epoch
+ * @secret: the epoch secret
+ * @key: the cipher key, expanded from @secret
+ * @nonce_tail: the nonce tail, expanded from @secret
+ */
+struct ovpn_epoch_dir {
+	u8 secret[OVPN_EPOCH_SECRET_SIZE];
+	u8 key[SHA256_DIGEST_SIZE];
+	u8 nonce_tail[OVPN_NONCE_TAIL_SIZE];
+};
+
+/**
+ * struct ovpn_epoch_work - request to move a peer to its next epoch key
+ * @work: the work running the request
+ * @peer: the peer whose key should rotate, referenced by the request
+ * @leave: the epoch of the primary key to move away from
+ */
+struct ovpn_epoch_work {
+	struct work_struct work;
+	struct ovpn_peer *peer;
+	u32 leave;
+};
+
+/* HKDF-Expand-Label(secret, label, "", len) for len up to one digest */
+static int ovpn_epoch_expand(struct crypto_shash *hmac, const u8 *secret,
+			     const char *label, u8 *out, unsigned int len)
+{
+	const unsigned int label_len = strlen(label);
+	u8 info[OVPN_EPOCH_INFO_MAX], digest[SHA256_DIGEST_SIZE];
+	unsigned int info_len = 0;
+	int ret;
+
+	if (WARN_ON(len > sizeof(digest) ||
+		    sizeof(OVPN_EPOCH_LABEL_PREFIX) - 1 + label_len > 16))
+		return -EINVAL;
+
+	put_unaligned_be16(len, info);
+	info_len += 2;
+	info[info_len++] = sizeof(OVPN_EPOCH_LABEL_PREFIX) - 1 + label_len;
+	memcpy(info + info_len, OVPN_EPOCH_LABEL_PREFIX,
+	       sizeof(OVPN_EPOCH_LABEL_PREFIX) - 1);
+	info_len += sizeof(OVPN_EPOCH_LABEL_PREFIX) - 1;
+	memcpy(info + info_len, label, label_len);
+	info_len += label_len;
+	/* empty context, then the counter of the first and only block */
+	info[info_len++] = 0;
+	info[info_len++] = 1;
+
+	ret = crypto_shash_setkey(hmac, secret, OVPN_EPOCH_SECRET_SIZE) ?:
+	      crypto_shash_tfm_digest(hmac, info, info_len, digest);
+	if (!ret)
+		memcpy(out, digest, len);
+	memzero_explicit(digest, sizeof(digest));
+
+	return ret;
+}
+
+/* derive the key material of the epoch following the one of secret */
+static int ovpn_epoch_derive(struct crypto_shash *hmac, const u8 *secret,
+			     unsigned int key_size, struct ovpn_epoch_dir *dir)
+{
+	return ovpn_epoch_expand(hmac, secret, "datakey upd", dir->secret,
+				 sizeof(dir->secret)) ?:
+	       ovpn_epoch_expand(hmac, dir->secret, "data_key", dir->key,
+				 key_size) ?:
+	       ovpn_epoch_expand(hmac, dir->secret, "data_iv", dir->nonce_tail,
+				 sizeof(dir->nonce_tail));
+}
+
+/**
+ * ovpn_epoch_init - set up the epoch state of a new key slot
+ * @ks: the key slot being built
+ * @kc: the configuration of the key, carrying the epoch secrets
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_epoch_init(struct ovpn_crypto_key_slot *ks,
+		    const struct ovpn_key_config *kc)
+{
+	struct ovpn_epoch *epoch;
+
+	/* only AEAD keys are fully derived from the epoch secret */
+	if (kc->cipher_alg == OVPN_CIPHER_ALG_AES_CBC_HMAC_SHA256)
+		return -EOPNOTSUPP;
+
+	/* keys are expanded from a single HMAC-SHA256 block */
+	if (kc->encrypt.cipher_key_size > SHA256_DIGEST_SIZE ||
+	    kc->decrypt.cipher_key_size > SHA256_DIGEST_SIZE)
+		return -EINVAL;
+
+	epoch = kzalloc_node(sizeof(*epoch), GFP_KERNEL, kc->node);
+	if (!epoch)
+		return -ENOMEM;
+
+	memcpy(epoch->secret_xmit, kc->encrypt.epoch_secret,
+	       sizeof(epoch->secret_xmit));
+	memcpy(epoch->secret_recv, kc->decrypt.epoch_secret,
+	       sizeof(epoch->secret_recv));
+
+	epoch->kc = *kc;
+	epoch->kc.encrypt.cipher_key = NULL;
+	epoch->kc.encrypt.nonce_tail = NULL;
+	epoch->kc.encrypt.epoch_secret = NULL;
+	epoch->kc.decrypt.cipher_key = NULL;
+	epoch->kc.decrypt.nonce_tail = NULL;
+	epoch->kc.decrypt.epoch_secret = NULL;
+
+	ks->epoch = epoch;
+
+	return 0;
+}
+
+/**
+ * ovpn_epoch_free - release the epoch state of a key slot
+ * @ks: the key slot being destroyed
+ */
+void ovpn_epoch_free(struct ovpn_crypto_key_slot *ks)
+{
+	kfree_sensitive(ks->epoch);
+	ks->epoch = NULL;
+}
+
+/* point a key direction to the material of an epoch */
+static void ovpn_epoch_dir_set(struct ovpn_key_direction *kd,
+			       const struct ovpn_epoch_dir *dir)
+{
+	kd->cipher_key = dir->key;
+	kd->nonce_tail = dir->nonce_tail;
+	kd->nonce_tail_size = sizeof(dir->nonce_tail);
+	kd->epoch_secret = dir->secret;
+}
+
+/**
+ * ovpn_epoch_next - build the key slot of the epoch following the one of ks
+ * @ks: the epoch key slot to derive the successor of
+ *
+ * The successor carries the following key ID and the same configuration.
+ * Must be called in process context.
+ *
+ * Return: the new key slot or an error pointer otherwise
+ */
+struct ovpn_crypto_key_slot *
+ovpn_epoch_next(const struct ovpn_crypto_key_slot *ks)
+{
+	const struct ovpn_epoch *epoch = ks->epoch;
+	struct ovpn_key_config kc = epoch->kc;
+	struct ovpn_epoch_dir enc, dec;
+	struct ovpn_crypto_key_slot *next;
+	struct crypto_shash *hmac;
+	int ret;
+
+	hmac = crypto_alloc_shash("hmac(sha256)", 0, 0);
+	if (IS_ERR(hmac))
+		return ERR_CAST(hmac);
+
+	ret = ovpn_epoch_derive(hmac, epoch->secret_xmit,
+				kc.encrypt.cipher_key_size, &enc) ?:
+	      ovpn_epoch_derive(hmac, epoch->secret_recv,
+				kc.decrypt.cipher_key_size, &dec);
+	crypto_free_shash(hmac);
+	if (ret) {
+		next = ERR_PTR(ret);
+		goto out;
+	}
+
+	kc.key_id = (ks->key_id + 1) & OVPN_KEY_ID_MASK;
+	ovpn_epoch_dir_set(&kc.encrypt, &enc);
+	ovpn_epoch_dir_set(&kc.decrypt, &dec);
+
+	next = ovpn_aead_crypto_key_slot_new(&kc, ks->tfm_pool);
+	if (!IS_ERR(next))
+		next->epoch->n = epoch->n + 1;
+out:
+	memzero_explicit(&enc, sizeof(enc));
+	memzero_explicit(&dec, sizeof(dec));
+	return next;
+}
+
+static void ovpn_epoch_work(struct work_struct *work)
+{
+	struct ovpn_epoch_work *ew = container_of(work, struct ovpn_epoch_work,
+						  work);
+	struct ovpn_peer *peer = ew->peer;
+	int ret;
+
+	ret = ovpn_crypto_epoch_advance(&peer->crypto, ew->leave);
+	if (ret < 0) {
+		netdev_warn(peer->ovpn->dev,
+			    "cannot derive the next epoch key of peer %u: %d\n",
+			    peer->id, ret);
+		/* userspace may still rekey the old way */
+		ovpn_nl_notify_swap_keys(peer);
+	}
+
+	ovpn_peer_put(peer);
+	kfree(ew);
+}
+
+/**
+ * ovpn_epoch_request - ask for a peer to move on to its next epoch key
+ * @peer: the peer whose key should rotate, referenced by the caller
+ * @ks: the epoch key slot triggering the rotation
+ * @next: whether @ks is the successor of the primary key, which the peer
+ *	  sent with, rather than the primary key reaching its watermark
+ *
+ * Only the first request made by a key slot is considered. The rotation
+ * happens in process context, since building a key slot may sleep.
+ */
+void ovpn_epoch_request(struct ovpn_peer *peer,
+			struct ovpn_crypto_key_slot *ks, bool next)
+{
+	struct ovpn_epoch_work *ew;
+
+	if (test_and_set_bit(0, &ks->epoch->requested))
+		return;
+
+	ew = kmalloc(sizeof(*ew), GFP_ATOMIC);
+	if (unlikely(!ew)) {
+		/* received packets retry, the watermark is crossed once */
+		clear_bit(0, &ks->epoch->requested);
+		if (!next)
+			ovpn_nl_notify_swap_keys(peer);
+		return;
+	}
+
+	/* released by the work */
+	kref_get(&peer->refcount);
+	ew->peer = peer;
+	ew->leave = ks->epoch->n - next;
+
+	INIT_WORK(&ew->work, ovpn_epoch_work);
+	queue_work(system_unbound_wq, &ew->work);
+}
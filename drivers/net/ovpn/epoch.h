@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_EPOCH_H_
+#define _NET_OVPN_EPOCH_H_
+
+#include <linux/types.h>
+#include <uapi/linux/ovpn.h>
+
+#include "crypto.h"
+
+struct ovpn_peer;
+
+/**
+ * struct ovpn_epoch - state of a key slot deriving its own successor
+ * @secret_xmit: epoch secret of the encryption direction
+ * @secret_recv: epoch secret of the decryption direction
+ * @kc: configuration of the key, inherited by the successors (the key
+ *	material pointers are unused)
+ * @n: epochs elapsed since userspace installed the first key of the chain
+ * @requested: bit 0 is set once moving away from the key was requested
+ */
+struct ovpn_epoch {
+	u8 secret_xmit[OVPN_EPOCH_SECRET_SIZE];
+	u8 secret_recv[OVPN_EPOCH_SECRET_SIZE];
+	struct ovpn_key_config kc;
+	u32 n;
+	unsigned long requested;
+};
+
+int ovpn_epoch_init(struct ovpn_crypto_key_slot *ks,
+		    const struct ovpn_key_config *kc);
+void ovpn_epoch_free(struct ovpn_crypto_key_slot *ks);
+struct ovpn_crypto_key_slot *
+ovpn_epoch_next(const struct ovpn_crypto_key_slot *ks);
+void ovpn_epoch_request(struct ovpn_peer *peer,
+			struct ovpn_crypto_key_slot *ks, bool next);
+
+#endif /* _NET_OVPN_EPOCH_H_ */
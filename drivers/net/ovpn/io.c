@@ -7,23 +7,59 @@
  *		Antonio Quartulli <antonio@openvpn.net>
  */
 
+#include <linux/bpf.h>
+#include <linux/icmpv6.h>
+#include <linux/jhash.h>
 #include <linux/netdevice.h>
 #include <linux/skbuff.h>
-#include <net/gro_cells.h>
+#include <net/busy_poll.h>
 #include <net/gso.h>
+#include <net/icmp.h>
+#include <net/inet_ecn.h>
 #include <net/ip.h>
+#include <net/xdp.h>
+#include <trace/events/ovpn.h>
 
 #include "ovpnstruct.h"
 #include "peer.h"
 #include "io.h"
 #include "crypto.h"
 #include "crypto_aead.h"
+#include "comp.h"
+#include "cputime.h"
+#include "drop.h"
+#include "epoch.h"
+#include "latency.h"
+#include "mcast.h"
+#include "mem.h"
+#include "mirror.h"
+#include "mss.h"
+#include "napi.h"
 #include "netlink.h"
+#include "parallel.h"
+#include "probe.h"
 #include "proto.h"
+#include "sched.h"
+#include "sample.h"
 #include "socket.h"
 #include "tcp.h"
+#include "topk.h"
 #include "udp.h"
+#include "worker.h"
 #include "skb.h"
+#include "stats.h"
+
+/* packets of each peer, per direction, that can be pending on an async
+ * crypto engine. Sending resumes once half of them completed
+ */
+#define OVPN_CRYPTO_INFLIGHT_MAX 256
+#define OVPN_CRYPTO_INFLIGHT_WAKE (OVPN_CRYPTO_INFLIGHT_MAX / 2)
+
+/* headroom of out-of-band messages: outer headers, DATA_V2 opcode, packet
+ * ID (up to 64bit) and auth tag
+ */
+#define OVPN_SPECIAL_HEADROOM	(OVPN_HEAD_ROOM + OVPN_OP_SIZE_V2 + \
+				 NONCE_WIRE_SIZE_64 + 16)
 
 static const unsigned char ovpn_keepalive_message[] = {
 	0x2a, 0x18, 0x7b, 0xf3, 0x64, 0x1e, 0xb4, 0xcb,
@@ -50,49 +86,201 @@ static bool ovpn_is_keepalive(struct sk_buff *skb)
 		       sizeof(ovpn_keepalive_message));
 }
 
+/* packet ID of a received packet, only to be traced or checked early: it is
+ * not yet authenticated and the header may not be linear
+ */
+static u64 ovpn_rx_pktid(const struct ovpn_crypto_key_slot *ks,
+			 struct sk_buff *skb)
+{
+	u8 buf[NONCE_WIRE_SIZE_64];
+	const u8 *pid;
+
+	pid = skb_header_pointer(skb, ks->op_size, ks->nonce_wire_size, buf);
+
+	return pid ? ovpn_pktid_from_wire(pid, ks->nonce_wire_size) : 0;
+}
+
+/* run the native XDP program attached to the interface, if any, on a
+ * decrypted packet. Return true if the packet was consumed by the program
+ */
+static bool ovpn_netdev_xdp(struct ovpn_struct *ovpn, struct sk_buff **skbp)
+{
+	struct bpf_prog *prog;
+	u32 act = XDP_PASS;
+
+	rcu_read_lock();
+	prog = rcu_dereference(ovpn->xdp_prog);
+	if (prog) {
+		/* the TCP transport may receive from process context */
+		local_bh_disable();
+		act = do_xdp_generic(prog, skbp);
+		local_bh_enable();
+	}
+	rcu_read_unlock();
+
+	return act != XDP_PASS;
+}
+
+/* seed of the flow hash of decapsulated packets */
+static u32 ovpn_rx_hash_seed __read_mostly;
+
+/* ports of a TCP or UDP packet, 0 if they are not in the packet */
+static __be32 ovpn_rx_hash_ports(struct sk_buff *skb, unsigned int thoff,
+				 enum pkt_hash_types *type)
+{
+	const __be32 *ports;
+	__be32 _ports;
+
+	ports = skb_header_pointer(skb, skb_network_offset(skb) + thoff,
+				   sizeof(_ports), &_ports);
+	if (unlikely(!ports))
+		return 0;
+
+	*type = PKT_HASH_TYPE_L4;
+	return *ports;
+}
+
+/* set the flow hash of a decapsulated packet while its headers are hot, so
+ * that RPS/RFS and the qdiscs of the stack do not dissect it again.
+ * Fragments and packets other than TCP and UDP are hashed by their addresses
+ * only
+ */
+static void ovpn_rx_set_hash(struct sk_buff *skb)
+{
+	enum pkt_hash_types type = PKT_HASH_TYPE_L3;
+	const struct ipv6hdr *ip6h;
+	const struct iphdr *iph;
+	__be32 ports = 0;
+	u32 hash;
+
+	net_get_random_once(&ovpn_rx_hash_seed, sizeof(ovpn_rx_hash_seed));
+
+	switch (skb->protocol) {
+	case htons(ETH_P_IP):
+		iph = ip_hdr(skb);
+		if ((iph->protocol == IPPROTO_TCP ||
+		     iph->protocol == IPPROTO_UDP) && !ip_is_fragment(iph))
+			ports = ovpn_rx_hash_ports(skb, iph->ihl * 4, &type);
+
+		hash = jhash_3words((__force u32)iph->saddr,
+				    (__force u32)iph->daddr,
+				    (__force u32)ports ^ iph->protocol,
+				    ovpn_rx_hash_seed);
+		break;
+	case htons(ETH_P_IPV6):
+		if (unlikely(!pskb_network_may_pull(skb, sizeof(*ip6h))))
+			goto clear;
+
+		ip6h = ipv6_hdr(skb);
+		if (ip6h->nexthdr == IPPROTO_TCP ||
+		    ip6h->nexthdr == IPPROTO_UDP)
+			ports = ovpn_rx_hash_ports(skb, sizeof(*ip6h), &type);
+
+		/* saddr and daddr are contiguous */
+		hash = jhash2((const u32 *)&ip6h->saddr,
+			      2 * sizeof(struct in6_addr) / sizeof(u32),
+			      ovpn_rx_hash_seed ^ (__force u32)ports ^
+			      ip6h->nexthdr);
+		break;
+	default:
+		goto clear;
+	}
+
+	skb_set_hash(skb, hash, type);
+	return;
+clear:
+	skb_clear_hash(skb);
+}
+
+/* sockets busy polling for a decapsulated packet drive the NAPI context of
+ * the device the transport packet was received on, which decrypts the next
+ * packets in turn. A packet decrypted out of place inherits the NAPI ID of
+ * the received packet, those decrypted in place carry it already
+ */
+static void ovpn_rx_set_napi_id(struct sk_buff *skb, const struct sk_buff *src)
+{
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	if (src->napi_id >= MIN_NAPI_ID)
+		skb->napi_id = src->napi_id;
+#endif
+}
+
 /* Called after decrypt to write the IP packet to the device.
  * This method is expected to manage/free the skb.
  */
 static void ovpn_netdev_write(struct ovpn_peer *peer, struct sk_buff *skb)
 {
+	unsigned int len;
+
 	/* packet integrity was verified on the VPN layer - no need to perform
 	 * any additional check along the stack
 	 */
 	skb->ip_summed = CHECKSUM_UNNECESSARY;
 	skb->csum_level = ~0;
 
-	/* skb hash for transport packet no longer valid after decapsulation */
-	skb_clear_hash(skb);
-
 	/* post-decrypt scrub -- prepare to inject encapsulated packet onto the
 	 * interface, based on __skb_tunnel_rx() in dst.h
 	 */
 	skb->dev = peer->ovpn->dev;
-	skb_set_queue_mapping(skb, 0);
+	/* steer by peer, so that RPS can spread peers across CPUs */
+	skb_record_rx_queue(skb, ovpn_peer_queue(peer,
+						 skb->dev->real_num_rx_queues));
 	skb_scrub_packet(skb, true);
 
+	/* the IP header was parsed already, no need to run the flow dissector
+	 * to find the transport header
+	 */
 	skb_reset_network_header(skb);
-	skb_reset_transport_header(skb);
-	skb_probe_transport_header(skb);
+	skb_set_transport_header(skb, ovpn_ip_hdrlen(skb));
 	skb_reset_inner_headers(skb);
 
 	memset(skb->cb, 0, sizeof(skb->cb));
 
-	/* cause packet to be "received" by the interface */
-	if (likely(gro_cells_receive(&peer->ovpn->gro_cells,
-				     skb) == NET_RX_SUCCESS))
+	if (unlikely(ovpn_netdev_xdp(peer->ovpn, &skb)))
+		return;
+
+	/* the skb may be consumed as soon as it is queued */
+	len = skb->len;
+	trace_ovpn_netdev_rx(skb, peer->id);
+
+	/* cause packet to be "received" by the interface. Drops are
+	 * accounted for by ovpn_napi_receive()
+	 */
+	if (likely(ovpn_napi_receive(peer->ovpn, skb) == NET_RX_SUCCESS))
 		/* update RX stats with the size of decrypted packet */
-		dev_sw_netstats_rx_add(peer->ovpn->dev, skb->len);
-	else
-		dev_core_stats_rx_dropped_inc(peer->ovpn->dev);
+		dev_sw_netstats_rx_add(peer->ovpn->dev, len);
+}
+
+static bool ovpn_c2c_forward(struct ovpn_peer *peer, struct sk_buff *skb);
+
+/* Peers failing authentication at a sustained rate, above the limit set by
+ * userspace, are quarantined for OVPN_PEER_QUARANTINE_TIME: their packets
+ * are dropped without being decrypted meanwhile
+ */
+static void ovpn_peer_auth_failed(struct ovpn_peer *peer)
+{
+	if (likely(ovpn_ratelimit_allow(&peer->auth_fail_limit, 1)))
+		return;
+
+	if (!ovpn_peer_quarantined(peer))
+		net_info_ratelimited("%s: quarantining peer %u after repeated authentication failures\n",
+				     peer->ovpn->dev->name, peer->id);
+	/* 0 means no quarantine */
+	WRITE_ONCE(peer->quarantine_until,
+		   (jiffies + OVPN_PEER_QUARANTINE_TIME) ?: 1);
 }
 
 void ovpn_decrypt_post(struct sk_buff *skb, int ret)
 {
 	struct ovpn_crypto_key_slot *ks = ovpn_skb_cb(skb)->ks;
 	struct ovpn_peer *peer = ovpn_skb_cb(skb)->peer;
+	bool ks_held = ovpn_skb_cb(skb)->ks_held;
+	enum ovpn_drop_reason reason;
+	struct sk_buff *src;
+	u8 outer_ds = 0;
 	__be16 proto;
-	__be32 *pid;
+	bool rpf_ok;
+	u64 pktid;
 
 	/* crypto is happening asyncronously. this function will be called
 	 * again later by the crypto callback with a proper return code
@@ -100,37 +288,103 @@ void ovpn_decrypt_post(struct sk_buff *skb, int ret)
 	if (unlikely(ret == -EINPROGRESS))
 		return;
 
+	/* crypto is done, the request can be reused by the next packet */
+	if (likely(ovpn_skb_cb(skb)->req)) {
+		ovpn_aead_req_put(ks, ovpn_skb_cb(skb)->req);
+		ovpn_skb_cb(skb)->req = NULL;
+	}
+
+	/* decrypted in parallel: the rest of the processing happens in the
+	 * order packets were received in
+	 */
+	if (ovpn_skb_cb(skb)->parallel) {
+		ovpn_parallel_serialize(skb, ret);
+		return;
+	}
+
+	ovpn_mem_uncharge_skb(peer->ovpn, skb);
+	if (ks->async)
+		atomic_dec(&peer->crypto_inflight_rx);
+
+	/* decrypted out of place, the received packet is kept until its
+	 * outer headers have been processed
+	 */
+	src = ovpn_skb_cb(skb)->skb;
+
+	/* the header is left in place by decryption, also out of place */
+	if (trace_ovpn_decrypt_done_enabled())
+		trace_ovpn_decrypt_done(src ?: skb, peer->id, ks->key_id,
+					ovpn_rx_pktid(ks, skb), ks->async,
+					ret);
+
 	if (unlikely(ret < 0)) {
 		net_err_ratelimited("%s: error during decryption for peer %u, key-id %u: %d\n",
 				    peer->ovpn->dev->name, peer->id, ks->key_id,
 				    ret);
+		if (ret == -EBADMSG)
+			ovpn_peer_auth_failed(peer);
+		reason = OVPN_DROP_DECRYPT;
 		goto drop;
 	}
 
 	/* PID sits after the op */
-	pid = (__force __be32 *)(skb->data + OVPN_OP_SIZE_V2);
-	ret = ovpn_pktid_recv(&ks->pid_recv, ntohl(*pid), 0);
+	pktid = ovpn_pktid_from_wire(skb->data + ks->op_size,
+				     ks->nonce_wire_size);
+	ret = ovpn_pktid_recv(&ks->pid_recv, pktid, 0);
+	trace_ovpn_replay_check(peer->id, ks->key_id, pktid, ret);
 	if (unlikely(ret < 0)) {
 		net_err_ratelimited("%s: PKT ID RX error: %d\n",
 				    peer->ovpn->dev->name, ret);
+		reason = OVPN_DROP_REPLAY;
+		goto drop;
+	}
+
+	/* authenticated traffic only counts against the limits of the key */
+	if (unlikely(ks->volume_limited) &&
+	    ovpn_key_volume_account(peer, ks, 1,
+				    skb->len -
+				    ovpn_skb_cb(skb)->payload_offset) < 0) {
+		reason = OVPN_DROP_KEY_EXHAUSTED;
 		goto drop;
 	}
 
+	/* the peer moved on to the next epoch key: follow it */
+	if (unlikely(ks->epoch) && ks == rcu_access_pointer(peer->crypto.next))
+		ovpn_epoch_request(peer, ks, true);
+
 	/* note event of authenticated packet received for keepalive */
 	ovpn_peer_keepalive_recv_reset(peer);
+	ovpn_peer_node_update(peer);
+
+	if (likely(ovpn_peer_is_udp(peer))) {
+		/* ECN marks of the outer header are propagated to the inner
+		 * one below, once the latter is in place
+		 */
+		if (peer->ovpn->inherit_dsfield)
+			outer_ds = ovpn_ip_dsfield(src ?: skb);
 
-	if (peer->sock->sock->sk->sk_protocol == IPPROTO_UDP) {
-		/* check if this peer changed it's IP address and update
-		 * state
+		/* packets coming over one of the paths of the peer leave
+		 * its binding alone. Otherwise check if this peer changed
+		 * it's IP address and update state
 		 */
-		ovpn_peer_float(peer, skb);
-		/* update source endpoint for this peer */
-		ovpn_peer_update_local_endpoint(peer, skb);
+		if (!ovpn_path_rx(peer, src ?: skb)) {
+			ovpn_peer_float(peer, src ?: skb);
+			/* update source endpoint for this peer */
+			ovpn_peer_update_local_endpoint(peer, src ?: skb);
+		}
 	}
 
 	/* point to encapsulated IP packet */
 	__skb_pull(skb, ovpn_skb_cb(skb)->payload_offset);
 
+	/* keepalives are framed as well, the framing goes first */
+	if (unlikely(ovpn_comp_stub_strip(skb, READ_ONCE(peer->comp_stub)))) {
+		net_info_ratelimited("%s: compressed packet received from peer %u\n",
+				     peer->ovpn->dev->name, peer->id);
+		reason = OVPN_DROP_INNER_PROTO;
+		goto drop;
+	}
+
 	/* check if this is a valid datapacket that has to be delivered to the
 	 * ovpn interface
 	 */
@@ -141,23 +395,47 @@ void ovpn_decrypt_post(struct sk_buff *skb, int ret)
 		if (unlikely(!pskb_may_pull(skb, 1))) {
 			net_info_ratelimited("%s: NULL packet received from peer %u\n",
 					     peer->ovpn->dev->name, peer->id);
+			reason = OVPN_DROP_INNER_PROTO;
 			goto drop;
 		}
 
+		/* keepalives are consumed here, they are not a drop */
 		if (ovpn_is_keepalive(skb)) {
 			netdev_dbg(peer->ovpn->dev,
 				   "ping received from peer %u\n", peer->id);
+			ovpn_dev_stats_inc(peer->ovpn, keepalive_rx);
+			/* probes are keepalives followed by a trailer */
+			if (skb->len > sizeof(ovpn_keepalive_message))
+				ovpn_probe_recv(peer, skb,
+						sizeof(ovpn_keepalive_message));
+			consume_skb(skb);
+			skb = NULL;
 			goto drop;
 		}
 
 		net_info_ratelimited("%s: unsupported protocol received from peer %u\n",
 				     peer->ovpn->dev->name, peer->id);
+		reason = OVPN_DROP_INNER_PROTO;
 		goto drop;
 	}
 	skb->protocol = proto;
+	ovpn_peer_activity_reset(peer);
+
+	/* RFC 6040: congestion experienced on the way is reported to the
+	 * endpoints, unless the packet does not support ECN
+	 */
+	if (unlikely(INET_ECN_is_ce(outer_ds)) &&
+	    INET_ECN_decapsulate(skb, outer_ds, ovpn_ip_dsfield(skb)) > 1) {
+		net_dbg_ratelimited("%s: congestion experienced by non-ECT packet from peer %u\n",
+				    peer->ovpn->dev->name, peer->id);
+		reason = OVPN_DROP_ECN;
+		goto drop;
+	}
 
 	/* perform Reverse Path Filtering (RPF) */
-	if (unlikely(!ovpn_peer_check_by_src(peer->ovpn, skb, peer))) {
+	rpf_ok = ovpn_peer_check_by_src(peer->ovpn, skb, peer);
+	trace_ovpn_rpf_check(skb, peer->id, rpf_ok);
+	if (unlikely(!rpf_ok)) {
 		if (skb_protocol_to_family(skb) == AF_INET6)
 			net_dbg_ratelimited("%s: RPF dropped packet from peer %u, src: %pI6c\n",
 					    peer->ovpn->dev->name, peer->id,
@@ -166,50 +444,384 @@ void ovpn_decrypt_post(struct sk_buff *skb, int ret)
 			net_dbg_ratelimited("%s: RPF dropped packet from peer %u, src: %pI4\n",
 					    peer->ovpn->dev->name, peer->id,
 					    &ip_hdr(skb)->saddr);
+		reason = OVPN_DROP_RPF;
 		goto drop;
 	}
 
+	if (unlikely(!ovpn_ratelimit_allow(&peer->rx_limit, skb->len))) {
+		net_dbg_ratelimited("%s: packet from peer %u exceeds its rate limit\n",
+				    peer->ovpn->dev->name, peer->id);
+		reason = OVPN_DROP_RATE_LIMIT;
+		goto drop;
+	}
+
+	/* replies to SYNs of the peer are sent back through the same MTU */
+	if (unlikely(test_bit(OVPN_PEER_MSS_CLAMP, &peer->flags)))
+		ovpn_mss_clamp(skb, ovpn_peer_mtu(peer) ?:
+				    READ_ONCE(peer->ovpn->dev->mtu));
+
 	/* increment RX stats */
-	ovpn_peer_stats_increment_rx(&peer->vpn_stats, skb->len);
-	ovpn_peer_stats_increment_rx(&peer->link_stats,
+	ovpn_peer_stats_increment_rx(peer->vpn_stats, skb->len);
+	ovpn_peer_stats_increment_rx(peer->link_stats,
 				     ovpn_skb_cb(skb)->orig_len);
+	ovpn_topk_account(peer, false, ovpn_skb_cb(skb)->orig_len);
+	ovpn_peer_stats_touch(peer);
+	ovpn_mirror_skb(peer, skb, false);
+	ovpn_sample_skb(peer, skb, ks->key_id, false);
+	/* decrypted out of place, the stamp stays with the received packet */
+	ovpn_latency_rx(peer, src ?: skb);
+
+	/* the hash of the transport packet is not valid after decapsulation */
+	ovpn_rx_set_hash(skb);
+	if (src)
+		ovpn_rx_set_napi_id(skb, src);
+
+	if (peer->ovpn->client_to_client && ovpn_c2c_forward(peer, skb)) {
+		skb = NULL;
+		goto drop;
+	}
 
 	ovpn_netdev_write(peer, skb);
 	/* skb is passed to upper layer - don't free it */
 	skb = NULL;
 drop:
 	if (unlikely(skb))
-		dev_core_stats_rx_dropped_inc(peer->ovpn->dev);
-	kfree_skb(skb);
+		ovpn_peer_rx_drop(peer, skb, reason);
+	consume_skb(src);
+	if (ks_held)
+		ovpn_crypto_key_slot_put(ks);
 	ovpn_peer_put(peer);
 }
 
-/* pick next packet from RX queue, decrypt and forward it to the device */
-void ovpn_recv(struct ovpn_peer *peer, struct sk_buff *skb)
+/* packets of a burst decrypted back-to-back: a full GRO aggregate */
+#define OVPN_RX_BATCH	64
+
+static void ovpn_recv_cb_init(struct sk_buff *skb, struct ovpn_peer *peer,
+			      struct ovpn_crypto_key_slot *ks, bool ks_held)
+{
+	ovpn_skb_cb(skb)->peer = peer;
+	ovpn_skb_cb(skb)->ks = ks;
+	ovpn_skb_cb(skb)->ks_held = ks_held;
+	ovpn_skb_cb(skb)->req = NULL;
+	ovpn_skb_cb(skb)->orig_len = skb->len;
+	ovpn_skb_cb(skb)->skb = NULL;
+	ovpn_skb_cb(skb)->job = NULL;
+	ovpn_skb_cb(skb)->parallel = false;
+	ovpn_skb_cb(skb)->mem_charged = false;
+}
+
+/* a key only decrypts packets framed the way it frames them, DATA_V1 or
+ * DATA_V2
+ */
+static bool ovpn_recv_opcode_ok(const struct ovpn_crypto_key_slot *ks,
+				const struct sk_buff *skb)
+{
+	return ovpn_opcode_from_skb(skb, 0) ==
+	       (ks->op_size == OVPN_OP_SIZE_V1 ? OVPN_DATA_V1 : OVPN_DATA_V2);
+}
+
+/* The packets of a peer are decrypted within its budget, so that a peer
+ * flooding the interface, possibly with junk failing authentication, cannot
+ * take all the softirq time of the CPU it is received on. Packets over
+ * budget, or received while the peer is quarantined, are dropped before any
+ * crypto work, along with their reference to the peer.
+ */
+static bool ovpn_recv_admit(struct ovpn_peer *peer, struct sk_buff *skb)
+{
+	enum ovpn_drop_reason reason;
+
+	if (unlikely(ovpn_peer_quarantined(peer))) {
+		reason = OVPN_DROP_QUARANTINE;
+		goto drop;
+	}
+
+	if (unlikely(!ovpn_ratelimit_allow(&peer->decrypt_limit, skb->len))) {
+		net_dbg_ratelimited("%s: packet from peer %u exceeds its decryption budget\n",
+				    peer->ovpn->dev->name, peer->id);
+		reason = OVPN_DROP_DECRYPT_BUDGET;
+		goto drop;
+	}
+
+	/* what is mirrored is what the peer gets to have decrypted */
+	ovpn_mirror_skb(peer, skb, true);
+	return true;
+drop:
+	ovpn_peer_rx_drop(peer, skb, reason);
+	ovpn_peer_put(peer);
+	return false;
+}
+
+/* A packet replaying an ID already received, or below the replay window, is
+ * dropped before decryption based on its cleartext ID: ovpn_pktid_recv()
+ * would reject it anyway. CBC keys carry the ID encrypted
+ */
+static bool ovpn_recv_replayed(const struct ovpn_crypto_key_slot *ks,
+			       struct sk_buff *skb)
+{
+	if (ks->cipher_alg == OVPN_CIPHER_ALG_AES_CBC_HMAC_SHA256)
+		return false;
+
+	return ovpn_pktid_recv_check(&ks->pid_recv, ovpn_rx_pktid(ks, skb)) < 0;
+}
+
+/* whether a received packet should be decrypted by the parallel engine */
+static bool ovpn_recv_parallel(struct ovpn_struct *ovpn)
+{
+	if (!ovpn->padata_rx)
+		return false;
+
+	return !ovpn->rx_load || ovpn_parallel_rx_overloaded(ovpn);
+}
+
+/* decrypt a packet admitted by ovpn_recv_admit() and forward it */
+static void __ovpn_recv(struct ovpn_peer *peer, struct sk_buff *skb)
 {
 	struct ovpn_crypto_key_slot *ks;
+	u64 start, load_start = 0;
+	bool parallel;
 	u8 key_id;
+	int ret;
 
+	rcu_read_lock();
 	/* get the key slot matching the key ID in the received packet */
 	key_id = ovpn_key_id_from_skb(skb);
 	ks = ovpn_crypto_key_id_to_slot(&peer->crypto, key_id);
-	if (unlikely(!ks)) {
+	trace_ovpn_key_select(peer->id, key_id, false, !!ks);
+	if (unlikely(ks && !ovpn_recv_opcode_ok(ks, skb))) {
+		rcu_read_unlock();
+		ovpn_peer_rx_drop(peer, skb, OVPN_DROP_BAD_OPCODE);
+		ovpn_peer_put(peer);
+		return;
+	}
+
+	if (unlikely(ks && ovpn_recv_replayed(ks, skb))) {
+		rcu_read_unlock();
+		ovpn_peer_rx_drop(peer, skb, OVPN_DROP_REPLAY);
+		ovpn_peer_put(peer);
+		return;
+	}
+
+	/* the slot is protected by RCU until synchronous decryption is done.
+	 * Only a request completing asynchronously or on another CPU requires
+	 * a reference
+	 */
+	parallel = ovpn_recv_parallel(peer->ovpn);
+	if (unlikely(!ks || ((ks->async || parallel) &&
+			     !ovpn_crypto_key_slot_hold(ks)))) {
+		rcu_read_unlock();
 		net_info_ratelimited("%s: no available key for peer %u, key-id: %u\n",
 				     peer->ovpn->dev->name, peer->id, key_id);
-		dev_core_stats_rx_dropped_inc(peer->ovpn->dev);
-		kfree_skb(skb);
+		ovpn_peer_rx_drop(peer, skb, OVPN_DROP_NO_KEY);
+		ovpn_peer_put(peer);
 		return;
 	}
 
-	ovpn_skb_cb(skb)->peer = peer;
-	ovpn_skb_cb(skb)->orig_len = skb->len;
-	ovpn_decrypt_post(skb, ovpn_aead_decrypt(ks, skb));
+	/* received packets cannot be pushed back: once the engine holds too
+	 * many packets of this peer, new ones are dropped
+	 */
+	if (ks->async &&
+	    unlikely(atomic_inc_return(&peer->crypto_inflight_rx) >
+		     OVPN_CRYPTO_INFLIGHT_MAX)) {
+		atomic_dec(&peer->crypto_inflight_rx);
+		rcu_read_unlock();
+		ovpn_dev_stats_inc(peer->ovpn, crypto_inflight_dropped);
+		ovpn_crypto_key_slot_put(ks);
+		ovpn_peer_rx_drop(peer, skb, OVPN_DROP_CRYPTO_INFLIGHT);
+		ovpn_peer_put(peer);
+		return;
+	}
+
+	ovpn_recv_cb_init(skb, peer, ks, ks->async || parallel);
+
+	/* packets left pending on the engine or on the parallel CPUs are held
+	 * by the interface until they are decrypted
+	 */
+	if ((ks->async || parallel) &&
+	    unlikely(!ovpn_mem_charge_skb(peer->ovpn, skb))) {
+		if (ks->async)
+			atomic_dec(&peer->crypto_inflight_rx);
+		rcu_read_unlock();
+		ovpn_crypto_key_slot_put(ks);
+		ovpn_peer_rx_drop(peer, skb, OVPN_DROP_MEM_BUDGET);
+		ovpn_peer_put(peer);
+		return;
+	}
+
+	if (trace_ovpn_decrypt_submit_enabled())
+		trace_ovpn_decrypt_submit(skb, peer->id, key_id,
+					  ovpn_rx_pktid(ks, skb),
+					  ks->async || parallel);
+
+	if (parallel && ovpn_parallel_decrypt(peer->ovpn, skb)) {
+		if (peer->ovpn->rx_load)
+			ovpn_dev_stats_inc(peer->ovpn, rx_parallel_offload);
+		rcu_read_unlock();
+		return;
+	}
+
+	if (peer->ovpn->rx_load)
+		load_start = local_clock();
+	start = ovpn_cputime_start(peer);
+	ret = ovpn_aead_decrypt(ks, &skb);
+	ovpn_cputime_end(peer, false, start);
+	if (load_start)
+		ovpn_parallel_rx_account(peer->ovpn, load_start);
+	ovpn_decrypt_post(skb, ret);
+	rcu_read_unlock();
 }
 
-void ovpn_encrypt_post(struct sk_buff *skb, int ret)
+/* pick next packet from RX queue, decrypt and forward it to the device */
+void ovpn_recv(struct ovpn_peer *peer, struct sk_buff *skb)
+{
+	if (likely(ovpn_recv_admit(peer, skb)))
+		__ovpn_recv(peer, skb);
+}
+
+/* decrypt a batch of packets prepared by ovpn_recv_list(), then check and
+ * deliver all of them. Called under RCU read lock
+ */
+static void ovpn_recv_batch(struct ovpn_peer *peer, struct sk_buff **skbs,
+			    unsigned int n)
+{
+	struct ovpn_crypto_key_slot *ks;
+	int rets[OVPN_RX_BATCH];
+	u64 start, load_start = 0;
+	unsigned int i;
+
+	if (peer->ovpn->rx_load)
+		load_start = local_clock();
+	start = ovpn_cputime_start(peer);
+	for (i = 0; i < n; i++) {
+		ks = ovpn_skb_cb(skbs[i])->ks;
+		if (trace_ovpn_decrypt_submit_enabled())
+			trace_ovpn_decrypt_submit(skbs[i], peer->id, ks->key_id,
+						  ovpn_rx_pktid(ks, skbs[i]),
+						  false);
+		rets[i] = ovpn_aead_decrypt(ks, &skbs[i]);
+	}
+	ovpn_cputime_end(peer, false, start);
+	if (load_start)
+		ovpn_parallel_rx_account(peer->ovpn, load_start);
+	if (n)
+		ovpn_dev_stats_hist(peer->ovpn, crypto_batch, n);
+
+	for (i = 0; i < n; i++)
+		ovpn_decrypt_post(skbs[i], rets[i]);
+}
+
+/**
+ * ovpn_recv_list - decrypt a burst of packets received from the same peer
+ * @peer: the peer the packets were received from
+ * @list: the packets, each holding a reference to @peer, emptied on return
+ *
+ * The burst goes through the RX path stage by stage rather than packet by
+ * packet: the key slot of consecutive packets with the same key ID is looked
+ * up once, up to OVPN_RX_BATCH packets are decrypted back-to-back and only
+ * then go through replay protection, RPF and delivery, in order. The code
+ * and the state of each stage thus stay hot across the batch.
+ *
+ * Packets that may complete asynchronously or on another CPU rather go
+ * through ovpn_recv() one by one, once the packets before them are done.
+ */
+void ovpn_recv_list(struct ovpn_peer *peer, struct sk_buff_head *list)
+{
+	struct ovpn_crypto_key_slot *ks = NULL;
+	struct sk_buff *skbs[OVPN_RX_BATCH];
+	struct sk_buff *skb;
+	unsigned int n = 0;
+	u8 key_id;
+
+	/* packets decrypted in parallel are serialized by padata instead */
+	if (ovpn_recv_parallel(peer->ovpn)) {
+		while ((skb = __skb_dequeue(list)))
+			ovpn_recv(peer, skb);
+		return;
+	}
+
+	rcu_read_lock();
+	while ((skb = __skb_dequeue(list))) {
+		if (unlikely(!ovpn_recv_admit(peer, skb)))
+			continue;
+
+		key_id = ovpn_key_id_from_skb(skb);
+		if (!ks || ks->key_id != key_id) {
+			ks = ovpn_crypto_key_id_to_slot(&peer->crypto, key_id);
+			trace_ovpn_key_select(peer->id, key_id, false, !!ks);
+		}
+
+		if (unlikely(!ks || ks->async || !ovpn_recv_opcode_ok(ks, skb))) {
+			ovpn_recv_batch(peer, skbs, n);
+			n = 0;
+			/* drops are accounted for there */
+			__ovpn_recv(peer, skb);
+			ks = NULL;
+			continue;
+		}
+
+		if (unlikely(ovpn_recv_replayed(ks, skb))) {
+			ovpn_peer_rx_drop(peer, skb, OVPN_DROP_REPLAY);
+			ovpn_peer_put(peer);
+			continue;
+		}
+
+		ovpn_recv_cb_init(skb, peer, ks, false);
+		skbs[n++] = skb;
+		if (n == OVPN_RX_BATCH) {
+			ovpn_recv_batch(peer, skbs, n);
+			n = 0;
+		}
+	}
+
+	ovpn_recv_batch(peer, skbs, n);
+	rcu_read_unlock();
+}
+
+/* account for n asynchronous requests of peer about to be submitted and
+ * stop the netdev TX queue once the engine holds too many of them
+ */
+static void ovpn_crypto_inflight_tx_add(struct ovpn_peer *peer,
+					unsigned int n)
+{
+	struct netdev_queue *txq;
+
+	if (likely(atomic_add_return(n, &peer->crypto_inflight_tx) <
+		   OVPN_CRYPTO_INFLIGHT_MAX))
+		return;
+
+	txq = ovpn_peer_txq(peer);
+	netif_tx_stop_queue(txq);
+
+	/* the requests in flight may have completed before the queue was
+	 * stopped, so that none of them would wake it
+	 */
+	smp_mb__after_atomic();
+	if (atomic_read(&peer->crypto_inflight_tx) <=
+	    OVPN_CRYPTO_INFLIGHT_WAKE)
+		netif_tx_wake_queue(txq);
+}
+
+/* account for a completed asynchronous request of peer and restart the
+ * netdev TX queue once enough of them completed
+ */
+static void ovpn_crypto_inflight_tx_done(struct ovpn_peer *peer)
+{
+	struct netdev_queue *txq;
+
+	if (atomic_dec_return(&peer->crypto_inflight_tx) >
+	    OVPN_CRYPTO_INFLIGHT_WAKE)
+		return;
+
+	txq = ovpn_peer_txq(peer);
+	if (netif_tx_queue_stopped(txq))
+		netif_tx_wake_queue(txq);
+}
+
+static void __ovpn_encrypt_post(struct sk_buff *skb, int ret, bool async)
 {
 	struct ovpn_crypto_key_slot *ks = ovpn_skb_cb(skb)->ks;
 	struct ovpn_peer *peer = ovpn_skb_cb(skb)->peer;
+	bool ks_held = ovpn_skb_cb(skb)->ks_held;
+	enum ovpn_drop_reason reason;
 
 	/* encryption is happening asynchronously. This function will be
 	 * called later by the crypto callback with a proper return value
@@ -217,6 +829,33 @@ void ovpn_encrypt_post(struct sk_buff *skb, int ret)
 	if (unlikely(ret == -EINPROGRESS))
 		return;
 
+	/* crypto is done, the request can be reused by the next packet */
+	if (likely(ovpn_skb_cb(skb)->req)) {
+		ovpn_aead_req_put(ks, ovpn_skb_cb(skb)->req);
+		ovpn_skb_cb(skb)->req = NULL;
+	}
+
+	/* encrypted in parallel: packets are sent in the order their packet
+	 * IDs were reserved in
+	 */
+	if (ovpn_skb_cb(skb)->parallel) {
+		ovpn_parallel_serialize(skb, ret);
+		return;
+	}
+
+	ovpn_mem_uncharge_skb(peer->ovpn, skb);
+	if (ks->async)
+		ovpn_crypto_inflight_tx_done(peer);
+
+	/* on success the packet starts with the ovpn header */
+	if (trace_ovpn_encrypt_done_enabled())
+		trace_ovpn_encrypt_done(skb, peer->id, ks->key_id,
+					ret ? 0 :
+					ovpn_pktid_from_wire(skb->data +
+							     ks->op_size,
+							     ks->nonce_wire_size),
+					async, ret);
+
 	if (unlikely(ret == -ERANGE)) {
 		/* we ran out of IVs and we must kill the key as it can't be
 		 * usea nymore
@@ -224,19 +863,43 @@ void ovpn_encrypt_post(struct sk_buff *skb, int ret)
 		netdev_warn(peer->ovpn->dev,
 			    "killing primary key for peer %u\n", peer->id);
 		ovpn_crypto_kill_primary(&peer->crypto);
+		reason = OVPN_DROP_KEY_EXHAUSTED;
 		goto err;
 	}
 
-	if (unlikely(ret < 0))
+	if (unlikely(ret < 0)) {
+		reason = ret == -EDQUOT ? OVPN_DROP_MEM_BUDGET :
+					   OVPN_DROP_ENCRYPT;
 		goto err;
+	}
 
 	skb_mark_not_on_list(skb);
-	ovpn_peer_stats_increment_tx(&peer->link_stats, skb->len);
-	ovpn_peer_stats_increment_tx(&peer->vpn_stats,
+	ovpn_peer_stats_increment_tx(peer->link_stats, skb->len);
+	ovpn_peer_stats_increment_tx(peer->vpn_stats,
 				     ovpn_skb_cb(skb)->orig_len);
+	ovpn_topk_account(peer, true, skb->len);
+	ovpn_mirror_skb(peer, skb, true);
+	ovpn_peer_stats_touch(peer);
 
-	switch (peer->sock->sock->sk->sk_protocol) {
+	switch (READ_ONCE(peer->proto)) {
 	case IPPROTO_UDP:
+		/* packets encrypted synchronously as part of a batch are sent
+		 * all together once the whole batch has been processed
+		 */
+		if (ovpn_skb_cb(skb)->batch) {
+			__skb_queue_tail(ovpn_skb_cb(skb)->batch, skb);
+			break;
+		}
+		/* packets completed by an async engine are sent in batches
+		 * by the NAPI context of this CPU, which releases the peer
+		 */
+		if (async) {
+			ovpn_peer_keepalive_xmit_reset(peer);
+			if (ks_held)
+				ovpn_crypto_key_slot_put(ks);
+			ovpn_napi_send(peer->ovpn, skb);
+			return;
+		}
 		ovpn_udp_send_skb(peer->ovpn, peer, skb);
 		break;
 	case IPPROTO_TCP:
@@ -244,55 +907,485 @@ void ovpn_encrypt_post(struct sk_buff *skb, int ret)
 		break;
 	default:
 		/* no transport configured yet */
+		reason = OVPN_DROP_NO_TRANSPORT;
 		goto err;
 	}
 	ovpn_peer_keepalive_xmit_reset(peer);
 	/* skb passed down the stack - don't free it */
 	skb = NULL;
 err:
-	if (unlikely(skb)) {
-		dev_core_stats_tx_dropped_inc(peer->ovpn->dev);
-		kfree_skb(skb);
-	}
-	ovpn_crypto_key_slot_put(ks);
+	if (unlikely(skb))
+		ovpn_peer_tx_drop(peer, skb, reason);
+	if (ks_held)
+		ovpn_crypto_key_slot_put(ks);
 	ovpn_peer_put(peer);
 }
 
-static bool ovpn_encrypt_one(struct ovpn_peer *peer, struct sk_buff *skb)
+void ovpn_encrypt_post(struct sk_buff *skb, int ret)
+{
+	__ovpn_encrypt_post(skb, ret, false);
+}
+
+/**
+ * ovpn_encrypt_post_async - complete an asynchronous encryption
+ * @skb: the encrypted packet
+ * @ret: the result reported by the crypto engine
+ *
+ * Invoked by the completion callback of the engine, possibly in hard IRQ
+ * context: UDP packets are not sent from here but handed to ovpn_napi_send().
+ */
+void ovpn_encrypt_post_async(struct sk_buff *skb, int ret)
+{
+	__ovpn_encrypt_post(skb, ret, true);
+}
+
+/* account for a list of packets about to be encrypted with a key slot having
+ * traffic limits
+ */
+static int ovpn_key_volume_xmit(struct ovpn_peer *peer,
+				struct ovpn_crypto_key_slot *ks,
+				struct sk_buff_head *list)
+{
+	struct sk_buff *curr;
+	u64 bytes = 0;
+
+	skb_queue_walk(list, curr)
+		bytes += curr->len;
+
+	return ovpn_key_volume_account(peer, ks, skb_queue_len(list), bytes);
+}
+
+/* Segment a GSO packet about to be encrypted and queue its segments to list.
+ * No feature is passed to skb_gso_segment() on purpose: without NETIF_F_SG
+ * and checksum offload, skb_segment() copies the payload of every segment
+ * into a new linear skb and checksums it in the same pass, so that each byte
+ * is touched once before the cipher reads it, and the linear segments are
+ * then encrypted in place
+ */
+static void ovpn_encrypt_segment(struct ovpn_peer *peer, struct sk_buff *skb,
+				 struct sk_buff_head *list)
+{
+	struct sk_buff *segments, *curr, *next;
+
+	segments = skb_gso_segment(skb, 0);
+	if (IS_ERR(segments)) {
+		net_err_ratelimited("%s: cannot segment packet for peer %u: %ld\n",
+				    peer->ovpn->dev->name, peer->id,
+				    PTR_ERR(segments));
+		skb_tx_error(skb);
+		ovpn_peer_tx_drop(peer, skb, OVPN_DROP_SEGMENT);
+		return;
+	}
+
+	ovpn_dev_stats_add(peer->ovpn, tx_gso_segments,
+			   skb_shinfo(skb)->gso_segs);
+	consume_skb(skb);
+
+	skb_list_walk_safe(segments, curr, next) {
+		skb_mark_not_on_list(curr);
+		__skb_queue_tail(list, curr);
+	}
+}
+
+/**
+ * ovpn_encrypt_list - encrypt a list of packets directed to the same peer
+ * @peer: the peer the packets should be sent to
+ * @skb: the first packet of the list
+ * @mode: how the UDP packets encrypted synchronously are sent
+ *
+ * The primary key slot is looked up only once for the whole list and all
+ * the references required by ovpn_encrypt_post() are taken in one go, so
+ * that the packets can be handed to the crypto engine back-to-back. The key
+ * slot is referenced only if it may complete requests asynchronously or on
+ * another CPU, otherwise it is protected by RCU until the whole list is
+ * encrypted.
+ *
+ * GSO packets are segmented here, right before encryption, so that the
+ * path from the stack down to this point handles one skb per burst.
+ *
+ * Packet IDs are reserved here as one block and assigned in list order. On
+ * interfaces encrypting in parallel, packets are then spread over the
+ * parallel CPUs.
+ *
+ * UDP packets encrypted synchronously by ndo_start_xmit() join the TX batch
+ * of the CPU, sent once the stack is done passing packets down. Those of the
+ * keepalive worker rather join the packets completed by async engines, all
+ * sent together by the NAPI context of the CPU.
+ *
+ * Packets stop being charged to the socket they come from here, since the
+ * tunnel holds them back on its own from now on: the TX queue feeding the
+ * peer is stopped by in-flight async requests, by the backlog of a TCP
+ * transport or by the send buffer of the UDP socket, which is charged with
+ * the encrypted packets. Inner TCP flows are thus not throttled by TSQ while
+ * packets are encrypted or queued for the transport.
+ */
+void ovpn_encrypt_list(struct ovpn_peer *peer, struct sk_buff *skb,
+		       enum ovpn_tx_mode mode)
 {
+	struct sk_buff_head list, batch, *batchp = NULL;
 	struct ovpn_crypto_key_slot *ks;
+	struct sk_buff *curr, *next;
+	bool parallel, inherit, pmtu_disc;
+	unsigned int n;
+	int ret, pid_err;
+	u8 comp_stub;
+	u64 pktid, start;
 
-	if (unlikely(skb->ip_summed == CHECKSUM_PARTIAL &&
-		     skb_checksum_help(skb))) {
-		net_warn_ratelimited("%s: cannot compute checksum for outgoing packet\n",
-				     peer->ovpn->dev->name);
-		return false;
+	__skb_queue_head_init(&list);
+	skb_list_walk_safe(skb, curr, next) {
+		skb_mark_not_on_list(curr);
+		/* before segmenting, so that segments are not charged */
+		skb_orphan(curr);
+
+		if (skb_is_gso(curr)) {
+			ovpn_encrypt_segment(peer, curr, &list);
+			continue;
+		}
+
+		/* the checksum is covered by the AEAD tag, still the inner
+		 * packet has to carry it once decrypted by the peer. Cloned
+		 * packets are rather checksummed on their way to the cipher
+		 */
+		if (unlikely(curr->ip_summed == CHECKSUM_PARTIAL &&
+			     !ovpn_aead_csum_deferrable(curr) &&
+			     skb_checksum_help(curr))) {
+			net_warn_ratelimited("%s: cannot compute checksum for outgoing packet\n",
+					     peer->ovpn->dev->name);
+			ovpn_peer_tx_drop(peer, curr, OVPN_DROP_CHECKSUM);
+			continue;
+		}
+
+		__skb_queue_tail(&list, curr);
 	}
 
+	n = skb_queue_len(&list);
+	if (unlikely(!n))
+		return;
+
+	parallel = !!peer->ovpn->padata_tx;
+	inherit = peer->ovpn->inherit_dsfield;
+	pmtu_disc = peer->ovpn->pmtu_disc;
+	comp_stub = READ_ONCE(peer->comp_stub);
+
+	rcu_read_lock();
 	/* get primary key to be used for encrypting data */
 	ks = ovpn_crypto_key_slot_primary(&peer->crypto);
-	if (unlikely(!ks)) {
+	trace_ovpn_key_select(peer->id, ks ? ks->key_id : 0, true, !!ks);
+	if (unlikely(!ks || ((ks->async || parallel) &&
+			     !refcount_add_not_zero(n, &ks->refcount.refcount)))) {
+		rcu_read_unlock();
 		net_warn_ratelimited("%s: error while retrieving primary key slot for peer %u\n",
 				     peer->ovpn->dev->name, peer->id);
+		while ((curr = __skb_dequeue(&list)))
+			ovpn_peer_tx_drop(peer, curr, OVPN_DROP_NO_KEY);
+		return;
+	}
+
+	/* each packet carries its own reference to the peer (and to the key
+	 * slot, if async or parallel) because the crypto code may run async.
+	 * ovpn_encrypt_post() will release them upon completion. The caller
+	 * may rely on RCU only, while the peer is being released
+	 */
+	if (unlikely(!refcount_add_not_zero(n, &peer->refcount.refcount))) {
+		while ((curr = __skb_dequeue(&list))) {
+			if (ks->async || parallel)
+				ovpn_crypto_key_slot_put(ks);
+			ovpn_peer_tx_drop(peer, curr, OVPN_DROP_NO_PEER);
+		}
+		rcu_read_unlock();
+		return;
+	}
+
+	/* stop feeding the engine with packets of this peer once it holds too
+	 * many of them. The packets of the list are submitted anyway, as they
+	 * have already left the qdisc
+	 */
+	if (ks->async)
+		ovpn_crypto_inflight_tx_add(peer, n);
+
+	ovpn_dev_stats_hist(peer->ovpn, crypto_batch, n);
+
+	/* over UDP, multiple packets can be coalesced into one GSO packet,
+	 * also across transmissions. Packets encrypted in parallel are rather
+	 * sent one by one, once their turn comes
+	 */
+	if ((n > 1 || mode != OVPN_TX_NOW) && !parallel &&
+	    ovpn_peer_is_udp(peer)) {
+		__skb_queue_head_init(&batch);
+		batchp = &batch;
+	}
+
+	/* the packet IDs of the whole list are reserved in one go */
+	pid_err = ovpn_pktid_xmit_reserve(&ks->pid_xmit, n, &pktid);
+	/* ask userspace to rekey early enough for the new key to be in place
+	 * before this one runs out of IDs. Epoch keys rotate on their own
+	 */
+	if (unlikely(ovpn_pktid_xmit_rekey_due(&ks->pid_xmit,
+					       pid_err ? ks->pid_xmit.limit :
+							 pktid + n))) {
+		if (ks->epoch)
+			ovpn_epoch_request(peer, ks, false);
+		else
+			ovpn_nl_notify_swap_keys(peer);
+	}
+
+	/* a key past its hard traffic limit fails closed like one out of
+	 * packet IDs
+	 */
+	if (unlikely(ks->volume_limited) && !pid_err)
+		pid_err = ovpn_key_volume_xmit(peer, ks, &list);
+
+	while ((curr = __skb_dequeue(&list))) {
+		ovpn_skb_cb(curr)->peer = peer;
+		ovpn_skb_cb(curr)->ks = ks;
+		ovpn_skb_cb(curr)->ks_held = ks->async || parallel;
+		ovpn_skb_cb(curr)->req = NULL;
+		ovpn_skb_cb(curr)->batch = batchp;
+		ovpn_skb_cb(curr)->orig_len = curr->len;
+		ovpn_skb_cb(curr)->skb = NULL;
+		ovpn_skb_cb(curr)->parallel = false;
+		ovpn_skb_cb(curr)->mem_charged = false;
+		ovpn_sample_skb(peer, curr, ks->key_id, true);
+		/* the inner header is not readable anymore once encrypted */
+		ovpn_skb_cb(curr)->dsfield = inherit ? ovpn_ip_dsfield(curr) : 0;
+		ovpn_skb_cb(curr)->df = pmtu_disc && ovpn_ip_df(curr);
+
+		/* no ID left for the list: the key is killed by the first
+		 * packet and all of them are dropped
+		 */
+		if (unlikely(pid_err < 0)) {
+			ovpn_encrypt_post(curr, pid_err);
+			continue;
+		}
+
+		/* the framing moves bytes around: no checksum is deferred */
+		if (unlikely(comp_stub) &&
+		    ((curr->ip_summed == CHECKSUM_PARTIAL &&
+		      skb_checksum_help(curr)) ||
+		     ovpn_comp_stub_frame(curr, comp_stub))) {
+			ovpn_encrypt_post(curr, -ENOMEM);
+			continue;
+		}
+
+		/* dropped before taking a packet ID, which is not lost */
+		if (ovpn_skb_cb(curr)->ks_held &&
+		    unlikely(!ovpn_mem_charge_skb(peer->ovpn, curr))) {
+			ovpn_encrypt_post(curr, -EDQUOT);
+			continue;
+		}
+
+		trace_ovpn_encrypt_submit(curr, peer->id, ks->key_id, pktid,
+					  ks->async || parallel);
+
+		if (parallel && ovpn_parallel_encrypt(peer->ovpn, curr, pktid)) {
+			pktid++;
+			continue;
+		}
+
+		start = ovpn_cputime_start(peer);
+		ret = ovpn_aead_encrypt(ks, &curr, peer->id, pktid++);
+		ovpn_cputime_end(peer, true, start);
+		ovpn_encrypt_post(curr, ret);
+	}
+
+	rcu_read_unlock();
+
+	if (!batchp || skb_queue_empty(batchp))
+		return;
+
+	switch (mode) {
+	case OVPN_TX_XMIT:
+		ovpn_udp_tx_batch_add(peer, batchp);
+		break;
+	case OVPN_TX_NAPI:
+		while ((curr = __skb_dequeue(batchp))) {
+			/* released by the NAPI context once sent */
+			kref_get(&peer->refcount);
+			ovpn_napi_send(peer->ovpn, curr);
+		}
+		break;
+	default:
+		ovpn_udp_send_skb_list(peer->ovpn, peer, batchp);
+		break;
+	}
+}
+
+/* tell the sender of skb that it does not fit the MTU of its peer */
+static void ovpn_tx_frag_needed(struct sk_buff *skb, unsigned int mtu)
+{
+	if (skb->protocol == htons(ETH_P_IP))
+		icmp_ndo_send(skb, ICMP_DEST_UNREACH, ICMP_FRAG_NEEDED,
+			      htonl(mtu));
+	else
+		icmpv6_ndo_send(skb, ICMPV6_PKT_TOOBIG, 0, mtu);
+}
+
+/* whether skb exceeds the MTU of its peer and should be bounced back.
+ * No path MTU below the IPv6 minimum can be reported to IPv6 senders, their
+ * packets are rather sent as they are
+ */
+static bool ovpn_tx_too_big(struct sk_buff *skb, unsigned int mtu)
+{
+	/* GSO packets are checked against the size of their segments */
+	if (skb_is_gso(skb) ? skb_gso_validate_network_len(skb, mtu) :
+			      skb->len <= mtu)
+		return false;
+
+	if (!ovpn_ip_df(skb))
 		return false;
+
+	return skb->protocol == htons(ETH_P_IP) || mtu >= IPV6_MIN_MTU;
+}
+
+/* drop the packets of list exceeding the TX rate limit or the MTU of peer,
+ * clamp the MSS of the TCP SYNs left and return what is left of the list
+ */
+static struct sk_buff *ovpn_tx_filter(struct ovpn_peer *peer,
+				      struct sk_buff *skb)
+{
+	struct sk_buff *curr, *next, *head = NULL, **tail = &head;
+	bool clamp = test_bit(OVPN_PEER_MSS_CLAMP, &peer->flags);
+	bool police = !!READ_ONCE(peer->tx_limit.rate);
+	unsigned int mtu = ovpn_peer_mtu(peer);
+	enum ovpn_drop_reason reason;
+
+	/* every packet of the stack goes through here, keepalives do not */
+	ovpn_peer_activity_reset(peer);
+
+	if (likely(!police && !mtu && !clamp))
+		return skb;
+
+	skb_list_walk_safe(skb, curr, next) {
+		if (unlikely(mtu && ovpn_tx_too_big(curr, mtu))) {
+			ovpn_tx_frag_needed(curr, mtu);
+			reason = OVPN_DROP_PMTU;
+		} else if (unlikely(police &&
+				    !ovpn_ratelimit_allow(&peer->tx_limit,
+							  curr->len))) {
+			reason = OVPN_DROP_RATE_LIMIT;
+		} else {
+			if (clamp)
+				ovpn_mss_clamp(curr, mtu ?:
+					       READ_ONCE(peer->ovpn->dev->mtu));
+			*tail = curr;
+			tail = &curr->next;
+			continue;
+		}
+
+		skb_mark_not_on_list(curr);
+		ovpn_peer_tx_drop(peer, curr, reason);
 	}
+	*tail = NULL;
 
-	ovpn_skb_cb(skb)->peer = peer;
-	ovpn_skb_cb(skb)->orig_len = skb->len;
+	return head;
+}
+
+/**
+ * ovpn_send_peer - send packets of the stack to a peer
+ * @peer: the peer to send the packets to
+ * @skb: the first packet of the list to send
+ * @mode: how the encrypted packets should be sent
+ *
+ * Packets are filtered and wait for the turn of their peer, if fair queuing
+ * is enabled. Assumes that caller holds a reference to peer.
+ */
+void ovpn_send_peer(struct ovpn_peer *peer, struct sk_buff *skb,
+		    enum ovpn_tx_mode mode)
+{
+	struct sk_buff *curr;
+
+	skb = ovpn_tx_filter(peer, skb);
+	if (!skb)
+		return;
+
+	if (unlikely(rcu_access_pointer(peer->mirror)))
+		for (curr = skb; curr; curr = curr->next)
+			__ovpn_mirror_skb(peer, curr, false);
+
+	/* GSO packets are segmented only when their turn to be encrypted
+	 * comes
+	 */
+	if (peer->ovpn->sched)
+		ovpn_sched_enqueue(peer, skb);
+	else
+		ovpn_encrypt_list(peer, skb, mode);
+}
 
-	/* take a reference to the peer because the crypto code may run async.
-	 * ovpn_encrypt_post() will release it upon completion
+/* forward a packet decrypted for peer straight to the peer serving its
+ * destination, without a round trip through the network stack. Packets not
+ * directed to another peer are left to the stack.
+ *
+ * Return: true if skb was consumed
+ */
+static bool ovpn_c2c_forward(struct ovpn_peer *peer, struct sk_buff *skb)
+{
+	struct ovpn_struct *ovpn = peer->ovpn;
+	struct ovpn_peer *dst;
+
+	/* the route of the transport packet must not be mistaken for the
+	 * one of the tunneled packet by the lookup of the destination
 	 */
-	DEBUG_NET_WARN_ON_ONCE(!ovpn_peer_hold(peer));
-	ovpn_encrypt_post(skb, ovpn_aead_encrypt(ks, skb, peer->id));
+	skb_scrub_packet(skb, true);
+
+	dst = ovpn_peer_get_by_dst(ovpn, skb);
+	if (!dst)
+		return false;
+
+	if (unlikely(dst == peer)) {
+		ovpn_peer_put(dst);
+		return false;
+	}
+
+	/* the inner checksum is left as the sender computed it, the
+	 * packet is not routed and therefore its TTL is left untouched
+	 */
+	skb->dev = ovpn->dev;
+	skb->ip_summed = CHECKSUM_NONE;
+	ovpn_dev_stats_inc(ovpn, rx_c2c_forwarded);
+
+	ovpn_send_peer(dst, skb, OVPN_TX_NOW);
+	ovpn_peer_put(dst);
+
 	return true;
 }
 
-/* send skb to connected peer, if any */
-static void ovpn_send(struct ovpn_struct *ovpn, struct sk_buff *skb,
-		      struct ovpn_peer *peer)
+/**
+ * ovpn_send - send packets to their peer
+ * @ovpn: the instance the packets are sent on
+ * @skb: the first packet of the list to send
+ * @peer: the peer to send the packets to (NULL for packets of the stack, sent
+ *	  to the peer serving their destination)
+ * @mode: how the encrypted packets should be sent
+ *
+ * Must be called with BHs disabled and under RCU, like ndo_start_xmit().
+ */
+void ovpn_send(struct ovpn_struct *ovpn, struct sk_buff *skb,
+	       struct ovpn_peer *peer, enum ovpn_tx_mode mode)
 {
-	struct sk_buff *curr, *next;
+	/* packets of the stack are filtered and wait for the turn of their
+	 * peer, while keepalives skip both
+	 */
+	bool from_stack = !peer;
+
+	/* the single peer of a P2P instance is protected by the RCU read side
+	 * section of the transmission: the references the packets need are
+	 * taken by ovpn_encrypt_list(), without holding one for the lookup
+	 */
+	if (from_stack && ovpn_mode_p2p(ovpn)) {
+		peer = rcu_dereference_bh(ovpn->peer);
+		if (likely(peer)) {
+			skb = ovpn_tx_filter(peer, skb);
+			if (skb)
+				ovpn_encrypt_list(peer, skb, mode);
+			return;
+		}
+	}
+
+	/* groups without members are looked up like any other destination */
+	if (from_stack && !ovpn_mode_p2p(ovpn) &&
+	    unlikely(ovpn_mcast_is_group(skb)) &&
+	    ovpn_mcast_xmit(ovpn, skb, mode))
+		return;
 
 	if (likely(!peer))
 		/* retrieve peer serving the destination IP of this packet */
@@ -300,25 +1393,225 @@ static void ovpn_send(struct ovpn_struct *ovpn, struct sk_buff *skb,
 	if (unlikely(!peer)) {
 		net_dbg_ratelimited("%s: no peer to send data to\n",
 				    ovpn->dev->name);
-		dev_core_stats_tx_dropped_inc(ovpn->dev);
-		goto drop;
+		ovpn_dev_stats_inc(ovpn, peer_miss_dst);
+		ovpn_drop_count(ovpn, true, OVPN_DROP_NO_PEER);
+		kfree_skb_list_reason(skb, (enum skb_drop_reason)
+					   OVPN_DROP_NO_PEER);
+		return;
 	}
 
-	/* this might be a GSO-segmented skb list: process each skb
-	 * independently
-	 */
-	skb_list_walk_safe(skb, curr, next)
-		if (unlikely(!ovpn_encrypt_one(peer, curr))) {
-			dev_core_stats_tx_dropped_inc(ovpn->dev);
-			kfree_skb(curr);
-		}
+	if (from_stack)
+		ovpn_send_peer(peer, skb, mode);
+	else
+		ovpn_encrypt_list(peer, skb, mode);
+	ovpn_peer_put(peer);
+}
 
-	/* skb passed over, no need to free */
-	skb = NULL;
-drop:
-	if (likely(peer))
+/**
+ * ovpn_net_select_queue - pick the TX queue for an outgoing packet
+ * @dev: the ovpn device
+ * @skb: the packet to send
+ * @sb_dev: subordinate device (unused)
+ *
+ * Packets directed to UDP peers are steered like by any multiqueue device:
+ * by XPS, which maps every CPU to a queue of its own by default, or by the
+ * flow hash otherwise. The flows of a peer are thus spread across queues,
+ * each of them staying on one queue, and are encrypted in parallel.
+ *
+ * The packets of TCP peers are rather steered by the ID of the peer, so that
+ * the stream of one peer is always serialized on the same queue, which is
+ * stopped while the socket of the peer is congested. Only MultiPeer instances
+ * serving TCP peers thus have to look up the destination peer here: the
+ * others pick the queue from the packet alone, leaving the lookup to
+ * ovpn_net_xmit().
+ *
+ * Return: the index of the selected TX queue
+ */
+u16 ovpn_net_select_queue(struct net_device *dev, struct sk_buff *skb,
+			  struct net_device *sb_dev)
+{
+	struct ovpn_struct *ovpn = netdev_priv(dev);
+	struct ovpn_peer *peer;
+	u16 queue = 0;
+
+	if (dev->real_num_tx_queues == 1)
+		return 0;
+
+	/* malformed packets are dropped by ovpn_net_xmit() */
+	if (unlikely(!ovpn_ip_check_protocol(skb)))
+		return 0;
+
+	/* called under RCU, like ndo_start_xmit() */
+	if (ovpn_mode_p2p(ovpn)) {
+		peer = rcu_dereference_bh(ovpn->peer);
+		if (!peer)
+			return 0;
+
+		return ovpn_peer_is_udp(peer) ?
+		       netdev_pick_tx(dev, skb, sb_dev) :
+		       ovpn_peer_queue(peer, dev->real_num_tx_queues);
+	}
+
+	if (likely(!atomic_read(&ovpn->tcp_peers)))
+		return netdev_pick_tx(dev, skb, sb_dev);
+
+	peer = ovpn_peer_get_by_dst(ovpn, skb);
+	if (likely(peer)) {
+		queue = ovpn_peer_is_udp(peer) ?
+			netdev_pick_tx(dev, skb, sb_dev) :
+			ovpn_peer_queue(peer, dev->real_num_tx_queues);
 		ovpn_peer_put(peer);
-	kfree_skb_list(skb);
+	}
+
+	return queue;
+}
+
+/* packets of the stack collected before being encrypted together */
+#define OVPN_TX_BATCH	64
+
+/**
+ * ovpn_tx_pending_alloc - allocate the per-CPU pending TX lists of an
+ *			   interface
+ * @ovpn: the instance to allocate the lists for
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_tx_pending_alloc(struct ovpn_struct *ovpn)
+{
+	int cpu;
+
+	ovpn->tx_pending = alloc_percpu(struct sk_buff_head);
+	if (!ovpn->tx_pending)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu)
+		__skb_queue_head_init(per_cpu_ptr(ovpn->tx_pending, cpu));
+
+	return 0;
+}
+
+/**
+ * ovpn_tx_pending_free - release the per-CPU pending TX lists of an interface
+ * @ovpn: the instance whose lists should be released
+ *
+ * Packets still waiting are dropped.
+ */
+void ovpn_tx_pending_free(struct ovpn_struct *ovpn)
+{
+	int cpu;
+
+	if (!ovpn->tx_pending)
+		return;
+
+	for_each_possible_cpu(cpu)
+		__skb_queue_purge(per_cpu_ptr(ovpn->tx_pending, cpu));
+
+	free_percpu(ovpn->tx_pending);
+	ovpn->tx_pending = NULL;
+}
+
+/* peers whose packets are gathered at once out of a pending TX list */
+#define OVPN_TX_STREAMS	8
+
+/**
+ * struct ovpn_tx_stream - packets of a pending TX list directed to a peer
+ * @peer: the peer the packets are directed to, referenced by the stream
+ * @head: the first packet of the stream
+ * @tail: where the next packet of the stream is linked
+ */
+struct ovpn_tx_stream {
+	struct ovpn_peer *peer;
+	struct sk_buff *head;
+	struct sk_buff **tail;
+};
+
+/* encrypt and send the packets gathered by the streams in use */
+static void ovpn_tx_streams_flush(struct ovpn_tx_stream *streams,
+				  unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		*streams[i].tail = NULL;
+		ovpn_send_peer(streams[i].peer, streams[i].head, OVPN_TX_XMIT);
+		ovpn_peer_put(streams[i].peer);
+	}
+}
+
+/* send the packets of the stack collected by the current CPU. The packets
+ * directed to the same peer are passed down as one list, so that they are
+ * encrypted in one go and coalesced into the same GSO trains even when the
+ * stack did not build GSO packets out of them.
+ *
+ * Packets of many peers are usually interleaved on servers: they are
+ * gathered by up to OVPN_TX_STREAMS peers at once, each keeping the order of
+ * its packets, rather than by runs of consecutive packets. Must be called
+ * with BHs disabled and under RCU, like ndo_start_xmit()
+ */
+static void ovpn_tx_pending_flush(struct ovpn_struct *ovpn)
+{
+	struct sk_buff_head *pending = this_cpu_ptr(ovpn->tx_pending);
+	struct ovpn_tx_stream streams[OVPN_TX_STREAMS];
+	struct sk_buff *skb, *head = NULL, **tail = &head;
+	struct sk_buff_head list;
+	struct ovpn_peer *peer;
+	unsigned int i, n = 0;
+
+	if (skb_queue_empty(pending))
+		return;
+
+	/* the list is reusable as soon as it is detached */
+	__skb_queue_head_init(&list);
+	skb_queue_splice_init(pending, &list);
+
+	/* all packets go to the single peer of a P2P instance */
+	if (ovpn_mode_p2p(ovpn)) {
+		while ((skb = __skb_dequeue(&list))) {
+			*tail = skb;
+			tail = &skb->next;
+		}
+		ovpn_send(ovpn, head, NULL, OVPN_TX_XMIT);
+		return;
+	}
+
+	while ((skb = __skb_dequeue(&list))) {
+		/* packets to groups and without a peer take the usual path,
+		 * which replicates or drops them
+		 */
+		peer = NULL;
+		if (likely(!ovpn_mcast_is_group(skb)))
+			peer = ovpn_peer_get_by_dst(ovpn, skb);
+		if (unlikely(!peer)) {
+			ovpn_send(ovpn, skb, NULL, OVPN_TX_XMIT);
+			continue;
+		}
+
+		for (i = 0; i < n; i++)
+			if (streams[i].peer == peer)
+				break;
+
+		if (i < n) {
+			/* the stream already holds a reference */
+			ovpn_peer_put(peer);
+		} else {
+			/* a peer has at most one stream: it is sent before
+			 * a new one may open
+			 */
+			if (n == OVPN_TX_STREAMS) {
+				ovpn_tx_streams_flush(streams, n);
+				n = 0;
+				i = 0;
+			}
+			streams[n].peer = peer;
+			streams[n].tail = &streams[n].head;
+			n++;
+		}
+
+		*streams[i].tail = skb;
+		streams[i].tail = &skb->next;
+	}
+
+	ovpn_tx_streams_flush(streams, n);
 }
 
 /* Send user data to the network
@@ -326,10 +1619,13 @@ static void ovpn_send(struct ovpn_struct *ovpn, struct sk_buff *skb,
 netdev_tx_t ovpn_net_xmit(struct sk_buff *skb, struct net_device *dev)
 {
 	struct ovpn_struct *ovpn = netdev_priv(dev);
-	struct sk_buff *segments, *tmp, *curr, *next;
-	struct sk_buff_head skb_list;
+	struct netdev_queue *txq;
+	enum ovpn_drop_reason reason;
+	netdev_tx_t ret = NET_XMIT_DROP;
+	struct sk_buff *tmp;
 	__be16 proto;
-	int ret;
+
+	txq = netdev_get_tx_queue(dev, skb_get_queue_mapping(skb));
 
 	/* reset netfilter state */
 	nf_reset_ct(skb);
@@ -339,55 +1635,89 @@ netdev_tx_t ovpn_net_xmit(struct sk_buff *skb, struct net_device *dev)
 	if (unlikely(!proto || skb->protocol != proto)) {
 		net_err_ratelimited("%s: dropping malformed payload packet\n",
 				    dev->name);
-		dev_core_stats_tx_dropped_inc(ovpn->dev);
+		reason = OVPN_DROP_MALFORMED;
 		goto drop;
 	}
 
-	if (skb_is_gso(skb)) {
-		segments = skb_gso_segment(skb, 0);
-		if (IS_ERR(segments)) {
-			ret = PTR_ERR(segments);
-			net_err_ratelimited("%s: cannot segment packet: %d\n",
-					    dev->name, ret);
-			dev_core_stats_tx_dropped_inc(ovpn->dev);
-			goto drop;
-		}
+	/* a shared skb is cloned, not copied: the data of the clone is left
+	 * untouched by encrypting it out of place
+	 */
+	if (unlikely(skb_shared(skb)))
+		ovpn_dev_stats_inc(ovpn, tx_shared);
+	tmp = skb_share_check(skb, GFP_ATOMIC);
+	if (unlikely(!tmp)) {
+		/* skb was released by skb_share_check() */
+		ovpn_drop_count(ovpn, true, OVPN_DROP_NOMEM);
+		net_err_ratelimited("%s: skb_share_check failed\n", dev->name);
+		goto out;
+	}
+	ovpn_latency_stamp_tx(ovpn, tmp);
+	ovpn_dev_stats_hist(ovpn, tx_gso_burst,
+			    skb_is_gso(tmp) ? skb_shinfo(tmp)->gso_segs : 1);
 
-		consume_skb(skb);
-		skb = segments;
+	/* GSO packets are segmented right before encryption. While the stack
+	 * has more packets to pass down, they are collected and encrypted
+	 * together once it stops
+	 */
+	if (ovpn->workers) {
+		ovpn_worker_xmit(ovpn, tmp);
+	} else {
+		__skb_queue_tail(this_cpu_ptr(ovpn->tx_pending), tmp);
+		if (skb_queue_len(this_cpu_ptr(ovpn->tx_pending)) >=
+		    OVPN_TX_BATCH)
+			ovpn_tx_pending_flush(ovpn);
 	}
+	ret = NETDEV_TX_OK;
+	goto out;
 
-	/* from this moment on, "skb" might be a list */
+drop:
+	skb_tx_error(skb);
+	ovpn_tx_drop(ovpn, skb, reason);
+out:
+	/* like the doorbell of a NIC, the TX batch is sent once the stack has
+	 * no more packets to pass down or the queue was stopped meanwhile
+	 */
+	if (!netdev_xmit_more() || netif_xmit_stopped(txq)) {
+		ovpn_tx_pending_flush(ovpn);
+		ovpn_udp_tx_batch_flush(ovpn);
+	}
+	return ret;
+}
 
-	__skb_queue_head_init(&skb_list);
-	skb_list_walk_safe(skb, curr, next) {
-		skb_mark_not_on_list(curr);
+/**
+ * ovpn_xdp_xmit - send frames redirected by an XDP program into the tunnel
+ * @dev: the ovpn device
+ * @n: number of frames
+ * @frames: the frames to send, starting with an Ethernet header
+ * @flags: XDP_XMIT_* flags
+ *
+ * Frames are turned into skbs and sent through the regular TX path.
+ *
+ * Return: the number of frames consumed or a negative error code
+ */
+int ovpn_xdp_xmit(struct net_device *dev, int n, struct xdp_frame **frames,
+		  u32 flags)
+{
+	struct sk_buff *skb;
+	int i;
+
+	if (unlikely(flags & ~XDP_XMIT_FLAGS_MASK))
+		return -EINVAL;
 
-		tmp = skb_share_check(curr, GFP_ATOMIC);
-		if (unlikely(!tmp)) {
-			kfree_skb_list(next);
-			net_err_ratelimited("%s: skb_share_check failed\n",
-					    dev->name);
-			goto drop_list;
+	for (i = 0; i < n; i++) {
+		/* the Ethernet header of the frame is stripped here */
+		skb = xdp_build_skb_from_frame(frames[i], dev);
+		if (unlikely(!skb)) {
+			ovpn_drop_count(netdev_priv(dev), true,
+					OVPN_DROP_NOMEM);
+			break;
 		}
 
-		__skb_queue_tail(&skb_list, tmp);
+		skb_reset_network_header(skb);
+		ovpn_net_xmit(skb, dev);
 	}
-	skb_list.prev->next = NULL;
-
-	ovpn_send(ovpn, skb_list.next, NULL);
 
-	return NETDEV_TX_OK;
-
-drop_list:
-	skb_queue_walk_safe(&skb_list, curr, next) {
-		dev_core_stats_tx_dropped_inc(ovpn->dev);
-		kfree_skb(curr);
-	}
-drop:
-	skb_tx_error(skb);
-	kfree_skb_list(skb);
-	return NET_XMIT_DROP;
+	return i;
 }
 
 /**
@@ -396,7 +1726,14 @@ netdev_tx_t ovpn_net_xmit(struct sk_buff *skb, struct net_device *dev)
  * @data: message content
  * @len: message length
  *
- * Assumes that caller holds a reference to peer
+ * Assumes that caller holds a reference to peer.
+ *
+ * Messages are small and sent for many peers at once by the keepalive
+ * worker: the skb is carved out of the per-CPU page fragment cache rather
+ * than kmalloc'ed, and it is sized for the whole outer packet, so that
+ * encryption happens in place without reallocating the head. Over UDP, the
+ * encrypted messages are sent in one go by the NAPI context of the CPU once
+ * the worker enables BHs again.
  */
 static void ovpn_xmit_special(struct ovpn_peer *peer, const void *data,
 			      const unsigned int len)
@@ -408,11 +1745,11 @@ static void ovpn_xmit_special(struct ovpn_peer *peer, const void *data,
 	if (unlikely(!ovpn))
 		return;
 
-	skb = alloc_skb(256 + len, GFP_ATOMIC);
+	skb = netdev_alloc_skb(ovpn->dev, OVPN_SPECIAL_HEADROOM + len);
 	if (unlikely(!skb))
 		return;
 
-	skb_reserve(skb, 128);
+	skb_reserve(skb, OVPN_SPECIAL_HEADROOM);
 	skb->priority = TC_PRIO_BESTEFFORT;
 	memcpy(__skb_put(skb, len), data, len);
 
@@ -424,15 +1761,37 @@ static void ovpn_xmit_special(struct ovpn_peer *peer, const void *data,
 		return;
 	}
 
-	ovpn_send(ovpn, skb, peer);
+	ovpn_send(ovpn, skb, peer, OVPN_TX_NAPI);
 }
 
 /**
  * ovpn_keepalive_xmit - send keepalive message to peer
  * @peer: the peer to send the message to
+ *
+ * Must be called with BHs disabled: see ovpn_xmit_special().
  */
 void ovpn_keepalive_xmit(struct ovpn_peer *peer)
 {
+	ovpn_dev_stats_inc(peer->ovpn, keepalive_tx);
 	ovpn_xmit_special(peer, ovpn_keepalive_message,
 			  sizeof(ovpn_keepalive_message));
 }
+
+/**
+ * ovpn_probe_msg_xmit - send a probe message to peer
+ * @peer: the peer to send the message to
+ * @t: the trailer of the message, following the keepalive message
+ *
+ * Must be called with BHs disabled: see ovpn_xmit_special().
+ */
+void ovpn_probe_msg_xmit(struct ovpn_peer *peer,
+			 const struct ovpn_probe_trailer *t)
+{
+	u8 msg[sizeof(ovpn_keepalive_message) + sizeof(*t)];
+
+	memcpy(msg, ovpn_keepalive_message, sizeof(ovpn_keepalive_message));
+	memcpy(msg + sizeof(ovpn_keepalive_message), t, sizeof(*t));
+
+	ovpn_dev_stats_inc(peer->ovpn, keepalive_tx);
+	ovpn_xmit_special(peer, msg, sizeof(msg));
+}
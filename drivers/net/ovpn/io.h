@@ -10,12 +10,40 @@
 #ifndef _NET_OVPN_OVPN_H_
 #define _NET_OVPN_OVPN_H_
 
+struct ovpn_probe_trailer;
+struct ovpn_struct;
+struct sk_buff_head;
+struct xdp_frame;
+
+/* how ovpn_encrypt_list() sends the UDP packets it encrypts synchronously */
+enum ovpn_tx_mode {
+	OVPN_TX_NOW,	/* right away */
+	OVPN_TX_XMIT,	/* with the TX batch of the CPU */
+	OVPN_TX_NAPI,	/* by the NAPI context of the CPU */
+};
+
 netdev_tx_t ovpn_net_xmit(struct sk_buff *skb, struct net_device *dev);
+int ovpn_tx_pending_alloc(struct ovpn_struct *ovpn);
+void ovpn_tx_pending_free(struct ovpn_struct *ovpn);
+u16 ovpn_net_select_queue(struct net_device *dev, struct sk_buff *skb,
+			  struct net_device *sb_dev);
+int ovpn_xdp_xmit(struct net_device *dev, int n, struct xdp_frame **frames,
+		  u32 flags);
 
 void ovpn_recv(struct ovpn_peer *peer, struct sk_buff *skb);
+void ovpn_recv_list(struct ovpn_peer *peer, struct sk_buff_head *list);
 void ovpn_keepalive_xmit(struct ovpn_peer *peer);
+void ovpn_probe_msg_xmit(struct ovpn_peer *peer,
+			 const struct ovpn_probe_trailer *t);
 
+void ovpn_encrypt_list(struct ovpn_peer *peer, struct sk_buff *skb,
+		       enum ovpn_tx_mode mode);
+void ovpn_send_peer(struct ovpn_peer *peer, struct sk_buff *skb,
+		    enum ovpn_tx_mode mode);
+void ovpn_send(struct ovpn_struct *ovpn, struct sk_buff *skb,
+	       struct ovpn_peer *peer, enum ovpn_tx_mode mode);
 void ovpn_encrypt_post(struct sk_buff *skb, int ret);
+void ovpn_encrypt_post_async(struct sk_buff *skb, int ret);
 void ovpn_decrypt_post(struct sk_buff *skb, int ret);
 
 #endif /* _NET_OVPN_OVPN_H_ */
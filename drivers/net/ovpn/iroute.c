@@ -0,0 +1,331 @@
+// SPDX-License-Identifier: GPL-2.0
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include <linux/bitops.h>
+#include <linux/netdevice.h>
+#include <linux/slab.h>
+
+#include "ovpnstruct.h"
+#include "iroute.h"
+#include "peer.h"
+
+/* The iroute table is a path-compressed binary trie, one per address
+ * family. Every node stores a prefix: children extend it by at least one
+ * bit and are indexed by the first bit following the parent prefix.
+ * Intermediate nodes (with no peer) are only created to split two subtrees
+ * and always have two children.
+ *
+ * Lookups walk the trie under RCU. Writers are serialized by the lock of
+ * the peer collection.
+ */
+
+/* dereference a trie pointer while holding the peers lock */
+#define ovpn_iroute_deref(_p, _peers) \
+	rcu_dereference_protected(_p, lockdep_is_held(&(_peers)->lock))
+
+static unsigned int ovpn_iroute_max_prefixlen(sa_family_t family)
+{
+	return family == AF_INET ? 32 : 128;
+}
+
+static struct ovpn_iroute __rcu **
+ovpn_iroute_root(struct ovpn_peer_collection *peers, sa_family_t family)
+{
+	return family == AF_INET ? &peers->iroutes4 : &peers->iroutes6;
+}
+
+/* value of the bit at position index (0 being the MSB of the first byte) */
+static unsigned int ovpn_iroute_bit(const u8 *addr, unsigned int index)
+{
+	return !!(addr[index / 8] & (0x80 >> (index % 8)));
+}
+
+/* number of leading bits shared by node prefix and addr, up to limit */
+static unsigned int ovpn_iroute_match_len(const struct ovpn_iroute *node,
+					  const u8 *addr, unsigned int limit)
+{
+	unsigned int len = 0, i;
+	u8 diff;
+
+	limit = min_t(unsigned int, limit, node->prefixlen);
+
+	for (i = 0; len < limit; i++) {
+		diff = node->addr[i] ^ addr[i];
+		if (diff) {
+			len += 7 - __fls(diff);
+			break;
+		}
+		len += 8;
+	}
+
+	return min(len, limit);
+}
+
+/* copy addr into key, clearing all bits following the prefix */
+static void ovpn_iroute_key(u8 *key, const void *addr, sa_family_t family,
+			    unsigned int prefixlen)
+{
+	unsigned int size = ovpn_iroute_max_prefixlen(family) / 8;
+
+	memset(key, 0, sizeof(struct in6_addr));
+	memcpy(key, addr, size);
+
+	if (prefixlen % 8)
+		key[prefixlen / 8] &= 0xff << (8 - prefixlen % 8);
+	if (DIV_ROUND_UP(prefixlen, 8) < size)
+		memset(key + DIV_ROUND_UP(prefixlen, 8), 0,
+		       size - DIV_ROUND_UP(prefixlen, 8));
+}
+
+/**
+ * ovpn_iroute_lookup - find the peer a destination is routed to
+ * @ovpn: the instance to search
+ * @family: address family of addr
+ * @addr: the address to look up, in network byte order
+ *
+ * Must be called under RCU read lock. No reference is taken on the returned
+ * peer.
+ *
+ * Return: the peer owning the longest prefix matching addr or NULL if no
+ * prefix matches
+ */
+struct ovpn_peer *ovpn_iroute_lookup(struct ovpn_struct *ovpn,
+				     sa_family_t family, const void *addr)
+{
+	unsigned int maxlen = ovpn_iroute_max_prefixlen(family);
+	struct ovpn_peer *peer, *found = NULL;
+	const struct ovpn_iroute *node;
+	unsigned int bit;
+
+	node = rcu_dereference(*ovpn_iroute_root(ovpn->peers, family));
+	while (node) {
+		if (ovpn_iroute_match_len(node, addr, maxlen) < node->prefixlen)
+			break;
+
+		peer = READ_ONCE(node->peer);
+		if (peer)
+			found = peer;
+
+		if (node->prefixlen == maxlen)
+			break;
+
+		bit = ovpn_iroute_bit(addr, node->prefixlen);
+		node = rcu_dereference(node->child[bit]);
+	}
+
+	return found;
+}
+
+/* invalidate the peers cached for the destinations, the release pairs with
+ * ovpn_peer_get_by_dst(). Must be called with the peers lock held
+ */
+static void ovpn_iroute_changed(struct ovpn_peer_collection *peers)
+{
+	smp_store_release(&peers->genid, peers->genid + 1);
+}
+
+/**
+ * ovpn_iroute_add - route a prefix to a peer
+ * @peer: the peer the prefix should be routed to
+ * @family: address family of the prefix
+ * @addr: the prefix, in network byte order
+ * @prefixlen: length of the prefix in bits
+ *
+ * Return: 0 on success, -EEXIST if the prefix is already routed or another
+ * negative error code otherwise
+ */
+int ovpn_iroute_add(struct ovpn_peer *peer, sa_family_t family,
+		    const void *addr, u8 prefixlen)
+{
+	struct ovpn_peer_collection *peers = peer->ovpn->peers;
+	struct ovpn_iroute __rcu **slot;
+	struct ovpn_iroute *node, *new, *im;
+	unsigned int matchlen = 0;
+	int ret = 0;
+
+	if (prefixlen > ovpn_iroute_max_prefixlen(family))
+		return -EINVAL;
+
+	/* allocate here an intermediate node too, in case one is needed to
+	 * split a subtree, so that no allocation happens under lock
+	 */
+	new = kzalloc(sizeof(*new), GFP_KERNEL);
+	im = kzalloc(sizeof(*im), GFP_KERNEL);
+	if (!new || !im) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	new->peer = peer;
+	new->family = family;
+	new->prefixlen = prefixlen;
+	ovpn_iroute_key(new->addr, addr, family, prefixlen);
+
+	ovpn_spin_lock_bh_stat(peer->ovpn, &peers->lock,
+			       lock_peers_contended);
+	/* the peer may have been removed in the meantime */
+	if (xa_load(&peers->by_id, peer->id) != peer) {
+		ret = -ENOENT;
+		goto unlock;
+	}
+
+	slot = ovpn_iroute_root(peers, family);
+	while ((node = ovpn_iroute_deref(*slot, peers))) {
+		matchlen = ovpn_iroute_match_len(node, new->addr, prefixlen);
+		if (node->prefixlen != matchlen || node->prefixlen == prefixlen)
+			break;
+
+		slot = &node->child[ovpn_iroute_bit(new->addr,
+						    node->prefixlen)];
+	}
+
+	if (!node) {
+		rcu_assign_pointer(*slot, new);
+	} else if (node->prefixlen == prefixlen && matchlen == prefixlen) {
+		/* same prefix: only an intermediate node can be claimed */
+		if (node->peer) {
+			ret = -EEXIST;
+			goto unlock;
+		}
+
+		list_add(&node->peer_entry, &peer->iroutes);
+		WRITE_ONCE(node->peer, peer);
+		ovpn_iroute_changed(peers);
+		goto unlock;
+	} else if (matchlen == prefixlen) {
+		/* the new prefix includes the existing node */
+		RCU_INIT_POINTER(new->child[ovpn_iroute_bit(node->addr,
+							    matchlen)], node);
+		rcu_assign_pointer(*slot, new);
+	} else {
+		/* prefixes diverge: split them under an intermediate node */
+		im->family = family;
+		im->prefixlen = matchlen;
+		ovpn_iroute_key(im->addr, new->addr, family, matchlen);
+		INIT_LIST_HEAD(&im->peer_entry);
+
+		if (ovpn_iroute_bit(new->addr, matchlen)) {
+			RCU_INIT_POINTER(im->child[0], node);
+			RCU_INIT_POINTER(im->child[1], new);
+		} else {
+			RCU_INIT_POINTER(im->child[0], new);
+			RCU_INIT_POINTER(im->child[1], node);
+		}
+		rcu_assign_pointer(*slot, im);
+		im = NULL;
+	}
+
+	list_add(&new->peer_entry, &peer->iroutes);
+	ovpn_iroute_changed(peers);
+	new = NULL;
+unlock:
+	spin_unlock_bh(&peers->lock);
+out:
+	kfree(new);
+	kfree(im);
+	return ret;
+}
+
+/* remove a prefix from the trie. Must be called with the peers lock held */
+static int __ovpn_iroute_del(struct ovpn_peer_collection *peers,
+			     sa_family_t family, const u8 *key, u8 prefixlen)
+{
+	struct ovpn_iroute __rcu **slot, **parent_slot = NULL;
+	struct ovpn_iroute *node, *parent = NULL, *c0, *c1;
+	unsigned int matchlen = 0;
+
+	slot = ovpn_iroute_root(peers, family);
+	while ((node = ovpn_iroute_deref(*slot, peers))) {
+		matchlen = ovpn_iroute_match_len(node, key, prefixlen);
+		if (node->prefixlen != matchlen || node->prefixlen == prefixlen)
+			break;
+
+		parent = node;
+		parent_slot = slot;
+		slot = &node->child[ovpn_iroute_bit(key, node->prefixlen)];
+	}
+
+	if (!node || node->prefixlen != prefixlen || matchlen != prefixlen ||
+	    !node->peer)
+		return -ENOENT;
+
+	list_del_init(&node->peer_entry);
+
+	c0 = ovpn_iroute_deref(node->child[0], peers);
+	c1 = ovpn_iroute_deref(node->child[1], peers);
+
+	/* still needed to split its subtrees: turn into intermediate node */
+	if (c0 && c1) {
+		WRITE_ONCE(node->peer, NULL);
+		return 0;
+	}
+
+	/* a leaf below an intermediate node: the latter is not needed anymore
+	 * and is replaced by the sibling subtree
+	 */
+	if (parent && !parent->peer && !c0 && !c1) {
+		if (rcu_access_pointer(parent->child[0]) == node)
+			c0 = ovpn_iroute_deref(parent->child[1], peers);
+		else
+			c0 = ovpn_iroute_deref(parent->child[0], peers);
+		rcu_assign_pointer(*parent_slot, c0);
+		kfree_rcu(parent, rcu);
+		kfree_rcu(node, rcu);
+		return 0;
+	}
+
+	rcu_assign_pointer(*slot, c0 ? c0 : c1);
+	kfree_rcu(node, rcu);
+	return 0;
+}
+
+/**
+ * ovpn_iroute_del - stop routing a prefix
+ * @ovpn: the instance to remove the prefix from
+ * @family: address family of the prefix
+ * @addr: the prefix, in network byte order
+ * @prefixlen: length of the prefix in bits
+ *
+ * Return: 0 on success or -ENOENT if the prefix is not routed
+ */
+int ovpn_iroute_del(struct ovpn_struct *ovpn, sa_family_t family,
+		    const void *addr, u8 prefixlen)
+{
+	u8 key[sizeof(struct in6_addr)];
+	int ret;
+
+	if (prefixlen > ovpn_iroute_max_prefixlen(family))
+		return -EINVAL;
+
+	ovpn_iroute_key(key, addr, family, prefixlen);
+
+	ovpn_spin_lock_bh_stat(ovpn, &ovpn->peers->lock,
+			       lock_peers_contended);
+	ret = __ovpn_iroute_del(ovpn->peers, family, key, prefixlen);
+	if (!ret)
+		ovpn_iroute_changed(ovpn->peers);
+	spin_unlock_bh(&ovpn->peers->lock);
+
+	return ret;
+}
+
+/**
+ * ovpn_iroute_flush_peer - stop routing all prefixes of a peer
+ * @peer: the peer being removed
+ *
+ * Must be called with the peers lock held.
+ */
+void ovpn_iroute_flush_peer(struct ovpn_peer *peer)
+{
+	struct ovpn_iroute *node, *tmp;
+
+	list_for_each_entry_safe(node, tmp, &peer->iroutes, peer_entry)
+		__ovpn_iroute_del(peer->ovpn->peers, node->family, node->addr,
+				  node->prefixlen);
+	ovpn_iroute_changed(peer->ovpn->peers);
+}
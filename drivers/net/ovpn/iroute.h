@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_IROUTE_H_
+#define _NET_OVPN_IROUTE_H_
+
+#include <linux/in6.h>
+#include <linux/list.h>
+#include <linux/rcupdate.h>
+#include <linux/socket.h>
+
+struct ovpn_peer;
+struct ovpn_struct;
+
+/**
+ * struct ovpn_iroute - node of the iroute longest-prefix-match trie
+ * @child: subtrees of prefixes longer than this one, indexed by the first bit
+ *	   following the prefix
+ * @peer: the peer the prefix is routed to (NULL for intermediate nodes)
+ * @peer_entry: entry in the list of prefixes routed to the peer
+ * @rcu: used to free the node in an RCU safe way
+ * @family: address family of the prefix
+ * @prefixlen: length of the prefix in bits
+ * @addr: the prefix (bits past prefixlen are zero), in network byte order
+ */
+struct ovpn_iroute {
+	struct ovpn_iroute __rcu *child[2];
+	struct ovpn_peer *peer;
+	struct list_head peer_entry;
+	struct rcu_head rcu;
+	sa_family_t family;
+	u8 prefixlen;
+	u8 addr[sizeof(struct in6_addr)];
+};
+
+int ovpn_iroute_add(struct ovpn_peer *peer, sa_family_t family,
+		    const void *addr, u8 prefixlen);
+int ovpn_iroute_del(struct ovpn_struct *ovpn, sa_family_t family,
+		    const void *addr, u8 prefixlen);
+void ovpn_iroute_flush_peer(struct ovpn_peer *peer);
+struct ovpn_peer *ovpn_iroute_lookup(struct ovpn_struct *ovpn,
+				     sa_family_t family, const void *addr);
+
+#endif /* _NET_OVPN_IROUTE_H_ */
@@ -0,0 +1,119 @@
+// SPDX-License-Identifier: GPL-2.0
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include <linux/bitops.h>
+#include <linux/minmax.h>
+#include <linux/netdevice.h>
+
+#include "ovpnstruct.h"
+#include "latency.h"
+#include "peer.h"
+
+/* enabled as long as at least one interface keeps latency histograms */
+DEFINE_STATIC_KEY_FALSE(ovpn_latency_enabled);
+
+/**
+ * ovpn_latency_record - account for one latency sample
+ * @latency: the per-CPU histograms to update
+ * @tx: whether the sample belongs to the TX or to the RX histogram
+ * @start: monotonic time the packet entered ovpn at
+ */
+void ovpn_latency_record(struct ovpn_peer_latency __percpu *latency, bool tx,
+			 ktime_t start)
+{
+	struct ovpn_peer_latency *lat;
+	unsigned long flags;
+	s64 ns;
+	int i;
+
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	i = ns > 0 ? min(fls64(ns), OVPN_LATENCY_BUCKETS - 1) : 0;
+
+	lat = get_cpu_ptr(latency);
+	/* the TCP transport may receive from process context */
+	flags = u64_stats_update_begin_irqsave(&lat->syncp);
+	u64_stats_inc(tx ? &lat->tx[i] : &lat->rx[i]);
+	u64_stats_update_end_irqrestore(&lat->syncp, flags);
+	put_cpu_ptr(latency);
+}
+
+/**
+ * ovpn_latency_init - allocate the latency histograms of a new peer
+ * @peer: the peer, whose histograms are allocated only if its interface
+ *	  keeps them
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_latency_init(struct ovpn_peer *peer)
+{
+	if (!peer->ovpn->latency_hist)
+		return 0;
+
+	peer->latency = netdev_alloc_pcpu_stats(struct ovpn_peer_latency);
+	if (!peer->latency)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/**
+ * ovpn_latency_fetch - sum up per-CPU latency histograms
+ * @latency: the per-CPU histograms to read
+ * @tx: array of OVPN_LATENCY_BUCKETS elements to store the TX histogram into
+ * @rx: array of OVPN_LATENCY_BUCKETS elements to store the RX histogram into
+ */
+void ovpn_latency_fetch(const struct ovpn_peer_latency __percpu *latency,
+			u64 *tx, u64 *rx)
+{
+	u64 tmp_tx[OVPN_LATENCY_BUCKETS], tmp_rx[OVPN_LATENCY_BUCKETS];
+	const struct ovpn_peer_latency *lat;
+	unsigned int start;
+	int cpu, i;
+
+	memset(tx, 0, sizeof(*tx) * OVPN_LATENCY_BUCKETS);
+	memset(rx, 0, sizeof(*rx) * OVPN_LATENCY_BUCKETS);
+
+	for_each_possible_cpu(cpu) {
+		lat = per_cpu_ptr(latency, cpu);
+		do {
+			start = u64_stats_fetch_begin(&lat->syncp);
+			for (i = 0; i < OVPN_LATENCY_BUCKETS; i++) {
+				tmp_tx[i] = u64_stats_read(&lat->tx[i]);
+				tmp_rx[i] = u64_stats_read(&lat->rx[i]);
+			}
+		} while (u64_stats_fetch_retry(&lat->syncp, start));
+
+		for (i = 0; i < OVPN_LATENCY_BUCKETS; i++) {
+			tx[i] += tmp_tx[i];
+			rx[i] += tmp_rx[i];
+		}
+	}
+}
+
+/**
+ * ovpn_latency_enable - start keeping latency histograms for an interface
+ * @ovpn: the instance, which must not have any peer yet
+ */
+void ovpn_latency_enable(struct ovpn_struct *ovpn)
+{
+	ovpn->latency_hist = true;
+	static_branch_inc(&ovpn_latency_enabled);
+}
+
+/**
+ * ovpn_latency_disable - stop keeping latency histograms for an interface
+ * @ovpn: the instance, which must not have any peer left
+ */
+void ovpn_latency_disable(struct ovpn_struct *ovpn)
+{
+	if (!ovpn->latency_hist)
+		return;
+
+	ovpn->latency_hist = false;
+	static_branch_dec(&ovpn_latency_enabled);
+}
@@ -0,0 +1,123 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_LATENCY_H_
+#define _NET_OVPN_LATENCY_H_
+
+#include <linux/jump_label.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/skbuff.h>
+#include <linux/u64_stats_sync.h>
+#include <uapi/linux/ovpn.h>
+
+#include "ovpnstruct.h"
+#include "peer.h"
+#include "skb.h"
+
+/* Latency histograms measure the time a packet spends inside ovpn: on TX
+ * from ovpn_net_xmit() to the hand-off to the transport socket, on RX from
+ * the reception on the transport socket to the delivery to the interface.
+ *
+ * The start time travels with the packet in skb->tstamp, as a monotonic
+ * delivery time: it is set on entry and cleared on exit, so that it is
+ * never seen outside ovpn. Coalesced UDP trains are sampled through their
+ * first packet. Packets to send already carrying a delivery time, like the
+ * departure time of paced TCP flows, keep it for the qdisc of the lower
+ * device and are not sampled.
+ *
+ * Bucket i counts the packets whose latency in nanoseconds is below 2^i
+ * (and not below 2^(i-1)), the last bucket also counts all slower packets.
+ */
+
+DECLARE_STATIC_KEY_FALSE(ovpn_latency_enabled);
+
+/**
+ * struct ovpn_peer_latency - per-CPU latency histograms of a peer
+ * @tx: packets sent, per bucket
+ * @rx: packets received, per bucket
+ * @syncp: synchronization point for 64bit counters on 32bit architectures
+ */
+struct ovpn_peer_latency {
+	u64_stats_t tx[OVPN_LATENCY_BUCKETS];
+	u64_stats_t rx[OVPN_LATENCY_BUCKETS];
+	struct u64_stats_sync syncp;
+};
+
+void ovpn_latency_record(struct ovpn_peer_latency __percpu *latency, bool tx,
+			 ktime_t start);
+
+/**
+ * ovpn_latency_stamp - record when a packet entered ovpn
+ * @ovpn: the instance the packet entered
+ * @skb: the packet
+ */
+static inline void ovpn_latency_stamp(const struct ovpn_struct *ovpn,
+				      struct sk_buff *skb)
+{
+	if (static_branch_unlikely(&ovpn_latency_enabled) && ovpn->latency_hist)
+		skb_set_delivery_time(skb, ktime_get(), SKB_CLOCK_MONOTONIC);
+}
+
+/**
+ * ovpn_latency_stamp_tx - record when a packet to send entered ovpn
+ * @ovpn: the instance the packet entered
+ * @skb: the packet, owned by the caller
+ *
+ * A delivery time set by the stack is preserved.
+ */
+static inline void ovpn_latency_stamp_tx(const struct ovpn_struct *ovpn,
+					 struct sk_buff *skb)
+{
+	ovpn_skb_cb(skb)->own_tstamp = !skb->tstamp;
+	if (ovpn_skb_cb(skb)->own_tstamp)
+		ovpn_latency_stamp(ovpn, skb);
+}
+
+/* account for the time since the packet was stamped, if it was */
+static inline void __ovpn_latency_done(struct ovpn_peer *peer,
+				       struct sk_buff *skb, bool tx)
+{
+	if (!static_branch_unlikely(&ovpn_latency_enabled) || !peer->latency)
+		return;
+
+	if (!skb->tstamp || skb->tstamp_type != SKB_CLOCK_MONOTONIC)
+		return;
+
+	ovpn_latency_record(peer->latency, tx, skb->tstamp);
+	skb_set_delivery_time(skb, 0, SKB_CLOCK_MONOTONIC);
+}
+
+/**
+ * ovpn_latency_tx - account for a packet handed to the transport socket
+ * @peer: the peer the packet is sent to
+ * @skb: the packet
+ */
+static inline void ovpn_latency_tx(struct ovpn_peer *peer, struct sk_buff *skb)
+{
+	if (ovpn_skb_cb(skb)->own_tstamp)
+		__ovpn_latency_done(peer, skb, true);
+}
+
+/**
+ * ovpn_latency_rx - account for a packet delivered to the interface
+ * @peer: the peer the packet was received from
+ * @skb: the packet as received on the transport socket
+ */
+static inline void ovpn_latency_rx(struct ovpn_peer *peer, struct sk_buff *skb)
+{
+	__ovpn_latency_done(peer, skb, false);
+}
+
+int ovpn_latency_init(struct ovpn_peer *peer);
+void ovpn_latency_fetch(const struct ovpn_peer_latency __percpu *latency,
+			u64 *tx, u64 *rx);
+void ovpn_latency_enable(struct ovpn_struct *ovpn);
+void ovpn_latency_disable(struct ovpn_struct *ovpn);
+
+#endif /* _NET_OVPN_LATENCY_H_ */
@@ -7,6 +7,7 @@
  *		James Yonan <james@openvpn.net>
  */
 
+#include <linux/bpf.h>
 #include <linux/ethtool.h>
 #include <linux/genetlink.h>
 #include <linux/module.h>
@@ -14,7 +15,6 @@
 #include <linux/inetdevice.h>
 //#include <linux/rcupdate.h>
 #include <linux/version.h>
-#include <net/gro_cells.h>
 #include <net/ip.h>
 #include <net/rtnetlink.h>
 #include <uapi/linux/if_arp.h>
@@ -22,63 +22,277 @@
 
 #include "ovpnstruct.h"
 #include "main.h"
+#include "bench.h"
+#include "bpf.h"
+#include "crypto_aead.h"
+#include "ctrl.h"
+#include "demux.h"
 #include "netlink.h"
 #include "io.h"
+#include "cputime.h"
+#include "latency.h"
+#include "mem.h"
+#include "monitor.h"
+#include "napi.h"
 #include "packet.h"
+#include "parallel.h"
 #include "peer.h"
+#include "route.h"
+#include "rxpool.h"
+#include "sample.h"
+#include "sched.h"
+#include "stats.h"
 #include "tcp.h"
+#include "topk.h"
+#include "udp.h"
+#include "worker.h"
+
+#define CREATE_TRACE_POINTS
+#include <trace/events/ovpn.h>
 
 /* Driver info */
 #define DRV_DESCRIPTION	"OpenVPN data channel offload (ovpn)"
 #define DRV_COPYRIGHT	"(C) 2020-2024 OpenVPN, Inc."
 
+/* enabled as long as any MP instance exists, see ovpn_mode_p2p() */
+DEFINE_STATIC_KEY_FALSE(ovpn_mp_enabled);
+
 /**
  * ovpn_struct_init - Initialize the netdevice private area
  * @dev: the device to initialize
- * @mode: device operation mode (i.e. p2p, mp, ..)
+ * @conf: the configuration of the device
  *
  * Return: 0 on success or a negative error code otherwise
  */
-static int ovpn_struct_init(struct net_device *dev, enum ovpn_mode mode)
+static int ovpn_struct_init(struct net_device *dev,
+			    const struct ovpn_iface_config *conf)
 {
 	struct ovpn_struct *ovpn = netdev_priv(dev);
+	enum ovpn_cipher_alg alg;
+	int ret = -ENOMEM;
 
 	ovpn->dev = dev;
-	ovpn->mode = mode;
+	ovpn->mode = conf->mode;
+	ovpn->compact_keys = conf->compact_keys;
+	ovpn->lib_max_len = conf->lib_max_len;
+	/* a single peer has nobody to share the interface with */
+	ovpn->fair_queue = conf->fair_queue && conf->mode == OVPN_MODE_MP;
+	ovpn->inherit_dsfield = conf->inherit_dsfield;
+	ovpn->pmtu_disc = conf->pmtu_disc;
+	ovpn->client_to_client = conf->client_to_client &&
+				 conf->mode == OVPN_MODE_MP;
+	ovpn->threaded = conf->threaded;
+	ovpn->compact = conf->compact;
+	/* the peer IDs of the instances sharing a socket are indexed per
+	 * netns: the instance cannot move to another one
+	 */
+	ovpn->shared_socket = conf->shared_socket &&
+			      conf->mode == OVPN_MODE_MP;
+	if (ovpn->shared_socket)
+		dev->features |= NETIF_F_NETNS_LOCAL;
+	ovpn->shared_napi = conf->shared_napi;
+	ovpn->direct_xmit = conf->direct_xmit;
+	/* AEAD authenticates the payload already */
+	ovpn->udp_zero_csum = conf->udp_zero_csum;
+	ovpn->udp6_zero_csum = conf->udp6_zero_csum;
+	/* ICMP errors about packets exceeding the MTU of their peer are
+	 * routed back by means of the dst of the packet
+	 */
+	netif_keep_dst(dev);
 	spin_lock_init(&ovpn->lock);
+	INIT_DELAYED_WORK(&ovpn->keepalive_work, ovpn_peer_keepalive_work);
+	init_llist_head(&ovpn->float_list);
+	INIT_WORK(&ovpn->float_work, ovpn_peer_float_work);
+	init_llist_head(&ovpn->float_notify_list);
+	INIT_DELAYED_WORK(&ovpn->float_notify_work, ovpn_peer_float_notify_work);
+
+	ovpn->stats = netdev_alloc_pcpu_stats(struct ovpn_dev_stats);
+	if (!ovpn->stats)
+		return -ENOMEM;
+
+	if (ovpn_udp_tx_batch_alloc(ovpn) < 0)
+		goto err_stats;
+
+	if (ovpn_tx_pending_alloc(ovpn) < 0)
+		goto err_batch;
 
-	if (mode == OVPN_MODE_MP) {
+	if (conf->mode == OVPN_MODE_MP) {
 		/* the peer container is fairly large, therefore we dynamically
-		 * allocate it only when needed
+		 * allocate it only when the first peer is added
 		 */
-		ovpn->peers = kzalloc(sizeof(*ovpn->peers), GFP_KERNEL);
-		if (!ovpn->peers)
-			return -ENOMEM;
+		ovpn->peers = ovpn_peers_empty;
+		ovpn->table_size = conf->table_size;
+	}
 
-		spin_lock_init(&ovpn->peers->lock);
+	if (conf->shared_dst_cache) {
+		ovpn->routes = ovpn_route_table_alloc();
+		if (!ovpn->routes)
+			goto err_pending;
 	}
 
+	ovpn->tfm_pool = ovpn_aead_tfm_pool_alloc();
+	if (!ovpn->tfm_pool)
+		goto err_routes;
+
+	for (alg = 0; alg <= OVPN_CIPHER_ALG_CHACHA20_POLY1305; alg++) {
+		if (!conf->aead_drivers[alg])
+			continue;
+
+		ret = ovpn_aead_tfm_pool_set_driver(ovpn->tfm_pool, alg,
+						    conf->aead_drivers[alg]);
+		if (ret < 0)
+			goto err_tfms;
+	}
+
+	ret = ovpn_rx_pools_init(ovpn);
+	if (ret < 0)
+		goto err_tfms;
+
+	if (conf->parallel_rx || conf->parallel_tx ||
+	    conf->parallel_rx_adaptive) {
+		ret = ovpn_parallel_init(ovpn, conf->parallel_rx ||
+					       conf->parallel_rx_adaptive,
+					 conf->parallel_tx,
+					 conf->parallel_rx_adaptive,
+					 conf->parallel_cpus);
+		if (ret < 0)
+			goto err_pools;
+	}
+
+	if (conf->ctrl_netlink) {
+		ret = ovpn_ctrl_init(ovpn);
+		if (ret < 0)
+			goto err_parallel;
+	}
+
+	if (conf->stats_interval) {
+		ret = ovpn_monitor_init(ovpn, conf->stats_interval);
+		if (ret < 0)
+			goto err_ctrl;
+	}
+
+	if (conf->top_talkers) {
+		ret = ovpn_topk_init(ovpn);
+		if (ret < 0)
+			goto err_monitor;
+	}
+
+	if (conf->sample_rate) {
+		ret = ovpn_sample_init(ovpn, conf->sample_rate);
+		if (ret < 0)
+			goto err_topk;
+	}
+
+	if (conf->mem_budget) {
+		ret = ovpn_mem_init(ovpn, (u64)conf->mem_budget * 1024);
+		if (ret < 0)
+			goto err_sample;
+	}
+
+	if (conf->latency_hist)
+		ovpn_latency_enable(ovpn);
+
+	if (conf->cputime_acct)
+		ovpn_cputime_enable(ovpn);
+
+	if (conf->mode == OVPN_MODE_MP)
+		static_branch_inc(&ovpn_mp_enabled);
+
 	return 0;
+
+err_sample:
+	ovpn_sample_destroy(ovpn);
+err_topk:
+	ovpn_topk_free(ovpn);
+err_monitor:
+	ovpn_monitor_destroy(ovpn);
+err_ctrl:
+	ovpn_ctrl_destroy(ovpn);
+err_parallel:
+	ovpn_parallel_free(ovpn);
+err_pools:
+	ovpn_rx_pools_free(ovpn);
+err_tfms:
+	ovpn_aead_tfm_pool_free(ovpn->tfm_pool);
+	ovpn->tfm_pool = NULL;
+err_routes:
+	ovpn_route_table_free(ovpn->routes);
+	ovpn->routes = NULL;
+err_pending:
+	ovpn_tx_pending_free(ovpn);
+err_batch:
+	ovpn_udp_tx_batch_free(ovpn);
+err_stats:
+	free_percpu(ovpn->stats);
+	ovpn->stats = NULL;
+	return ret;
 }
 
 static void ovpn_struct_free(struct net_device *net)
 {
 	struct ovpn_struct *ovpn = netdev_priv(net);
 
-	gro_cells_destroy(&ovpn->gro_cells);
-	kfree(ovpn->peers);
+	cancel_delayed_work_sync(&ovpn->keepalive_work);
+	ovpn_monitor_destroy(ovpn);
+	/* drop the references held on floated peers */
+	flush_work(&ovpn->float_work);
+	flush_delayed_work(&ovpn->float_notify_work);
+	/* the kthreads hand packets to the scheduler and the NAPI contexts */
+	ovpn_worker_destroy(ovpn);
+	/* the scheduler hands packets to the NAPI contexts */
+	ovpn_sched_destroy(ovpn);
+	ovpn_tx_pending_free(ovpn);
+	ovpn_udp_tx_batch_free(ovpn);
+	ovpn_napi_destroy(ovpn);
+	ovpn_peer_collection_free(ovpn->peers);
 	rcu_barrier();
+	/* no control packet is received anymore */
+	ovpn_ctrl_destroy(ovpn);
+	/* nor any packet sampled */
+	ovpn_sample_destroy(ovpn);
+	ovpn_latency_disable(ovpn);
+	ovpn_cputime_disable(ovpn);
+	ovpn_topk_free(ovpn);
+	/* key slots report to the stats until their RCU destructor is done */
+	free_percpu(ovpn->stats);
+	ovpn_aead_tfm_pool_free(ovpn->tfm_pool);
+	ovpn_route_table_free(ovpn->routes);
+	ovpn_rx_pools_free(ovpn);
+	ovpn_parallel_free(ovpn);
+	/* no packet is held by the device anymore */
+	ovpn_mem_destroy(ovpn);
+
+	if (ovpn->mode == OVPN_MODE_MP)
+		static_branch_dec(&ovpn_mp_enabled);
 }
 
 static int ovpn_net_init(struct net_device *dev)
 {
 	struct ovpn_struct *ovpn = netdev_priv(dev);
-	int err = gro_cells_init(&ovpn->gro_cells, dev);
+	int err = ovpn_napi_init(ovpn);
 	struct in_device *dev_v4;
 
 	if (err)
 		return err;
 
+	if (ovpn->fair_queue) {
+		err = ovpn_sched_init(ovpn);
+		if (err) {
+			ovpn_napi_destroy(ovpn);
+			return err;
+		}
+	}
+
+	/* the kthreads are named after the interface */
+	if (ovpn->threaded) {
+		err = ovpn_worker_init(ovpn);
+		if (err) {
+			ovpn_sched_destroy(ovpn);
+			ovpn_napi_destroy(ovpn);
+			return err;
+		}
+	}
+
 	if (ovpn->mode == OVPN_MODE_MP) {
 		dev_v4 = __in_dev_get_rtnl(dev);
 		if (dev_v4) {
@@ -106,20 +320,48 @@ static int ovpn_net_open(struct net_device *dev)
 	 */
 	netif_carrier_on(dev);
 	netif_tx_start_all_queues(dev);
+	ovpn_monitor_start(netdev_priv(dev));
 	return 0;
 }
 
 static int ovpn_net_stop(struct net_device *dev)
 {
+	ovpn_monitor_stop(netdev_priv(dev));
 	netif_tx_stop_all_queues(dev);
 	return 0;
 }
 
+static int ovpn_xdp_set(struct net_device *dev, struct bpf_prog *prog)
+{
+	struct ovpn_struct *ovpn = netdev_priv(dev);
+	struct bpf_prog *old_prog;
+
+	old_prog = rtnl_dereference(ovpn->xdp_prog);
+	rcu_assign_pointer(ovpn->xdp_prog, prog);
+	if (old_prog)
+		bpf_prog_put(old_prog);
+
+	return 0;
+}
+
+static int ovpn_xdp(struct net_device *dev, struct netdev_bpf *xdp)
+{
+	switch (xdp->command) {
+	case XDP_SETUP_PROG:
+		return ovpn_xdp_set(dev, xdp->prog);
+	default:
+		return -EINVAL;
+	}
+}
+
 static const struct net_device_ops ovpn_netdev_ops = {
 	.ndo_init		= ovpn_net_init,
 	.ndo_open		= ovpn_net_open,
 	.ndo_stop		= ovpn_net_stop,
 	.ndo_start_xmit		= ovpn_net_xmit,
+	.ndo_select_queue	= ovpn_net_select_queue,
+	.ndo_bpf		= ovpn_xdp,
+	.ndo_xdp_xmit		= ovpn_xdp_xmit,
 };
 
 /**
@@ -140,10 +382,42 @@ static void ovpn_get_drvinfo(struct net_device *dev,
 	strscpy(info->bus_info, "ovpn", sizeof(info->bus_info));
 }
 
+static int ovpn_get_sset_count(struct net_device *dev, int sset)
+{
+	switch (sset) {
+	case ETH_SS_STATS:
+		return ovpn_dev_stats_count() + ovpn_rx_pools_stats_count();
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static void ovpn_get_strings(struct net_device *dev, u32 sset, u8 *data)
+{
+	switch (sset) {
+	case ETH_SS_STATS:
+		ovpn_dev_stats_strings(data);
+		ovpn_rx_pools_stats_strings(data + ovpn_dev_stats_count() *
+					    ETH_GSTRING_LEN);
+		break;
+	}
+}
+
+static void ovpn_get_ethtool_stats(struct net_device *dev,
+				   struct ethtool_stats *stats, u64 *data)
+{
+	ovpn_dev_stats_fetch(netdev_priv(dev), data);
+	ovpn_rx_pools_stats_fetch(netdev_priv(dev),
+				  data + ovpn_dev_stats_count());
+}
+
 static const struct ethtool_ops ovpn_ethtool_ops = {
 	.get_drvinfo		= ovpn_get_drvinfo,
 	.get_link		= ethtool_op_get_link,
 	.get_ts_info		= ethtool_op_get_ts_info,
+	.get_sset_count		= ovpn_get_sset_count,
+	.get_strings		= ovpn_get_strings,
+	.get_ethtool_stats	= ovpn_get_ethtool_stats,
 };
 
 /* we register with rtnl to let core know that ovpn is a virtual driver and
@@ -188,14 +462,49 @@ static void ovpn_setup(struct net_device *dev)
 	dev->hw_features |= feat;
 	dev->hw_enc_features |= feat;
 
+	/* GSO packets are segmented in software right before encryption, so
+	 * any size is fine: let the admin enable BIG TCP by raising
+	 * gso_max_size and gso_ipv4_max_size
+	 */
+	netif_set_tso_max_size(dev, GSO_MAX_SIZE);
+
 	dev->needed_headroom = OVPN_HEAD_ROOM;
 	dev->needed_tailroom = OVPN_MAX_PADDING;
+
+	dev->xdp_features = NETDEV_XDP_ACT_BASIC | NETDEV_XDP_ACT_REDIRECT |
+			    NETDEV_XDP_ACT_NDO_XMIT;
+}
+
+/* map the CPUs to the TX queues in turn, so that by default XPS makes every
+ * CPU send from a queue of its own as long as there are enough queues
+ */
+static void ovpn_xps_init(struct net_device *dev)
+{
+	unsigned int queue, cpu;
+	cpumask_var_t cpus;
+
+	if (dev->real_num_tx_queues == 1)
+		return;
+
+	if (!zalloc_cpumask_var(&cpus, GFP_KERNEL))
+		return;
+
+	for (queue = 0; queue < dev->real_num_tx_queues; queue++) {
+		cpumask_clear(cpus);
+		for_each_possible_cpu(cpu)
+			if (cpu % dev->real_num_tx_queues == queue)
+				cpumask_set_cpu(cpu, cpus);
+
+		netif_set_xps_queue(dev, cpus, queue);
+	}
+
+	free_cpumask_var(cpus);
 }
 
 /**
  * ovpn_iface_create - create and initialize a new 'ovpn' netdevice
  * @name: the name of the new device
- * @mode: the OpenVPN mode to set this device to
+ * @conf: the configuration of the device
  * @net: the netns this device should be created in
  *
  * A new netdevice is created and registered.
@@ -204,20 +513,21 @@ static void ovpn_setup(struct net_device *dev)
  * Return: a pointer to the new device on success or a negative error code
  *         otherwise
  */
-struct net_device *ovpn_iface_create(const char *name, enum ovpn_mode mode,
+struct net_device *ovpn_iface_create(const char *name,
+				     const struct ovpn_iface_config *conf,
 				     struct net *net)
 {
 	struct net_device *dev;
 	int ret;
 
-	dev = alloc_netdev(sizeof(struct ovpn_struct), name, NET_NAME_USER,
-			   ovpn_setup);
+	dev = alloc_netdev_mqs(sizeof(struct ovpn_struct), name, NET_NAME_USER,
+			       ovpn_setup, conf->txqs, conf->rxqs);
 	if (!dev)
 		return ERR_PTR(-ENOMEM);
 
 	dev_net_set(dev, net);
 
-	ret = ovpn_struct_init(dev, mode);
+	ret = ovpn_struct_init(dev, conf);
 	if (ret < 0)
 		goto err;
 
@@ -234,6 +544,8 @@ struct net_device *ovpn_iface_create(const char *name, enum ovpn_mode mode,
 	netif_carrier_off(dev);
 	rtnl_unlock();
 
+	ovpn_xps_init(dev);
+
 	return dev;
 
 err:
@@ -254,7 +566,8 @@ void ovpn_iface_destruct(struct ovpn_struct *ovpn)
 
 	netif_carrier_off(ovpn->dev);
 
-	ovpn->registered = false;
+	WRITE_ONCE(ovpn->registered, false);
+	cancel_delayed_work_sync(&ovpn->keepalive_work);
 
 	switch (ovpn->mode) {
 	case OVPN_MODE_P2P:
@@ -266,14 +579,42 @@ void ovpn_iface_destruct(struct ovpn_struct *ovpn)
 	}
 }
 
+/* let the instances of the netns of a lower device react to it going up or
+ * down: the notifiers of the routing tables, registered at boot, already ran
+ */
+static void ovpn_lower_dev_event(struct net_device *dev, bool up)
+{
+	struct net_device *iter;
+
+	ASSERT_RTNL();
+
+	for_each_netdev(dev_net(dev), iter) {
+		if (ovpn_dev_is_valid(iter))
+			ovpn_peers_link_event(netdev_priv(iter), dev, up);
+	}
+}
+
 static int ovpn_netdev_notifier_call(struct notifier_block *nb,
 				     unsigned long state, void *ptr)
 {
 	struct net_device *dev = netdev_notifier_info_to_dev(ptr);
 	struct ovpn_struct *ovpn;
 
-	if (!ovpn_dev_is_valid(dev))
+	if (!ovpn_dev_is_valid(dev)) {
+		switch (state) {
+		case NETDEV_UNREGISTER:
+		case NETDEV_DOWN:
+			ovpn_lower_dev_event(dev, false);
+			break;
+		case NETDEV_UP:
+		case NETDEV_CHANGE:
+			/* carrier changes are reported as NETDEV_CHANGE */
+			ovpn_lower_dev_event(dev, netif_running(dev) &&
+						  netif_carrier_ok(dev));
+			break;
+		}
 		return NOTIFY_DONE;
+	}
 
 	ovpn = netdev_priv(dev);
 
@@ -313,13 +654,43 @@ static struct notifier_block ovpn_netdev_notifier = {
 
 static int __init ovpn_init(void)
 {
-	int err = register_netdevice_notifier(&ovpn_netdev_notifier);
+	int err;
+
+	/* before the netlink family lets keys be created */
+	ovpn_aead_select_drivers();
 
+	err = ovpn_tcp_init();
 	if (err) {
-		pr_err("ovpn: can't register netdevice notifier: %d\n", err);
+		pr_err("ovpn: can't initialize TCP support: %d\n", err);
 		return err;
 	}
 
+	ovpn_drop_reasons_register();
+
+	err = ovpn_peer_collections_init();
+	if (err) {
+		pr_err("ovpn: can't allocate the empty peer tables: %d\n", err);
+		goto cleanup_tcp;
+	}
+
+	err = ovpn_demux_init();
+	if (err) {
+		pr_err("ovpn: can't register pernet operations: %d\n", err);
+		goto cleanup_peers;
+	}
+
+	err = ovpn_route_neigh_init();
+	if (err) {
+		pr_err("ovpn: can't register netevent notifier: %d\n", err);
+		goto cleanup_demux;
+	}
+
+	err = register_netdevice_notifier(&ovpn_netdev_notifier);
+	if (err) {
+		pr_err("ovpn: can't register netdevice notifier: %d\n", err);
+		goto cleanup_neigh;
+	}
+
 	err = rtnl_link_register(&ovpn_link_ops);
 	if (err) {
 		pr_err("ovpn: can't register rtnl link ops: %d\n", err);
@@ -332,14 +703,31 @@ static int __init ovpn_init(void)
 		goto unreg_rtnl;
 	}
 
-	ovpn_tcp_init();
+	err = ovpn_bpf_init();
+	if (err) {
+		pr_err("ovpn: can't register BPF kfuncs: %d\n", err);
+		goto unreg_nl;
+	}
+
+	ovpn_bench_run();
 
 	return 0;
 
+unreg_nl:
+	ovpn_nl_unregister();
 unreg_rtnl:
 	rtnl_link_unregister(&ovpn_link_ops);
 unreg_netdev:
 	unregister_netdevice_notifier(&ovpn_netdev_notifier);
+cleanup_neigh:
+	ovpn_route_neigh_cleanup();
+cleanup_demux:
+	ovpn_demux_cleanup();
+cleanup_peers:
+	ovpn_peer_collections_cleanup();
+cleanup_tcp:
+	ovpn_drop_reasons_unregister();
+	ovpn_tcp_cleanup();
 	return err;
 }
 
@@ -348,8 +736,13 @@ static __exit void ovpn_cleanup(void)
 	ovpn_nl_unregister();
 	rtnl_link_unregister(&ovpn_link_ops);
 	unregister_netdevice_notifier(&ovpn_netdev_notifier);
+	ovpn_route_neigh_cleanup();
+	ovpn_demux_cleanup();
 
 	rcu_barrier();
+	ovpn_peer_collections_cleanup();
+	ovpn_drop_reasons_unregister();
+	ovpn_tcp_cleanup();
 }
 
 module_init(ovpn_init);
@@ -10,9 +10,118 @@
 #ifndef _NET_OVPN_MAIN_H_
 #define _NET_OVPN_MAIN_H_
 
+#include <linux/jump_label.h>
+
+#include "ovpnstruct.h"
+
 #define OVPN_DEFAULT_IFNAME "ovpn%d"
 
-struct net_device *ovpn_iface_create(const char *name, enum ovpn_mode mode,
+struct cpumask;
+
+DECLARE_STATIC_KEY_FALSE(ovpn_mp_enabled);
+
+/**
+ * ovpn_mode_p2p - check whether an instance serves a single peer
+ * @ovpn: the instance to check
+ *
+ * As long as no MP instance exists, the check is patched out of the
+ * datapath and P2P instances take their fast path unconditionally.
+ *
+ * Return: true if @ovpn is in P2P mode, false otherwise
+ */
+static inline bool ovpn_mode_p2p(const struct ovpn_struct *ovpn)
+{
+	return !static_branch_unlikely(&ovpn_mp_enabled) ||
+	       ovpn->mode == OVPN_MODE_P2P;
+}
+
+/**
+ * struct ovpn_iface_config - configuration of a new interface
+ * @mode: device operation mode (i.e. p2p, mp, ..)
+ * @txqs: number of TX queues of the device
+ * @rxqs: number of RX queues of the device
+ * @table_size: number of buckets in each peer table (MultiPeer mode only)
+ * @shared_dst_cache: whether peers should share one route cache
+ * @parallel_rx: whether received packets should be decrypted in parallel
+ * @parallel_tx: whether sent packets should be encrypted in parallel
+ * @parallel_cpus: CPUs packets are encrypted/decrypted on (NULL for all)
+ * @compact_keys: whether AES-GCM keys should be used via the AES-GCM library
+ * @lib_max_len: largest linear packet AES-GCM keys encrypt/decrypt via the
+ *		 AES-GCM library even if they have transforms (0 to disable)
+ * @aead_drivers: crypto driver to use for each cipher (NULL for the default)
+ * @latency_hist: whether peers should keep latency histograms
+ * @fair_queue: whether packets to send should be scheduled fairly among peers
+ *		in MultiPeer mode
+ * @inherit_dsfield: whether the outer headers should inherit DSCP and ECN from
+ *		     the packets they tunnel (UDP only)
+ * @pmtu_disc: whether packets exceeding the path MTU of their peer should be
+ *	       bounced back with ICMP errors (UDP only)
+ * @ctrl_netlink: whether the control packets of known peers should be
+ *		  delivered to userspace in batches over netlink
+ * @stats_interval: seconds between two multicasts of the stats of the active
+ *		    peers (0 to disable)
+ * @client_to_client: whether packets between peers should be forwarded
+ *		      without going through the network stack (MultiPeer mode
+ *		      only)
+ * @threaded: whether packets should be encrypted and decrypted by per-CPU
+ *	      kthreads rather than in softirq context
+ * @compact: whether per-CPU caches should be kept small, for devices with
+ *	     little memory
+ * @shared_socket: whether the UDP sockets of the device may be shared with
+ *		   other devices of the netns (MultiPeer mode only)
+ * @shared_napi: whether the device should deliver received packets through
+ *		 the RX contexts shared by the devices of the netns
+ * @direct_xmit: whether the device may hand UDP packets to the lower device
+ *		 right away, bypassing the IP output path
+ * @udp_zero_csum: whether IPv4 UDP packets should be sent with no checksum
+ * @udp6_zero_csum: whether IPv6 UDP packets should be sent and accepted with
+ *		    no checksum (RFC 6936)
+ * @cputime_acct: whether peers should account for the CPU time spent on
+ *		  their crypto
+ * @top_talkers: whether the heaviest peers should be tracked
+ * @sample_rate: one packet every how many should have its header exported
+ *		 over netlink, on average (0 to disable)
+ * @parallel_rx_adaptive: whether received packets should be decrypted in
+ *			  parallel only while the CPU receiving them is
+ *			  overloaded
+ * @mem_budget: KiB the packets queued by the device may take at most
+ *		(0 for no limit)
+ */
+struct ovpn_iface_config {
+	enum ovpn_mode mode;
+	unsigned int txqs;
+	unsigned int rxqs;
+	unsigned int table_size;
+	bool shared_dst_cache;
+	bool parallel_rx;
+	bool parallel_tx;
+	const struct cpumask *parallel_cpus;
+	bool compact_keys;
+	unsigned int lib_max_len;
+	const char *aead_drivers[OVPN_CIPHER_ALG_CHACHA20_POLY1305 + 1];
+	bool latency_hist;
+	bool fair_queue;
+	bool inherit_dsfield;
+	bool pmtu_disc;
+	bool ctrl_netlink;
+	unsigned int stats_interval;
+	bool client_to_client;
+	bool threaded;
+	bool compact;
+	bool shared_socket;
+	bool shared_napi;
+	bool direct_xmit;
+	bool udp_zero_csum;
+	bool udp6_zero_csum;
+	bool cputime_acct;
+	bool top_talkers;
+	unsigned int sample_rate;
+	bool parallel_rx_adaptive;
+	unsigned int mem_budget;
+};
+
+struct net_device *ovpn_iface_create(const char *name,
+				     const struct ovpn_iface_config *conf,
 				     struct net *net);
 void ovpn_iface_destruct(struct ovpn_struct *ovpn);
 bool ovpn_dev_is_valid(const struct net_device *dev);
@@ -0,0 +1,234 @@
+// SPDX-License-Identifier: GPL-2.0
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/netdevice.h>
+#include <linux/skbuff.h>
+#include <linux/slab.h>
+#include <net/addrconf.h>
+#include <net/route.h>
+
+#include "ovpnstruct.h"
+#include "bind.h"
+#include "drop.h"
+#include "io.h"
+#include "mcast.h"
+#include "peer.h"
+
+/* Packets sent to a multicast group, or broadcast, are replicated to all
+ * peers userspace made members of the group. Every (group, peer) pair is an
+ * entry of a table hashed by group, so that a packet only walks the members
+ * of its own group and those colliding with it.
+ *
+ * Members are sent clones of the packet, which share its data until the
+ * latter is encrypted out of place for each of them.
+ *
+ * Lookups walk the table under RCU. Writers are serialized by the lock of
+ * the peer collection.
+ */
+
+static unsigned int ovpn_mcast_addr_len(sa_family_t family)
+{
+	return family == AF_INET ? sizeof(struct in_addr) :
+				   sizeof(struct in6_addr);
+}
+
+static u32 ovpn_mcast_hash(sa_family_t family, const void *addr)
+{
+	return jhash(addr, ovpn_mcast_addr_len(family), family);
+}
+
+/* membership of peer in group. Must be called with the peers lock held */
+static struct ovpn_mcast *ovpn_mcast_find(struct ovpn_peer *peer,
+					  sa_family_t family, const void *addr)
+{
+	struct ovpn_mcast *m;
+
+	list_for_each_entry(m, &peer->mcast, peer_entry)
+		if (m->family == family &&
+		    !memcmp(m->addr, addr, ovpn_mcast_addr_len(family)))
+			return m;
+
+	return NULL;
+}
+
+/**
+ * ovpn_mcast_add - make a peer member of a multicast group
+ * @peer: the peer joining the group
+ * @family: address family of the group
+ * @addr: the group address, in network byte order
+ *
+ * Return: 0 on success, -EEXIST if the peer is a member already or another
+ * negative error code otherwise
+ */
+int ovpn_mcast_add(struct ovpn_peer *peer, sa_family_t family,
+		   const void *addr)
+{
+	struct ovpn_peer_collection *peers = peer->ovpn->peers;
+	struct ovpn_mcast *m;
+	int ret = 0;
+
+	m = kzalloc(sizeof(*m), GFP_KERNEL);
+	if (!m)
+		return -ENOMEM;
+
+	m->peer = peer;
+	m->family = family;
+	memcpy(m->addr, addr, ovpn_mcast_addr_len(family));
+
+	ovpn_spin_lock_bh_stat(peer->ovpn, &peers->lock, lock_peers_contended);
+	/* the peer may have been removed in the meantime */
+	if (xa_load(&peers->by_id, peer->id) != peer) {
+		ret = -ENOENT;
+		goto unlock;
+	}
+
+	if (ovpn_mcast_find(peer, family, addr)) {
+		ret = -EEXIST;
+		goto unlock;
+	}
+
+	list_add(&m->peer_entry, &peer->mcast);
+	hash_add_rcu(peers->mcast, &m->hash_entry,
+		     ovpn_mcast_hash(family, addr));
+	m = NULL;
+unlock:
+	spin_unlock_bh(&peers->lock);
+	kfree(m);
+	return ret;
+}
+
+/* remove a membership. Must be called with the peers lock held */
+static void __ovpn_mcast_del(struct ovpn_mcast *m)
+{
+	list_del(&m->peer_entry);
+	hash_del_rcu(&m->hash_entry);
+	kfree_rcu(m, rcu);
+}
+
+/**
+ * ovpn_mcast_del - remove a peer from a multicast group
+ * @peer: the peer leaving the group
+ * @family: address family of the group
+ * @addr: the group address, in network byte order
+ *
+ * Return: 0 on success or -ENOENT if the peer is not a member
+ */
+int ovpn_mcast_del(struct ovpn_peer *peer, sa_family_t family,
+		   const void *addr)
+{
+	struct ovpn_peer_collection *peers = peer->ovpn->peers;
+	struct ovpn_mcast *m;
+	int ret = -ENOENT;
+
+	ovpn_spin_lock_bh_stat(peer->ovpn, &peers->lock, lock_peers_contended);
+	m = ovpn_mcast_find(peer, family, addr);
+	if (m) {
+		__ovpn_mcast_del(m);
+		ret = 0;
+	}
+	spin_unlock_bh(&peers->lock);
+
+	return ret;
+}
+
+/**
+ * ovpn_mcast_flush_peer - remove a peer from all its multicast groups
+ * @peer: the peer being removed
+ *
+ * Must be called with the peers lock held.
+ */
+void ovpn_mcast_flush_peer(struct ovpn_peer *peer)
+{
+	struct ovpn_mcast *m, *tmp;
+
+	list_for_each_entry_safe(m, tmp, &peer->mcast, peer_entry)
+		__ovpn_mcast_del(m);
+}
+
+/**
+ * ovpn_mcast_is_group - check if a packet to send is multicast or broadcast
+ * @skb: the packet to check
+ *
+ * Return: true if the destination of skb may have members
+ */
+bool ovpn_mcast_is_group(struct sk_buff *skb)
+{
+	const struct rtable *rt;
+
+	switch (skb_protocol_to_family(skb)) {
+	case AF_INET:
+		if (ipv4_is_multicast(ip_hdr(skb)->daddr) ||
+		    ipv4_is_lbcast(ip_hdr(skb)->daddr))
+			return true;
+
+		/* subnet broadcasts are known to the route only */
+		rt = skb_rtable(skb);
+		return rt && rt->rt_type == RTN_BROADCAST;
+	case AF_INET6:
+		return ipv6_addr_is_multicast(&ipv6_hdr(skb)->daddr);
+	default:
+		return false;
+	}
+}
+
+/**
+ * ovpn_mcast_xmit - replicate a packet to the members of its group
+ * @ovpn: the instance sending the packet
+ * @skb: the multicast or broadcast packet
+ * @mode: how the encrypted packets should be sent
+ *
+ * Called under RCU read lock, like ndo_start_xmit().
+ *
+ * Return: true if skb was consumed, false if its group has no member
+ */
+bool ovpn_mcast_xmit(struct ovpn_struct *ovpn, struct sk_buff *skb,
+		     enum ovpn_tx_mode mode)
+{
+	sa_family_t family = skb_protocol_to_family(skb);
+	struct ovpn_peer *peer, *prev = NULL;
+	struct sk_buff *clone;
+	struct ovpn_mcast *m;
+	const void *addr;
+
+	if (family == AF_INET)
+		addr = &ip_hdr(skb)->daddr;
+	else
+		addr = &ipv6_hdr(skb)->daddr;
+
+	hash_for_each_possible_rcu(ovpn->peers->mcast, m, hash_entry,
+				   ovpn_mcast_hash(family, addr)) {
+		if (m->family != family ||
+		    memcmp(m->addr, addr, ovpn_mcast_addr_len(family)))
+			continue;
+
+		peer = m->peer;
+		if (unlikely(!ovpn_peer_hold(peer)))
+			continue;
+
+		/* the last member is sent the packet itself */
+		if (prev) {
+			clone = skb_clone(skb, GFP_ATOMIC);
+			if (likely(clone))
+				ovpn_send_peer(prev, clone, mode);
+			else
+				ovpn_drop_count(ovpn, true, OVPN_DROP_NOMEM);
+			ovpn_peer_put(prev);
+		}
+		prev = peer;
+	}
+
+	if (!prev)
+		return false;
+
+	ovpn_send_peer(prev, skb, mode);
+	ovpn_peer_put(prev);
+
+	return true;
+}
@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_MCAST_H_
+#define _NET_OVPN_MCAST_H_
+
+#include <linux/in6.h>
+#include <linux/list.h>
+#include <linux/netdevice.h>
+#include <linux/rcupdate.h>
+#include <linux/socket.h>
+
+#include "io.h"
+
+struct ovpn_peer;
+struct ovpn_struct;
+struct sk_buff;
+
+/**
+ * struct ovpn_mcast - membership of a peer in a multicast group
+ * @hash_entry: entry in the table of memberships, hashed by group
+ * @peer_entry: entry in the list of groups the peer is a member of
+ * @peer: the member
+ * @rcu: used to free the membership in an RCU safe way
+ * @family: address family of the group
+ * @addr: the group address, in network byte order (IPv4 addresses use the
+ *	  first 4 bytes only)
+ */
+struct ovpn_mcast {
+	struct hlist_node hash_entry;
+	struct list_head peer_entry;
+	struct ovpn_peer *peer;
+	struct rcu_head rcu;
+	sa_family_t family;
+	u8 addr[sizeof(struct in6_addr)];
+};
+
+int ovpn_mcast_add(struct ovpn_peer *peer, sa_family_t family,
+		   const void *addr);
+int ovpn_mcast_del(struct ovpn_peer *peer, sa_family_t family,
+		   const void *addr);
+void ovpn_mcast_flush_peer(struct ovpn_peer *peer);
+bool ovpn_mcast_is_group(struct sk_buff *skb);
+bool ovpn_mcast_xmit(struct ovpn_struct *ovpn, struct sk_buff *skb,
+		     enum ovpn_tx_mode mode);
+
+#endif /* _NET_OVPN_MCAST_H_ */
@@ -0,0 +1,124 @@
+// SPDX-License-Identifier: GPL-2.0
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include <linux/slab.h>
+
+#include "ovpnstruct.h"
+#include "mem.h"
+
+/* An interface may be given a budget for the memory of the packets it holds
+ * on its own: those pending on an async crypto engine or waiting for their
+ * turn after being decrypted or encrypted in parallel, those queued to a TCP
+ * transport and the decrypted ones queued to the NAPI contexts. Once the
+ * budget is exhausted, new packets are dropped before being queued, so that
+ * an overloaded interface sheds load instead of exhausting the memory of the
+ * host. The other queues of the interface are bounded by their length only.
+ *
+ * The budget is checked against the approximate value of the per-CPU
+ * counter: the memory actually charged may exceed it by OVPN_MEM_BATCH for
+ * each CPU.
+ */
+#define OVPN_MEM_BATCH	(64 * 1024)
+
+/**
+ * ovpn_mem_init - give an interface a memory budget
+ * @ovpn: the interface
+ * @budget: bytes the interface may hold at most
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_mem_init(struct ovpn_struct *ovpn, u64 budget)
+{
+	struct ovpn_mem *mem;
+	int ret;
+
+	mem = kzalloc(sizeof(*mem), GFP_KERNEL);
+	if (!mem)
+		return -ENOMEM;
+
+	ret = percpu_counter_init(&mem->used, 0, GFP_KERNEL);
+	if (ret < 0) {
+		kfree(mem);
+		return ret;
+	}
+
+	mem->budget = min_t(u64, budget, S64_MAX);
+	ovpn->mem = mem;
+
+	return 0;
+}
+
+/**
+ * ovpn_mem_destroy - remove the memory budget of an interface
+ * @ovpn: the interface, holding no packet anymore
+ */
+void ovpn_mem_destroy(struct ovpn_struct *ovpn)
+{
+	if (!ovpn->mem)
+		return;
+
+	percpu_counter_destroy(&ovpn->mem->used);
+	kfree(ovpn->mem);
+	ovpn->mem = NULL;
+}
+
+/**
+ * __ovpn_mem_charge - charge memory to a budget
+ * @mem: the budget
+ * @size: bytes to charge
+ *
+ * Return: true if @size was charged, false if it would exceed the budget
+ */
+bool __ovpn_mem_charge(struct ovpn_mem *mem, unsigned int size)
+{
+	s64 used = percpu_counter_read(&mem->used) + size;
+	s64 peak;
+
+	if (unlikely(used > mem->budget))
+		return false;
+
+	percpu_counter_add_batch(&mem->used, size, OVPN_MEM_BATCH);
+
+	peak = atomic64_read(&mem->peak);
+	while (unlikely(used > peak) &&
+	       !atomic64_try_cmpxchg(&mem->peak, &peak, used))
+		;
+
+	return true;
+}
+
+/**
+ * __ovpn_mem_uncharge - give memory back to a budget
+ * @mem: the budget
+ * @size: bytes charged by __ovpn_mem_charge()
+ */
+void __ovpn_mem_uncharge(struct ovpn_mem *mem, unsigned int size)
+{
+	percpu_counter_add_batch(&mem->used, -(s64)size, OVPN_MEM_BATCH);
+}
+
+/**
+ * ovpn_mem_usage - get the memory held by an interface against its budget
+ * @ovpn: the interface
+ * @used: set to the bytes currently charged
+ * @peak: set to the highest amount of bytes charged so far
+ *
+ * Return: false if the interface has no memory budget
+ */
+bool ovpn_mem_usage(const struct ovpn_struct *ovpn, u64 *used, u64 *peak)
+{
+	struct ovpn_mem *mem = ovpn->mem;
+
+	if (!mem)
+		return false;
+
+	*used = max_t(s64, percpu_counter_sum(&mem->used), 0);
+	*peak = atomic64_read(&mem->peak);
+
+	return true;
+}
@@ -0,0 +1,105 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_MEM_H_
+#define _NET_OVPN_MEM_H_
+
+#include <linux/atomic.h>
+#include <linux/percpu_counter.h>
+#include <linux/skbuff.h>
+
+#include "ovpnstruct.h"
+#include "skb.h"
+
+/**
+ * struct ovpn_mem - memory budget of the packets queued by an interface
+ * @used: bytes currently charged, per-CPU so that charging scales
+ * @budget: bytes that may be charged at most
+ * @peak: highest value @used was seen at
+ */
+struct ovpn_mem {
+	struct percpu_counter used;
+	s64 budget;
+	atomic64_t peak;
+};
+
+int ovpn_mem_init(struct ovpn_struct *ovpn, u64 budget);
+void ovpn_mem_destroy(struct ovpn_struct *ovpn);
+bool __ovpn_mem_charge(struct ovpn_mem *mem, unsigned int size);
+void __ovpn_mem_uncharge(struct ovpn_mem *mem, unsigned int size);
+bool ovpn_mem_usage(const struct ovpn_struct *ovpn, u64 *used, u64 *peak);
+
+/**
+ * ovpn_mem_charge - charge memory to the budget of an interface
+ * @ovpn: the interface holding the memory
+ * @size: bytes to charge
+ *
+ * Return: true if @size was charged, false if it would exceed the budget
+ */
+static inline bool ovpn_mem_charge(struct ovpn_struct *ovpn,
+				   unsigned int size)
+{
+	return !ovpn->mem || __ovpn_mem_charge(ovpn->mem, size);
+}
+
+/**
+ * ovpn_mem_uncharge - give memory back to the budget of an interface
+ * @ovpn: the interface that was holding the memory
+ * @size: bytes charged by ovpn_mem_charge()
+ */
+static inline void ovpn_mem_uncharge(struct ovpn_struct *ovpn,
+				     unsigned int size)
+{
+	if (ovpn->mem)
+		__ovpn_mem_uncharge(ovpn->mem, size);
+}
+
+/* a packet pending on crypto may change its truesize along the way, unlike
+ * its original length: it is charged as a linear packet of that length
+ */
+static inline unsigned int ovpn_mem_skb_size(struct sk_buff *skb)
+{
+	return SKB_TRUESIZE(ovpn_skb_cb(skb)->orig_len);
+}
+
+/**
+ * ovpn_mem_charge_skb - charge a packet pending on crypto to the budget
+ * @ovpn: the interface the packet belongs to
+ * @skb: the packet, whose ovpn_cb is initialized
+ *
+ * Return: true if the packet was charged, false if it should be dropped
+ */
+static inline bool ovpn_mem_charge_skb(struct ovpn_struct *ovpn,
+				       struct sk_buff *skb)
+{
+	if (!ovpn->mem)
+		return true;
+
+	if (unlikely(!__ovpn_mem_charge(ovpn->mem, ovpn_mem_skb_size(skb))))
+		return false;
+
+	ovpn_skb_cb(skb)->mem_charged = true;
+	return true;
+}
+
+/**
+ * ovpn_mem_uncharge_skb - give the memory of a packet back, if charged
+ * @ovpn: the interface the packet belongs to
+ * @skb: the packet, done with crypto
+ */
+static inline void ovpn_mem_uncharge_skb(struct ovpn_struct *ovpn,
+					 struct sk_buff *skb)
+{
+	if (!ovpn_skb_cb(skb)->mem_charged)
+		return;
+
+	ovpn_skb_cb(skb)->mem_charged = false;
+	__ovpn_mem_uncharge(ovpn->mem, ovpn_mem_skb_size(skb));
+}
+
+#endif /* _NET_OVPN_MEM_H_ */
@@ -0,0 +1,86 @@
+// SPDX-License-Identifier: GPL-2.0
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include <linux/netdevice.h>
+#include <linux/skbuff.h>
+#include <linux/slab.h>
+
+#include "ovpnstruct.h"
+#include "mirror.h"
+#include "peer.h"
+
+/**
+ * __ovpn_mirror_skb - mirror a packet of a peer to its capture device
+ * @peer: the peer the packet is sent to or received from
+ * @skb: the packet, left untouched
+ * @ciphertext: whether skb carries the encrypted transport payload rather
+ *		than the plaintext
+ *
+ * The first snaplen bytes of skb are copied into a new linear packet, rather
+ * than cloned, since the original may be encrypted or decrypted in place
+ * right after. Encrypted payloads go without their transport headers.
+ */
+void __ovpn_mirror_skb(struct ovpn_peer *peer, const struct sk_buff *skb,
+		       bool ciphertext)
+{
+	struct ovpn_mirror *mirror;
+	struct net_device *dev;
+	struct sk_buff *nskb;
+	unsigned int len;
+
+	rcu_read_lock();
+	mirror = rcu_dereference(peer->mirror);
+	if (!mirror || (ciphertext && !mirror->ciphertext))
+		goto out;
+
+	if (mirror->sample > 1 &&
+	    atomic_inc_return(&mirror->count) % mirror->sample)
+		goto out;
+
+	dev = dev_get_by_index_rcu(dev_net(peer->ovpn->dev), mirror->ifindex);
+	if (!dev || !(dev->flags & IFF_UP))
+		goto out;
+
+	len = skb->len;
+	if (mirror->snaplen)
+		len = min(len, mirror->snaplen);
+
+	nskb = alloc_skb(len, GFP_ATOMIC);
+	if (!nskb)
+		goto out;
+
+	if (skb_copy_bits(skb, 0, skb_put(nskb, len), len) < 0) {
+		kfree_skb(nskb);
+		goto out;
+	}
+
+	skb_reset_mac_header(nskb);
+	skb_reset_network_header(nskb);
+	nskb->protocol = ciphertext ? 0 : skb->protocol;
+	nskb->dev = dev;
+	dev_queue_xmit(nskb);
+out:
+	rcu_read_unlock();
+}
+
+/**
+ * ovpn_mirror_reset - assign a new capture configuration to a peer
+ * @peer: the peer whose configuration has to be replaced
+ * @new: the new configuration, NULL to stop mirroring
+ */
+void ovpn_mirror_reset(struct ovpn_peer *peer, struct ovpn_mirror *new)
+{
+	struct ovpn_mirror *old;
+
+	spin_lock_bh(&peer->lock);
+	old = rcu_replace_pointer(peer->mirror, new, true);
+	spin_unlock_bh(&peer->lock);
+
+	if (old)
+		kfree_rcu(old, rcu);
+}
@@ -0,0 +1,66 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_MIRROR_H_
+#define _NET_OVPN_MIRROR_H_
+
+#include <linux/atomic.h>
+#include <linux/rcupdate.h>
+#include <linux/types.h>
+
+#include "peer.h"
+
+struct sk_buff;
+
+/* The packets of a peer can be mirrored to a capture device, so that the
+ * traffic of a single peer can be inspected without tapping the interface,
+ * which would make the stack share, and ovpn_net_xmit() clone, the packets
+ * of all peers. Mirrored packets are copies, sent out of the capture device
+ * and dropped by it once the taps saw them: a dummy device with no link
+ * layer (e.g. a tun device nobody reads from) fits.
+ */
+
+/**
+ * struct ovpn_mirror - capture configuration of a peer
+ * @ifindex: the device packets are mirrored to, in the netns of the
+ *	     interface
+ * @snaplen: bytes of each packet mirrored (0 for the whole packet)
+ * @sample: one packet every @sample is mirrored
+ * @ciphertext: whether the encrypted transport payloads are mirrored too
+ * @count: packets seen so far, for sampling
+ * @rcu: used to free the configuration after an RCU grace period
+ */
+struct ovpn_mirror {
+	int ifindex;
+	u32 snaplen;
+	u32 sample;
+	bool ciphertext;
+	atomic_t count;
+	struct rcu_head rcu;
+};
+
+void __ovpn_mirror_skb(struct ovpn_peer *peer, const struct sk_buff *skb,
+		       bool ciphertext);
+
+/**
+ * ovpn_mirror_skb - mirror a packet of a peer to its capture device, if any
+ * @peer: the peer the packet is sent to or received from
+ * @skb: the packet, left untouched
+ * @ciphertext: whether skb carries the encrypted transport payload rather
+ *		than the plaintext
+ */
+static inline void ovpn_mirror_skb(struct ovpn_peer *peer,
+				   const struct sk_buff *skb, bool ciphertext)
+{
+	if (unlikely(rcu_access_pointer(peer->mirror)))
+		__ovpn_mirror_skb(peer, skb, ciphertext);
+}
+
+void ovpn_mirror_reset(struct ovpn_peer *peer, struct ovpn_mirror *new);
+
+#endif /* _NET_OVPN_MIRROR_H_ */
@@ -0,0 +1,173 @@
+// SPDX-License-Identifier: GPL-2.0
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include <linux/slab.h>
+#include <linux/xarray.h>
+
+#include "ovpnstruct.h"
+#include "main.h"
+#include "monitor.h"
+#include "netlink.h"
+#include "peer.h"
+#include "stats.h"
+
+/* Polling the stats of all peers with GET_PEER dumps means building a full
+ * message per peer, most of which did not change in the meantime. When
+ * enabled, a round every interval rather packs a compact record per peer
+ * into as few messages as possible, multicast to the OVPN_NLGRP_STATS group:
+ *
+ * - records carry the traffic since the previous record of the same peer,
+ *   adding them up gives the counters reported by GET_PEER;
+ * - only peers with traffic since the previous round are reported, found by
+ *   means of the same stats generation dumps are filtered by;
+ * - rounds are skipped while nobody listens, the next record of each peer
+ *   covering the traffic seen in the meantime.
+ */
+
+/* fill @rec with the traffic of @peer since its previous record, if the peer
+ * had any since generation @since
+ */
+static bool ovpn_monitor_record(struct ovpn_peer *peer, u32 since,
+				struct ovpn_stats_record *rec)
+{
+	struct ovpn_peer_stats_sum vpn, link;
+
+	if (!ovpn_peer_stats_changed(peer, since))
+		return false;
+
+	ovpn_peer_stats_fetch(peer->vpn_stats, &peer->vpn_base, &vpn);
+	ovpn_peer_stats_fetch(peer->link_stats, &peer->link_base, &link);
+
+	*rec = (struct ovpn_stats_record) {
+		.peer_id = peer->id,
+		.vpn_rx_packets = vpn.rx_packets - peer->reported_vpn.rx_packets,
+		.vpn_tx_packets = vpn.tx_packets - peer->reported_vpn.tx_packets,
+		.link_rx_packets = link.rx_packets -
+				   peer->reported_link.rx_packets,
+		.link_tx_packets = link.tx_packets -
+				   peer->reported_link.tx_packets,
+		.vpn_rx_bytes = vpn.rx_bytes - peer->reported_vpn.rx_bytes,
+		.vpn_tx_bytes = vpn.tx_bytes - peer->reported_vpn.tx_bytes,
+		.link_rx_bytes = link.rx_bytes - peer->reported_link.rx_bytes,
+		.link_tx_bytes = link.tx_bytes - peer->reported_link.tx_bytes,
+	};
+
+	peer->reported_vpn = vpn;
+	peer->reported_link = link;
+
+	/* every packet is accounted on the link first */
+	return rec->link_rx_packets || rec->link_tx_packets;
+}
+
+static void ovpn_monitor_work(struct work_struct *work)
+{
+	struct ovpn_monitor *mon = container_of(to_delayed_work(work),
+						struct ovpn_monitor, work);
+	struct ovpn_struct *ovpn = mon->ovpn;
+	struct ovpn_peer *peer;
+	unsigned long index;
+	unsigned int n = 0;
+	u32 since;
+
+	if (!ovpn_nl_stats_has_listeners(ovpn))
+		goto out;
+
+	/* peers with traffic from now on are reported at the next round */
+	since = mon->gen;
+	mon->gen = atomic_inc_return(&ovpn->stats_gen);
+
+	rcu_read_lock();
+	if (ovpn->mode == OVPN_MODE_P2P) {
+		peer = rcu_dereference(ovpn->peer);
+		if (peer && ovpn_monitor_record(peer, since, &mon->recs[n]))
+			n++;
+	} else {
+		xa_for_each(&ovpn->peers->by_id, index, peer) {
+			if (!ovpn_monitor_record(peer, since, &mon->recs[n]))
+				continue;
+
+			if (++n < OVPN_MONITOR_BATCH)
+				continue;
+
+			/* the walk resumes from index */
+			rcu_read_unlock();
+			ovpn_nl_notify_stats(ovpn, mon->gen, mon->recs, n);
+			n = 0;
+			cond_resched();
+			rcu_read_lock();
+		}
+	}
+	rcu_read_unlock();
+
+	if (n)
+		ovpn_nl_notify_stats(ovpn, mon->gen, mon->recs, n);
+out:
+	schedule_delayed_work(&mon->work, mon->interval);
+}
+
+/**
+ * ovpn_monitor_init - start multicasting the stats of active peers
+ * @ovpn: the instance whose peers should be reported
+ * @interval: seconds between two rounds of records
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_monitor_init(struct ovpn_struct *ovpn, unsigned int interval)
+{
+	struct ovpn_monitor *mon;
+
+	mon = kzalloc(sizeof(*mon), GFP_KERNEL);
+	if (!mon)
+		return -ENOMEM;
+
+	INIT_DELAYED_WORK(&mon->work, ovpn_monitor_work);
+	mon->ovpn = ovpn;
+	mon->interval = interval * HZ;
+	mon->gen = atomic_read(&ovpn->stats_gen);
+
+	ovpn->monitor = mon;
+
+	return 0;
+}
+
+/**
+ * ovpn_monitor_start - schedule the rounds of records while the device is up
+ * @ovpn: the instance whose peers should be reported
+ */
+void ovpn_monitor_start(struct ovpn_struct *ovpn)
+{
+	if (ovpn->monitor)
+		schedule_delayed_work(&ovpn->monitor->work,
+				      ovpn->monitor->interval);
+}
+
+/**
+ * ovpn_monitor_stop - stop the rounds of records once the device is down
+ * @ovpn: the instance whose peers are reported
+ */
+void ovpn_monitor_stop(struct ovpn_struct *ovpn)
+{
+	if (ovpn->monitor)
+		cancel_delayed_work_sync(&ovpn->monitor->work);
+}
+
+/**
+ * ovpn_monitor_destroy - stop multicasting the stats of active peers
+ * @ovpn: the instance whose peers are reported
+ */
+void ovpn_monitor_destroy(struct ovpn_struct *ovpn)
+{
+	struct ovpn_monitor *mon = ovpn->monitor;
+
+	if (!mon)
+		return;
+
+	cancel_delayed_work_sync(&mon->work);
+	kfree(mon);
+	ovpn->monitor = NULL;
+}
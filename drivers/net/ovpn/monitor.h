@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_MONITOR_H_
+#define _NET_OVPN_MONITOR_H_
+
+#include <linux/types.h>
+#include <linux/workqueue.h>
+#include <uapi/linux/ovpn.h>
+
+struct ovpn_struct;
+
+/* stats records carried by a single netlink message */
+#define OVPN_MONITOR_BATCH 64
+
+/**
+ * struct ovpn_monitor - periodic multicast of the stats of active peers
+ * @work: collects and multicasts the records every @interval
+ * @ovpn: the instance whose peers are reported
+ * @interval: jiffies between two rounds of records
+ * @gen: stats generation opened by the last round
+ * @recs: records collected for the next message
+ */
+struct ovpn_monitor {
+	struct delayed_work work;
+	struct ovpn_struct *ovpn;
+	unsigned long interval;
+	u32 gen;
+	struct ovpn_stats_record recs[OVPN_MONITOR_BATCH];
+};
+
+int ovpn_monitor_init(struct ovpn_struct *ovpn, unsigned int interval);
+void ovpn_monitor_destroy(struct ovpn_struct *ovpn);
+void ovpn_monitor_start(struct ovpn_struct *ovpn);
+void ovpn_monitor_stop(struct ovpn_struct *ovpn);
+
+#endif /* _NET_OVPN_MONITOR_H_ */
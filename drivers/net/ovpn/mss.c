@@ -0,0 +1,120 @@
+// SPDX-License-Identifier: GPL-2.0
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include <asm/unaligned.h>
+#include <linux/skbuff.h>
+#include <linux/tcp.h>
+#include <net/checksum.h>
+#include <net/ip.h>
+#include <net/ipv6.h>
+#include <net/tcp.h>
+
+#include "mss.h"
+
+/* lower the MSS option of the TCP SYN at offset thoff of skb to mss */
+static void ovpn_mss_clamp_tcp(struct sk_buff *skb, unsigned int thoff,
+			       u16 mss)
+{
+	unsigned int i, optlen;
+	struct tcphdr *th;
+	u16 old;
+	u8 *opt;
+
+	if (!pskb_may_pull(skb, thoff + sizeof(*th)))
+		return;
+
+	th = (struct tcphdr *)(skb->data + thoff);
+	if (!th->syn)
+		return;
+
+	optlen = th->doff * 4;
+	if (optlen <= sizeof(*th) || skb_ensure_writable(skb, thoff + optlen))
+		return;
+
+	/* the head may have been reallocated */
+	th = (struct tcphdr *)(skb->data + thoff);
+	opt = (u8 *)(th + 1);
+	optlen -= sizeof(*th);
+
+	for (i = 0; i < optlen; ) {
+		if (opt[i] == TCPOPT_EOL)
+			return;
+
+		if (opt[i] == TCPOPT_NOP) {
+			i++;
+			continue;
+		}
+
+		if (optlen - i < 2 || opt[i + 1] < 2 || opt[i + 1] > optlen - i)
+			return;
+
+		if (opt[i] == TCPOPT_MSS && opt[i + 1] == TCPOLEN_MSS) {
+			old = get_unaligned_be16(&opt[i + 2]);
+			if (old <= mss)
+				return;
+
+			put_unaligned_be16(mss, &opt[i + 2]);
+			inet_proto_csum_replace2(&th->check, skb, htons(old),
+						 htons(mss), false);
+			return;
+		}
+
+		i += opt[i + 1];
+	}
+}
+
+/**
+ * ovpn_mss_clamp - make TCP connections fit the MTU of a peer
+ * @skb: the IP packet sent to or received from the peer
+ * @mtu: the largest packet the tunnel to the peer carries
+ *
+ * The MSS option of TCP SYN packets is lowered so that neither endpoint of
+ * the connection sends segments larger than @mtu. Other packets are left
+ * untouched.
+ */
+void ovpn_mss_clamp(struct sk_buff *skb, unsigned int mtu)
+{
+	unsigned int hdrlen, nhoff = skb_network_offset(skb);
+	__be16 frag_off;
+	int thoff;
+	u8 nexthdr;
+
+	switch (skb->protocol) {
+	case htons(ETH_P_IP):
+		if (!pskb_may_pull(skb, nhoff + sizeof(struct iphdr)))
+			return;
+
+		if (ip_hdr(skb)->protocol != IPPROTO_TCP ||
+		    ip_is_fragment(ip_hdr(skb)))
+			return;
+
+		hdrlen = sizeof(struct iphdr);
+		thoff = nhoff + ip_hdrlen(skb);
+		break;
+	case htons(ETH_P_IPV6):
+		if (!pskb_may_pull(skb, nhoff + sizeof(struct ipv6hdr)))
+			return;
+
+		nexthdr = ipv6_hdr(skb)->nexthdr;
+		thoff = ipv6_skip_exthdr(skb, nhoff + sizeof(struct ipv6hdr),
+					 &nexthdr, &frag_off);
+		if (thoff < 0 || nexthdr != IPPROTO_TCP ||
+		    (frag_off & htons(~0x7)))
+			return;
+
+		hdrlen = sizeof(struct ipv6hdr);
+		break;
+	default:
+		return;
+	}
+
+	if (mtu <= hdrlen + sizeof(struct tcphdr))
+		return;
+
+	ovpn_mss_clamp_tcp(skb, thoff, mtu - hdrlen - sizeof(struct tcphdr));
+}
@@ -0,0 +1,16 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_MSS_H_
+#define _NET_OVPN_MSS_H_
+
+struct sk_buff;
+
+void ovpn_mss_clamp(struct sk_buff *skb, unsigned int mtu);
+
+#endif /* _NET_OVPN_MSS_H_ */
@@ -0,0 +1,581 @@
+// SPDX-License-Identifier: GPL-2.0
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include <linux/bottom_half.h>
+#include <linux/cpu.h>
+#include <linux/mutex.h>
+#include <linux/netdevice.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/smp.h>
+
+#include "ovpnstruct.h"
+#include "main.h"
+#include "drop.h"
+#include "io.h"
+#include "mem.h"
+#include "napi.h"
+#include "peer.h"
+#include "skb.h"
+#include "stats.h"
+#include "udp.h"
+
+/* Decrypted packets are queued to a per-CPU context owned by the interface
+ * and are passed to GRO by its NAPI poll, within the usual NAPI budget. The
+ * queue is bounded by OVPN_QUEUE_LEN: under overload packets are dropped on
+ * enqueue, before they can pile up.
+ *
+ * The same context sends the UDP packets completed by async crypto engines:
+ * engines complete requests one by one, often from hard IRQ context, while
+ * the poll hands the packets of each peer to the UDP socket as one batch.
+ * Such packets carry a reference to their peer, released once sent.
+ *
+ * Last, the context decrypts the UDP packets of the peers with a preferred RX
+ * CPU, steered there by the CPU the packet was received on (like RFS does
+ * for sockets): the flows of a peer are then decrypted and delivered where
+ * its consumers run, no matter how the NIC hashes the outer packets. The CPU
+ * steering a packet to an idle context kicks its poll with an IPI. Steered
+ * packets carry a reference to their peer, which is passed to ovpn_recv().
+ *
+ * Interfaces created with a shared pool use the contexts of their netns
+ * instead, hosted by a dummy device: packets are delivered to GRO with their
+ * own device and accounted to it as usual. An interface leaving the pool
+ * drops its packets still queued to the contexts.
+ */
+
+/* send list to peer and release the references carried by its packets */
+static void ovpn_napi_send_list(struct ovpn_peer *peer,
+				struct sk_buff_head *list)
+{
+	unsigned int n = skb_queue_len(list);
+
+	ovpn_udp_send_skb_list(peer->ovpn, peer, list);
+	while (n--)
+		ovpn_peer_put(peer);
+}
+
+static void ovpn_napi_send_poll(struct ovpn_napi_cell *cell)
+{
+	struct sk_buff_head list, batch;
+	struct ovpn_peer *peer;
+	struct sk_buff *skb;
+
+	__skb_queue_head_init(&list);
+	__skb_queue_head_init(&batch);
+
+	local_irq_disable();
+	skb_queue_splice_init(&cell->tx_queue, &list);
+	local_irq_enable();
+
+	while ((skb = __skb_dequeue(&list))) {
+		peer = ovpn_skb_cb(skb)->peer;
+		__skb_queue_tail(&batch, skb);
+
+		/* consecutive packets of the same peer form one batch */
+		skb = skb_peek(&list);
+		if (!skb || ovpn_skb_cb(skb)->peer != peer)
+			ovpn_napi_send_list(peer, &batch);
+	}
+}
+
+/* decrypt up to budget steered packets, return how many were processed */
+static int ovpn_napi_steer_poll(struct ovpn_napi_cell *cell, int budget)
+{
+	struct sk_buff *skb;
+	int work_done = 0;
+
+	if (skb_queue_empty(&cell->steer_list)) {
+		spin_lock(&cell->steer_queue.lock);
+		skb_queue_splice_tail_init(&cell->steer_queue,
+					   &cell->steer_list);
+		spin_unlock(&cell->steer_queue.lock);
+	}
+
+	while (work_done < budget) {
+		skb = __skb_dequeue(&cell->steer_list);
+		if (!skb)
+			break;
+
+		/* decrypted packets end up in the queue of this same cell */
+		ovpn_recv(ovpn_skb_cb(skb)->peer, skb);
+		work_done++;
+	}
+
+	return work_done;
+}
+
+/* account for a run of n packets of dev handed to GRO */
+static void ovpn_napi_gro_account(struct net_device *dev, unsigned int n)
+{
+	struct ovpn_struct *ovpn;
+
+	if (!n)
+		return;
+
+	ovpn = netdev_priv(dev);
+	ovpn_dev_stats_hist(ovpn, rx_gro_batch, n);
+}
+
+static int ovpn_napi_poll(struct napi_struct *napi, int budget)
+{
+	struct ovpn_napi_cell *cell = container_of(napi, struct ovpn_napi_cell,
+						   napi);
+	struct net_device *dev = NULL;
+	unsigned int batch = 0;
+	struct sk_buff *skb;
+	int work_done = 0;
+
+	/* like TX completions of real devices, sending is not accounted to
+	 * the budget
+	 */
+	if (!skb_queue_empty_lockless(&cell->tx_queue))
+		ovpn_napi_send_poll(cell);
+
+	/* half of the budget at most goes to decryption, so that packets
+	 * decrypted by the previous poll are delivered first
+	 */
+	if (!skb_queue_empty(&cell->steer_list) ||
+	    !skb_queue_empty_lockless(&cell->steer_queue))
+		work_done = ovpn_napi_steer_poll(cell, budget / 2);
+
+	while (work_done < budget) {
+		skb = __skb_dequeue(&cell->queue);
+		if (!skb)
+			break;
+
+		/* the cell may be shared by the interfaces of the netns */
+		if (skb->dev != dev) {
+			ovpn_napi_gro_account(dev, batch);
+			dev = skb->dev;
+			batch = 0;
+		}
+
+		ovpn_mem_uncharge(netdev_priv(skb->dev), skb->truesize);
+		/* GRO passes packets up in batches, via napi->rx_list */
+		napi_gro_receive(napi, skb);
+		work_done++;
+		batch++;
+	}
+	ovpn_napi_gro_account(dev, batch);
+
+	/* packets still waiting for decryption need another poll */
+	if (!skb_queue_empty(&cell->steer_list) ||
+	    !skb_queue_empty_lockless(&cell->steer_queue))
+		return budget;
+
+	if (work_done < budget)
+		napi_complete_done(napi, work_done);
+
+	return work_done;
+}
+
+/* IPI handler scheduling the poll of a cell on its own CPU */
+static void ovpn_napi_steer_kick(void *info)
+{
+	struct ovpn_napi_cell *cell = info;
+
+	napi_schedule(&cell->napi);
+	/* last access to the cell, which may be freed right after */
+	clear_bit_unlock(OVPN_NAPI_STEER_KICK, &cell->flags);
+}
+
+/* pools of RX contexts shared by the interfaces of a netns */
+static LIST_HEAD(ovpn_napi_pools);
+static DEFINE_MUTEX(ovpn_napi_pools_lock);
+
+/* create per-CPU RX contexts polled on behalf of dev */
+static struct ovpn_napi *ovpn_napi_alloc(struct net_device *dev)
+{
+	struct ovpn_napi_cell *cell;
+	struct ovpn_napi *napi;
+	int cpu;
+
+	napi = kzalloc(sizeof(*napi), GFP_KERNEL);
+	if (!napi)
+		return NULL;
+
+	napi->cells = alloc_percpu(struct ovpn_napi_cell);
+	if (!napi->cells) {
+		kfree(napi);
+		return NULL;
+	}
+
+	for_each_possible_cpu(cpu) {
+		cell = per_cpu_ptr(napi->cells, cpu);
+
+		__skb_queue_head_init(&cell->queue);
+		__skb_queue_head_init(&cell->tx_queue);
+		skb_queue_head_init(&cell->steer_queue);
+		__skb_queue_head_init(&cell->steer_list);
+		INIT_CSD(&cell->csd, ovpn_napi_steer_kick, cell);
+		/* busy polling would run the poll on another CPU: sockets
+		 * rather poll the device the transport packets come from,
+		 * whose NAPI ID is left on the decrypted packets by GRO
+		 */
+		set_bit(NAPI_STATE_NO_BUSY_POLL, &cell->napi.state);
+		netif_napi_add(dev, &cell->napi, ovpn_napi_poll);
+		napi_enable(&cell->napi);
+	}
+
+	return napi;
+}
+
+static void ovpn_napi_free_rcu(struct rcu_head *head)
+{
+	struct ovpn_napi *napi = container_of(head, struct ovpn_napi, rcu);
+
+	free_percpu(napi->cells);
+	kfree(napi);
+}
+
+static void ovpn_napi_free(struct ovpn_napi *napi)
+{
+	struct ovpn_napi_cell *cell;
+	struct sk_buff *skb;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		cell = per_cpu_ptr(napi->cells, cpu);
+
+		napi_disable(&cell->napi);
+		__netif_napi_del(&cell->napi);
+		/* the IPI of a CPU steering a packet may still be pending */
+		while (test_bit(OVPN_NAPI_STEER_KICK, &cell->flags))
+			cpu_relax();
+
+		__skb_queue_purge(&cell->queue);
+		skb_queue_splice_init(&cell->steer_queue, &cell->steer_list);
+		skb_queue_splice_init(&cell->tx_queue, &cell->steer_list);
+		while ((skb = __skb_dequeue(&cell->steer_list))) {
+			ovpn_peer_put(ovpn_skb_cb(skb)->peer);
+			kfree_skb(skb);
+		}
+	}
+
+	/* netpoll may still walk the NAPI contexts of the device under RCU */
+	call_rcu(&napi->rcu, ovpn_napi_free_rcu);
+}
+
+/* join the pool of the netns, creating it if needed */
+static struct ovpn_napi *ovpn_napi_pool_get(struct net *net)
+{
+	struct net_device *dev;
+	struct ovpn_napi *napi;
+
+	mutex_lock(&ovpn_napi_pools_lock);
+	list_for_each_entry(napi, &ovpn_napi_pools, list) {
+		if (net_eq(napi->net, net)) {
+			napi->users++;
+			goto unlock;
+		}
+	}
+
+	/* the decrypted packets keep pointing to their own interface */
+	dev = alloc_netdev_dummy(0);
+	if (!dev) {
+		napi = NULL;
+		goto unlock;
+	}
+
+	napi = ovpn_napi_alloc(dev);
+	if (!napi) {
+		free_netdev(dev);
+		goto unlock;
+	}
+
+	napi->dev = dev;
+	napi->net = net;
+	napi->users = 1;
+	list_add(&napi->list, &ovpn_napi_pools);
+unlock:
+	mutex_unlock(&ovpn_napi_pools_lock);
+	return napi;
+}
+
+/**
+ * struct ovpn_napi_flush - packets of an interface leaving a pool
+ * @cell: the RX context being flushed
+ * @ovpn: the interface leaving the pool
+ * @rx: decrypted packets of @ovpn taken from the pool
+ * @held: packets of @ovpn taken from the pool, holding a reference to their
+ *	  peer
+ */
+struct ovpn_napi_flush {
+	struct ovpn_napi_cell *cell;
+	struct ovpn_struct *ovpn;
+	struct sk_buff_head rx;
+	struct sk_buff_head held;
+};
+
+/* move the packets of ovpn from queue to list. The packets to send and the
+ * steered ones refer to their instance through their peer
+ */
+static void ovpn_napi_queue_take(struct sk_buff_head *queue,
+				 struct sk_buff_head *list,
+				 const struct ovpn_struct *ovpn, bool held)
+{
+	struct sk_buff *skb, *tmp;
+
+	skb_queue_walk_safe(queue, skb, tmp) {
+		if (held ? ovpn_skb_cb(skb)->peer->ovpn != ovpn :
+			   skb->dev != ovpn->dev)
+			continue;
+
+		__skb_unlink(skb, queue);
+		__skb_queue_tail(list, skb);
+	}
+}
+
+/* the lockless queues of a cell are fed by its own CPU only */
+static int ovpn_napi_cell_flush(void *arg)
+{
+	struct ovpn_napi_flush *flush = arg;
+	struct ovpn_napi_cell *cell = flush->cell;
+
+	local_bh_disable();
+	ovpn_napi_queue_take(&cell->queue, &flush->rx, flush->ovpn, false);
+	local_irq_disable();
+	ovpn_napi_queue_take(&cell->tx_queue, &flush->held, flush->ovpn, true);
+	local_irq_enable();
+	local_bh_enable();
+
+	return 0;
+}
+
+/* drop the packets of ovpn still queued to the pool it is leaving */
+static void ovpn_napi_pool_flush(struct ovpn_napi *napi,
+				 struct ovpn_struct *ovpn)
+{
+	struct ovpn_napi_flush flush = { .ovpn = ovpn };
+	struct ovpn_napi_cell *cell;
+	struct sk_buff *skb;
+	int cpu;
+
+	__skb_queue_head_init(&flush.rx);
+	__skb_queue_head_init(&flush.held);
+
+	cpus_read_lock();
+	for_each_possible_cpu(cpu) {
+		cell = per_cpu_ptr(napi->cells, cpu);
+		flush.cell = cell;
+
+		/* the poll is completed, delivering the packets held by GRO */
+		napi_disable(&cell->napi);
+
+		ovpn_napi_queue_take(&cell->steer_list, &flush.held, ovpn,
+				     true);
+		spin_lock_bh(&cell->steer_queue.lock);
+		ovpn_napi_queue_take(&cell->steer_queue, &flush.held, ovpn,
+				     true);
+		spin_unlock_bh(&cell->steer_queue.lock);
+
+		/* nobody feeds the queues of an offline CPU */
+		if (!cpu_online(cpu) ||
+		    smp_call_on_cpu(cpu, ovpn_napi_cell_flush, &flush, false))
+			ovpn_napi_cell_flush(&flush);
+
+		napi_enable(&cell->napi);
+	}
+	cpus_read_unlock();
+
+	while ((skb = __skb_dequeue(&flush.rx))) {
+		ovpn_mem_uncharge(ovpn, skb->truesize);
+		kfree_skb(skb);
+	}
+	while ((skb = __skb_dequeue(&flush.held))) {
+		ovpn_peer_put(ovpn_skb_cb(skb)->peer);
+		kfree_skb(skb);
+	}
+}
+
+/* leave the pool, destroying it along with the last interface */
+static void ovpn_napi_pool_put(struct ovpn_napi *napi,
+			       struct ovpn_struct *ovpn)
+{
+	struct net_device *dev = napi->dev;
+
+	mutex_lock(&ovpn_napi_pools_lock);
+	if (--napi->users) {
+		ovpn_napi_pool_flush(napi, ovpn);
+		mutex_unlock(&ovpn_napi_pools_lock);
+		return;
+	}
+
+	list_del(&napi->list);
+	mutex_unlock(&ovpn_napi_pools_lock);
+
+	ovpn_napi_free(napi);
+	free_netdev(dev);
+}
+
+/**
+ * ovpn_napi_init - create the per-CPU RX contexts of an interface
+ * @ovpn: the instance to create the contexts for
+ *
+ * Interfaces created with a shared pool rather join the RX contexts of their
+ * netns, so that their number does not grow with the interfaces.
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_napi_init(struct ovpn_struct *ovpn)
+{
+	struct ovpn_napi *napi;
+
+	if (ovpn->shared_napi)
+		napi = ovpn_napi_pool_get(dev_net(ovpn->dev));
+	else
+		napi = ovpn_napi_alloc(ovpn->dev);
+	if (!napi)
+		return -ENOMEM;
+
+	ovpn->napi = napi;
+
+	return 0;
+}
+
+/**
+ * ovpn_napi_destroy - tear down the per-CPU RX contexts of an interface
+ * @ovpn: the instance whose contexts should be destroyed
+ */
+void ovpn_napi_destroy(struct ovpn_struct *ovpn)
+{
+	struct ovpn_napi *napi = ovpn->napi;
+
+	if (!napi)
+		return;
+
+	if (napi->dev)
+		ovpn_napi_pool_put(napi, ovpn);
+	else
+		ovpn_napi_free(napi);
+	ovpn->napi = NULL;
+}
+
+/**
+ * ovpn_napi_receive - queue a decrypted packet for delivery to the stack
+ * @ovpn: the instance the packet was received on
+ * @skb: the packet to deliver
+ *
+ * Return: NET_RX_SUCCESS if the packet was queued or NET_RX_DROP if it was
+ * dropped (and accounted for)
+ */
+int ovpn_napi_receive(struct ovpn_struct *ovpn, struct sk_buff *skb)
+{
+	struct net_device *dev = ovpn->dev;
+	enum ovpn_drop_reason reason;
+	struct ovpn_napi_cell *cell;
+
+	if (unlikely(!(dev->flags & IFF_UP))) {
+		reason = OVPN_DROP_IFACE_DOWN;
+		goto drop;
+	}
+
+	/* GRO cannot work on shared data */
+	if (skb_cloned(skb) || netif_elide_gro(dev))
+		return netif_rx(skb);
+
+	/* the TCP transport may receive from process context */
+	local_bh_disable();
+	cell = this_cpu_ptr(ovpn->napi->cells);
+	if (unlikely(skb_queue_len(&cell->queue) >= OVPN_QUEUE_LEN)) {
+		local_bh_enable();
+		ovpn_dev_stats_inc(ovpn, rx_backlog_dropped);
+		reason = OVPN_DROP_RX_BACKLOG;
+		goto drop;
+	}
+
+	if (unlikely(!ovpn_mem_charge(ovpn, skb->truesize))) {
+		local_bh_enable();
+		reason = OVPN_DROP_MEM_BUDGET;
+		goto drop;
+	}
+
+	__skb_queue_tail(&cell->queue, skb);
+	if (skb_queue_len(&cell->queue) == 1)
+		napi_schedule(&cell->napi);
+	local_bh_enable();
+
+	return NET_RX_SUCCESS;
+
+drop:
+	ovpn_rx_drop(ovpn, skb, reason);
+	return NET_RX_DROP;
+}
+
+/**
+ * ovpn_napi_send - queue a packet completed by an async engine for sending
+ * @ovpn: the instance the packet is sent on
+ * @skb: the encrypted UDP packet, holding a reference to its peer
+ *
+ * May be called in any context, hard IRQ included.
+ */
+void ovpn_napi_send(struct ovpn_struct *ovpn, struct sk_buff *skb)
+{
+	struct ovpn_napi_cell *cell;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	cell = this_cpu_ptr(ovpn->napi->cells);
+	__skb_queue_tail(&cell->tx_queue, skb);
+	if (skb_queue_len(&cell->tx_queue) == 1)
+		napi_schedule(&cell->napi);
+	local_irq_restore(flags);
+}
+
+/**
+ * ovpn_napi_steer - steer a received packet to the preferred CPU of its peer
+ * @peer: the peer the packet was received from
+ * @skb: the encrypted packet, holding a reference to @peer
+ *
+ * Must be called with BHs disabled.
+ *
+ * Return: true if the packet was consumed (steered or dropped) together with
+ * the reference to @peer, false if it should be decrypted by the current CPU
+ */
+bool ovpn_napi_steer(struct ovpn_peer *peer, struct sk_buff *skb)
+{
+	struct ovpn_struct *ovpn = peer->ovpn;
+	int cpu = READ_ONCE(peer->rx_cpu);
+	struct ovpn_napi_cell *cell;
+	bool kick;
+
+	if (likely(cpu < 0) || cpu == smp_processor_id() || !cpu_online(cpu))
+		return false;
+
+	cell = per_cpu_ptr(ovpn->napi->cells, cpu);
+
+	spin_lock(&cell->steer_queue.lock);
+	if (unlikely(skb_queue_len(&cell->steer_queue) >= OVPN_QUEUE_LEN)) {
+		spin_unlock(&cell->steer_queue.lock);
+		ovpn_peer_rx_drop(peer, skb, OVPN_DROP_STEER_BACKLOG);
+		ovpn_peer_put(peer);
+		return true;
+	}
+
+	ovpn_skb_cb(skb)->peer = peer;
+	__skb_queue_tail(&cell->steer_queue, skb);
+	/* the poll empties the queue before completing: a non-empty queue
+	 * means the poll is already scheduled
+	 */
+	kick = skb_queue_len(&cell->steer_queue) == 1;
+	spin_unlock(&cell->steer_queue.lock);
+
+	/* the packet and its peer now belong to the target CPU */
+	ovpn_dev_stats_inc(ovpn, rx_steered);
+
+	if (!kick || test_and_set_bit_lock(OVPN_NAPI_STEER_KICK, &cell->flags))
+		return true;
+
+	if (unlikely(smp_call_function_single_async(cpu, &cell->csd))) {
+		/* the CPU went offline: poll the cell from here instead */
+		clear_bit_unlock(OVPN_NAPI_STEER_KICK, &cell->flags);
+		napi_schedule(&cell->napi);
+	}
+
+	return true;
+}
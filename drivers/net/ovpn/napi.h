@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_NAPI_H_
+#define _NET_OVPN_NAPI_H_
+
+#include <linux/netdevice.h>
+#include <linux/skbuff.h>
+#include <linux/smp.h>
+
+struct ovpn_peer;
+struct ovpn_struct;
+
+/* bit of ovpn_napi_cell::flags set while @csd is in flight */
+#define OVPN_NAPI_STEER_KICK	0
+
+/**
+ * struct ovpn_napi_cell - per-CPU RX context of an interface
+ * @queue: decrypted packets waiting to be passed to GRO
+ * @tx_queue: packets encrypted by an async engine, waiting to be sent
+ * @steer_queue: encrypted packets steered to this CPU by other CPUs, waiting
+ *		 to be decrypted
+ * @steer_list: packets taken from @steer_queue by the poll and not yet
+ *		decrypted
+ * @csd: IPI used to schedule @napi on behalf of the CPUs steering packets
+ * @flags: OVPN_NAPI_* bits
+ * @napi: the NAPI context draining the queues
+ */
+struct ovpn_napi_cell {
+	struct sk_buff_head queue;
+	struct sk_buff_head tx_queue;
+	struct sk_buff_head steer_queue;
+	struct sk_buff_head steer_list;
+	call_single_data_t csd;
+	unsigned long flags;
+	struct napi_struct napi;
+};
+
+/**
+ * struct ovpn_napi - RX contexts of an interface, or of a pool shared by
+ *		      several interfaces
+ * @cells: one RX context per possible CPU
+ * @rcu: used to free the contexts in an RCU safe way
+ * @dev: dummy device hosting the contexts of a pool (NULL if not a pool)
+ * @net: netns the interfaces sharing the pool live in
+ * @users: interfaces sharing the pool
+ * @list: entry in the list of pools
+ */
+struct ovpn_napi {
+	struct ovpn_napi_cell __percpu *cells;
+	struct rcu_head rcu;
+	struct net_device *dev;
+	struct net *net;
+	unsigned int users;
+	struct list_head list;
+};
+
+int ovpn_napi_init(struct ovpn_struct *ovpn);
+void ovpn_napi_destroy(struct ovpn_struct *ovpn);
+int ovpn_napi_receive(struct ovpn_struct *ovpn, struct sk_buff *skb);
+void ovpn_napi_send(struct ovpn_struct *ovpn, struct sk_buff *skb);
+bool ovpn_napi_steer(struct ovpn_peer *peer, struct sk_buff *skb);
+
+#endif /* _NET_OVPN_NAPI_H_ */
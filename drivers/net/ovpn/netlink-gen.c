@@ -20,21 +20,105 @@ static const struct netlink_range_validation ovpn_a_peer_local_port_range = {
 	.max	= 65535ULL,
 };
 
+static const struct netlink_range_validation ovpn_a_peer_replay_window_range = {
+	.min	= 64ULL,
+	.max	= 65536ULL,
+};
+
+static const struct netlink_range_validation ovpn_a_peer_rekey_threshold_range = {
+	.min	= 1ULL,
+	.max	= 100ULL,
+};
+
+static const struct netlink_range_validation ovpn_a_peer_sched_weight_range = {
+	.min	= 1ULL,
+	.max	= 256ULL,
+};
+
+static const struct netlink_range_validation ovpn_a_path_weight_range = {
+	.min	= 1ULL,
+	.max	= 255ULL,
+};
+
+static const struct netlink_range_validation ovpn_a_num_tx_queues_range = {
+	.min	= 1ULL,
+	.max	= 4096ULL,
+};
+
+static const struct netlink_range_validation ovpn_a_num_rx_queues_range = {
+	.min	= 1ULL,
+	.max	= 4096ULL,
+};
+
+static const struct netlink_range_validation ovpn_a_peer_table_size_range = {
+	.min	= 16ULL,
+	.max	= 1048576ULL,
+};
+
+static const struct netlink_range_validation ovpn_a_stats_interval_range = {
+	.min	= 1ULL,
+	.max	= 60ULL,
+};
+
 /* Common nested types */
-const struct nla_policy ovpn_keyconf_nl_policy[OVPN_A_KEYCONF_DECRYPT_DIR + 1] = {
+const struct nla_policy ovpn_keyconf_nl_policy[OVPN_A_KEYCONF_HARD_PACKETS + 1] = {
 	[OVPN_A_KEYCONF_SLOT] = NLA_POLICY_MAX(NLA_U32, 1),
 	[OVPN_A_KEYCONF_KEY_ID] = NLA_POLICY_MAX(NLA_U32, 7),
-	[OVPN_A_KEYCONF_CIPHER_ALG] = NLA_POLICY_MAX(NLA_U32, 2),
+	[OVPN_A_KEYCONF_CIPHER_ALG] = NLA_POLICY_MAX(NLA_U32, 3),
 	[OVPN_A_KEYCONF_ENCRYPT_DIR] = NLA_POLICY_NESTED(ovpn_keydir_nl_policy),
 	[OVPN_A_KEYCONF_DECRYPT_DIR] = NLA_POLICY_NESTED(ovpn_keydir_nl_policy),
+	[OVPN_A_KEYCONF_PKTID_64] = { .type = NLA_FLAG, },
+	[OVPN_A_KEYCONF_ASYNC] = { .type = NLA_FLAG, },
+	[OVPN_A_KEYCONF_DATA_V1] = { .type = NLA_FLAG, },
+	[OVPN_A_KEYCONF_SOFT_BYTES] = { .type = NLA_UINT, },
+	[OVPN_A_KEYCONF_HARD_BYTES] = { .type = NLA_UINT, },
+	[OVPN_A_KEYCONF_SOFT_PACKETS] = { .type = NLA_UINT, },
+	[OVPN_A_KEYCONF_HARD_PACKETS] = { .type = NLA_UINT, },
+};
+
+const struct nla_policy ovpn_keystate_nl_policy[OVPN_A_KEYSTATE_PACKETS + 1] = {
+	[OVPN_A_KEYSTATE_SLOT] = NLA_POLICY_MAX(NLA_U32, 1),
+	[OVPN_A_KEYSTATE_KEY_ID] = NLA_POLICY_MAX(NLA_U32, 7),
+	[OVPN_A_KEYSTATE_REPLAY_WINDOW] = { .type = NLA_U32, },
+	[OVPN_A_KEYSTATE_RX_PKTID] = { .type = NLA_UINT, },
+	[OVPN_A_KEYSTATE_RX_PKTID_FLOOR] = { .type = NLA_UINT, },
+	[OVPN_A_KEYSTATE_MAX_BACKTRACK] = { .type = NLA_U32, },
+	[OVPN_A_KEYSTATE_FLOOR_UPDATES] = { .type = NLA_UINT, },
+	[OVPN_A_KEYSTATE_REORDER] = { .type = NLA_UINT, },
+	[OVPN_A_KEYSTATE_TX_PKTID] = { .type = NLA_UINT, },
+	[OVPN_A_KEYSTATE_TX_PKTID_GAP] = { .type = NLA_UINT, },
+	[OVPN_A_KEYSTATE_BYTES] = { .type = NLA_UINT, },
+	[OVPN_A_KEYSTATE_PACKETS] = { .type = NLA_UINT, },
 };
 
-const struct nla_policy ovpn_keydir_nl_policy[OVPN_A_KEYDIR_NONCE_TAIL + 1] = {
+const struct nla_policy ovpn_keydir_nl_policy[OVPN_A_KEYDIR_HMAC_KEY + 1] = {
 	[OVPN_A_KEYDIR_CIPHER_KEY] = NLA_POLICY_MAX_LEN(256),
 	[OVPN_A_KEYDIR_NONCE_TAIL] = NLA_POLICY_EXACT_LEN(OVPN_NONCE_TAIL_SIZE),
+	[OVPN_A_KEYDIR_EPOCH_SECRET] = NLA_POLICY_EXACT_LEN(OVPN_EPOCH_SECRET_SIZE),
+	[OVPN_A_KEYDIR_HMAC_KEY] = NLA_POLICY_MAX_LEN(64),
+};
+
+const struct nla_policy ovpn_iroute_nl_policy[OVPN_A_IROUTE_PREFIX_LEN + 1] = {
+	[OVPN_A_IROUTE_PEER_ID] = NLA_POLICY_FULL_RANGE(NLA_U32, &ovpn_a_peer_id_range),
+	[OVPN_A_IROUTE_IPV4] = { .type = NLA_U32, },
+	[OVPN_A_IROUTE_IPV6] = NLA_POLICY_EXACT_LEN(16),
+	[OVPN_A_IROUTE_PREFIX_LEN] = NLA_POLICY_MAX(NLA_U32, 128),
+};
+
+const struct nla_policy ovpn_mcast_nl_policy[OVPN_A_MCAST_IPV6 + 1] = {
+	[OVPN_A_MCAST_PEER_ID] = NLA_POLICY_FULL_RANGE(NLA_U32, &ovpn_a_peer_id_range),
+	[OVPN_A_MCAST_IPV4] = { .type = NLA_U32, },
+	[OVPN_A_MCAST_IPV6] = NLA_POLICY_EXACT_LEN(16),
 };
 
-const struct nla_policy ovpn_peer_nl_policy[OVPN_A_PEER_LINK_TX_PACKETS + 1] = {
+const struct nla_policy ovpn_path_nl_policy[OVPN_A_PATH_EXCLUDED + 1] = {
+	[OVPN_A_PATH_SOCKADDR_REMOTE] = { .type = NLA_BINARY, },
+	[OVPN_A_PATH_LOCAL_IP] = NLA_POLICY_MAX_LEN(16),
+	[OVPN_A_PATH_WEIGHT] = NLA_POLICY_FULL_RANGE(NLA_U32, &ovpn_a_path_weight_range),
+	[OVPN_A_PATH_EXCLUDED] = { .type = NLA_FLAG, },
+};
+
+const struct nla_policy ovpn_peer_nl_policy[OVPN_A_PEER_OUT_MARK + 1] = {
 	[OVPN_A_PEER_ID] = NLA_POLICY_FULL_RANGE(NLA_U32, &ovpn_a_peer_id_range),
 	[OVPN_A_PEER_SOCKADDR_REMOTE] = { .type = NLA_BINARY, },
 	[OVPN_A_PEER_SOCKET] = { .type = NLA_U32, },
@@ -54,12 +138,102 @@ const struct nla_policy ovpn_peer_nl_policy[OVPN_A_PEER_LINK_TX_PACKETS + 1] = {
 	[OVPN_A_PEER_LINK_TX_BYTES] = { .type = NLA_UINT, },
 	[OVPN_A_PEER_LINK_RX_PACKETS] = { .type = NLA_U32, },
 	[OVPN_A_PEER_LINK_TX_PACKETS] = { .type = NLA_U32, },
+	[OVPN_A_PEER_REPLAY_WINDOW] = NLA_POLICY_FULL_RANGE(NLA_U32, &ovpn_a_peer_replay_window_range),
+	[OVPN_A_PEER_STATS_GEN] = { .type = NLA_U32, },
+	[OVPN_A_PEER_REKEY_THRESHOLD] = NLA_POLICY_FULL_RANGE(NLA_U32, &ovpn_a_peer_rekey_threshold_range),
+	[OVPN_A_PEER_CRYPTO_DRIVER] = { .type = NLA_NUL_STRING, .len = 127, },
+	[OVPN_A_PEER_TX_LATENCY] = { .type = NLA_UINT, },
+	[OVPN_A_PEER_RX_LATENCY] = { .type = NLA_UINT, },
+	[OVPN_A_PEER_DECRYPT_ERRORS] = { .type = NLA_UINT, },
+	[OVPN_A_PEER_REPLAY_ERRORS] = { .type = NLA_UINT, },
+	[OVPN_A_PEER_REPLAY_MAX_BACKTRACK] = { .type = NLA_U32, },
+	[OVPN_A_PEER_RPF_DROPS] = { .type = NLA_UINT, },
+	[OVPN_A_PEER_NO_KEY_DROPS] = { .type = NLA_UINT, },
+	[OVPN_A_PEER_TX_DROPS] = { .type = NLA_UINT, },
+	[OVPN_A_PEER_KEYSTATE] = NLA_POLICY_NESTED(ovpn_keystate_nl_policy),
+	[OVPN_A_PEER_IROUTE] = NLA_POLICY_NESTED(ovpn_iroute_nl_policy),
+	[OVPN_A_PEER_SCHED_WEIGHT] = NLA_POLICY_FULL_RANGE(NLA_U32, &ovpn_a_peer_sched_weight_range),
+	[OVPN_A_PEER_TX_RATE] = { .type = NLA_UINT, },
+	[OVPN_A_PEER_TX_BURST] = { .type = NLA_U32, },
+	[OVPN_A_PEER_RX_RATE] = { .type = NLA_UINT, },
+	[OVPN_A_PEER_RX_BURST] = { .type = NLA_U32, },
+	[OVPN_A_PEER_MTU] = NLA_POLICY_MAX(NLA_U32, 65535),
+	[OVPN_A_PEER_MSS_CLAMP] = NLA_POLICY_MAX(NLA_U32, 1),
+	[OVPN_A_PEER_RX_CPU] = { .type = NLA_S32, },
+	[OVPN_A_PEER_IDLE_TIMEOUT] = { .type = NLA_U32, },
+	[OVPN_A_PEER_PATH] = NLA_POLICY_NESTED(ovpn_path_nl_policy),
+	[OVPN_A_PEER_TX_PORT_MIN] = { .type = NLA_U16, },
+	[OVPN_A_PEER_TX_PORT_MAX] = { .type = NLA_U16, },
+	[OVPN_A_PEER_RX_PORT_MIN] = { .type = NLA_U16, },
+	[OVPN_A_PEER_RX_PORT_MAX] = { .type = NLA_U16, },
+	[OVPN_A_PEER_COMP_STUB] = NLA_POLICY_MAX(NLA_U32, 3),
+	[OVPN_A_PEER_CONNECTED_SOCKET] = { .type = NLA_FLAG, },
+	[OVPN_A_PEER_DECRYPT_RATE] = { .type = NLA_UINT, },
+	[OVPN_A_PEER_DECRYPT_BURST] = { .type = NLA_U32, },
+	[OVPN_A_PEER_DECRYPT_BUDGET_DROPS] = { .type = NLA_UINT, },
+	[OVPN_A_PEER_AUTH_FAIL_RATE] = { .type = NLA_U32, },
+	[OVPN_A_PEER_QUARANTINED] = { .type = NLA_FLAG, },
+	[OVPN_A_PEER_KEEPALIVE_INTERVAL_MS] = { .type = NLA_U32, },
+	[OVPN_A_PEER_KEEPALIVE_TIMEOUT_MS] = { .type = NLA_U32, },
+	[OVPN_A_PEER_PROBE_INTERVAL] = { .type = NLA_U32, },
+	[OVPN_A_PEER_PROBE_SRTT] = { .type = NLA_U32, },
+	[OVPN_A_PEER_PROBE_RTTVAR] = { .type = NLA_U32, },
+	[OVPN_A_PEER_PROBE_LOSS] = { .type = NLA_U32, },
+	[OVPN_A_PEER_PROBE_TX] = { .type = NLA_UINT, },
+	[OVPN_A_PEER_PROBE_RX] = { .type = NLA_UINT, },
+	[OVPN_A_PEER_TCP_SRTT] = { .type = NLA_U32, },
+	[OVPN_A_PEER_TCP_CWND] = { .type = NLA_U32, },
+	[OVPN_A_PEER_TCP_TOTAL_RETRANS] = { .type = NLA_U32, },
+	[OVPN_A_PEER_TCP_DELIVERY_RATE] = { .type = NLA_UINT, },
+	[OVPN_A_PEER_TCP_OUT_QUEUE] = { .type = NLA_U32, },
+	[OVPN_A_PEER_TCP_TX_EAGAIN] = { .type = NLA_UINT, },
+	[OVPN_A_PEER_ENCRYPT_NS] = { .type = NLA_UINT, },
+	[OVPN_A_PEER_DECRYPT_NS] = { .type = NLA_UINT, },
+	[OVPN_A_PEER_MIRROR_IFINDEX] = { .type = NLA_U32, },
+	[OVPN_A_PEER_MIRROR_SNAPLEN] = { .type = NLA_U32, },
+	[OVPN_A_PEER_MIRROR_SAMPLE] = NLA_POLICY_MIN(NLA_U32, 1),
+	[OVPN_A_PEER_MIRROR_CIPHERTEXT] = NLA_POLICY_MAX(NLA_U32, 1),
+	[OVPN_A_PEER_TCP_STRIPE] = { .type = NLA_U32, },
+	[OVPN_A_PEER_TCP_STREAMS] = { .type = NLA_U32, },
+	[OVPN_A_PEER_RESET] = { .type = NLA_FLAG, },
+	[OVPN_A_PEER_OUT_MARK] = { .type = NLA_U32, },
 };
 
 /* OVPN_CMD_NEW_IFACE - do */
-static const struct nla_policy ovpn_new_iface_nl_policy[OVPN_A_MODE + 1] = {
+static const struct nla_policy ovpn_new_iface_nl_policy[OVPN_A_MEM_BUDGET + 1] = {
 	[OVPN_A_IFNAME] = { .type = NLA_NUL_STRING, },
 	[OVPN_A_MODE] = NLA_POLICY_MAX(NLA_U32, 1),
+	[OVPN_A_NUM_TX_QUEUES] = NLA_POLICY_FULL_RANGE(NLA_U32, &ovpn_a_num_tx_queues_range),
+	[OVPN_A_NUM_RX_QUEUES] = NLA_POLICY_FULL_RANGE(NLA_U32, &ovpn_a_num_rx_queues_range),
+	[OVPN_A_PEER_TABLE_SIZE] = NLA_POLICY_FULL_RANGE(NLA_U32, &ovpn_a_peer_table_size_range),
+	[OVPN_A_SHARED_DST_CACHE] = { .type = NLA_FLAG, },
+	[OVPN_A_PARALLEL_RX] = { .type = NLA_FLAG, },
+	[OVPN_A_PARALLEL_TX] = { .type = NLA_FLAG, },
+	[OVPN_A_PARALLEL_CPUS] = { .type = NLA_BINARY, },
+	[OVPN_A_COMPACT_KEYS] = { .type = NLA_FLAG, },
+	[OVPN_A_AES_GCM_DRIVER] = { .type = NLA_NUL_STRING, .len = 127, },
+	[OVPN_A_CHACHA20_POLY1305_DRIVER] = { .type = NLA_NUL_STRING, .len = 127, },
+	[OVPN_A_LIB_CRYPTO_MAX_LEN] = { .type = NLA_U32, },
+	[OVPN_A_LATENCY_HIST] = { .type = NLA_FLAG, },
+	[OVPN_A_FAIR_QUEUE] = { .type = NLA_FLAG, },
+	[OVPN_A_INHERIT_DSFIELD] = { .type = NLA_FLAG, },
+	[OVPN_A_PMTU_DISC] = { .type = NLA_FLAG, },
+	[OVPN_A_CTRL_NETLINK] = { .type = NLA_FLAG, },
+	[OVPN_A_STATS_INTERVAL] = NLA_POLICY_FULL_RANGE(NLA_U32, &ovpn_a_stats_interval_range),
+	[OVPN_A_CLIENT_TO_CLIENT] = { .type = NLA_FLAG, },
+	[OVPN_A_THREADED] = { .type = NLA_FLAG, },
+	[OVPN_A_COMPACT] = { .type = NLA_FLAG, },
+	[OVPN_A_SHARED_SOCKET] = { .type = NLA_FLAG, },
+	[OVPN_A_SHARED_NAPI] = { .type = NLA_FLAG, },
+	[OVPN_A_IFACE_COUNT] = NLA_POLICY_RANGE(NLA_U32, 1, 128),
+	[OVPN_A_DIRECT_XMIT] = { .type = NLA_FLAG, },
+	[OVPN_A_UDP_ZERO_CSUM] = { .type = NLA_FLAG, },
+	[OVPN_A_UDP6_ZERO_CSUM] = { .type = NLA_FLAG, },
+	[OVPN_A_CPU_TIME] = { .type = NLA_FLAG, },
+	[OVPN_A_TOP_TALKERS] = { .type = NLA_FLAG, },
+	[OVPN_A_SAMPLE_RATE] = { .type = NLA_U32, },
+	[OVPN_A_PARALLEL_RX_ADAPTIVE] = { .type = NLA_FLAG, },
+	[OVPN_A_MEM_BUDGET] = { .type = NLA_U32, },
 };
 
 /* OVPN_CMD_DEL_IFACE - do */
@@ -74,14 +248,17 @@ static const struct nla_policy ovpn_set_peer_nl_policy[OVPN_A_PEER + 1] = {
 };
 
 /* OVPN_CMD_GET_PEER - do */
-static const struct nla_policy ovpn_get_peer_do_nl_policy[OVPN_A_PEER + 1] = {
+static const struct nla_policy ovpn_get_peer_do_nl_policy[OVPN_A_PEER_INFO + 1] = {
 	[OVPN_A_IFINDEX] = { .type = NLA_U32, },
 	[OVPN_A_PEER] = NLA_POLICY_NESTED(ovpn_peer_nl_policy),
+	[OVPN_A_PEER_INFO] = NLA_POLICY_MASK(NLA_U32, 0x3ff),
 };
 
 /* OVPN_CMD_GET_PEER - dump */
-static const struct nla_policy ovpn_get_peer_dump_nl_policy[OVPN_A_IFINDEX + 1] = {
+static const struct nla_policy ovpn_get_peer_dump_nl_policy[OVPN_A_PEER_INFO + 1] = {
 	[OVPN_A_IFINDEX] = { .type = NLA_U32, },
+	[OVPN_A_STATS_GEN] = { .type = NLA_U32, },
+	[OVPN_A_PEER_INFO] = NLA_POLICY_MASK(NLA_U32, 0x3ff),
 };
 
 /* OVPN_CMD_DEL_PEER - do */
@@ -108,13 +285,73 @@ static const struct nla_policy ovpn_del_key_nl_policy[OVPN_A_PEER + 1] = {
 	[OVPN_A_PEER] = NLA_POLICY_NESTED(ovpn_peer_nl_policy),
 };
 
+/* OVPN_CMD_NEW_IROUTE - do */
+static const struct nla_policy ovpn_new_iroute_nl_policy[OVPN_A_IROUTE + 1] = {
+	[OVPN_A_IFINDEX] = { .type = NLA_U32, },
+	[OVPN_A_IROUTE] = NLA_POLICY_NESTED(ovpn_iroute_nl_policy),
+};
+
+/* OVPN_CMD_DEL_IROUTE - do */
+static const struct nla_policy ovpn_del_iroute_nl_policy[OVPN_A_IROUTE + 1] = {
+	[OVPN_A_IFINDEX] = { .type = NLA_U32, },
+	[OVPN_A_IROUTE] = NLA_POLICY_NESTED(ovpn_iroute_nl_policy),
+};
+
+/* OVPN_CMD_NEW_PEERS - do */
+static const struct nla_policy ovpn_new_peers_nl_policy[OVPN_A_PEERS + 1] = {
+	[OVPN_A_IFINDEX] = { .type = NLA_U32, },
+	[OVPN_A_PEERS] = NLA_POLICY_NESTED(ovpn_peer_nl_policy),
+};
+
+/* OVPN_CMD_SET_KEYS - do */
+static const struct nla_policy ovpn_set_keys_nl_policy[OVPN_A_PEERS + 1] = {
+	[OVPN_A_IFINDEX] = { .type = NLA_U32, },
+	[OVPN_A_PEERS] = NLA_POLICY_NESTED(ovpn_peer_nl_policy),
+};
+
+/* OVPN_CMD_SWAP_KEYS_BULK - do */
+static const struct nla_policy ovpn_swap_keys_bulk_nl_policy[OVPN_A_PEERS + 1] = {
+	[OVPN_A_IFINDEX] = { .type = NLA_U32, },
+	[OVPN_A_PEERS] = NLA_POLICY_NESTED(ovpn_peer_nl_policy),
+};
+
+/* OVPN_CMD_NEW_MCAST - do */
+static const struct nla_policy ovpn_new_mcast_nl_policy[OVPN_A_MCAST + 1] = {
+	[OVPN_A_IFINDEX] = { .type = NLA_U32, },
+	[OVPN_A_MCAST] = NLA_POLICY_NESTED(ovpn_mcast_nl_policy),
+};
+
+/* OVPN_CMD_DEL_MCAST - do */
+static const struct nla_policy ovpn_del_mcast_nl_policy[OVPN_A_MCAST + 1] = {
+	[OVPN_A_IFINDEX] = { .type = NLA_U32, },
+	[OVPN_A_MCAST] = NLA_POLICY_NESTED(ovpn_mcast_nl_policy),
+};
+
+/* OVPN_CMD_SET_KEYSTATE - do */
+static const struct nla_policy ovpn_set_keystate_nl_policy[OVPN_A_PEERS + 1] = {
+	[OVPN_A_IFINDEX] = { .type = NLA_U32, },
+	[OVPN_A_PEERS] = NLA_POLICY_NESTED(ovpn_peer_nl_policy),
+};
+
+/* OVPN_CMD_DEL_IFACES - do */
+static const struct nla_policy ovpn_del_ifaces_nl_policy[OVPN_A_IFINDEX + 1] = {
+	[OVPN_A_IFINDEX] = { .type = NLA_U32, },
+};
+
+/* OVPN_CMD_GET_TOP_PEERS - do */
+static const struct nla_policy ovpn_get_top_peers_nl_policy[OVPN_A_TOP_TX + 1] = {
+	[OVPN_A_IFINDEX] = { .type = NLA_U32, },
+	[OVPN_A_TOP_N] = NLA_POLICY_RANGE(NLA_U32, 1, 64),
+	[OVPN_A_TOP_TX] = { .type = NLA_FLAG, },
+};
+
 /* Ops table for ovpn */
 static const struct genl_split_ops ovpn_nl_ops[] = {
 	{
 		.cmd		= OVPN_CMD_NEW_IFACE,
 		.doit		= ovpn_nl_new_iface_doit,
 		.policy		= ovpn_new_iface_nl_policy,
-		.maxattr	= OVPN_A_MODE,
+		.maxattr	= OVPN_A_MEM_BUDGET,
 		.flags		= GENL_ADMIN_PERM | GENL_CMD_CAP_DO,
 	},
 	{
@@ -141,14 +378,14 @@ static const struct genl_split_ops ovpn_nl_ops[] = {
 		.doit		= ovpn_nl_get_peer_doit,
 		.post_doit	= ovpn_nl_post_doit,
 		.policy		= ovpn_get_peer_do_nl_policy,
-		.maxattr	= OVPN_A_PEER,
+		.maxattr	= OVPN_A_PEER_INFO,
 		.flags		= GENL_ADMIN_PERM | GENL_CMD_CAP_DO,
 	},
 	{
 		.cmd		= OVPN_CMD_GET_PEER,
 		.dumpit		= ovpn_nl_get_peer_dumpit,
 		.policy		= ovpn_get_peer_dump_nl_policy,
-		.maxattr	= OVPN_A_IFINDEX,
+		.maxattr	= OVPN_A_PEER_INFO,
 		.flags		= GENL_ADMIN_PERM | GENL_CMD_CAP_DUMP,
 	},
 	{
@@ -187,10 +424,102 @@ static const struct genl_split_ops ovpn_nl_ops[] = {
 		.maxattr	= OVPN_A_PEER,
 		.flags		= GENL_ADMIN_PERM | GENL_CMD_CAP_DO,
 	},
+	{
+		.cmd		= OVPN_CMD_NEW_IROUTE,
+		.pre_doit	= ovpn_nl_pre_doit,
+		.doit		= ovpn_nl_new_iroute_doit,
+		.post_doit	= ovpn_nl_post_doit,
+		.policy		= ovpn_new_iroute_nl_policy,
+		.maxattr	= OVPN_A_IROUTE,
+		.flags		= GENL_ADMIN_PERM | GENL_CMD_CAP_DO,
+	},
+	{
+		.cmd		= OVPN_CMD_DEL_IROUTE,
+		.pre_doit	= ovpn_nl_pre_doit,
+		.doit		= ovpn_nl_del_iroute_doit,
+		.post_doit	= ovpn_nl_post_doit,
+		.policy		= ovpn_del_iroute_nl_policy,
+		.maxattr	= OVPN_A_IROUTE,
+		.flags		= GENL_ADMIN_PERM | GENL_CMD_CAP_DO,
+	},
+	{
+		.cmd		= OVPN_CMD_NEW_PEERS,
+		.pre_doit	= ovpn_nl_pre_doit,
+		.doit		= ovpn_nl_new_peers_doit,
+		.post_doit	= ovpn_nl_post_doit,
+		.policy		= ovpn_new_peers_nl_policy,
+		.maxattr	= OVPN_A_PEERS,
+		.flags		= GENL_ADMIN_PERM | GENL_CMD_CAP_DO,
+	},
+	{
+		.cmd		= OVPN_CMD_SET_KEYS,
+		.pre_doit	= ovpn_nl_pre_doit,
+		.doit		= ovpn_nl_set_keys_doit,
+		.post_doit	= ovpn_nl_post_doit,
+		.policy		= ovpn_set_keys_nl_policy,
+		.maxattr	= OVPN_A_PEERS,
+		.flags		= GENL_ADMIN_PERM | GENL_CMD_CAP_DO,
+	},
+	{
+		.cmd		= OVPN_CMD_SWAP_KEYS_BULK,
+		.pre_doit	= ovpn_nl_pre_doit,
+		.doit		= ovpn_nl_swap_keys_bulk_doit,
+		.post_doit	= ovpn_nl_post_doit,
+		.policy		= ovpn_swap_keys_bulk_nl_policy,
+		.maxattr	= OVPN_A_PEERS,
+		.flags		= GENL_ADMIN_PERM | GENL_CMD_CAP_DO,
+	},
+	{
+		.cmd		= OVPN_CMD_NEW_MCAST,
+		.pre_doit	= ovpn_nl_pre_doit,
+		.doit		= ovpn_nl_new_mcast_doit,
+		.post_doit	= ovpn_nl_post_doit,
+		.policy		= ovpn_new_mcast_nl_policy,
+		.maxattr	= OVPN_A_MCAST,
+		.flags		= GENL_ADMIN_PERM | GENL_CMD_CAP_DO,
+	},
+	{
+		.cmd		= OVPN_CMD_DEL_MCAST,
+		.pre_doit	= ovpn_nl_pre_doit,
+		.doit		= ovpn_nl_del_mcast_doit,
+		.post_doit	= ovpn_nl_post_doit,
+		.policy		= ovpn_del_mcast_nl_policy,
+		.maxattr	= OVPN_A_MCAST,
+		.flags		= GENL_ADMIN_PERM | GENL_CMD_CAP_DO,
+	},
+	{
+		.cmd		= OVPN_CMD_SET_KEYSTATE,
+		.pre_doit	= ovpn_nl_pre_doit,
+		.doit		= ovpn_nl_set_keystate_doit,
+		.post_doit	= ovpn_nl_post_doit,
+		.policy		= ovpn_set_keystate_nl_policy,
+		.maxattr	= OVPN_A_PEERS,
+		.flags		= GENL_ADMIN_PERM | GENL_CMD_CAP_DO,
+	},
+	{
+		.cmd		= OVPN_CMD_DEL_IFACES,
+		.doit		= ovpn_nl_del_ifaces_doit,
+		.policy		= ovpn_del_ifaces_nl_policy,
+		.maxattr	= OVPN_A_IFINDEX,
+		.flags		= GENL_ADMIN_PERM | GENL_CMD_CAP_DO,
+	},
+	{
+		.cmd		= OVPN_CMD_GET_TOP_PEERS,
+		.pre_doit	= ovpn_nl_pre_doit,
+		.doit		= ovpn_nl_get_top_peers_doit,
+		.post_doit	= ovpn_nl_post_doit,
+		.policy		= ovpn_get_top_peers_nl_policy,
+		.maxattr	= OVPN_A_TOP_TX,
+		.flags		= GENL_ADMIN_PERM | GENL_CMD_CAP_DO,
+	},
 };
 
 static const struct genl_multicast_group ovpn_nl_mcgrps[] = {
 	[OVPN_NLGRP_PEERS] = { "peers", },
+	[OVPN_NLGRP_CTRL] = { "ctrl", .flags = GENL_MCAST_CAP_NET_ADMIN, },
+	[OVPN_NLGRP_STATS] = { "stats", .flags = GENL_MCAST_CAP_NET_ADMIN, },
+	[OVPN_NLGRP_FLOATS] = { "floats", .flags = GENL_MCAST_CAP_NET_ADMIN, },
+	[OVPN_NLGRP_SAMPLES] = { "samples", .flags = GENL_MCAST_CAP_NET_ADMIN, },
 };
 
 struct genl_family ovpn_nl_family __ro_after_init = {
@@ -12,9 +12,13 @@
 #include <uapi/linux/ovpn.h>
 
 /* Common nested types */
-extern const struct nla_policy ovpn_keyconf_nl_policy[OVPN_A_KEYCONF_DECRYPT_DIR + 1];
-extern const struct nla_policy ovpn_keydir_nl_policy[OVPN_A_KEYDIR_NONCE_TAIL + 1];
-extern const struct nla_policy ovpn_peer_nl_policy[OVPN_A_PEER_LINK_TX_PACKETS + 1];
+extern const struct nla_policy ovpn_keyconf_nl_policy[OVPN_A_KEYCONF_HARD_PACKETS + 1];
+extern const struct nla_policy ovpn_keystate_nl_policy[OVPN_A_KEYSTATE_PACKETS + 1];
+extern const struct nla_policy ovpn_keydir_nl_policy[OVPN_A_KEYDIR_HMAC_KEY + 1];
+extern const struct nla_policy ovpn_peer_nl_policy[OVPN_A_PEER_OUT_MARK + 1];
+extern const struct nla_policy ovpn_iroute_nl_policy[OVPN_A_IROUTE_PREFIX_LEN + 1];
+extern const struct nla_policy ovpn_mcast_nl_policy[OVPN_A_MCAST_IPV6 + 1];
+extern const struct nla_policy ovpn_path_nl_policy[OVPN_A_PATH_EXCLUDED + 1];
 
 int ovpn_nl_pre_doit(const struct genl_split_ops *ops, struct sk_buff *skb,
 		     struct genl_info *info);
@@ -31,9 +35,23 @@ int ovpn_nl_del_peer_doit(struct sk_buff *skb, struct genl_info *info);
 int ovpn_nl_set_key_doit(struct sk_buff *skb, struct genl_info *info);
 int ovpn_nl_swap_keys_doit(struct sk_buff *skb, struct genl_info *info);
 int ovpn_nl_del_key_doit(struct sk_buff *skb, struct genl_info *info);
+int ovpn_nl_new_iroute_doit(struct sk_buff *skb, struct genl_info *info);
+int ovpn_nl_del_iroute_doit(struct sk_buff *skb, struct genl_info *info);
+int ovpn_nl_new_peers_doit(struct sk_buff *skb, struct genl_info *info);
+int ovpn_nl_set_keys_doit(struct sk_buff *skb, struct genl_info *info);
+int ovpn_nl_swap_keys_bulk_doit(struct sk_buff *skb, struct genl_info *info);
+int ovpn_nl_new_mcast_doit(struct sk_buff *skb, struct genl_info *info);
+int ovpn_nl_del_mcast_doit(struct sk_buff *skb, struct genl_info *info);
+int ovpn_nl_set_keystate_doit(struct sk_buff *skb, struct genl_info *info);
+int ovpn_nl_del_ifaces_doit(struct sk_buff *skb, struct genl_info *info);
+int ovpn_nl_get_top_peers_doit(struct sk_buff *skb, struct genl_info *info);
 
 enum {
 	OVPN_NLGRP_PEERS,
+	OVPN_NLGRP_CTRL,
+	OVPN_NLGRP_STATS,
+	OVPN_NLGRP_FLOATS,
+	OVPN_NLGRP_SAMPLES,
 };
 
 extern struct genl_family ovpn_nl_family;
@@ -6,22 +6,37 @@
  *  Author:	Antonio Quartulli <antonio@openvpn.net>
  */
 
+#include <linux/bitmap.h>
+#include <linux/cpumask.h>
 #include <linux/netdevice.h>
+#include <linux/overflow.h>
 #include <linux/rtnetlink.h>
 #include <linux/types.h>
 #include <net/genetlink.h>
+#include <net/ip.h>
 
 #include <uapi/linux/ovpn.h>
 
 #include "ovpnstruct.h"
 #include "main.h"
+#include "crypto_aead.h"
 #include "io.h"
 #include "netlink.h"
 #include "netlink-gen.h"
 #include "bind.h"
+#include "cputime.h"
+#include "iroute.h"
+#include "mcast.h"
+#include "mem.h"
+#include "mirror.h"
+#include "latency.h"
 #include "packet.h"
 #include "peer.h"
+#include "probe.h"
+#include "sample.h"
 #include "socket.h"
+#include "tcp.h"
+#include "topk.h"
 
 MODULE_ALIAS_GENL_FAMILY(OVPN_FAMILY_NAME);
 
@@ -88,49 +103,207 @@ void ovpn_nl_post_doit(const struct genl_split_ops *ops, struct sk_buff *skb,
 		netdev_put(ovpn->dev, NULL);
 }
 
+/* parse the CPU set parallel crypto should use, encoded as an array of u32
+ * (CPU 0 being the LSB of the first item)
+ */
+static int ovpn_nl_parse_cpus(struct nlattr *attr, struct cpumask *cpus,
+			      struct netlink_ext_ack *extack)
+{
+	unsigned int nbits = nla_len(attr) * BITS_PER_BYTE;
+
+	if (nla_len(attr) % sizeof(u32)) {
+		NL_SET_ERR_MSG_ATTR(extack, attr,
+				    "CPU set must be an array of u32");
+		return -EINVAL;
+	}
+
+	bitmap_from_arr32(cpumask_bits(cpus), nla_data(attr),
+			  min_t(unsigned int, nbits, nr_cpumask_bits));
+	cpumask_and(cpus, cpus, cpu_possible_mask);
+	if (cpumask_empty(cpus)) {
+		NL_SET_ERR_MSG_ATTR(extack, attr,
+				    "CPU set includes no possible CPU");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* tear down a set of interfaces, unregistered all at once */
+static void ovpn_nl_ifaces_destroy(struct net_device **devs, unsigned int n)
+{
+	LIST_HEAD(list);
+	unsigned int i;
+
+	rtnl_lock();
+	for (i = 0; i < n; i++) {
+		ovpn_iface_destruct(netdev_priv(devs[i]));
+		unregister_netdevice_queue(devs[i], &list);
+	}
+	unregister_netdevice_many(&list);
+	rtnl_unlock();
+}
+
 int ovpn_nl_new_iface_doit(struct sk_buff *skb, struct genl_info *info)
 {
+	struct ovpn_iface_config conf = {
+		.mode = OVPN_MODE_P2P,
+		.txqs = 1,
+		.rxqs = 1,
+		.table_size = OVPN_PEER_TABLE_SIZE,
+	};
 	const char *ifname = OVPN_DEFAULT_IFNAME;
-	enum ovpn_mode mode = OVPN_MODE_P2P;
+	unsigned int count = 1, i, n;
+	struct net_device **devs;
+	cpumask_var_t cpus;
 	struct net_device *dev;
 	struct sk_buff *msg;
 	void *hdr;
+	int ret;
 
 	if (info->attrs[OVPN_A_IFNAME])
 		ifname = nla_data(info->attrs[OVPN_A_IFNAME]);
 
+	if (info->attrs[OVPN_A_IFACE_COUNT])
+		count = nla_get_u32(info->attrs[OVPN_A_IFACE_COUNT]);
+
+	if (count > 1 && !strchr(ifname, '%')) {
+		NL_SET_ERR_MSG_MOD(info->extack,
+				   "a batch of interfaces needs a name template");
+		return -EINVAL;
+	}
+
 	if (info->attrs[OVPN_A_MODE]) {
-		mode = nla_get_u32(info->attrs[OVPN_A_MODE]);
-		pr_debug("ovpn: setting device (%s) mode: %u\n", ifname, mode);
+		conf.mode = nla_get_u32(info->attrs[OVPN_A_MODE]);
+		pr_debug("ovpn: setting device (%s) mode: %u\n", ifname,
+			 conf.mode);
+	}
+
+	conf.compact = !!info->attrs[OVPN_A_COMPACT];
+	if (conf.compact)
+		conf.table_size = OVPN_PEER_TABLE_SIZE_COMPACT;
+
+	if (info->attrs[OVPN_A_NUM_TX_QUEUES])
+		conf.txqs = nla_get_u32(info->attrs[OVPN_A_NUM_TX_QUEUES]);
+
+	if (info->attrs[OVPN_A_NUM_RX_QUEUES])
+		conf.rxqs = nla_get_u32(info->attrs[OVPN_A_NUM_RX_QUEUES]);
+
+	if (info->attrs[OVPN_A_PEER_TABLE_SIZE])
+		conf.table_size =
+			nla_get_u32(info->attrs[OVPN_A_PEER_TABLE_SIZE]);
+
+	if (info->attrs[OVPN_A_AES_GCM_DRIVER])
+		conf.aead_drivers[OVPN_CIPHER_ALG_AES_GCM] =
+			nla_data(info->attrs[OVPN_A_AES_GCM_DRIVER]);
+
+	if (info->attrs[OVPN_A_CHACHA20_POLY1305_DRIVER])
+		conf.aead_drivers[OVPN_CIPHER_ALG_CHACHA20_POLY1305] =
+			nla_data(info->attrs[OVPN_A_CHACHA20_POLY1305_DRIVER]);
+
+	if (info->attrs[OVPN_A_LIB_CRYPTO_MAX_LEN])
+		conf.lib_max_len =
+			nla_get_u32(info->attrs[OVPN_A_LIB_CRYPTO_MAX_LEN]);
+
+	if (info->attrs[OVPN_A_STATS_INTERVAL])
+		conf.stats_interval =
+			nla_get_u32(info->attrs[OVPN_A_STATS_INTERVAL]);
+
+	if (info->attrs[OVPN_A_SAMPLE_RATE])
+		conf.sample_rate = nla_get_u32(info->attrs[OVPN_A_SAMPLE_RATE]);
+
+	if (info->attrs[OVPN_A_MEM_BUDGET])
+		conf.mem_budget = nla_get_u32(info->attrs[OVPN_A_MEM_BUDGET]);
+
+	/* compact interfaces share one route cache among their peers, instead
+	 * of one per-CPU cache per peer, and use the AES-GCM library instead
+	 * of two transforms per key
+	 */
+	conf.shared_dst_cache = conf.compact ||
+				!!info->attrs[OVPN_A_SHARED_DST_CACHE];
+	conf.compact_keys = conf.compact || !!info->attrs[OVPN_A_COMPACT_KEYS];
+	conf.parallel_rx = !!info->attrs[OVPN_A_PARALLEL_RX];
+	conf.parallel_tx = !!info->attrs[OVPN_A_PARALLEL_TX];
+	conf.parallel_rx_adaptive = !!info->attrs[OVPN_A_PARALLEL_RX_ADAPTIVE];
+	conf.latency_hist = !!info->attrs[OVPN_A_LATENCY_HIST];
+	conf.fair_queue = !!info->attrs[OVPN_A_FAIR_QUEUE];
+	conf.inherit_dsfield = !!info->attrs[OVPN_A_INHERIT_DSFIELD];
+	conf.pmtu_disc = !!info->attrs[OVPN_A_PMTU_DISC];
+	conf.ctrl_netlink = !!info->attrs[OVPN_A_CTRL_NETLINK];
+	conf.client_to_client = !!info->attrs[OVPN_A_CLIENT_TO_CLIENT];
+	conf.threaded = !!info->attrs[OVPN_A_THREADED];
+	conf.shared_socket = !!info->attrs[OVPN_A_SHARED_SOCKET];
+	conf.shared_napi = !!info->attrs[OVPN_A_SHARED_NAPI];
+	conf.direct_xmit = !!info->attrs[OVPN_A_DIRECT_XMIT];
+	conf.udp_zero_csum = !!info->attrs[OVPN_A_UDP_ZERO_CSUM];
+	conf.udp6_zero_csum = !!info->attrs[OVPN_A_UDP6_ZERO_CSUM];
+	conf.cputime_acct = !!info->attrs[OVPN_A_CPU_TIME];
+	conf.top_talkers = !!info->attrs[OVPN_A_TOP_TALKERS];
+
+	devs = kcalloc(count, sizeof(*devs), GFP_KERNEL);
+	if (!devs)
+		return -ENOMEM;
+
+	if (info->attrs[OVPN_A_PARALLEL_CPUS]) {
+		if (!zalloc_cpumask_var(&cpus, GFP_KERNEL)) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		ret = ovpn_nl_parse_cpus(info->attrs[OVPN_A_PARALLEL_CPUS],
+					 cpus, info->extack);
+		if (ret < 0) {
+			free_cpumask_var(cpus);
+			goto out;
+		}
+		conf.parallel_cpus = cpus;
 	}
 
-	dev = ovpn_iface_create(ifname, mode, genl_info_net(info));
+	for (n = 0; n < count; n++) {
+		dev = ovpn_iface_create(ifname, &conf, genl_info_net(info));
+		if (IS_ERR(dev))
+			break;
+		devs[n] = dev;
+	}
+	if (conf.parallel_cpus)
+		free_cpumask_var(cpus);
 	if (IS_ERR(dev)) {
 		NL_SET_ERR_MSG_FMT_MOD(info->extack,
 				       "error while creating interface: %ld",
 				       PTR_ERR(dev));
-		return PTR_ERR(dev);
+		ret = PTR_ERR(dev);
+		/* a batch is created as a whole or not at all */
+		ovpn_nl_ifaces_destroy(devs, n);
+		goto out;
 	}
 
 	msg = nlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
-	if (!msg)
-		return -ENOMEM;
+	if (!msg) {
+		ret = -ENOMEM;
+		goto out;
+	}
 
 	hdr = genlmsg_iput(msg, info);
 	if (!hdr) {
 		nlmsg_free(msg);
-		return -ENOBUFS;
+		ret = -ENOBUFS;
+		goto out;
 	}
 
-	if (nla_put_string(msg, OVPN_A_IFNAME, dev->name)) {
-		genlmsg_cancel(msg, hdr);
-		nlmsg_free(msg);
-		return -EMSGSIZE;
+	for (i = 0; i < count; i++) {
+		if (nla_put_string(msg, OVPN_A_IFNAME, devs[i]->name)) {
+			genlmsg_cancel(msg, hdr);
+			nlmsg_free(msg);
+			ret = -EMSGSIZE;
+			goto out;
+		}
 	}
 
 	genlmsg_end(msg, hdr);
-
-	return genlmsg_reply(msg, info);
+	ret = genlmsg_reply(msg, info);
+out:
+	kfree(devs);
+	return ret;
 }
 
 int ovpn_nl_del_iface_doit(struct sk_buff *skb, struct genl_info *info)
@@ -146,12 +319,184 @@ int ovpn_nl_del_iface_doit(struct sk_buff *skb, struct genl_info *info)
 	return 0;
 }
 
+int ovpn_nl_del_ifaces_doit(struct sk_buff *skb, struct genl_info *info)
+{
+	struct net *net = genl_info_net(info);
+	struct ovpn_struct *ovpn;
+	struct net_device *dev;
+	struct nlattr *attr;
+	int rem, ret = -EINVAL;
+	LIST_HEAD(list);
+
+	rtnl_lock();
+	/* the whole batch is checked before any interface goes away */
+	nlmsg_for_each_attr(attr, info->nlhdr, GENL_HDRLEN, rem) {
+		if (nla_type(attr) != OVPN_A_IFINDEX)
+			continue;
+
+		dev = __dev_get_by_index(net, nla_get_u32(attr));
+		if (!dev || !ovpn_dev_is_valid(dev)) {
+			NL_SET_ERR_MSG_ATTR(info->extack, attr,
+					    "ifindex does not match any ovpn iface");
+			ret = -ENODEV;
+			goto unlock;
+		}
+		ret = 0;
+	}
+
+	if (ret < 0) {
+		NL_SET_ERR_MSG_MOD(info->extack, "no interface specified");
+		goto unlock;
+	}
+
+	nlmsg_for_each_attr(attr, info->nlhdr, GENL_HDRLEN, rem) {
+		if (nla_type(attr) != OVPN_A_IFINDEX)
+			continue;
+
+		dev = __dev_get_by_index(net, nla_get_u32(attr));
+		ovpn = netdev_priv(dev);
+		/* listed more than once */
+		if (!ovpn->registered)
+			continue;
+
+		ovpn_iface_destruct(ovpn);
+		unregister_netdevice_queue(dev, &list);
+	}
+	unregister_netdevice_many(&list);
+unlock:
+	rtnl_unlock();
+
+	return ret;
+}
+
+/* create the socket connected to peer and make it reply from there */
+static int ovpn_nl_peer_csock(struct ovpn_peer *peer, struct genl_info *info)
+{
+	struct ovpn_socket *csock;
+
+	if (peer->proto != IPPROTO_UDP) {
+		NL_SET_ERR_MSG_MOD(info->extack,
+				   "a connected socket requires a UDP peer");
+		return -EINVAL;
+	}
+
+	csock = ovpn_socket_new_connected(peer);
+	if (IS_ERR(csock)) {
+		NL_SET_ERR_MSG_FMT_MOD(info->extack,
+				       "cannot create connected socket: %ld",
+				       PTR_ERR(csock));
+		return PTR_ERR(csock);
+	}
+
+	WRITE_ONCE(peer->csock, csock);
+	ovpn_bind_set_sk(peer, csock->sk);
+
+	return 0;
+}
+
+/* let a TCP peer send over one more connection */
+static int ovpn_nl_peer_tcp_stripe(struct ovpn_peer *peer,
+				   struct genl_info *info,
+				   struct nlattr **attrs)
+{
+	u32 sockfd = nla_get_u32(attrs[OVPN_A_PEER_TCP_STRIPE]);
+	struct ovpn_socket *ovpn_sock;
+	struct socket *sock;
+	int ret;
+
+	if (peer->proto != IPPROTO_TCP) {
+		NL_SET_ERR_MSG_ATTR(info->extack, attrs[OVPN_A_PEER_TCP_STRIPE],
+				    "stripes require a TCP peer");
+		return -EINVAL;
+	}
+
+	/* stripes are only added by requests serialized on the peer */
+	if (peer->tcp->n_stripes == OVPN_TCP_STRIPES_MAX) {
+		NL_SET_ERR_MSG_ATTR(info->extack, attrs[OVPN_A_PEER_TCP_STRIPE],
+				    "too many stripes");
+		return -ENOSPC;
+	}
+
+	/* sockfd_lookup() increases sock's refcounter */
+	sock = sockfd_lookup(sockfd, &ret);
+	if (!sock) {
+		NL_SET_ERR_MSG_FMT_MOD(info->extack,
+				       "cannot lookup stripe socket (fd=%u): %d",
+				       sockfd, ret);
+		return -ENOTSOCK;
+	}
+
+	if (sock->sk->sk_protocol != IPPROTO_TCP) {
+		NL_SET_ERR_MSG_ATTR(info->extack, attrs[OVPN_A_PEER_TCP_STRIPE],
+				    "stripe socket is not TCP");
+		sockfd_put(sock);
+		return -EINVAL;
+	}
+
+	ovpn_sock = ovpn_socket_new_stripe(sock, peer);
+	if (IS_ERR(ovpn_sock)) {
+		NL_SET_ERR_MSG_FMT_MOD(info->extack,
+				       "cannot encapsulate stripe socket: %ld",
+				       PTR_ERR(ovpn_sock));
+		sockfd_put(sock);
+		return -ENOTSOCK;
+	}
+
+	return 0;
+}
+
+/* mirror the packets of a peer to a capture device, ifindex 0 stops */
+static int ovpn_nl_peer_mirror(struct ovpn_peer *peer, struct genl_info *info,
+			       struct nlattr **attrs)
+{
+	struct nlattr *attr = attrs[OVPN_A_PEER_MIRROR_IFINDEX];
+	int ifindex = nla_get_u32(attr);
+	struct ovpn_mirror *mirror;
+	struct net_device *dev;
+	bool valid;
+
+	if (!ifindex) {
+		ovpn_mirror_reset(peer, NULL);
+		return 0;
+	}
+
+	rcu_read_lock();
+	dev = dev_get_by_index_rcu(dev_net(peer->ovpn->dev), ifindex);
+	/* packets mirrored to an ovpn device could be sent back here */
+	valid = dev && !ovpn_dev_is_valid(dev);
+	rcu_read_unlock();
+
+	if (!valid) {
+		NL_SET_ERR_MSG_ATTR(info->extack, attr,
+				    "ifindex does not match any capture device");
+		return -ENODEV;
+	}
+
+	mirror = kzalloc(sizeof(*mirror), GFP_KERNEL);
+	if (!mirror)
+		return -ENOMEM;
+
+	mirror->ifindex = ifindex;
+	mirror->sample = 1;
+	if (attrs[OVPN_A_PEER_MIRROR_SNAPLEN])
+		mirror->snaplen =
+			nla_get_u32(attrs[OVPN_A_PEER_MIRROR_SNAPLEN]);
+	if (attrs[OVPN_A_PEER_MIRROR_SAMPLE])
+		mirror->sample = nla_get_u32(attrs[OVPN_A_PEER_MIRROR_SAMPLE]);
+	if (attrs[OVPN_A_PEER_MIRROR_CIPHERTEXT])
+		mirror->ciphertext =
+			nla_get_u32(attrs[OVPN_A_PEER_MIRROR_CIPHERTEXT]);
+
+	ovpn_mirror_reset(peer, mirror);
+
+	return 0;
+}
+
 static u8 *ovpn_nl_attr_local_ip(struct genl_info *info,
-				 struct ovpn_struct *ovpn,
-				 struct nlattr **attrs, int sock_fam)
+				 struct nlattr *attr, int sock_fam)
 {
-	size_t ip_len = nla_len(attrs[OVPN_A_PEER_LOCAL_IP]);
-	u8 *local_ip = nla_data(attrs[OVPN_A_PEER_LOCAL_IP]);
+	size_t ip_len = nla_len(attr);
+	u8 *local_ip = nla_data(attr);
 	bool is_mapped;
 
 	if (ip_len == sizeof(struct in_addr)) {
@@ -185,190 +530,589 @@ static u8 *ovpn_nl_attr_local_ip(struct genl_info *info,
 	return local_ip;
 }
 
-int ovpn_nl_set_peer_doit(struct sk_buff *skb, struct genl_info *info)
+/* validate a remote sockaddr, turning a v6-mapped-v4 one into a sockaddr_in
+ * stored in mapped
+ */
+static struct sockaddr_storage *
+ovpn_nl_attr_sockaddr(struct genl_info *info, struct nlattr *attr,
+		      struct sockaddr_in *mapped)
 {
-	bool keepalive_set = false, new_peer = false;
-	struct nlattr *attrs[OVPN_A_PEER_MAX + 1];
-	struct ovpn_struct *ovpn = info->user_ptr[0];
-	struct sockaddr_storage *ss = NULL;
-	u32 sockfd, id, interv, timeout;
-	struct socket *sock = NULL;
-	struct sockaddr_in mapped;
+	struct sockaddr_storage *ss = nla_data(attr);
+	size_t sa_len = nla_len(attr);
 	struct sockaddr_in6 *in6;
-	struct ovpn_peer *peer;
-	u8 *local_ip = NULL;
-	size_t sa_len;
-	int ret;
 
-	if (GENL_REQ_ATTR_CHECK(info, OVPN_A_PEER))
-		return -EINVAL;
+	switch (sa_len) {
+	case sizeof(struct sockaddr_in):
+		if (ss->ss_family == AF_INET)
+			/* valid sockaddr */
+			break;
 
-	ret = nla_parse_nested(attrs, OVPN_A_PEER_MAX, info->attrs[OVPN_A_PEER],
-			       ovpn_peer_nl_policy, info->extack);
-	if (ret)
-		return ret;
+		NL_SET_ERR_MSG_MOD(info->extack,
+				   "remote sockaddr_in has invalid family");
+		return ERR_PTR(-EINVAL);
+	case sizeof(struct sockaddr_in6):
+		if (ss->ss_family == AF_INET6)
+			/* valid sockaddr */
+			break;
 
-	if (NL_REQ_ATTR_CHECK(info->extack, info->attrs[OVPN_A_PEER], attrs,
-			      OVPN_A_PEER_ID))
-		return -EINVAL;
+		NL_SET_ERR_MSG_MOD(info->extack,
+				   "remote sockaddr_in6 has invalid family");
+		return ERR_PTR(-EINVAL);
+	default:
+		NL_SET_ERR_MSG_FMT_MOD(info->extack,
+				       "invalid size for sockaddr: %zd",
+				       sa_len);
+		return ERR_PTR(-EINVAL);
+	}
 
-	id = nla_get_u32(attrs[OVPN_A_PEER_ID]);
-	/* check if the peer exists first, otherwise create a new one */
-	peer = ovpn_peer_get_by_id(ovpn, id);
-	if (!peer) {
-		peer = ovpn_peer_new(ovpn, id);
-		new_peer = true;
-		if (IS_ERR(peer)) {
-			NL_SET_ERR_MSG_FMT_MOD(info->extack,
-					       "cannot create new peer object for peer %u (sockaddr=%pIScp): %ld",
-					       id, ss, PTR_ERR(peer));
-			return PTR_ERR(peer);
+	/* if this is a v6-mapped-v4, convert the sockaddr
+	 * object from AF_INET6 to AF_INET before continue
+	 * processing
+	 */
+	if (ss->ss_family == AF_INET6) {
+		in6 = (struct sockaddr_in6 *)ss;
+
+		if (ipv6_addr_v4mapped(&in6->sin6_addr)) {
+			mapped->sin_family = AF_INET;
+			mapped->sin_addr.s_addr = in6->sin6_addr.s6_addr32[3];
+			mapped->sin_port = in6->sin6_port;
+			ss = (struct sockaddr_storage *)mapped;
 		}
 	}
 
-	if (new_peer && NL_REQ_ATTR_CHECK(info->extack,
-					  info->attrs[OVPN_A_PEER], attrs,
-					  OVPN_A_PEER_SOCKET)) {
-		ret = -EINVAL;
-		goto peer_release;
-	}
+	return ss;
+}
 
-	if (new_peer && ovpn->mode == OVPN_MODE_MP &&
-	    !attrs[OVPN_A_PEER_VPN_IPV4] && !attrs[OVPN_A_PEER_VPN_IPV6]) {
+/**
+ * ovpn_nl_peer_paths - replace the paths a peer is reached over
+ * @peer: the peer to configure
+ * @info: generic netlink info from the user request
+ * @nest: the OVPN_A_PEER attribute carrying the OVPN_A_PEER_PATH entries
+ *
+ * The paths listed by the request replace all those of the peer. A single
+ * empty OVPN_A_PEER_PATH removes all paths.
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+static int ovpn_nl_peer_paths(struct ovpn_peer *peer, struct genl_info *info,
+			      struct nlattr *nest)
+{
+	struct nlattr *attrs[OVPN_A_PATH_MAX + 1];
+	struct ovpn_path_set *set = NULL;
+	struct sockaddr_storage *ss;
+	struct sockaddr_in mapped;
+	struct nlattr *attr, *ip;
+	struct ovpn_path *path;
+	int rem, ret, num = 0;
+	u8 *local_ip;
+
+	if (peer->proto != IPPROTO_UDP) {
 		NL_SET_ERR_MSG_MOD(info->extack,
-				   "a VPN IP is required when adding a peer in MP mode");
-		ret = -EINVAL;
-		goto peer_release;
+				   "paths can only be used with UDP");
+		return -EINVAL;
 	}
 
-	if (attrs[OVPN_A_PEER_SOCKET]) {
-		/* lookup the fd in the kernel table and extract the socket
-		 * object
-		 */
-		sockfd = nla_get_u32(attrs[OVPN_A_PEER_SOCKET]);
-		/* sockfd_lookup() increases sock's refcounter */
-		sock = sockfd_lookup(sockfd, &ret);
-		if (!sock) {
-			NL_SET_ERR_MSG_FMT_MOD(info->extack,
-					       "cannot lookup peer socket (fd=%u): %d",
-					       sockfd, ret);
-			ret = -ENOTSOCK;
-			goto peer_release;
-		}
+	nla_for_each_nested(attr, nest, rem)
+		if (nla_type(attr) == OVPN_A_PEER_PATH && nla_len(attr))
+			num++;
 
-		if (peer->sock)
-			ovpn_socket_put(peer->sock);
+	if (num > OVPN_MAX_PATHS) {
+		NL_SET_ERR_MSG_FMT_MOD(info->extack,
+				       "a peer can have up to %d paths",
+				       OVPN_MAX_PATHS);
+		return -EINVAL;
+	}
 
-		peer->sock = ovpn_socket_new(sock, peer);
-		if (IS_ERR(peer->sock)) {
-			NL_SET_ERR_MSG_FMT_MOD(info->extack,
-					       "cannot encapsulate socket: %ld",
-					       PTR_ERR(peer->sock));
-			sockfd_put(sock);
-			peer->sock = NULL;
-			ret = -ENOTSOCK;
-			goto peer_release;
-		}
+	if (num) {
+		set = ovpn_path_set_new(num);
+		if (!set)
+			return -ENOMEM;
 	}
 
-	/* Only when using UDP as transport protocol the remote endpoint
-	 * can be configured so that ovpn knows where to send packets
-	 * to.
-	 *
-	 * In case of TCP, the socket is connected to the peer and ovpn
-	 * will just send bytes over it, without the need to specify a
-	 * destination.
-	 */
-	if (peer->sock->sock->sk->sk_protocol == IPPROTO_UDP &&
-	    attrs[OVPN_A_PEER_SOCKADDR_REMOTE]) {
-		ss = nla_data(attrs[OVPN_A_PEER_SOCKADDR_REMOTE]);
-		sa_len = nla_len(attrs[OVPN_A_PEER_SOCKADDR_REMOTE]);
-		switch (sa_len) {
-		case sizeof(struct sockaddr_in):
-			if (ss->ss_family == AF_INET)
-				/* valid sockaddr */
-				break;
+	path = set ? set->paths : NULL;
+	nla_for_each_nested(attr, nest, rem) {
+		if (nla_type(attr) != OVPN_A_PEER_PATH || !nla_len(attr))
+			continue;
 
-			NL_SET_ERR_MSG_MOD(info->extack,
-					   "remote sockaddr_in has invalid family");
-			ret = -EINVAL;
-			goto peer_release;
-		case sizeof(struct sockaddr_in6):
-			if (ss->ss_family == AF_INET6)
-				/* valid sockaddr */
-				break;
+		ret = nla_parse_nested(attrs, OVPN_A_PATH_MAX, attr,
+				       ovpn_path_nl_policy, info->extack);
+		if (ret)
+			goto err;
 
-			NL_SET_ERR_MSG_MOD(info->extack,
-					   "remote sockaddr_in6 has invalid family");
+		if (NL_REQ_ATTR_CHECK(info->extack, attr, attrs,
+				      OVPN_A_PATH_SOCKADDR_REMOTE)) {
 			ret = -EINVAL;
-			goto peer_release;
-		default:
-			NL_SET_ERR_MSG_FMT_MOD(info->extack,
-					       "invalid size for sockaddr: %zd",
-					       sa_len);
-			ret = -EINVAL;
-			goto peer_release;
+			goto err;
 		}
 
-		/* if this is a v6-mapped-v4, convert the sockaddr
-		 * object from AF_INET6 to AF_INET before continue
-		 * processing
-		 */
-		if (ss->ss_family == AF_INET6) {
-			in6 = (struct sockaddr_in6 *)ss;
-
-			if (ipv6_addr_v4mapped(&in6->sin6_addr)) {
-				mapped.sin_family = AF_INET;
-				mapped.sin_addr.s_addr =
-					in6->sin6_addr.s6_addr32[3];
-				mapped.sin_port = in6->sin6_port;
-				ss = (struct sockaddr_storage *)&mapped;
-			}
+		ss = ovpn_nl_attr_sockaddr(info,
+					   attrs[OVPN_A_PATH_SOCKADDR_REMOTE],
+					   &mapped);
+		if (IS_ERR(ss)) {
+			ret = PTR_ERR(ss);
+			goto err;
 		}
 
-		if (attrs[OVPN_A_PEER_LOCAL_IP]) {
-			local_ip = ovpn_nl_attr_local_ip(info, ovpn,
-							 attrs,
+		if (ss->ss_family == AF_INET)
+			path->bind.sa.in4 = *(struct sockaddr_in *)ss;
+		else
+			path->bind.sa.in6 = *(struct sockaddr_in6 *)ss;
+
+		ip = attrs[OVPN_A_PATH_LOCAL_IP];
+		if (ip) {
+			local_ip = ovpn_nl_attr_local_ip(info, ip,
 							 ss->ss_family);
 			if (IS_ERR(local_ip)) {
 				ret = PTR_ERR(local_ip);
-				NL_SET_ERR_MSG_FMT_MOD(info->extack,
-						       "cannot retrieve local IP: %d",
-						       ret);
-				goto peer_release;
+				goto err;
 			}
-		}
 
-		/* set peer sockaddr */
-		ret = ovpn_peer_reset_sockaddr(peer, ss, local_ip);
-		if (ret < 0) {
-			NL_SET_ERR_MSG_FMT_MOD(info->extack,
-					       "cannot set peer sockaddr: %d",
-					       ret);
-			goto peer_release;
+			memcpy(&path->bind.local, local_ip,
+			       ss->ss_family == AF_INET ?
+			       sizeof(struct in_addr) :
+			       sizeof(struct in6_addr));
 		}
+
+		path->weight = 1;
+		if (attrs[OVPN_A_PATH_WEIGHT])
+			path->weight = nla_get_u32(attrs[OVPN_A_PATH_WEIGHT]);
+		path++;
 	}
 
-	/* VPN IPs cannot be updated, because they are hashed */
-	if (new_peer && attrs[OVPN_A_PEER_VPN_IPV4])
-		peer->vpn_addrs.ipv4.s_addr =
-			nla_get_in_addr(attrs[OVPN_A_PEER_VPN_IPV4]);
+	ovpn_path_set_reset(peer, set);
 
-	/* VPN IPs cannot be updated, because they are hashed */
-	if (new_peer && attrs[OVPN_A_PEER_VPN_IPV6])
-		peer->vpn_addrs.ipv6 =
+	return 0;
+err:
+	ovpn_path_set_free(set);
+	return ret;
+}
+
+/**
+ * ovpn_nl_parse_iroute - parse the prefix of an iroute request
+ * @info: the netlink request
+ * @nest: the OVPN_A_IROUTE or OVPN_A_PEER_IROUTE attribute to parse
+ * @attrs: where to store the parsed OVPN_A_IROUTE attributes
+ * @family: the address family of the prefix
+ * @addr: the prefix
+ * @prefixlen: the prefix length
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+static int ovpn_nl_parse_iroute(struct genl_info *info, struct nlattr *nest,
+				struct nlattr **attrs, sa_family_t *family,
+				struct in6_addr *addr, u8 *prefixlen)
+{
+	struct ovpn_struct *ovpn = info->user_ptr[0];
+	u32 len, max_len;
+	int ret;
+
+	if (ovpn->mode != OVPN_MODE_MP) {
+		NL_SET_ERR_MSG_MOD(info->extack,
+				   "iroutes can only be used in MP mode");
+		return -EOPNOTSUPP;
+	}
+
+	ret = nla_parse_nested(attrs, OVPN_A_IROUTE_MAX, nest,
+			       ovpn_iroute_nl_policy, info->extack);
+	if (ret)
+		return ret;
+
+	if (NL_REQ_ATTR_CHECK(info->extack, nest, attrs,
+			      OVPN_A_IROUTE_PREFIX_LEN))
+		return -EINVAL;
+
+	if (!!attrs[OVPN_A_IROUTE_IPV4] == !!attrs[OVPN_A_IROUTE_IPV6]) {
+		NL_SET_ERR_MSG_MOD(info->extack,
+				   "exactly one of IPv4 or IPv6 prefix must be specified");
+		return -EINVAL;
+	}
+
+	if (attrs[OVPN_A_IROUTE_IPV4]) {
+		*family = AF_INET;
+		memset(addr, 0, sizeof(*addr));
+		addr->s6_addr32[0] = nla_get_in_addr(attrs[OVPN_A_IROUTE_IPV4]);
+		max_len = 32;
+	} else {
+		*family = AF_INET6;
+		*addr = nla_get_in6_addr(attrs[OVPN_A_IROUTE_IPV6]);
+		max_len = 128;
+	}
+
+	len = nla_get_u32(attrs[OVPN_A_IROUTE_PREFIX_LEN]);
+	if (len > max_len) {
+		NL_SET_ERR_MSG_FMT_MOD(info->extack,
+				       "invalid prefix length %u", len);
+		return -EINVAL;
+	}
+	*prefixlen = len;
+
+	return 0;
+}
+
+/**
+ * ovpn_nl_peer_iroutes - validate or install the prefixes routed to a peer
+ * @peer: the peer the prefixes are routed to
+ * @info: the netlink request
+ * @nest: the OVPN_A_PEER attribute carrying the OVPN_A_PEER_IROUTE entries
+ * @install: false to only validate the prefixes, true to also install them
+ *
+ * Prefixes are installed in order: those preceding a failure are left in
+ * place, like for a sequence of NEW_IROUTE requests.
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+static int ovpn_nl_peer_iroutes(struct ovpn_peer *peer, struct genl_info *info,
+				struct nlattr *nest, bool install)
+{
+	struct nlattr *attrs[OVPN_A_IROUTE_MAX + 1];
+	struct in6_addr addr;
+	struct nlattr *attr;
+	sa_family_t family;
+	u8 prefixlen;
+	int rem, ret;
+
+	nla_for_each_nested(attr, nest, rem) {
+		if (nla_type(attr) != OVPN_A_PEER_IROUTE)
+			continue;
+
+		ret = ovpn_nl_parse_iroute(info, attr, attrs, &family, &addr,
+					   &prefixlen);
+		if (ret)
+			return ret;
+
+		if (!install)
+			continue;
+
+		ret = ovpn_iroute_add(peer, family, &addr, prefixlen);
+		if (ret) {
+			NL_SET_ERR_MSG_ATTR(info->extack, attr,
+					    ret == -EEXIST ?
+					    "prefix already routed" :
+					    "cannot route prefix to peer");
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/* a burst sent alone applies to the current rate, and vice versa */
+static void ovpn_nl_peer_ratelimit(struct ovpn_ratelimit *rl,
+				   struct nlattr *rate, struct nlattr *burst)
+{
+	if (!rate && !burst)
+		return;
+
+	ovpn_ratelimit_set(rl, rate ? nla_get_uint(rate) : READ_ONCE(rl->rate),
+			   burst ? nla_get_u32(burst) : READ_ONCE(rl->burst));
+}
+
+/**
+ * ovpn_nl_parse_ports - parse a range of UDP ports of a SET_PEER request
+ * @info: generic netlink info from the user request
+ * @min: the attribute carrying the first port of the range
+ * @max: the attribute carrying the last port of the range
+ * @range: where to store the parsed range
+ *
+ * Both ends have to be given together. A range starting at port 0 is empty.
+ *
+ * Return: 1 if a range was parsed, 0 if none was given or a negative error
+ * code otherwise
+ */
+static int ovpn_nl_parse_ports(struct genl_info *info, struct nlattr *min,
+			       struct nlattr *max, struct ovpn_port_range *range)
+{
+	if (!min && !max)
+		return 0;
+
+	if (!min || !max) {
+		NL_SET_ERR_MSG_ATTR(info->extack, min ?: max,
+				    "both ends of the port range are required");
+		return -EINVAL;
+	}
+
+	range->min = nla_get_u16(min);
+	range->max = range->min ? nla_get_u16(max) : 0;
+	if (range->min > range->max) {
+		NL_SET_ERR_MSG_ATTR(info->extack, max, "invalid port range");
+		return -EINVAL;
+	}
+
+	return 1;
+}
+
+/**
+ * ovpn_nl_peer_modify - apply the configuration of a SET_PEER request
+ * @peer: the peer to configure
+ * @info: generic netlink info from the user request
+ * @nest: the OVPN_A_PEER attribute carrying the configuration
+ * @attrs: the parsed content of nest
+ * @new_peer: true if peer was just created and is not hashed yet
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+static int ovpn_nl_peer_modify(struct ovpn_peer *peer, struct genl_info *info,
+			       struct nlattr *nest, struct nlattr **attrs,
+			       bool new_peer)
+{
+	struct ovpn_struct *ovpn = peer->ovpn;
+	struct ovpn_port_range tx_ports, rx_ports;
+	struct sockaddr_storage *ss = NULL;
+	u32 sockfd, interv, timeout;
+	int set_tx_ports, set_rx_ports;
+	struct nlattr *ip;
+	struct socket *sock = NULL;
+	struct sockaddr_in mapped;
+	u8 *local_ip = NULL;
+	int ret;
+
+	if (new_peer && NL_REQ_ATTR_CHECK(info->extack, nest, attrs,
+					  OVPN_A_PEER_SOCKET))
+		return -EINVAL;
+
+	if (new_peer && ovpn->mode == OVPN_MODE_MP &&
+	    !attrs[OVPN_A_PEER_VPN_IPV4] && !attrs[OVPN_A_PEER_VPN_IPV6] &&
+	    !attrs[OVPN_A_PEER_IROUTE]) {
+		NL_SET_ERR_MSG_MOD(info->extack,
+				   "a VPN IP or iroute is required when adding a peer in MP mode");
+		return -EINVAL;
+	}
+
+	/* 0 leaves the peer limited by the MTU of the interface only */
+	if (attrs[OVPN_A_PEER_MTU] &&
+	    nla_get_u32(attrs[OVPN_A_PEER_MTU]) &&
+	    nla_get_u32(attrs[OVPN_A_PEER_MTU]) < IPV4_MIN_MTU) {
+		NL_SET_ERR_MSG_ATTR(info->extack, attrs[OVPN_A_PEER_MTU],
+				    "peer MTU is too small");
+		return -EINVAL;
+	}
+
+	/* -1 lets packets be decrypted by the CPU they are received on */
+	if (attrs[OVPN_A_PEER_RX_CPU]) {
+		s32 cpu = nla_get_s32(attrs[OVPN_A_PEER_RX_CPU]);
+
+		if (cpu < -1 || (cpu >= 0 && (cpu >= nr_cpu_ids ||
+					      !cpu_possible(cpu)))) {
+			NL_SET_ERR_MSG_ATTR(info->extack,
+					    attrs[OVPN_A_PEER_RX_CPU],
+					    "invalid RX CPU");
+			return -EINVAL;
+		}
+	}
+
+	set_tx_ports = ovpn_nl_parse_ports(info, attrs[OVPN_A_PEER_TX_PORT_MIN],
+					   attrs[OVPN_A_PEER_TX_PORT_MAX],
+					   &tx_ports);
+	if (set_tx_ports < 0)
+		return set_tx_ports;
+
+	set_rx_ports = ovpn_nl_parse_ports(info, attrs[OVPN_A_PEER_RX_PORT_MIN],
+					   attrs[OVPN_A_PEER_RX_PORT_MAX],
+					   &rx_ports);
+	if (set_rx_ports < 0)
+		return set_rx_ports;
+
+	/* prefixes are installed once the peer is hashed */
+	ret = ovpn_nl_peer_iroutes(peer, info, nest, false);
+	if (ret)
+		return ret;
+
+	if (attrs[OVPN_A_PEER_SOCKET]) {
+		/* lookup the fd in the kernel table and extract the socket
+		 * object
+		 */
+		sockfd = nla_get_u32(attrs[OVPN_A_PEER_SOCKET]);
+		/* sockfd_lookup() increases sock's refcounter */
+		sock = sockfd_lookup(sockfd, &ret);
+		if (!sock) {
+			NL_SET_ERR_MSG_FMT_MOD(info->extack,
+					       "cannot lookup peer socket (fd=%u): %d",
+					       sockfd, ret);
+			return -ENOTSOCK;
+		}
+
+		if (peer->sock)
+			ovpn_socket_put(peer->sock);
+
+		peer->sock = ovpn_socket_new(sock, peer);
+		if (IS_ERR(peer->sock)) {
+			NL_SET_ERR_MSG_FMT_MOD(info->extack,
+					       "cannot encapsulate socket: %ld",
+					       PTR_ERR(peer->sock));
+			sockfd_put(sock);
+			peer->sock = NULL;
+			ovpn_peer_set_proto(peer, 0);
+			return -ENOTSOCK;
+		}
+
+		ovpn_peer_set_proto(peer, sock->sk->sk_protocol);
+		if (peer->proto == IPPROTO_TCP)
+			ovpn_tcp_socket_kick(peer->sock);
+	}
+
+	if (attrs[OVPN_A_PEER_TCP_STRIPE]) {
+		ret = ovpn_nl_peer_tcp_stripe(peer, info, attrs);
+		if (ret)
+			return ret;
+	}
+
+	/* Only when using UDP as transport protocol the remote endpoint
+	 * can be configured so that ovpn knows where to send packets
+	 * to.
+	 *
+	 * In case of TCP, the socket is connected to the peer and ovpn
+	 * will just send bytes over it, without the need to specify a
+	 * destination.
+	 */
+	if (peer->proto == IPPROTO_UDP && attrs[OVPN_A_PEER_SOCKADDR_REMOTE]) {
+		ss = ovpn_nl_attr_sockaddr(info,
+					   attrs[OVPN_A_PEER_SOCKADDR_REMOTE],
+					   &mapped);
+		if (IS_ERR(ss))
+			return PTR_ERR(ss);
+
+		ip = attrs[OVPN_A_PEER_LOCAL_IP];
+		if (ip) {
+			local_ip = ovpn_nl_attr_local_ip(info, ip,
+							 ss->ss_family);
+			if (IS_ERR(local_ip)) {
+				ret = PTR_ERR(local_ip);
+				NL_SET_ERR_MSG_FMT_MOD(info->extack,
+						       "cannot retrieve local IP: %d",
+						       ret);
+				return ret;
+			}
+		}
+
+		/* set peer sockaddr */
+		ret = ovpn_peer_reset_sockaddr(peer, ss, local_ip);
+		if (ret < 0) {
+			NL_SET_ERR_MSG_FMT_MOD(info->extack,
+					       "cannot set peer sockaddr: %d",
+					       ret);
+			return ret;
+		}
+
+		/* new peers are hashed with their binding once added */
+		if (!new_peer)
+			ovpn_peer_rehash(peer);
+	}
+
+	if (attrs[OVPN_A_PEER_PATH]) {
+		ret = ovpn_nl_peer_paths(peer, info, nest);
+		if (ret)
+			return ret;
+	}
+
+	/* the socket is connected to the endpoint the peer has by now and
+	 * stays around until the peer goes away
+	 */
+	if (attrs[OVPN_A_PEER_CONNECTED_SOCKET] && !peer->csock) {
+		ret = ovpn_nl_peer_csock(peer, info);
+		if (ret)
+			return ret;
+	}
+
+	/* the capture settings are replaced as a whole */
+	if (attrs[OVPN_A_PEER_MIRROR_IFINDEX]) {
+		ret = ovpn_nl_peer_mirror(peer, info, attrs);
+		if (ret)
+			return ret;
+	}
+
+	/* VPN IPs cannot be updated, because they are hashed */
+	if (new_peer && attrs[OVPN_A_PEER_VPN_IPV4])
+		peer->vpn_addrs.ipv4.s_addr =
+			nla_get_in_addr(attrs[OVPN_A_PEER_VPN_IPV4]);
+
+	/* VPN IPs cannot be updated, because they are hashed */
+	if (new_peer && attrs[OVPN_A_PEER_VPN_IPV6])
+		peer->vpn_addrs.ipv6 =
 			nla_get_in6_addr(attrs[OVPN_A_PEER_VPN_IPV6]);
 
-	/* when setting the keepalive, both parameters have to be configured */
-	if (attrs[OVPN_A_PEER_KEEPALIVE_INTERVAL] &&
-	    attrs[OVPN_A_PEER_KEEPALIVE_TIMEOUT]) {
-		keepalive_set = true;
+	/* when setting the keepalive, both parameters have to be configured.
+	 * Values in milliseconds take precedence over those in seconds
+	 */
+	if (attrs[OVPN_A_PEER_KEEPALIVE_INTERVAL_MS] &&
+	    attrs[OVPN_A_PEER_KEEPALIVE_TIMEOUT_MS]) {
+		interv = nla_get_u32(attrs[OVPN_A_PEER_KEEPALIVE_INTERVAL_MS]);
+		timeout = nla_get_u32(attrs[OVPN_A_PEER_KEEPALIVE_TIMEOUT_MS]);
+		ovpn_peer_keepalive_set(peer, interv, timeout);
+	} else if (attrs[OVPN_A_PEER_KEEPALIVE_INTERVAL] &&
+		   attrs[OVPN_A_PEER_KEEPALIVE_TIMEOUT]) {
 		interv = nla_get_u32(attrs[OVPN_A_PEER_KEEPALIVE_INTERVAL]);
 		timeout = nla_get_u32(attrs[OVPN_A_PEER_KEEPALIVE_TIMEOUT]);
+		ovpn_peer_keepalive_set(peer,
+					min_t(u64, (u64)interv * MSEC_PER_SEC,
+					      U32_MAX),
+					min_t(u64, (u64)timeout * MSEC_PER_SEC,
+					      U32_MAX));
 	}
 
-	if (keepalive_set)
-		ovpn_peer_keepalive_set(peer, interv, timeout);
+	if (attrs[OVPN_A_PEER_PROBE_INTERVAL])
+		ovpn_probe_set(peer,
+			       nla_get_u32(attrs[OVPN_A_PEER_PROBE_INTERVAL]));
+
+	/* the new window size applies to keys installed from now on */
+	if (attrs[OVPN_A_PEER_REPLAY_WINDOW])
+		WRITE_ONCE(peer->replay_window,
+			   nla_get_u32(attrs[OVPN_A_PEER_REPLAY_WINDOW]));
+
+	/* like the window size, the threshold applies to new keys only */
+	if (attrs[OVPN_A_PEER_REKEY_THRESHOLD])
+		WRITE_ONCE(peer->rekey_threshold,
+			   nla_get_u32(attrs[OVPN_A_PEER_REKEY_THRESHOLD]));
+
+	/* the weight counts from the next round of the TX scheduler on */
+	if (attrs[OVPN_A_PEER_SCHED_WEIGHT])
+		WRITE_ONCE(peer->sched_weight,
+			   nla_get_u32(attrs[OVPN_A_PEER_SCHED_WEIGHT]));
+
+	if (attrs[OVPN_A_PEER_MTU])
+		WRITE_ONCE(peer->mtu, nla_get_u32(attrs[OVPN_A_PEER_MTU]));
+
+	if (attrs[OVPN_A_PEER_MSS_CLAMP])
+		assign_bit(OVPN_PEER_MSS_CLAMP, &peer->flags,
+			   nla_get_u32(attrs[OVPN_A_PEER_MSS_CLAMP]));
+
+	if (attrs[OVPN_A_PEER_IDLE_TIMEOUT])
+		ovpn_peer_idle_set(peer,
+				   nla_get_u32(attrs[OVPN_A_PEER_IDLE_TIMEOUT]));
+
+	/* packets already steered are decrypted by the previous CPU */
+	if (attrs[OVPN_A_PEER_RX_CPU])
+		WRITE_ONCE(peer->rx_cpu,
+			   nla_get_s32(attrs[OVPN_A_PEER_RX_CPU]));
+
+	/* the port ranges are agreed upon with the peer by userspace */
+	if (set_tx_ports)
+		WRITE_ONCE(peer->tx_ports, tx_ports);
+	if (set_rx_ports)
+		WRITE_ONCE(peer->rx_ports, rx_ports);
+
+	/* the framing is negotiated over the control channel too */
+	if (attrs[OVPN_A_PEER_COMP_STUB])
+		WRITE_ONCE(peer->comp_stub,
+			   nla_get_u32(attrs[OVPN_A_PEER_COMP_STUB]));
+
+	if (attrs[OVPN_A_PEER_OUT_MARK])
+		ovpn_peer_out_mark_set(peer,
+				       nla_get_u32(attrs[OVPN_A_PEER_OUT_MARK]));
+
+	ovpn_nl_peer_ratelimit(&peer->tx_limit, attrs[OVPN_A_PEER_TX_RATE],
+			       attrs[OVPN_A_PEER_TX_BURST]);
+	ovpn_nl_peer_ratelimit(&peer->rx_limit, attrs[OVPN_A_PEER_RX_RATE],
+			       attrs[OVPN_A_PEER_RX_BURST]);
+	ovpn_nl_peer_ratelimit(&peer->decrypt_limit,
+			       attrs[OVPN_A_PEER_DECRYPT_RATE],
+			       attrs[OVPN_A_PEER_DECRYPT_BURST]);
+
+	/* up to one second of failures at the tolerated rate are absorbed */
+	if (attrs[OVPN_A_PEER_AUTH_FAIL_RATE]) {
+		u32 rate = nla_get_u32(attrs[OVPN_A_PEER_AUTH_FAIL_RATE]);
+
+		ovpn_ratelimit_set(&peer->auth_fail_limit, rate, rate);
+	}
 
 	netdev_dbg(ovpn->dev,
 		   "%s: %s peer with endpoint=%pIScp/%s id=%u VPN-IPv4=%pI4 VPN-IPv6=%pI6c\n",
@@ -376,7 +1120,92 @@ int ovpn_nl_set_peer_doit(struct sk_buff *skb, struct genl_info *info)
 		   peer->sock->sock->sk->sk_prot_creator->name, peer->id,
 		   &peer->vpn_addrs.ipv4.s_addr, &peer->vpn_addrs.ipv6);
 
+	return 0;
+}
+
+/* the datapath state of a new peer is allocated on the NUMA node of the CPU
+ * that last received data on its socket: for connected sockets and for the
+ * handshake of peers that just connected, this is the CPU the traffic of the
+ * peer is steered to
+ */
+static int ovpn_nl_peer_node(struct nlattr **attrs)
+{
+	int cpu, node = NUMA_NO_NODE, err;
+	struct socket *sock;
+
+	if (!attrs[OVPN_A_PEER_SOCKET])
+		return NUMA_NO_NODE;
+
+	sock = sockfd_lookup(nla_get_u32(attrs[OVPN_A_PEER_SOCKET]), &err);
+	if (!sock)
+		return NUMA_NO_NODE;
+
+	cpu = READ_ONCE(sock->sk->sk_incoming_cpu);
+	if (cpu >= 0 && cpu < nr_cpu_ids && cpu_online(cpu))
+		node = cpu_to_node(cpu);
+	sockfd_put(sock);
+
+	return node;
+}
+
+int ovpn_nl_set_peer_doit(struct sk_buff *skb, struct genl_info *info)
+{
+	struct nlattr *attrs[OVPN_A_PEER_MAX + 1];
+	struct ovpn_struct *ovpn = info->user_ptr[0];
+	struct ovpn_peer *peer;
+	bool new_peer = false;
+	u32 id;
+	int ret;
+
+	if (GENL_REQ_ATTR_CHECK(info, OVPN_A_PEER))
+		return -EINVAL;
+
+	ret = nla_parse_nested(attrs, OVPN_A_PEER_MAX, info->attrs[OVPN_A_PEER],
+			       ovpn_peer_nl_policy, info->extack);
+	if (ret)
+		return ret;
+
+	if (NL_REQ_ATTR_CHECK(info->extack, info->attrs[OVPN_A_PEER], attrs,
+			      OVPN_A_PEER_ID))
+		return -EINVAL;
+
+	id = nla_get_u32(attrs[OVPN_A_PEER_ID]);
+	/* check if the peer exists first, otherwise create a new one */
+	peer = ovpn_peer_get_by_id(ovpn, id);
+	if (!peer) {
+		peer = ovpn_peer_new(ovpn, id, ovpn_nl_peer_node(attrs));
+		new_peer = true;
+		if (IS_ERR(peer)) {
+			NL_SET_ERR_MSG_FMT_MOD(info->extack,
+					       "cannot create new peer object for peer %u: %ld",
+					       id, PTR_ERR(peer));
+			return PTR_ERR(peer);
+		}
+	}
+
+	/* requests for different peers run in parallel, while those
+	 * reconfiguring the same peer are serialized
+	 */
+	if (!new_peer)
+		mutex_lock(&peer->config_lock);
+	ret = ovpn_nl_peer_modify(peer, info, info->attrs[OVPN_A_PEER], attrs,
+				  new_peer);
+	if (ret < 0) {
+		if (!new_peer)
+			mutex_unlock(&peer->config_lock);
+		goto peer_release;
+	}
+
+	/* a client reconnecting with the same ID recycles its peer: the new
+	 * session brings its own keys. The old session is only torn down once
+	 * the request was found valid, so that a failing one leaves it intact
+	 */
+	if (!new_peer && attrs[OVPN_A_PEER_RESET])
+		ovpn_peer_reset(peer);
+
 	if (new_peer) {
+		/* keep the peer around for its prefixes to be installed */
+		kref_get(&peer->refcount);
 		ret = ovpn_peer_add(ovpn, peer);
 		if (ret < 0) {
 			NL_SET_ERR_MSG_FMT_MOD(info->extack,
@@ -384,11 +1213,14 @@ int ovpn_nl_set_peer_doit(struct sk_buff *skb, struct genl_info *info)
 					       peer->id, ret);
 			goto peer_release;
 		}
-	} else {
-		ovpn_peer_put(peer);
 	}
 
-	return 0;
+	ret = ovpn_nl_peer_iroutes(peer, info, info->attrs[OVPN_A_PEER], true);
+	if (!new_peer)
+		mutex_unlock(&peer->config_lock);
+	ovpn_peer_put(peer);
+
+	return ret;
 
 peer_release:
 	if (new_peer) {
@@ -396,112 +1228,1279 @@ int ovpn_nl_set_peer_doit(struct sk_buff *skb, struct genl_info *info)
 		 * context
 		 */
 		ovpn_peer_release(peer);
-		kfree(peer);
+		ovpn_peer_free(peer);
 	} else {
 		ovpn_peer_put(peer);
 	}
 
-	return ret;
+	return ret;
+}
+
+/* report the packet ID state of a key slot: replay protection and next TX ID */
+static int ovpn_nl_put_keystate(struct sk_buff *skb,
+				const struct ovpn_crypto_key_slot *ks,
+				enum ovpn_key_slot slot)
+{
+	const struct ovpn_pktid_recv *pr = &ks->pid_recv;
+	u64 reorder[OVPN_REORDER_BUCKETS];
+	struct nlattr *attr;
+	int i;
+
+	attr = nla_nest_start(skb, OVPN_A_PEER_KEYSTATE);
+	if (!attr)
+		return -EMSGSIZE;
+
+	ovpn_pktid_recv_reorder_fetch(pr, reorder);
+
+	if (nla_put_u32(skb, OVPN_A_KEYSTATE_SLOT, slot) ||
+	    nla_put_u32(skb, OVPN_A_KEYSTATE_KEY_ID, ks->key_id) ||
+	    nla_put_u32(skb, OVPN_A_KEYSTATE_REPLAY_WINDOW, pr->window) ||
+	    nla_put_uint(skb, OVPN_A_KEYSTATE_RX_PKTID,
+			 atomic64_read(&pr->id)) ||
+	    nla_put_uint(skb, OVPN_A_KEYSTATE_RX_PKTID_FLOOR,
+			 atomic64_read(&pr->id_floor)) ||
+	    nla_put_u32(skb, OVPN_A_KEYSTATE_MAX_BACKTRACK,
+			READ_ONCE(pr->max_backtrack)) ||
+	    nla_put_uint(skb, OVPN_A_KEYSTATE_FLOOR_UPDATES,
+			 atomic_long_read(&pr->floor_updates)) ||
+	    nla_put_uint(skb, OVPN_A_KEYSTATE_TX_PKTID,
+			 atomic64_read(&ks->pid_xmit.seq_num)))
+		goto err;
+
+	for (i = 0; i < OVPN_REORDER_BUCKETS; i++)
+		if (nla_put_uint(skb, OVPN_A_KEYSTATE_REORDER, reorder[i]))
+			goto err;
+
+	/* traffic is counted only for keys with limits */
+	if (ks->volume_limited &&
+	    (nla_put_uint(skb, OVPN_A_KEYSTATE_BYTES,
+			  atomic64_read(&ks->volume.bytes)) ||
+	     nla_put_uint(skb, OVPN_A_KEYSTATE_PACKETS,
+			  atomic64_read(&ks->volume.packets))))
+		goto err;
+
+	nla_nest_end(skb, attr);
+	return 0;
+err:
+	nla_nest_cancel(skb, attr);
+	return -EMSGSIZE;
+}
+
+/* histograms are reported bucket by bucket, one attribute per bucket */
+static int ovpn_nl_put_latency(struct sk_buff *skb,
+			       const struct ovpn_peer *peer)
+{
+	u64 tx[OVPN_LATENCY_BUCKETS], rx[OVPN_LATENCY_BUCKETS];
+	int i;
+
+	ovpn_latency_fetch(peer->latency, tx, rx);
+
+	for (i = 0; i < OVPN_LATENCY_BUCKETS; i++)
+		if (nla_put_uint(skb, OVPN_A_PEER_TX_LATENCY, tx[i]))
+			return -EMSGSIZE;
+
+	for (i = 0; i < OVPN_LATENCY_BUCKETS; i++)
+		if (nla_put_uint(skb, OVPN_A_PEER_RX_LATENCY, rx[i]))
+			return -EMSGSIZE;
+
+	return 0;
+}
+
+static int ovpn_nl_put_cputime(struct sk_buff *skb,
+			       const struct ovpn_peer *peer)
+{
+	u64 encrypt_ns, decrypt_ns;
+
+	ovpn_cputime_fetch(peer->cputime, &encrypt_ns, &decrypt_ns);
+
+	if (nla_put_uint(skb, OVPN_A_PEER_ENCRYPT_NS, encrypt_ns) ||
+	    nla_put_uint(skb, OVPN_A_PEER_DECRYPT_NS, decrypt_ns))
+		return -EMSGSIZE;
+
+	return 0;
+}
+
+/* round trip estimation, reported once the peer was probed */
+static int ovpn_nl_put_probe(struct sk_buff *skb, struct ovpn_peer *peer)
+{
+	struct ovpn_probe_stats st;
+
+	ovpn_probe_fetch(&peer->probe, &st);
+	if (!st.tx)
+		return 0;
+
+	if ((st.srtt &&
+	     (nla_put_u32(skb, OVPN_A_PEER_PROBE_SRTT, st.srtt) ||
+	      nla_put_u32(skb, OVPN_A_PEER_PROBE_RTTVAR, st.rttvar))) ||
+	    nla_put_u32(skb, OVPN_A_PEER_PROBE_LOSS, st.loss) ||
+	    nla_put_uint(skb, OVPN_A_PEER_PROBE_TX, st.tx) ||
+	    nla_put_uint(skb, OVPN_A_PEER_PROBE_RX, st.rx))
+		return -EMSGSIZE;
+
+	return 0;
+}
+
+/* state of the TCP transport, the same as reported by TCP_INFO */
+static int ovpn_nl_put_tcp_info(struct sk_buff *skb,
+				const struct ovpn_peer *peer)
+{
+	struct ovpn_tcp_info info;
+
+	ovpn_tcp_get_info(peer, &info);
+
+	if (nla_put_u32(skb, OVPN_A_PEER_TCP_SRTT, info.srtt) ||
+	    nla_put_u32(skb, OVPN_A_PEER_TCP_CWND, info.cwnd) ||
+	    nla_put_u32(skb, OVPN_A_PEER_TCP_TOTAL_RETRANS,
+			info.total_retrans) ||
+	    nla_put_uint(skb, OVPN_A_PEER_TCP_DELIVERY_RATE,
+			 info.delivery_rate) ||
+	    nla_put_u32(skb, OVPN_A_PEER_TCP_OUT_QUEUE, info.out_queue) ||
+	    nla_put_uint(skb, OVPN_A_PEER_TCP_TX_EAGAIN, info.tx_eagain) ||
+	    nla_put_u32(skb, OVPN_A_PEER_TCP_STREAMS, info.streams))
+		return -EMSGSIZE;
+
+	return 0;
+}
+
+/* rate limits are reported only when enabled */
+static int ovpn_nl_put_ratelimit(struct sk_buff *skb,
+				 const struct ovpn_ratelimit *rl, int rate_attr,
+				 int burst_attr)
+{
+	u64 rate = READ_ONCE(rl->rate);
+
+	if (!rate)
+		return 0;
+
+	if (nla_put_uint(skb, rate_attr, rate) ||
+	    nla_put_u32(skb, burst_attr, READ_ONCE(rl->burst)))
+		return -EMSGSIZE;
+
+	return 0;
+}
+
+/* port ranges are reported only when not empty */
+static int ovpn_nl_put_ports(struct sk_buff *skb, struct ovpn_port_range range,
+			     int min_attr, int max_attr)
+{
+	if (!range.min)
+		return 0;
+
+	if (nla_put_u16(skb, min_attr, range.min) ||
+	    nla_put_u16(skb, max_attr, range.max))
+		return -EMSGSIZE;
+
+	return 0;
+}
+
+/* attributes reported when userspace does not select any */
+#define OVPN_NL_PEER_INFO_ALL	(OVPN_PEER_INFO_ADDRS |		\
+				 OVPN_PEER_INFO_CONFIG |	\
+				 OVPN_PEER_INFO_KEYS |		\
+				 OVPN_PEER_INFO_VPN_STATS |	\
+				 OVPN_PEER_INFO_LINK_STATS |	\
+				 OVPN_PEER_INFO_ERRORS |	\
+				 OVPN_PEER_INFO_LATENCY |	\
+				 OVPN_PEER_INFO_PROBE |		\
+				 OVPN_PEER_INFO_TCP |		\
+				 OVPN_PEER_INFO_CPU_TIME)
+
+static u32 ovpn_nl_peer_info(const struct genl_info *info)
+{
+	if (!info->attrs[OVPN_A_PEER_INFO])
+		return OVPN_NL_PEER_INFO_ALL;
+
+	return nla_get_u32(info->attrs[OVPN_A_PEER_INFO]);
+}
+
+/* endpoint of the peer: remote sockaddr and local IP */
+static int ovpn_nl_put_peer_bind(struct sk_buff *skb,
+				 const struct ovpn_peer *peer)
+{
+	const struct ovpn_bind *bind;
+
+	rcu_read_lock();
+	bind = rcu_dereference(peer->bind);
+	if (bind) {
+		if (bind->sa.in4.sin_family == AF_INET) {
+			if (nla_put(skb, OVPN_A_PEER_SOCKADDR_REMOTE,
+				    sizeof(bind->sa.in4), &bind->sa.in4) ||
+			    nla_put(skb, OVPN_A_PEER_LOCAL_IP,
+				    sizeof(bind->local.ipv4),
+				    &bind->local.ipv4))
+				goto err_unlock;
+		} else if (bind->sa.in4.sin_family == AF_INET6) {
+			if (nla_put(skb, OVPN_A_PEER_SOCKADDR_REMOTE,
+				    sizeof(bind->sa.in6), &bind->sa.in6) ||
+			    nla_put(skb, OVPN_A_PEER_LOCAL_IP,
+				    sizeof(bind->local.ipv6),
+				    &bind->local.ipv6))
+				goto err_unlock;
+		}
+	}
+	rcu_read_unlock();
+
+	return 0;
+err_unlock:
+	rcu_read_unlock();
+	return -EMSGSIZE;
+}
+
+static int ovpn_nl_put_peer_mirror(struct sk_buff *skb,
+				   const struct ovpn_peer *peer)
+{
+	const struct ovpn_mirror *mirror;
+	int ret = 0;
+
+	rcu_read_lock();
+	mirror = rcu_dereference(peer->mirror);
+	if (mirror &&
+	    (nla_put_u32(skb, OVPN_A_PEER_MIRROR_IFINDEX, mirror->ifindex) ||
+	     nla_put_u32(skb, OVPN_A_PEER_MIRROR_SNAPLEN, mirror->snaplen) ||
+	     nla_put_u32(skb, OVPN_A_PEER_MIRROR_SAMPLE, mirror->sample) ||
+	     nla_put_u32(skb, OVPN_A_PEER_MIRROR_CIPHERTEXT,
+			 mirror->ciphertext)))
+		ret = -EMSGSIZE;
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/* paths of the peer, one OVPN_A_PEER_PATH each */
+static int ovpn_nl_put_peer_paths(struct sk_buff *skb,
+				  const struct ovpn_peer *peer)
+{
+	const struct ovpn_path_set *set;
+	const struct ovpn_path *path;
+	size_t sa_len, ip_len;
+	struct nlattr *attr;
+	int ret = 0;
+	u8 i;
+
+	rcu_read_lock();
+	set = rcu_dereference(peer->paths);
+	for (i = 0; set && i < set->num; i++) {
+		path = &set->paths[i];
+		if (path->bind.sa.in4.sin_family == AF_INET) {
+			sa_len = sizeof(path->bind.sa.in4);
+			ip_len = sizeof(path->bind.local.ipv4);
+		} else {
+			sa_len = sizeof(path->bind.sa.in6);
+			ip_len = sizeof(path->bind.local.ipv6);
+		}
+
+		attr = nla_nest_start(skb, OVPN_A_PEER_PATH);
+		if (!attr) {
+			ret = -EMSGSIZE;
+			break;
+		}
+
+		if (nla_put(skb, OVPN_A_PATH_SOCKADDR_REMOTE, sa_len,
+			    &path->bind.sa) ||
+		    nla_put(skb, OVPN_A_PATH_LOCAL_IP, ip_len,
+			    &path->bind.local) ||
+		    nla_put_u32(skb, OVPN_A_PATH_WEIGHT, path->weight) ||
+		    (!ovpn_path_usable(path) &&
+		     nla_put_flag(skb, OVPN_A_PATH_EXCLUDED))) {
+			nla_nest_cancel(skb, attr);
+			ret = -EMSGSIZE;
+			break;
+		}
+		nla_nest_end(skb, attr);
+	}
+	rcu_read_unlock();
+
+	return ret;
+}
+
+static int ovpn_nl_put_peer_addrs(struct sk_buff *skb,
+				  const struct ovpn_peer *peer)
+{
+	if (peer->vpn_addrs.ipv4.s_addr != htonl(INADDR_ANY))
+		if (nla_put_in_addr(skb, OVPN_A_PEER_VPN_IPV4,
+				    peer->vpn_addrs.ipv4.s_addr))
+			return -EMSGSIZE;
+
+	if (!ipv6_addr_equal(&peer->vpn_addrs.ipv6, &in6addr_any))
+		if (nla_put_in6_addr(skb, OVPN_A_PEER_VPN_IPV6,
+				     &peer->vpn_addrs.ipv6))
+			return -EMSGSIZE;
+
+	if (ovpn_nl_put_peer_bind(skb, peer) ||
+	    ovpn_nl_put_peer_paths(skb, peer) ||
+	    nla_put_net16(skb, OVPN_A_PEER_LOCAL_PORT,
+			  inet_sk(peer->sock->sock->sk)->inet_sport))
+		return -EMSGSIZE;
+
+	return 0;
+}
+
+static int ovpn_nl_put_peer_config(struct sk_buff *skb,
+				   const struct ovpn_peer *peer)
+{
+	unsigned long interval = READ_ONCE(peer->keepalive_interval);
+	unsigned long timeout = READ_ONCE(peer->keepalive_timeout);
+
+	/* sub-second values are rounded up, so that they don't read as off */
+	if (nla_put_u32(skb, OVPN_A_PEER_KEEPALIVE_INTERVAL,
+			DIV_ROUND_UP(interval, MSEC_PER_SEC)) ||
+	    nla_put_u32(skb, OVPN_A_PEER_KEEPALIVE_TIMEOUT,
+			DIV_ROUND_UP(timeout, MSEC_PER_SEC)) ||
+	    nla_put_u32(skb, OVPN_A_PEER_KEEPALIVE_INTERVAL_MS, interval) ||
+	    nla_put_u32(skb, OVPN_A_PEER_KEEPALIVE_TIMEOUT_MS, timeout) ||
+	    nla_put_u32(skb, OVPN_A_PEER_PROBE_INTERVAL,
+			READ_ONCE(peer->probe.interval)) ||
+	    nla_put_u32(skb, OVPN_A_PEER_IDLE_TIMEOUT,
+			READ_ONCE(peer->idle_timeout)) ||
+	    nla_put_u32(skb, OVPN_A_PEER_REPLAY_WINDOW,
+			READ_ONCE(peer->replay_window)) ||
+	    nla_put_u32(skb, OVPN_A_PEER_REKEY_THRESHOLD,
+			READ_ONCE(peer->rekey_threshold)))
+		return -EMSGSIZE;
+
+	if (peer->ovpn->sched &&
+	    nla_put_u32(skb, OVPN_A_PEER_SCHED_WEIGHT,
+			READ_ONCE(peer->sched_weight)))
+		return -EMSGSIZE;
+
+	if (nla_put_u32(skb, OVPN_A_PEER_MTU, READ_ONCE(peer->mtu)) ||
+	    nla_put_u32(skb, OVPN_A_PEER_MSS_CLAMP,
+			test_bit(OVPN_PEER_MSS_CLAMP, &peer->flags)) ||
+	    nla_put_s32(skb, OVPN_A_PEER_RX_CPU, READ_ONCE(peer->rx_cpu)) ||
+	    nla_put_u32(skb, OVPN_A_PEER_COMP_STUB, READ_ONCE(peer->comp_stub)))
+		return -EMSGSIZE;
+
+	if (READ_ONCE(peer->out_mark) &&
+	    nla_put_u32(skb, OVPN_A_PEER_OUT_MARK, READ_ONCE(peer->out_mark)))
+		return -EMSGSIZE;
+
+	if (READ_ONCE(peer->csock) &&
+	    nla_put_flag(skb, OVPN_A_PEER_CONNECTED_SOCKET))
+		return -EMSGSIZE;
+
+	if (nla_put_u32(skb, OVPN_A_PEER_AUTH_FAIL_RATE,
+			READ_ONCE(peer->auth_fail_limit.rate)) ||
+	    (ovpn_peer_quarantined(peer) &&
+	     nla_put_flag(skb, OVPN_A_PEER_QUARANTINED)))
+		return -EMSGSIZE;
+
+	if (ovpn_nl_put_ports(skb, READ_ONCE(peer->tx_ports),
+			      OVPN_A_PEER_TX_PORT_MIN,
+			      OVPN_A_PEER_TX_PORT_MAX) ||
+	    ovpn_nl_put_ports(skb, READ_ONCE(peer->rx_ports),
+			      OVPN_A_PEER_RX_PORT_MIN,
+			      OVPN_A_PEER_RX_PORT_MAX))
+		return -EMSGSIZE;
+
+	if (ovpn_nl_put_ratelimit(skb, &peer->tx_limit, OVPN_A_PEER_TX_RATE,
+				  OVPN_A_PEER_TX_BURST) ||
+	    ovpn_nl_put_ratelimit(skb, &peer->rx_limit, OVPN_A_PEER_RX_RATE,
+				  OVPN_A_PEER_RX_BURST) ||
+	    ovpn_nl_put_ratelimit(skb, &peer->decrypt_limit,
+				  OVPN_A_PEER_DECRYPT_RATE,
+				  OVPN_A_PEER_DECRYPT_BURST))
+		return -EMSGSIZE;
+
+	return ovpn_nl_put_peer_mirror(skb, peer);
+}
+
+static int ovpn_nl_put_peer_keys(struct sk_buff *skb,
+				 const struct ovpn_peer *peer, u32 mask)
+{
+	const struct ovpn_crypto_key_slot *ks, *ks2;
+	unsigned int max_backtrack;
+	const char *driver;
+	int ret = -EMSGSIZE;
+
+	rcu_read_lock();
+	ks = rcu_dereference(peer->crypto.primary);
+	ks2 = rcu_dereference(peer->crypto.secondary);
+
+	if (mask & OVPN_PEER_INFO_KEYS) {
+		/* the implementation the crypto API picked for the current
+		 * key
+		 */
+		driver = ks ? ovpn_aead_driver_name(ks) : NULL;
+		if (driver &&
+		    nla_put_string(skb, OVPN_A_PEER_CRYPTO_DRIVER, driver))
+			goto out;
+
+		if ((ks && ovpn_nl_put_keystate(skb, ks,
+						OVPN_KEY_SLOT_PRIMARY)) ||
+		    (ks2 && ovpn_nl_put_keystate(skb, ks2,
+						 OVPN_KEY_SLOT_SECONDARY)))
+			goto out;
+	}
+
+	if (mask & OVPN_PEER_INFO_ERRORS) {
+		/* largest reordering seen by the replay protection of either
+		 * key
+		 */
+		max_backtrack =
+			max(ks ? READ_ONCE(ks->pid_recv.max_backtrack) : 0,
+			    ks2 ? READ_ONCE(ks2->pid_recv.max_backtrack) : 0);
+		if (nla_put_u32(skb, OVPN_A_PEER_REPLAY_MAX_BACKTRACK,
+				max_backtrack))
+			goto out;
+	}
+
+	ret = 0;
+out:
+	rcu_read_unlock();
+	return ret;
+}
+
+static int ovpn_nl_put_peer_stats(struct sk_buff *skb,
+				  const struct ovpn_peer *peer, u32 mask)
+{
+	struct ovpn_peer_stats_sum vpn, link;
+	struct ovpn_peer_errors_sum errors;
+
+	if (mask & OVPN_PEER_INFO_VPN_STATS) {
+		ovpn_peer_stats_fetch(peer->vpn_stats, &peer->vpn_base,
+				      &vpn);
+		if (nla_put_uint(skb, OVPN_A_PEER_VPN_RX_BYTES, vpn.rx_bytes) ||
+		    nla_put_uint(skb, OVPN_A_PEER_VPN_RX_PACKETS,
+				 vpn.rx_packets) ||
+		    nla_put_uint(skb, OVPN_A_PEER_VPN_TX_BYTES, vpn.tx_bytes) ||
+		    nla_put_uint(skb, OVPN_A_PEER_VPN_TX_PACKETS,
+				 vpn.tx_packets))
+			return -EMSGSIZE;
+	}
+
+	if (mask & OVPN_PEER_INFO_LINK_STATS) {
+		ovpn_peer_stats_fetch(peer->link_stats, &peer->link_base,
+				      &link);
+		if (nla_put_uint(skb, OVPN_A_PEER_LINK_RX_BYTES,
+				 link.rx_bytes) ||
+		    nla_put_uint(skb, OVPN_A_PEER_LINK_RX_PACKETS,
+				 link.rx_packets) ||
+		    nla_put_uint(skb, OVPN_A_PEER_LINK_TX_BYTES,
+				 link.tx_bytes) ||
+		    nla_put_uint(skb, OVPN_A_PEER_LINK_TX_PACKETS,
+				 link.tx_packets))
+			return -EMSGSIZE;
+	}
+
+	if (mask & OVPN_PEER_INFO_ERRORS) {
+		ovpn_peer_errors_fetch(peer->errors, &peer->errors_base,
+				       &errors);
+		if (nla_put_uint(skb, OVPN_A_PEER_DECRYPT_ERRORS,
+				 errors.decrypt) ||
+		    nla_put_uint(skb, OVPN_A_PEER_REPLAY_ERRORS,
+				 errors.replay) ||
+		    nla_put_uint(skb, OVPN_A_PEER_RPF_DROPS, errors.rpf) ||
+		    nla_put_uint(skb, OVPN_A_PEER_NO_KEY_DROPS,
+				 errors.no_key) ||
+		    nla_put_uint(skb, OVPN_A_PEER_DECRYPT_BUDGET_DROPS,
+				 errors.budget) ||
+		    nla_put_uint(skb, OVPN_A_PEER_TX_DROPS, errors.tx_drop))
+			return -EMSGSIZE;
+	}
+
+	return 0;
+}
+
+/* ID and stats generation are always reported, while the rest is grouped by
+ * the OVPN_PEER_INFO_* flags set in mask
+ */
+static int ovpn_nl_send_peer(struct sk_buff *skb, const struct genl_info *info,
+			     struct ovpn_peer *peer, u32 stats_gen,
+			     u32 mask, u32 portid, u32 seq, int flags)
+{
+	struct nlattr *attr;
+	void *hdr;
+
+	hdr = genlmsg_put(skb, portid, seq, &ovpn_nl_family, flags,
+			  OVPN_CMD_SET_PEER);
+	if (!hdr)
+		return -ENOBUFS;
+
+	attr = nla_nest_start(skb, OVPN_A_PEER);
+	if (!attr)
+		goto err;
+
+	if (nla_put_u32(skb, OVPN_A_PEER_ID, peer->id) ||
+	    nla_put_u32(skb, OVPN_A_PEER_STATS_GEN, stats_gen))
+		goto err;
+
+	if ((mask & OVPN_PEER_INFO_ADDRS) &&
+	    ovpn_nl_put_peer_addrs(skb, peer))
+		goto err;
+
+	if ((mask & OVPN_PEER_INFO_CONFIG) &&
+	    ovpn_nl_put_peer_config(skb, peer))
+		goto err;
+
+	if ((mask & (OVPN_PEER_INFO_KEYS | OVPN_PEER_INFO_ERRORS)) &&
+	    ovpn_nl_put_peer_keys(skb, peer, mask))
+		goto err;
+
+	if (ovpn_nl_put_peer_stats(skb, peer, mask))
+		goto err;
+
+	if ((mask & OVPN_PEER_INFO_LATENCY) && peer->latency &&
+	    ovpn_nl_put_latency(skb, peer))
+		goto err;
+
+	if ((mask & OVPN_PEER_INFO_PROBE) && ovpn_nl_put_probe(skb, peer))
+		goto err;
+
+	if ((mask & OVPN_PEER_INFO_TCP) && ovpn_peer_is_tcp(peer) &&
+	    ovpn_nl_put_tcp_info(skb, peer))
+		goto err;
+
+	if ((mask & OVPN_PEER_INFO_CPU_TIME) && peer->cputime &&
+	    ovpn_nl_put_cputime(skb, peer))
+		goto err;
+
+	nla_nest_end(skb, attr);
+	genlmsg_end(skb, hdr);
+
+	return 0;
+err:
+	genlmsg_cancel(skb, hdr);
+	return -EMSGSIZE;
+}
+
+int ovpn_nl_get_peer_doit(struct sk_buff *skb, struct genl_info *info)
+{
+	struct nlattr *attrs[OVPN_A_PEER_MAX + 1];
+	struct ovpn_struct *ovpn = info->user_ptr[0];
+	struct ovpn_peer *peer;
+	struct sk_buff *msg;
+	u32 peer_id;
+	int ret;
+
+	if (GENL_REQ_ATTR_CHECK(info, OVPN_A_PEER))
+		return -EINVAL;
+
+	ret = nla_parse_nested(attrs, OVPN_A_PEER_MAX, info->attrs[OVPN_A_PEER],
+			       ovpn_peer_nl_policy, info->extack);
+	if (ret)
+		return ret;
+
+	if (NL_REQ_ATTR_CHECK(info->extack, info->attrs[OVPN_A_PEER], attrs,
+			      OVPN_A_PEER_ID))
+		return -EINVAL;
+
+	peer_id = nla_get_u32(attrs[OVPN_A_PEER_ID]);
+	peer = ovpn_peer_get_by_id(ovpn, peer_id);
+	if (!peer) {
+		NL_SET_ERR_MSG_FMT_MOD(info->extack,
+				       "cannot find peer with id %u", peer_id);
+		return -ENOENT;
+	}
+
+	msg = nlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+	if (!msg)
+		return -ENOMEM;
+
+	ret = ovpn_nl_send_peer(msg, info, peer,
+				atomic_read(&ovpn->stats_gen),
+				ovpn_nl_peer_info(info), info->snd_portid,
+				info->snd_seq, 0);
+	if (ret < 0) {
+		nlmsg_free(msg);
+		goto err;
+	}
+
+	ret = genlmsg_reply(msg, info);
+err:
+	ovpn_peer_put(peer);
+	return ret;
+}
+
+int ovpn_nl_get_peer_dumpit(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	const struct genl_info *info = genl_info_dump(cb);
+	int last_idx = cb->args[1], dumped = 0;
+	u32 mask = ovpn_nl_peer_info(info);
+	u32 filter_gen = 0, stats_gen;
+	struct ovpn_struct *ovpn;
+	struct ovpn_peer *peer;
+	struct net_device *dev;
+	bool filter = false;
+	unsigned long index;
+
+	dev = ovpn_get_dev_from_attrs(sock_net(cb->skb->sk), info);
+	if (IS_ERR(dev))
+		return PTR_ERR(dev);
+
+	ovpn = netdev_priv(dev);
+
+	/* every dump opens a new stats generation. Userspace can pass the one
+	 * reported by a dump to the next one, in order to get only the peers
+	 * whose stats changed in the meantime
+	 */
+	if (!cb->args[3]) {
+		cb->args[2] = atomic_inc_return(&ovpn->stats_gen);
+		cb->args[3] = 1;
+	}
+	stats_gen = cb->args[2];
+
+	if (info->attrs[OVPN_A_STATS_GEN]) {
+		filter_gen = nla_get_u32(info->attrs[OVPN_A_STATS_GEN]);
+		filter = true;
+	}
+
+	if (ovpn->mode == OVPN_MODE_P2P) {
+		/* if we already dumped a peer it means we are done */
+		if (last_idx)
+			goto out;
+
+		rcu_read_lock();
+		peer = rcu_dereference(ovpn->peer);
+		if (peer &&
+		    (!filter || ovpn_peer_stats_changed(peer, filter_gen))) {
+			if (ovpn_nl_send_peer(skb, info, peer, stats_gen, mask,
+					      NETLINK_CB(cb->skb).portid,
+					      cb->nlh->nlmsg_seq,
+					      NLM_F_MULTI) == 0)
+				dumped++;
+		}
+		rcu_read_unlock();
+	} else {
+		/* in MP mode args[1] holds the next peer ID to dump, so that
+		 * peers added or removed between invocations do not shift
+		 * the position we left at
+		 */
+		rcu_read_lock();
+		xa_for_each_start(&ovpn->peers->by_id, index, peer,
+				  cb->args[1]) {
+			if (filter &&
+			    !ovpn_peer_stats_changed(peer, filter_gen)) {
+				cb->args[1] = index + 1;
+				continue;
+			}
+
+			if (ovpn_nl_send_peer(skb, info, peer, stats_gen, mask,
+					      NETLINK_CB(cb->skb).portid,
+					      cb->nlh->nlmsg_seq,
+					      NLM_F_MULTI) < 0)
+				break;
+
+			cb->args[1] = index + 1;
+		}
+		rcu_read_unlock();
+	}
+
+out:
+	netdev_put(dev, NULL);
+
+	/* sum up peers dumped in this message, so that at the next invocation
+	 * we can continue from where we left (P2P only)
+	 */
+	cb->args[1] += dumped;
+	return skb->len;
+}
+
+int ovpn_nl_del_peer_doit(struct sk_buff *skb, struct genl_info *info)
+{
+	struct nlattr *attrs[OVPN_A_PEER_MAX + 1];
+	struct ovpn_struct *ovpn = info->user_ptr[0];
+	struct ovpn_peer *peer;
+	u32 peer_id;
+	int ret;
+
+	if (GENL_REQ_ATTR_CHECK(info, OVPN_A_PEER))
+		return -EINVAL;
+
+	ret = nla_parse_nested(attrs, OVPN_A_PEER_MAX, info->attrs[OVPN_A_PEER],
+			       ovpn_peer_nl_policy, info->extack);
+	if (ret)
+		return ret;
+
+	if (NL_REQ_ATTR_CHECK(info->extack, info->attrs[OVPN_A_PEER], attrs,
+			      OVPN_A_PEER_ID))
+		return -EINVAL;
+
+	peer_id = nla_get_u32(attrs[OVPN_A_PEER_ID]);
+
+	peer = ovpn_peer_get_by_id(ovpn, peer_id);
+	if (!peer)
+		return -ENOENT;
+
+	netdev_dbg(ovpn->dev, "%s: peer id=%u\n", __func__, peer->id);
+	ret = ovpn_peer_del(peer, OVPN_DEL_PEER_REASON_USERSPACE);
+	ovpn_peer_put(peer);
+
+	return ret;
+}
+
+static int ovpn_nl_get_key_dir(struct genl_info *info, struct nlattr *key,
+			       enum ovpn_cipher_alg cipher,
+			       struct ovpn_key_direction *dir)
+{
+	struct nlattr *attrs[OVPN_A_KEYDIR_MAX + 1];
+	int ret;
+
+	ret = nla_parse_nested(attrs, OVPN_A_KEYDIR_MAX, key,
+			       ovpn_keydir_nl_policy, info->extack);
+	if (ret)
+		return ret;
+
+	switch (cipher) {
+	case OVPN_CIPHER_ALG_AES_GCM:
+	case OVPN_CIPHER_ALG_CHACHA20_POLY1305:
+		if (NL_REQ_ATTR_CHECK(info->extack, key, attrs,
+				      OVPN_A_KEYDIR_CIPHER_KEY) ||
+		    NL_REQ_ATTR_CHECK(info->extack, key, attrs,
+				      OVPN_A_KEYDIR_NONCE_TAIL))
+			return -EINVAL;
+
+		dir->cipher_key = nla_data(attrs[OVPN_A_KEYDIR_CIPHER_KEY]);
+		dir->cipher_key_size = nla_len(attrs[OVPN_A_KEYDIR_CIPHER_KEY]);
+
+		/* These algorithms require a 96bit nonce,
+		 * Construct it by combining 4-bytes packet id and
+		 * 8-bytes nonce-tail from userspace
+		 */
+		dir->nonce_tail = nla_data(attrs[OVPN_A_KEYDIR_NONCE_TAIL]);
+		dir->nonce_tail_size = nla_len(attrs[OVPN_A_KEYDIR_NONCE_TAIL]);
+
+		/* the following keys are derived from the epoch secret */
+		dir->epoch_secret = NULL;
+		if (attrs[OVPN_A_KEYDIR_EPOCH_SECRET])
+			dir->epoch_secret =
+				nla_data(attrs[OVPN_A_KEYDIR_EPOCH_SECRET]);
+
+		dir->hmac_key = NULL;
+		dir->hmac_key_size = 0;
+		break;
+	case OVPN_CIPHER_ALG_AES_CBC_HMAC_SHA256:
+		if (NL_REQ_ATTR_CHECK(info->extack, key, attrs,
+				      OVPN_A_KEYDIR_CIPHER_KEY) ||
+		    NL_REQ_ATTR_CHECK(info->extack, key, attrs,
+				      OVPN_A_KEYDIR_HMAC_KEY))
+			return -EINVAL;
+
+		dir->cipher_key = nla_data(attrs[OVPN_A_KEYDIR_CIPHER_KEY]);
+		dir->cipher_key_size = nla_len(attrs[OVPN_A_KEYDIR_CIPHER_KEY]);
+		dir->hmac_key = nla_data(attrs[OVPN_A_KEYDIR_HMAC_KEY]);
+		dir->hmac_key_size = nla_len(attrs[OVPN_A_KEYDIR_HMAC_KEY]);
+
+		/* a random IV is sent with every packet */
+		dir->nonce_tail = NULL;
+		dir->nonce_tail_size = 0;
+		dir->epoch_secret = NULL;
+		break;
+	default:
+		NL_SET_ERR_MSG_MOD(info->extack, "unsupported cipher");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/**
+ * ovpn_nl_parse_keyconf - parse a key configuration
+ * @info: generic netlink info from the user request
+ * @keyconf: the OVPN_A_PEER_KEYCONF attribute to parse
+ * @pkr: the key reset object to fill
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+static int ovpn_nl_parse_keyconf(struct genl_info *info,
+				 struct nlattr *keyconf,
+				 struct ovpn_peer_key_reset *pkr)
+{
+	struct nlattr *attrs[OVPN_A_KEYCONF_MAX + 1];
+	int ret;
+
+	ret = nla_parse_nested(attrs, OVPN_A_KEYCONF_MAX, keyconf,
+			       ovpn_keyconf_nl_policy, info->extack);
+	if (ret)
+		return ret;
+
+	if (NL_REQ_ATTR_CHECK(info->extack, keyconf, attrs,
+			      OVPN_A_KEYCONF_SLOT) ||
+	    NL_REQ_ATTR_CHECK(info->extack, keyconf, attrs,
+			      OVPN_A_KEYCONF_KEY_ID) ||
+	    NL_REQ_ATTR_CHECK(info->extack, keyconf, attrs,
+			      OVPN_A_KEYCONF_CIPHER_ALG) ||
+	    NL_REQ_ATTR_CHECK(info->extack, keyconf, attrs,
+			      OVPN_A_KEYCONF_ENCRYPT_DIR) ||
+	    NL_REQ_ATTR_CHECK(info->extack, keyconf, attrs,
+			      OVPN_A_KEYCONF_DECRYPT_DIR))
+		return -EINVAL;
+
+	pkr->slot = nla_get_u8(attrs[OVPN_A_KEYCONF_SLOT]);
+	pkr->key.key_id = nla_get_u16(attrs[OVPN_A_KEYCONF_KEY_ID]);
+	pkr->key.cipher_alg = nla_get_u16(attrs[OVPN_A_KEYCONF_CIPHER_ALG]);
+	/* the packet ID format is negotiated by userspace with the peer */
+	pkr->key.long_pktid = !!attrs[OVPN_A_KEYCONF_PKTID_64];
+	/* so is the use of peer IDs: if not, packets are framed as DATA_V1 */
+	pkr->key.data_v1 = !!attrs[OVPN_A_KEYCONF_DATA_V1];
+
+	/* traffic limits mandated by the security policy of userspace */
+	pkr->key.soft_bytes = attrs[OVPN_A_KEYCONF_SOFT_BYTES] ?
+		nla_get_uint(attrs[OVPN_A_KEYCONF_SOFT_BYTES]) : 0;
+	pkr->key.hard_bytes = attrs[OVPN_A_KEYCONF_HARD_BYTES] ?
+		nla_get_uint(attrs[OVPN_A_KEYCONF_HARD_BYTES]) : 0;
+	pkr->key.soft_packets = attrs[OVPN_A_KEYCONF_SOFT_PACKETS] ?
+		nla_get_uint(attrs[OVPN_A_KEYCONF_SOFT_PACKETS]) : 0;
+	pkr->key.hard_packets = attrs[OVPN_A_KEYCONF_HARD_PACKETS] ?
+		nla_get_uint(attrs[OVPN_A_KEYCONF_HARD_PACKETS]) : 0;
+	if ((pkr->key.hard_bytes && pkr->key.soft_bytes > pkr->key.hard_bytes) ||
+	    (pkr->key.hard_packets &&
+	     pkr->key.soft_packets > pkr->key.hard_packets)) {
+		NL_SET_ERR_MSG_MOD(info->extack,
+				   "soft traffic limit above the hard one");
+		return -EINVAL;
+	}
+
+	ret = ovpn_nl_get_key_dir(info, attrs[OVPN_A_KEYCONF_ENCRYPT_DIR],
+				  pkr->key.cipher_alg, &pkr->key.encrypt);
+	if (ret < 0)
+		return ret;
+
+	ret = ovpn_nl_get_key_dir(info, attrs[OVPN_A_KEYCONF_DECRYPT_DIR],
+				  pkr->key.cipher_alg, &pkr->key.decrypt);
+	if (ret < 0)
+		return ret;
+
+	if (!pkr->key.encrypt.epoch_secret != !pkr->key.decrypt.epoch_secret) {
+		NL_SET_ERR_MSG_MOD(info->extack,
+				   "epoch secret required in both directions");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* complete a parsed key with the settings it inherits from its peer */
+static void ovpn_nl_key_prepare(struct ovpn_peer *peer,
+				struct ovpn_peer_key_reset *pkr)
+{
+	pkr->key.replay_window = READ_ONCE(peer->replay_window);
+	pkr->key.rekey_threshold = READ_ONCE(peer->rekey_threshold);
+	pkr->key.compact = peer->ovpn->compact_keys;
+	pkr->key.lib_max_len = peer->ovpn->lib_max_len;
+	pkr->key.node = READ_ONCE(peer->node);
+}
+
+/* build the key slot and install it in the crypto state of the peer */
+static int ovpn_nl_key_install(struct ovpn_peer *peer,
+			       const struct ovpn_peer_key_reset *pkr)
+{
+	return ovpn_crypto_state_reset(&peer->crypto, pkr,
+				       peer->ovpn->tfm_pool);
+}
+
+/**
+ * struct ovpn_nl_async_key - key installation requested with KEYCONF_ASYNC
+ * @work: builds and installs the key slot, then notifies userspace
+ * @peer: the peer the key is for
+ * @pkr: the key to install, pointing into @data
+ * @data: copy of the key material of the request
+ */
+struct ovpn_nl_async_key {
+	struct work_struct work;
+	struct ovpn_peer *peer;
+	struct ovpn_peer_key_reset pkr;
+	u8 data[];
+};
+
+/* report the result of an asynchronous key installation */
+static void ovpn_nl_notify_set_key(struct ovpn_peer *peer, u8 key_id, int err)
+{
+	struct nlattr *res;
+	struct sk_buff *msg;
+	void *hdr;
+
+	msg = genlmsg_new(nla_total_size(sizeof(u32)) +
+			  nla_total_size(3 * nla_total_size(sizeof(u32))),
+			  GFP_KERNEL);
+	if (!msg)
+		return;
+
+	hdr = genlmsg_put(msg, 0, 0, &ovpn_nl_family, 0, OVPN_CMD_SET_KEY);
+	if (!hdr)
+		goto err_free_msg;
+
+	if (nla_put_u32(msg, OVPN_A_IFINDEX, peer->ovpn->dev->ifindex))
+		goto err_cancel_msg;
+
+	res = nla_nest_start(msg, OVPN_A_PEER_RESULT);
+	if (!res)
+		goto err_cancel_msg;
+
+	if (nla_put_u32(msg, OVPN_A_PEER_RESULT_ID, peer->id) ||
+	    nla_put_s32(msg, OVPN_A_PEER_RESULT_ERROR, err) ||
+	    nla_put_u32(msg, OVPN_A_PEER_RESULT_KEY_ID, key_id))
+		goto err_cancel_msg;
+
+	nla_nest_end(msg, res);
+	genlmsg_end(msg, hdr);
+
+	genlmsg_multicast_netns(&ovpn_nl_family, dev_net(peer->ovpn->dev), msg,
+				0, OVPN_NLGRP_PEERS, GFP_KERNEL);
+	return;
+
+err_cancel_msg:
+	genlmsg_cancel(msg, hdr);
+err_free_msg:
+	nlmsg_free(msg);
+}
+
+static void ovpn_nl_async_key_work(struct work_struct *work)
+{
+	struct ovpn_nl_async_key *ak = container_of(work,
+						    struct ovpn_nl_async_key,
+						    work);
+	int ret;
+
+	ret = ovpn_nl_key_install(ak->peer, &ak->pkr);
+	ovpn_nl_notify_set_key(ak->peer, ak->pkr.key.key_id, ret);
+
+	ovpn_peer_put(ak->peer);
+	kfree_sensitive(ak);
+}
+
+/* copy one direction of a key into the buffer of an asynchronous request */
+static u8 *ovpn_nl_async_key_dir(struct ovpn_key_direction *dir, u8 *data)
+{
+	memcpy(data, dir->cipher_key, dir->cipher_key_size);
+	dir->cipher_key = data;
+	data += dir->cipher_key_size;
+
+	memcpy(data, dir->nonce_tail, dir->nonce_tail_size);
+	dir->nonce_tail = data;
+	data += dir->nonce_tail_size;
+
+	memcpy(data, dir->hmac_key, dir->hmac_key_size);
+	dir->hmac_key = data;
+	data += dir->hmac_key_size;
+
+	if (dir->epoch_secret) {
+		memcpy(data, dir->epoch_secret, OVPN_EPOCH_SECRET_SIZE);
+		dir->epoch_secret = data;
+	}
+
+	return data + OVPN_EPOCH_SECRET_SIZE;
+}
+
+/**
+ * ovpn_nl_set_key_async - install a key from a worker
+ * @peer: the peer the key is for
+ * @pkr: the key to install, pointing into the request
+ *
+ * Allocating and keying the transforms may take long with some drivers: the
+ * request is acked right away and the result is reported with a SET_KEY
+ * notification on the peers group, carrying the ID of the key installed.
+ * Userspace should wait for it before swapping keys or installing another key
+ * in the same slot.
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+static int ovpn_nl_set_key_async(struct ovpn_peer *peer,
+				 const struct ovpn_peer_key_reset *pkr)
+{
+	const struct ovpn_key_config *kc = &pkr->key;
+	struct ovpn_nl_async_key *ak;
+	u8 *data;
+
+	ak = kzalloc(struct_size(ak, data, kc->encrypt.cipher_key_size +
+				 kc->encrypt.nonce_tail_size +
+				 kc->decrypt.cipher_key_size +
+				 kc->decrypt.nonce_tail_size +
+				 kc->encrypt.hmac_key_size +
+				 kc->decrypt.hmac_key_size +
+				 2 * OVPN_EPOCH_SECRET_SIZE), GFP_KERNEL);
+	if (!ak)
+		return -ENOMEM;
+
+	ak->pkr = *pkr;
+	data = ovpn_nl_async_key_dir(&ak->pkr.key.encrypt, ak->data);
+	ovpn_nl_async_key_dir(&ak->pkr.key.decrypt, data);
+
+	/* released by the worker */
+	kref_get(&peer->refcount);
+	ak->peer = peer;
+
+	INIT_WORK(&ak->work, ovpn_nl_async_key_work);
+	queue_work(system_unbound_wq, &ak->work);
+
+	return 0;
+}
+
+int ovpn_nl_set_key_doit(struct sk_buff *skb, struct genl_info *info)
+{
+	struct nlattr *p_attrs[OVPN_A_PEER_MAX + 1];
+	struct ovpn_struct *ovpn = info->user_ptr[0];
+	struct ovpn_peer_key_reset pkr;
+	struct ovpn_peer *peer;
+	u32 peer_id;
+	int ret;
+
+	if (GENL_REQ_ATTR_CHECK(info, OVPN_A_PEER))
+		return -EINVAL;
+
+	ret = nla_parse_nested(p_attrs, OVPN_A_PEER_MAX,
+			       info->attrs[OVPN_A_PEER], ovpn_peer_nl_policy,
+			       info->extack);
+	if (ret)
+		return ret;
+
+	if (NL_REQ_ATTR_CHECK(info->extack, info->attrs[OVPN_A_PEER], p_attrs,
+			      OVPN_A_PEER_ID) ||
+	    NL_REQ_ATTR_CHECK(info->extack, info->attrs[OVPN_A_PEER], p_attrs,
+			      OVPN_A_PEER_KEYCONF))
+		return -EINVAL;
+
+	ret = ovpn_nl_parse_keyconf(info, p_attrs[OVPN_A_PEER_KEYCONF], &pkr);
+	if (ret < 0)
+		return ret;
+
+	peer_id = nla_get_u32(p_attrs[OVPN_A_PEER_ID]);
+	peer = ovpn_peer_get_by_id(ovpn, peer_id);
+	if (!peer) {
+		NL_SET_ERR_MSG_FMT_MOD(info->extack,
+				       "no peer with id %u to set key for",
+				       peer_id);
+		return -ENOENT;
+	}
+
+	ovpn_nl_key_prepare(peer, &pkr);
+	if (nla_find_nested(p_attrs[OVPN_A_PEER_KEYCONF],
+			    OVPN_A_KEYCONF_ASYNC)) {
+		ret = ovpn_nl_set_key_async(peer, &pkr);
+		goto out;
+	}
+
+	ret = ovpn_nl_key_install(peer, &pkr);
+	if (ret < 0) {
+		NL_SET_ERR_MSG_FMT_MOD(info->extack,
+				       "cannot install new key for peer %u",
+				       peer_id);
+		goto out;
+	}
+
+	netdev_dbg(ovpn->dev, "%s: new key installed (id=%u) for peer %u\n",
+		   __func__, pkr.key.key_id, peer_id);
+out:
+	ovpn_peer_put(peer);
+	return ret;
+}
+
+/**
+ * ovpn_nl_new_peer_bulk - create one of the peers of a NEW_PEERS request
+ * @ovpn: the instance the peer is created in
+ * @info: generic netlink info from the user request
+ * @nest: the OVPN_A_PEERS attribute describing the peer
+ *
+ * The peer is fully configured, including its key if any, but it is not
+ * hashed yet.
+ *
+ * Return: the new peer on success or an error pointer otherwise
+ */
+static struct ovpn_peer *ovpn_nl_new_peer_bulk(struct ovpn_struct *ovpn,
+					       struct genl_info *info,
+					       struct nlattr *nest)
+{
+	struct nlattr *attrs[OVPN_A_PEER_MAX + 1];
+	struct ovpn_peer_key_reset pkr;
+	struct ovpn_peer *peer;
+	u32 id;
+	int ret;
+
+	ret = nla_parse_nested(attrs, OVPN_A_PEER_MAX, nest,
+			       ovpn_peer_nl_policy, info->extack);
+	if (ret)
+		return ERR_PTR(ret);
+
+	if (NL_REQ_ATTR_CHECK(info->extack, nest, attrs, OVPN_A_PEER_ID))
+		return ERR_PTR(-EINVAL);
+
+	if (attrs[OVPN_A_PEER_KEYCONF]) {
+		ret = ovpn_nl_parse_keyconf(info, attrs[OVPN_A_PEER_KEYCONF],
+					    &pkr);
+		if (ret < 0)
+			return ERR_PTR(ret);
+	}
+
+	/* existing peers can only be modified with SET_PEER */
+	id = nla_get_u32(attrs[OVPN_A_PEER_ID]);
+	peer = ovpn_peer_get_by_id(ovpn, id);
+	if (peer) {
+		ovpn_peer_put(peer);
+		return ERR_PTR(-EEXIST);
+	}
+
+	peer = ovpn_peer_new(ovpn, id, ovpn_nl_peer_node(attrs));
+	if (IS_ERR(peer))
+		return peer;
+
+	ret = ovpn_nl_peer_modify(peer, info, nest, attrs, true);
+	if (ret < 0)
+		goto err;
+
+	if (attrs[OVPN_A_PEER_KEYCONF]) {
+		ovpn_nl_key_prepare(peer, &pkr);
+		ret = ovpn_crypto_state_reset(&peer->crypto, &pkr,
+					      ovpn->tfm_pool);
+		if (ret < 0)
+			goto err;
+	}
+
+	return peer;
+err:
+	ovpn_peer_release(peer);
+	ovpn_peer_free(peer);
+	return ERR_PTR(ret);
+}
+
+/**
+ * ovpn_nl_peers_reply - report the peers a bulk request failed for
+ * @info: generic netlink info from the user request
+ * @errs: per-peer result, in the same order as the OVPN_A_PEERS attributes
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+static int ovpn_nl_peers_reply(struct genl_info *info, const int *errs)
+{
+	struct nlattr *attr, *id, *res;
+	unsigned int i = 0, failed = 0;
+	struct sk_buff *msg;
+	void *hdr;
+	int rem;
+
+	nlmsg_for_each_attr(attr, info->nlhdr, GENL_HDRLEN, rem)
+		if (nla_type(attr) == OVPN_A_PEERS && errs[i++])
+			failed++;
+
+	msg = genlmsg_new(failed *
+			  nla_total_size(2 * nla_total_size(sizeof(u32))),
+			  GFP_KERNEL);
+	if (!msg)
+		return -ENOMEM;
+
+	hdr = genlmsg_iput(msg, info);
+	if (!hdr)
+		goto err_free_msg;
+
+	i = 0;
+	nlmsg_for_each_attr(attr, info->nlhdr, GENL_HDRLEN, rem) {
+		if (nla_type(attr) != OVPN_A_PEERS || !errs[i++])
+			continue;
+
+		res = nla_nest_start(msg, OVPN_A_PEER_RESULT);
+		if (!res)
+			goto err_cancel_msg;
+
+		/* the ID may be missing if that was the error */
+		id = nla_find_nested(attr, OVPN_A_PEER_ID);
+		if (id && nla_put_u32(msg, OVPN_A_PEER_RESULT_ID,
+				      nla_get_u32(id)))
+			goto err_cancel_msg;
+
+		if (nla_put_s32(msg, OVPN_A_PEER_RESULT_ERROR, errs[i - 1]))
+			goto err_cancel_msg;
+
+		nla_nest_end(msg, res);
+	}
+
+	genlmsg_end(msg, hdr);
+
+	return genlmsg_reply(msg, info);
+
+err_cancel_msg:
+	genlmsg_cancel(msg, hdr);
+err_free_msg:
+	nlmsg_free(msg);
+	return -EMSGSIZE;
 }
 
-static int ovpn_nl_send_peer(struct sk_buff *skb, const struct genl_info *info,
-			     const struct ovpn_peer *peer, u32 portid, u32 seq,
-			     int flags)
+int ovpn_nl_new_peers_doit(struct sk_buff *skb, struct genl_info *info)
 {
-	const struct ovpn_bind *bind;
+	struct ovpn_struct *ovpn = info->user_ptr[0];
+	unsigned int n = 0, i = 0;
+	struct ovpn_peer **peers;
 	struct nlattr *attr;
-	void *hdr;
-
-	hdr = genlmsg_put(skb, portid, seq, &ovpn_nl_family, flags,
-			  OVPN_CMD_SET_PEER);
-	if (!hdr)
-		return -ENOBUFS;
+	int rem, ret, *errs;
 
-	attr = nla_nest_start(skb, OVPN_A_PEER);
-	if (!attr)
-		goto err;
+	if (ovpn->mode != OVPN_MODE_MP) {
+		NL_SET_ERR_MSG_MOD(info->extack,
+				   "bulk peer creation is supported in MP mode only");
+		return -EOPNOTSUPP;
+	}
 
-	if (nla_put_u32(skb, OVPN_A_PEER_ID, peer->id))
-		goto err;
+	nlmsg_for_each_attr(attr, info->nlhdr, GENL_HDRLEN, rem)
+		if (nla_type(attr) == OVPN_A_PEERS)
+			n++;
 
-	if (peer->vpn_addrs.ipv4.s_addr != htonl(INADDR_ANY))
-		if (nla_put_in_addr(skb, OVPN_A_PEER_VPN_IPV4,
-				    peer->vpn_addrs.ipv4.s_addr))
-			goto err;
+	if (!n) {
+		NL_SET_ERR_MSG_MOD(info->extack, "no peer specified");
+		return -EINVAL;
+	}
 
-	if (!ipv6_addr_equal(&peer->vpn_addrs.ipv6, &in6addr_any))
-		if (nla_put_in6_addr(skb, OVPN_A_PEER_VPN_IPV6,
-				     &peer->vpn_addrs.ipv6))
-			goto err;
+	peers = kvcalloc(n, sizeof(*peers), GFP_KERNEL);
+	errs = kvcalloc(n, sizeof(*errs), GFP_KERNEL);
+	if (!peers || !errs) {
+		ret = -ENOMEM;
+		goto out;
+	}
 
-	if (nla_put_u32(skb, OVPN_A_PEER_KEEPALIVE_INTERVAL,
-			peer->keepalive_interval) ||
-	    nla_put_u32(skb, OVPN_A_PEER_KEEPALIVE_TIMEOUT,
-			peer->keepalive_timeout))
-		goto err;
+	/* sockets, keys and bindings are set up without holding any lock */
+	nlmsg_for_each_attr(attr, info->nlhdr, GENL_HDRLEN, rem) {
+		if (nla_type(attr) != OVPN_A_PEERS)
+			continue;
 
-	rcu_read_lock();
-	bind = rcu_dereference(peer->bind);
-	if (bind) {
-		if (bind->sa.in4.sin_family == AF_INET) {
-			if (nla_put(skb, OVPN_A_PEER_SOCKADDR_REMOTE,
-				    sizeof(bind->sa.in4), &bind->sa.in4) ||
-			    nla_put(skb, OVPN_A_PEER_LOCAL_IP,
-				    sizeof(bind->local.ipv4),
-				    &bind->local.ipv4))
-				goto err_unlock;
-		} else if (bind->sa.in4.sin_family == AF_INET6) {
-			if (nla_put(skb, OVPN_A_PEER_SOCKADDR_REMOTE,
-				    sizeof(bind->sa.in6), &bind->sa.in6) ||
-			    nla_put(skb, OVPN_A_PEER_LOCAL_IP,
-				    sizeof(bind->local.ipv6),
-				    &bind->local.ipv6))
-				goto err_unlock;
+		peers[i] = ovpn_nl_new_peer_bulk(ovpn, info, attr);
+		if (IS_ERR(peers[i])) {
+			errs[i] = PTR_ERR(peers[i]);
+			peers[i] = NULL;
 		}
+		i++;
 	}
-	rcu_read_unlock();
 
-	if (nla_put_net16(skb, OVPN_A_PEER_LOCAL_PORT,
-			  inet_sk(peer->sock->sock->sk)->inet_sport) ||
-	    /* VPN RX stats */
-	    nla_put_uint(skb, OVPN_A_PEER_VPN_RX_BYTES,
-			 atomic64_read(&peer->vpn_stats.rx.bytes)) ||
-	    nla_put_uint(skb, OVPN_A_PEER_VPN_RX_PACKETS,
-			 atomic64_read(&peer->vpn_stats.rx.packets)) ||
-	    /* VPN TX stats */
-	    nla_put_uint(skb, OVPN_A_PEER_VPN_TX_BYTES,
-			 atomic64_read(&peer->vpn_stats.tx.bytes)) ||
-	    nla_put_uint(skb, OVPN_A_PEER_VPN_TX_PACKETS,
-			 atomic64_read(&peer->vpn_stats.tx.packets)) ||
-	    /* link RX stats */
-	    nla_put_uint(skb, OVPN_A_PEER_LINK_RX_BYTES,
-			 atomic64_read(&peer->link_stats.rx.bytes)) ||
-	    nla_put_uint(skb, OVPN_A_PEER_LINK_RX_PACKETS,
-			 atomic64_read(&peer->link_stats.rx.packets)) ||
-	    /* link TX stats */
-	    nla_put_uint(skb, OVPN_A_PEER_LINK_TX_BYTES,
-			 atomic64_read(&peer->link_stats.tx.bytes)) ||
-	    nla_put_uint(skb, OVPN_A_PEER_LINK_TX_PACKETS,
-			 atomic64_read(&peer->link_stats.tx.packets)))
-		goto err;
+	/* keep the peers around for their prefixes to be installed */
+	for (i = 0; i < n; i++)
+		if (peers[i])
+			kref_get(&peers[i]->refcount);
 
-	nla_nest_end(skb, attr);
-	genlmsg_end(skb, hdr);
+	/* then all peers are published at once */
+	ovpn_peer_add_bulk(ovpn, peers, errs, n);
 
-	return 0;
-err_unlock:
-	rcu_read_unlock();
-err:
-	genlmsg_cancel(skb, hdr);
-	return -EMSGSIZE;
+	for (i = 0; i < n; i++) {
+		if (!peers[i] || !errs[i])
+			continue;
+
+		/* release right away because peer is not really used in any
+		 * context
+		 */
+		ovpn_peer_release(peers[i]);
+		ovpn_peer_free(peers[i]);
+		peers[i] = NULL;
+	}
+
+	/* prefixes can only be routed to peers that were added */
+	i = 0;
+	nlmsg_for_each_attr(attr, info->nlhdr, GENL_HDRLEN, rem) {
+		if (nla_type(attr) != OVPN_A_PEERS)
+			continue;
+
+		if (peers[i]) {
+			errs[i] = ovpn_nl_peer_iroutes(peers[i], info, attr,
+						       true);
+			ovpn_peer_put(peers[i]);
+		}
+		i++;
+	}
+
+	ret = ovpn_nl_peers_reply(info, errs);
+out:
+	kvfree(peers);
+	kvfree(errs);
+	return ret;
 }
 
-int ovpn_nl_get_peer_doit(struct sk_buff *skb, struct genl_info *info)
+int ovpn_nl_swap_keys_doit(struct sk_buff *skb, struct genl_info *info)
 {
-	struct nlattr *attrs[OVPN_A_PEER_MAX + 1];
 	struct ovpn_struct *ovpn = info->user_ptr[0];
+	struct nlattr *attrs[OVPN_A_PEER_MAX + 1];
 	struct ovpn_peer *peer;
-	struct sk_buff *msg;
 	u32 peer_id;
 	int ret;
 
@@ -518,349 +2517,809 @@ int ovpn_nl_get_peer_doit(struct sk_buff *skb, struct genl_info *info)
 		return -EINVAL;
 
 	peer_id = nla_get_u32(attrs[OVPN_A_PEER_ID]);
+
 	peer = ovpn_peer_get_by_id(ovpn, peer_id);
 	if (!peer) {
 		NL_SET_ERR_MSG_FMT_MOD(info->extack,
-				       "cannot find peer with id %u", peer_id);
+				       "no peer with id %u to swap keys for",
+				       peer_id);
 		return -ENOENT;
 	}
 
-	msg = nlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
-	if (!msg)
+	ovpn_crypto_key_slots_swap(&peer->crypto);
+	ovpn_peer_put(peer);
+
+	return 0;
+}
+
+/**
+ * struct ovpn_nl_key_work - installation of a key of a SET_KEYS request
+ * @work: builds and installs the key slot on an unbound worker
+ * @peer: the peer the key is for (NULL if the request was invalid)
+ * @pkr: the key to install, pointing into the request
+ * @err: result of the installation
+ */
+struct ovpn_nl_key_work {
+	struct work_struct work;
+	struct ovpn_peer *peer;
+	struct ovpn_peer_key_reset pkr;
+	int err;
+};
+
+static void ovpn_nl_key_work(struct work_struct *work)
+{
+	struct ovpn_nl_key_work *kw = container_of(work,
+						   struct ovpn_nl_key_work,
+						   work);
+	kw->err = ovpn_nl_key_install(kw->peer, &kw->pkr);
+}
+
+/**
+ * ovpn_nl_key_work_init - prepare the installation of one key of SET_KEYS
+ * @ovpn: the instance the peer belongs to
+ * @info: generic netlink info from the user request
+ * @nest: the OVPN_A_PEERS attribute carrying the ID and the key of the peer
+ * @kw: the work to prepare
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+static int ovpn_nl_key_work_init(struct ovpn_struct *ovpn,
+				 struct genl_info *info, struct nlattr *nest,
+				 struct ovpn_nl_key_work *kw)
+{
+	struct nlattr *attrs[OVPN_A_PEER_MAX + 1];
+	int ret;
+
+	ret = nla_parse_nested(attrs, OVPN_A_PEER_MAX, nest,
+			       ovpn_peer_nl_policy, info->extack);
+	if (ret)
+		return ret;
+
+	if (NL_REQ_ATTR_CHECK(info->extack, nest, attrs, OVPN_A_PEER_ID) ||
+	    NL_REQ_ATTR_CHECK(info->extack, nest, attrs, OVPN_A_PEER_KEYCONF))
+		return -EINVAL;
+
+	ret = ovpn_nl_parse_keyconf(info, attrs[OVPN_A_PEER_KEYCONF],
+				    &kw->pkr);
+	if (ret < 0)
+		return ret;
+
+	kw->peer = ovpn_peer_get_by_id(ovpn, nla_get_u32(attrs[OVPN_A_PEER_ID]));
+	if (!kw->peer)
+		return -ENOENT;
+
+	ovpn_nl_key_prepare(kw->peer, &kw->pkr);
+	INIT_WORK(&kw->work, ovpn_nl_key_work);
+
+	return 0;
+}
+
+/* Install the keys of many peers at once, as a rekey wave would.
+ *
+ * Building a key slot allocates and keys the AEAD transforms, which may
+ * take a while with some drivers: all slots are built in parallel on
+ * unbound workers and the handler waits for all of them before replying.
+ * Peers listed more than once get their keys installed in no specific
+ * order. Like NEW_PEERS, the reply lists the peers that failed.
+ */
+int ovpn_nl_set_keys_doit(struct sk_buff *skb, struct genl_info *info)
+{
+	struct ovpn_struct *ovpn = info->user_ptr[0];
+	struct ovpn_nl_key_work *works;
+	unsigned int n = 0, i = 0;
+	struct nlattr *attr;
+	int rem, ret, *errs;
+
+	nlmsg_for_each_attr(attr, info->nlhdr, GENL_HDRLEN, rem)
+		if (nla_type(attr) == OVPN_A_PEERS)
+			n++;
+
+	if (!n) {
+		NL_SET_ERR_MSG_MOD(info->extack, "no peer specified");
+		return -EINVAL;
+	}
+
+	works = kvcalloc(n, sizeof(*works), GFP_KERNEL);
+	errs = kvcalloc(n, sizeof(*errs), GFP_KERNEL);
+	if (!works || !errs) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* keys point into the request, which outlives the workers */
+	nlmsg_for_each_attr(attr, info->nlhdr, GENL_HDRLEN, rem) {
+		if (nla_type(attr) != OVPN_A_PEERS)
+			continue;
+
+		errs[i] = ovpn_nl_key_work_init(ovpn, info, attr, &works[i]);
+		if (!errs[i])
+			queue_work(system_unbound_wq, &works[i].work);
+		i++;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!works[i].peer)
+			continue;
+
+		flush_work(&works[i].work);
+		errs[i] = works[i].err;
+		ovpn_peer_put(works[i].peer);
+	}
+
+	ret = ovpn_nl_peers_reply(info, errs);
+out:
+	kvfree(works);
+	kvfree(errs);
+	return ret;
+}
+
+int ovpn_nl_swap_keys_bulk_doit(struct sk_buff *skb, struct genl_info *info)
+{
+	struct nlattr *attrs[OVPN_A_PEER_MAX + 1];
+	struct ovpn_struct *ovpn = info->user_ptr[0];
+	unsigned int n = 0, i = 0;
+	struct ovpn_peer *peer;
+	struct nlattr *attr;
+	int rem, ret, *errs;
+
+	nlmsg_for_each_attr(attr, info->nlhdr, GENL_HDRLEN, rem)
+		if (nla_type(attr) == OVPN_A_PEERS)
+			n++;
+
+	if (!n) {
+		NL_SET_ERR_MSG_MOD(info->extack, "no peer specified");
+		return -EINVAL;
+	}
+
+	errs = kvcalloc(n, sizeof(*errs), GFP_KERNEL);
+	if (!errs)
 		return -ENOMEM;
 
-	ret = ovpn_nl_send_peer(msg, info, peer, info->snd_portid,
-				info->snd_seq, 0);
-	if (ret < 0) {
-		nlmsg_free(msg);
-		goto err;
+	nlmsg_for_each_attr(attr, info->nlhdr, GENL_HDRLEN, rem) {
+		if (nla_type(attr) != OVPN_A_PEERS)
+			continue;
+
+		errs[i] = nla_parse_nested(attrs, OVPN_A_PEER_MAX, attr,
+					   ovpn_peer_nl_policy, info->extack);
+		if (!errs[i] && NL_REQ_ATTR_CHECK(info->extack, attr, attrs,
+						  OVPN_A_PEER_ID))
+			errs[i] = -EINVAL;
+		if (errs[i]) {
+			i++;
+			continue;
+		}
+
+		peer = ovpn_peer_get_by_id(ovpn,
+					   nla_get_u32(attrs[OVPN_A_PEER_ID]));
+		if (peer) {
+			ovpn_crypto_key_slots_swap(&peer->crypto);
+			ovpn_peer_put(peer);
+		} else {
+			errs[i] = -ENOENT;
+		}
+		i++;
 	}
 
-	ret = genlmsg_reply(msg, info);
-err:
-	ovpn_peer_put(peer);
+	ret = ovpn_nl_peers_reply(info, errs);
+	kvfree(errs);
 	return ret;
 }
 
-int ovpn_nl_get_peer_dumpit(struct sk_buff *skb, struct netlink_callback *cb)
+/* restore the packet ID state of the key slots of peer, as snapshotted on
+ * another node, one OVPN_A_PEER_KEYSTATE nest per key
+ */
+static int ovpn_nl_peer_keystate(struct ovpn_peer *peer,
+				 struct genl_info *info, struct nlattr *nest)
 {
-	const struct genl_info *info = genl_info_dump(cb);
-	struct ovpn_struct *ovpn;
+	struct nlattr *attrs[OVPN_A_KEYSTATE_MAX + 1];
+	struct nlattr *attr, *tx, *gap, *rx, *bytes, *packets;
+	struct ovpn_crypto_key_slot *ks;
+	u64 tx_pktid = 0, rx_pktid = 0;
+	unsigned int n = 0;
+	int rem, ret;
+	u8 key_id;
+
+	nla_for_each_nested(attr, nest, rem) {
+		if (nla_type(attr) != OVPN_A_PEER_KEYSTATE)
+			continue;
+
+		ret = nla_parse_nested(attrs, OVPN_A_KEYSTATE_MAX, attr,
+				       ovpn_keystate_nl_policy, info->extack);
+		if (ret)
+			return ret;
+
+		if (NL_REQ_ATTR_CHECK(info->extack, attr, attrs,
+				      OVPN_A_KEYSTATE_KEY_ID))
+			return -EINVAL;
+
+		key_id = nla_get_u32(attrs[OVPN_A_KEYSTATE_KEY_ID]);
+		tx = attrs[OVPN_A_KEYSTATE_TX_PKTID];
+		gap = attrs[OVPN_A_KEYSTATE_TX_PKTID_GAP];
+		rx = attrs[OVPN_A_KEYSTATE_RX_PKTID];
+
+		/* the gap covers the packets the previous owner of the key
+		 * sent after the snapshot
+		 */
+		if (tx) {
+			tx_pktid = nla_get_uint(tx);
+			if (gap && check_add_overflow(tx_pktid,
+						      nla_get_uint(gap),
+						      &tx_pktid)) {
+				NL_SET_ERR_MSG_ATTR(info->extack, gap,
+						    "TX packet ID out of range");
+				return -ERANGE;
+			}
+		}
+
+		if (rx) {
+			rx_pktid = nla_get_uint(rx);
+			if (rx_pktid > S64_MAX) {
+				NL_SET_ERR_MSG_ATTR(info->extack, rx,
+						    "RX packet ID out of range");
+				return -ERANGE;
+			}
+		}
+
+		rcu_read_lock();
+		ks = ovpn_crypto_key_id_to_slot(&peer->crypto, key_id);
+		if (!ks) {
+			rcu_read_unlock();
+			NL_SET_ERR_MSG_ATTR(info->extack,
+					    attrs[OVPN_A_KEYSTATE_KEY_ID],
+					    "no key with this ID");
+			return -ENOENT;
+		}
+
+		ret = tx ? ovpn_pktid_xmit_restore(&ks->pid_xmit, tx_pktid) : 0;
+		if (!ret && rx)
+			ovpn_pktid_recv_restore(&ks->pid_recv, rx_pktid);
+		/* the key does not get a fresh traffic budget on this node */
+		bytes = attrs[OVPN_A_KEYSTATE_BYTES];
+		packets = attrs[OVPN_A_KEYSTATE_PACKETS];
+		if (!ret && bytes)
+			atomic64_set(&ks->volume.bytes, nla_get_uint(bytes));
+		if (!ret && packets)
+			atomic64_set(&ks->volume.packets, nla_get_uint(packets));
+		rcu_read_unlock();
+
+		if (ret) {
+			NL_SET_ERR_MSG_ATTR(info->extack, tx,
+					    "TX packet ID out of range");
+			return ret;
+		}
+		n++;
+	}
+
+	if (!n) {
+		NL_SET_ERR_MSG_ATTR(info->extack, nest, "no key state specified");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+int ovpn_nl_set_keystate_doit(struct sk_buff *skb, struct genl_info *info)
+{
+	struct nlattr *attrs[OVPN_A_PEER_MAX + 1];
+	struct ovpn_struct *ovpn = info->user_ptr[0];
+	unsigned int n = 0, i = 0;
 	struct ovpn_peer *peer;
-	struct net_device *dev;
-	int bkt, last_idx = cb->args[1], dumped = 0;
+	struct nlattr *attr;
+	int rem, ret, *errs;
 
-	dev = ovpn_get_dev_from_attrs(sock_net(cb->skb->sk), info);
-	if (IS_ERR(dev))
-		return PTR_ERR(dev);
+	nlmsg_for_each_attr(attr, info->nlhdr, GENL_HDRLEN, rem)
+		if (nla_type(attr) == OVPN_A_PEERS)
+			n++;
 
-	ovpn = netdev_priv(dev);
+	if (!n) {
+		NL_SET_ERR_MSG_MOD(info->extack, "no peer specified");
+		return -EINVAL;
+	}
 
-	if (ovpn->mode == OVPN_MODE_P2P) {
-		/* if we already dumped a peer it means we are done */
-		if (last_idx)
-			goto out;
+	errs = kvcalloc(n, sizeof(*errs), GFP_KERNEL);
+	if (!errs)
+		return -ENOMEM;
+
+	nlmsg_for_each_attr(attr, info->nlhdr, GENL_HDRLEN, rem) {
+		if (nla_type(attr) != OVPN_A_PEERS)
+			continue;
+
+		errs[i] = nla_parse_nested(attrs, OVPN_A_PEER_MAX, attr,
+					   ovpn_peer_nl_policy, info->extack);
+		if (!errs[i] && NL_REQ_ATTR_CHECK(info->extack, attr, attrs,
+						  OVPN_A_PEER_ID))
+			errs[i] = -EINVAL;
+		if (errs[i]) {
+			i++;
+			continue;
+		}
+
+		peer = ovpn_peer_get_by_id(ovpn,
+					   nla_get_u32(attrs[OVPN_A_PEER_ID]));
+		if (peer) {
+			errs[i] = ovpn_nl_peer_keystate(peer, info, attr);
+			ovpn_peer_put(peer);
+		} else {
+			errs[i] = -ENOENT;
+		}
+		i++;
+	}
+
+	ret = ovpn_nl_peers_reply(info, errs);
+	kvfree(errs);
+	return ret;
+}
+
+int ovpn_nl_del_key_doit(struct sk_buff *skb, struct genl_info *info)
+{
+	struct nlattr *p_attrs[OVPN_A_PEER_MAX + 1];
+	struct nlattr *attrs[OVPN_A_KEYCONF_MAX + 1];
+	struct ovpn_struct *ovpn = info->user_ptr[0];
+	enum ovpn_key_slot slot;
+	struct ovpn_peer *peer;
+	u32 peer_id;
+	int ret;
+
+	if (GENL_REQ_ATTR_CHECK(info, OVPN_A_PEER))
+		return -EINVAL;
+
+	ret = nla_parse_nested(p_attrs, OVPN_A_PEER_MAX,
+			       info->attrs[OVPN_A_PEER], ovpn_peer_nl_policy,
+			       info->extack);
+	if (ret)
+		return ret;
+
+	if (NL_REQ_ATTR_CHECK(info->extack, info->attrs[OVPN_A_PEER], p_attrs,
+			      OVPN_A_PEER_ID) ||
+	    NL_REQ_ATTR_CHECK(info->extack, info->attrs[OVPN_A_PEER], p_attrs,
+			      OVPN_A_PEER_KEYCONF))
+		return -EINVAL;
+
+	ret = nla_parse_nested(attrs, OVPN_A_KEYCONF_MAX,
+			       p_attrs[OVPN_A_PEER_KEYCONF],
+			       ovpn_keyconf_nl_policy, info->extack);
+	if (ret)
+		return ret;
 
-		rcu_read_lock();
-		peer = rcu_dereference(ovpn->peer);
-		if (peer) {
-			if (ovpn_nl_send_peer(skb, info, peer,
-					      NETLINK_CB(cb->skb).portid,
-					      cb->nlh->nlmsg_seq,
-					      NLM_F_MULTI) == 0)
-				dumped++;
-		}
-		rcu_read_unlock();
-	} else {
-		rcu_read_lock();
-		hash_for_each_rcu(ovpn->peers->by_id, bkt, peer,
-				  hash_entry_id) {
-			/* skip already dumped peers that were dumped by
-			 * previous invocations
-			 */
-			if (last_idx > 0) {
-				last_idx--;
-				continue;
-			}
+	if (NL_REQ_ATTR_CHECK(info->extack, p_attrs[OVPN_A_PEER_KEYCONF], attrs,
+			      OVPN_A_KEYCONF_SLOT))
+		return -EINVAL;
 
-			if (ovpn_nl_send_peer(skb, info, peer,
-					      NETLINK_CB(cb->skb).portid,
-					      cb->nlh->nlmsg_seq,
-					      NLM_F_MULTI) < 0)
-				break;
+	peer_id = nla_get_u32(p_attrs[OVPN_A_PEER_ID]);
+	slot = nla_get_u8(attrs[OVPN_A_KEYCONF_SLOT]);
 
-			/* count peers being dumped during this invocation */
-			dumped++;
-		}
-		rcu_read_unlock();
+	peer = ovpn_peer_get_by_id(ovpn, peer_id);
+	if (!peer) {
+		NL_SET_ERR_MSG_FMT_MOD(info->extack,
+				       "no peer with id %u to delete key for",
+				       peer_id);
+		return -ENOENT;
 	}
 
-out:
-	netdev_put(dev, NULL);
+	ovpn_crypto_key_slot_delete(&peer->crypto, slot);
+	ovpn_peer_put(peer);
 
-	/* sum up peers dumped in this message, so that at the next invocation
-	 * we can continue from where we left
-	 */
-	cb->args[1] += dumped;
-	return skb->len;
+	return 0;
 }
 
-int ovpn_nl_del_peer_doit(struct sk_buff *skb, struct genl_info *info)
+int ovpn_nl_new_iroute_doit(struct sk_buff *skb, struct genl_info *info)
 {
-	struct nlattr *attrs[OVPN_A_PEER_MAX + 1];
+	struct nlattr *attrs[OVPN_A_IROUTE_MAX + 1];
 	struct ovpn_struct *ovpn = info->user_ptr[0];
 	struct ovpn_peer *peer;
+	struct in6_addr addr;
+	sa_family_t family;
+	u8 prefixlen;
 	u32 peer_id;
 	int ret;
 
-	if (GENL_REQ_ATTR_CHECK(info, OVPN_A_PEER))
+	if (GENL_REQ_ATTR_CHECK(info, OVPN_A_IROUTE))
 		return -EINVAL;
 
-	ret = nla_parse_nested(attrs, OVPN_A_PEER_MAX, info->attrs[OVPN_A_PEER],
-			       ovpn_peer_nl_policy, info->extack);
+	ret = ovpn_nl_parse_iroute(info, info->attrs[OVPN_A_IROUTE], attrs,
+				   &family, &addr, &prefixlen);
 	if (ret)
 		return ret;
 
-	if (NL_REQ_ATTR_CHECK(info->extack, info->attrs[OVPN_A_PEER], attrs,
-			      OVPN_A_PEER_ID))
+	if (NL_REQ_ATTR_CHECK(info->extack, info->attrs[OVPN_A_IROUTE], attrs,
+			      OVPN_A_IROUTE_PEER_ID))
 		return -EINVAL;
 
-	peer_id = nla_get_u32(attrs[OVPN_A_PEER_ID]);
-
+	peer_id = nla_get_u32(attrs[OVPN_A_IROUTE_PEER_ID]);
 	peer = ovpn_peer_get_by_id(ovpn, peer_id);
-	if (!peer)
+	if (!peer) {
+		NL_SET_ERR_MSG_FMT_MOD(info->extack,
+				       "no peer with id %u to route to",
+				       peer_id);
 		return -ENOENT;
+	}
 
-	netdev_dbg(ovpn->dev, "%s: peer id=%u\n", __func__, peer->id);
-	ret = ovpn_peer_del(peer, OVPN_DEL_PEER_REASON_USERSPACE);
+	ret = ovpn_iroute_add(peer, family, &addr, prefixlen);
+	if (ret == -EEXIST)
+		NL_SET_ERR_MSG_MOD(info->extack, "prefix already routed");
 	ovpn_peer_put(peer);
 
 	return ret;
 }
 
-static int ovpn_nl_get_key_dir(struct genl_info *info, struct nlattr *key,
-			       enum ovpn_cipher_alg cipher,
-			       struct ovpn_key_direction *dir)
+int ovpn_nl_del_iroute_doit(struct sk_buff *skb, struct genl_info *info)
 {
-	struct nlattr *attrs[OVPN_A_KEYDIR_MAX + 1];
+	struct nlattr *attrs[OVPN_A_IROUTE_MAX + 1];
+	struct ovpn_struct *ovpn = info->user_ptr[0];
+	struct in6_addr addr;
+	sa_family_t family;
+	u8 prefixlen;
 	int ret;
 
-	ret = nla_parse_nested(attrs, OVPN_A_KEYDIR_MAX, key,
-			       ovpn_keydir_nl_policy, info->extack);
+	if (GENL_REQ_ATTR_CHECK(info, OVPN_A_IROUTE))
+		return -EINVAL;
+
+	ret = ovpn_nl_parse_iroute(info, info->attrs[OVPN_A_IROUTE], attrs,
+				   &family, &addr, &prefixlen);
 	if (ret)
 		return ret;
 
-	switch (cipher) {
-	case OVPN_CIPHER_ALG_AES_GCM:
-	case OVPN_CIPHER_ALG_CHACHA20_POLY1305:
-		if (NL_REQ_ATTR_CHECK(info->extack, key, attrs,
-				      OVPN_A_KEYDIR_CIPHER_KEY) ||
-		    NL_REQ_ATTR_CHECK(info->extack, key, attrs,
-				      OVPN_A_KEYDIR_NONCE_TAIL))
-			return -EINVAL;
-
-		dir->cipher_key = nla_data(attrs[OVPN_A_KEYDIR_CIPHER_KEY]);
-		dir->cipher_key_size = nla_len(attrs[OVPN_A_KEYDIR_CIPHER_KEY]);
-
-		/* These algorithms require a 96bit nonce,
-		 * Construct it by combining 4-bytes packet id and
-		 * 8-bytes nonce-tail from userspace
-		 */
-		dir->nonce_tail = nla_data(attrs[OVPN_A_KEYDIR_NONCE_TAIL]);
-		dir->nonce_tail_size = nla_len(attrs[OVPN_A_KEYDIR_NONCE_TAIL]);
-		break;
-	default:
-		NL_SET_ERR_MSG_MOD(info->extack, "unsupported cipher");
-		return -EINVAL;
-	}
+	ret = ovpn_iroute_del(ovpn, family, &addr, prefixlen);
+	if (ret == -ENOENT)
+		NL_SET_ERR_MSG_MOD(info->extack, "prefix not routed");
 
-	return 0;
+	return ret;
 }
 
-int ovpn_nl_set_key_doit(struct sk_buff *skb, struct genl_info *info)
+/**
+ * ovpn_nl_mcast_doit - make a peer join or leave a multicast group
+ * @info: the NEW_MCAST or DEL_MCAST request
+ * @join: true if the peer should join the group
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+static int ovpn_nl_mcast_doit(struct genl_info *info, bool join)
 {
-	struct nlattr *p_attrs[OVPN_A_PEER_MAX + 1];
-	struct nlattr *attrs[OVPN_A_KEYCONF_MAX + 1];
+	struct nlattr *attrs[OVPN_A_MCAST_MAX + 1];
 	struct ovpn_struct *ovpn = info->user_ptr[0];
-	struct ovpn_peer_key_reset pkr;
 	struct ovpn_peer *peer;
+	struct in6_addr addr;
+	sa_family_t family;
 	u32 peer_id;
 	int ret;
 
-	if (GENL_REQ_ATTR_CHECK(info, OVPN_A_PEER))
+	if (ovpn->mode != OVPN_MODE_MP) {
+		NL_SET_ERR_MSG_MOD(info->extack,
+				   "multicast groups can only be used in MP mode");
+		return -EOPNOTSUPP;
+	}
+
+	if (GENL_REQ_ATTR_CHECK(info, OVPN_A_MCAST))
 		return -EINVAL;
 
-	ret = nla_parse_nested(p_attrs, OVPN_A_PEER_MAX,
-			       info->attrs[OVPN_A_PEER], ovpn_peer_nl_policy,
+	ret = nla_parse_nested(attrs, OVPN_A_MCAST_MAX,
+			       info->attrs[OVPN_A_MCAST], ovpn_mcast_nl_policy,
 			       info->extack);
 	if (ret)
 		return ret;
 
-	if (NL_REQ_ATTR_CHECK(info->extack, info->attrs[OVPN_A_PEER], p_attrs,
-			      OVPN_A_PEER_ID) ||
-	    NL_REQ_ATTR_CHECK(info->extack, info->attrs[OVPN_A_PEER], p_attrs,
-			      OVPN_A_PEER_KEYCONF))
+	if (NL_REQ_ATTR_CHECK(info->extack, info->attrs[OVPN_A_MCAST], attrs,
+			      OVPN_A_MCAST_PEER_ID))
 		return -EINVAL;
 
-	ret = nla_parse_nested(attrs, OVPN_A_KEYCONF_MAX,
-			       p_attrs[OVPN_A_PEER_KEYCONF],
-			       ovpn_keyconf_nl_policy, info->extack);
-	if (ret)
-		return ret;
-
-	if (NL_REQ_ATTR_CHECK(info->extack, p_attrs[OVPN_A_PEER_KEYCONF], attrs,
-			      OVPN_A_KEYCONF_SLOT) ||
-	    NL_REQ_ATTR_CHECK(info->extack, p_attrs[OVPN_A_PEER_KEYCONF], attrs,
-			      OVPN_A_KEYCONF_KEY_ID) ||
-	    NL_REQ_ATTR_CHECK(info->extack, p_attrs[OVPN_A_PEER_KEYCONF], attrs,
-			      OVPN_A_KEYCONF_CIPHER_ALG) ||
-	    NL_REQ_ATTR_CHECK(info->extack, p_attrs[OVPN_A_PEER_KEYCONF], attrs,
-			      OVPN_A_KEYCONF_ENCRYPT_DIR) ||
-	    NL_REQ_ATTR_CHECK(info->extack, p_attrs[OVPN_A_PEER_KEYCONF], attrs,
-			      OVPN_A_KEYCONF_DECRYPT_DIR))
+	if (!!attrs[OVPN_A_MCAST_IPV4] == !!attrs[OVPN_A_MCAST_IPV6]) {
+		NL_SET_ERR_MSG_MOD(info->extack,
+				   "exactly one of IPv4 or IPv6 group must be specified");
 		return -EINVAL;
+	}
 
-	peer_id = nla_get_u32(p_attrs[OVPN_A_PEER_ID]);
-	pkr.slot = nla_get_u8(attrs[OVPN_A_KEYCONF_SLOT]);
-	pkr.key.key_id = nla_get_u16(attrs[OVPN_A_KEYCONF_KEY_ID]);
-	pkr.key.cipher_alg = nla_get_u16(attrs[OVPN_A_KEYCONF_CIPHER_ALG]);
-
-	ret = ovpn_nl_get_key_dir(info, attrs[OVPN_A_KEYCONF_ENCRYPT_DIR],
-				  pkr.key.cipher_alg, &pkr.key.encrypt);
-	if (ret < 0)
-		return ret;
-
-	ret = ovpn_nl_get_key_dir(info, attrs[OVPN_A_KEYCONF_DECRYPT_DIR],
-				  pkr.key.cipher_alg, &pkr.key.decrypt);
-	if (ret < 0)
-		return ret;
+	/* IPv4 groups may also be broadcast addresses, which cannot be told
+	 * apart from unicast ones without knowing the subnet
+	 */
+	if (attrs[OVPN_A_MCAST_IPV4]) {
+		family = AF_INET;
+		memset(&addr, 0, sizeof(addr));
+		addr.s6_addr32[0] = nla_get_in_addr(attrs[OVPN_A_MCAST_IPV4]);
+	} else {
+		family = AF_INET6;
+		addr = nla_get_in6_addr(attrs[OVPN_A_MCAST_IPV6]);
+		if (!ipv6_addr_is_multicast(&addr)) {
+			NL_SET_ERR_MSG_ATTR(info->extack,
+					    attrs[OVPN_A_MCAST_IPV6],
+					    "not a multicast address");
+			return -EINVAL;
+		}
+	}
 
+	peer_id = nla_get_u32(attrs[OVPN_A_MCAST_PEER_ID]);
 	peer = ovpn_peer_get_by_id(ovpn, peer_id);
 	if (!peer) {
 		NL_SET_ERR_MSG_FMT_MOD(info->extack,
-				       "no peer with id %u to set key for",
-				       peer_id);
+				       "cannot find peer with id %u", peer_id);
 		return -ENOENT;
 	}
 
-	ret = ovpn_crypto_state_reset(&peer->crypto, &pkr);
-	if (ret < 0) {
-		NL_SET_ERR_MSG_FMT_MOD(info->extack,
-				       "cannot install new key for peer %u",
-				       peer_id);
+	if (join) {
+		ret = ovpn_mcast_add(peer, family, &addr);
+		if (ret == -EEXIST)
+			NL_SET_ERR_MSG_MOD(info->extack,
+					   "peer is already a member of the group");
+	} else {
+		ret = ovpn_mcast_del(peer, family, &addr);
+		if (ret == -ENOENT)
+			NL_SET_ERR_MSG_MOD(info->extack,
+					   "peer is not a member of the group");
+	}
+	ovpn_peer_put(peer);
+
+	return ret;
+}
+
+int ovpn_nl_new_mcast_doit(struct sk_buff *skb, struct genl_info *info)
+{
+	return ovpn_nl_mcast_doit(info, true);
+}
+
+int ovpn_nl_del_mcast_doit(struct sk_buff *skb, struct genl_info *info)
+{
+	return ovpn_nl_mcast_doit(info, false);
+}
+
+int ovpn_nl_get_top_peers_doit(struct sk_buff *skb, struct genl_info *info)
+{
+	struct ovpn_struct *ovpn = info->user_ptr[0];
+	bool tx = !!info->attrs[OVPN_A_TOP_TX];
+	unsigned int n = OVPN_TOPK_DEFAULT, i;
+	struct ovpn_stats_record *recs;
+	struct ovpn_topk_entry *top;
+	struct sk_buff *msg;
+	struct nlattr *attr;
+	void *hdr;
+	int ret;
+
+	if (!ovpn->topk) {
+		NL_SET_ERR_MSG_MOD(info->extack,
+				   "interface does not track its top talkers");
+		return -EOPNOTSUPP;
+	}
+
+	if (info->attrs[OVPN_A_TOP_N])
+		n = nla_get_u32(info->attrs[OVPN_A_TOP_N]);
+
+	top = kcalloc(n, sizeof(*top), GFP_KERNEL);
+	if (!top)
+		return -ENOMEM;
+
+	ret = ovpn_topk_fetch(ovpn, tx, top, n);
+	if (ret < 0)
 		goto out;
+	n = ret;
+
+	msg = genlmsg_new(nla_total_size(sizeof(u32)) +
+			  nla_total_size(n * sizeof(*recs)), GFP_KERNEL);
+	if (!msg) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	hdr = genlmsg_iput(msg, info);
+	if (!hdr) {
+		ret = -ENOBUFS;
+		goto err_free_msg;
+	}
+
+	if (nla_put_u32(msg, OVPN_A_IFINDEX, ovpn->dev->ifindex)) {
+		ret = -EMSGSIZE;
+		goto err_free_msg;
+	}
+
+	/* records only carry the link traffic of the ranked direction */
+	attr = nla_reserve(msg, OVPN_A_STATS_RECORDS, n * sizeof(*recs));
+	if (!attr) {
+		ret = -EMSGSIZE;
+		goto err_free_msg;
+	}
+
+	recs = nla_data(attr);
+	memset(recs, 0, n * sizeof(*recs));
+	for (i = 0; i < n; i++) {
+		recs[i].peer_id = top[i].peer_id;
+		if (tx) {
+			recs[i].link_tx_packets = top[i].packets;
+			recs[i].link_tx_bytes = top[i].bytes;
+		} else {
+			recs[i].link_rx_packets = top[i].packets;
+			recs[i].link_rx_bytes = top[i].bytes;
+		}
+	}
+
+	genlmsg_end(msg, hdr);
+	ret = genlmsg_reply(msg, info);
+	goto out;
+
+err_free_msg:
+	nlmsg_free(msg);
+out:
+	kfree(top);
+	return ret;
+}
+
+/**
+ * ovpn_nl_put_del_peer - append a DEL_PEER notification to a message
+ * @msg: the skb to append the notification to
+ * @peer: the peer being deleted
+ *
+ * Return: 0 on success or -EMSGSIZE if msg has no room left
+ */
+static int ovpn_nl_put_del_peer(struct sk_buff *msg, struct ovpn_peer *peer)
+{
+	struct nlattr *attr;
+	void *hdr;
+
+	hdr = genlmsg_put(msg, 0, 0, &ovpn_nl_family, 0, OVPN_CMD_DEL_PEER);
+	if (!hdr)
+		return -EMSGSIZE;
+
+	if (nla_put_u32(msg, OVPN_A_IFINDEX, peer->ovpn->dev->ifindex))
+		goto err_cancel_msg;
+
+	attr = nla_nest_start(msg, OVPN_A_PEER);
+	if (!attr)
+		goto err_cancel_msg;
+
+	if (nla_put_u8(msg, OVPN_A_PEER_DEL_REASON, peer->delete_reason))
+		goto err_cancel_msg;
+
+	if (nla_put_u32(msg, OVPN_A_PEER_ID, peer->id))
+		goto err_cancel_msg;
+
+	nla_nest_end(msg, attr);
+
+	genlmsg_end(msg, hdr);
+
+	return 0;
+
+err_cancel_msg:
+	genlmsg_cancel(msg, hdr);
+	return -EMSGSIZE;
+}
+
+int ovpn_nl_notify_del_peer(struct ovpn_peer *peer)
+{
+	struct sk_buff *msg;
+	int ret;
+
+	netdev_info(peer->ovpn->dev, "deleting peer with id %u, reason %d\n",
+		    peer->id, peer->delete_reason);
+
+	msg = nlmsg_new(100, GFP_ATOMIC);
+	if (!msg)
+		return -ENOMEM;
+
+	ret = ovpn_nl_put_del_peer(msg, peer);
+	if (ret < 0) {
+		nlmsg_free(msg);
+		return ret;
 	}
 
-	netdev_dbg(ovpn->dev, "%s: new key installed (id=%u) for peer %u\n",
-		   __func__, pkr.key.key_id, peer_id);
-out:
-	ovpn_peer_put(peer);
-	return ret;
+	genlmsg_multicast_netns(&ovpn_nl_family, dev_net(peer->ovpn->dev), msg,
+				0, OVPN_NLGRP_PEERS, GFP_ATOMIC);
+
+	return 0;
 }
 
-int ovpn_nl_swap_keys_doit(struct sk_buff *skb, struct genl_info *info)
+int ovpn_nl_notify_del_peers(struct ovpn_struct *ovpn, struct list_head *peers)
 {
-	struct ovpn_struct *ovpn = info->user_ptr[0];
-	struct nlattr *attrs[OVPN_A_PEER_MAX + 1];
+	struct sk_buff *msg = NULL;
 	struct ovpn_peer *peer;
-	u32 peer_id;
-	int ret;
 
-	if (GENL_REQ_ATTR_CHECK(info, OVPN_A_PEER))
-		return -EINVAL;
+	/* notifications are packed as consecutive messages in as few skbs as
+	 * possible, so that a burst of deletions results in a few datagrams
+	 * only. Peers left without notification on error are notified upon
+	 * release
+	 */
+	list_for_each_entry(peer, peers, expire_entry) {
+		netdev_info(ovpn->dev, "deleting peer with id %u, reason %d\n",
+			    peer->id, peer->delete_reason);
 
-	ret = nla_parse_nested(attrs, OVPN_A_PEER_MAX, info->attrs[OVPN_A_PEER],
-			       ovpn_peer_nl_policy, info->extack);
-	if (ret)
-		return ret;
+		if (msg && !ovpn_nl_put_del_peer(msg, peer)) {
+			peer->del_notified = true;
+			continue;
+		}
 
-	if (NL_REQ_ATTR_CHECK(info->extack, info->attrs[OVPN_A_PEER], attrs,
-			      OVPN_A_PEER_ID))
-		return -EINVAL;
+		/* current skb is full: send it and start a new one */
+		if (msg)
+			genlmsg_multicast_netns(&ovpn_nl_family,
+						dev_net(ovpn->dev), msg, 0,
+						OVPN_NLGRP_PEERS, GFP_KERNEL);
 
-	peer_id = nla_get_u32(attrs[OVPN_A_PEER_ID]);
+		msg = nlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+		if (!msg)
+			return -ENOMEM;
 
-	peer = ovpn_peer_get_by_id(ovpn, peer_id);
-	if (!peer) {
-		NL_SET_ERR_MSG_FMT_MOD(info->extack,
-				       "no peer with id %u to swap keys for",
-				       peer_id);
-		return -ENOENT;
+		if (ovpn_nl_put_del_peer(msg, peer) < 0) {
+			nlmsg_free(msg);
+			return -EMSGSIZE;
+		}
+		peer->del_notified = true;
 	}
 
-	ovpn_crypto_key_slots_swap(&peer->crypto);
-	ovpn_peer_put(peer);
+	if (msg)
+		genlmsg_multicast_netns(&ovpn_nl_family, dev_net(ovpn->dev),
+					msg, 0, OVPN_NLGRP_PEERS, GFP_KERNEL);
 
 	return 0;
 }
 
-int ovpn_nl_del_key_doit(struct sk_buff *skb, struct genl_info *info)
+/* the notification carries no peer ID: the peers of the interface are all
+ * gone
+ */
+int ovpn_nl_notify_del_all_peers(struct ovpn_struct *ovpn,
+				 enum ovpn_del_peer_reason reason)
 {
-	struct nlattr *p_attrs[OVPN_A_PEER_MAX + 1];
-	struct nlattr *attrs[OVPN_A_KEYCONF_MAX + 1];
-	struct ovpn_struct *ovpn = info->user_ptr[0];
-	enum ovpn_key_slot slot;
-	struct ovpn_peer *peer;
-	u32 peer_id;
-	int ret;
+	struct nlattr *attr;
+	struct sk_buff *msg;
+	void *hdr;
 
-	if (GENL_REQ_ATTR_CHECK(info, OVPN_A_PEER))
-		return -EINVAL;
+	netdev_info(ovpn->dev, "deleting all peers, reason %d\n", reason);
 
-	ret = nla_parse_nested(p_attrs, OVPN_A_PEER_MAX,
-			       info->attrs[OVPN_A_PEER], ovpn_peer_nl_policy,
-			       info->extack);
-	if (ret)
-		return ret;
+	msg = nlmsg_new(100, GFP_KERNEL);
+	if (!msg)
+		return -ENOMEM;
 
-	if (NL_REQ_ATTR_CHECK(info->extack, info->attrs[OVPN_A_PEER], p_attrs,
-			      OVPN_A_PEER_ID) ||
-	    NL_REQ_ATTR_CHECK(info->extack, info->attrs[OVPN_A_PEER], p_attrs,
-			      OVPN_A_PEER_KEYCONF))
-		return -EINVAL;
+	hdr = genlmsg_put(msg, 0, 0, &ovpn_nl_family, 0, OVPN_CMD_DEL_PEER);
+	if (!hdr)
+		goto err_free_msg;
 
-	ret = nla_parse_nested(attrs, OVPN_A_KEYCONF_MAX,
-			       p_attrs[OVPN_A_PEER_KEYCONF],
-			       ovpn_keyconf_nl_policy, info->extack);
-	if (ret)
-		return ret;
+	if (nla_put_u32(msg, OVPN_A_IFINDEX, ovpn->dev->ifindex))
+		goto err_cancel_msg;
 
-	if (NL_REQ_ATTR_CHECK(info->extack, p_attrs[OVPN_A_PEER_KEYCONF], attrs,
-			      OVPN_A_KEYCONF_SLOT))
-		return -EINVAL;
+	attr = nla_nest_start(msg, OVPN_A_PEER);
+	if (!attr)
+		goto err_cancel_msg;
 
-	peer_id = nla_get_u32(p_attrs[OVPN_A_PEER_ID]);
-	slot = nla_get_u8(attrs[OVPN_A_KEYCONF_SLOT]);
+	if (nla_put_u8(msg, OVPN_A_PEER_DEL_REASON, reason))
+		goto err_cancel_msg;
 
-	peer = ovpn_peer_get_by_id(ovpn, peer_id);
-	if (!peer) {
-		NL_SET_ERR_MSG_FMT_MOD(info->extack,
-				       "no peer with id %u to delete key for",
-				       peer_id);
-		return -ENOENT;
-	}
+	nla_nest_end(msg, attr);
+	genlmsg_end(msg, hdr);
 
-	ovpn_crypto_key_slot_delete(&peer->crypto, slot);
-	ovpn_peer_put(peer);
+	genlmsg_multicast_netns(&ovpn_nl_family, dev_net(ovpn->dev), msg, 0,
+				OVPN_NLGRP_PEERS, GFP_KERNEL);
 
 	return 0;
+
+err_cancel_msg:
+	genlmsg_cancel(msg, hdr);
+err_free_msg:
+	nlmsg_free(msg);
+	return -EMSGSIZE;
 }
 
-int ovpn_nl_notify_del_peer(struct ovpn_peer *peer)
+int ovpn_nl_notify_swap_keys(struct ovpn_peer *peer)
 {
+	return ovpn_nl_notify_rekey(peer, -1, OVPN_REKEY_REASON_PKTID);
+}
+
+int ovpn_nl_notify_rekey(struct ovpn_peer *peer, int key_id,
+			 enum ovpn_rekey_reason reason)
+{
+	static const char * const why[] = {
+		[OVPN_REKEY_REASON_PKTID] = "running out of packet IDs",
+		[OVPN_REKEY_REASON_SOFT_LIMIT] = "soft traffic limit reached",
+		[OVPN_REKEY_REASON_HARD_LIMIT] = "hard traffic limit exceeded",
+	};
 	struct sk_buff *msg;
-	struct nlattr *attr;
 	int ret = -EMSGSIZE;
 	void *hdr;
 
-	netdev_info(peer->ovpn->dev, "deleting peer with id %u, reason %d\n",
-		    peer->id, peer->delete_reason);
+	if (key_id < 0)
+		netdev_info(peer->ovpn->dev, "peer with id %u must rekey - primary key %s.\n",
+			    peer->id, why[reason]);
+	else
+		netdev_info(peer->ovpn->dev, "peer with id %u must rekey - key %d %s.\n",
+			    peer->id, key_id, why[reason]);
 
 	msg = nlmsg_new(100, GFP_ATOMIC);
 	if (!msg)
 		return -ENOMEM;
 
-	hdr = genlmsg_put(msg, 0, 0, &ovpn_nl_family, 0, OVPN_CMD_DEL_PEER);
+	hdr = genlmsg_put(msg, 0, 0, &ovpn_nl_family, 0, OVPN_CMD_SWAP_KEYS);
 	if (!hdr) {
 		ret = -ENOBUFS;
 		goto err_free_msg;
@@ -869,18 +3328,13 @@ int ovpn_nl_notify_del_peer(struct ovpn_peer *peer)
 	if (nla_put_u32(msg, OVPN_A_IFINDEX, peer->ovpn->dev->ifindex))
 		goto err_cancel_msg;
 
-	attr = nla_nest_start(msg, OVPN_A_PEER);
-	if (!attr)
-		goto err_cancel_msg;
-
-	if (nla_put_u8(msg, OVPN_A_PEER_DEL_REASON, peer->delete_reason))
+	if (nla_put_u32(msg, OVPN_A_PEER_ID, peer->id) ||
+	    nla_put_u32(msg, OVPN_A_REKEY_REASON, reason))
 		goto err_cancel_msg;
 
-	if (nla_put_u32(msg, OVPN_A_PEER_ID, peer->id))
+	if (key_id >= 0 && nla_put_u32(msg, OVPN_A_REKEY_KEY_ID, key_id))
 		goto err_cancel_msg;
 
-	nla_nest_end(msg, attr);
-
 	genlmsg_end(msg, hdr);
 
 	genlmsg_multicast_netns(&ovpn_nl_family, dev_net(peer->ovpn->dev), msg,
@@ -895,45 +3349,245 @@ int ovpn_nl_notify_del_peer(struct ovpn_peer *peer)
 	return ret;
 }
 
-int ovpn_nl_notify_swap_keys(struct ovpn_peer *peer)
+int ovpn_nl_notify_link_change(struct ovpn_struct *ovpn,
+			       const struct net_device *dev, bool up,
+			       unsigned int excluded)
 {
 	struct sk_buff *msg;
 	int ret = -EMSGSIZE;
 	void *hdr;
 
-	netdev_info(peer->ovpn->dev, "peer with id %u must rekey - primary key unusable.\n",
-		    peer->id);
-
-	msg = nlmsg_new(100, GFP_ATOMIC);
+	msg = nlmsg_new(100, GFP_KERNEL);
 	if (!msg)
 		return -ENOMEM;
 
-	hdr = genlmsg_put(msg, 0, 0, &ovpn_nl_family, 0, OVPN_CMD_SWAP_KEYS);
+	hdr = genlmsg_put(msg, 0, 0, &ovpn_nl_family, 0, OVPN_CMD_LINK_CHANGE);
 	if (!hdr) {
 		ret = -ENOBUFS;
 		goto err_free_msg;
 	}
 
+	if (nla_put_u32(msg, OVPN_A_IFINDEX, ovpn->dev->ifindex) ||
+	    nla_put_u32(msg, OVPN_A_LINK_IFINDEX, dev->ifindex) ||
+	    nla_put_u32(msg, OVPN_A_LINK_PATHS_EXCLUDED, excluded))
+		goto err_cancel_msg;
+
+	if (up && nla_put_flag(msg, OVPN_A_LINK_UP))
+		goto err_cancel_msg;
+
+	genlmsg_end(msg, hdr);
+
+	genlmsg_multicast_netns(&ovpn_nl_family, dev_net(ovpn->dev), msg, 0,
+				OVPN_NLGRP_PEERS, GFP_KERNEL);
+
+	return 0;
+
+err_cancel_msg:
+	genlmsg_cancel(msg, hdr);
+err_free_msg:
+	nlmsg_free(msg);
+	return ret;
+}
+
+int ovpn_nl_put_ctrl_packet(struct sk_buff *msg, const struct ovpn_peer *peer,
+			    const struct sk_buff *skb, unsigned int offset)
+{
+	unsigned int len = skb->len - offset;
+	struct nlattr *attr;
+	void *hdr;
+
+	hdr = genlmsg_put(msg, 0, 0, &ovpn_nl_family, 0, OVPN_CMD_CTRL_PACKET);
+	if (!hdr)
+		return -EMSGSIZE;
+
 	if (nla_put_u32(msg, OVPN_A_IFINDEX, peer->ovpn->dev->ifindex))
 		goto err_cancel_msg;
 
+	attr = nla_nest_start(msg, OVPN_A_PEER);
+	if (!attr)
+		goto err_cancel_msg;
+
 	if (nla_put_u32(msg, OVPN_A_PEER_ID, peer->id))
 		goto err_cancel_msg;
 
+	nla_nest_end(msg, attr);
+
+	attr = nla_reserve(msg, OVPN_A_CTRL_PACKET, len);
+	if (!attr)
+		goto err_cancel_msg;
+
+	if (WARN_ON_ONCE(skb_copy_bits(skb, offset, nla_data(attr), len)))
+		goto err_cancel_msg;
+
 	genlmsg_end(msg, hdr);
 
-	genlmsg_multicast_netns(&ovpn_nl_family, dev_net(peer->ovpn->dev), msg,
-				0, OVPN_NLGRP_PEERS, GFP_ATOMIC);
+	return 0;
+
+err_cancel_msg:
+	genlmsg_cancel(msg, hdr);
+	return -EMSGSIZE;
+}
+
+void ovpn_nl_notify_ctrl(struct ovpn_struct *ovpn, struct sk_buff *msg)
+{
+	genlmsg_multicast_netns(&ovpn_nl_family, dev_net(ovpn->dev), msg, 0,
+				OVPN_NLGRP_CTRL, GFP_KERNEL);
+}
+
+int ovpn_nl_put_float(struct sk_buff *msg, const struct ovpn_peer *peer)
+{
+	struct nlattr *attr;
+	void *hdr;
+
+	hdr = genlmsg_put(msg, 0, 0, &ovpn_nl_family, 0, OVPN_CMD_PEER_FLOAT);
+	if (!hdr)
+		return -EMSGSIZE;
+
+	if (nla_put_u32(msg, OVPN_A_IFINDEX, peer->ovpn->dev->ifindex))
+		goto err_cancel_msg;
+
+	attr = nla_nest_start(msg, OVPN_A_PEER);
+	if (!attr)
+		goto err_cancel_msg;
+
+	if (nla_put_u32(msg, OVPN_A_PEER_ID, peer->id) ||
+	    ovpn_nl_put_peer_bind(msg, peer))
+		goto err_cancel_msg;
+
+	nla_nest_end(msg, attr);
+	genlmsg_end(msg, hdr);
 
 	return 0;
 
 err_cancel_msg:
 	genlmsg_cancel(msg, hdr);
+	return -EMSGSIZE;
+}
+
+bool ovpn_nl_floats_has_listeners(struct ovpn_struct *ovpn)
+{
+	return genl_has_listeners(&ovpn_nl_family, dev_net(ovpn->dev),
+				  OVPN_NLGRP_FLOATS);
+}
+
+void ovpn_nl_notify_floats(struct ovpn_struct *ovpn, struct sk_buff *msg)
+{
+	genlmsg_multicast_netns(&ovpn_nl_family, dev_net(ovpn->dev), msg, 0,
+				OVPN_NLGRP_FLOATS, GFP_KERNEL);
+}
+
+bool ovpn_nl_stats_has_listeners(struct ovpn_struct *ovpn)
+{
+	return genl_has_listeners(&ovpn_nl_family, dev_net(ovpn->dev),
+				  OVPN_NLGRP_STATS);
+}
+
+int ovpn_nl_notify_stats(struct ovpn_struct *ovpn, u32 gen,
+			 const struct ovpn_stats_record *recs, unsigned int n)
+{
+	size_t len = n * sizeof(*recs);
+	u64 mem_used, mem_peak;
+	struct sk_buff *msg;
+	bool mem;
+	void *hdr;
+	int ret;
+
+	mem = ovpn_mem_usage(ovpn, &mem_used, &mem_peak);
+
+	msg = genlmsg_new(nla_total_size(sizeof(u32)) * 2 +
+			  nla_total_size(len) +
+			  (mem ? nla_total_size(sizeof(u64)) * 2 : 0),
+			  GFP_KERNEL);
+	if (!msg)
+		return -ENOMEM;
+
+	hdr = genlmsg_put(msg, 0, 0, &ovpn_nl_family, 0, OVPN_CMD_PEER_STATS);
+	if (!hdr) {
+		ret = -ENOBUFS;
+		goto err_free_msg;
+	}
+
+	if (nla_put_u32(msg, OVPN_A_IFINDEX, ovpn->dev->ifindex) ||
+	    nla_put_u32(msg, OVPN_A_STATS_GEN, gen) ||
+	    nla_put(msg, OVPN_A_STATS_RECORDS, len, recs)) {
+		ret = -EMSGSIZE;
+		goto err_free_msg;
+	}
+
+	/* how close the interface gets to its memory budget */
+	if (mem && (nla_put_uint(msg, OVPN_A_MEM_USED, mem_used) ||
+		    nla_put_uint(msg, OVPN_A_MEM_PEAK, mem_peak))) {
+		ret = -EMSGSIZE;
+		goto err_free_msg;
+	}
+
+	genlmsg_end(msg, hdr);
+
+	return genlmsg_multicast_netns(&ovpn_nl_family, dev_net(ovpn->dev),
+				       msg, 0, OVPN_NLGRP_STATS, GFP_KERNEL);
+
 err_free_msg:
 	nlmsg_free(msg);
 	return ret;
 }
 
+int ovpn_nl_put_sample(struct sk_buff *msg, const struct ovpn_peer *peer,
+		       const struct sk_buff *skb, u8 key_id, bool tx)
+{
+	unsigned int len = min_t(unsigned int, skb->len, OVPN_SAMPLE_HEADER);
+	struct nlattr *attr;
+	void *hdr;
+
+	hdr = genlmsg_put(msg, 0, 0, &ovpn_nl_family, 0,
+			  OVPN_CMD_PACKET_SAMPLE);
+	if (!hdr)
+		return -EMSGSIZE;
+
+	if (nla_put_u32(msg, OVPN_A_IFINDEX, peer->ovpn->dev->ifindex))
+		goto err_cancel_msg;
+
+	attr = nla_nest_start(msg, OVPN_A_PEER);
+	if (!attr)
+		goto err_cancel_msg;
+
+	if (nla_put_u32(msg, OVPN_A_PEER_ID, peer->id))
+		goto err_cancel_msg;
+
+	nla_nest_end(msg, attr);
+
+	if (nla_put_u32(msg, OVPN_A_SAMPLE_KEY_ID, key_id) ||
+	    (tx && nla_put_flag(msg, OVPN_A_SAMPLE_TX)) ||
+	    nla_put_u32(msg, OVPN_A_SAMPLE_LEN, skb->len))
+		goto err_cancel_msg;
+
+	attr = nla_reserve(msg, OVPN_A_SAMPLE_HEADER, len);
+	if (!attr)
+		goto err_cancel_msg;
+
+	if (WARN_ON_ONCE(skb_copy_bits(skb, 0, nla_data(attr), len)))
+		goto err_cancel_msg;
+
+	genlmsg_end(msg, hdr);
+
+	return 0;
+
+err_cancel_msg:
+	genlmsg_cancel(msg, hdr);
+	return -EMSGSIZE;
+}
+
+bool ovpn_nl_samples_has_listeners(struct ovpn_struct *ovpn)
+{
+	return genl_has_listeners(&ovpn_nl_family, dev_net(ovpn->dev),
+				  OVPN_NLGRP_SAMPLES);
+}
+
+void ovpn_nl_notify_samples(struct ovpn_struct *ovpn, struct sk_buff *msg)
+{
+	genlmsg_multicast_netns(&ovpn_nl_family, dev_net(ovpn->dev), msg, 0,
+				OVPN_NLGRP_SAMPLES, GFP_KERNEL);
+}
+
 /**
  * ovpn_nl_register - perform any needed registration in the NL subsustem
  *
@@ -20,6 +20,25 @@ void ovpn_nl_unregister(void);
  */
 int ovpn_nl_notify_del_peer(struct ovpn_peer *peer);
 
+/**
+ * ovpn_nl_notify_del_peers - notify userspace about a batch of deleted peers
+ * @ovpn: the instance the peers belong to
+ * @peers: list of deleted peers, linked by expire_entry
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_nl_notify_del_peers(struct ovpn_struct *ovpn, struct list_head *peers);
+
+/**
+ * ovpn_nl_notify_del_all_peers - notify userspace that all peers are deleted
+ * @ovpn: the instance the peers belonged to
+ * @reason: why the peers were deleted
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_nl_notify_del_all_peers(struct ovpn_struct *ovpn,
+				 enum ovpn_del_peer_reason reason);
+
 /**
  * ovpn_nl_notify_swap_keys - notify userspace peer's key must be renewed
  * @peer: the peer whose key needs to be renewed
@@ -28,4 +47,122 @@ int ovpn_nl_notify_del_peer(struct ovpn_peer *peer);
  */
 int ovpn_nl_notify_swap_keys(struct ovpn_peer *peer);
 
+/**
+ * ovpn_nl_notify_rekey - notify userspace a key of a peer must be renewed
+ * @peer: the peer whose key needs to be renewed
+ * @key_id: the ID of the key, or -1 for the primary key
+ * @reason: why the key needs to be renewed
+ *
+ * Userspace gets the same notification as with ovpn_nl_notify_swap_keys(),
+ * carrying the reason and the key ID on top.
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_nl_notify_rekey(struct ovpn_peer *peer, int key_id,
+			 enum ovpn_rekey_reason reason);
+
+/**
+ * ovpn_nl_notify_link_change - notify userspace a lower device changed state
+ * @ovpn: the instance whose peers were updated
+ * @dev: the lower device
+ * @up: whether @dev can carry packets now
+ * @excluded: number of paths of the peers that lost their route
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_nl_notify_link_change(struct ovpn_struct *ovpn,
+			       const struct net_device *dev, bool up,
+			       unsigned int excluded);
+
+/**
+ * ovpn_nl_put_ctrl_packet - append a control packet to a message
+ * @msg: the skb to append the packet to
+ * @peer: the peer the packet was received from
+ * @skb: the packet
+ * @offset: where the control packet starts in @skb
+ *
+ * Return: 0 on success or -EMSGSIZE if msg has no room left
+ */
+int ovpn_nl_put_ctrl_packet(struct sk_buff *msg, const struct ovpn_peer *peer,
+			    const struct sk_buff *skb, unsigned int offset);
+
+/**
+ * ovpn_nl_notify_ctrl - deliver a batch of control packets to userspace
+ * @ovpn: the instance the packets were received on
+ * @msg: the message carrying the packets, consumed
+ */
+void ovpn_nl_notify_ctrl(struct ovpn_struct *ovpn, struct sk_buff *msg);
+
+/**
+ * ovpn_nl_put_float - append the new endpoint of a floated peer to a message
+ * @msg: the skb to append the endpoint to
+ * @peer: the peer that floated
+ *
+ * Return: 0 on success or -EMSGSIZE if msg has no room left
+ */
+int ovpn_nl_put_float(struct sk_buff *msg, const struct ovpn_peer *peer);
+
+/**
+ * ovpn_nl_floats_has_listeners - check if anybody listens to peer floats
+ * @ovpn: the instance the floats would be reported for
+ *
+ * Return: true if the OVPN_NLGRP_FLOATS multicast group has listeners
+ */
+bool ovpn_nl_floats_has_listeners(struct ovpn_struct *ovpn);
+
+/**
+ * ovpn_nl_notify_floats - deliver a batch of peer floats to userspace
+ * @ovpn: the instance the peers belong to
+ * @msg: the message carrying the floats, consumed
+ */
+void ovpn_nl_notify_floats(struct ovpn_struct *ovpn, struct sk_buff *msg);
+
+/**
+ * ovpn_nl_stats_has_listeners - check if anybody listens to stats records
+ * @ovpn: the instance the records would refer to
+ *
+ * Return: true if the OVPN_NLGRP_STATS multicast group has listeners
+ */
+bool ovpn_nl_stats_has_listeners(struct ovpn_struct *ovpn);
+
+/**
+ * ovpn_nl_notify_stats - multicast a batch of peer stats records
+ * @ovpn: the instance the records refer to
+ * @gen: the stats generation opened when collecting the records
+ * @recs: the records
+ * @n: the number of records
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_nl_notify_stats(struct ovpn_struct *ovpn, u32 gen,
+			 const struct ovpn_stats_record *recs, unsigned int n);
+
+/**
+ * ovpn_nl_put_sample - append the header of a sampled packet to a message
+ * @msg: the skb to append the sample to
+ * @peer: the peer the packet is sent to or received from
+ * @skb: the sampled plaintext packet
+ * @key_id: the key the packet is encrypted or was decrypted with
+ * @tx: whether the packet is sent rather than received
+ *
+ * Return: 0 on success or -EMSGSIZE if msg has no room left
+ */
+int ovpn_nl_put_sample(struct sk_buff *msg, const struct ovpn_peer *peer,
+		       const struct sk_buff *skb, u8 key_id, bool tx);
+
+/**
+ * ovpn_nl_samples_has_listeners - check if anybody listens to packet samples
+ * @ovpn: the instance the samples would be taken on
+ *
+ * Return: true if the OVPN_NLGRP_SAMPLES multicast group has listeners
+ */
+bool ovpn_nl_samples_has_listeners(struct ovpn_struct *ovpn);
+
+/**
+ * ovpn_nl_notify_samples - deliver a batch of packet samples to userspace
+ * @ovpn: the instance the samples were taken on
+ * @msg: the message carrying the samples, consumed
+ */
+void ovpn_nl_notify_samples(struct ovpn_struct *ovpn, struct sk_buff *msg);
+
 #endif /* _NET_OVPN_NETLINK_H_ */
@@ -10,20 +10,80 @@
 #ifndef _NET_OVPN_OVPNSTRUCT_H_
 #define _NET_OVPN_OVPNSTRUCT_H_
 
-#include <net/gro_cells.h>
+#include <linux/hashtable.h>
+#include <linux/llist.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
 #include <uapi/linux/ovpn.h>
 
+struct bpf_prog;
+struct ovpn_aead_tfm_pool;
+struct ovpn_ctrl;
+struct ovpn_monitor;
+struct padata_instance;
+struct padata_shell;
+struct ovpn_rx_load;
+struct ovpn_iroute;
+struct ovpn_mem;
+struct ovpn_napi;
+struct ovpn_peer_dst_cache;
+struct ovpn_peer_miss_cache;
+struct ovpn_udp_tx_batch;
+struct page_pool;
+struct ovpn_route_table;
+struct ovpn_sampler;
+struct ovpn_sched;
+struct ovpn_topk;
+struct ovpn_worker;
+
+/* default number of buckets in each peer table (MultiPeer mode only) */
+#define OVPN_PEER_TABLE_SIZE 4096
+/* default number of buckets of compact interfaces, hosting a few dozens of
+ * peers
+ */
+#define OVPN_PEER_TABLE_SIZE_COMPACT 64
+
+/* buckets of the table of multicast memberships, as a power of 2 */
+#define OVPN_MCAST_HASH_BITS 8
+
 /**
  * struct ovpn_peer_collection - container of peers for MultiPeer mode
- * @by_id: table of peers index by ID
+ * @by_id: array of peers indexed by ID
  * @by_transp_addr: table of peers indexed by transport address
- * @by_vpn_addr: table of peers indexed by VPN IP address
- * @lock: protects writes to peers tables
+ * @by_vpn_addr4: table of peers indexed by VPN IPv4 address
+ * @by_vpn_addr6: table of peers indexed by VPN IPv6 address
+ * @size: number of buckets in each hashtable (power of 2)
+ * @genid: bumped whenever a VPN address or a routed prefix is added or
+ *	   removed
+ * @misses: per-CPU peer IDs recently received data for but not found
+ * @dsts: per-CPU peers recently found for inner destinations
+ * @iroutes4: root of the trie of IPv4 prefixes routed to peers
+ * @iroutes6: root of the trie of IPv6 prefixes routed to peers
+ * @mcast: multicast memberships of the peers, hashed by group
+ * @transp_locks: locks protecting writes to by_transp_addr, one per shard of
+ *		  buckets
+ * @transp_locks_mask: mask selecting the transport lock of a bucket
+ * @lock: protects writes to peers tables, except by_transp_addr
+ *
+ * Adding and removing peers takes @lock and then the transport lock of the
+ * bucket involved. Floating peers are moved between buckets by taking the
+ * transport locks only, so that they do not wait for peers being added or
+ * removed elsewhere in the tables.
  */
 struct ovpn_peer_collection {
-	DECLARE_HASHTABLE(by_id, 12);
-	DECLARE_HASHTABLE(by_transp_addr, 12);
-	DECLARE_HASHTABLE(by_vpn_addr, 12);
+	struct xarray by_id;
+	struct hlist_head *by_transp_addr;
+	struct hlist_head *by_vpn_addr4;
+	struct hlist_head *by_vpn_addr6;
+	unsigned int size;
+	u32 genid;
+	struct ovpn_peer_miss_cache __percpu *misses;
+	struct ovpn_peer_dst_cache __percpu *dsts;
+	struct ovpn_iroute __rcu *iroutes4;
+	struct ovpn_iroute __rcu *iroutes6;
+	DECLARE_HASHTABLE(mcast, OVPN_MCAST_HASH_BITS);
+	spinlock_t *transp_locks;
+	unsigned int transp_locks_mask;
 	spinlock_t lock; /* protects writes to peers tables */
 };
 
@@ -33,10 +93,66 @@ struct ovpn_peer_collection {
  * @registered: whether dev is still registered with netdev or not
  * @mode: device operation mode (i.e. p2p, mp, ..)
  * @lock: protect this object
- * @peers: data structures holding multi-peer references
+ * @peers: data structures holding multi-peer references (the empty tables
+ *	   shared by all instances until the first peer is added)
+ * @table_size: number of buckets in each peer table (MultiPeer mode only)
  * @peer: in P2P mode, this is the only remote peer
+ * @tcp_peers: number of peers of the instance using TCP
  * @dev_list: entry for the module wide device list
- * @gro_cells: pointer to the Generic Receive Offload cell
+ * @napi: per-CPU RX contexts delivering decrypted packets to GRO
+ * @stats: per-CPU interface-wide datapath counters
+ * @tx_batch: per-CPU UDP packets encrypted by ndo_start_xmit, waiting for the
+ *	      stack to stop passing packets down
+ * @tx_pending: per-CPU packets passed down by the stack, waiting to be
+ *		encrypted together once it stops doing so
+ * @keepalive_work: periodic check of the keepalive state of all peers
+ * @stats_gen: generation of peer stats, bumped by every peer dump
+ * @float_list: peers waiting to be rehashed after floating (MP only)
+ * @float_work: rehashes floated peers in batch (MP only)
+ * @float_notify_list: peers whose float was not reported to userspace yet
+ * @float_notify_work: reports the floats of a time window in batch
+ * @routes: route cache shared by all peers (NULL if peers own their cache)
+ * @rx_pools: per-CPU page pools RX packets are decrypted out of place into
+ * @xdp_prog: XDP program run on decrypted packets (native mode only)
+ * @compact_keys: AES-GCM keys are used via the library instead of transforms
+ * @lib_max_len: largest linear packet AES-GCM keys with transforms handle via
+ *		 the library (0 if disabled)
+ * @latency_hist: peers keep latency histograms
+ * @cputime_acct: peers account for the CPU time spent on their crypto
+ * @fair_queue: packets to send are scheduled fairly among peers (MP only)
+ * @sched: per-peer fair queuing of the packets to send (NULL if disabled)
+ * @inherit_dsfield: outer headers inherit DSCP and ECN of the tunneled packets
+ * @pmtu_disc: packets exceeding the path MTU of their peer are bounced back
+ * @client_to_client: packets between peers are forwarded right after
+ *		      decryption, bypassing the network stack (MP only)
+ * @threaded: packets are encrypted and decrypted by per-CPU kthreads
+ * @workers: the per-CPU crypto kthreads (NULL unless threaded)
+ * @compact: the memory footprint is kept small, for embedded devices
+ * @shared_socket: the UDP sockets of the instance may be shared with other
+ *		   instances of the netns, which demultiplex by peer ID
+ * @shared_napi: @napi is the pool of RX contexts shared by the instances of
+ *		 the netns created with a shared pool
+ * @direct_xmit: UDP packets are queued to the lower device with the link
+ *		 layer header cached by their binding, bypassing netfilter
+ *		 and the neighbour output
+ * @udp_zero_csum: IPv4 UDP packets are sent with no checksum
+ * @udp6_zero_csum: IPv6 UDP packets are sent and accepted with no checksum
+ * @ctrl: batches of control packets pending delivery over netlink (NULL if
+ *	  control packets are left to the transport sockets)
+ * @monitor: periodic multicast of the stats of active peers (NULL if
+ *	     disabled)
+ * @topk: per-CPU sketches of the heaviest peers (NULL if disabled)
+ * @sampler: sampled export of the packet headers over netlink (NULL if
+ *	     disabled)
+ * @tfm_pool: AEAD transforms of released keys, reused by new keys
+ * @padata: engine encrypting and decrypting packets in parallel (NULL if
+ *	    disabled)
+ * @padata_rx: ordering domain of the packets decrypted in parallel
+ * @padata_tx: ordering domain of the packets encrypted in parallel
+ * @rx_load: per-CPU load deciding whether received packets are decrypted in
+ *	     parallel (NULL unless parallel RX is adaptive)
+ * @mem: memory budget of the packets queued by the interface (NULL if
+ *	 unlimited)
  */
 struct ovpn_struct {
 	struct net_device *dev;
@@ -44,9 +160,50 @@ struct ovpn_struct {
 	enum ovpn_mode mode;
 	spinlock_t lock; /* protect writing to the ovpn_struct object */
 	struct ovpn_peer_collection *peers;
+	unsigned int table_size;
 	struct ovpn_peer __rcu *peer;
+	atomic_t tcp_peers;
 	struct list_head dev_list;
-	struct gro_cells gro_cells;
+	struct ovpn_napi *napi;
+	struct ovpn_dev_stats __percpu *stats;
+	struct ovpn_udp_tx_batch __percpu *tx_batch;
+	struct sk_buff_head __percpu *tx_pending;
+	struct delayed_work keepalive_work;
+	atomic_t stats_gen;
+	struct llist_head float_list;
+	struct work_struct float_work;
+	struct llist_head float_notify_list;
+	struct delayed_work float_notify_work;
+	struct ovpn_route_table *routes;
+	struct page_pool * __percpu *rx_pools;
+	struct bpf_prog __rcu *xdp_prog;
+	bool compact_keys;
+	unsigned int lib_max_len;
+	bool latency_hist;
+	bool cputime_acct;
+	bool fair_queue;
+	struct ovpn_sched *sched;
+	bool inherit_dsfield;
+	bool pmtu_disc;
+	bool client_to_client;
+	bool threaded;
+	struct ovpn_worker __percpu *workers;
+	bool compact;
+	bool shared_socket;
+	bool shared_napi;
+	bool direct_xmit;
+	bool udp_zero_csum;
+	bool udp6_zero_csum;
+	struct ovpn_ctrl *ctrl;
+	struct ovpn_monitor *monitor;
+	struct ovpn_topk __percpu *topk;
+	struct ovpn_sampler *sampler;
+	struct ovpn_aead_tfm_pool *tfm_pool;
+	struct padata_instance *padata;
+	struct padata_shell *padata_rx;
+	struct padata_shell *padata_tx;
+	struct ovpn_rx_load __percpu *rx_load;
+	struct ovpn_mem *mem;
 };
 
 #endif /* _NET_OVPN_OVPNSTRUCT_H_ */
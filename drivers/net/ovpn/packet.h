@@ -29,6 +29,12 @@
  */
 #define NONCE_WIRE_SIZE (NONCE_SIZE - sizeof(struct ovpn_nonce_tail))
 
+/* size of the packet ID sent over the wire by keys using 64bit packet IDs.
+ * Their IV is made of the packet ID followed by the first 4 bytes of the
+ * nonce tail
+ */
+#define NONCE_WIRE_SIZE_64 8
+
 /* Last 8 bytes of AEAD nonce
  * Provided by userspace and usually derived from
  * key material generated during TLS handshake
@@ -0,0 +1,346 @@
+// SPDX-License-Identifier: GPL-2.0
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include <linux/interrupt.h>
+#include <linux/netdevice.h>
+#include <linux/padata.h>
+#include <linux/sched/clock.h>
+#include <linux/slab.h>
+#include <linux/smp.h>
+#include <net/hotdata.h>
+
+#include "ovpnstruct.h"
+#include "cputime.h"
+#include "crypto_aead.h"
+#include "io.h"
+#include "parallel.h"
+#include "peer.h"
+#include "skb.h"
+
+/* All packets of one peer usually come from one UDP flow, or one sending
+ * socket, and are therefore encrypted or decrypted by one CPU. Interfaces
+ * created with OVPN_A_PARALLEL_RX and/or OVPN_A_PARALLEL_TX rather hand
+ * packets over to padata, which spreads the crypto work over a set of CPUs
+ * (all of them, unless OVPN_A_PARALLEL_CPUS is specified).
+ *
+ * The rest of the processing (ovpn_decrypt_post() and ovpn_encrypt_post())
+ * then happens in the original packet order, on the CPU the packets were
+ * handed over on. On TX, packet IDs are reserved before packets are handed
+ * over: this way packets leave in packet ID order and the replay window of
+ * the receiver never has to go backwards.
+ *
+ * Each direction has one ordering domain, shared by all the peers of the
+ * interface, so that no padata state has to be torn down along with a peer.
+ *
+ * Interfaces created with OVPN_A_PARALLEL_RX_ADAPTIVE rather decrypt inline,
+ * in the softirq the packets are received in, as long as the CPU keeps up.
+ * Received packets go to padata only for a short while after the CPU was
+ * found overloaded: its softirqs were deferred to ksoftirqd, its backlog is
+ * half full or inline decryption took half of the last jiffy. Packets
+ * decrypted inline may then overtake packets still in the engine, which the
+ * replay window absorbs.
+ */
+
+/* time packets keep being handed over to padata once the CPU was found
+ * overloaded, unless it is found overloaded again meanwhile
+ */
+#define OVPN_RX_LOAD_HOLD_MS	10
+
+/**
+ * ovpn_parallel_init - create the parallel crypto engine of an interface
+ * @ovpn: the instance to create the engine for
+ * @rx: whether received packets should be decrypted in parallel
+ * @tx: whether sent packets should be encrypted in parallel
+ * @rx_adaptive: whether received packets should be decrypted in parallel
+ *		 only while the CPU receiving them is overloaded (requires @rx)
+ * @cpus: the CPUs the crypto work should be spread over (NULL for all)
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_parallel_init(struct ovpn_struct *ovpn, bool rx, bool tx,
+		       bool rx_adaptive, const struct cpumask *cpus)
+{
+	int ret = -ENOMEM;
+
+	ovpn->padata = padata_alloc("ovpn");
+	if (!ovpn->padata)
+		return -ENOMEM;
+
+	if (rx_adaptive) {
+		ovpn->rx_load = alloc_percpu(struct ovpn_rx_load);
+		if (!ovpn->rx_load)
+			goto err;
+	}
+
+	if (rx) {
+		ovpn->padata_rx = padata_alloc_shell(ovpn->padata);
+		if (!ovpn->padata_rx)
+			goto err;
+	}
+
+	if (tx) {
+		ovpn->padata_tx = padata_alloc_shell(ovpn->padata);
+		if (!ovpn->padata_tx)
+			goto err;
+	}
+
+	if (cpus) {
+		ret = padata_set_cpumask(ovpn->padata, PADATA_CPU_PARALLEL,
+					 (struct cpumask *)cpus);
+		if (ret < 0)
+			goto err;
+	}
+
+	return 0;
+err:
+	ovpn_parallel_free(ovpn);
+	return ret;
+}
+
+/**
+ * ovpn_parallel_free - destroy the parallel crypto engine of an interface
+ * @ovpn: the instance whose engine should be destroyed
+ *
+ * Every packet in flight holds a reference to its peer, therefore no packet
+ * is left in the engine once the interface is being freed.
+ */
+void ovpn_parallel_free(struct ovpn_struct *ovpn)
+{
+	if (!ovpn->padata)
+		return;
+
+	if (ovpn->padata_rx)
+		padata_free_shell(ovpn->padata_rx);
+	if (ovpn->padata_tx)
+		padata_free_shell(ovpn->padata_tx);
+	padata_free(ovpn->padata);
+	free_percpu(ovpn->rx_load);
+	ovpn->rx_load = NULL;
+	ovpn->padata_rx = NULL;
+	ovpn->padata_tx = NULL;
+	ovpn->padata = NULL;
+}
+
+/* start handing packets over to padata from the current CPU */
+static void ovpn_parallel_rx_offload(struct ovpn_rx_load *load)
+{
+	load->offload_until = jiffies + msecs_to_jiffies(OVPN_RX_LOAD_HOLD_MS);
+}
+
+/**
+ * ovpn_parallel_rx_overloaded - check whether a received packet should be
+ *				 decrypted by the engine
+ * @ovpn: the instance the packet was received on, with adaptive parallel RX
+ *
+ * Only softirqs risk being deferred to ksoftirqd: packets received in
+ * process context (i.e. over TCP) are always decrypted inline.
+ *
+ * Return: true if the packet should be handed over to the engine
+ */
+bool ovpn_parallel_rx_overloaded(struct ovpn_struct *ovpn)
+{
+	struct softnet_data *sd;
+	struct ovpn_rx_load *load;
+
+	if (!in_serving_softirq())
+		return false;
+
+	/* only ever accessed by softirqs of its own CPU */
+	load = this_cpu_ptr(ovpn->rx_load);
+	sd = this_cpu_ptr(&softnet_data);
+	if (current == this_cpu_ksoftirqd() ||
+	    skb_queue_len_lockless(&sd->input_pkt_queue) >=
+	    READ_ONCE(net_hotdata.max_backlog) / 2)
+		ovpn_parallel_rx_offload(load);
+
+	return time_before(jiffies, load->offload_until);
+}
+
+/**
+ * ovpn_parallel_rx_account - account for a packet decrypted inline
+ * @ovpn: the instance the packet was received on, with adaptive parallel RX
+ * @start: the value of local_clock() before decrypting the packet
+ */
+void ovpn_parallel_rx_account(struct ovpn_struct *ovpn, u64 start)
+{
+	struct ovpn_rx_load *load;
+	unsigned long now;
+
+	if (!in_serving_softirq())
+		return;
+
+	load = this_cpu_ptr(ovpn->rx_load);
+	now = jiffies;
+	if (load->tick != now) {
+		load->tick = now;
+		load->crypto_ns = 0;
+	}
+
+	load->crypto_ns += local_clock() - start;
+	if (load->crypto_ns > TICK_NSEC / 2)
+		ovpn_parallel_rx_offload(load);
+}
+
+/* hand a packet over to padata. Return true if padata took the packet */
+static bool ovpn_parallel_submit(struct padata_shell *ps, struct sk_buff *skb,
+				 u64 pktid,
+				 void (*parallel)(struct padata_priv *),
+				 void (*serial)(struct padata_priv *))
+{
+	struct ovpn_parallel_job *job;
+	int cb_cpu;
+
+	job = kzalloc(sizeof(*job), GFP_ATOMIC);
+	if (unlikely(!job))
+		return false;
+
+	job->skb = skb;
+	job->pktid = pktid;
+	job->padata.parallel = parallel;
+	job->padata.serial = serial;
+	ovpn_skb_cb(skb)->job = job;
+	ovpn_skb_cb(skb)->parallel = true;
+
+	/* keep processing packets on the CPU they were handed over on */
+	cb_cpu = raw_smp_processor_id();
+	if (unlikely(padata_do_parallel(ps, &job->padata, &cb_cpu))) {
+		ovpn_skb_cb(skb)->job = NULL;
+		ovpn_skb_cb(skb)->parallel = false;
+		kfree(job);
+		return false;
+	}
+
+	return true;
+}
+
+/* take a packet out of its job, once it is its turn to be processed */
+static struct sk_buff *ovpn_parallel_job_end(struct padata_priv *padata,
+					     int *ret)
+{
+	struct ovpn_parallel_job *job;
+	struct sk_buff *skb;
+
+	job = container_of(padata, struct ovpn_parallel_job, padata);
+	skb = job->skb;
+	*ret = job->ret;
+	kfree(job);
+
+	ovpn_skb_cb(skb)->job = NULL;
+	ovpn_skb_cb(skb)->parallel = false;
+
+	return skb;
+}
+
+static void ovpn_parallel_decrypt_serial(struct padata_priv *padata)
+{
+	struct sk_buff *skb;
+	int ret;
+
+	skb = ovpn_parallel_job_end(padata, &ret);
+	ovpn_decrypt_post(skb, ret);
+}
+
+static void ovpn_parallel_decrypt_parallel(struct padata_priv *padata)
+{
+	struct ovpn_parallel_job *job;
+	struct ovpn_peer *peer;
+	struct sk_buff *skb;
+	u64 start;
+	int ret;
+
+	job = container_of(padata, struct ovpn_parallel_job, padata);
+	skb = job->skb;
+	peer = ovpn_skb_cb(skb)->peer;
+
+	start = ovpn_cputime_start(peer);
+	ret = ovpn_aead_decrypt(ovpn_skb_cb(skb)->ks, &skb);
+	ovpn_cputime_end(peer, false, start);
+	/* calls ovpn_parallel_serialize() once decryption is done */
+	ovpn_decrypt_post(skb, ret);
+}
+
+/**
+ * ovpn_parallel_decrypt - hand a received packet over to the engine
+ * @ovpn: the instance the packet was received on
+ * @skb: the packet to decrypt, with its cb filled for ovpn_aead_decrypt()
+ *
+ * The key slot referenced by the cb must be held, as it is used after the
+ * caller returns.
+ *
+ * Return: true if the engine took the packet or false if it has to be
+ * decrypted inline
+ */
+bool ovpn_parallel_decrypt(struct ovpn_struct *ovpn, struct sk_buff *skb)
+{
+	return ovpn_parallel_submit(ovpn->padata_rx, skb, 0,
+				    ovpn_parallel_decrypt_parallel,
+				    ovpn_parallel_decrypt_serial);
+}
+
+static void ovpn_parallel_encrypt_serial(struct padata_priv *padata)
+{
+	struct sk_buff *skb;
+	int ret;
+
+	skb = ovpn_parallel_job_end(padata, &ret);
+	ovpn_encrypt_post(skb, ret);
+}
+
+static void ovpn_parallel_encrypt_parallel(struct padata_priv *padata)
+{
+	struct ovpn_parallel_job *job;
+	struct ovpn_peer *peer;
+	struct sk_buff *skb;
+	u64 start;
+	int ret;
+
+	job = container_of(padata, struct ovpn_parallel_job, padata);
+	skb = job->skb;
+	peer = ovpn_skb_cb(skb)->peer;
+
+	start = ovpn_cputime_start(peer);
+	ret = ovpn_aead_encrypt(ovpn_skb_cb(skb)->ks, &skb, peer->id,
+				job->pktid);
+	ovpn_cputime_end(peer, true, start);
+	/* calls ovpn_parallel_serialize() once encryption is done */
+	ovpn_encrypt_post(skb, ret);
+}
+
+/**
+ * ovpn_parallel_encrypt - hand a packet to send over to the engine
+ * @ovpn: the instance the packet is sent on
+ * @skb: the packet to encrypt, with its cb filled for ovpn_aead_encrypt()
+ * @pktid: the packet ID reserved for the packet
+ *
+ * The key slot referenced by the cb must be held, as it is used after the
+ * caller returns.
+ *
+ * Return: true if the engine took the packet or false if it has to be
+ * encrypted inline
+ */
+bool ovpn_parallel_encrypt(struct ovpn_struct *ovpn, struct sk_buff *skb,
+			   u64 pktid)
+{
+	return ovpn_parallel_submit(ovpn->padata_tx, skb, pktid,
+				    ovpn_parallel_encrypt_parallel,
+				    ovpn_parallel_encrypt_serial);
+}
+
+/**
+ * ovpn_parallel_serialize - queue a processed packet for in-order handling
+ * @skb: the encrypted or decrypted packet
+ * @ret: the result of the crypto operation
+ */
+void ovpn_parallel_serialize(struct sk_buff *skb, int ret)
+{
+	struct ovpn_parallel_job *job = ovpn_skb_cb(skb)->job;
+
+	job->skb = skb;
+	job->ret = ret;
+	padata_do_serial(&job->padata);
+}
@@ -0,0 +1,97 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_PARALLEL_H_
+#define _NET_OVPN_PARALLEL_H_
+
+#include <linux/cpumask.h>
+#include <linux/padata.h>
+#include <linux/skbuff.h>
+
+struct ovpn_struct;
+
+/**
+ * struct ovpn_rx_load - per-CPU softirq load seen by adaptive parallel RX
+ * @tick: the jiffy @crypto_ns is accounted to
+ * @crypto_ns: time spent decrypting inline during @tick, in nanoseconds
+ * @offload_until: jiffies until which packets go to the parallel engine
+ */
+struct ovpn_rx_load {
+	unsigned long tick;
+	u64 crypto_ns;
+	unsigned long offload_until;
+};
+
+/**
+ * struct ovpn_parallel_job - a packet being encrypted or decrypted in parallel
+ * @padata: padata state, used to restore the original packet order
+ * @skb: the packet, replaced by the processed one once done
+ * @pktid: the packet ID reserved for the packet (TX only)
+ * @ret: the result of the crypto operation
+ */
+struct ovpn_parallel_job {
+	struct padata_priv padata;
+	struct sk_buff *skb;
+	u64 pktid;
+	int ret;
+};
+
+#if IS_ENABLED(CONFIG_PADATA)
+
+int ovpn_parallel_init(struct ovpn_struct *ovpn, bool rx, bool tx,
+		       bool rx_adaptive, const struct cpumask *cpus);
+void ovpn_parallel_free(struct ovpn_struct *ovpn);
+bool ovpn_parallel_rx_overloaded(struct ovpn_struct *ovpn);
+void ovpn_parallel_rx_account(struct ovpn_struct *ovpn, u64 start);
+bool ovpn_parallel_decrypt(struct ovpn_struct *ovpn, struct sk_buff *skb);
+bool ovpn_parallel_encrypt(struct ovpn_struct *ovpn, struct sk_buff *skb,
+			   u64 pktid);
+void ovpn_parallel_serialize(struct sk_buff *skb, int ret);
+
+#else
+
+static inline int ovpn_parallel_init(struct ovpn_struct *ovpn, bool rx,
+				     bool tx, bool rx_adaptive,
+				     const struct cpumask *cpus)
+{
+	return -EOPNOTSUPP;
+}
+
+static inline void ovpn_parallel_free(struct ovpn_struct *ovpn)
+{
+}
+
+static inline bool ovpn_parallel_rx_overloaded(struct ovpn_struct *ovpn)
+{
+	return false;
+}
+
+static inline void ovpn_parallel_rx_account(struct ovpn_struct *ovpn,
+					    u64 start)
+{
+}
+
+static inline bool ovpn_parallel_decrypt(struct ovpn_struct *ovpn,
+					 struct sk_buff *skb)
+{
+	return false;
+}
+
+static inline bool ovpn_parallel_encrypt(struct ovpn_struct *ovpn,
+					 struct sk_buff *skb, u64 pktid)
+{
+	return false;
+}
+
+static inline void ovpn_parallel_serialize(struct sk_buff *skb, int ret)
+{
+}
+
+#endif
+
+#endif /* _NET_OVPN_PARALLEL_H_ */
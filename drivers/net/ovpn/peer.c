@@ -10,118 +10,159 @@
 #include <linux/skbuff.h>
 #include <linux/list.h>
 #include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/prefetch.h>
 #include <net/ip6_route.h>
+#include <net/l3mdev.h>
+#include <net/netlink.h>
 
 #include "ovpnstruct.h"
 #include "bind.h"
 #include "pktid.h"
 #include "crypto.h"
+#include "demux.h"
 #include "io.h"
+#include "iroute.h"
+#include "cputime.h"
+#include "latency.h"
 #include "main.h"
+#include "mcast.h"
+#include "mirror.h"
 #include "netlink.h"
 #include "peer.h"
+#include "probe.h"
+#include "route.h"
+#include "sched.h"
 #include "socket.h"
+#include "stats.h"
 
-/**
- * ovpn_peer_ping - timer task for sending periodic keepalive
- * @t: timer object that triggered the task
+/* minimum period of the keepalive worker, unless a peer has a keepalive
+ * value below one second: deadlines falling within the same second are then
+ * handled by the same walk of the peers
  */
-static void ovpn_peer_ping(struct timer_list *t)
-{
-	struct ovpn_peer *peer = from_timer(peer, t, keepalive_xmit);
-
-	netdev_dbg(peer->ovpn->dev, "%s: sending ping to peer %u\n", __func__,
-		   peer->id);
-	ovpn_keepalive_xmit(peer);
-}
-
-/**
- * ovpn_peer_expire - timer task for incoming keepialive timeout
- * @t: the timer that triggered the task
- */
-static void ovpn_peer_expire(struct timer_list *t)
-{
-	struct ovpn_peer *peer = from_timer(peer, t, keepalive_recv);
-
-	netdev_dbg(peer->ovpn->dev, "%s: peer %u expired\n", __func__,
-		   peer->id);
-	ovpn_peer_del(peer, OVPN_DEL_PEER_REASON_EXPIRED);
-}
+#define OVPN_KEEPALIVE_PERIOD HZ
+/* maximum period of the keepalive worker, when no deadline is closer */
+#define OVPN_KEEPALIVE_MAX_PERIOD (60 * HZ)
+/* keepalives encrypted by the worker before letting them be sent */
+#define OVPN_KEEPALIVE_BATCH NAPI_POLL_WEIGHT
 
 /**
  * ovpn_peer_keepalive_set - configure keepalive values for peer
  * @peer: the peer to configure
- * @interval: outgoing keepalive interval
- * @timeout: incoming keepalive timeout
+ * @interval: outgoing keepalive interval, in milliseconds
+ * @timeout: incoming keepalive timeout, in milliseconds
  */
 void ovpn_peer_keepalive_set(struct ovpn_peer *peer, u32 interval, u32 timeout)
 {
-	u32 delta;
+	unsigned long now = jiffies;
 
 	netdev_dbg(peer->ovpn->dev,
 		   "%s: scheduling keepalive for peer %u: interval=%u timeout=%u\n",
 		   __func__, peer->id, interval, timeout);
 
-	peer->keepalive_interval = interval;
-	if (interval > 0) {
-		delta = msecs_to_jiffies(interval * MSEC_PER_SEC);
-		mod_timer(&peer->keepalive_xmit, jiffies + delta);
-	} else {
-		timer_delete(&peer->keepalive_xmit);
-	}
+	/* both countdowns restart from now */
+	WRITE_ONCE(peer->last_sent, now);
+	WRITE_ONCE(peer->last_recv, now);
+	WRITE_ONCE(peer->keepalive_interval, interval);
+	WRITE_ONCE(peer->keepalive_timeout, timeout);
 
-	peer->keepalive_timeout = timeout;
-	if (timeout) {
-		delta = msecs_to_jiffies(timeout * MSEC_PER_SEC);
-		mod_timer(&peer->keepalive_recv, jiffies + delta);
-	} else {
-		timer_delete(&peer->keepalive_recv);
-	}
+	/* the worker may be sleeping until a later deadline: let it re-arm
+	 * for the deadlines of the peer right away
+	 */
+	if (interval || timeout)
+		mod_delayed_work(system_wq, &peer->ovpn->keepalive_work, 0);
+}
+
+/**
+ * ovpn_peer_idle_set - configure after how long an idle peer is compacted
+ * @peer: the peer to configure
+ * @timeout: seconds without tunneled traffic (0 to disable)
+ */
+void ovpn_peer_idle_set(struct ovpn_peer *peer, u32 timeout)
+{
+	/* the countdown restarts from now */
+	WRITE_ONCE(peer->last_data, jiffies);
+	WRITE_ONCE(peer->idle_timeout, timeout);
+
+	if (timeout)
+		mod_delayed_work(system_wq, &peer->ovpn->keepalive_work, 0);
 }
 
 /**
  * ovpn_peer_new - allocate and initialize a new peer object
  * @ovpn: the openvpn instance inside which the peer should be created
  * @id: the ID assigned to this peer
+ * @node: NUMA node the peer is served on (NUMA_NO_NODE if unknown)
  *
  * Return: a pointer to the new peer on success or an error code otherwise
  */
-struct ovpn_peer *ovpn_peer_new(struct ovpn_struct *ovpn, u32 id)
+struct ovpn_peer *ovpn_peer_new(struct ovpn_struct *ovpn, u32 id, int node)
 {
 	struct ovpn_peer *peer;
 	int ret;
 
 	/* alloc and init peer object */
-	peer = kzalloc(sizeof(*peer), GFP_KERNEL);
+	peer = kzalloc_node(sizeof(*peer), GFP_KERNEL, node);
 	if (!peer)
 		return ERR_PTR(-ENOMEM);
 
 	peer->id = id;
+	peer->node = node;
+	peer->node_cand = node;
 	peer->halt = false;
 	peer->ovpn = ovpn;
 
 	peer->vpn_addrs.ipv4.s_addr = htonl(INADDR_ANY);
 	peer->vpn_addrs.ipv6 = in6addr_any;
+	peer->replay_window = REPLAY_WINDOW_SIZE;
+	peer->rekey_threshold = OVPN_REKEY_THRESHOLD;
+	peer->sched_weight = OVPN_SCHED_WEIGHT;
+	peer->rx_cpu = -1;
+	peer->last_data = jiffies;
+	ovpn_ratelimit_set(&peer->tx_limit, 0, OVPN_RATELIMIT_BURST);
+	ovpn_ratelimit_set(&peer->rx_limit, 0, OVPN_RATELIMIT_BURST);
+	ovpn_ratelimit_set(&peer->decrypt_limit, 0, OVPN_RATELIMIT_BURST);
+	ovpn_ratelimit_set(&peer->auth_fail_limit, 0, 0);
+	ovpn_probe_init(&peer->probe);
+	/* a new peer is reported by the next filtered dump */
+	peer->stats_gen = atomic_read(&ovpn->stats_gen);
 
 	RCU_INIT_POINTER(peer->bind, NULL);
+	RCU_INIT_POINTER(peer->paths, NULL);
+	RCU_INIT_POINTER(peer->mirror, NULL);
 	ovpn_crypto_state_init(&peer->crypto);
 	spin_lock_init(&peer->lock);
+	mutex_init(&peer->config_lock);
+	seqlock_init(&peer->rpf_cache.lock);
+	INIT_LIST_HEAD(&peer->iroutes);
+	INIT_LIST_HEAD(&peer->mcast);
+	__skb_queue_head_init(&peer->sched_queue);
+	__skb_queue_head_init(&peer->sched_prio);
+	INIT_LIST_HEAD(&peer->sched_entry);
 	kref_init(&peer->refcount);
-	ovpn_peer_stats_init(&peer->vpn_stats);
-	ovpn_peer_stats_init(&peer->link_stats);
-
-	ret = dst_cache_init(&peer->dst_cache, GFP_KERNEL);
-	if (ret < 0) {
-		netdev_err(ovpn->dev, "%s: cannot initialize dst cache\n",
-			   __func__);
-		kfree(peer);
-		return ERR_PTR(ret);
+
+	peer->vpn_stats = netdev_alloc_pcpu_stats(struct ovpn_peer_stats);
+	peer->link_stats = netdev_alloc_pcpu_stats(struct ovpn_peer_stats);
+	peer->errors = netdev_alloc_pcpu_stats(struct ovpn_peer_errors);
+	if (!peer->vpn_stats || !peer->link_stats || !peer->errors ||
+	    ovpn_latency_init(peer) < 0 || ovpn_cputime_init(peer) < 0) {
+		ovpn_peer_free(peer);
+		return ERR_PTR(-ENOMEM);
 	}
 
-	netdev_hold(ovpn->dev, NULL, GFP_KERNEL);
+	/* peers using the shared route table do not need their own cache */
+	if (!ovpn->routes) {
+		ret = dst_cache_init(&peer->dst_cache, GFP_KERNEL);
+		if (ret < 0) {
+			netdev_err(ovpn->dev,
+				   "%s: cannot initialize dst cache\n",
+				   __func__);
+			ovpn_peer_free(peer);
+			return ERR_PTR(ret);
+		}
+	}
 
-	timer_setup(&peer->keepalive_xmit, ovpn_peer_ping, 0);
-	timer_setup(&peer->keepalive_recv, ovpn_peer_expire, 0);
+	netdev_hold(ovpn->dev, NULL, GFP_KERNEL);
 
 	return peer;
 }
@@ -167,8 +208,282 @@ int ovpn_peer_reset_sockaddr(struct ovpn_peer *peer,
 	return 0;
 }
 
-#define ovpn_get_hash_head(_tbl, _key, _key_len)		\
-	(&(_tbl)[jhash(_key, _key_len, 0) % HASH_SIZE(_tbl)])	\
+static struct hlist_head *
+ovpn_peer_addr4_head(struct ovpn_peer_collection *peers, __be32 addr)
+{
+	u32 hash = jhash_1word((__force u32)addr, 0);
+
+	return &peers->by_vpn_addr4[hash & (peers->size - 1)];
+}
+
+static struct hlist_head *
+ovpn_peer_addr6_head(struct ovpn_peer_collection *peers,
+		     const struct in6_addr *addr)
+{
+	u32 hash = jhash2(addr->s6_addr32, ARRAY_SIZE(addr->s6_addr32), 0);
+
+	return &peers->by_vpn_addr6[hash & (peers->size - 1)];
+}
+
+/**
+ * struct ovpn_transp_key - compact transport address used as hash key
+ * @addr: remote IP address (an IPv4 address lives in addr[0], rest is zero)
+ * @port: remote UDP port
+ * @family: address family
+ *
+ * The key has no padding and is made of 32bit words only, therefore it can be
+ * filled without memset and hashed with jhash2()
+ */
+struct ovpn_transp_key {
+	__be32 addr[4];
+	__be16 port;
+	u16 family;
+};
+
+/**
+ * ovpn_transp_key_from_skb - fill transport key with skb source address
+ * @skb: the packet to extract data from
+ * @key: the key to fill
+ *
+ * Return: true on success or false if the skb is neither IPv4 nor IPv6
+ */
+static bool ovpn_transp_key_from_skb(struct sk_buff *skb,
+				     struct ovpn_transp_key *key)
+{
+	key->family = skb_protocol_to_family(skb);
+	switch (key->family) {
+	case AF_INET:
+		key->addr[0] = ip_hdr(skb)->saddr;
+		key->addr[1] = 0;
+		key->addr[2] = 0;
+		key->addr[3] = 0;
+		break;
+	case AF_INET6:
+		memcpy(key->addr, &ipv6_hdr(skb)->saddr, sizeof(key->addr));
+		break;
+	default:
+		return false;
+	}
+	key->port = udp_hdr(skb)->source;
+
+	return true;
+}
+
+/**
+ * ovpn_transp_key_from_bind - fill transport key with a peer remote endpoint
+ * @bind: the binding to extract data from
+ * @key: the key to fill
+ *
+ * Return: true on success or false if the binding family is not supported
+ */
+static bool ovpn_transp_key_from_bind(const struct ovpn_bind *bind,
+				      struct ovpn_transp_key *key)
+{
+	key->family = bind->sa.in4.sin_family;
+	switch (key->family) {
+	case AF_INET:
+		key->addr[0] = bind->sa.in4.sin_addr.s_addr;
+		key->addr[1] = 0;
+		key->addr[2] = 0;
+		key->addr[3] = 0;
+		key->port = bind->sa.in4.sin_port;
+		break;
+	case AF_INET6:
+		memcpy(key->addr, &bind->sa.in6.sin6_addr, sizeof(key->addr));
+		key->port = bind->sa.in6.sin6_port;
+		break;
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+static u32 ovpn_transp_key_hash(const struct ovpn_transp_key *key)
+{
+	BUILD_BUG_ON(sizeof(*key) % sizeof(u32));
+
+	return jhash2((const u32 *)key, sizeof(*key) / sizeof(u32), 0);
+}
+
+/* number of transport locks allocated per possible CPU */
+#define OVPN_PEER_TRANSP_LOCKS_PER_CPU	4
+
+static spinlock_t *ovpn_peer_transp_lock(struct ovpn_peer_collection *peers,
+					 u32 hash)
+{
+	return &peers->transp_locks[hash & peers->transp_locks_mask];
+}
+
+/**
+ * ovpn_peer_hash_transp - hash a new peer by transport address
+ * @peer: the peer to hash
+ * @key: the transport address of the peer
+ *
+ * Must be called with the peers lock held (MP only).
+ */
+static void ovpn_peer_hash_transp(struct ovpn_peer *peer,
+				  const struct ovpn_transp_key *key)
+{
+	struct ovpn_peer_collection *peers = peer->ovpn->peers;
+	u32 hash = ovpn_transp_key_hash(key);
+	spinlock_t *lock = ovpn_peer_transp_lock(peers, hash);
+
+	spin_lock(lock);
+	WRITE_ONCE(peer->transp_hash, hash);
+	hlist_add_head_rcu(&peer->hash_entry_transp_addr,
+			   &peers->by_transp_addr[hash & (peers->size - 1)]);
+	spin_unlock(lock);
+}
+
+/**
+ * ovpn_peer_rehash_transp - move a floated peer to its new transport bucket
+ * @peer: the peer to move
+ * @key: the new transport address of the peer
+ *
+ * Only the transport locks of the old and the new bucket are taken. Peers
+ * removed in the meantime are not re-added.
+ */
+static void ovpn_peer_rehash_transp(struct ovpn_peer *peer,
+				    const struct ovpn_transp_key *key)
+{
+	struct ovpn_peer_collection *peers = peer->ovpn->peers;
+	u32 hash = ovpn_transp_key_hash(key);
+	spinlock_t *lock1, *lock2;
+
+	/* only the float worker changes the hash of a hashed peer */
+	lock1 = ovpn_peer_transp_lock(peers, READ_ONCE(peer->transp_hash));
+	lock2 = ovpn_peer_transp_lock(peers, hash);
+
+	/* take the two locks in a fixed order */
+	if (lock1 > lock2)
+		swap(lock1, lock2);
+
+	spin_lock_bh(lock1);
+	if (lock1 != lock2)
+		spin_lock_nested(lock2, SINGLE_DEPTH_NESTING);
+
+	if (!hlist_unhashed(&peer->hash_entry_transp_addr)) {
+		hlist_del_rcu(&peer->hash_entry_transp_addr);
+		WRITE_ONCE(peer->transp_hash, hash);
+		hlist_add_head_rcu(&peer->hash_entry_transp_addr,
+				   &peers->by_transp_addr[hash &
+							  (peers->size - 1)]);
+	}
+
+	if (lock1 != lock2)
+		spin_unlock(lock2);
+	spin_unlock_bh(lock1);
+}
+
+/**
+ * ovpn_peer_unhash_transp - remove peer from the transport address table
+ * @peer: the peer to remove
+ *
+ * Must be called with the peers lock held (MP only).
+ */
+static void ovpn_peer_unhash_transp(struct ovpn_peer *peer)
+{
+	struct ovpn_peer_collection *peers = peer->ovpn->peers;
+	spinlock_t *lock;
+
+	/* the float worker may move the peer until its lock is held */
+	for (;;) {
+		lock = ovpn_peer_transp_lock(peers,
+					     READ_ONCE(peer->transp_hash));
+		spin_lock(lock);
+		if (likely(lock == ovpn_peer_transp_lock(peers,
+							 peer->transp_hash)))
+			break;
+		spin_unlock(lock);
+	}
+
+	hlist_del_init_rcu(&peer->hash_entry_transp_addr);
+	spin_unlock(lock);
+}
+
+/* floats are reported to userspace in batches, at most once per window */
+#define OVPN_FLOAT_NOTIFY_DELAY	(HZ / 10)
+
+/* queue the peer for the float notification of the current window. All the
+ * floats of a peer within a window are reported once, with the endpoint the
+ * peer is bound to when the window closes
+ */
+static void ovpn_peer_float_notify(struct ovpn_peer *peer)
+{
+	struct ovpn_struct *ovpn = peer->ovpn;
+
+	if (!ovpn_nl_floats_has_listeners(ovpn))
+		return;
+
+	if (test_and_set_bit(OVPN_PEER_FLOAT_NOTIFY, &peer->flags))
+		return;
+
+	if (unlikely(!ovpn_peer_hold(peer))) {
+		clear_bit(OVPN_PEER_FLOAT_NOTIFY, &peer->flags);
+		return;
+	}
+
+	llist_add(&peer->float_notify_node, &ovpn->float_notify_list);
+	/* the first float opens the window, later ones just join it */
+	schedule_delayed_work(&ovpn->float_notify_work,
+			      OVPN_FLOAT_NOTIFY_DELAY);
+}
+
+/* whether skb comes from the address of the binding and from one of the
+ * source ports the peer spreads its flows over
+ */
+static bool ovpn_peer_rx_ports_match(const struct ovpn_peer *peer,
+				     const struct ovpn_bind *bind,
+				     const struct sk_buff *skb)
+{
+	struct ovpn_port_range range = READ_ONCE(peer->rx_ports);
+	u16 port;
+
+	if (likely(!range.min))
+		return false;
+
+	port = ntohs(udp_hdr(skb)->source);
+	if (port < range.min || port > range.max)
+		return false;
+
+	switch (skb_protocol_to_family(skb)) {
+	case AF_INET:
+		return bind->sa.in4.sin_family == AF_INET &&
+		       bind->sa.in4.sin_addr.s_addr == ip_hdr(skb)->saddr;
+	case AF_INET6:
+		return bind->sa.in6.sin6_family == AF_INET6 &&
+		       ipv6_addr_equal(&bind->sa.in6.sin6_addr,
+				       &ipv6_hdr(skb)->saddr);
+	default:
+		return false;
+	}
+}
+
+/**
+ * ovpn_peer_rehash - let the transport hash of a peer follow its binding
+ * @peer: the peer whose binding changed
+ *
+ * Moving the peer in the table requires the transport locks, therefore it is
+ * left to the float worker. Rebindings happening before the worker runs are
+ * coalesced. P2P instances have no transport address table.
+ */
+void ovpn_peer_rehash(struct ovpn_peer *peer)
+{
+	struct ovpn_struct *ovpn = peer->ovpn;
+
+	if (ovpn->mode != OVPN_MODE_MP ||
+	    test_and_set_bit(OVPN_PEER_FLOAT_PENDING, &peer->flags))
+		return;
+
+	if (unlikely(!ovpn_peer_hold(peer))) {
+		clear_bit(OVPN_PEER_FLOAT_PENDING, &peer->flags);
+		return;
+	}
+
+	llist_add(&peer->float_node, &ovpn->float_list);
+	schedule_work(&ovpn->float_work);
+}
 
 /**
  * ovpn_peer_float - update remote endpoint for peer
@@ -177,20 +492,21 @@ int ovpn_peer_reset_sockaddr(struct ovpn_peer *peer,
  */
 void ovpn_peer_float(struct ovpn_peer *peer, struct sk_buff *skb)
 {
+	struct ovpn_struct *ovpn = peer->ovpn;
 	struct sockaddr_storage ss;
 	const u8 *local_ip = NULL;
 	struct sockaddr_in6 *sa6;
 	struct sockaddr_in *sa;
 	struct ovpn_bind *bind;
 	sa_family_t family;
-	size_t salen;
 
 	rcu_read_lock();
 	bind = rcu_dereference(peer->bind);
 	if (unlikely(!bind))
 		goto unlock;
 
-	if (likely(ovpn_bind_skb_src_match(bind, skb)))
+	if (likely(ovpn_bind_skb_src_match(bind, skb)) ||
+	    ovpn_peer_rx_ports_match(peer, bind, skb))
 		goto unlock;
 
 	family = skb_protocol_to_family(skb);
@@ -204,7 +520,6 @@ void ovpn_peer_float(struct ovpn_peer *peer, struct sk_buff *skb)
 		sa->sin_family = AF_INET;
 		sa->sin_addr.s_addr = ip_hdr(skb)->saddr;
 		sa->sin_port = udp_hdr(skb)->source;
-		salen = sizeof(*sa);
 		break;
 	case AF_INET6:
 		sa6 = (struct sockaddr_in6 *)&ss;
@@ -213,7 +528,6 @@ void ovpn_peer_float(struct ovpn_peer *peer, struct sk_buff *skb)
 		sa6->sin6_port = udp_hdr(skb)->source;
 		sa6->sin6_scope_id = ipv6_iface_scope_id(&ipv6_hdr(skb)->saddr,
 							 skb->skb_iif);
-		salen = sizeof(*sa6);
 		break;
 	default:
 		goto unlock;
@@ -223,28 +537,234 @@ void ovpn_peer_float(struct ovpn_peer *peer, struct sk_buff *skb)
 		   peer->id, &ss);
 	ovpn_peer_reset_sockaddr(peer, (struct sockaddr_storage *)&ss,
 				 local_ip);
-
-	spin_lock_bh(&peer->ovpn->peers->lock);
-	/* remove old hashing */
-	hlist_del_init_rcu(&peer->hash_entry_transp_addr);
-	/* re-add with new transport address */
-	hlist_add_head_rcu(&peer->hash_entry_transp_addr,
-			   ovpn_get_hash_head(peer->ovpn->peers->by_transp_addr,
-					      &ss, salen));
-	spin_unlock_bh(&peer->ovpn->peers->lock);
+	ovpn_dev_stats_inc(ovpn, peer_float);
+	ovpn_peer_float_notify(peer);
+	ovpn_peer_rehash(peer);
 
 unlock:
 	rcu_read_unlock();
 }
 
 /**
- * ovpn_peer_timer_delete_all - killall keepalive timers
- * @peer: peer for which timers should be killed
+ * ovpn_peer_float_stale - check if the hashing of a peer lags behind a float
+ * @peer: the peer to check
+ *
+ * Return: true if the peer is hashed with another address than its binding
+ */
+static bool ovpn_peer_float_stale(struct ovpn_peer *peer)
+{
+	struct ovpn_transp_key key;
+	struct ovpn_bind *bind;
+	bool ret = false;
+
+	/* unhashed peers are not re-added */
+	if (hlist_unhashed_lockless(&peer->hash_entry_transp_addr))
+		return false;
+
+	rcu_read_lock();
+	bind = rcu_dereference(peer->bind);
+	if (bind && ovpn_transp_key_from_bind(bind, &key))
+		ret = ovpn_transp_key_hash(&key) !=
+		      READ_ONCE(peer->transp_hash);
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/**
+ * ovpn_peer_float_work - move floated peers in the transport address table
+ * @work: the work embedded in the ovpn instance
+ *
+ * All peers that floated since the last run are rehashed in one pass, each
+ * one taking only the transport locks of its old and new bucket.
+ */
+void ovpn_peer_float_work(struct work_struct *work)
+{
+	struct ovpn_struct *ovpn = container_of(work, struct ovpn_struct,
+						float_work);
+	struct ovpn_peer *peer, *tmp;
+	struct ovpn_transp_key key;
+	struct llist_node *list;
+	bool requeue = false, rehash;
+	struct ovpn_bind *bind;
+
+	list = llist_del_all(&ovpn->float_list);
+	if (!list)
+		return;
+
+	llist_for_each_entry(peer, list, float_node) {
+		/* peers removed in the meantime must not be re-added */
+		if (hlist_unhashed_lockless(&peer->hash_entry_transp_addr))
+			continue;
+
+		rcu_read_lock();
+		bind = rcu_dereference(peer->bind);
+		rehash = bind && ovpn_transp_key_from_bind(bind, &key) &&
+			 ovpn_transp_key_hash(&key) !=
+			 READ_ONCE(peer->transp_hash);
+		rcu_read_unlock();
+
+		if (rehash)
+			ovpn_peer_rehash_transp(peer, &key);
+	}
+
+	llist_for_each_entry_safe(peer, tmp, list, float_node) {
+		/* from now on new floats queue the peer again */
+		clear_bit(OVPN_PEER_FLOAT_PENDING, &peer->flags);
+		smp_mb__after_atomic();
+
+		/* a float that happened after the rehash found the flag still
+		 * set: handle it with another pass, keeping the reference
+		 */
+		if (ovpn_peer_float_stale(peer) &&
+		    !test_and_set_bit(OVPN_PEER_FLOAT_PENDING, &peer->flags)) {
+			llist_add(&peer->float_node, &ovpn->float_list);
+			requeue = true;
+			continue;
+		}
+
+		ovpn_peer_put(peer);
+	}
+
+	if (requeue)
+		schedule_work(&ovpn->float_work);
+}
+
+/**
+ * ovpn_peer_float_notify_work - report the floats of a window to userspace
+ * @work: the delayed work embedded in the ovpn instance
+ *
+ * The new endpoints are packed as consecutive messages in as few skbs as
+ * possible, so that a mass rebinding results in a few datagrams only.
+ */
+void ovpn_peer_float_notify_work(struct work_struct *work)
+{
+	struct ovpn_struct *ovpn = container_of(to_delayed_work(work),
+						struct ovpn_struct,
+						float_notify_work);
+	struct ovpn_peer *peer, *tmp;
+	struct sk_buff *msg = NULL;
+	struct llist_node *list;
+
+	list = llist_del_all(&ovpn->float_notify_list);
+	llist_for_each_entry_safe(peer, tmp, list, float_notify_node) {
+		/* from now on new floats are reported in the next window.
+		 * The barrier orders the flag against reading the binding,
+		 * so that no float goes unreported
+		 */
+		clear_bit(OVPN_PEER_FLOAT_NOTIFY, &peer->flags);
+		smp_mb__after_atomic();
+
+		if (msg && !ovpn_nl_put_float(msg, peer))
+			goto put;
+
+		/* the current message is full: send it and start a new one */
+		if (msg)
+			ovpn_nl_notify_floats(ovpn, msg);
+
+		msg = nlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+		if (msg && ovpn_nl_put_float(msg, peer)) {
+			nlmsg_free(msg);
+			msg = NULL;
+		}
+put:
+		ovpn_peer_put(peer);
+	}
+
+	if (msg)
+		ovpn_nl_notify_floats(ovpn, msg);
+}
+
+/* enabled as long as any peer uses TCP, see ovpn_peer_is_udp(). Peers are
+ * released in atomic context, where the key can only be decremented lazily
+ */
+DEFINE_STATIC_KEY_DEFERRED_FALSE(ovpn_tcp_enabled, HZ);
+
+/**
+ * ovpn_peer_set_proto - record the transport protocol of a peer
+ * @peer: the peer whose socket was just attached
+ * @proto: the protocol of the socket (IPPROTO_UDP or IPPROTO_TCP)
+ *
+ * The protocol is cached for the datapath, so that it does not have to chase
+ * the socket of the peer for every packet.
+ */
+void ovpn_peer_set_proto(struct ovpn_peer *peer, u8 proto)
+{
+	u8 old = peer->proto;
+
+	if (proto == IPPROTO_TCP && old != IPPROTO_TCP) {
+		static_branch_deferred_inc(&ovpn_tcp_enabled);
+		atomic_inc(&peer->ovpn->tcp_peers);
+	}
+
+	WRITE_ONCE(peer->proto, proto);
+
+	if (old == IPPROTO_TCP && proto != IPPROTO_TCP) {
+		atomic_dec(&peer->ovpn->tcp_peers);
+		static_branch_slow_dec_deferred(&ovpn_tcp_enabled);
+	}
+}
+
+/**
+ * ovpn_peer_reset - recycle a peer for a new session with the same ID
+ * @peer: the peer to reset
+ *
+ * The keys of the previous session are removed, its counters restart from
+ * zero and the liveness of the peer starts over. The peer keeps its hash
+ * placement, VPN IPs, iroutes and per-CPU state, so that a reconnecting
+ * client costs neither new allocations nor an RCU grace period. The caller
+ * installs the new keys as for a new peer, once the new binding is in place.
+ *
+ * Must be called with peer->config_lock held.
  */
-static void ovpn_peer_timer_delete_all(struct ovpn_peer *peer)
+void ovpn_peer_reset(struct ovpn_peer *peer)
 {
-	timer_shutdown_sync(&peer->keepalive_xmit);
-	timer_shutdown_sync(&peer->keepalive_recv);
+	unsigned long now = jiffies;
+
+	ovpn_crypto_state_flush(&peer->crypto);
+
+	ovpn_peer_stats_reset(peer->vpn_stats, &peer->vpn_base);
+	ovpn_peer_stats_reset(peer->link_stats, &peer->link_base);
+	ovpn_peer_errors_reset(peer->errors, &peer->errors_base);
+	/* the next record of the monitor counts from zero */
+	memset(&peer->reported_vpn, 0, sizeof(peer->reported_vpn));
+	memset(&peer->reported_link, 0, sizeof(peer->reported_link));
+	WRITE_ONCE(peer->stats_gen, atomic_read(&peer->ovpn->stats_gen));
+
+	WRITE_ONCE(peer->last_sent, now);
+	WRITE_ONCE(peer->last_recv, now);
+	WRITE_ONCE(peer->last_data, now);
+	WRITE_ONCE(peer->quarantine_until, 0);
+	ovpn_probe_set(peer, READ_ONCE(peer->probe.interval));
+
+	/* the cache is kept, but the new endpoint may be routed differently */
+	ovpn_route_cache_reset(peer);
+}
+
+/**
+ * ovpn_peer_out_mark_set - change the firewall mark of the outer packets
+ * @peer: the peer whose outer packets should carry the mark
+ * @mark: the new mark, 0 to use the one of the transport socket
+ *
+ * The routes cached for the peer and for its paths were looked up with the
+ * previous mark and are forgotten.
+ */
+void ovpn_peer_out_mark_set(struct ovpn_peer *peer, u32 mark)
+{
+	struct ovpn_path_set *paths;
+	u8 i;
+
+	if (READ_ONCE(peer->out_mark) == mark)
+		return;
+
+	WRITE_ONCE(peer->out_mark, mark);
+	ovpn_route_cache_reset(peer);
+
+	rcu_read_lock();
+	paths = rcu_dereference(peer->paths);
+	for (i = 0; paths && i < paths->num; i++)
+		dst_cache_reset(&paths->paths[i].dst_cache);
+	rcu_read_unlock();
 }
 
 /**
@@ -255,60 +775,61 @@ void ovpn_peer_release(struct ovpn_peer *peer)
 {
 	if (peer->sock)
 		ovpn_socket_put(peer->sock);
+	if (peer->csock)
+		ovpn_socket_put(peer->csock);
+
+	if (peer->proto == IPPROTO_TCP) {
+		atomic_dec(&peer->ovpn->tcp_peers);
+		static_branch_slow_dec_deferred(&ovpn_tcp_enabled);
+	}
 
 	ovpn_crypto_state_release(&peer->crypto);
 	ovpn_bind_reset(peer, NULL);
-	ovpn_peer_timer_delete_all(peer);
+	ovpn_path_set_reset(peer, NULL);
+	ovpn_mirror_reset(peer, NULL);
 
+	if (peer->ovpn->routes)
+		ovpn_route_cache_reset(peer);
 	dst_cache_destroy(&peer->dst_cache);
 }
 
 /**
- * ovpn_peer_release_kref - callback for kref_put
- * @kref: the kref object belonging to the peer
+ * ovpn_peer_free - free the memory of a peer object
+ * @peer: the peer to free
+ *
+ * The peer must not be reachable by any RCU reader anymore.
  */
-void ovpn_peer_release_kref(struct kref *kref)
+void ovpn_peer_free(struct ovpn_peer *peer)
 {
-	struct ovpn_peer *peer = container_of(kref, struct ovpn_peer, refcount);
+	free_percpu(peer->vpn_stats);
+	free_percpu(peer->link_stats);
+	free_percpu(peer->errors);
+	free_percpu(peer->latency);
+	free_percpu(peer->cputime);
+	mutex_destroy(&peer->config_lock);
+	kfree(peer);
+}
 
-	ovpn_peer_release(peer);
-	netdev_put(peer->ovpn->dev, NULL);
-	ovpn_nl_notify_del_peer(peer);
-	kfree_rcu(peer, rcu);
+static void ovpn_peer_free_rcu(struct rcu_head *head)
+{
+	ovpn_peer_free(container_of(head, struct ovpn_peer, rcu));
 }
 
 /**
- * ovpn_peer_skb_to_sockaddr - fill sockaddr with skb source address
- * @skb: the packet to extract data from
- * @ss: the sockaddr to fill
- *
- * Return: true on success or false otherwise
+ * ovpn_peer_release_kref - callback for kref_put
+ * @kref: the kref object belonging to the peer
  */
-static bool ovpn_peer_skb_to_sockaddr(struct sk_buff *skb,
-				      struct sockaddr_storage *ss)
+void ovpn_peer_release_kref(struct kref *kref)
 {
-	struct sockaddr_in6 *sa6;
-	struct sockaddr_in *sa4;
-
-	ss->ss_family = skb_protocol_to_family(skb);
-	switch (ss->ss_family) {
-	case AF_INET:
-		sa4 = (struct sockaddr_in *)ss;
-		sa4->sin_family = AF_INET;
-		sa4->sin_addr.s_addr = ip_hdr(skb)->saddr;
-		sa4->sin_port = udp_hdr(skb)->source;
-		break;
-	case AF_INET6:
-		sa6 = (struct sockaddr_in6 *)ss;
-		sa6->sin6_family = AF_INET6;
-		sa6->sin6_addr = ipv6_hdr(skb)->saddr;
-		sa6->sin6_port = udp_hdr(skb)->source;
-		break;
-	default:
-		return false;
-	}
+	struct ovpn_peer *peer = container_of(kref, struct ovpn_peer, refcount);
 
-	return true;
+	ovpn_peer_release(peer);
+	netdev_put(peer->ovpn->dev, NULL);
+	/* peers expired in batch were already notified */
+	if (!peer->del_notified)
+		ovpn_nl_notify_del_peer(peer);
+	/* stats may still be read by RCU readers dumping the peer */
+	call_rcu(&peer->rcu, ovpn_peer_free_rcu);
 }
 
 /**
@@ -358,8 +879,7 @@ static struct ovpn_peer *ovpn_peer_get_by_vpn_addr4(struct ovpn_struct *ovpn,
 	struct hlist_head *head;
 	struct ovpn_peer *tmp;
 
-	head = ovpn_get_hash_head(ovpn->peers->by_vpn_addr, &addr,
-				  sizeof(addr));
+	head = ovpn_peer_addr4_head(ovpn->peers, addr);
 
 	hlist_for_each_entry_rcu(tmp, head, hash_entry_addr4)
 		if (addr == tmp->vpn_addrs.ipv4.s_addr)
@@ -383,8 +903,7 @@ static struct ovpn_peer *ovpn_peer_get_by_vpn_addr6(struct ovpn_struct *ovpn,
 	struct hlist_head *head;
 	struct ovpn_peer *tmp;
 
-	head = ovpn_get_hash_head(ovpn->peers->by_vpn_addr, addr,
-				  sizeof(*addr));
+	head = ovpn_peer_addr6_head(ovpn->peers, addr);
 
 	hlist_for_each_entry_rcu(tmp, head, hash_entry_addr6)
 		if (ipv6_addr_equal(addr, &tmp->vpn_addrs.ipv6))
@@ -394,64 +913,53 @@ static struct ovpn_peer *ovpn_peer_get_by_vpn_addr6(struct ovpn_struct *ovpn,
 }
 
 /**
- * ovpn_peer_transp_match - check if sockaddr and peer binding match
+ * ovpn_peer_transp_match - check if transport key and peer binding match
  * @peer: the peer to get the binding from
- * @ss: the sockaddr to match
+ * @key: the transport key to match
  *
- * Return: true if sockaddr and binding match or false otherwise
+ * Return: true if key and binding match or false otherwise
  */
 static bool ovpn_peer_transp_match(const struct ovpn_peer *peer,
-				   const struct sockaddr_storage *ss)
+				   const struct ovpn_transp_key *key)
 {
 	struct ovpn_bind *bind = rcu_dereference(peer->bind);
-	struct sockaddr_in6 *sa6;
-	struct sockaddr_in *sa4;
 
 	if (unlikely(!bind))
 		return false;
 
-	if (ss->ss_family != bind->sa.in4.sin_family)
+	if (key->family != bind->sa.in4.sin_family)
 		return false;
 
-	switch (ss->ss_family) {
+	switch (key->family) {
 	case AF_INET:
-		sa4 = (struct sockaddr_in *)ss;
-		if (sa4->sin_addr.s_addr != bind->sa.in4.sin_addr.s_addr)
-			return false;
-		if (sa4->sin_port != bind->sa.in4.sin_port)
-			return false;
-		break;
+		return key->addr[0] == bind->sa.in4.sin_addr.s_addr &&
+		       key->port == bind->sa.in4.sin_port;
 	case AF_INET6:
-		sa6 = (struct sockaddr_in6 *)ss;
-		if (!ipv6_addr_equal(&sa6->sin6_addr, &bind->sa.in6.sin6_addr))
-			return false;
-		if (sa6->sin6_port != bind->sa.in6.sin6_port)
-			return false;
-		break;
+		return ipv6_addr_equal((const struct in6_addr *)key->addr,
+				       &bind->sa.in6.sin6_addr) &&
+		       key->port == bind->sa.in6.sin6_port;
 	default:
 		return false;
 	}
-
-	return true;
 }
 
 /**
  * ovpn_peer_get_by_transp_addr_p2p - get peer by transport address in a P2P
  *                                    instance
  * @ovpn: the openvpn instance to search
- * @ss: the transport socket address
+ * @key: the transport address
  *
  * Return: the peer if found or NULL otherwise
  */
 static struct ovpn_peer *
 ovpn_peer_get_by_transp_addr_p2p(struct ovpn_struct *ovpn,
-				 struct sockaddr_storage *ss)
+				 const struct ovpn_transp_key *key)
 {
 	struct ovpn_peer *tmp, *peer = NULL;
 
 	rcu_read_lock();
 	tmp = rcu_dereference(ovpn->peer);
-	if (likely(tmp && ovpn_peer_transp_match(tmp, ss) &&
+	if (likely(tmp && ovpn_peer_transp_match(tmp, key) &&
 		   ovpn_peer_hold(tmp)))
 		peer = tmp;
 	rcu_read_unlock();
@@ -460,42 +968,31 @@ ovpn_peer_get_by_transp_addr_p2p(struct ovpn_struct *ovpn,
 }
 
 /**
- * ovpn_peer_get_by_transp_addr - retrieve peer by transport address
+ * ovpn_peer_get_by_transp_key - retrieve peer by transport key
  * @ovpn: the openvpn instance to search
- * @skb: the skb to retrieve the source transport address from
+ * @key: the transport address
  *
  * Return: a pointer to the peer if found or NULL otherwise
  */
-struct ovpn_peer *ovpn_peer_get_by_transp_addr(struct ovpn_struct *ovpn,
-					       struct sk_buff *skb)
+static struct ovpn_peer *
+ovpn_peer_get_by_transp_key(struct ovpn_struct *ovpn,
+			    const struct ovpn_transp_key *key)
 {
 	struct ovpn_peer *tmp, *peer = NULL;
-	struct sockaddr_storage ss = { 0 };
 	struct hlist_head *head;
-	size_t sa_len;
+	u32 hash;
 
-	if (unlikely(!ovpn_peer_skb_to_sockaddr(skb, &ss)))
-		return NULL;
+	if (ovpn_mode_p2p(ovpn))
+		return ovpn_peer_get_by_transp_addr_p2p(ovpn, key);
 
-	if (ovpn->mode == OVPN_MODE_P2P)
-		return ovpn_peer_get_by_transp_addr_p2p(ovpn, &ss);
-
-	switch (ss.ss_family) {
-	case AF_INET:
-		sa_len = sizeof(struct sockaddr_in);
-		break;
-	case AF_INET6:
-		sa_len = sizeof(struct sockaddr_in6);
-		break;
-	default:
-		return NULL;
-	}
-
-	head = ovpn_get_hash_head(ovpn->peers->by_transp_addr, &ss, sa_len);
+	hash = ovpn_transp_key_hash(key);
+	head = &ovpn->peers->by_transp_addr[hash & (ovpn->peers->size - 1)];
 
 	rcu_read_lock();
 	hlist_for_each_entry_rcu(tmp, head, hash_entry_transp_addr) {
-		if (!ovpn_peer_transp_match(tmp, &ss))
+		/* the precomputed hash spares most binding comparisons */
+		if (READ_ONCE(tmp->transp_hash) != hash ||
+		    !ovpn_peer_transp_match(tmp, key))
 			continue;
 
 		if (!ovpn_peer_hold(tmp))
@@ -509,6 +1006,56 @@ struct ovpn_peer *ovpn_peer_get_by_transp_addr(struct ovpn_struct *ovpn,
 	return peer;
 }
 
+/**
+ * ovpn_peer_get_by_transp_addr - retrieve peer by transport address
+ * @ovpn: the openvpn instance to search
+ * @skb: the skb to retrieve the source transport address from
+ *
+ * Return: a pointer to the peer if found or NULL otherwise
+ */
+struct ovpn_peer *ovpn_peer_get_by_transp_addr(struct ovpn_struct *ovpn,
+					       struct sk_buff *skb)
+{
+	struct ovpn_transp_key key;
+
+	if (unlikely(!ovpn_transp_key_from_skb(skb, &key)))
+		return NULL;
+
+	return ovpn_peer_get_by_transp_key(ovpn, &key);
+}
+
+/**
+ * ovpn_peer_get_by_remote - retrieve peer by remote transport endpoint
+ * @ovpn: the openvpn instance to search
+ * @family: the address family of @addr (AF_INET or AF_INET6)
+ * @addr: the remote address of the peer
+ * @port: the remote port of the peer
+ *
+ * Return: a pointer to the peer if found or NULL otherwise
+ */
+struct ovpn_peer *ovpn_peer_get_by_remote(struct ovpn_struct *ovpn,
+					  int family, const void *addr,
+					  __be16 port)
+{
+	struct ovpn_transp_key key = {
+		.family = family,
+		.port = port,
+	};
+
+	switch (family) {
+	case AF_INET:
+		key.addr[0] = *(const __be32 *)addr;
+		break;
+	case AF_INET6:
+		memcpy(key.addr, addr, sizeof(key.addr));
+		break;
+	default:
+		return NULL;
+	}
+
+	return ovpn_peer_get_by_transp_key(ovpn, &key);
+}
+
 /**
  * ovpn_peer_get_by_id_p2p - get peer by ID in a P2P instance
  * @ovpn: the openvpn instance to search
@@ -540,39 +1087,200 @@ static struct ovpn_peer *ovpn_peer_get_by_id_p2p(struct ovpn_struct *ovpn,
 struct ovpn_peer *ovpn_peer_get_by_id(struct ovpn_struct *ovpn, u32 peer_id)
 {
 	struct ovpn_peer *tmp, *peer = NULL;
-	struct hlist_head *head;
 
-	if (ovpn->mode == OVPN_MODE_P2P)
+	if (ovpn_mode_p2p(ovpn))
+		return ovpn_peer_get_by_id_p2p(ovpn, peer_id);
+
+	rcu_read_lock();
+	tmp = xa_load(&ovpn->peers->by_id, peer_id);
+	/* the refcount lives on another cacheline than the fields read by
+	 * the datapath: load both at once
+	 */
+	if (tmp)
+		prefetch(tmp);
+	if (tmp && ovpn_peer_hold(tmp))
+		peer = tmp;
+	rcu_read_unlock();
+
+	return peer;
+}
+
+/* number of missed peer IDs each CPU remembers, as a power of 2 */
+#define OVPN_PEER_MISS_BITS	6
+
+/**
+ * struct ovpn_peer_miss - peer ID data was received for but not found
+ * @id: the ID missed
+ * @genid: generation of the peer tables the lookup of @id failed in
+ * @valid: whether this entry was ever stored
+ */
+struct ovpn_peer_miss {
+	u32 id;
+	u32 genid;
+	bool valid;
+};
+
+/**
+ * struct ovpn_peer_miss_cache - recent lookup failures of a CPU
+ * @entries: misses indexed by the hash of their ID
+ */
+struct ovpn_peer_miss_cache {
+	struct ovpn_peer_miss entries[1 << OVPN_PEER_MISS_BITS];
+};
+
+/**
+ * ovpn_peer_get_by_id_rx - retrieve the sender of a data packet by peer ID
+ * @ovpn: the openvpn instance to search
+ * @peer_id: the peer ID carried by the packet
+ * @cached: set to true if the lookup failed because of a known miss
+ *
+ * Stale clients or scanners may keep sending data for IDs that do not
+ * exist: every CPU remembers the IDs it recently missed, so that their
+ * packets are dropped without walking the tables over and over. Entries are
+ * only valid for the generation of the peer tables they were stored in,
+ * hence adding a peer makes it reachable immediately.
+ * Must be called in BH context.
+ *
+ * Return: a pointer to the peer if found or NULL otherwise
+ */
+struct ovpn_peer *ovpn_peer_get_by_id_rx(struct ovpn_struct *ovpn,
+					 u32 peer_id, bool *cached)
+{
+	struct ovpn_peer_miss_cache *cache;
+	struct ovpn_peer_miss *miss;
+	struct ovpn_peer *peer;
+	u32 genid;
+
+	*cached = false;
+	if (ovpn_mode_p2p(ovpn))
 		return ovpn_peer_get_by_id_p2p(ovpn, peer_id);
 
-	head = ovpn_get_hash_head(ovpn->peers->by_id, &peer_id,
-				  sizeof(peer_id));
+	cache = this_cpu_ptr(ovpn->peers->misses);
+	miss = &cache->entries[hash_32(peer_id, OVPN_PEER_MISS_BITS)];
+	/* pairs with the release in ovpn_peer_hash_mp(): a peer added after
+	 * this load is found by the lookup or bumps the generation again
+	 */
+	genid = smp_load_acquire(&ovpn->peers->genid);
+	if (miss->valid && miss->id == peer_id && miss->genid == genid) {
+		*cached = true;
+		return NULL;
+	}
+
+	peer = ovpn_peer_get_by_id(ovpn, peer_id);
+	if (!peer) {
+		miss->id = peer_id;
+		miss->genid = genid;
+		miss->valid = true;
+	}
+
+	return peer;
+}
+
+/**
+ * ovpn_peer_get_by_vpn_addr - retrieve peer by the address it has in the VPN
+ * @ovpn: the openvpn instance to search
+ * @family: the address family of @addr (AF_INET or AF_INET6)
+ * @addr: the VPN address of the peer
+ *
+ * Unlike ovpn_peer_get_by_dst(), only the address assigned to the peer is
+ * matched: neither the routes of the peer nor the system routing table are
+ * considered.
+ *
+ * Return: a pointer to the peer if found or NULL otherwise
+ */
+struct ovpn_peer *ovpn_peer_get_by_vpn_addr(struct ovpn_struct *ovpn,
+					    int family, const void *addr)
+{
+	struct ovpn_peer *peer = NULL;
+	struct in6_addr addr6;
+	__be32 addr4;
 
 	rcu_read_lock();
-	hlist_for_each_entry_rcu(tmp, head, hash_entry_id) {
-		if (tmp->id != peer_id)
-			continue;
+	switch (family) {
+	case AF_INET:
+		addr4 = *(const __be32 *)addr;
+		if (ovpn->mode == OVPN_MODE_MP) {
+			peer = ovpn_peer_get_by_vpn_addr4(ovpn, addr4);
+			break;
+		}
 
-		if (!ovpn_peer_hold(tmp))
-			continue;
+		peer = rcu_dereference(ovpn->peer);
+		if (peer && peer->vpn_addrs.ipv4.s_addr != addr4)
+			peer = NULL;
+		break;
+	case AF_INET6:
+		memcpy(&addr6, addr, sizeof(addr6));
+		if (ovpn->mode == OVPN_MODE_MP) {
+			peer = ovpn_peer_get_by_vpn_addr6(ovpn, &addr6);
+			break;
+		}
 
-		peer = tmp;
+		peer = rcu_dereference(ovpn->peer);
+		if (peer && !ipv6_addr_equal(&peer->vpn_addrs.ipv6, &addr6))
+			peer = NULL;
 		break;
 	}
+
+	if (peer && !ovpn_peer_hold(peer))
+		peer = NULL;
 	rcu_read_unlock();
 
 	return peer;
 }
 
+/* number of consecutive packets that must be received on a new local address
+ * before the binding is switched to it. This keeps the local endpoint sticky
+ * when the upstream balances packets across multiple local addresses (i.e.
+ * ECMP)
+ */
+#define OVPN_LOCAL_EP_STICKY_PKTS	8
+
+/**
+ * ovpn_peer_local_cand - account packet received on another local address
+ * @bind: the binding the packet was received for
+ * @addr: the local address the packet was received on
+ * @len: size of addr
+ *
+ * Concurrent updates may only delay the switch, therefore no lock is taken.
+ *
+ * Return: true if the binding should now switch to addr, false otherwise
+ */
+static bool ovpn_peer_local_cand(struct ovpn_bind *bind, const void *addr,
+				 size_t len)
+{
+	u8 cnt;
+
+	/* an unset local address is learnt immediately */
+	if (!memchr_inv(&bind->local, 0, len))
+		return true;
+
+	if (memcmp(&bind->local_cand, addr, len)) {
+		memcpy(&bind->local_cand, addr, len);
+		WRITE_ONCE(bind->local_cand_cnt, 1);
+		return false;
+	}
+
+	cnt = READ_ONCE(bind->local_cand_cnt) + 1;
+	WRITE_ONCE(bind->local_cand_cnt, cnt);
+
+	return cnt >= OVPN_LOCAL_EP_STICKY_PKTS;
+}
+
 /**
  * ovpn_peer_update_local_endpoint - update local endpoint for peer
  * @peer: peer to update the endpoint for
  * @skb: incoming packet to retrieve the destination address (local) from
+ *
+ * The local endpoint is switched only after OVPN_LOCAL_EP_STICKY_PKTS
+ * consecutive packets have been received on the same new address. Packets
+ * received on the current local endpoint only cost one comparison.
  */
 void ovpn_peer_update_local_endpoint(struct ovpn_peer *peer,
 				     struct sk_buff *skb)
 {
 	struct ovpn_bind *bind;
+	const void *daddr;
+	size_t len;
 
 	rcu_read_lock();
 	bind = rcu_dereference(peer->bind);
@@ -581,31 +1289,76 @@ void ovpn_peer_update_local_endpoint(struct ovpn_peer *peer,
 
 	switch (skb_protocol_to_family(skb)) {
 	case AF_INET:
-		if (unlikely(bind->local.ipv4.s_addr != ip_hdr(skb)->daddr)) {
-			netdev_dbg(peer->ovpn->dev,
-				   "%s: learning local IPv4 for peer %d (%pI4 -> %pI4)\n",
-				   __func__, peer->id, &bind->local.ipv4.s_addr,
-				   &ip_hdr(skb)->daddr);
-			bind->local.ipv4.s_addr = ip_hdr(skb)->daddr;
-		}
+		daddr = &ip_hdr(skb)->daddr;
+		len = sizeof(bind->local.ipv4);
 		break;
 	case AF_INET6:
-		if (unlikely(memcmp(&bind->local.ipv6, &ipv6_hdr(skb)->daddr,
-				    sizeof(bind->local.ipv6)))) {
-			netdev_dbg(peer->ovpn->dev,
-				   "%s: learning local IPv6 for peer %d (%pI6c -> %pI6c\n",
-				   __func__, peer->id, &bind->local.ipv6,
-				   &ipv6_hdr(skb)->daddr);
-			bind->local.ipv6 = ipv6_hdr(skb)->daddr;
-		}
+		daddr = &ipv6_hdr(skb)->daddr;
+		len = sizeof(bind->local.ipv6);
 		break;
 	default:
-		break;
+		goto unlock;
+	}
+
+	if (likely(!memcmp(&bind->local, daddr, len))) {
+		/* a packet on the current endpoint breaks any candidate run */
+		if (unlikely(READ_ONCE(bind->local_cand_cnt)))
+			WRITE_ONCE(bind->local_cand_cnt, 0);
+		goto unlock;
+	}
+
+	if (!ovpn_peer_local_cand(bind, daddr, len))
+		goto unlock;
+
+	ovpn_spin_lock_bh_stat(peer->ovpn, &peer->lock, lock_peer_contended);
+	/* the binding may have been replaced in the meantime */
+	if (rcu_access_pointer(peer->bind) == bind) {
+		if (len == sizeof(bind->local.ipv4))
+			netdev_dbg(peer->ovpn->dev,
+				   "%s: learning local IPv4 for peer %d (%pI4 -> %pI4)\n",
+				   __func__, peer->id, &bind->local.ipv4,
+				   daddr);
+		else
+			netdev_dbg(peer->ovpn->dev,
+				   "%s: learning local IPv6 for peer %d (%pI6c -> %pI6c)\n",
+				   __func__, peer->id, &bind->local.ipv6,
+				   daddr);
+
+		memcpy(&bind->local, daddr, len);
+		WRITE_ONCE(bind->local_cand_cnt, 0);
 	}
+	spin_unlock_bh(&peer->lock);
 unlock:
 	rcu_read_unlock();
 }
 
+/* number of inner destinations each CPU remembers the peer of, as a power
+ * of 2
+ */
+#define OVPN_PEER_DST_BITS	6
+
+/**
+ * struct ovpn_peer_dst - peer recently found for an inner destination
+ * @daddr: the inner destination, v4-mapped for IPv4
+ * @nexthop: the nexthop the route of the packet pointed at, v4-mapped too
+ * @peer: the peer found, NULL if this entry was never stored
+ * @genid: generation of the peer tables @peer was found in
+ */
+struct ovpn_peer_dst {
+	struct in6_addr daddr;
+	struct in6_addr nexthop;
+	struct ovpn_peer *peer;
+	u32 genid;
+};
+
+/**
+ * struct ovpn_peer_dst_cache - recent destination lookups of a CPU
+ * @entries: lookups indexed by the hash of their destination
+ */
+struct ovpn_peer_dst_cache {
+	struct ovpn_peer_dst entries[1 << OVPN_PEER_DST_BITS];
+};
+
 /**
  * ovpn_peer_get_by_dst - Lookup peer to send skb to
  * @ovpn: the private data representing the current VPN session
@@ -615,6 +1368,15 @@ void ovpn_peer_update_local_endpoint(struct ovpn_peer *peer,
  * after encapsulation. The skb is expected to be the in-tunnel packet, without
  * any OpenVPN related header.
  *
+ * In MP mode every CPU remembers the peers it recently found, keyed by the
+ * inner destination and by the nexthop of the route the stack picked for
+ * it, so that flows routed behind a peer are served by a single probe
+ * instead of a walk of the routed prefixes and of the address table.
+ * Entries are only valid for the generation of the peer tables they were
+ * stored in, which changes whenever a peer or a routed prefix goes away:
+ * a matching entry therefore points to a peer that is still hashed.
+ * Must be called in BH context.
+ *
  * Assume that the IP header is accessible in the skb data.
  *
  * Return: the peer if found or NULL otherwise.
@@ -622,14 +1384,18 @@ void ovpn_peer_update_local_endpoint(struct ovpn_peer *peer,
 struct ovpn_peer *ovpn_peer_get_by_dst(struct ovpn_struct *ovpn,
 				       struct sk_buff *skb)
 {
+	struct ovpn_peer_collection *peers;
+	struct ovpn_peer_dst_cache *cache;
+	struct in6_addr daddr, nexthop;
 	struct ovpn_peer *peer = NULL;
-	struct in6_addr addr6;
+	struct ovpn_peer_dst *e;
 	__be32 addr4;
+	u32 genid;
 
 	/* in P2P mode, no matter the destination, packets are always sent to
 	 * the single peer listening on the other side
 	 */
-	if (ovpn->mode == OVPN_MODE_P2P) {
+	if (ovpn_mode_p2p(ovpn)) {
 		rcu_read_lock();
 		peer = rcu_dereference(ovpn->peer);
 		if (unlikely(peer && !ovpn_peer_hold(peer)))
@@ -638,18 +1404,59 @@ struct ovpn_peer *ovpn_peer_get_by_dst(struct ovpn_struct *ovpn,
 		return peer;
 	}
 
-	rcu_read_lock();
 	switch (skb_protocol_to_family(skb)) {
 	case AF_INET:
-		addr4 = ovpn_nexthop_from_skb4(skb);
-		peer = ovpn_peer_get_by_vpn_addr4(ovpn, addr4);
+		ipv6_addr_set_v4mapped(ip_hdr(skb)->daddr, &daddr);
+		ipv6_addr_set_v4mapped(ovpn_nexthop_from_skb4(skb), &nexthop);
 		break;
 	case AF_INET6:
-		addr6 = ovpn_nexthop_from_skb6(skb);
-		peer = ovpn_peer_get_by_vpn_addr6(ovpn, &addr6);
+		daddr = ipv6_hdr(skb)->daddr;
+		nexthop = ovpn_nexthop_from_skb6(skb);
 		break;
+	default:
+		return NULL;
+	}
+
+	rcu_read_lock();
+	peers = READ_ONCE(ovpn->peers);
+	cache = this_cpu_ptr(peers->dsts);
+	e = &cache->entries[hash_32(ipv6_addr_hash(&daddr),
+				    OVPN_PEER_DST_BITS)];
+	/* pairs with the releases in ovpn_peer_unhash() and in the trie of
+	 * routed prefixes: the tables looked up below are at least as recent
+	 * as this generation
+	 */
+	genid = smp_load_acquire(&peers->genid);
+	if (e->peer && e->genid == genid &&
+	    ipv6_addr_equal(&e->daddr, &daddr) &&
+	    ipv6_addr_equal(&e->nexthop, &nexthop)) {
+		peer = e->peer;
+		goto hold;
 	}
 
+	/* prefixes explicitly routed to a peer take precedence */
+	if (ipv6_addr_v4mapped(&daddr)) {
+		addr4 = daddr.s6_addr32[3];
+		peer = ovpn_iroute_lookup(ovpn, AF_INET, &addr4);
+		if (!peer)
+			peer = ovpn_peer_get_by_vpn_addr4(ovpn,
+							  nexthop.s6_addr32[3]);
+	} else {
+		peer = ovpn_iroute_lookup(ovpn, AF_INET6, &daddr);
+		if (!peer)
+			peer = ovpn_peer_get_by_vpn_addr6(ovpn, &nexthop);
+	}
+
+	/* the empty tables are shared by all instances: a peer found right
+	 * after the ones of this instance were allocated is not cached there
+	 */
+	if (peer && peers != ovpn_peers_empty) {
+		e->daddr = daddr;
+		e->nexthop = nexthop;
+		e->genid = genid;
+		e->peer = peer;
+	}
+hold:
 	if (unlikely(peer && !ovpn_peer_hold(peer)))
 		peer = NULL;
 	rcu_read_unlock();
@@ -672,7 +1479,9 @@ static __be32 ovpn_nexthop_from_rt4(struct ovpn_struct *ovpn, __be32 dest)
 {
 	struct rtable *rt;
 	struct flowi4 fl = {
-		.daddr = dest
+		.daddr = dest,
+		/* routes via an interface enslaved to a VRF are in its table */
+		.flowi4_l3mdev = l3mdev_master_ifindex(ovpn->dev),
 	};
 
 	rt = ip_route_output_flow(dev_net(ovpn->dev), &fl, NULL);
@@ -713,10 +1522,10 @@ static struct in6_addr ovpn_nexthop_from_rt6(struct ovpn_struct *ovpn,
 	struct rt6_info *rt;
 	struct flowi6 fl = {
 		.daddr = dest,
+		.flowi6_l3mdev = l3mdev_master_ifindex(ovpn->dev),
 	};
 
-	entry = ipv6_stub->ipv6_dst_lookup_flow(dev_net(ovpn->dev), NULL, &fl,
-						NULL);
+	entry = ovpn_route_lookup6(dev_net(ovpn->dev), NULL, &fl);
 	if (IS_ERR(entry)) {
 		net_dbg_ratelimited("%s: no route to host %pI6c\n", __func__,
 				    &dest);
@@ -738,6 +1547,64 @@ static struct in6_addr ovpn_nexthop_from_rt6(struct ovpn_struct *ovpn,
 	return dest;
 }
 
+/* current generation of the system routing table for the given family */
+static u32 ovpn_rpf_fib_genid(const struct net *net, sa_family_t family)
+{
+#if IS_ENABLED(CONFIG_IPV6)
+	if (family == AF_INET6)
+		return atomic_read(&net->ipv6.fib6_sernum);
+#endif
+	return rt_genid_ipv4(net);
+}
+
+/**
+ * ovpn_rpf_cache_lookup - check if a source was already verified for a peer
+ * @peer: the peer that sent the packet
+ * @src: the source address of the packet
+ * @fib_genid: current generation of the system routing table
+ * @peers_genid: current generation of the peer tables
+ *
+ * An entry is only valid if neither the routing table nor the VPN addresses
+ * assigned to peers changed since the entry was stored.
+ *
+ * Return: true if the entry is cached and still valid, false otherwise
+ */
+static bool ovpn_rpf_cache_lookup(struct ovpn_peer *peer,
+				  const struct in6_addr *src, u32 fib_genid,
+				  u32 peers_genid)
+{
+	const struct ovpn_rpf_entry *e;
+	unsigned int seq;
+	bool hit;
+
+	e = &peer->rpf_cache.entries[hash_32(ipv6_addr_hash(src),
+					     OVPN_RPF_CACHE_BITS)];
+	do {
+		seq = read_seqbegin(&peer->rpf_cache.lock);
+		hit = e->valid && e->fib_genid == fib_genid &&
+		      e->peers_genid == peers_genid &&
+		      ipv6_addr_equal(&e->src, src);
+	} while (read_seqretry(&peer->rpf_cache.lock, seq));
+
+	return hit;
+}
+
+static void ovpn_rpf_cache_store(struct ovpn_peer *peer,
+				 const struct in6_addr *src, u32 fib_genid,
+				 u32 peers_genid)
+{
+	struct ovpn_rpf_entry *e;
+
+	e = &peer->rpf_cache.entries[hash_32(ipv6_addr_hash(src),
+					     OVPN_RPF_CACHE_BITS)];
+	write_seqlock_bh(&peer->rpf_cache.lock);
+	e->src = *src;
+	e->fib_genid = fib_genid;
+	e->peers_genid = peers_genid;
+	e->valid = true;
+	write_sequnlock_bh(&peer->rpf_cache.lock);
+}
+
 /**
  * ovpn_peer_check_by_src - check that skb source is routed via peer
  * @ovpn: the openvpn instance to search
@@ -749,27 +1616,61 @@ static struct in6_addr ovpn_nexthop_from_rt6(struct ovpn_struct *ovpn,
 bool ovpn_peer_check_by_src(struct ovpn_struct *ovpn, struct sk_buff *skb,
 			    struct ovpn_peer *peer)
 {
+	u32 fib_genid, peers_genid;
+	struct in6_addr addr6, src;
+	struct ovpn_peer *tmp;
+	sa_family_t family;
 	bool match = false;
-	struct in6_addr addr6;
 	__be32 addr4;
 
-	if (ovpn->mode == OVPN_MODE_P2P) {
+	if (ovpn_mode_p2p(ovpn)) {
 		/* in P2P mode, no matter the destination, packets are always
 		 * sent to the single peer listening on the other side
 		 */
 		rcu_read_lock();
-		match = (peer == rcu_dereference(ovpn->peer));
+		match = (peer == rcu_dereference(ovpn->peer));
+		rcu_read_unlock();
+		return match;
+	}
+
+	family = skb_protocol_to_family(skb);
+	switch (family) {
+	case AF_INET:
+		ipv6_addr_set_v4mapped(ip_hdr(skb)->saddr, &src);
+		rcu_read_lock();
+		tmp = ovpn_iroute_lookup(ovpn, AF_INET, &ip_hdr(skb)->saddr);
 		rcu_read_unlock();
-		return match;
+		break;
+	case AF_INET6:
+		src = ipv6_hdr(skb)->saddr;
+		rcu_read_lock();
+		tmp = ovpn_iroute_lookup(ovpn, AF_INET6, &src);
+		rcu_read_unlock();
+		break;
+	default:
+		return false;
 	}
 
+	/* sources covered by an iroute must come from the peer owning it */
+	if (tmp)
+		return tmp == peer;
+
+	/* sources behind a peer are usually few and stable: skip the route
+	 * lookup if this one was verified since the last routing or peer
+	 * table change
+	 */
+	fib_genid = ovpn_rpf_fib_genid(dev_net(ovpn->dev), family);
+	peers_genid = READ_ONCE(ovpn->peers->genid);
+	if (ovpn_rpf_cache_lookup(peer, &src, fib_genid, peers_genid))
+		return true;
+
 	/* This function performs a reverse path check, therefore we now
 	 * lookup the nexthop we would use if we wanted to route a packet
 	 * to the source IP. If the nexthop matches the sender we know the
 	 * latter is valid and we allow the packet to come in
 	 */
 
-	switch (skb_protocol_to_family(skb)) {
+	switch (family) {
 	case AF_INET:
 		addr4 = ovpn_nexthop_from_rt4(ovpn, ip_hdr(skb)->saddr);
 		rcu_read_lock();
@@ -784,90 +1685,170 @@ bool ovpn_peer_check_by_src(struct ovpn_struct *ovpn, struct sk_buff *skb,
 		break;
 	}
 
+	/* only successful checks are cached, so that spoofed sources can't
+	 * evict legit entries at no cost
+	 */
+	if (match)
+		ovpn_rpf_cache_store(peer, &src, fib_genid, peers_genid);
+
 	return match;
 }
 
 /**
- * ovpn_peer_add_mp - add peer to related tables in a MP instance
+ * ovpn_peer_hash_mp - add peer to related tables in a MP instance
  * @ovpn: the instance to add the peer to
  * @peer: the peer to add
  *
+ * Must be called with the peers lock held and with the slot of the peer ID
+ * reserved in the by_id array.
+ *
  * Return: 0 on success or a negative error code otherwise
  */
-static int ovpn_peer_add_mp(struct ovpn_struct *ovpn, struct ovpn_peer *peer)
+static int ovpn_peer_hash_mp(struct ovpn_struct *ovpn, struct ovpn_peer *peer)
 {
-	struct sockaddr_storage sa = { 0 };
-	struct sockaddr_in6 *sa6;
-	struct sockaddr_in *sa4;
+	struct ovpn_transp_key key;
 	struct hlist_head *head;
 	struct ovpn_bind *bind;
 	struct ovpn_peer *tmp;
-	size_t salen;
-	int ret = 0;
+	int ret;
 
-	spin_lock_bh(&ovpn->peers->lock);
 	/* do not add duplicates */
 	tmp = ovpn_peer_get_by_id(ovpn, peer->id);
 	if (tmp) {
 		ovpn_peer_put(tmp);
-		ret = -EEXIST;
-		goto unlock;
+		return -EEXIST;
 	}
 
 	bind = rcu_dereference_protected(peer->bind, true);
 	/* peers connected via TCP have bind == NULL */
-	if (bind) {
-		switch (bind->sa.in4.sin_family) {
-		case AF_INET:
-			sa4 = (struct sockaddr_in *)&sa;
-
-			sa4->sin_family = AF_INET;
-			sa4->sin_addr.s_addr = bind->sa.in4.sin_addr.s_addr;
-			sa4->sin_port = bind->sa.in4.sin_port;
-			salen = sizeof(*sa4);
-			break;
-		case AF_INET6:
-			sa6 = (struct sockaddr_in6 *)&sa;
+	if (bind && !ovpn_transp_key_from_bind(bind, &key))
+		return -EPROTONOSUPPORT;
+
+	/* shared sockets demultiplex by peer ID across the instances */
+	if (ovpn->shared_socket) {
+		ret = ovpn_demux_add(peer);
+		if (ret < 0)
+			return ret;
+	}
 
-			sa6->sin6_family = AF_INET6;
-			sa6->sin6_addr = bind->sa.in6.sin6_addr;
-			sa6->sin6_port = bind->sa.in6.sin6_port;
-			salen = sizeof(*sa6);
-			break;
-		default:
-			ret = -EPROTONOSUPPORT;
-			goto unlock;
-		}
+	if (bind)
+		ovpn_peer_hash_transp(peer, &key);
 
-		head = ovpn_get_hash_head(ovpn->peers->by_transp_addr, &sa,
-					  salen);
-		hlist_add_head_rcu(&peer->hash_entry_transp_addr, head);
-	}
+	xa_store_bh(&ovpn->peers->by_id, peer->id, peer, GFP_ATOMIC);
 
-	hlist_add_head_rcu(&peer->hash_entry_id,
-			   ovpn_get_hash_head(ovpn->peers->by_id, &peer->id,
-					      sizeof(peer->id)));
+	/* invalidate RPF results cached by other peers and the missed IDs, the
+	 * release pairs with ovpn_peer_get_by_id_rx()
+	 */
+	smp_store_release(&ovpn->peers->genid, ovpn->peers->genid + 1);
 
 	if (peer->vpn_addrs.ipv4.s_addr != htonl(INADDR_ANY)) {
-		head = ovpn_get_hash_head(ovpn->peers->by_vpn_addr,
-					  &peer->vpn_addrs.ipv4,
-					  sizeof(peer->vpn_addrs.ipv4));
+		head = ovpn_peer_addr4_head(ovpn->peers,
+					    peer->vpn_addrs.ipv4.s_addr);
 		hlist_add_head_rcu(&peer->hash_entry_addr4, head);
 	}
 
 	if (!ipv6_addr_any(&peer->vpn_addrs.ipv6)) {
-		head = ovpn_get_hash_head(ovpn->peers->by_vpn_addr,
-					  &peer->vpn_addrs.ipv6,
-					  sizeof(peer->vpn_addrs.ipv6));
+		head = ovpn_peer_addr6_head(ovpn->peers, &peer->vpn_addrs.ipv6);
 		hlist_add_head_rcu(&peer->hash_entry_addr6, head);
 	}
 
-unlock:
+	return 0;
+}
+
+/* the tables of an instance are allocated along with its first peer, until
+ * then lookups walk the empty tables shared by all instances
+ */
+static int ovpn_peer_tables_alloc(struct ovpn_struct *ovpn)
+{
+	struct ovpn_peer_collection *peers;
+
+	if (likely(READ_ONCE(ovpn->peers) != ovpn_peers_empty))
+		return 0;
+
+	peers = ovpn_peer_collection_alloc(ovpn->table_size);
+	if (!peers)
+		return -ENOMEM;
+
+	/* another peer may have been added meanwhile */
+	if (cmpxchg(&ovpn->peers, ovpn_peers_empty, peers) != ovpn_peers_empty)
+		ovpn_peer_collection_free(peers);
+
+	return 0;
+}
+
+/**
+ * ovpn_peer_add_mp - add peer to related tables in a MP instance
+ * @ovpn: the instance to add the peer to
+ * @peer: the peer to add
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+static int ovpn_peer_add_mp(struct ovpn_struct *ovpn, struct ovpn_peer *peer)
+{
+	int ret;
+
+	ret = ovpn_peer_tables_alloc(ovpn);
+	if (ret < 0)
+		return ret;
+
+	/* make sure storing the peer below won't need to allocate memory */
+	ret = xa_reserve_bh(&ovpn->peers->by_id, peer->id, GFP_KERNEL);
+	if (ret < 0)
+		return ret;
+
+	ovpn_spin_lock_bh_stat(ovpn, &ovpn->peers->lock,
+			       lock_peers_contended);
+	ret = ovpn_peer_hash_mp(ovpn, peer);
+	/* no-op if the peer was stored */
+	xa_release(&ovpn->peers->by_id, peer->id);
 	spin_unlock_bh(&ovpn->peers->lock);
 
 	return ret;
 }
 
+/**
+ * ovpn_peer_add_bulk - add many peers to a MP instance at once
+ * @ovpn: the instance to add the peers to
+ * @peers: the peers to add (NULL entries are skipped)
+ * @errs: per-peer result. Entries already carrying an error are skipped,
+ *	  the others are set to the result of adding the related peer
+ * @n: number of entries in peers and errs
+ *
+ * All peers are hashed within a single critical section. As with
+ * ovpn_peer_add(), the caller transfers its reference of each added peer.
+ */
+void ovpn_peer_add_bulk(struct ovpn_struct *ovpn, struct ovpn_peer **peers,
+			int *errs, unsigned int n)
+{
+	unsigned int i;
+	int ret;
+
+	ret = ovpn_peer_tables_alloc(ovpn);
+
+	/* reserve all ID slots upfront, so that no allocation happens under
+	 * lock
+	 */
+	for (i = 0; i < n; i++) {
+		if (!peers[i] || errs[i])
+			continue;
+
+		errs[i] = ret ?: xa_reserve_bh(&ovpn->peers->by_id,
+					       peers[i]->id, GFP_KERNEL);
+	}
+
+	ovpn_spin_lock_bh_stat(ovpn, &ovpn->peers->lock,
+			       lock_peers_contended);
+	for (i = 0; i < n; i++) {
+		if (!peers[i] || errs[i])
+			continue;
+
+		errs[i] = ovpn_peer_hash_mp(ovpn, peers[i]);
+		/* no-op if the peer was stored */
+		xa_release(&ovpn->peers->by_id, peers[i]->id);
+	}
+	spin_unlock_bh(&ovpn->peers->lock);
+}
+
 /**
  * ovpn_peer_add_p2p - add peer to related tables in a P2P instance
  * @ovpn: the instance to add the peer to
@@ -925,10 +1906,19 @@ int ovpn_peer_add(struct ovpn_struct *ovpn, struct ovpn_peer *peer)
 static void ovpn_peer_unhash(struct ovpn_peer *peer,
 			     enum ovpn_del_peer_reason reason)
 {
-	hlist_del_init_rcu(&peer->hash_entry_id);
+	xa_erase_bh(&peer->ovpn->peers->by_id, peer->id);
+	if (peer->ovpn->shared_socket)
+		ovpn_demux_del(peer);
 	hlist_del_init_rcu(&peer->hash_entry_addr4);
 	hlist_del_init_rcu(&peer->hash_entry_addr6);
-	hlist_del_init_rcu(&peer->hash_entry_transp_addr);
+	/* the release pairs with ovpn_peer_get_by_dst(): a lookup in the new
+	 * generation cannot find the peer anymore
+	 */
+	smp_store_release(&peer->ovpn->peers->genid,
+			  peer->ovpn->peers->genid + 1);
+	ovpn_iroute_flush_peer(peer);
+	ovpn_mcast_flush_peer(peer);
+	ovpn_peer_unhash_transp(peer);
 
 	ovpn_peer_put(peer);
 	peer->delete_reason = reason;
@@ -947,7 +1937,8 @@ static int ovpn_peer_del_mp(struct ovpn_peer *peer,
 	struct ovpn_peer *tmp;
 	int ret = 0;
 
-	spin_lock_bh(&peer->ovpn->peers->lock);
+	ovpn_spin_lock_bh_stat(peer->ovpn, &peer->ovpn->peers->lock,
+			       lock_peers_contended);
 	tmp = ovpn_peer_get_by_id(peer->ovpn, peer->id);
 	if (tmp != peer) {
 		ret = -ENOENT;
@@ -1030,18 +2021,530 @@ int ovpn_peer_del(struct ovpn_peer *peer, enum ovpn_del_peer_reason reason)
 	}
 }
 
+/**
+ * ovpn_peer_keepalive_enabled - check if a peer has any keepalive configured
+ * @peer: the peer to check
+ *
+ * Return: true if either keepalive interval or timeout, the probe interval or
+ * the idle timeout is set
+ */
+static bool ovpn_peer_keepalive_enabled(const struct ovpn_peer *peer)
+{
+	return READ_ONCE(peer->keepalive_interval) ||
+	       READ_ONCE(peer->keepalive_timeout) ||
+	       READ_ONCE(peer->probe.interval) ||
+	       READ_ONCE(peer->idle_timeout);
+}
+
+/**
+ * ovpn_peer_keepalive_fast - check if a peer needs sub-second keepalives
+ * @peer: the peer to check
+ *
+ * Return: true if the keepalive interval or timeout, or the probe interval of
+ * the peer is below one second
+ */
+static bool ovpn_peer_keepalive_fast(const struct ovpn_peer *peer)
+{
+	unsigned long interval = READ_ONCE(peer->keepalive_interval);
+	unsigned long timeout = READ_ONCE(peer->keepalive_timeout);
+	unsigned long probe = READ_ONCE(peer->probe.interval);
+
+	return (interval && interval < MSEC_PER_SEC) ||
+	       (timeout && timeout < MSEC_PER_SEC) ||
+	       (probe && probe < MSEC_PER_SEC);
+}
+
+/**
+ * ovpn_peer_keepalive_expired - check if a peer has been silent for too long
+ * @peer: the peer to check
+ * @now: the current time in jiffies
+ *
+ * Return: true if the keepalive timeout of the peer has elapsed
+ */
+static bool ovpn_peer_keepalive_expired(const struct ovpn_peer *peer,
+					unsigned long now)
+{
+	unsigned long timeout = READ_ONCE(peer->keepalive_timeout);
+
+	if (!timeout)
+		return false;
+
+	return time_after_eq(now, READ_ONCE(peer->last_recv) +
+				  msecs_to_jiffies(timeout));
+}
+
+/**
+ * ovpn_peer_keepalive_deadline - get the next keepalive event of a peer
+ * @peer: the peer to check
+ * @deadline: the earliest deadline found so far, lowered if the peer has an
+ *	      earlier one
+ */
+static void ovpn_peer_keepalive_deadline(const struct ovpn_peer *peer,
+					 unsigned long *deadline)
+{
+	unsigned long interval = READ_ONCE(peer->keepalive_interval);
+	unsigned long timeout = READ_ONCE(peer->keepalive_timeout);
+	unsigned long t;
+
+	if (interval) {
+		t = READ_ONCE(peer->last_sent) + msecs_to_jiffies(interval);
+		if (time_before(t, *deadline))
+			*deadline = t;
+	}
+
+	if (timeout) {
+		t = READ_ONCE(peer->last_recv) + msecs_to_jiffies(timeout);
+		if (time_before(t, *deadline))
+			*deadline = t;
+	}
+
+	interval = READ_ONCE(peer->probe.interval);
+	if (interval) {
+		t = READ_ONCE(peer->probe.last) + msecs_to_jiffies(interval);
+		if (time_before(t, *deadline))
+			*deadline = t;
+	}
+
+	timeout = READ_ONCE(peer->idle_timeout);
+	if (timeout && !peer->idle) {
+		t = READ_ONCE(peer->last_data) +
+		    msecs_to_jiffies(timeout * MSEC_PER_SEC);
+		if (time_before(t, *deadline))
+			*deadline = t;
+	}
+}
+
+/**
+ * ovpn_peer_idle_check - compact a peer that has been idle for too long
+ * @peer: the peer to check
+ * @now: the current time in jiffies
+ *
+ * The cached routes and the AEAD requests cached by the key slots of an
+ * idle peer are released. None needs to be restored explicitly: the first
+ * packets sent or received after the idle period look the route up again
+ * and refill the request caches.
+ *
+ * Must be called under RCU read lock.
+ */
+static void ovpn_peer_idle_check(struct ovpn_peer *peer, unsigned long now)
+{
+	unsigned long timeout = READ_ONCE(peer->idle_timeout);
+
+	if (!timeout)
+		return;
+
+	if (time_before(now, READ_ONCE(peer->last_data) +
+			     msecs_to_jiffies(timeout * MSEC_PER_SEC))) {
+		/* traffic resumed, rebuilding what was released */
+		peer->idle = false;
+		return;
+	}
+
+	if (peer->idle)
+		return;
+
+	netdev_dbg(peer->ovpn->dev, "%s: compacting idle peer %u\n", __func__,
+		   peer->id);
+	peer->idle = true;
+
+	local_bh_disable();
+	ovpn_route_cache_reset(peer);
+	local_bh_enable();
+	ovpn_crypto_state_compact(&peer->crypto);
+	ovpn_dev_stats_inc(peer->ovpn, peer_idle);
+}
+
+/**
+ * ovpn_peer_keepalive_ping - queue a peer for a keepalive if one is due
+ * @peer: the peer to check
+ * @now: the current time in jiffies
+ * @ping: the list of peers to ping, linked by expire_entry
+ */
+static void ovpn_peer_keepalive_ping(struct ovpn_peer *peer, unsigned long now,
+				     struct list_head *ping)
+{
+	unsigned long interval = READ_ONCE(peer->keepalive_interval);
+	bool probe = ovpn_probe_due(peer, now);
+
+	/* probes are due regardless of the traffic sent to the peer */
+	if (!probe &&
+	    (!interval ||
+	     time_before(now, READ_ONCE(peer->last_sent) +
+			      msecs_to_jiffies(interval))))
+		return;
+
+	if (!ovpn_peer_hold(peer))
+		return;
+
+	netdev_dbg(peer->ovpn->dev, "%s: sending ping to peer %u\n", __func__,
+		   peer->id);
+	/* encryption may complete later: don't ping twice */
+	WRITE_ONCE(peer->last_sent, now);
+	if (probe) {
+		WRITE_ONCE(peer->probe.last, now);
+		set_bit(OVPN_PEER_PROBE_PENDING, &peer->flags);
+	}
+	list_add_tail(&peer->expire_entry, ping);
+}
+
+/**
+ * ovpn_peers_ping - send a keepalive to a batch of peers
+ * @ping: list of peers to ping, each one with a reference held
+ *
+ * Keepalives are encrypted back-to-back with BHs disabled and sent together
+ * by the NAPI context of the CPU every OVPN_KEEPALIVE_BATCH peers, rather
+ * than one by one with a separate trip down the UDP output path each.
+ */
+static void ovpn_peers_ping(struct list_head *ping)
+{
+	struct ovpn_peer *peer, *tmp;
+	unsigned int n = 0;
+
+	/* the TX path expects BH to be disabled */
+	local_bh_disable();
+	list_for_each_entry_safe(peer, tmp, ping, expire_entry) {
+		list_del(&peer->expire_entry);
+		if (test_and_clear_bit(OVPN_PEER_PROBE_PENDING, &peer->flags))
+			ovpn_probe_xmit(peer);
+		else
+			ovpn_keepalive_xmit(peer);
+		ovpn_peer_put(peer);
+
+		if (++n % OVPN_KEEPALIVE_BATCH)
+			continue;
+
+		/* let the batch be sent before encrypting the next one */
+		local_bh_enable();
+		cond_resched();
+		local_bh_disable();
+	}
+	local_bh_enable();
+}
+
+/**
+ * ovpn_peers_expire - delete a batch of expired peers in a MP instance
+ * @ovpn: the instance the peers belong to
+ * @expired: list of expired peers, each one with a reference held
+ *
+ * All peers are unhashed within a single critical section and userspace is
+ * then notified with as few messages as possible. Peers removed concurrently
+ * by somebody else are skipped, because their notification is sent already.
+ */
+static void ovpn_peers_expire(struct ovpn_struct *ovpn,
+			      struct list_head *expired)
+{
+	struct ovpn_peer *peer, *tmp;
+	LIST_HEAD(stale);
+
+	ovpn_spin_lock_bh_stat(ovpn, &ovpn->peers->lock,
+			       lock_peers_contended);
+	list_for_each_entry_safe(peer, tmp, expired, expire_entry) {
+		if (xa_load(&ovpn->peers->by_id, peer->id) != peer) {
+			list_move(&peer->expire_entry, &stale);
+			continue;
+		}
+
+		netdev_dbg(ovpn->dev, "%s: peer %u expired\n", __func__,
+			   peer->id);
+		ovpn_peer_unhash(peer, OVPN_DEL_PEER_REASON_EXPIRED);
+	}
+	spin_unlock_bh(&ovpn->peers->lock);
+
+	ovpn_nl_notify_del_peers(ovpn, expired);
+
+	list_splice(&stale, expired);
+	list_for_each_entry_safe(peer, tmp, expired, expire_entry) {
+		list_del(&peer->expire_entry);
+		ovpn_peer_put(peer);
+	}
+}
+
+/**
+ * ovpn_peer_keepalive_work - periodic keepalive check for all peers
+ * @work: the work embedded in the ovpn instance
+ *
+ * Checks all peers of an instance in one batch, instead of arming two timers
+ * per peer that would have to be modified for each packet. The work re-arms
+ * itself as long as any peer has a keepalive configured.
+ *
+ * The datapath only records when traffic was last sent and received: the
+ * work is re-armed for the earliest deadline these timestamps lead to, so
+ * that a busy peer pushing its deadlines forward just makes the next run
+ * sleep longer. Runs are at least OVPN_KEEPALIVE_PERIOD apart, unless a peer
+ * has sub-second keepalive values: only then the work may run every jiffy,
+ * still walking all peers at once rather than each peer arming its own
+ * timer.
+ */
+void ovpn_peer_keepalive_work(struct work_struct *work)
+{
+	struct ovpn_struct *ovpn = container_of(work, struct ovpn_struct,
+						keepalive_work.work);
+	unsigned long now = jiffies, index, delay;
+	unsigned long next = now + OVPN_KEEPALIVE_MAX_PERIOD;
+	struct ovpn_peer *peer;
+	unsigned long period = OVPN_KEEPALIVE_PERIOD;
+	LIST_HEAD(expired);
+	bool rearm = false;
+	LIST_HEAD(ping);
+
+	rcu_read_lock();
+	switch (ovpn->mode) {
+	case OVPN_MODE_P2P:
+		peer = rcu_dereference(ovpn->peer);
+		if (!peer)
+			break;
+
+		rearm = ovpn_peer_keepalive_enabled(peer);
+		if (ovpn_peer_keepalive_fast(peer))
+			period = 1;
+		if (ovpn_peer_keepalive_expired(peer, now)) {
+			netdev_dbg(ovpn->dev, "%s: peer %u expired\n",
+				   __func__, peer->id);
+			local_bh_disable();
+			ovpn_peer_del(peer, OVPN_DEL_PEER_REASON_EXPIRED);
+			local_bh_enable();
+			break;
+		}
+
+		ovpn_peer_keepalive_ping(peer, now, &ping);
+		ovpn_peer_idle_check(peer, now);
+		ovpn_peer_keepalive_deadline(peer, &next);
+		break;
+	case OVPN_MODE_MP:
+		xa_for_each(&ovpn->peers->by_id, index, peer) {
+			rearm |= ovpn_peer_keepalive_enabled(peer);
+			if (ovpn_peer_keepalive_fast(peer))
+				period = 1;
+
+			if (!ovpn_peer_keepalive_expired(peer, now)) {
+				ovpn_peer_keepalive_ping(peer, now, &ping);
+				ovpn_peer_idle_check(peer, now);
+				ovpn_peer_keepalive_deadline(peer, &next);
+				continue;
+			}
+
+			/* peers are deleted in batch once the walk is over */
+			if (ovpn_peer_hold(peer))
+				list_add_tail(&peer->expire_entry, &expired);
+		}
+		break;
+	}
+	rcu_read_unlock();
+
+	if (!list_empty(&ping))
+		ovpn_peers_ping(&ping);
+
+	if (!list_empty(&expired))
+		ovpn_peers_expire(ovpn, &expired);
+
+	if (!rearm || !READ_ONCE(ovpn->registered))
+		return;
+
+	delay = time_after(next, now + period) ? next - now : period;
+	schedule_delayed_work(&ovpn->keepalive_work, delay);
+}
+
+/* drop the cached routes of a UDP peer and re-evaluate its paths */
+static unsigned int ovpn_peer_link_event(struct ovpn_peer *peer,
+					 struct net *net)
+{
+	struct ovpn_path_set *set;
+
+	/* TCP peers are routed by their socket */
+	if (peer->proto != IPPROTO_UDP)
+		return 0;
+
+	ovpn_route_cache_reset(peer);
+
+	set = rcu_dereference(peer->paths);
+	if (!set)
+		return 0;
+
+	return ovpn_path_set_link_event(set, net);
+}
+
+/**
+ * ovpn_peers_link_event - react to a lower device changing state
+ * @ovpn: the instance whose peers may be reached over @dev
+ * @dev: the lower device that went up or down
+ * @up: whether @dev can carry packets now
+ *
+ * Once the routing tables of the netns of @dev reflect its new state, any
+ * route cached by a peer may be stale: all of them are dropped at once
+ * rather than one by one as sending fails. Multipath peers move their
+ * traffic off the paths that lost their route right away. Userspace is
+ * notified once for the whole instance.
+ */
+void ovpn_peers_link_event(struct ovpn_struct *ovpn, struct net_device *dev,
+			   bool up)
+{
+	struct net *net = dev_net(dev);
+	unsigned int excluded = 0;
+	struct ovpn_peer *peer;
+	unsigned long index;
+	bool any = false;
+
+	rcu_read_lock();
+	switch (ovpn->mode) {
+	case OVPN_MODE_P2P:
+		peer = rcu_dereference(ovpn->peer);
+		if (!peer)
+			break;
+
+		excluded = ovpn_peer_link_event(peer, net);
+		any = true;
+		break;
+	case OVPN_MODE_MP:
+		xa_for_each(&ovpn->peers->by_id, index, peer) {
+			excluded += ovpn_peer_link_event(peer, net);
+			any = true;
+		}
+		break;
+	}
+	rcu_read_unlock();
+
+	if (any)
+		ovpn_nl_notify_link_change(ovpn, dev, up, excluded);
+}
+
+/* tables of the MP instances that never had a peer, always empty */
+struct ovpn_peer_collection *ovpn_peers_empty __read_mostly;
+
+/**
+ * ovpn_peer_collections_init - allocate the empty peer tables
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_peer_collections_init(void)
+{
+	ovpn_peers_empty = ovpn_peer_collection_alloc(1);
+
+	return ovpn_peers_empty ? 0 : -ENOMEM;
+}
+
+/**
+ * ovpn_peer_collections_cleanup - release the empty peer tables
+ */
+void ovpn_peer_collections_cleanup(void)
+{
+	struct ovpn_peer_collection *peers = ovpn_peers_empty;
+
+	ovpn_peers_empty = NULL;
+	ovpn_peer_collection_free(peers);
+}
+
+/**
+ * ovpn_peer_collection_alloc - allocate the peer tables for MultiPeer mode
+ * @size: requested number of buckets in each table
+ *
+ * The size is rounded up to the next power of 2.
+ *
+ * Return: the new collection or NULL on allocation failure
+ */
+struct ovpn_peer_collection *ovpn_peer_collection_alloc(unsigned int size)
+{
+	struct ovpn_peer_collection *peers;
+
+	peers = kzalloc(sizeof(*peers), GFP_KERNEL);
+	if (!peers)
+		return NULL;
+
+	xa_init_flags(&peers->by_id, XA_FLAGS_LOCK_BH);
+	peers->size = roundup_pow_of_two(size);
+	peers->by_transp_addr = kvcalloc(peers->size,
+					 sizeof(*peers->by_transp_addr),
+					 GFP_KERNEL);
+	peers->by_vpn_addr4 = kvcalloc(peers->size,
+				       sizeof(*peers->by_vpn_addr4),
+				       GFP_KERNEL);
+	peers->by_vpn_addr6 = kvcalloc(peers->size,
+				       sizeof(*peers->by_vpn_addr6),
+				       GFP_KERNEL);
+	peers->misses = alloc_percpu(struct ovpn_peer_miss_cache);
+	peers->dsts = alloc_percpu(struct ovpn_peer_dst_cache);
+	if (!peers->by_transp_addr || !peers->by_vpn_addr4 ||
+	    !peers->by_vpn_addr6 || !peers->misses || !peers->dsts ||
+	    alloc_bucket_spinlocks(&peers->transp_locks,
+				   &peers->transp_locks_mask, peers->size,
+				   OVPN_PEER_TRANSP_LOCKS_PER_CPU,
+				   GFP_KERNEL)) {
+		ovpn_peer_collection_free(peers);
+		return NULL;
+	}
+
+	spin_lock_init(&peers->lock);
+
+	return peers;
+}
+
+/**
+ * ovpn_peer_collection_free - release the peer tables
+ * @peers: the collection to free (may be NULL or the empty tables)
+ */
+void ovpn_peer_collection_free(struct ovpn_peer_collection *peers)
+{
+	if (!peers || peers == ovpn_peers_empty)
+		return;
+
+	xa_destroy(&peers->by_id);
+	free_bucket_spinlocks(peers->transp_locks);
+	free_percpu(peers->dsts);
+	free_percpu(peers->misses);
+	kvfree(peers->by_transp_addr);
+	kvfree(peers->by_vpn_addr4);
+	kvfree(peers->by_vpn_addr6);
+	kfree(peers);
+}
+
+/* peers unhashed within one critical section of the teardown */
+#define OVPN_PEERS_FREE_BATCH 256
+
 /**
  * ovpn_peers_free - free all peers in the instance
  * @ovpn: the instance whose peers should be released
+ *
+ * Peers are unhashed in batches of OVPN_PEERS_FREE_BATCH, so that BHs are
+ * not disabled for the whole walk, and are released once all of them are
+ * unreachable, outside of the peers lock. Userspace receives one
+ * notification for all peers instead of one per peer.
  */
 void ovpn_peers_free(struct ovpn_struct *ovpn)
 {
-	struct hlist_node *tmp;
-	struct ovpn_peer *peer;
-	int bkt;
-
-	spin_lock_bh(&ovpn->peers->lock);
-	hash_for_each_safe(ovpn->peers->by_id, bkt, tmp, peer, hash_entry_id)
-		ovpn_peer_unhash(peer, OVPN_DEL_PEER_REASON_TEARDOWN);
-	spin_unlock_bh(&ovpn->peers->lock);
+	struct ovpn_peer *peer, *tmp;
+	unsigned long index;
+	LIST_HEAD(removed);
+	unsigned int n;
+	bool notified;
+
+	do {
+		n = 0;
+		ovpn_spin_lock_bh_stat(ovpn, &ovpn->peers->lock,
+				       lock_peers_contended);
+		xa_for_each(&ovpn->peers->by_id, index, peer) {
+			/* keep the peer until the notification is sent */
+			kref_get(&peer->refcount);
+			list_add_tail(&peer->expire_entry, &removed);
+			ovpn_peer_unhash(peer, OVPN_DEL_PEER_REASON_TEARDOWN);
+			if (++n == OVPN_PEERS_FREE_BATCH)
+				break;
+		}
+		spin_unlock_bh(&ovpn->peers->lock);
+		cond_resched();
+	} while (n == OVPN_PEERS_FREE_BATCH);
+
+	if (list_empty(&removed))
+		return;
+
+	/* on failure each peer is notified upon release */
+	notified = !ovpn_nl_notify_del_all_peers(ovpn,
+						 OVPN_DEL_PEER_REASON_TEARDOWN);
+
+	n = 0;
+	list_for_each_entry_safe(peer, tmp, &removed, expire_entry) {
+		list_del(&peer->expire_entry);
+		peer->del_notified |= notified;
+		ovpn_peer_put(peer);
+		if (!(++n % OVPN_PEERS_FREE_BATCH))
+			cond_resched();
+	}
 }
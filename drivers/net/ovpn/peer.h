@@ -10,12 +10,17 @@
 #ifndef _NET_OVPN_OVPNPEER_H_
 #define _NET_OVPN_OVPNPEER_H_
 
+#include <linux/jump_label_ratelimit.h>
+#include <linux/netdevice.h>
+#include <linux/seqlock.h>
 #include <net/dst_cache.h>
-#include <net/strparser.h>
+#include <net/sock.h>
 #include <uapi/linux/ovpn.h>
 
 #include "bind.h"
 #include "pktid.h"
+#include "probe.h"
+#include "ratelimit.h"
 #include "crypto.h"
 #include "socket.h"
 #include "stats.h"
@@ -23,94 +28,239 @@
 #include <net/dst_cache.h>
 #include <uapi/linux/ovpn.h>
 
+/* bits of ovpn_peer::flags */
+enum {
+	OVPN_PEER_FLOAT_PENDING,	/* transport address must be rehashed */
+	OVPN_PEER_MSS_CLAMP,		/* MSS of TCP SYNs is clamped to @mtu */
+	OVPN_PEER_FLOAT_NOTIFY,		/* float must be reported to userspace */
+	OVPN_PEER_PROBE_PENDING,	/* next ping must be a probe request */
+};
+
+#define OVPN_RPF_CACHE_BITS 3
+#define OVPN_RPF_CACHE_SIZE (1 << OVPN_RPF_CACHE_BITS)
+
+/* how long the packets of a peer failing authentication too often are
+ * dropped without being decrypted
+ */
+#define OVPN_PEER_QUARANTINE_TIME (5 * HZ)
+
+struct ovpn_mirror;
+struct ovpn_peer_cputime;
+struct ovpn_peer_latency;
+struct ovpn_peer_tcp;
+struct ovpn_route;
+
+/**
+ * struct ovpn_rpf_entry - a source address that passed the RPF check
+ * @src: the source address (IPv4 addresses are stored v4-mapped)
+ * @fib_genid: generation of the system routing table at check time
+ * @peers_genid: generation of the peer tables at check time
+ * @valid: true if the entry was ever filled
+ */
+struct ovpn_rpf_entry {
+	struct in6_addr src;
+	u32 fib_genid;
+	u32 peers_genid;
+	bool valid;
+};
+
+/**
+ * struct ovpn_rpf_cache - per-peer cache of verified source addresses
+ * @lock: protects the entries against concurrent RX on multiple CPUs
+ * @entries: direct-mapped entries, indexed by source address hash
+ */
+struct ovpn_rpf_cache {
+	seqlock_t lock;
+	struct ovpn_rpf_entry entries[OVPN_RPF_CACHE_SIZE];
+};
+
 /**
  * struct ovpn_peer - the main remote peer object
  * @ovpn: main openvpn instance this peer belongs to
  * @id: unique identifier
+ * @bind: remote peer binding
+ * @paths: paths the peer is reached over besides @bind (UDP only, NULL if
+ *	   none)
+ * @sock: the socket being used to talk to this peer
+ * @csock: UDP socket connected to the peer, created on request to be hit by
+ *	   the early demux (UDP only, NULL if none)
+ * @vpn_stats: per-peer in-VPN TX/RX stats (per-CPU)
+ * @link_stats: per-peer link/transport TX/RX stats (per-CPU)
+ * @errors: per-peer drop counters (per-CPU)
+ * @latency: per-peer latency histograms (per-CPU, NULL if disabled)
+ * @cputime: per-peer crypto CPU time (per-CPU, NULL if disabled)
+ * @mirror: capture configuration of the peer (NULL if not mirrored)
+ * @crypto: the crypto configuration (ciphers, keys, etc..)
+ * @tcp: TCP specific state (TCP only, allocated when the socket is attached)
+ * @proto: transport protocol of @sock, cached for the datapath (0 if none)
+ * @tx_ports: outer source ports the flows sent to the peer are spread over
+ *	      (UDP only, empty to send from the port of the socket)
+ * @rx_ports: source ports the peer may send from besides the port of its
+ *	      binding without floating (UDP only)
+ * @comp_stub: compression stub framing of the inner packets, as negotiated
+ *	       with a peer accepting no compression (enum ovpn_comp_stub)
+ * @out_mark: firewall mark of the outer packets sent to the peer, which
+ *	      their route is looked up with (UDP only, 0 for the mark of the
+ *	      socket)
+ * @last_sent: jiffies of the last packet sent to the peer
+ * @last_recv: jiffies of the last authenticated packet received from the peer
+ * @last_data: jiffies of the last packet tunneled to or from the peer,
+ *	       keepalives excluded
+ * @stats_gen: instance stats generation at the time stats last changed
+ * @node: NUMA node new key slots of the peer are allocated on
+ * @node_cand: NUMA node the last packets of the peer were received on
+ * @node_cand_cnt: consecutive packets received on @node_cand
+ * @crypto_inflight_rx: received packets pending on an async crypto engine
+ * @crypto_inflight_tx: packets to send pending on an async crypto engine
+ * @dst_cache: cache for dst_entry used to send to peer (not initialized if
+ *	       the interface uses a shared route table)
+ * @route: entry of the shared route table used to send to peer
+ * @route_genid: routing generation @route was last looked up at
+ * @pmtu: largest packet that reaches the peer unfragmented once encapsulated,
+ *	  as of the last route used to send to it (0 if unknown, UDP only)
+ * @rpf_cache: cache of source addresses verified by the RPF check (MP only)
+ * @mtu: largest packet that can be sent to the peer (0 if limited by the
+ *	 interface MTU only)
+ * @rx_cpu: CPU decrypting the UDP packets received from the peer (-1 for the
+ *	    CPU they are received on)
+ * @sched_queue: packets waiting for the TX scheduler (fair queuing only)
+ * @sched_prio: latency sensitive packets waiting for the TX scheduler, sent
+ *		before those in @sched_queue
+ * @sched_entry: entry in the list of peers served by the TX scheduler
+ * @sched_deficit: bytes the peer may still send in the current round
+ * @sched_weight: quanta given to the peer in every round of the TX scheduler
+ * @tx_limit: rate limit of the packets sent to the peer
+ * @rx_limit: rate limit of the packets received from the peer
+ * @decrypt_limit: budget of the packets of the peer that may be decrypted,
+ *		   checked before authenticating them
+ * @auth_fail_limit: rate of authentication failures tolerated before the
+ *		     peer is quarantined, one token per failure
+ * @quarantine_until: time the quarantine of the peer ends at, 0 if none
  * @vpn_addrs: IP addresses assigned over the tunnel
  * @vpn_addrs.ipv4: IPv4 assigned to peer on the tunnel
  * @vpn_addrs.ipv6: IPv6 assigned to peer on the tunnel
- * @hash_entry_id: entry in the peer ID hashtable
  * @hash_entry_addr4: entry in the peer IPv4 hashtable
  * @hash_entry_addr6: entry in the peer IPv6 hashtable
  * @hash_entry_transp_addr: entry in the peer transport address hashtable
- * @sock: the socket being used to talk to this peer
- * @tcp: keeps track of TCP specific state
- * @tcp.strp: stream parser context (TCP only)
- * @tcp.tx_work: work for deferring outgoing packet processing (TCP only)
- * @tcp.user_queue: received packets that have to go to userspace (TCP only)
- * @tcp.tx_in_progress: true if TX is already ongoing (TCP only)
- * @tcp.out_msg.skb: packet scheduled for sending (TCP only)
- * @tcp.out_msg.offset: offset where next send should start (TCP only)
- * @tcp.out_msg.len: remaining data to send within packet (TCP only)
- * @tcp.sk_cb.sk_data_ready: pointer to original cb (TCP only)
- * @tcp.sk_cb.sk_write_space: pointer to original cb (TCP only)
- * @tcp.sk_cb.prot: pointer to original prot object (TCP only)
- * @tcp.sk_cb.ops: pointer to the original prot_ops object (TCP only)
- * @crypto: the crypto configuration (ciphers, keys, etc..)
- * @dst_cache: cache for dst_entry used to send to peer
- * @bind: remote peer binding
- * @keepalive_xmit: timer used to send the next keepalive
- * @keepalive_interval: seconds after which a new keepalive should be sent
- * @keepalive_recv: timer used to check for received keepalives
- * @keepalive_timeout: seconds after which an inactive peer is considered dead
+ * @transp_hash: hash of the transport address the peer is hashed with (MP only)
+ * @float_node: entry in the list of peers the float worker has to rehash
+ * @float_notify_node: entry in the list of peers whose float has to be
+ *		       reported to userspace
+ * @flags: OVPN_PEER_* bits
+ * @bpf_cookie: opaque value attached to the peer by BPF programs
+ * @iroutes: prefixes routed to this peer (MP only)
+ * @mcast: multicast groups this peer is a member of (MP only)
+ * @keepalive_interval: milliseconds after which a new keepalive should be
+ *			sent
+ * @keepalive_timeout: milliseconds after which an inactive peer is considered
+ *		       dead
+ * @probe: round trip estimation, sampled by probes sent along keepalives
+ * @idle_timeout: seconds without tunneled traffic after which the resources
+ *		  of the peer that can be rebuilt on demand are released (0 to
+ *		  disable)
+ * @idle: true if the resources of the peer were released for being idle
+ * @replay_window: size of the replay window used by newly installed keys
+ * @rekey_threshold: percentage of the packet ID space newly installed keys
+ *		     can use before userspace is asked to rekey
  * @halt: true if ovpn_peer_mark_delete was called
- * @vpn_stats: per-peer in-VPN TX/RX stays
- * @link_stats: per-peer link/transport TX/RX stats
  * @delete_reason: why peer was deleted (i.e. timeout, transport error, ..)
- * @lock: protects binding to peer (bind)
+ * @del_notified: true if userspace was already notified about the deletion
+ * @reported_vpn: VPN stats as of the last record multicast by the monitor
+ * @reported_link: link stats as of the last record multicast by the monitor
+ * @vpn_base: totals of @vpn_stats at the last reset
+ * @link_base: totals of @link_stats at the last reset
+ * @errors_base: totals of @errors at the last reset
+ * @expire_entry: entry in the list of peers being expired or pinged by the
+ *		  keepalive worker
+ * @lock: protects binding to peer (bind and paths)
+ * @config_lock: serializes the netlink requests reconfiguring the peer
  * @refcount: reference counter
  * @rcu: used to free peer in an RCU safe way
  * @delete_work: deferred cleanup work, used to notify userspace
  */
 struct ovpn_peer {
+	/* read by the datapath for every packet */
 	struct ovpn_struct *ovpn;
 	u32 id;
+	struct ovpn_bind __rcu *bind;
+	struct ovpn_path_set __rcu *paths;
+	struct ovpn_socket *sock;
+	struct ovpn_socket *csock;
+	struct ovpn_peer_stats __percpu *vpn_stats;
+	struct ovpn_peer_stats __percpu *link_stats;
+	struct ovpn_peer_errors __percpu *errors;
+	struct ovpn_peer_latency __percpu *latency;
+	struct ovpn_peer_cputime __percpu *cputime;
+	struct ovpn_mirror __rcu *mirror;
+	struct ovpn_crypto_state crypto;
+	struct ovpn_peer_tcp *tcp;
+	u8 proto;
+	struct ovpn_port_range tx_ports;
+	struct ovpn_port_range rx_ports;
+	u8 comp_stub;
+	u32 out_mark;
+
+	/* written by the datapath */
+	unsigned long last_sent ____cacheline_aligned_in_smp;
+	unsigned long last_recv;
+	unsigned long last_data;
+	u32 stats_gen;
+	int node;
+	int node_cand;
+	unsigned int node_cand_cnt;
+	atomic_t crypto_inflight_rx;
+	atomic_t crypto_inflight_tx;
+	struct dst_cache dst_cache;
+	struct ovpn_route __rcu *route;
+	int route_genid;
+	unsigned int pmtu;
+	struct ovpn_rpf_cache rpf_cache;
+	unsigned int mtu;
+	int rx_cpu;
+	struct sk_buff_head sched_queue;
+	struct sk_buff_head sched_prio;
+	struct list_head sched_entry;
+	int sched_deficit;
+	u32 sched_weight;
+	struct ovpn_ratelimit tx_limit;
+	struct ovpn_ratelimit rx_limit;
+	struct ovpn_ratelimit decrypt_limit;
+	struct ovpn_ratelimit auth_fail_limit;
+	unsigned long quarantine_until;
+
+	/* lookup tables and control path */
 	struct {
 		struct in_addr ipv4;
 		struct in6_addr ipv6;
-	} vpn_addrs;
-	struct hlist_node hash_entry_id;
+	} vpn_addrs ____cacheline_aligned_in_smp;
 	struct hlist_node hash_entry_addr4;
 	struct hlist_node hash_entry_addr6;
 	struct hlist_node hash_entry_transp_addr;
-	struct ovpn_socket *sock;
-
-	/* state of the TCP reading. Needed to keep track of how much of a
-	 * single packet has already been read from the stream and how much is
-	 * missing
-	 */
-	struct {
-		struct strparser strp;
-		struct work_struct tx_work;
-		struct sk_buff_head user_queue;
-		bool tx_in_progress;
-
-		struct {
-			struct sk_buff *skb;
-			int offset;
-			int len;
-		} out_msg;
-
-		struct {
-			void (*sk_data_ready)(struct sock *sk);
-			void (*sk_write_space)(struct sock *sk);
-			struct proto *prot;
-			const struct proto_ops *ops;
-		} sk_cb;
-	} tcp;
-	struct ovpn_crypto_state crypto;
-	struct dst_cache dst_cache;
-	struct ovpn_bind __rcu *bind;
-	struct timer_list keepalive_xmit;
+	u32 transp_hash;
+	struct llist_node float_node;
+	struct llist_node float_notify_node;
+	unsigned long flags;
+	u64 bpf_cookie;
+	struct list_head iroutes;
+	struct list_head mcast;
 	unsigned long keepalive_interval;
-	struct timer_list keepalive_recv;
 	unsigned long keepalive_timeout;
+	struct ovpn_probe probe;
+	unsigned long idle_timeout;
+	bool idle;
+	unsigned int replay_window;
+	unsigned int rekey_threshold;
 	bool halt;
-	struct ovpn_peer_stats vpn_stats;
-	struct ovpn_peer_stats link_stats;
 	enum ovpn_del_peer_reason delete_reason;
+	bool del_notified;
+	struct ovpn_peer_stats_sum reported_vpn;
+	struct ovpn_peer_stats_sum reported_link;
+	struct ovpn_peer_stats_base vpn_base;
+	struct ovpn_peer_stats_base link_base;
+	struct ovpn_peer_errors_base errors_base;
+	struct list_head expire_entry;
 	spinlock_t lock; /* protects bind */
+	struct mutex config_lock; /* serializes SET_PEER */
 	struct kref refcount;
 	struct rcu_head rcu;
 	struct work_struct delete_work;
@@ -127,9 +277,91 @@ static inline bool ovpn_peer_hold(struct ovpn_peer *peer)
 	return kref_get_unless_zero(&peer->refcount);
 }
 
+void ovpn_peer_reset(struct ovpn_peer *peer);
+void ovpn_peer_out_mark_set(struct ovpn_peer *peer, u32 mark);
 void ovpn_peer_release(struct ovpn_peer *peer);
 void ovpn_peer_release_kref(struct kref *kref);
 void ovpn_peer_release(struct ovpn_peer *peer);
+void ovpn_peer_set_proto(struct ovpn_peer *peer, u8 proto);
+
+extern struct static_key_false_deferred ovpn_tcp_enabled;
+
+/**
+ * ovpn_peer_is_udp - check whether a peer is reached over UDP
+ * @peer: the peer to check
+ *
+ * As long as no peer uses TCP, the check is patched out of the datapath.
+ *
+ * Return: true if the transport of @peer is UDP, false otherwise
+ */
+static inline bool ovpn_peer_is_udp(const struct ovpn_peer *peer)
+{
+	return !static_branch_unlikely(&ovpn_tcp_enabled.key) ||
+	       READ_ONCE(peer->proto) == IPPROTO_UDP;
+}
+
+/**
+ * ovpn_peer_quarantined - check whether the packets of a peer are refused
+ * @peer: the peer to check
+ *
+ * Return: true if the peer failed authentication too often lately
+ */
+static inline bool ovpn_peer_quarantined(struct ovpn_peer *peer)
+{
+	unsigned long until = READ_ONCE(peer->quarantine_until);
+
+	if (likely(!until))
+		return false;
+
+	if (time_before(jiffies, until))
+		return true;
+
+	/* unless quarantined again meanwhile */
+	cmpxchg(&peer->quarantine_until, until, 0);
+	return false;
+}
+
+/**
+ * ovpn_peer_is_tcp - check whether a peer is reached over TCP
+ * @peer: the peer to check
+ *
+ * Return: true if the transport of @peer is TCP, false otherwise
+ */
+static inline bool ovpn_peer_is_tcp(const struct ovpn_peer *peer)
+{
+	return static_branch_unlikely(&ovpn_tcp_enabled.key) &&
+	       READ_ONCE(peer->proto) == IPPROTO_TCP;
+}
+
+/**
+ * ovpn_peer_queue - map a peer to one of the device queues
+ * @peer: the peer to map
+ * @num_queues: the number of queues available
+ *
+ * Peer IDs are allocated densely by userspace, therefore they already spread
+ * evenly across queues.
+ *
+ * Return: the index of the queue serving the peer
+ */
+static inline u16 ovpn_peer_queue(const struct ovpn_peer *peer,
+				  unsigned int num_queues)
+{
+	return peer->id % num_queues;
+}
+
+/**
+ * ovpn_peer_txq - get the netdev TX queue feeding packets to a peer
+ * @peer: the destination peer
+ *
+ * Return: the TX queue the packets directed to peer are sent from
+ */
+static inline struct netdev_queue *ovpn_peer_txq(struct ovpn_peer *peer)
+{
+	struct net_device *dev = peer->ovpn->dev;
+
+	return netdev_get_tx_queue(dev, ovpn_peer_queue(peer,
+							dev->real_num_tx_queues));
+}
 
 /**
  * ovpn_peer_put - decrease reference counter
@@ -140,15 +372,34 @@ static inline void ovpn_peer_put(struct ovpn_peer *peer)
 	kref_put(&peer->refcount, ovpn_peer_release_kref);
 }
 
-struct ovpn_peer *ovpn_peer_new(struct ovpn_struct *ovpn, u32 id);
+struct ovpn_peer *ovpn_peer_new(struct ovpn_struct *ovpn, u32 id, int node);
+void ovpn_peer_free(struct ovpn_peer *peer);
 int ovpn_peer_add(struct ovpn_struct *ovpn, struct ovpn_peer *peer);
+void ovpn_peer_add_bulk(struct ovpn_struct *ovpn, struct ovpn_peer **peers,
+			int *errs, unsigned int n);
 int ovpn_peer_del(struct ovpn_peer *peer, enum ovpn_del_peer_reason reason);
 void ovpn_peer_release_p2p(struct ovpn_struct *ovpn);
 void ovpn_peers_free(struct ovpn_struct *ovpn);
+void ovpn_peers_link_event(struct ovpn_struct *ovpn, struct net_device *dev,
+			   bool up);
+
+extern struct ovpn_peer_collection *ovpn_peers_empty;
+
+int ovpn_peer_collections_init(void);
+void ovpn_peer_collections_cleanup(void);
+struct ovpn_peer_collection *ovpn_peer_collection_alloc(unsigned int size);
+void ovpn_peer_collection_free(struct ovpn_peer_collection *peers);
 
 struct ovpn_peer *ovpn_peer_get_by_transp_addr(struct ovpn_struct *ovpn,
 					       struct sk_buff *skb);
+struct ovpn_peer *ovpn_peer_get_by_remote(struct ovpn_struct *ovpn,
+					  int family, const void *addr,
+					  __be16 port);
 struct ovpn_peer *ovpn_peer_get_by_id(struct ovpn_struct *ovpn, u32 peer_id);
+struct ovpn_peer *ovpn_peer_get_by_id_rx(struct ovpn_struct *ovpn,
+					 u32 peer_id, bool *cached);
+struct ovpn_peer *ovpn_peer_get_by_vpn_addr(struct ovpn_struct *ovpn,
+					    int family, const void *addr);
 struct ovpn_peer *ovpn_peer_get_by_dst(struct ovpn_struct *ovpn,
 				       struct sk_buff *skb);
 bool ovpn_peer_check_by_src(struct ovpn_struct *ovpn, struct sk_buff *skb,
@@ -159,42 +410,164 @@ bool ovpn_peer_check_by_src(struct ovpn_struct *ovpn, struct sk_buff *skb,
  * @peer: peer for which the timeout should be reset
  *
  * To be invoked upon reception of an authenticated packet from peer in order
- * to report valid activity and thus reset the keepalive timeout
+ * to report valid activity and thus reset the keepalive timeout.
+ *
+ * Only the timestamp is updated here, expiration is checked by the
+ * per-interface keepalive worker.
  */
 static inline void ovpn_peer_keepalive_recv_reset(struct ovpn_peer *peer)
 {
-	u32 delta = msecs_to_jiffies(peer->keepalive_timeout * MSEC_PER_SEC);
-
-	if (unlikely(!delta))
-		return;
+	unsigned long now = jiffies;
 
-	mod_timer(&peer->keepalive_recv, jiffies + delta);
+	/* avoid dirtying the cacheline more than once per tick */
+	if (READ_ONCE(peer->last_recv) != now)
+		WRITE_ONCE(peer->last_recv, now);
 }
 
 /**
- * ovpn_peer_keepalive_xmit_reset - reset keepalive sending timer
- * @peer: peer for which the timer should be reset
+ * ovpn_peer_keepalive_xmit_reset - reset keepalive sending countdown
+ * @peer: peer for which the countdown should be reset
  *
  * To be invoked upon sending of an authenticated packet to peer in order
- * to report valid outgoing activity and thus reset the keepalive sending
- * timer
+ * to report valid outgoing activity and thus postpone the next keepalive
  */
 static inline void ovpn_peer_keepalive_xmit_reset(struct ovpn_peer *peer)
 {
-	u32 delta = msecs_to_jiffies(peer->keepalive_interval * MSEC_PER_SEC);
+	unsigned long now = jiffies;
+
+	if (READ_ONCE(peer->last_sent) != now)
+		WRITE_ONCE(peer->last_sent, now);
+}
+
+/**
+ * ovpn_peer_activity_reset - note tunneled traffic to or from a peer
+ * @peer: the peer the packet is sent to or received from
+ *
+ * Keepalives do not count: a peer exchanging nothing else is idle.
+ */
+static inline void ovpn_peer_activity_reset(struct ovpn_peer *peer)
+{
+	unsigned long now = jiffies;
+
+	if (READ_ONCE(peer->last_data) != now)
+		WRITE_ONCE(peer->last_data, now);
+}
+
+/* number of consecutive packets that must be received on another NUMA node
+ * before the key slots installed for a peer are allocated there
+ */
+#define OVPN_PEER_NODE_STICKY_PKTS	1024
+
+/**
+ * ovpn_peer_node_update - follow the NUMA node a peer is received on
+ * @peer: the peer a packet was received from
+ *
+ * A peer object cannot move once created, but key slots are replaced at
+ * every renegotiation: when traffic consistently arrives on another node,
+ * the next key slots are allocated there. Packets received on the current
+ * node only cost a comparison.
+ */
+static inline void ovpn_peer_node_update(struct ovpn_peer *peer)
+{
+	int node = numa_node_id();
+	unsigned int cnt;
+
+	if (likely(nr_online_nodes == 1))
+		return;
 
-	if (unlikely(!delta))
+	if (likely(node == READ_ONCE(peer->node))) {
+		/* a packet on the current node breaks any candidate run */
+		if (unlikely(READ_ONCE(peer->node_cand_cnt)))
+			WRITE_ONCE(peer->node_cand_cnt, 0);
 		return;
+	}
 
-	mod_timer(&peer->keepalive_xmit, jiffies + delta);
+	/* racing CPUs may only delay the switch */
+	if (READ_ONCE(peer->node_cand) != node) {
+		WRITE_ONCE(peer->node_cand, node);
+		WRITE_ONCE(peer->node_cand_cnt, 1);
+		return;
+	}
+
+	cnt = READ_ONCE(peer->node_cand_cnt) + 1;
+	WRITE_ONCE(peer->node_cand_cnt, cnt);
+	if (cnt >= OVPN_PEER_NODE_STICKY_PKTS) {
+		WRITE_ONCE(peer->node, node);
+		WRITE_ONCE(peer->node_cand_cnt, 0);
+	}
+}
+
+/**
+ * ovpn_peer_stats_touch - record that the stats of a peer changed
+ * @peer: the peer whose stats were updated
+ *
+ * Lets peer dumps skip peers that had no traffic since a given generation.
+ */
+static inline void ovpn_peer_stats_touch(struct ovpn_peer *peer)
+{
+	u32 gen = atomic_read(&peer->ovpn->stats_gen);
+
+	if (READ_ONCE(peer->stats_gen) != gen)
+		WRITE_ONCE(peer->stats_gen, gen);
+}
+
+/**
+ * ovpn_peer_stats_changed - check if peer stats changed since a generation
+ * @peer: the peer to check
+ * @gen: the stats generation to compare against
+ *
+ * Return: true if the stats of the peer changed during or after gen
+ */
+static inline bool ovpn_peer_stats_changed(const struct ovpn_peer *peer,
+					   u32 gen)
+{
+	return (s32)(READ_ONCE(peer->stats_gen) - gen) >= 0;
+}
+
+/**
+ * ovpn_peer_mtu - get the largest packet that can be sent to a peer
+ * @peer: the peer packets are sent to
+ *
+ * Return: the MTU configured for the peer, lowered to its path MTU when the
+ * latter is discovered, or 0 if packets are limited by the interface MTU only
+ */
+static inline unsigned int ovpn_peer_mtu(const struct ovpn_peer *peer)
+{
+	unsigned int mtu = READ_ONCE(peer->mtu), pmtu = 0;
+
+	if (peer->ovpn->pmtu_disc)
+		pmtu = READ_ONCE(peer->pmtu);
+
+	if (!mtu || (pmtu && pmtu < mtu))
+		return pmtu;
+
+	return mtu;
+}
+
+/**
+ * ovpn_peer_out_mark - get the firewall mark of the outer packets to a peer
+ * @peer: the peer packets are sent to
+ * @sk: the transport socket packets are sent over
+ *
+ * Return: the outer mark configured for the peer, or the one of @sk if none
+ */
+static inline u32 ovpn_peer_out_mark(const struct ovpn_peer *peer,
+				     const struct sock *sk)
+{
+	return READ_ONCE(peer->out_mark) ?: READ_ONCE(sk->sk_mark);
 }
 
 void ovpn_peer_keepalive_set(struct ovpn_peer *peer, u32 interval, u32 timeout);
+void ovpn_peer_idle_set(struct ovpn_peer *peer, u32 timeout);
+void ovpn_peer_keepalive_work(struct work_struct *work);
 
 void ovpn_peer_update_local_endpoint(struct ovpn_peer *peer,
 				     struct sk_buff *skb);
 
+void ovpn_peer_rehash(struct ovpn_peer *peer);
 void ovpn_peer_float(struct ovpn_peer *peer, struct sk_buff *skb);
+void ovpn_peer_float_work(struct work_struct *work);
+void ovpn_peer_float_notify_work(struct work_struct *work);
 int ovpn_peer_reset_sockaddr(struct ovpn_peer *peer,
 			     const struct sockaddr_storage *ss,
 			     const u8 *local_ip);
@@ -9,8 +9,11 @@
 
 #include <linux/atomic.h>
 #include <linux/jiffies.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
 #include <linux/net.h>
 #include <linux/netdevice.h>
+#include <linux/slab.h>
 #include <linux/types.h>
 
 #include "ovpnstruct.h"
@@ -18,113 +21,309 @@
 #include "packet.h"
 #include "pktid.h"
 
-void ovpn_pktid_xmit_init(struct ovpn_pktid_xmit *pid)
+/**
+ * ovpn_pktid_xmit_init - initialize the packet ID generator of a key
+ * @pid: the transmitter state to initialize
+ * @long_ids: whether the key uses 64bit packet IDs
+ * @threshold: percentage of the ID space used before asking to rekey
+ */
+void ovpn_pktid_xmit_init(struct ovpn_pktid_xmit *pid, bool long_ids,
+			  unsigned int threshold)
 {
 	atomic64_set(&pid->seq_num, 1);
+	pid->limit = long_ids ? OVPN_PKTID_XMIT_MAX_64 : OVPN_PKTID_XMIT_MAX;
+	pid->watermark = threshold >= 100 ? pid->limit :
+		div_u64(pid->limit, 100) * threshold;
+	pid->notified = 0;
+}
+
+/**
+ * ovpn_pktid_xmit_restore - move the packet ID generator of a key forward
+ * @pid: the transmitter state
+ * @seq_num: the next packet ID to hand out
+ *
+ * Used to take over a key from another node. The counter never moves back,
+ * as IDs are part of the cipher IV and must never be handed out twice.
+ *
+ * Return: 0 on success or -ERANGE if @seq_num is beyond the ID space
+ */
+int ovpn_pktid_xmit_restore(struct ovpn_pktid_xmit *pid, u64 seq_num)
+{
+	s64 old = atomic64_read(&pid->seq_num);
+
+	if (seq_num > pid->limit)
+		return -ERANGE;
+
+	while (old < (s64)seq_num &&
+	       !atomic64_try_cmpxchg(&pid->seq_num, &old, seq_num))
+		;
+
+	return 0;
 }
 
-void ovpn_pktid_recv_init(struct ovpn_pktid_recv *pr)
+/**
+ * ovpn_pktid_recv_init - initialize the replay protection state
+ * @pr: the receiver state to initialize
+ * @window: the size of the replay window in packets, rounded up to the next
+ *	    power of 2
+ * @node: NUMA node the replay window should be allocated on
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_pktid_recv_init(struct ovpn_pktid_recv *pr, unsigned int window,
+			 int node)
 {
 	memset(pr, 0, sizeof(*pr));
 	spin_lock_init(&pr->lock);
+
+	pr->window = roundup_pow_of_two(clamp_t(unsigned int, window,
+						REPLAY_WINDOW_MIN,
+						REPLAY_WINDOW_MAX));
+	pr->history = kcalloc_node(REPLAY_WINDOW_WORDS(pr->window),
+				   sizeof(*pr->history), GFP_KERNEL, node);
+	if (!pr->history)
+		return -ENOMEM;
+
+	pr->reorder = alloc_percpu(struct ovpn_pktid_reorder);
+	if (!pr->reorder) {
+		kfree(pr->history);
+		pr->history = NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/**
+ * ovpn_pktid_recv_release - free the replay protection state
+ * @pr: the receiver state to release
+ */
+void ovpn_pktid_recv_release(struct ovpn_pktid_recv *pr)
+{
+	kfree(pr->history);
+	pr->history = NULL;
+	free_percpu(pr->reorder);
+	pr->reorder = NULL;
+}
+
+/**
+ * ovpn_pktid_recv_reorder_fetch - sum up the per-CPU reorder histogram
+ * @pr: the receiver state
+ * @buckets: array of OVPN_REORDER_BUCKETS elements to fill
+ */
+void ovpn_pktid_recv_reorder_fetch(const struct ovpn_pktid_recv *pr,
+				   u64 *buckets)
+{
+	int cpu, i;
+
+	memset(buckets, 0, sizeof(*buckets) * OVPN_REORDER_BUCKETS);
+
+	for_each_possible_cpu(cpu)
+		for (i = 0; i < OVPN_REORDER_BUCKETS; i++)
+			buckets[i] += READ_ONCE(per_cpu_ptr(pr->reorder,
+							    cpu)->buckets[i]);
+}
+
+/* raise v to at least val */
+static void ovpn_pktid_raise(atomic64_t *v, s64 val)
+{
+	s64 old = atomic64_read(v);
+
+	while (old < val && !atomic64_try_cmpxchg(v, &old, val))
+		;
+}
+
+/**
+ * ovpn_pktid_recv_restore - move the replay window of a key forward
+ * @pr: the receiver state
+ * @id: the highest packet ID received by the previous owner of the key
+ *
+ * Used to take over a key from another node. The IDs that node received are
+ * not known one by one, therefore all IDs up to @id are rejected from now on.
+ * @id must not exceed S64_MAX.
+ */
+void ovpn_pktid_recv_restore(struct ovpn_pktid_recv *pr, u64 id)
+{
+	ovpn_pktid_raise(&pr->id, id);
+	ovpn_pktid_raise(&pr->id_floor, id);
+}
+
+/**
+ * ovpn_pktid_history_mark - mark a packet ID as received
+ * @pr: the receiver state
+ * @pkt_id: the ID to mark
+ *
+ * The block number stored alongside each bitmask allows words to be recycled
+ * and updated atomically, without the need for a lock. Only its lower 32 bits
+ * are stored: with 64bit packet IDs they wrap around, therefore block numbers
+ * are compared as sequence numbers. All IDs being marked are within the
+ * window, way closer to each other than half of the block number space.
+ *
+ * Return: 0 if the ID was not received before or -EINVAL otherwise
+ */
+static int ovpn_pktid_history_mark(struct ovpn_pktid_recv *pr, u64 pkt_id)
+{
+	const u32 block = pkt_id / REPLAY_WORD_BITS;
+	const u64 mask = BIT_ULL(pkt_id % REPLAY_WORD_BITS);
+	atomic64_t *word;
+	s64 old, new;
+
+	word = &pr->history[block & (REPLAY_WINDOW_WORDS(pr->window) - 1)];
+	old = atomic64_read(word);
+	do {
+		const u32 tag = (u64)old >> 32;
+
+		if (likely(tag == block)) {
+			/* replayed packet */
+			if (old & mask)
+				return -EINVAL;
+
+			new = old | mask;
+		} else if ((s32)(tag - block) < 0) {
+			/* the word tracks IDs that are out of the window by
+			 * now: recycle it for the block of this ID
+			 */
+			new = ((u64)block << 32) | mask;
+		} else {
+			/* the word was already recycled for a newer block */
+			return -EINVAL;
+		}
+	} while (!atomic64_try_cmpxchg(word, &old, new));
+
+	return 0;
+}
+
+/* Handle a change of the time stamp. Only long packet IDs carry one and they
+ * are not used by the AEAD data channel, therefore this path is not expected
+ * to be concurrent with the lockless one.
+ */
+static int ovpn_pktid_recv_time(struct ovpn_pktid_recv *pr, u32 pkt_time)
+{
+	int i, ret = 0;
+
+	spin_lock_bh(&pr->lock);
+	if (pkt_time > pr->time) {
+		/* time moved forward, accept */
+		for (i = 0; i < REPLAY_WINDOW_WORDS(pr->window); i++)
+			atomic64_set(&pr->history[i], 0);
+		atomic64_set(&pr->id, 0);
+		atomic64_set(&pr->id_floor, 0);
+		WRITE_ONCE(pr->time, pkt_time);
+	} else if (pkt_time < pr->time) {
+		/* time moved backward, reject */
+		ret = -ETIME;
+	}
+	spin_unlock_bh(&pr->lock);
+
+	return ret;
+}
+
+/* bucket of the reorder histogram accounting for an ID backtracking by delta */
+static unsigned int ovpn_reorder_bucket(unsigned int delta)
+{
+	return min_t(unsigned int, fls(delta), OVPN_REORDER_BUCKETS - 1);
 }
 
 /* Packet replay detection.
- * Allows ID backtrack of up to REPLAY_WINDOW_SIZE - 1.
+ * Allows ID backtrack of up to pr->window - 1.
+ *
+ * Packets are processed without taking any lock, so that traffic of the same
+ * peer can be received on multiple CPUs in parallel.
  */
-int ovpn_pktid_recv(struct ovpn_pktid_recv *pr, u32 pkt_id, u32 pkt_time)
+int ovpn_pktid_recv(struct ovpn_pktid_recv *pr, u64 pkt_id, u32 pkt_time)
 {
 	const unsigned long now = jiffies;
+	const unsigned long expire = now + PKTID_RECV_EXPIRE;
+	unsigned int delta;
+	s64 id;
 	int ret;
 
 	/* ID must not be zero */
 	if (unlikely(pkt_id == 0))
 		return -EINVAL;
 
-	spin_lock_bh(&pr->lock);
+	/* time changed? */
+	if (unlikely(pkt_time != READ_ONCE(pr->time))) {
+		ret = ovpn_pktid_recv_time(pr, pkt_time);
+		if (ret < 0)
+			return ret;
+	}
 
-	/* expire backtracks at or below pr->id after PKTID_RECV_EXPIRE time */
-	if (unlikely(time_after_eq(now, pr->expire)))
-		pr->id_floor = pr->id;
+	/* IDs beyond the transmitter limit can not be legitimate */
+	if (unlikely(pkt_id > S64_MAX))
+		return -EINVAL;
 
-	/* time changed? */
-	if (unlikely(pkt_time != pr->time)) {
-		if (pkt_time > pr->time) {
-			/* time moved forward, accept */
-			pr->base = 0;
-			pr->extent = 0;
-			pr->id = 0;
-			pr->time = pkt_time;
-			pr->id_floor = 0;
-		} else {
-			/* time moved backward, reject */
-			ret = -ETIME;
-			goto out;
-		}
+	id = atomic64_read(&pr->id);
+
+	/* expire backtracks at or below pr->id after PKTID_RECV_EXPIRE time */
+	if (unlikely(time_after_eq(now, READ_ONCE(pr->expire)))) {
+		atomic64_set(&pr->id_floor, id);
+		atomic_long_inc(&pr->floor_updates);
 	}
 
-	if (likely(pkt_id == pr->id + 1)) {
-		/* well-formed ID sequence (incremented by 1) */
-		pr->base = REPLAY_INDEX(pr->base, -1);
-		pr->history[pr->base / 8] |= (1 << (pr->base % 8));
-		if (pr->extent < REPLAY_WINDOW_SIZE)
-			++pr->extent;
-		pr->id = pkt_id;
-	} else if (pkt_id > pr->id) {
-		/* ID jumped forward by more than one */
-		const unsigned int delta = pkt_id - pr->id;
-
-		if (delta < REPLAY_WINDOW_SIZE) {
-			unsigned int i;
-
-			pr->base = REPLAY_INDEX(pr->base, -delta);
-			pr->history[pr->base / 8] |= (1 << (pr->base % 8));
-			pr->extent += delta;
-			if (pr->extent > REPLAY_WINDOW_SIZE)
-				pr->extent = REPLAY_WINDOW_SIZE;
-			for (i = 1; i < delta; ++i) {
-				unsigned int newb = REPLAY_INDEX(pr->base, i);
-
-				pr->history[newb / 8] &= ~BIT(newb % 8);
-			}
-		} else {
-			pr->base = 0;
-			pr->extent = REPLAY_WINDOW_SIZE;
-			memset(pr->history, 0, sizeof(pr->history));
-			pr->history[0] = 1;
-		}
-		pr->id = pkt_id;
-	} else {
+	if (unlikely(pkt_id <= id)) {
 		/* ID backtrack */
-		const unsigned int delta = pr->id - pkt_id;
-
-		if (delta > pr->max_backtrack)
-			pr->max_backtrack = delta;
-		if (delta < pr->extent) {
-			if (pkt_id > pr->id_floor) {
-				const unsigned int ri = REPLAY_INDEX(pr->base,
-								     delta);
-				u8 *p = &pr->history[ri / 8];
-				const u8 mask = (1 << (ri % 8));
-
-				if (*p & mask) {
-					ret = -EINVAL;
-					goto out;
-				}
-				*p |= mask;
-			} else {
-				ret = -EINVAL;
-				goto out;
-			}
-		} else {
-			ret = -EINVAL;
-			goto out;
-		}
+		delta = min_t(u64, id - pkt_id, UINT_MAX);
+		if (delta > READ_ONCE(pr->max_backtrack))
+			WRITE_ONCE(pr->max_backtrack, delta);
+		this_cpu_inc(pr->reorder->buckets[ovpn_reorder_bucket(delta)]);
+
+		if (delta >= pr->window ||
+		    pkt_id <= atomic64_read(&pr->id_floor))
+			return -EINVAL;
 	}
 
-	pr->expire = now + PKTID_RECV_EXPIRE;
-	ret = 0;
-out:
-	spin_unlock_bh(&pr->lock);
-	return ret;
+	ret = ovpn_pktid_history_mark(pr, pkt_id);
+	if (unlikely(ret < 0))
+		return ret;
+
+	/* move the window forward, unless another CPU moved it further */
+	while (pkt_id > id && !atomic64_try_cmpxchg(&pr->id, &id, pkt_id))
+		;
+
+	/* avoid dirtying the cacheline more than once per jiffy */
+	if (READ_ONCE(pr->expire) != expire)
+		WRITE_ONCE(pr->expire, expire);
+
+	return 0;
+}
+
+/**
+ * ovpn_pktid_recv_check - check a packet ID before authenticating it
+ * @pr: the receiver state
+ * @pkt_id: the ID carried by the packet, in cleartext
+ *
+ * Unlike ovpn_pktid_recv(), nothing is recorded, since the ID may be forged.
+ * Only IDs that ovpn_pktid_recv() would reject anyway are reported, i.e.
+ * IDs already received and IDs below the replay window, so that the packet
+ * carrying them can be dropped without being decrypted.
+ *
+ * Return: 0 if the ID may be accepted or -EINVAL otherwise
+ */
+int ovpn_pktid_recv_check(const struct ovpn_pktid_recv *pr, u64 pkt_id)
+{
+	const s64 id = atomic64_read(&pr->id);
+	const u32 block = pkt_id / REPLAY_WORD_BITS;
+	u32 idx, tag;
+	u64 word;
+
+	if (unlikely(pkt_id == 0 || pkt_id > S64_MAX))
+		return -EINVAL;
+
+	if (likely(pkt_id > id))
+		return 0;
+
+	if (id - pkt_id >= pr->window ||
+	    pkt_id <= atomic64_read(&pr->id_floor))
+		return -EINVAL;
+
+	idx = block & (REPLAY_WINDOW_WORDS(pr->window) - 1);
+	word = atomic64_read(&pr->history[idx]);
+	tag = word >> 32;
+	/* replayed, or the word was recycled for a newer block already */
+	if ((tag == block && (word & BIT_ULL(pkt_id % REPLAY_WORD_BITS))) ||
+	    (s32)(tag - block) > 0)
+		return -EINVAL;
+
+	return 0;
 }
@@ -10,6 +10,10 @@
 #ifndef _NET_OVPN_OVPNPKTID_H_
 #define _NET_OVPN_OVPNPKTID_H_
 
+#include <linux/percpu.h>
+#include <asm/unaligned.h>
+#include <uapi/linux/ovpn.h>
+
 #include "packet.h"
 
 /* If no packets received for this length of time, set a backtrack floor
@@ -17,58 +21,141 @@
  */
 #define PKTID_RECV_EXPIRE (30 * HZ)
 
+/* end of the packet ID space: IDs are 32bit and never wrap around */
+#define OVPN_PKTID_XMIT_MAX 0x100000000LL
+/* end of the packet ID space of keys using 64bit packet IDs */
+#define OVPN_PKTID_XMIT_MAX_64 S64_MAX
+
+/* default percentage of the packet ID space used before asking to rekey */
+#define OVPN_REKEY_THRESHOLD 100
+
 /* Packet-ID state for transmitter */
 struct ovpn_pktid_xmit {
 	atomic64_t seq_num;
+	/* first value seq_num can not be handed out at */
+	s64 limit;
+	/* userspace is asked to rekey once seq_num reaches this value */
+	s64 watermark;
+	/* bit 0 is set once userspace was asked to rekey */
+	unsigned long notified;
 };
 
-/* replay window sizing in bytes = 2^REPLAY_WINDOW_ORDER */
+/* default replay window sizing in bytes = 2^REPLAY_WINDOW_ORDER */
 #define REPLAY_WINDOW_ORDER 8
 
 #define REPLAY_WINDOW_BYTES BIT(REPLAY_WINDOW_ORDER)
 #define REPLAY_WINDOW_SIZE  (REPLAY_WINDOW_BYTES * 8)
-#define REPLAY_INDEX(base, i) (((base) + (i)) & (REPLAY_WINDOW_SIZE - 1))
+
+/* bounds of the replay window size configurable by userspace, in packets */
+#define REPLAY_WINDOW_MIN 64
+#define REPLAY_WINDOW_MAX 65536
+
+/* each history word tracks a block of REPLAY_WORD_BITS consecutive IDs. The
+ * history spans twice the window, so that a word is recycled for a newer
+ * block only once all the IDs it tracked are out of the window
+ */
+#define REPLAY_WORD_BITS 32
+#define REPLAY_WINDOW_WORDS(window) (2 * (window) / REPLAY_WORD_BITS)
+
+/* histogram of the distance IDs backtrack by: bucket i counts distances
+ * below 2^i (and not below 2^(i-1)), the last bucket also counts all
+ * larger distances
+ */
+struct ovpn_pktid_reorder {
+	unsigned long buckets[OVPN_REORDER_BUCKETS];
+};
 
 /* Packet-ID state for receiver.
- * Other than lock member, can be zeroed to initialize.
+ * Other than lock, history, reorder and window, can be zeroed to initialize.
  */
 struct ovpn_pktid_recv {
-	/* "sliding window" bitmask of recent packet IDs received */
-	u8 history[REPLAY_WINDOW_BYTES];
-	/* bit position of deque base in history */
-	unsigned int base;
-	/* extent (in bits) of deque in history */
-	unsigned int extent;
+	/* "sliding window" of recent packet IDs received: the upper half of
+	 * each word carries the number of the block being tracked, the lower
+	 * half the bitmask of the IDs received within that block
+	 */
+	atomic64_t *history;
+	/* size of the replay window in packets (power of 2) */
+	unsigned int window;
+	/* highest sequence number received */
+	atomic64_t id;
 	/* expiration of history in jiffies */
 	unsigned long expire;
-	/* highest sequence number received */
-	u32 id;
 	/* highest time stamp received */
 	u32 time;
 	/* we will only accept backtrack IDs > id_floor */
-	u32 id_floor;
+	atomic64_t id_floor;
 	unsigned int max_backtrack;
-	/* protects entire pktd ID state */
+	/* how many times id_floor was raised because of expiration */
+	atomic_long_t floor_updates;
+	/* backtracking IDs, counted per-CPU */
+	struct ovpn_pktid_reorder __percpu *reorder;
+	/* serializes time stamp changes, the rest of the state is lockless */
 	spinlock_t lock;
 };
 
 /* Get the next packet ID for xmit */
-static inline int ovpn_pktid_xmit_next(struct ovpn_pktid_xmit *pid, u32 *pktid)
+static inline int ovpn_pktid_xmit_next(struct ovpn_pktid_xmit *pid, u64 *pktid)
 {
 	const s64 seq_num = atomic64_fetch_add_unless(&pid->seq_num, 1,
-						      0x100000000LL);
-	/* when the 32bit space is over, we return an error because the packet
+						      pid->limit);
+	/* when the ID space is over, we return an error because the packet
 	 * ID is used to create the cipher IV and we do not want to reuse the
 	 * same value more than once
 	 */
-	if (unlikely(seq_num == 0x100000000LL))
+	if (unlikely(seq_num == pid->limit))
 		return -ERANGE;
 
-	*pktid = (u32)seq_num;
+	*pktid = seq_num;
+
+	return 0;
+}
+
+/**
+ * ovpn_pktid_xmit_reserve - reserve a block of consecutive packet IDs for xmit
+ * @pid: the packet ID state of the key slot used for encryption
+ * @n: the number of packet IDs to reserve
+ * @first: filled with the first reserved packet ID
+ *
+ * A whole batch of packets pays one atomic operation on the shared counter,
+ * unless other CPUs are reserving IDs at the same time. The block is never
+ * cut short: if fewer than n IDs are left, nothing is reserved.
+ *
+ * Return: 0 on success or -ERANGE if the packet ID space is exhausted
+ */
+static inline int ovpn_pktid_xmit_reserve(struct ovpn_pktid_xmit *pid,
+					  unsigned int n, u64 *first)
+{
+	s64 seq_num = atomic64_read(&pid->seq_num);
+
+	do {
+		/* same limit as ovpn_pktid_xmit_next(): IDs must never be
+		 * reused, as they are part of the cipher IV
+		 */
+		if (unlikely(n > pid->limit - seq_num))
+			return -ERANGE;
+	} while (!atomic64_try_cmpxchg(&pid->seq_num, &seq_num, seq_num + n));
+
+	*first = seq_num;
 
 	return 0;
 }
 
+/**
+ * ovpn_pktid_xmit_rekey_due - check whether userspace should be asked to rekey
+ * @pid: the packet ID state of the key slot used for encryption
+ * @end: the value of the counter after the last reservation
+ *
+ * Return: true only the first time the watermark is found to be crossed
+ */
+static inline bool ovpn_pktid_xmit_rekey_due(struct ovpn_pktid_xmit *pid,
+					     s64 end)
+{
+	if (likely(end < pid->watermark) || test_bit(0, &pid->notified))
+		return false;
+
+	return !test_and_set_bit(0, &pid->notified);
+}
+
 /* Write 12-byte AEAD IV to dest */
 static inline void ovpn_pktid_aead_write(const u32 pktid,
 					 const struct ovpn_nonce_tail *nt,
@@ -79,9 +166,46 @@ static inline void ovpn_pktid_aead_write(const u32 pktid,
 	memcpy(dest + 4, nt->u8, sizeof(struct ovpn_nonce_tail));
 }
 
-void ovpn_pktid_xmit_init(struct ovpn_pktid_xmit *pid);
-void ovpn_pktid_recv_init(struct ovpn_pktid_recv *pr);
+/* Write 12-byte AEAD IV of a key using 64bit packet IDs to dest: the 8-byte
+ * packet ID is followed by the head of the nonce tail
+ */
+static inline void ovpn_pktid_aead_write64(const u64 pktid,
+					   const struct ovpn_nonce_tail *nt,
+					   unsigned char *dest)
+{
+	put_unaligned_be64(pktid, dest);
+	BUILD_BUG_ON(NONCE_WIRE_SIZE_64 > NONCE_SIZE);
+	memcpy(dest + NONCE_WIRE_SIZE_64, nt->u8,
+	       NONCE_SIZE - NONCE_WIRE_SIZE_64);
+}
+
+/**
+ * ovpn_pktid_from_wire - read the packet ID carried by a DATA_V2 packet
+ * @data: the packet ID, right after the op
+ * @size: the size of the packet ID on the wire (NONCE_WIRE_SIZE or
+ *	  NONCE_WIRE_SIZE_64)
+ *
+ * Return: the packet ID
+ */
+static inline u64 ovpn_pktid_from_wire(const u8 *data, unsigned int size)
+{
+	if (size == NONCE_WIRE_SIZE_64)
+		return get_unaligned_be64(data);
+
+	return get_unaligned_be32(data);
+}
+
+void ovpn_pktid_xmit_init(struct ovpn_pktid_xmit *pid, bool long_ids,
+			  unsigned int threshold);
+int ovpn_pktid_xmit_restore(struct ovpn_pktid_xmit *pid, u64 seq_num);
+int ovpn_pktid_recv_init(struct ovpn_pktid_recv *pr, unsigned int window,
+			 int node);
+void ovpn_pktid_recv_release(struct ovpn_pktid_recv *pr);
+void ovpn_pktid_recv_reorder_fetch(const struct ovpn_pktid_recv *pr,
+				   u64 *buckets);
+void ovpn_pktid_recv_restore(struct ovpn_pktid_recv *pr, u64 id);
 
-int ovpn_pktid_recv(struct ovpn_pktid_recv *pr, u32 pkt_id, u32 pkt_time);
+int ovpn_pktid_recv(struct ovpn_pktid_recv *pr, u64 pkt_id, u32 pkt_time);
+int ovpn_pktid_recv_check(const struct ovpn_pktid_recv *pr, u64 pkt_id);
 
 #endif /* _NET_OVPN_OVPNPKTID_H_ */
@@ -0,0 +1,193 @@
+// SPDX-License-Identifier: GPL-2.0
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/skbuff.h>
+
+#include "ovpnstruct.h"
+#include "io.h"
+#include "peer.h"
+#include "probe.h"
+
+/* weight of a new sample in the smoothed loss: 1/2^OVPN_PROBE_LOSS_SHIFT */
+#define OVPN_PROBE_LOSS_SHIFT	3
+#define OVPN_PROBE_LOSS_ONE	(1U << 16)
+
+/**
+ * ovpn_probe_init - initialize the round trip estimation of a peer
+ * @probe: the state to initialize
+ */
+void ovpn_probe_init(struct ovpn_probe *probe)
+{
+	spin_lock_init(&probe->lock);
+}
+
+/**
+ * ovpn_probe_set - configure how often a peer is probed
+ * @peer: the peer to configure
+ * @interval: milliseconds between two probe requests (0 to disable)
+ *
+ * The estimation restarts from scratch, since the previous samples may have
+ * been taken at a different pace.
+ */
+void ovpn_probe_set(struct ovpn_peer *peer, u32 interval)
+{
+	struct ovpn_probe *probe = &peer->probe;
+
+	spin_lock_bh(&probe->lock);
+	probe->srtt = 0;
+	probe->rttvar = 0;
+	probe->loss = 0;
+	/* the request in flight, if any, is not accounted as lost */
+	probe->acked = true;
+	spin_unlock_bh(&probe->lock);
+
+	WRITE_ONCE(probe->last, jiffies);
+	WRITE_ONCE(probe->interval, interval);
+
+	if (interval)
+		mod_delayed_work(system_wq, &peer->ovpn->keepalive_work, 0);
+}
+
+/**
+ * ovpn_probe_due - check whether a peer should be probed
+ * @peer: the peer to check
+ * @now: the current time in jiffies
+ *
+ * Return: true if a probe request should be sent to the peer now
+ */
+bool ovpn_probe_due(const struct ovpn_peer *peer, unsigned long now)
+{
+	unsigned long interval = READ_ONCE(peer->probe.interval);
+
+	return interval &&
+	       time_after_eq(now, READ_ONCE(peer->probe.last) +
+				  msecs_to_jiffies(interval));
+}
+
+/**
+ * ovpn_probe_xmit - send a probe request to a peer
+ * @peer: the peer to probe
+ *
+ * The request also serves as keepalive. A request that was not echoed back
+ * by the time the next one is sent is accounted as lost. The keepalive
+ * worker moves the probe countdown forward when queueing the peer.
+ *
+ * Must be called with BHs disabled: see ovpn_keepalive_xmit().
+ */
+void ovpn_probe_xmit(struct ovpn_peer *peer)
+{
+	struct ovpn_probe *probe = &peer->probe;
+	struct ovpn_probe_trailer t = {
+		.type = OVPN_PROBE_REQUEST,
+	};
+	u32 loss;
+
+	spin_lock(&probe->lock);
+	loss = probe->loss - (probe->loss >> OVPN_PROBE_LOSS_SHIFT);
+	if (probe->tx && !probe->acked)
+		loss += OVPN_PROBE_LOSS_ONE >> OVPN_PROBE_LOSS_SHIFT;
+	probe->loss = loss;
+	probe->acked = false;
+	probe->tx++;
+	t.seq = htonl(++probe->seq);
+	spin_unlock(&probe->lock);
+
+	t.tstamp = cpu_to_be64(ktime_get_ns());
+	ovpn_probe_msg_xmit(peer, &t);
+}
+
+/* RFC 6298 estimators, though with the first sample setting the variation
+ * to half of it and with microsecond rather than clock granularity
+ */
+static void ovpn_probe_sample(struct ovpn_probe *probe, u32 rtt)
+{
+	u32 delta;
+
+	if (!probe->srtt) {
+		probe->srtt = rtt ?: 1;
+		probe->rttvar = rtt / 2;
+		return;
+	}
+
+	delta = abs_diff(probe->srtt, rtt);
+	probe->rttvar = probe->rttvar - (probe->rttvar >> 2) + (delta >> 2);
+	probe->srtt = (probe->srtt - (probe->srtt >> 3) + (rtt >> 3)) ?: 1;
+}
+
+/**
+ * ovpn_probe_recv - handle a probe message received from a peer
+ * @peer: the peer the message comes from
+ * @skb: the decrypted message
+ * @offset: offset of the probe trailer in skb
+ *
+ * Requests are echoed back to the peer. Replies to the last request sent
+ * carry a round trip time sample, late replies are ignored since the request
+ * was accounted as lost already.
+ */
+void ovpn_probe_recv(struct ovpn_peer *peer, const struct sk_buff *skb,
+		     unsigned int offset)
+{
+	struct ovpn_probe *probe = &peer->probe;
+	struct ovpn_probe_trailer buf;
+	const struct ovpn_probe_trailer *t;
+	struct ovpn_probe_trailer reply;
+	s64 rtt;
+
+	t = skb_header_pointer(skb, offset, sizeof(buf), &buf);
+	if (unlikely(!t))
+		return;
+
+	switch (t->type) {
+	case OVPN_PROBE_REQUEST:
+		reply = *t;
+		reply.type = OVPN_PROBE_REPLY;
+		memset(reply.reserved, 0, sizeof(reply.reserved));
+		/* the TCP transport may receive from process context */
+		local_bh_disable();
+		ovpn_probe_msg_xmit(peer, &reply);
+		local_bh_enable();
+		break;
+	case OVPN_PROBE_REPLY:
+		rtt = ktime_get_ns() - (s64)be64_to_cpu(t->tstamp);
+		if (unlikely(rtt < 0))
+			return;
+
+		spin_lock_bh(&probe->lock);
+		if (!probe->acked && ntohl(t->seq) == probe->seq) {
+			probe->acked = true;
+			probe->rx++;
+			ovpn_probe_sample(probe,
+					  min_t(s64, div_s64(rtt, NSEC_PER_USEC),
+						U32_MAX));
+		}
+		spin_unlock_bh(&probe->lock);
+		break;
+	default:
+		/* unknown kinds are plain keepalives */
+		break;
+	}
+}
+
+/**
+ * ovpn_probe_fetch - take a snapshot of the round trip estimation of a peer
+ * @probe: the state to read
+ * @st: the snapshot to fill
+ */
+void ovpn_probe_fetch(struct ovpn_probe *probe, struct ovpn_probe_stats *st)
+{
+	spin_lock_bh(&probe->lock);
+	st->srtt = probe->srtt;
+	st->rttvar = probe->rttvar;
+	st->loss = DIV_ROUND_CLOSEST(probe->loss * 1000, OVPN_PROBE_LOSS_ONE);
+	st->tx = probe->tx;
+	st->rx = probe->rx;
+	spin_unlock_bh(&probe->lock);
+}
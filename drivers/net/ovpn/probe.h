@@ -0,0 +1,100 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_PROBE_H_
+#define _NET_OVPN_PROBE_H_
+
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+struct ovpn_peer;
+struct sk_buff;
+
+/* Probes are keepalives carrying a trailer: the keepalive message comes
+ * first, so that peers not knowing about probes still take them for
+ * keepalives. A peer receiving a probe request echoes its trailer back in a
+ * probe reply, the sender of the request then samples the round trip time
+ * from the timestamp it finds in the reply.
+ */
+
+/**
+ * enum ovpn_probe_type - kind of a probe message
+ * @OVPN_PROBE_REQUEST: probe to be echoed back by the receiver
+ * @OVPN_PROBE_REPLY: echo of a probe request
+ */
+enum ovpn_probe_type {
+	OVPN_PROBE_REQUEST = 1,
+	OVPN_PROBE_REPLY,
+};
+
+/**
+ * struct ovpn_probe_trailer - trailer of a probe message
+ * @type: an enum ovpn_probe_type value
+ * @reserved: zero on TX, ignored on RX
+ * @seq: sequence number of the request
+ * @tstamp: monotonic time the request was sent at, in nanoseconds, as seen
+ *	    by the sender of the request
+ */
+struct ovpn_probe_trailer {
+	u8 type;
+	u8 reserved[3];
+	__be32 seq;
+	__be64 tstamp;
+} __packed;
+
+/**
+ * struct ovpn_probe - round trip estimation of a peer
+ * @lock: protects all members but @interval and @last
+ * @interval: milliseconds between two probe requests (0 to disable)
+ * @last: jiffies the last request was sent at
+ * @seq: sequence number of the last request sent
+ * @acked: whether the last request was echoed back
+ * @srtt: smoothed round trip time, in microseconds
+ * @rttvar: round trip time variation, in microseconds
+ * @loss: smoothed ratio of the requests not echoed back, in 1/65536th
+ * @tx: requests sent
+ * @rx: replies received in time, i.e. before the next request
+ */
+struct ovpn_probe {
+	spinlock_t lock;
+	unsigned long interval;
+	unsigned long last;
+	u32 seq;
+	bool acked;
+	u32 srtt;
+	u32 rttvar;
+	u32 loss;
+	u64 tx;
+	u64 rx;
+};
+
+/**
+ * struct ovpn_probe_stats - snapshot of the round trip estimation of a peer
+ * @srtt: smoothed round trip time, in microseconds
+ * @rttvar: round trip time variation, in microseconds
+ * @loss: ratio of lost probes, per mille
+ * @tx: requests sent
+ * @rx: replies received in time
+ */
+struct ovpn_probe_stats {
+	u32 srtt;
+	u32 rttvar;
+	u32 loss;
+	u64 tx;
+	u64 rx;
+};
+
+void ovpn_probe_init(struct ovpn_probe *probe);
+void ovpn_probe_set(struct ovpn_peer *peer, u32 interval);
+bool ovpn_probe_due(const struct ovpn_peer *peer, unsigned long now);
+void ovpn_probe_xmit(struct ovpn_peer *peer);
+void ovpn_probe_recv(struct ovpn_peer *peer, const struct sk_buff *skb,
+		     unsigned int offset);
+void ovpn_probe_fetch(struct ovpn_probe *probe, struct ovpn_probe_stats *st);
+
+#endif /* _NET_OVPN_PROBE_H_ */
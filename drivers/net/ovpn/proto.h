@@ -45,16 +45,21 @@
  * @skb: the packet to extract the OP code from
  * @offset: the offset in the data buffer where the OP code is located
  *
- * Note: this function assumes that the skb head was pulled enough
- * to access the first byte.
+ * The header is read in place, so it may sit in a page fragment of a packet
+ * received by a NIC splitting headers from payload.
  *
- * Return: the OP code
+ * Return: the OP code, or 0 (no valid OP code) if skb is too short
  */
 static inline u8 ovpn_opcode_from_skb(const struct sk_buff *skb, u16 offset)
 {
-	u8 byte = *(skb->data + offset);
+	const u8 *byte;
+	u8 tmp;
 
-	return byte >> OVPN_OPCODE_SHIFT;
+	byte = skb_header_pointer(skb, offset, sizeof(tmp), &tmp);
+	if (unlikely(!byte))
+		return 0;
+
+	return *byte >> OVPN_OPCODE_SHIFT;
 }
 
 /**
@@ -62,28 +67,41 @@ static inline u8 ovpn_opcode_from_skb(const struct sk_buff *skb, u16 offset)
  * @skb: the packet to extract the OP code from
  * @offset: the offset in the data buffer where the OP code is located
  *
- * Note: this function assumes that the skb head was pulled enough
- * to access the first 4 bytes.
+ * As for ovpn_opcode_from_skb(), the header may sit in a page fragment.
  *
- * Return: the peer ID.
+ * Return: the peer ID, or OVPN_PEER_ID_UNDEF if skb is too short
  */
 static inline u32 ovpn_peer_id_from_skb(const struct sk_buff *skb, u16 offset)
 {
-	return ntohl(*(__be32 *)(skb->data + offset)) & OVPN_PEER_ID_MASK;
+	const __be32 *op;
+	__be32 tmp;
+
+	op = skb_header_pointer(skb, offset, sizeof(tmp), &tmp);
+	if (unlikely(!op))
+		return OVPN_PEER_ID_UNDEF;
+
+	return ntohl(*op) & OVPN_PEER_ID_MASK;
 }
 
 /**
  * ovpn_key_id_from_skb - extract key ID from the skb head
  * @skb: the packet to extract the key ID code from
  *
- * Note: this function assumes that the skb head was pulled enough
- * to access the first byte.
+ * As for ovpn_opcode_from_skb(), the header may sit in a page fragment.
+ * The caller must make sure skb is not empty.
  *
  * Return: the key ID
  */
 static inline u8 ovpn_key_id_from_skb(const struct sk_buff *skb)
 {
-	return *skb->data & OVPN_KEY_ID_MASK;
+	const u8 *byte;
+	u8 tmp;
+
+	byte = skb_header_pointer(skb, 0, sizeof(tmp), &tmp);
+	if (unlikely(!byte))
+		return 0;
+
+	return *byte & OVPN_KEY_ID_MASK;
 }
 
 /**
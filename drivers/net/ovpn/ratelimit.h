@@ -0,0 +1,86 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_RATELIMIT_H_
+#define _NET_OVPN_RATELIMIT_H_
+
+#include <linux/atomic.h>
+#include <linux/math64.h>
+#include <linux/minmax.h>
+#include <linux/timekeeping.h>
+
+/* default burst of a rate limit, in bytes */
+#define OVPN_RATELIMIT_BURST 65536
+
+/**
+ * struct ovpn_ratelimit - token bucket policing the traffic of a peer
+ * @tat: theoretical arrival time of the next packet, in ns
+ * @rate: bytes per second allowed (0 if unlimited)
+ * @burst_ns: time it takes to send @burst bytes at @rate
+ * @burst: bytes that may exceed @rate after an idle period
+ *
+ * The bucket is implemented as a Generic Cell Rate Algorithm: instead of
+ * refilling tokens, every accepted packet pushes @tat forward by its cost at
+ * @rate. A packet is accepted as long as @tat is no more than @burst_ns ahead
+ * of now, so that the whole state fits one atomic and is updated locklessly
+ * by all CPUs.
+ */
+struct ovpn_ratelimit {
+	atomic64_t tat;
+	u64 rate;
+	u64 burst_ns;
+	u32 burst;
+};
+
+/**
+ * ovpn_ratelimit_set - configure a rate limit
+ * @rl: the rate limit to configure
+ * @rate: bytes per second allowed (0 to disable the limit)
+ * @burst: bytes that may exceed @rate after an idle period
+ */
+static inline void ovpn_ratelimit_set(struct ovpn_ratelimit *rl, u64 rate,
+				      u32 burst)
+{
+	WRITE_ONCE(rl->burst, burst);
+	WRITE_ONCE(rl->burst_ns,
+		   rate ? div64_u64((u64)burst * NSEC_PER_SEC, rate) : 0);
+	WRITE_ONCE(rl->rate, rate);
+}
+
+/**
+ * ovpn_ratelimit_allow - account for a packet against a rate limit
+ * @rl: the rate limit to check
+ * @len: the size of the packet
+ *
+ * Return: true if the packet conforms to the rate limit, false if it should
+ * be dropped
+ */
+static inline bool ovpn_ratelimit_allow(struct ovpn_ratelimit *rl,
+					unsigned int len)
+{
+	u64 rate = READ_ONCE(rl->rate);
+	s64 now, tat, next, cost;
+
+	if (likely(!rate))
+		return true;
+
+	cost = div64_u64((u64)len * NSEC_PER_SEC, rate);
+	now = ktime_get_ns();
+	tat = atomic64_read(&rl->tat);
+	do {
+		next = max(tat, now);
+		/* an idle bucket accepts one packet of any size */
+		if (next - now > READ_ONCE(rl->burst_ns))
+			return false;
+		next += cost;
+	} while (!atomic64_try_cmpxchg(&rl->tat, &tat, next));
+
+	return true;
+}
+
+#endif /* _NET_OVPN_RATELIMIT_H_ */
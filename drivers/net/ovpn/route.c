@@ -0,0 +1,360 @@
+// SPDX-License-Identifier: GPL-2.0
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include <linux/jhash.h>
+#include <linux/netdevice.h>
+#include <linux/slab.h>
+#include <net/arp.h>
+#include <net/ip6_route.h>
+#include <net/ndisc.h>
+#include <net/netevent.h>
+#include <net/route.h>
+
+#include "ovpnstruct.h"
+#include "bind.h"
+#include "peer.h"
+#include "route.h"
+
+/* Peers of an interface created with OVPN_A_SHARED_DST_CACHE do not own a
+ * per-CPU dst_cache. They reference instead an entry of the interface route
+ * table, shared by all the peers whose route uses the same local address and
+ * next hop.
+ *
+ * A peer trusts the shared entry only as long as the routing generation of
+ * the netns did not change since its last full route lookup: after a routing
+ * change each peer looks its route up once more and possibly moves to another
+ * entry. Routes specific to one destination (i.e. carrying a PMTU exception)
+ * get an entry of their own.
+ */
+
+/**
+ * ovpn_route_table_alloc - allocate an empty shared route table
+ *
+ * Return: the new table or NULL on allocation failure
+ */
+struct ovpn_route_table *ovpn_route_table_alloc(void)
+{
+	struct ovpn_route_table *table;
+	unsigned int i;
+
+	table = kmalloc(sizeof(*table), GFP_KERNEL);
+	if (!table)
+		return NULL;
+
+	for (i = 0; i < OVPN_ROUTE_TABLE_SIZE; i++)
+		INIT_HLIST_HEAD(&table->buckets[i]);
+	spin_lock_init(&table->lock);
+
+	return table;
+}
+
+/**
+ * ovpn_route_table_free - free a shared route table
+ * @table: the table to free (may be NULL)
+ *
+ * All peers must have released their entry already.
+ */
+void ovpn_route_table_free(struct ovpn_route_table *table)
+{
+	kfree(table);
+}
+
+static void ovpn_route_free_rcu(struct rcu_head *head)
+{
+	struct ovpn_route *route = container_of(head, struct ovpn_route, rcu);
+
+	dst_cache_destroy(&route->cache);
+	kfree(route);
+}
+
+static void ovpn_route_put(struct ovpn_route_table *table,
+			   struct ovpn_route *route)
+{
+	if (!route)
+		return;
+
+	spin_lock_bh(&table->lock);
+	if (!refcount_dec_and_test(&route->refcount)) {
+		spin_unlock_bh(&table->lock);
+		return;
+	}
+	hlist_del(&route->node);
+	spin_unlock_bh(&table->lock);
+
+	/* the datapath may still be using the cache of this entry */
+	call_rcu(&route->rcu, ovpn_route_free_rcu);
+}
+
+/* find the entry matching key or create it. A reference is taken on the
+ * returned entry
+ */
+static struct ovpn_route *ovpn_route_get(struct ovpn_route_table *table,
+					 const struct ovpn_route_key *key)
+{
+	u32 hash = jhash2((const u32 *)key, sizeof(*key) / sizeof(u32), 0);
+	struct hlist_head *head = &table->buckets[hash % OVPN_ROUTE_TABLE_SIZE];
+	struct ovpn_route *route;
+
+	spin_lock_bh(&table->lock);
+	hlist_for_each_entry(route, head, node) {
+		if (!memcmp(&route->key, key, sizeof(*key))) {
+			refcount_inc(&route->refcount);
+			goto unlock;
+		}
+	}
+
+	route = kzalloc(sizeof(*route), GFP_ATOMIC);
+	if (!route)
+		goto unlock;
+
+	if (dst_cache_init(&route->cache, GFP_ATOMIC) < 0) {
+		kfree(route);
+		route = NULL;
+		goto unlock;
+	}
+
+	route->key = *key;
+	refcount_set(&route->refcount, 1);
+	hlist_add_head(&route->node, head);
+unlock:
+	spin_unlock_bh(&table->lock);
+
+	return route;
+}
+
+/* point peer to the entry matching key and record the routing generation its
+ * route was looked up at
+ */
+static struct dst_cache *ovpn_route_assign(struct ovpn_peer *peer,
+					   const struct ovpn_route_key *key,
+					   int genid)
+{
+	struct ovpn_route_table *table = peer->ovpn->routes;
+	struct ovpn_route *route, *old;
+
+	route = rcu_dereference(peer->route);
+	if (!route || memcmp(&route->key, key, sizeof(*key))) {
+		route = ovpn_route_get(table, key);
+		old = unrcu_pointer(xchg(&peer->route,
+					 RCU_INITIALIZER(route)));
+		ovpn_route_put(table, old);
+	}
+	WRITE_ONCE(peer->route_genid, genid);
+
+	return route ? &route->cache : NULL;
+}
+
+/**
+ * ovpn_route_cache_get - get the cache holding the route to a peer
+ * @peer: the destination peer
+ * @bind: the current binding of the peer
+ * @net: the netns the route is looked up in
+ *
+ * Must be called under RCU read lock with BHs disabled.
+ *
+ * Return: the dst cache to look the route up in or NULL if a full route
+ * lookup is required
+ */
+struct dst_cache *ovpn_route_cache_get(struct ovpn_peer *peer,
+				       const struct ovpn_bind *bind,
+				       const struct net *net)
+{
+	struct ovpn_route *route;
+	size_t len;
+
+	if (!peer->ovpn->routes)
+		return &peer->dst_cache;
+
+	route = rcu_dereference(peer->route);
+	if (!route || READ_ONCE(peer->route_genid) !=
+		      ovpn_route_genid(net, route->key.family))
+		return NULL;
+
+	/* the local endpoint may have been learnt since the last lookup */
+	len = route->key.family == AF_INET ? sizeof(bind->local.ipv4) :
+					     sizeof(bind->local.ipv6);
+	if (memchr_inv(&bind->local, 0, len) &&
+	    memcmp(&bind->local, route->key.saddr, len))
+		return NULL;
+
+	return &route->cache;
+}
+
+/**
+ * ovpn_route_cache_set4 - get the cache to store a new IPv4 route to a peer in
+ * @peer: the destination peer
+ * @genid: the routing generation sampled before looking up the route
+ * @rt: the route found for the peer
+ * @fl: the flow the route was looked up for
+ *
+ * Must be called under RCU read lock with BHs disabled.
+ *
+ * Return: the dst cache to store the route in or NULL if it should not be
+ * cached
+ */
+struct dst_cache *ovpn_route_cache_set4(struct ovpn_peer *peer, int genid,
+					const struct rtable *rt,
+					const struct flowi4 *fl)
+{
+	struct ovpn_route_key key = {
+		.family = AF_INET,
+		.ifindex = rt->dst.dev->ifindex,
+	};
+
+	if (!peer->ovpn->routes)
+		return &peer->dst_cache;
+
+	key.saddr[0] = fl->saddr;
+	if (!rt->rt_uses_gateway)
+		key.nexthop[0] = fl->daddr;
+	else if (rt->rt_gw_family == AF_INET)
+		key.nexthop[0] = rt->rt_gw4;
+	else
+		memcpy(key.nexthop, &rt->rt_gw6, sizeof(key.nexthop));
+
+	if (rt->rt_pmtu)
+		key.daddr[0] = fl->daddr;
+
+	return ovpn_route_assign(peer, &key, genid);
+}
+
+#if IS_ENABLED(CONFIG_IPV6)
+/**
+ * ovpn_route_cache_set6 - get the cache to store a new IPv6 route to a peer in
+ * @peer: the destination peer
+ * @genid: the routing generation sampled before looking up the route
+ * @dst: the route found for the peer
+ * @fl: the flow the route was looked up for
+ *
+ * Must be called under RCU read lock with BHs disabled.
+ *
+ * Return: the dst cache to store the route in or NULL if it should not be
+ * cached
+ */
+struct dst_cache *ovpn_route_cache_set6(struct ovpn_peer *peer, int genid,
+					const struct dst_entry *dst,
+					const struct flowi6 *fl)
+{
+	const struct rt6_info *rt = dst_rt6_info(dst);
+	struct ovpn_route_key key = {
+		.family = AF_INET6,
+		.ifindex = dst->dev->ifindex,
+	};
+
+	if (!peer->ovpn->routes)
+		return &peer->dst_cache;
+
+	memcpy(key.saddr, &fl->saddr, sizeof(key.saddr));
+	memcpy(key.nexthop, rt6_nexthop(rt, &fl->daddr), sizeof(key.nexthop));
+	if (rt->rt6i_flags & RTF_CACHE)
+		memcpy(key.daddr, &fl->daddr, sizeof(key.daddr));
+
+	return ovpn_route_assign(peer, &key, genid);
+}
+#endif
+
+/**
+ * ovpn_route_cache_reset - forget the cached route to a peer
+ * @peer: the peer whose route is not valid anymore
+ */
+void ovpn_route_cache_reset(struct ovpn_peer *peer)
+{
+	struct ovpn_route *old;
+
+	if (!peer->ovpn->routes) {
+		dst_cache_reset(&peer->dst_cache);
+		return;
+	}
+
+	old = unrcu_pointer(xchg(&peer->route, NULL));
+	ovpn_route_put(peer->ovpn->routes, old);
+}
+
+/* bumped whenever a neighbour or a redirect changes in any netns, telling
+ * the link layer headers cached by the bindings of direct interfaces apart
+ */
+static atomic_t ovpn_neigh_gen = ATOMIC_INIT(1);
+
+/**
+ * ovpn_route_neigh_gen - get the neighbour generation
+ *
+ * Return: a value changing whenever any neighbour is updated
+ */
+u32 ovpn_route_neigh_gen(void)
+{
+	return atomic_read(&ovpn_neigh_gen);
+}
+
+/**
+ * ovpn_route_neigh_hh - copy the link layer header towards a next hop
+ * @dev: the device the next hop is reached over
+ * @family: the address family of @nexthop
+ * @nexthop: the next hop
+ * @hh: where to copy the header to, HH_DATA_MOD bytes, aligned to their end
+ *
+ * Only headers the neighbour code cached for a confirmed neighbour and
+ * fitting in HH_DATA_MOD bytes are copied, like Ethernet headers.
+ * Must be called under RCU read lock.
+ *
+ * Return: the length of the header or 0 if none could be copied
+ */
+unsigned int ovpn_route_neigh_hh(struct net_device *dev, sa_family_t family,
+				 const void *nexthop, u8 *hh)
+{
+	struct neighbour *neigh = NULL;
+	unsigned int len, seq;
+
+	if (family == AF_INET)
+		neigh = __ipv4_neigh_lookup_noref(dev, *(const u32 *)nexthop);
+#if IS_ENABLED(CONFIG_IPV6)
+	else if (family == AF_INET6)
+		neigh = __ipv6_neigh_lookup_noref_stub(dev, nexthop);
+#endif
+	if (!neigh || !(READ_ONCE(neigh->nud_state) & NUD_CONNECTED))
+		return 0;
+
+	do {
+		seq = read_seqbegin(&neigh->hh.hh_lock);
+		len = READ_ONCE(neigh->hh.hh_len);
+		if (len && len <= HH_DATA_MOD)
+			memcpy(hh, neigh->hh.hh_data, HH_DATA_MOD);
+	} while (read_seqretry(&neigh->hh.hh_lock, seq));
+
+	return len <= HH_DATA_MOD ? len : 0;
+}
+
+static int ovpn_route_netevent(struct notifier_block *nb,
+			       unsigned long event, void *ptr)
+{
+	if (event == NETEVENT_NEIGH_UPDATE || event == NETEVENT_REDIRECT)
+		atomic_inc(&ovpn_neigh_gen);
+
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block ovpn_route_netevent_nb = {
+	.notifier_call = ovpn_route_netevent,
+};
+
+/**
+ * ovpn_route_neigh_init - start tracking neighbour updates
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_route_neigh_init(void)
+{
+	return register_netevent_notifier(&ovpn_route_netevent_nb);
+}
+
+/**
+ * ovpn_route_neigh_cleanup - stop tracking neighbour updates
+ */
+void ovpn_route_neigh_cleanup(void)
+{
+	unregister_netevent_notifier(&ovpn_route_netevent_nb);
+}
@@ -0,0 +1,138 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_ROUTE_H_
+#define _NET_OVPN_ROUTE_H_
+
+#include <linux/refcount.h>
+#include <linux/spinlock.h>
+#include <net/dst_cache.h>
+#include <net/flow.h>
+#include <net/ipv6.h>
+#include <net/ipv6_stubs.h>
+#include <net/net_namespace.h>
+
+struct net_device;
+struct ovpn_bind;
+struct ovpn_peer;
+struct rtable;
+
+/* number of buckets of the shared route table */
+#define OVPN_ROUTE_TABLE_SIZE 64
+
+/**
+ * struct ovpn_route_key - what a shared route cache entry is looked up by
+ * @saddr: local address packets are sent from
+ * @nexthop: next hop packets are sent to
+ * @daddr: destination, only set for routes specific to one destination
+ * @ifindex: index of the output device
+ * @family: address family of the route
+ * @pad: padding so that the key can be hashed as an array of u32
+ */
+struct ovpn_route_key {
+	__be32 saddr[4];
+	__be32 nexthop[4];
+	__be32 daddr[4];
+	int ifindex;
+	u16 family;
+	u16 pad;
+};
+
+/**
+ * struct ovpn_route - dst cache shared by the peers using the same route
+ * @node: entry in the shared route table bucket
+ * @key: the local address and next hop the cached route uses
+ * @cache: the cached route
+ * @refcount: number of peers referencing this entry
+ * @rcu: used to free the entry in an RCU safe way
+ */
+struct ovpn_route {
+	struct hlist_node node;
+	struct ovpn_route_key key;
+	struct dst_cache cache;
+	refcount_t refcount;
+	struct rcu_head rcu;
+};
+
+/**
+ * struct ovpn_route_table - routes shared by the peers of an interface
+ * @buckets: entries hashed by key
+ * @lock: protects the buckets and the entries refcount
+ */
+struct ovpn_route_table {
+	struct hlist_head buckets[OVPN_ROUTE_TABLE_SIZE];
+	spinlock_t lock; /* protects buckets */
+};
+
+/**
+ * ovpn_route_genid - get the routing generation of a netns
+ * @net: the netns routes are looked up in
+ * @family: the address family of the routes
+ *
+ * Return: a value changing whenever a route in net is modified
+ */
+static inline int ovpn_route_genid(const struct net *net, sa_family_t family)
+{
+#if IS_ENABLED(CONFIG_IPV6)
+	/* rt_genid_ipv6() is not bumped when IPv6 routes are added or
+	 * deleted, unlike the serial number of the FIB
+	 */
+	if (family == AF_INET6)
+		return atomic_read(&net->ipv6.fib6_sernum);
+#endif
+	return rt_genid_ipv4(net);
+}
+
+#if IS_ENABLED(CONFIG_IPV6)
+/**
+ * ovpn_route_lookup6 - look an IPv6 route up
+ * @net: the netns to look the route up in
+ * @sk: the socket the route is for, if any
+ * @fl: the flow to route, whose source address may be filled in
+ *
+ * The IPv6 stub is only needed when IPv6 is a module: with IPv6 built in
+ * the lookup is a direct call, rather than an indirect one paying the
+ * retpoline cost on mitigated CPUs.
+ *
+ * Return: the route, or an ERR_PTR() if there is none
+ */
+static inline struct dst_entry *ovpn_route_lookup6(struct net *net,
+						   const struct sock *sk,
+						   struct flowi6 *fl)
+{
+#if IS_BUILTIN(CONFIG_IPV6)
+	return ip6_dst_lookup_flow(net, sk, fl, NULL);
+#else
+	return ipv6_stub->ipv6_dst_lookup_flow(net, sk, fl, NULL);
+#endif
+}
+#endif
+
+struct ovpn_route_table *ovpn_route_table_alloc(void);
+void ovpn_route_table_free(struct ovpn_route_table *table);
+
+struct dst_cache *ovpn_route_cache_get(struct ovpn_peer *peer,
+				       const struct ovpn_bind *bind,
+				       const struct net *net);
+struct dst_cache *ovpn_route_cache_set4(struct ovpn_peer *peer, int genid,
+					const struct rtable *rt,
+					const struct flowi4 *fl);
+#if IS_ENABLED(CONFIG_IPV6)
+struct dst_cache *ovpn_route_cache_set6(struct ovpn_peer *peer, int genid,
+					const struct dst_entry *dst,
+					const struct flowi6 *fl);
+#endif
+void ovpn_route_cache_reset(struct ovpn_peer *peer);
+
+u32 ovpn_route_neigh_gen(void);
+unsigned int ovpn_route_neigh_hh(struct net_device *dev, sa_family_t family,
+				 const void *nexthop, u8 *hh);
+int ovpn_route_neigh_init(void);
+void ovpn_route_neigh_cleanup(void);
+
+#endif /* _NET_OVPN_ROUTE_H_ */
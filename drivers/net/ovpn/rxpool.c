@@ -0,0 +1,166 @@
+// SPDX-License-Identifier: GPL-2.0
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include <linux/bottom_half.h>
+#include <linux/netdevice.h>
+#include <linux/percpu.h>
+#include <net/page_pool/helpers.h>
+
+#include "ovpnstruct.h"
+#include "rxpool.h"
+
+/* Packets that cannot be decrypted in place (i.e. cloned or fragmented skbs
+ * coming from the UDP socket) are decrypted into a new linear skb built on a
+ * page taken from a per-CPU page_pool owned by the interface. Once the
+ * decrypted packet is consumed by the stack, its page goes back to the pool
+ * it was taken from, so that the next packet can reuse it without hitting
+ * the page allocator.
+ */
+
+/* number of pages each per-CPU pool can keep for recycling */
+#define OVPN_RX_POOL_SIZE 256
+/* on compact interfaces: 64KB per CPU rather than 1MB with 4KB pages */
+#define OVPN_RX_POOL_SIZE_COMPACT 16
+
+/**
+ * ovpn_rx_pools_init - create the per-CPU RX page pools of an interface
+ * @ovpn: the instance to create the pools for
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_rx_pools_init(struct ovpn_struct *ovpn)
+{
+	struct page_pool_params pp_params = {
+		.order = 0,
+		.pool_size = ovpn->compact ? OVPN_RX_POOL_SIZE_COMPACT :
+					     OVPN_RX_POOL_SIZE,
+	};
+	struct page_pool *pool;
+	int cpu;
+
+	ovpn->rx_pools = alloc_percpu(struct page_pool *);
+	if (!ovpn->rx_pools)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		pp_params.nid = cpu_to_node(cpu);
+		pool = page_pool_create_percpu(&pp_params, cpu);
+		if (IS_ERR(pool)) {
+			ovpn_rx_pools_free(ovpn);
+			return PTR_ERR(pool);
+		}
+		*per_cpu_ptr(ovpn->rx_pools, cpu) = pool;
+	}
+
+	return 0;
+}
+
+/**
+ * ovpn_rx_pools_free - destroy the per-CPU RX page pools of an interface
+ * @ovpn: the instance whose pools should be destroyed
+ *
+ * Pages still in flight are released by the page_pool core once they are
+ * returned.
+ */
+void ovpn_rx_pools_free(struct ovpn_struct *ovpn)
+{
+	int cpu;
+
+	if (!ovpn->rx_pools)
+		return;
+
+	for_each_possible_cpu(cpu)
+		page_pool_destroy(*per_cpu_ptr(ovpn->rx_pools, cpu));
+
+	free_percpu(ovpn->rx_pools);
+	ovpn->rx_pools = NULL;
+}
+
+/**
+ * ovpn_rx_pool_alloc_skb - allocate a linear skb from the local RX pool
+ * @ovpn: the instance receiving the packet
+ * @len: the amount of data the skb must be able to hold
+ *
+ * The returned skb is empty, has OVPN_RX_POOL_HEADROOM bytes of headroom and
+ * returns its page to the pool when freed.
+ *
+ * Return: the new skb or NULL if len does not fit a page or memory is not
+ * available
+ */
+struct sk_buff *ovpn_rx_pool_alloc_skb(struct ovpn_struct *ovpn,
+				       unsigned int len)
+{
+	struct page_pool *pool;
+	struct sk_buff *skb;
+	struct page *page;
+
+	if (unlikely(len > OVPN_RX_POOL_MAX_LEN))
+		return NULL;
+
+	/* the alloc cache of a pool is lockless and relies on softirq
+	 * serialization, while the TCP transport may receive from process
+	 * context
+	 */
+	local_bh_disable();
+	pool = this_cpu_read(*ovpn->rx_pools);
+	page = page_pool_dev_alloc_pages(pool);
+	local_bh_enable();
+	if (unlikely(!page))
+		return NULL;
+
+	skb = build_skb(page_address(page), PAGE_SIZE);
+	if (unlikely(!skb)) {
+		page_pool_put_full_page(pool, page, false);
+		return NULL;
+	}
+
+	skb_mark_for_recycle(skb);
+	skb_reserve(skb, OVPN_RX_POOL_HEADROOM);
+
+	return skb;
+}
+
+/**
+ * ovpn_rx_pools_stats_count - get number of page pool counters
+ *
+ * Return: the amount of counters reported by ovpn_rx_pools_stats_fetch()
+ */
+int ovpn_rx_pools_stats_count(void)
+{
+	return page_pool_ethtool_stats_get_count();
+}
+
+/**
+ * ovpn_rx_pools_stats_strings - copy page pool counter names to ethtool
+ * @data: the buffer to fill with ETH_GSTRING_LEN long entries
+ */
+void ovpn_rx_pools_stats_strings(u8 *data)
+{
+	page_pool_ethtool_stats_get_strings(data);
+}
+
+/**
+ * ovpn_rx_pools_stats_fetch - sum up the counters of all the RX pools
+ * @ovpn: the instance whose counters should be reported
+ * @data: array of ovpn_rx_pools_stats_count() elements to fill
+ *
+ * Comparing the recycle counters to the slow allocations tells how often a
+ * decrypted packet reused a page.
+ */
+void ovpn_rx_pools_stats_fetch(struct ovpn_struct *ovpn, u64 *data)
+{
+#ifdef CONFIG_PAGE_POOL_STATS
+	struct page_pool_stats stats = {};
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		page_pool_get_stats(*per_cpu_ptr(ovpn->rx_pools, cpu), &stats);
+
+	page_pool_ethtool_stats_get(data, &stats);
+#endif
+}
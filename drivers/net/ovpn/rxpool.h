@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_RXPOOL_H_
+#define _NET_OVPN_RXPOOL_H_
+
+#include <linux/skbuff.h>
+
+struct ovpn_struct;
+
+/* headroom left in front of a packet decrypted into a pool page */
+#define OVPN_RX_POOL_HEADROOM	NET_SKB_PAD
+
+/* largest packet that can be decrypted into a pool page */
+#define OVPN_RX_POOL_MAX_LEN	\
+	(SKB_WITH_OVERHEAD(PAGE_SIZE) - OVPN_RX_POOL_HEADROOM)
+
+int ovpn_rx_pools_init(struct ovpn_struct *ovpn);
+void ovpn_rx_pools_free(struct ovpn_struct *ovpn);
+struct sk_buff *ovpn_rx_pool_alloc_skb(struct ovpn_struct *ovpn,
+				       unsigned int len);
+
+int ovpn_rx_pools_stats_count(void);
+void ovpn_rx_pools_stats_strings(u8 *data);
+void ovpn_rx_pools_stats_fetch(struct ovpn_struct *ovpn, u64 *data);
+
+#endif /* _NET_OVPN_RXPOOL_H_ */
@@ -0,0 +1,161 @@
+// SPDX-License-Identifier: GPL-2.0
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include <linux/random.h>
+#include <linux/slab.h>
+#include <net/netlink.h>
+
+#include "ovpnstruct.h"
+#include "netlink.h"
+#include "peer.h"
+#include "sample.h"
+
+/* Like sFlow, each CPU skips a random number of packets between two samples,
+ * averaging the configured rate, so that periodic traffic patterns do not
+ * bias the samples. The headers of the sampled plaintext packets are
+ * appended to a netlink message along with the peer, the key and the
+ * direction they were seen with, and a work item multicasts the messages.
+ * Samples are dropped while nobody listens or too many messages are
+ * pending.
+ */
+
+/* packets to let through before the next sample, on average rate */
+static unsigned int ovpn_sample_skip(unsigned int rate)
+{
+	if (rate == 1)
+		return 1;
+
+	return 1 + get_random_u32_below(2 * rate - 1);
+}
+
+static void ovpn_sample_work(struct work_struct *work)
+{
+	struct ovpn_sampler *sampler = container_of(work, struct ovpn_sampler,
+						    work);
+	struct sk_buff_head ready;
+	struct sk_buff *msg;
+
+	__skb_queue_head_init(&ready);
+
+	spin_lock_bh(&sampler->lock);
+	skb_queue_splice_tail_init(&sampler->ready, &ready);
+	if (sampler->msg)
+		__skb_queue_tail(&ready, sampler->msg);
+	sampler->msg = NULL;
+	spin_unlock_bh(&sampler->lock);
+
+	while ((msg = __skb_dequeue(&ready)))
+		ovpn_nl_notify_samples(sampler->ovpn, msg);
+}
+
+/**
+ * __ovpn_sample_skb - export the header of a sampled packet
+ * @sampler: the sampler of the interface
+ * @peer: the peer the packet is sent to or received from
+ * @skb: the packet, left untouched
+ * @key_id: the key the packet is encrypted or was decrypted with
+ * @tx: whether the packet is sent rather than received
+ */
+void __ovpn_sample_skb(struct ovpn_sampler *sampler,
+		       const struct ovpn_peer *peer, const struct sk_buff *skb,
+		       u8 key_id, bool tx)
+{
+	struct sk_buff *msg;
+
+	this_cpu_write(*sampler->countdown, ovpn_sample_skip(sampler->rate));
+
+	if (!ovpn_nl_samples_has_listeners(sampler->ovpn))
+		return;
+
+	spin_lock_bh(&sampler->lock);
+	msg = sampler->msg;
+	if (msg && !ovpn_nl_put_sample(msg, peer, skb, key_id, tx))
+		goto out;
+
+	if (unlikely(skb_queue_len(&sampler->ready) >= OVPN_SAMPLE_BACKLOG))
+		goto unlock;
+
+	/* the current message is full: start a new one */
+	if (msg)
+		__skb_queue_tail(&sampler->ready, msg);
+	sampler->msg = NULL;
+
+	msg = nlmsg_new(NLMSG_GOODSIZE, GFP_ATOMIC);
+	if (unlikely(!msg))
+		goto unlock;
+
+	if (unlikely(ovpn_nl_put_sample(msg, peer, skb, key_id, tx))) {
+		nlmsg_free(msg);
+		goto unlock;
+	}
+	sampler->msg = msg;
+out:
+	spin_unlock_bh(&sampler->lock);
+	schedule_work(&sampler->work);
+	return;
+unlock:
+	spin_unlock_bh(&sampler->lock);
+}
+
+/**
+ * ovpn_sample_init - start sampling the packets of an interface
+ * @ovpn: the instance to sample the packets of
+ * @rate: one packet every @rate is sampled, on average
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_sample_init(struct ovpn_struct *ovpn, unsigned int rate)
+{
+	struct ovpn_sampler *sampler;
+	int cpu;
+
+	sampler = kzalloc(sizeof(*sampler), GFP_KERNEL);
+	if (!sampler)
+		return -ENOMEM;
+
+	sampler->countdown = alloc_percpu(unsigned int);
+	if (!sampler->countdown) {
+		kfree(sampler);
+		return -ENOMEM;
+	}
+
+	sampler->rate = rate;
+	for_each_possible_cpu(cpu)
+		*per_cpu_ptr(sampler->countdown, cpu) = ovpn_sample_skip(rate);
+
+	spin_lock_init(&sampler->lock);
+	__skb_queue_head_init(&sampler->ready);
+	INIT_WORK(&sampler->work, ovpn_sample_work);
+	sampler->ovpn = ovpn;
+
+	ovpn->sampler = sampler;
+
+	return 0;
+}
+
+/**
+ * ovpn_sample_destroy - stop sampling the packets of an interface
+ * @ovpn: the instance to stop sampling the packets of
+ *
+ * Samples not delivered yet are dropped.
+ */
+void ovpn_sample_destroy(struct ovpn_struct *ovpn)
+{
+	struct ovpn_sampler *sampler = ovpn->sampler;
+
+	if (!sampler)
+		return;
+
+	cancel_work_sync(&sampler->work);
+	__skb_queue_purge(&sampler->ready);
+	nlmsg_free(sampler->msg);
+
+	free_percpu(sampler->countdown);
+	kfree(sampler);
+	ovpn->sampler = NULL;
+}
@@ -0,0 +1,70 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_SAMPLE_H_
+#define _NET_OVPN_SAMPLE_H_
+
+#include <linux/percpu.h>
+#include <linux/skbuff.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+#include "ovpnstruct.h"
+#include "peer.h"
+
+/* bytes of the inner packet exported with each sample */
+#define OVPN_SAMPLE_HEADER	128
+/* netlink messages full of samples that may wait for delivery */
+#define OVPN_SAMPLE_BACKLOG	16
+
+/**
+ * struct ovpn_sampler - sampled export of the packets of an interface
+ * @rate: one packet every @rate is sampled, on average
+ * @countdown: packets each CPU lets through before taking the next sample
+ * @lock: protects @msg and @ready
+ * @msg: netlink message samples are currently appended to
+ * @ready: full netlink messages waiting for delivery
+ * @work: delivers @ready and @msg to the OVPN_NLGRP_SAMPLES multicast group
+ * @ovpn: the instance the packets go through
+ */
+struct ovpn_sampler {
+	unsigned int rate;
+	unsigned int __percpu *countdown;
+	spinlock_t lock; /* protects msg and ready */
+	struct sk_buff *msg;
+	struct sk_buff_head ready;
+	struct work_struct work;
+	struct ovpn_struct *ovpn;
+};
+
+void __ovpn_sample_skb(struct ovpn_sampler *sampler,
+		       const struct ovpn_peer *peer, const struct sk_buff *skb,
+		       u8 key_id, bool tx);
+
+/**
+ * ovpn_sample_skb - count a plaintext packet towards the next sample
+ * @peer: the peer the packet is sent to or received from
+ * @skb: the packet, left untouched
+ * @key_id: the key the packet is encrypted or was decrypted with
+ * @tx: whether the packet is sent rather than received
+ */
+static inline void ovpn_sample_skb(const struct ovpn_peer *peer,
+				   const struct sk_buff *skb, u8 key_id,
+				   bool tx)
+{
+	struct ovpn_sampler *sampler = peer->ovpn->sampler;
+
+	if (unlikely(sampler) &&
+	    unlikely(!this_cpu_dec_return(*sampler->countdown)))
+		__ovpn_sample_skb(sampler, peer, skb, key_id, tx);
+}
+
+int ovpn_sample_init(struct ovpn_struct *ovpn, unsigned int rate);
+void ovpn_sample_destroy(struct ovpn_struct *ovpn);
+
+#endif /* _NET_OVPN_SAMPLE_H_ */
@@ -0,0 +1,223 @@
+// SPDX-License-Identifier: GPL-2.0
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include <linux/netdevice.h>
+#include <linux/pkt_sched.h>
+#include <linux/skbuff.h>
+#include <linux/slab.h>
+
+#include "ovpnstruct.h"
+#include "main.h"
+#include "drop.h"
+#include "io.h"
+#include "peer.h"
+#include "sched.h"
+#include "skb.h"
+
+/* In MP mode, packets leaving the stack are processed in the order they
+ * arrive: one peer receiving a bulk download can take all the TX CPU time of
+ * the interface and delay the packets of interactive peers. With fair queuing
+ * enabled, packets are rather queued per peer and a NAPI context serves the
+ * peers by Deficit Round Robin: in every round a peer may send up to its
+ * weight times the MTU worth of bytes before the next peer is served.
+ *
+ * Within the turn of a peer, latency sensitive packets are sent first: those
+ * the stack classified as interactive or control traffic (like pfifo_fast
+ * does) and those marked with a DSCP of CS5 and above, voice included.
+ *
+ * A peer with packets waiting is on the active list and the scheduler holds
+ * a reference to it, released once its queues are drained. The queues of a
+ * peer are bounded by OVPN_QUEUE_LEN: under overload packets are dropped on
+ * enqueue.
+ */
+
+/* lowest DSCP of the latency sensitive packets (CS5) */
+#define OVPN_SCHED_DSCP_PRIO	40
+
+static bool ovpn_sched_is_prio(struct sk_buff *skb)
+{
+	return (skb->priority & TC_PRIO_MAX) >= TC_PRIO_INTERACTIVE ||
+	       (ovpn_ip_dsfield(skb) >> 2) >= OVPN_SCHED_DSCP_PRIO;
+}
+
+/* queue of peer the next packet should be dequeued from */
+static struct sk_buff_head *ovpn_sched_next(struct ovpn_peer *peer)
+{
+	if (!skb_queue_empty(&peer->sched_prio))
+		return &peer->sched_prio;
+
+	return &peer->sched_queue;
+}
+
+/* bytes a peer is credited with in every round */
+static int ovpn_sched_quantum(struct ovpn_peer *peer)
+{
+	return READ_ONCE(peer->ovpn->dev->mtu) * READ_ONCE(peer->sched_weight);
+}
+
+static int ovpn_sched_poll(struct napi_struct *napi, int budget)
+{
+	struct ovpn_sched *sched = container_of(napi, struct ovpn_sched, napi);
+	struct sk_buff *skb, *first, **tail;
+	struct sk_buff_head *queue;
+	struct ovpn_peer *peer;
+	int work_done = 0;
+	bool drained;
+
+	while (work_done < budget) {
+		spin_lock(&sched->lock);
+		peer = list_first_entry_or_null(&sched->active, struct ovpn_peer,
+						sched_entry);
+		if (!peer) {
+			spin_unlock(&sched->lock);
+			break;
+		}
+
+		first = NULL;
+		tail = &first;
+		while (work_done < budget) {
+			queue = ovpn_sched_next(peer);
+			skb = skb_peek(queue);
+			if (!skb || skb->len > peer->sched_deficit)
+				break;
+
+			__skb_unlink(skb, queue);
+			peer->sched_deficit -= skb->len;
+			*tail = skb;
+			tail = &skb->next;
+			work_done++;
+		}
+
+		skb = skb_peek(ovpn_sched_next(peer));
+		drained = !skb;
+		if (drained) {
+			list_del_init(&peer->sched_entry);
+		} else if (skb->len > peer->sched_deficit) {
+			/* turn of the peer over, serve it again last */
+			peer->sched_deficit += ovpn_sched_quantum(peer);
+			list_move_tail(&peer->sched_entry, &sched->active);
+		}
+		/* otherwise the budget is over and the peer goes on first at the
+		 * next poll
+		 */
+		spin_unlock(&sched->lock);
+
+		if (first)
+			ovpn_encrypt_list(peer, first, OVPN_TX_NOW);
+		if (drained)
+			ovpn_peer_put(peer);
+	}
+
+	if (work_done < budget)
+		napi_complete_done(napi, work_done);
+
+	return work_done;
+}
+
+/**
+ * ovpn_sched_init - create the TX scheduler of an interface
+ * @ovpn: the instance to create the scheduler for
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_sched_init(struct ovpn_struct *ovpn)
+{
+	struct ovpn_sched *sched;
+
+	sched = kzalloc(sizeof(*sched), GFP_KERNEL);
+	if (!sched)
+		return -ENOMEM;
+
+	spin_lock_init(&sched->lock);
+	INIT_LIST_HEAD(&sched->active);
+	netif_napi_add_tx(ovpn->dev, &sched->napi, ovpn_sched_poll);
+	napi_enable(&sched->napi);
+
+	ovpn->sched = sched;
+
+	return 0;
+}
+
+/**
+ * ovpn_sched_destroy - tear down the TX scheduler of an interface
+ * @ovpn: the instance whose scheduler should be destroyed
+ *
+ * Packets still waiting are dropped and the references to their peers are
+ * released.
+ */
+void ovpn_sched_destroy(struct ovpn_struct *ovpn)
+{
+	struct ovpn_sched *sched = ovpn->sched;
+	struct ovpn_peer *peer, *tmp;
+
+	if (!sched)
+		return;
+
+	napi_disable(&sched->napi);
+	netif_napi_del(&sched->napi);
+
+	list_for_each_entry_safe(peer, tmp, &sched->active, sched_entry) {
+		list_del_init(&peer->sched_entry);
+		__skb_queue_purge(&peer->sched_queue);
+		__skb_queue_purge(&peer->sched_prio);
+		ovpn_peer_put(peer);
+	}
+
+	kfree(sched);
+	ovpn->sched = NULL;
+}
+
+/**
+ * ovpn_sched_enqueue - queue packets until the turn of their peer comes
+ * @peer: the peer the packets should be sent to
+ * @skb: the first packet of the list to queue
+ *
+ * Packets exceeding the queue of the peer are dropped.
+ */
+void ovpn_sched_enqueue(struct ovpn_peer *peer, struct sk_buff *skb)
+{
+	struct ovpn_sched *sched = peer->ovpn->sched;
+	struct sk_buff_head drop, *queue;
+	struct sk_buff *curr, *next;
+	bool kick = false;
+
+	__skb_queue_head_init(&drop);
+
+	spin_lock_bh(&sched->lock);
+	skb_list_walk_safe(skb, curr, next) {
+		skb_mark_not_on_list(curr);
+
+		if (unlikely(skb_queue_len(&peer->sched_queue) +
+			     skb_queue_len(&peer->sched_prio) >=
+			     OVPN_QUEUE_LEN)) {
+			__skb_queue_tail(&drop, curr);
+			continue;
+		}
+
+		queue = ovpn_sched_is_prio(curr) ? &peer->sched_prio :
+						   &peer->sched_queue;
+		__skb_queue_tail(queue, curr);
+	}
+
+	if (!skb_queue_empty(ovpn_sched_next(peer)) &&
+	    list_empty(&peer->sched_entry)) {
+		/* released by the poll once the queues are drained */
+		kref_get(&peer->refcount);
+		peer->sched_deficit = ovpn_sched_quantum(peer);
+		list_add_tail(&peer->sched_entry, &sched->active);
+		kick = true;
+	}
+	spin_unlock_bh(&sched->lock);
+
+	/* the NAPI context is already scheduled while any peer is active */
+	if (kick)
+		napi_schedule(&sched->napi);
+
+	while ((curr = __skb_dequeue(&drop)))
+		ovpn_peer_tx_drop(peer, curr, OVPN_DROP_SCHED_QUEUE);
+}
@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_SCHED_H_
+#define _NET_OVPN_SCHED_H_
+
+#include <linux/list.h>
+#include <linux/netdevice.h>
+#include <linux/spinlock.h>
+
+struct ovpn_peer;
+struct ovpn_struct;
+struct sk_buff;
+
+/* default weight of a peer in the TX scheduler */
+#define OVPN_SCHED_WEIGHT 1
+
+/**
+ * struct ovpn_sched - per-peer fair queuing of the packets to send (MP only)
+ * @lock: protects @active and the scheduler state of all peers
+ * @active: peers with packets waiting, in the order they are served
+ * @napi: the NAPI context dequeueing from the peers in @active
+ */
+struct ovpn_sched {
+	spinlock_t lock; /* protects active and the peer queues */
+	struct list_head active;
+	struct napi_struct napi;
+};
+
+int ovpn_sched_init(struct ovpn_struct *ovpn);
+void ovpn_sched_destroy(struct ovpn_struct *ovpn);
+void ovpn_sched_enqueue(struct ovpn_peer *peer, struct sk_buff *skb);
+
+#endif /* _NET_OVPN_SCHED_H_ */
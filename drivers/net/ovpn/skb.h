@@ -13,17 +13,37 @@
 #include <linux/in.h>
 #include <linux/in6.h>
 #include <linux/ip.h>
+#include <linux/ipv6.h>
 #include <linux/skbuff.h>
 #include <linux/socket.h>
 #include <linux/types.h>
+#include <net/dsfield.h>
+
+struct ovpn_parallel_job;
 
 struct ovpn_cb {
 	struct ovpn_peer *peer;
 	struct sk_buff *skb;
 	struct ovpn_crypto_key_slot *ks;
 	struct aead_request *req;
-	size_t orig_len;
-	unsigned int payload_offset;
+	union {
+		struct sk_buff_head *batch;
+		struct ovpn_parallel_job *job;
+	};
+	unsigned int orig_len;
+	union {
+		u16 payload_offset;	/* RX only */
+		struct {		/* TX only */
+			u8 dsfield;
+			bool df:1;
+			/* skb->tstamp is not a delivery time of the stack */
+			bool own_tstamp:1;
+		};
+	};
+	bool ks_held:1;
+	bool parallel:1;
+	/* charged to the memory budget of the interface */
+	bool mem_charged:1;
 };
 
 static inline struct ovpn_cb *ovpn_skb_cb(struct sk_buff *skb)
@@ -53,4 +73,47 @@ static inline __be16 ovpn_ip_check_protocol(struct sk_buff *skb)
 	return proto;
 }
 
+/* Return the length of the IP header of skb, as ip_rcv() and ipv6_rcv() set
+ * the transport header: IPv6 extension headers are left to the stack.
+ * skb->protocol must have been set by ovpn_decrypt_post() from the IP version
+ * of the decrypted packet, which ovpn_ip_check_protocol() only validates.
+ */
+static inline unsigned int ovpn_ip_hdrlen(const struct sk_buff *skb)
+{
+	if (skb->protocol == htons(ETH_P_IP))
+		return ip_hdr(skb)->ihl * 4;
+
+	return sizeof(struct ipv6hdr);
+}
+
+/* Return the DS field (DSCP and ECN) of the IP header of skb.
+ * Return 0 if skb does not carry an IP packet.
+ */
+static inline u8 ovpn_ip_dsfield(const struct sk_buff *skb)
+{
+	switch (skb->protocol) {
+	case htons(ETH_P_IP):
+		return ipv4_get_dsfield(ip_hdr(skb));
+	case htons(ETH_P_IPV6):
+		return ipv6_get_dsfield(ipv6_hdr(skb));
+	default:
+		return 0;
+	}
+}
+
+/* Return whether the IP packet in skb must not be fragmented on its way,
+ * which is always the case for IPv6.
+ */
+static inline bool ovpn_ip_df(const struct sk_buff *skb)
+{
+	switch (skb->protocol) {
+	case htons(ETH_P_IP):
+		return !!(ip_hdr(skb)->frag_off & htons(IP_DF));
+	case htons(ETH_P_IPV6):
+		return true;
+	default:
+		return false;
+	}
+}
+
 #endif /* _NET_OVPN_SKB_H_ */
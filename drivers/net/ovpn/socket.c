@@ -9,6 +9,7 @@
 
 #include <linux/net.h>
 #include <linux/netdevice.h>
+#include <net/udp_tunnel.h>
 
 #include "ovpnstruct.h"
 #include "main.h"
@@ -31,6 +32,16 @@ static void ovpn_socket_detach(struct socket *sock)
 	sockfd_put(sock);
 }
 
+static void ovpn_socket_release_work(struct work_struct *work)
+{
+	struct ovpn_socket *sock = container_of(work, struct ovpn_socket,
+						release_work);
+
+	ovpn_udp_socket_detach(sock->sock);
+	udp_tunnel_sock_release(sock->sock);
+	kfree_rcu(sock, rcu);
+}
+
 /**
  * ovpn_socket_release_kref - kref_put callback
  * @kref: the kref object
@@ -40,6 +51,15 @@ void ovpn_socket_release_kref(struct kref *kref)
 	struct ovpn_socket *sock = container_of(kref, struct ovpn_socket,
 						refcount);
 
+	/* closing a socket may sleep, while the last reference may be dropped
+	 * by the datapath
+	 */
+	if (test_bit(OVPN_SOCKET_KERNEL, &sock->flags)) {
+		INIT_WORK(&sock->release_work, ovpn_socket_release_work);
+		queue_work(system_unbound_wq, &sock->release_work);
+		return;
+	}
+
 	ovpn_socket_detach(sock->sock);
 	kfree_rcu(sock, rcu);
 }
@@ -64,7 +84,8 @@ static struct ovpn_socket *ovpn_socket_get(struct socket *sock)
 	return ovpn_sock;
 }
 
-static int ovpn_socket_attach(struct socket *sock, struct ovpn_peer *peer)
+static int ovpn_socket_attach(struct socket *sock, struct ovpn_peer *peer,
+			      bool stripe)
 {
 	int ret = -EOPNOTSUPP;
 
@@ -74,7 +95,7 @@ static int ovpn_socket_attach(struct socket *sock, struct ovpn_peer *peer)
 	if (sock->sk->sk_protocol == IPPROTO_UDP)
 		ret = ovpn_udp_socket_attach(sock, peer->ovpn);
 	else if (sock->sk->sk_protocol == IPPROTO_TCP)
-		ret = ovpn_tcp_socket_attach(sock, peer);
+		ret = ovpn_tcp_socket_attach(sock, peer, stripe);
 
 	return ret;
 }
@@ -94,25 +115,20 @@ struct ovpn_struct *ovpn_from_udp_sock(struct sock *sk)
 		return NULL;
 
 	/* make sure that sk matches our stored transport socket */
-	if (unlikely(!ovpn_sock->sock || sk != ovpn_sock->sock->sk))
+	if (unlikely(sk != ovpn_sock->sk))
 		return NULL;
 
 	return ovpn_sock->ovpn;
 }
 
-/**
- * ovpn_socket_new - create a new socket and initialize it
- * @sock: the kernel socket to embed
- * @peer: the peer reachable via this socket
- *
- * Return: an openvpn socket on success or a negative error code otherwise
- */
-struct ovpn_socket *ovpn_socket_new(struct socket *sock, struct ovpn_peer *peer)
+static struct ovpn_socket *__ovpn_socket_new(struct socket *sock,
+					     struct ovpn_peer *peer,
+					     bool stripe)
 {
 	struct ovpn_socket *ovpn_sock;
 	int ret;
 
-	ret = ovpn_socket_attach(sock, peer);
+	ret = ovpn_socket_attach(sock, peer, stripe);
 	if (ret < 0 && ret != -EALREADY)
 		return ERR_PTR(ret);
 
@@ -142,6 +158,7 @@ struct ovpn_socket *ovpn_socket_new(struct socket *sock, struct ovpn_peer *peer)
 	}
 
 	ovpn_sock->sock = sock;
+	ovpn_sock->sk = sock->sk;
 	kref_init(&ovpn_sock->refcount);
 
 	/* TCP sockets are per-peer, therefore they are linked to their unique
@@ -149,17 +166,111 @@ struct ovpn_socket *ovpn_socket_new(struct socket *sock, struct ovpn_peer *peer)
 	 */
 	if (sock->sk->sk_protocol == IPPROTO_TCP) {
 		ovpn_sock->peer = peer;
+		ovpn_sock->tcp = ovpn_tcp_stream(sock->sk);
 	} else {
 		/* in UDP we only link the ovpn instance since the socket is
-		 * shared among multiple peers
+		 * shared among multiple peers. Sockets shared among instances
+		 * are owned by none of them
 		 */
-		ovpn_sock->ovpn = peer->ovpn;
+		if (peer->ovpn->shared_socket)
+			set_bit(OVPN_SOCKET_SHARED, &ovpn_sock->flags);
+		else
+			ovpn_sock->ovpn = peer->ovpn;
 	}
 
 	rcu_assign_sk_user_data(sock->sk, ovpn_sock);
 
+	if (sock->sk->sk_protocol == IPPROTO_UDP)
+		ovpn_udp_socket_set_cb(ovpn_sock);
+	else if (stripe)
+		ovpn_tcp_stripe_add(peer, ovpn_sock);
+
 	return ovpn_sock;
 err:
 	ovpn_socket_detach(sock);
 	return ERR_PTR(ret);
 }
+
+/**
+ * ovpn_socket_new - create a new socket and initialize it
+ * @sock: the kernel socket to embed
+ * @peer: the peer reachable via this socket
+ *
+ * Return: an openvpn socket on success or a negative error code otherwise
+ */
+struct ovpn_socket *ovpn_socket_new(struct socket *sock, struct ovpn_peer *peer)
+{
+	return __ovpn_socket_new(sock, peer, false);
+}
+
+/**
+ * ovpn_socket_new_stripe - add a TCP socket to the streams of a peer
+ * @sock: the connected TCP socket to embed
+ * @peer: the TCP peer, with room for one more stripe
+ *
+ * Packets are spread over all the streams of @peer, which receives from all
+ * of them too. The new socket is owned by the first stream of @peer rather
+ * than by @peer itself, see ovpn_tcp_stripe_add().
+ *
+ * Return: an openvpn socket on success or a negative error code otherwise
+ */
+struct ovpn_socket *ovpn_socket_new_stripe(struct socket *sock,
+					   struct ovpn_peer *peer)
+{
+	return __ovpn_socket_new(sock, peer, true);
+}
+
+/**
+ * ovpn_socket_new_connected - create a UDP socket connected to a peer
+ * @peer: the UDP peer to connect the socket to
+ *
+ * The socket is bound to the local endpoint of @peer, on the port of its
+ * socket, and connected to its remote endpoint. The packets of @peer then
+ * hit the socket through the early demux of the stack, while those of other
+ * peers keep reaching the socket of the instance. The socket is attached
+ * before being bound, so that no data packet is missed meanwhile.
+ *
+ * Return: an openvpn socket on success or an error pointer otherwise
+ */
+struct ovpn_socket *ovpn_socket_new_connected(struct ovpn_peer *peer)
+{
+	struct ovpn_socket *ovpn_sock;
+	struct socket *sock;
+	int ret;
+
+	ret = ovpn_udp_sock_create(peer, &sock);
+	if (ret < 0)
+		return ERR_PTR(ret);
+
+	ret = ovpn_udp_socket_attach(sock, peer->ovpn);
+	if (ret < 0)
+		goto err_release;
+
+	ovpn_sock = kzalloc(sizeof(*ovpn_sock), GFP_KERNEL);
+	if (!ovpn_sock) {
+		ret = -ENOMEM;
+		goto err_detach;
+	}
+
+	ovpn_sock->sock = sock;
+	ovpn_sock->sk = sock->sk;
+	ovpn_sock->ovpn = peer->ovpn;
+	set_bit(OVPN_SOCKET_KERNEL, &ovpn_sock->flags);
+	kref_init(&ovpn_sock->refcount);
+
+	rcu_assign_sk_user_data(sock->sk, ovpn_sock);
+	ovpn_udp_socket_set_cb(ovpn_sock);
+
+	ret = ovpn_udp_sock_connect(peer, sock);
+	if (ret < 0) {
+		ovpn_socket_put(ovpn_sock);
+		return ERR_PTR(ret);
+	}
+
+	return ovpn_sock;
+err_detach:
+	ovpn_udp_socket_detach(sock);
+err_release:
+	udp_tunnel_sock_release(sock);
+	return ERR_PTR(ret);
+}
@@ -13,17 +13,47 @@
 #include <linux/net.h>
 #include <linux/kref.h>
 #include <linux/ptr_ring.h>
+#include <linux/workqueue.h>
 #include <net/sock.h>
 
 struct ovpn_struct;
 struct ovpn_peer;
+struct ovpn_peer_tcp;
+
+/**
+ * enum ovpn_socket_flags - bits of ovpn_socket::flags
+ * @OVPN_SOCKET_TX_STOPPED: netdev TX queues were stopped because the send
+ *			    buffer of the socket is full
+ * @OVPN_SOCKET_SHARED: the socket is shared by the instances of its netns
+ *			created with a shared socket, it has no owner
+ * @OVPN_SOCKET_KERNEL: the socket was created by ovpn to be connected to a
+ *			peer, it is closed along with this object
+ * @OVPN_SOCKET_CSUM6_RX: zero UDP checksums were allowed over the IPv6 socket
+ *			  on behalf of its instance, until it is detached
+ * @OVPN_SOCKET_GRO: UDP GRO was enabled on the socket on behalf of its
+ *		     instance, until it is detached
+ */
+enum ovpn_socket_flags {
+	OVPN_SOCKET_TX_STOPPED,
+	OVPN_SOCKET_SHARED,
+	OVPN_SOCKET_KERNEL,
+	OVPN_SOCKET_CSUM6_RX,
+	OVPN_SOCKET_GRO,
+};
 
 /**
  * struct ovpn_socket - a kernel socket referenced in the ovpn code
- * @ovpn: ovpn instance owning this socket (UDP only)
+ * @ovpn: ovpn instance owning this socket (UDP only, NULL if shared)
  * @peer: unique peer transmitting over this socket (TCP only)
+ * @tcp: state of the stream carried by this socket (TCP only)
+ * @sk: the sock of @sock, cached next to @ovpn for the receive path
  * @sock: the low level sock object
+ * @sk_write_space: original sk_write_space callback of the socket (UDP only)
+ * @bound_dev_if: device the socket was bound to when attached (UDP only)
+ * @l3mdev: L3 master device (VRF) of @bound_dev_if, 0 if none (UDP only)
+ * @flags: state of the socket, see enum ovpn_socket_flags (UDP only)
  * @refcount: amount of contexts currently referencing this object
+ * @release_work: closes the socket in process context (kernel sockets only)
  * @rcu: member used to schedule RCU destructor callback
  */
 struct ovpn_socket {
@@ -32,8 +62,15 @@ struct ovpn_socket {
 		struct ovpn_peer *peer;
 	};
 
+	struct ovpn_peer_tcp *tcp;
+	struct sock *sk;
 	struct socket *sock;
+	void (*sk_write_space)(struct sock *sk);
+	int bound_dev_if;
+	int l3mdev;
+	unsigned long flags;
 	struct kref refcount;
+	struct work_struct release_work;
 	struct rcu_head rcu;
 };
 
@@ -50,5 +87,8 @@ static inline void ovpn_socket_put(struct ovpn_socket *sock)
 
 struct ovpn_socket *ovpn_socket_new(struct socket *sock,
 				    struct ovpn_peer *peer);
+struct ovpn_socket *ovpn_socket_new_stripe(struct socket *sock,
+					   struct ovpn_peer *peer);
+struct ovpn_socket *ovpn_socket_new_connected(struct ovpn_peer *peer);
 
 #endif /* _NET_OVPN_SOCK_H_ */
@@ -8,14 +8,363 @@
  */
 
 #include <linux/atomic.h>
+#include <linux/ethtool.h>
+#include <linux/netdevice.h>
 
+#include "ovpnstruct.h"
+#include "peer.h"
 #include "stats.h"
 
-void ovpn_peer_stats_init(struct ovpn_peer_stats *ps)
+static void
+ovpn_peer_stats_total(const struct ovpn_peer_stats __percpu *pstats,
+		      struct ovpn_peer_stats_sum *sum)
 {
-	atomic64_set(&ps->rx.bytes, 0);
-	atomic64_set(&ps->rx.packets, 0);
+	u64 rx_bytes, rx_packets, tx_bytes, tx_packets;
+	const struct ovpn_peer_stats *stats;
+	unsigned int start;
+	int cpu;
 
-	atomic64_set(&ps->tx.bytes, 0);
-	atomic64_set(&ps->tx.packets, 0);
+	memset(sum, 0, sizeof(*sum));
+
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(pstats, cpu);
+		do {
+			start = u64_stats_fetch_begin(&stats->syncp);
+			rx_bytes = u64_stats_read(&stats->rx.bytes);
+			rx_packets = u64_stats_read(&stats->rx.packets);
+			tx_bytes = u64_stats_read(&stats->tx.bytes);
+			tx_packets = u64_stats_read(&stats->tx.packets);
+		} while (u64_stats_fetch_retry(&stats->syncp, start));
+
+		sum->rx_bytes += rx_bytes;
+		sum->rx_packets += rx_packets;
+		sum->tx_bytes += tx_bytes;
+		sum->tx_packets += tx_packets;
+	}
+}
+
+static void
+ovpn_peer_errors_total(const struct ovpn_peer_errors __percpu *perrors,
+		       struct ovpn_peer_errors_sum *sum)
+{
+	const struct ovpn_peer_errors *errors;
+	struct ovpn_peer_errors_sum tmp;
+	unsigned int start;
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+
+	for_each_possible_cpu(cpu) {
+		errors = per_cpu_ptr(perrors, cpu);
+		do {
+			start = u64_stats_fetch_begin(&errors->syncp);
+			tmp.decrypt = u64_stats_read(&errors->decrypt);
+			tmp.replay = u64_stats_read(&errors->replay);
+			tmp.rpf = u64_stats_read(&errors->rpf);
+			tmp.no_key = u64_stats_read(&errors->no_key);
+			tmp.budget = u64_stats_read(&errors->budget);
+			tmp.tx_drop = u64_stats_read(&errors->tx_drop);
+		} while (u64_stats_fetch_retry(&errors->syncp, start));
+
+		sum->decrypt += tmp.decrypt;
+		sum->replay += tmp.replay;
+		sum->rpf += tmp.rpf;
+		sum->no_key += tmp.no_key;
+		sum->budget += tmp.budget;
+		sum->tx_drop += tmp.tx_drop;
+	}
+}
+
+/* the per-CPU counters can only be written by the CPU owning them, so they
+ * are never zeroed: a reset records their totals instead, which are then
+ * subtracted from what is reported. A fetch racing with a reset may read
+ * a base more recent than the totals it summed up, hence the clamping.
+ */
+static u64 ovpn_stat_since(u64 total, const atomic64_t *base)
+{
+	u64 b = atomic64_read(base);
+
+	return total > b ? total - b : 0;
+}
+
+/**
+ * ovpn_peer_stats_fetch - sum up per-CPU peer counters
+ * @pstats: the per-CPU counters to read
+ * @base: the totals at the last reset
+ * @sum: the object to store the totals since the last reset into
+ */
+void ovpn_peer_stats_fetch(const struct ovpn_peer_stats __percpu *pstats,
+			   const struct ovpn_peer_stats_base *base,
+			   struct ovpn_peer_stats_sum *sum)
+{
+	ovpn_peer_stats_total(pstats, sum);
+
+	sum->rx_bytes = ovpn_stat_since(sum->rx_bytes, &base->rx_bytes);
+	sum->rx_packets = ovpn_stat_since(sum->rx_packets, &base->rx_packets);
+	sum->tx_bytes = ovpn_stat_since(sum->tx_bytes, &base->tx_bytes);
+	sum->tx_packets = ovpn_stat_since(sum->tx_packets, &base->tx_packets);
+}
+
+/**
+ * ovpn_peer_errors_fetch - sum up per-CPU peer drop counters
+ * @perrors: the per-CPU counters to read
+ * @base: the totals at the last reset
+ * @sum: the object to store the totals since the last reset into
+ */
+void ovpn_peer_errors_fetch(const struct ovpn_peer_errors __percpu *perrors,
+			    const struct ovpn_peer_errors_base *base,
+			    struct ovpn_peer_errors_sum *sum)
+{
+	ovpn_peer_errors_total(perrors, sum);
+
+	sum->decrypt = ovpn_stat_since(sum->decrypt, &base->decrypt);
+	sum->replay = ovpn_stat_since(sum->replay, &base->replay);
+	sum->rpf = ovpn_stat_since(sum->rpf, &base->rpf);
+	sum->no_key = ovpn_stat_since(sum->no_key, &base->no_key);
+	sum->budget = ovpn_stat_since(sum->budget, &base->budget);
+	sum->tx_drop = ovpn_stat_since(sum->tx_drop, &base->tx_drop);
+}
+
+/**
+ * ovpn_peer_stats_reset - restart peer stats from zero
+ * @pstats: the per-CPU counters to reset
+ * @base: the totals to move to the current values of @pstats
+ */
+void ovpn_peer_stats_reset(const struct ovpn_peer_stats __percpu *pstats,
+			   struct ovpn_peer_stats_base *base)
+{
+	struct ovpn_peer_stats_sum sum;
+
+	ovpn_peer_stats_total(pstats, &sum);
+
+	atomic64_set(&base->rx_bytes, sum.rx_bytes);
+	atomic64_set(&base->rx_packets, sum.rx_packets);
+	atomic64_set(&base->tx_bytes, sum.tx_bytes);
+	atomic64_set(&base->tx_packets, sum.tx_packets);
+}
+
+/**
+ * ovpn_peer_errors_reset - restart peer drop counters from zero
+ * @perrors: the per-CPU counters to reset
+ * @base: the totals to move to the current values of @perrors
+ */
+void ovpn_peer_errors_reset(const struct ovpn_peer_errors __percpu *perrors,
+			    struct ovpn_peer_errors_base *base)
+{
+	struct ovpn_peer_errors_sum sum;
+
+	ovpn_peer_errors_total(perrors, &sum);
+
+	atomic64_set(&base->decrypt, sum.decrypt);
+	atomic64_set(&base->replay, sum.replay);
+	atomic64_set(&base->rpf, sum.rpf);
+	atomic64_set(&base->no_key, sum.no_key);
+	atomic64_set(&base->budget, sum.budget);
+	atomic64_set(&base->tx_drop, sum.tx_drop);
+}
+
+struct ovpn_dev_stat_desc {
+	char name[ETH_GSTRING_LEN];
+	size_t offset;
+};
+
+#define OVPN_DEV_STAT(_name)						\
+	{ .name = #_name, .offset = offsetof(struct ovpn_dev_stats, _name) }
+
+#define OVPN_DEV_STAT_BUCKET(_name, _i, _range)				\
+	{ .name = #_name "_" _range,					\
+	  .offset = offsetof(struct ovpn_dev_stats, _name[_i]) }
+
+/* one counter per bucket, named after the batch sizes it accounts for */
+static_assert(OVPN_BATCH_HIST_BUCKETS == 7);
+#define OVPN_DEV_STAT_HIST(_name)					\
+	OVPN_DEV_STAT_BUCKET(_name, 0, "1"),				\
+	OVPN_DEV_STAT_BUCKET(_name, 1, "2_3"),				\
+	OVPN_DEV_STAT_BUCKET(_name, 2, "4_7"),				\
+	OVPN_DEV_STAT_BUCKET(_name, 3, "8_15"),				\
+	OVPN_DEV_STAT_BUCKET(_name, 4, "16_31"),			\
+	OVPN_DEV_STAT_BUCKET(_name, 5, "32_63"),			\
+	OVPN_DEV_STAT_BUCKET(_name, 6, "64_up")
+
+static const struct ovpn_dev_stat_desc ovpn_dev_stats_desc[] = {
+	OVPN_DEV_STAT(aead_req_cache_hit),
+	OVPN_DEV_STAT(aead_req_cache_miss),
+	OVPN_DEV_STAT(aead_encrypt_in_place),
+	OVPN_DEV_STAT(aead_encrypt_out_of_place),
+	OVPN_DEV_STAT(aead_csum_deferred),
+	OVPN_DEV_STAT(aead_decrypt_in_place),
+	OVPN_DEV_STAT(aead_decrypt_out_of_place),
+	OVPN_DEV_STAT(rx_backlog_dropped),
+	OVPN_DEV_STAT(rx_steered),
+	OVPN_DEV_STAT(rx_parallel_offload),
+	OVPN_DEV_STAT(rx_c2c_forwarded),
+	OVPN_DEV_STAT(aead_backlogged),
+	OVPN_DEV_STAT(crypto_inflight_dropped),
+	OVPN_DEV_STAT(aead_async_done),
+	OVPN_DEV_STAT(tx_gso_segments),
+	OVPN_DEV_STAT(tx_shared),
+	OVPN_DEV_STAT(tcp_tx_eagain),
+	OVPN_DEV_STAT(udp_tx_stop),
+	OVPN_DEV_STAT(keepalive_tx),
+	OVPN_DEV_STAT(keepalive_rx),
+	OVPN_DEV_STAT(peer_float),
+	OVPN_DEV_STAT(peer_sock_switch),
+	OVPN_DEV_STAT(peer_miss_id),
+	OVPN_DEV_STAT(peer_miss_transp_addr),
+	OVPN_DEV_STAT(peer_miss_dst),
+	OVPN_DEV_STAT(peer_idle),
+	OVPN_DEV_STAT_HIST(tx_gso_burst),
+	OVPN_DEV_STAT_HIST(rx_gro_batch),
+	OVPN_DEV_STAT_HIST(crypto_batch),
+	OVPN_DEV_STAT_HIST(udp_tx_train),
+	OVPN_DEV_STAT(lock_peers_contended),
+	OVPN_DEV_STAT(lock_peer_contended),
+	OVPN_DEV_STAT(lock_crypto_contended),
+	OVPN_DEV_STAT(lock_tcp_sock_contended),
+#define OVPN_DEV_STAT_DROP(_reason, _name)				\
+	{ .name = "drop_" #_name,					\
+	  .offset = offsetof(struct ovpn_dev_stats,			\
+			     drops[OVPN_DROP_IDX(OVPN_DROP_##_reason)]) },
+	OVPN_DROP_REASONS(OVPN_DEV_STAT_DROP)
+#undef OVPN_DEV_STAT_DROP
+};
+
+/**
+ * ovpn_dev_stats_count - get number of interface-wide counters
+ *
+ * Return: the amount of counters reported by ovpn_dev_stats_fetch()
+ */
+int ovpn_dev_stats_count(void)
+{
+	return ARRAY_SIZE(ovpn_dev_stats_desc);
+}
+
+/**
+ * ovpn_dev_stats_strings - copy counter names to the ethtool buffer
+ * @data: the buffer to fill with ETH_GSTRING_LEN long entries
+ */
+void ovpn_dev_stats_strings(u8 *data)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(ovpn_dev_stats_desc); i++)
+		ethtool_puts(&data, ovpn_dev_stats_desc[i].name);
+}
+
+/**
+ * ovpn_dev_stats_fetch - sum up per-CPU counters
+ * @ovpn: the instance whose counters should be reported
+ * @data: array of ovpn_dev_stats_count() elements to fill
+ */
+void ovpn_dev_stats_fetch(struct ovpn_struct *ovpn, u64 *data)
+{
+	const struct ovpn_dev_stats *stats;
+	unsigned int start;
+	int cpu, i;
+
+	memset(data, 0, sizeof(*data) * ARRAY_SIZE(ovpn_dev_stats_desc));
+
+	for_each_possible_cpu(cpu) {
+		u64 tmp[ARRAY_SIZE(ovpn_dev_stats_desc)];
+
+		stats = per_cpu_ptr(ovpn->stats, cpu);
+		do {
+			start = u64_stats_fetch_begin(&stats->syncp);
+			for (i = 0; i < ARRAY_SIZE(ovpn_dev_stats_desc); i++)
+				tmp[i] = u64_stats_read((const u64_stats_t *)
+							((const u8 *)stats +
+							 ovpn_dev_stats_desc[i].offset));
+		} while (u64_stats_fetch_retry(&stats->syncp, start));
+
+		for (i = 0; i < ARRAY_SIZE(ovpn_dev_stats_desc); i++)
+			data[i] += tmp[i];
+	}
+}
+
+/**
+ * ovpn_drop_count - account for a dropped packet
+ * @ovpn: the instance the packet was dropped on
+ * @tx: whether the packet was being sent or received
+ * @reason: why the packet was dropped
+ */
+void ovpn_drop_count(struct ovpn_struct *ovpn, bool tx,
+		     enum ovpn_drop_reason reason)
+{
+	if (tx)
+		dev_core_stats_tx_dropped_inc(ovpn->dev);
+	else
+		dev_core_stats_rx_dropped_inc(ovpn->dev);
+
+	ovpn_dev_stats_inc(ovpn, drops[OVPN_DROP_IDX(reason)]);
+}
+
+/**
+ * ovpn_peer_drop_count - account for a packet of a peer being dropped
+ * @peer: the peer the packet was received from or destined to
+ * @tx: whether the packet was being sent or received
+ * @reason: why the packet was dropped
+ *
+ * On top of the interface counters, the drop is accounted for in the
+ * counters of the peer: all TX drops and the RX drops that point at a
+ * misbehaving peer.
+ */
+void ovpn_peer_drop_count(struct ovpn_peer *peer, bool tx,
+			  enum ovpn_drop_reason reason)
+{
+	struct ovpn_peer_errors *errors;
+	unsigned long flags;
+	u64_stats_t *stat;
+
+	ovpn_drop_count(peer->ovpn, tx, reason);
+
+	errors = get_cpu_ptr(peer->errors);
+	if (tx)
+		stat = &errors->tx_drop;
+	else if (reason == OVPN_DROP_DECRYPT)
+		stat = &errors->decrypt;
+	else if (reason == OVPN_DROP_REPLAY)
+		stat = &errors->replay;
+	else if (reason == OVPN_DROP_RPF)
+		stat = &errors->rpf;
+	else if (reason == OVPN_DROP_NO_KEY)
+		stat = &errors->no_key;
+	else if (reason == OVPN_DROP_DECRYPT_BUDGET)
+		stat = &errors->budget;
+	else
+		stat = NULL;
+
+	if (stat) {
+		/* the TCP transport may drop from process context */
+		flags = u64_stats_update_begin_irqsave(&errors->syncp);
+		u64_stats_inc(stat);
+		u64_stats_update_end_irqrestore(&errors->syncp, flags);
+	}
+	put_cpu_ptr(peer->errors);
+}
+
+/* names reported by the drop monitor, indexed by reason within the
+ * subsystem
+ */
+static const char * const ovpn_drop_reasons[] = {
+	[0] = "OVPN_DROP_REASON",
+#define S(x, y) "OVPN_DROP_" #x,
+	OVPN_DROP_REASONS(S)
+#undef S
+};
+
+static const struct drop_reason_list ovpn_drop_reason_list = {
+	.reasons = ovpn_drop_reasons,
+	.n_reasons = ARRAY_SIZE(ovpn_drop_reasons),
+};
+
+/* make the drop reasons of ovpn known to the drop monitor */
+void ovpn_drop_reasons_register(void)
+{
+	drop_reasons_register_subsys(SKB_DROP_REASON_SUBSYS_OVPN,
+				     &ovpn_drop_reason_list);
+}
+
+void ovpn_drop_reasons_unregister(void)
+{
+	drop_reasons_unregister_subsys(SKB_DROP_REASON_SUBSYS_OVPN);
 }
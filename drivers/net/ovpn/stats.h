@@ -11,37 +11,316 @@
 #ifndef _NET_OVPN_OVPNSTATS_H_
 #define _NET_OVPN_OVPNSTATS_H_
 
+#include <linux/atomic.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+
+#include "drop.h"
+
+struct ovpn_struct;
+
 /* one stat */
 struct ovpn_peer_stat {
-	atomic64_t bytes;
-	atomic64_t packets;
+	u64_stats_t bytes;
+	u64_stats_t packets;
 };
 
-/* rx and tx stats combined */
+/* rx and tx stats combined, kept per-CPU */
 struct ovpn_peer_stats {
 	struct ovpn_peer_stat rx;
 	struct ovpn_peer_stat tx;
+	struct u64_stats_sync syncp;
 };
 
-void ovpn_peer_stats_init(struct ovpn_peer_stats *ps);
+/* rx and tx stats summed up over all CPUs */
+struct ovpn_peer_stats_sum {
+	u64 rx_bytes;
+	u64 rx_packets;
+	u64 tx_bytes;
+	u64 tx_packets;
+};
+
+/* totals of the per-CPU rx and tx stats at their last reset */
+struct ovpn_peer_stats_base {
+	atomic64_t rx_bytes;
+	atomic64_t rx_packets;
+	atomic64_t tx_bytes;
+	atomic64_t tx_packets;
+};
 
-static inline void ovpn_peer_stats_increment(struct ovpn_peer_stat *stat,
-					     const unsigned int n)
+static inline void
+ovpn_peer_stats_increment(struct ovpn_peer_stats __percpu *pstats,
+			  bool tx, const unsigned int n)
 {
-	atomic64_add(n, &stat->bytes);
-	atomic64_inc(&stat->packets);
+	struct ovpn_peer_stats *stats;
+	struct ovpn_peer_stat *stat;
+	unsigned long flags;
+
+	stats = get_cpu_ptr(pstats);
+	stat = tx ? &stats->tx : &stats->rx;
+
+	/* the TCP transport may update stats from process context */
+	flags = u64_stats_update_begin_irqsave(&stats->syncp);
+	u64_stats_add(&stat->bytes, n);
+	u64_stats_inc(&stat->packets);
+	u64_stats_update_end_irqrestore(&stats->syncp, flags);
+	put_cpu_ptr(pstats);
 }
 
-static inline void ovpn_peer_stats_increment_rx(struct ovpn_peer_stats *stats,
-						const unsigned int n)
+static inline void
+ovpn_peer_stats_increment_rx(struct ovpn_peer_stats __percpu *pstats,
+			     const unsigned int n)
 {
-	ovpn_peer_stats_increment(&stats->rx, n);
+	ovpn_peer_stats_increment(pstats, false, n);
 }
 
-static inline void ovpn_peer_stats_increment_tx(struct ovpn_peer_stats *stats,
-						const unsigned int n)
+static inline void
+ovpn_peer_stats_increment_tx(struct ovpn_peer_stats __percpu *pstats,
+			     const unsigned int n)
 {
-	ovpn_peer_stats_increment(&stats->tx, n);
+	ovpn_peer_stats_increment(pstats, true, n);
 }
 
+void ovpn_peer_stats_fetch(const struct ovpn_peer_stats __percpu *pstats,
+			   const struct ovpn_peer_stats_base *base,
+			   struct ovpn_peer_stats_sum *sum);
+void ovpn_peer_stats_reset(const struct ovpn_peer_stats __percpu *pstats,
+			   struct ovpn_peer_stats_base *base);
+
+/**
+ * struct ovpn_peer_errors - per-peer drop counters, kept per-CPU
+ * @decrypt: received packets failing decryption or authentication
+ * @replay: received packets rejected by the replay protection
+ * @rpf: received packets dropped by the reverse path filter
+ * @no_key: received packets carrying an unknown key ID
+ * @budget: received packets exceeding the decryption budget of the peer
+ * @tx_drop: packets to send dropped for any reason
+ * @syncp: synchronization point for 64bit counters on 32bit architectures
+ */
+struct ovpn_peer_errors {
+	u64_stats_t decrypt;
+	u64_stats_t replay;
+	u64_stats_t rpf;
+	u64_stats_t no_key;
+	u64_stats_t budget;
+	u64_stats_t tx_drop;
+	struct u64_stats_sync syncp;
+};
+
+/* per-peer drop counters summed up over all CPUs */
+struct ovpn_peer_errors_sum {
+	u64 decrypt;
+	u64 replay;
+	u64 rpf;
+	u64 no_key;
+	u64 budget;
+	u64 tx_drop;
+};
+
+/* totals of the per-CPU drop counters at their last reset */
+struct ovpn_peer_errors_base {
+	atomic64_t decrypt;
+	atomic64_t replay;
+	atomic64_t rpf;
+	atomic64_t no_key;
+	atomic64_t budget;
+	atomic64_t tx_drop;
+};
+
+void ovpn_peer_errors_fetch(const struct ovpn_peer_errors __percpu *perrors,
+			    const struct ovpn_peer_errors_base *base,
+			    struct ovpn_peer_errors_sum *sum);
+void ovpn_peer_errors_reset(const struct ovpn_peer_errors __percpu *perrors,
+			    struct ovpn_peer_errors_base *base);
+
+/* batch sizes are accounted for in power of 2 buckets: bucket i counts the
+ * batches of 2^i to 2^(i+1) - 1 packets, the last one all larger batches
+ */
+#define OVPN_BATCH_HIST_BUCKETS	7
+
+/**
+ * struct ovpn_dev_stats - interface-wide datapath counters
+ * @aead_req_cache_hit: AEAD requests taken from the per-CPU key slot cache
+ * @aead_req_cache_miss: AEAD requests allocated because the cache was empty
+ * @aead_encrypt_in_place: packets encrypted in their own buffer
+ * @aead_encrypt_out_of_place: packets encrypted into a new linear buffer,
+ *			       instead of being linearized first
+ * @aead_csum_deferred: cloned packets whose inner checksum was computed while
+ *			encrypting them out of place, instead of copying their
+ *			head first
+ * @aead_decrypt_in_place: packets decrypted in their own buffer
+ * @aead_decrypt_out_of_place: packets decrypted into a page of the RX pool,
+ *			       instead of being copied first
+ * @rx_backlog_dropped: decrypted packets dropped because the per-CPU RX
+ *			queue was full
+ * @rx_steered: received packets steered to the preferred RX CPU of their peer
+ * @rx_parallel_offload: received packets handed over to the parallel engine
+ *			 by adaptive parallel RX, the CPU being overloaded
+ * @rx_c2c_forwarded: decrypted packets forwarded straight to another peer
+ * @aead_backlogged: requests queued to the backlog of a saturated async
+ *		     crypto engine
+ * @crypto_inflight_dropped: received packets dropped because too many
+ *			     packets of the same peer were pending on an async
+ *			     crypto engine
+ * @aead_async_done: requests completed asynchronously by a crypto engine
+ * @tx_gso_segments: segments produced by software GSO before encryption
+ * @tx_shared: packets to send that were shared when entering ovpn
+ * @tcp_tx_eagain: sends over a TCP transport socket interrupted because the
+ *		   socket held enough unsent data or its buffer was full
+ * @udp_tx_stop: netdev TX queue stops due to the send buffer of a UDP
+ *		 transport socket being full
+ * @keepalive_tx: keepalive messages sent
+ * @keepalive_rx: keepalive messages received
+ * @peer_float: changes of the transport address of a peer
+ * @peer_sock_switch: changes of the UDP socket used to reply to a peer
+ * @peer_miss_id: received packets carrying an unknown peer ID
+ * @peer_miss_transp_addr: received packets with undefined peer ID coming
+ *			   from an unknown transport address
+ * @peer_miss_dst: packets to send to a destination no peer serves
+ * @peer_idle: peers whose resources were released for being idle
+ * @tx_gso_burst: packets passed to ndo_start_xmit(), by number of segments
+ * @rx_gro_batch: runs of decrypted packets handed to GRO by a NAPI poll, by
+ *		  number of packets
+ * @crypto_batch: lists of packets encrypted or decrypted back-to-back, by
+ *		  number of packets
+ * @udp_tx_train: sends over a UDP transport socket, by number of packets
+ * @lock_peers_contended: acquisitions of the lock of the peer tables that
+ *			  had to wait
+ * @lock_peer_contended: acquisitions of the lock of a peer, serializing
+ *			 updates of its endpoint, that had to wait
+ * @lock_crypto_contended: acquisitions of the mutex of the crypto state of a
+ *			   peer that had to wait
+ * @lock_tcp_sock_contended: accesses to a TCP transport socket owned by
+ *			     another context, which then had to wait or to
+ *			     defer the work
+ * @drops: dropped packets, per enum ovpn_drop_reason (see OVPN_DROP_IDX())
+ * @syncp: synchronization point for 64bit counters on 32bit architectures
+ *
+ * Counters are kept per-CPU and are summed up only when reported to
+ * userspace via ethtool -S
+ */
+struct ovpn_dev_stats {
+	u64_stats_t aead_req_cache_hit;
+	u64_stats_t aead_req_cache_miss;
+	u64_stats_t aead_encrypt_in_place;
+	u64_stats_t aead_encrypt_out_of_place;
+	u64_stats_t aead_csum_deferred;
+	u64_stats_t aead_decrypt_in_place;
+	u64_stats_t aead_decrypt_out_of_place;
+	u64_stats_t rx_backlog_dropped;
+	u64_stats_t rx_steered;
+	u64_stats_t rx_parallel_offload;
+	u64_stats_t rx_c2c_forwarded;
+	u64_stats_t aead_backlogged;
+	u64_stats_t crypto_inflight_dropped;
+	u64_stats_t aead_async_done;
+	u64_stats_t tx_gso_segments;
+	u64_stats_t tx_shared;
+	u64_stats_t tcp_tx_eagain;
+	u64_stats_t udp_tx_stop;
+	u64_stats_t keepalive_tx;
+	u64_stats_t keepalive_rx;
+	u64_stats_t peer_float;
+	u64_stats_t peer_sock_switch;
+	u64_stats_t peer_miss_id;
+	u64_stats_t peer_miss_transp_addr;
+	u64_stats_t peer_miss_dst;
+	u64_stats_t peer_idle;
+	u64_stats_t tx_gso_burst[OVPN_BATCH_HIST_BUCKETS];
+	u64_stats_t rx_gro_batch[OVPN_BATCH_HIST_BUCKETS];
+	u64_stats_t crypto_batch[OVPN_BATCH_HIST_BUCKETS];
+	u64_stats_t udp_tx_train[OVPN_BATCH_HIST_BUCKETS];
+	u64_stats_t lock_peers_contended;
+	u64_stats_t lock_peer_contended;
+	u64_stats_t lock_crypto_contended;
+	u64_stats_t lock_tcp_sock_contended;
+	u64_stats_t drops[OVPN_DROP_NUM];
+	struct u64_stats_sync syncp;
+};
+
+/**
+ * ovpn_dev_stats_add - add to an interface-wide counter
+ * @_ovpn: the ovpn instance owning the counter
+ * @_field: the ovpn_dev_stats member to update
+ * @_n: the amount to add
+ *
+ * Counters are updated from process, softirq and hardirq context (async
+ * crypto completions): interrupts are disabled while writing, so that the
+ * writers of a CPU do not nest.
+ */
+#define ovpn_dev_stats_add(_ovpn, _field, _n)				\
+	do {								\
+		struct ovpn_dev_stats *_stats;				\
+		unsigned long _flags;					\
+									\
+		_stats = get_cpu_ptr((_ovpn)->stats);			\
+		_flags = u64_stats_update_begin_irqsave(&_stats->syncp); \
+		u64_stats_add(&_stats->_field, _n);			\
+		u64_stats_update_end_irqrestore(&_stats->syncp, _flags); \
+		put_cpu_ptr((_ovpn)->stats);				\
+	} while (0)
+
+/**
+ * ovpn_dev_stats_inc - increment an interface-wide counter
+ * @_ovpn: the ovpn instance owning the counter
+ * @_field: the ovpn_dev_stats member to increment
+ */
+#define ovpn_dev_stats_inc(_ovpn, _field)				\
+	ovpn_dev_stats_add(_ovpn, _field, 1)
+
+/**
+ * ovpn_spin_lock_bh_stat - take a spinlock, counting contended acquisitions
+ * @_ovpn: the ovpn instance owning the counter
+ * @_lock: the spinlock to take with BHs disabled
+ * @_field: the ovpn_dev_stats member to increment if @_lock is busy
+ *
+ * Only the slow path is accounted for, the fast path costs a trylock.
+ */
+#define ovpn_spin_lock_bh_stat(_ovpn, _lock, _field)			\
+	do {								\
+		if (unlikely(!spin_trylock_bh(_lock))) {		\
+			ovpn_dev_stats_inc(_ovpn, _field);		\
+			spin_lock_bh(_lock);				\
+		}							\
+	} while (0)
+
+/**
+ * ovpn_mutex_lock_stat - take a mutex, counting contended acquisitions
+ * @_ovpn: the ovpn instance owning the counter
+ * @_lock: the mutex to take
+ * @_field: the ovpn_dev_stats member to increment if @_lock is busy
+ */
+#define ovpn_mutex_lock_stat(_ovpn, _lock, _field)			\
+	do {								\
+		if (unlikely(!mutex_trylock(_lock))) {			\
+			ovpn_dev_stats_inc(_ovpn, _field);		\
+			mutex_lock(_lock);				\
+		}							\
+	} while (0)
+
+/**
+ * ovpn_batch_hist_bucket - get the histogram bucket of a batch size
+ * @n: the number of packets in the batch
+ *
+ * Return: the index of the bucket accounting for @n
+ */
+static inline unsigned int ovpn_batch_hist_bucket(unsigned int n)
+{
+	return min_t(unsigned int, ilog2(n | 1), OVPN_BATCH_HIST_BUCKETS - 1);
+}
+
+/**
+ * ovpn_dev_stats_hist - account for a batch in an interface-wide histogram
+ * @_ovpn: the ovpn instance owning the histogram
+ * @_field: the ovpn_dev_stats histogram to update
+ * @_n: the number of packets in the batch
+ */
+#define ovpn_dev_stats_hist(_ovpn, _field, _n)				\
+	ovpn_dev_stats_inc(_ovpn, _field[ovpn_batch_hist_bucket(_n)])
+
+int ovpn_dev_stats_count(void);
+void ovpn_dev_stats_strings(u8 *data);
+void ovpn_dev_stats_fetch(struct ovpn_struct *ovpn, u64 *data);
+
 #endif /* _NET_OVPN_OVPNSTATS_H_ */
@@ -7,100 +7,140 @@
  */
 
 #include <linux/skbuff.h>
+#include <asm/unaligned.h>
 #include <net/hotdata.h>
 #include <net/inet_common.h>
 #include <net/tcp.h>
 #include <net/route.h>
+#include <trace/events/ovpn.h>
 #include <trace/events/sock.h>
 
 #include "ovpnstruct.h"
 #include "main.h"
+#include "ctrl.h"
+#include "drop.h"
 #include "io.h"
+#include "latency.h"
+#include "mem.h"
 #include "packet.h"
 #include "peer.h"
 #include "proto.h"
 #include "skb.h"
 #include "socket.h"
+#include "stats.h"
 #include "tcp.h"
 
+/* backlog of encrypted packets (in bytes) queued to a single TCP stream: the
+ * netdev TX queue is stopped above STOP, woken again below WAKE and packets
+ * exceeding MAX are dropped. It is kept short, so that packets rather wait
+ * in the qdisc of the interface, where they can be scheduled per flow
+ */
+#define OVPN_TCP_TXQ_STOP_BYTES	(64 * 1024)
+#define OVPN_TCP_TXQ_WAKE_BYTES	(OVPN_TCP_TXQ_STOP_BYTES / 2)
+#define OVPN_TCP_TXQ_MAX_BYTES	(OVPN_TCP_TXQ_STOP_BYTES * 2)
+
+/* unsent bytes (i.e. not yet handed to the network) the socket is allowed to
+ * hold, see TCP_NOTSENT_LOWAT: more than this would only sit in the send
+ * buffer in FIFO order. Sockets where userspace set a limit keep theirs
+ */
+#define OVPN_TCP_NOTSENT_LOWAT	(32 * 1024)
+
+/* max number of packets written to the socket with a single sendmsg call */
+#define OVPN_TCP_SEND_BATCH	16
+
+/* memory (in bytes) taken by the control packets of a single TCP peer that
+ * wait for userspace: packets exceeding it are dropped, while the reliability
+ * layer of the control channel takes care of them
+ */
+#define OVPN_TCP_USERQ_MAX_BYTES	(256 * 1024)
+
 static struct proto ovpn_tcp_prot __ro_after_init;
 static struct proto_ops ovpn_tcp_ops __ro_after_init;
 static struct proto ovpn_tcp6_prot;
 static struct proto_ops ovpn_tcp6_ops;
 static DEFINE_MUTEX(tcp6_prot_mutex);
 
-static int ovpn_tcp_parse(struct strparser *strp, struct sk_buff *skb)
-{
-	struct strp_msg *rxm = strp_msg(skb);
-	__be16 blen;
-	u16 len;
-	int err;
-
-	/* when packets are written to the TCP stream, they are prepended with
-	 * two bytes indicating the actual packet size.
-	 * Here we read those two bytes and move the skb data pointer to the
-	 * beginning of the packet
-	 */
+/* deferred TX/RX processing of all TCP peers */
+static struct workqueue_struct *ovpn_tcp_wq;
 
-	if (skb->len < rxm->offset + 2)
-		return 0;
+/* Queue TCP socket work on the CPU that last received data on the socket:
+ * this way work for a given peer keeps running on the same CPU as its RX
+ * softirq and hits warm socket cachelines. Fall back to any CPU if the RX
+ * CPU is unknown or went offline
+ */
+static void ovpn_tcp_queue_work(struct sock *sk, struct work_struct *work)
+{
+	int cpu = READ_ONCE(sk->sk_incoming_cpu);
 
-	err = skb_copy_bits(skb, rxm->offset, &blen, sizeof(blen));
-	if (err < 0)
-		return err;
+	if (cpu < 0 || cpu >= nr_cpu_ids || !cpu_online(cpu))
+		cpu = WORK_CPU_UNBOUND;
 
-	len = be16_to_cpu(blen);
-	if (len < 2)
-		return -EINVAL;
+	queue_work_on(cpu, ovpn_tcp_wq, work);
+}
 
-	return len + 2;
+/**
+ * ovpn_tcp_stream - get the state of the stream carried by a socket
+ * @sk: a socket that went through ovpn_tcp_socket_attach()
+ *
+ * Meant to be cached in the ovpn_socket wrapping @sk, whose callbacks may
+ * still run once the ULP data is cleared by ovpn_tcp_socket_detach().
+ *
+ * Return: the stream state
+ */
+struct ovpn_peer_tcp *ovpn_tcp_stream(const struct sock *sk)
+{
+	return rcu_dereference_raw(inet_csk(sk)->icsk_ulp_data);
 }
 
-/* queue skb for sending to userspace via recvmsg on the socket */
-static int ovpn_tcp_to_userspace(struct ovpn_socket *sock, struct sk_buff *skb)
+/* queue skb for sending to userspace via recvmsg on the socket. Userspace is
+ * woken up once the current read of the stream is over, by
+ * ovpn_tcp_read_sock()
+ */
+static int ovpn_tcp_to_userspace(struct ovpn_peer_tcp *tcp,
+				 struct sk_buff *skb)
 {
-	struct sock *sk = sock->sock->sk;
+	struct sk_buff_head *queue = &tcp->user_queue;
+	struct sock *sk = tcp->sk;
+
+	spin_lock_bh(&queue->lock);
+	if (unlikely(tcp->user_queue_bytes + skb->truesize >
+		     OVPN_TCP_USERQ_MAX_BYTES)) {
+		spin_unlock_bh(&queue->lock);
+		return -ENOBUFS;
+	}
 
 	skb_set_owner_r(skb, sk);
 	memset(skb->cb, 0, sizeof(skb->cb));
-	skb_queue_tail(&sock->peer->tcp.user_queue, skb);
-	sock->peer->tcp.sk_cb.sk_data_ready(sk);
+	__skb_queue_tail(queue, skb);
+	tcp->user_queue_bytes += skb->truesize;
+	spin_unlock_bh(&queue->lock);
+
+	tcp->user_wake = true;
 
 	return 0;
 }
 
-static void ovpn_tcp_rcv(struct strparser *strp, struct sk_buff *skb)
+/* account for a packet taken off the queue of packets going to userspace */
+static void ovpn_tcp_userspace_done(struct ovpn_peer_tcp *tcp,
+				    struct sk_buff *skb)
 {
-	struct ovpn_peer *peer = container_of(strp, struct ovpn_peer, tcp.strp);
-	struct strp_msg *msg = strp_msg(skb);
-	size_t pkt_len = msg->full_len - 2;
-	size_t off = msg->offset + 2;
-
-	/* ensure skb->data points to the beginning of the openvpn packet */
-	if (!pskb_pull(skb, off)) {
-		net_warn_ratelimited("%s: packet too small\n",
-				     peer->ovpn->dev->name);
-		goto err;
-	}
-
-	/* strparser does not trim the skb for us, therefore we do it now */
-	if (pskb_trim(skb, pkt_len) != 0) {
-		net_warn_ratelimited("%s: trimming skb failed\n",
-				     peer->ovpn->dev->name);
-		goto err;
-	}
+	spin_lock_bh(&tcp->user_queue.lock);
+	tcp->user_queue_bytes -= skb->truesize;
+	spin_unlock_bh(&tcp->user_queue.lock);
+}
 
-	/* we need the first byte of data to be accessible
-	 * to extract the opcode and the key ID later on
-	 */
-	if (!pskb_may_pull(skb, 1)) {
-		net_warn_ratelimited("%s: packet too small to fetch opcode\n",
-				     peer->ovpn->dev->name);
-		goto err;
-	}
+/* deliver a complete frame, whose length prefix has already been stripped.
+ * Data packets of all the streams of a peer go through the same key slots
+ * and replay windows, while the others go to the socket they came from
+ */
+static void ovpn_tcp_rcv(struct ovpn_peer_tcp *tcp, struct sk_buff *skb)
+{
+	struct ovpn_peer *peer = tcp->peer;
+	u8 opcode = ovpn_opcode_from_skb(skb, 0);
+	u16 len = skb->len;
 
-	/* DATA_V2 packets are handled in kernel, the rest goes to user space */
-	if (likely(ovpn_opcode_from_skb(skb, 0) == OVPN_DATA_V2)) {
+	/* data packets are handled in kernel, the rest goes to user space */
+	if (likely(opcode == OVPN_DATA_V2 || opcode == OVPN_DATA_V1)) {
 		/* hold reference to peer as required by ovpn_recv().
 		 *
 		 * NOTE: in this context we should already be holding a
@@ -108,34 +148,172 @@ static void ovpn_tcp_rcv(struct strparser *strp, struct sk_buff *skb)
 		 * not expected to fail
 		 */
 		WARN_ON(!ovpn_peer_hold(peer));
+		trace_ovpn_tcp_recv(skb, peer->id);
+		ovpn_latency_stamp(peer->ovpn, skb);
 		ovpn_recv(peer, skb);
-	} else {
-		/* The packet size header must be there when sending the packet
-		 * to userspace, therefore we put it back
-		 */
-		skb_push(skb, 2);
-		memset(skb->cb, 0, sizeof(skb->cb));
-		if (ovpn_tcp_to_userspace(peer->sock, skb) < 0) {
-			net_warn_ratelimited("%s: cannot send skb to userspace\n",
-					     peer->ovpn->dev->name);
-			goto err;
+		return;
+	}
+
+	/* batched over netlink, the length is carried by the attribute */
+	if (peer->ovpn->ctrl) {
+		ovpn_ctrl_recv(peer, skb, 0);
+		return;
+	}
+
+	/* The packet size header must be there when sending the packet
+	 * to userspace, therefore we put it back
+	 */
+	*(__be16 *)skb_push(skb, sizeof(u16)) = htons(len);
+	if (ovpn_tcp_to_userspace(tcp, skb) < 0) {
+		net_warn_ratelimited("%s: cannot send skb to userspace\n",
+				     peer->ovpn->dev->name);
+		ovpn_peer_rx_drop(peer, skb, OVPN_DROP_USER_BACKLOG);
+	}
+}
+
+/**
+ * ovpn_tcp_read_actor - extract length-prefixed frames from the TCP stream
+ * @desc: the read descriptor, carrying the stream
+ * @in_skb: the segment being read from the receive queue
+ * @offset: where unread data starts within @in_skb
+ * @len: how many bytes are available in @in_skb
+ *
+ * Frames are copied straight out of the receive queue into a new linear skb,
+ * sized after the 2-byte length prefix: there is no per-frame clone, pull or
+ * trim and many small frames contained in the same segment are extracted in
+ * one pass. Frames spanning multiple segments are assembled across calls.
+ *
+ * Return: the number of bytes consumed from @in_skb
+ */
+static int ovpn_tcp_read_actor(read_descriptor_t *desc, struct sk_buff *in_skb,
+			       unsigned int offset, size_t len)
+{
+	struct ovpn_peer_tcp *tcp = desc->arg.data;
+	struct ovpn_peer *peer = tcp->peer;
+	size_t consumed = 0;
+	unsigned int n;
+	u16 frame_len;
+
+	while (consumed < len) {
+		/* first collect the length prefix */
+		if (!tcp->rx_need) {
+			n = min_t(size_t, sizeof(tcp->rx_hdr) -
+					  tcp->rx_hdr_len,
+				  len - consumed);
+			if (skb_copy_bits(in_skb, offset + consumed,
+					  tcp->rx_hdr + tcp->rx_hdr_len,
+					  n) < 0)
+				goto err;
+
+			consumed += n;
+			tcp->rx_hdr_len += n;
+			if (tcp->rx_hdr_len < sizeof(tcp->rx_hdr))
+				break;
+
+			frame_len = get_unaligned_be16(tcp->rx_hdr);
+			tcp->rx_hdr_len = 0;
+			if (frame_len < 2) {
+				net_warn_ratelimited("%s: invalid TCP frame length %u from peer %u\n",
+						     peer->ovpn->dev->name,
+						     frame_len, peer->id);
+				goto err;
+			}
+
+			tcp->rx_need = frame_len;
+			/* leave room for the prefix in case the frame goes to
+			 * userspace. On allocation failure the frame is
+			 * skipped
+			 */
+			tcp->rx_skb = netdev_alloc_skb(peer->ovpn->dev,
+							    sizeof(u16) +
+							    frame_len);
+			if (likely(tcp->rx_skb))
+				skb_reserve(tcp->rx_skb, sizeof(u16));
+			else
+				ovpn_drop_count(peer->ovpn, false,
+						OVPN_DROP_NOMEM);
+			continue;
 		}
+
+		n = min_t(size_t, tcp->rx_need, len - consumed);
+		if (tcp->rx_skb &&
+		    skb_copy_bits(in_skb, offset + consumed,
+				  skb_put(tcp->rx_skb, n), n) < 0)
+			goto err;
+
+		consumed += n;
+		tcp->rx_need -= n;
+		if (tcp->rx_need || !tcp->rx_skb)
+			continue;
+
+		ovpn_tcp_rcv(tcp, tcp->rx_skb);
+		tcp->rx_skb = NULL;
 	}
 
-	return;
+	return consumed;
 err:
+	desc->count = 0;
+	desc->error = -EINVAL;
+	return consumed;
+}
+
+/* read all frames available on the socket. Must be called with the socket
+ * lock held (or owned)
+ */
+static void ovpn_tcp_read_sock(struct ovpn_peer_tcp *tcp)
+{
+	struct ovpn_peer *peer = tcp->peer;
+	read_descriptor_t desc = {
+		.arg.data = tcp,
+		.count = 1,
+	};
+
+	if (unlikely(READ_ONCE(tcp->rx_stopped)))
+		return;
+
+	tcp_read_sock(tcp->sk, &desc, ovpn_tcp_read_actor);
+	/* a single wakeup for all the packets queued to userspace */
+	if (tcp->user_wake) {
+		tcp->user_wake = false;
+		tcp->sk_cb.sk_data_ready(tcp->sk);
+	}
+	if (likely(!desc.error))
+		return;
+
+	/* the stream is unusable once framing is lost */
+	WRITE_ONCE(tcp->rx_stopped, true);
 	netdev_err(peer->ovpn->dev,
 		   "cannot process incoming TCP data for peer %u\n", peer->id);
-	dev_core_stats_rx_dropped_inc(peer->ovpn->dev);
-	kfree_skb(skb);
+	ovpn_drop_count(peer->ovpn, false, OVPN_DROP_TCP_FRAMING);
 	ovpn_peer_del(peer, OVPN_DEL_PEER_REASON_TRANSPORT_ERROR);
 }
 
+/* take the lock of the socket of tcp, accounting for the times another
+ * context owns it
+ */
+static void ovpn_tcp_lock_sock(struct ovpn_peer_tcp *tcp)
+{
+	if (unlikely(sock_owned_by_user_nocheck(tcp->sk)))
+		ovpn_dev_stats_inc(tcp->peer->ovpn, lock_tcp_sock_contended);
+	lock_sock(tcp->sk);
+}
+
+static void ovpn_tcp_rx_work(struct work_struct *work)
+{
+	struct ovpn_peer_tcp *tcp = container_of(work, struct ovpn_peer_tcp,
+						 rx_work);
+
+	ovpn_tcp_lock_sock(tcp);
+	ovpn_tcp_read_sock(tcp);
+	release_sock(tcp->sk);
+}
+
 static int ovpn_tcp_recvmsg(struct sock *sk, struct msghdr *msg, size_t len,
 			    int flags, int *addr_len)
 {
 	int err = 0, off, copied = 0, ret;
 	struct ovpn_socket *sock;
+	struct ovpn_peer_tcp *tcp;
 	struct ovpn_peer *peer;
 	struct sk_buff *skb;
 
@@ -152,9 +330,13 @@ static int ovpn_tcp_recvmsg(struct sock *sk, struct msghdr *msg, size_t len,
 	 */
 	ovpn_peer_hold(sock->peer);
 	peer = sock->peer;
+	/* each stream queues the packets it received to its own socket */
+	tcp = sock->tcp;
 	rcu_read_unlock();
 
-	skb = __skb_recv_datagram(sk, &peer->tcp.user_queue, flags, &off, &err);
+	skb = __skb_recv_datagram(sk, &tcp->user_queue, flags, &off, &err);
+	if (skb && !(flags & MSG_PEEK))
+		ovpn_tcp_userspace_done(tcp, skb);
 	if (!skb) {
 		if (err == -EAGAIN && sk->sk_shutdown & RCV_SHUTDOWN) {
 			ret = 0;
@@ -186,10 +368,13 @@ static int ovpn_tcp_recvmsg(struct sock *sk, struct msghdr *msg, size_t len,
 	return ret;
 }
 
+static void ovpn_tcp_purge(struct ovpn_peer_tcp *tcp);
+
 void ovpn_tcp_socket_detach(struct socket *sock)
 {
 	struct ovpn_socket *ovpn_sock;
-	struct ovpn_peer *peer;
+	struct ovpn_peer_tcp *tcp;
+	unsigned int i, n;
 
 	if (!sock)
 		return;
@@ -202,45 +387,277 @@ void ovpn_tcp_socket_detach(struct socket *sock)
 		return;
 	}
 
-	peer = ovpn_sock->peer;
-	strp_stop(&peer->tcp.strp);
+	tcp = ovpn_sock->tcp;
+	WRITE_ONCE(tcp->rx_stopped, true);
 
-	skb_queue_purge(&peer->tcp.user_queue);
+	/* the stripes of the peer go away along with its first stream. Their
+	 * state is freed after a grace period, like the one of this stream,
+	 * therefore senders that picked one of them can still use it
+	 */
+	n = tcp->n_stripes;
+	smp_store_release(&tcp->n_stripes, 0);
+	for (i = 0; i < n; i++)
+		ovpn_socket_put(tcp->stripes[i]);
+
+	skb_queue_purge(&tcp->user_queue);
 
 	/* restore CBs that were saved in ovpn_sock_set_tcp_cb() */
-	sock->sk->sk_data_ready = peer->tcp.sk_cb.sk_data_ready;
-	sock->sk->sk_write_space = peer->tcp.sk_cb.sk_write_space;
-	sock->sk->sk_prot = peer->tcp.sk_cb.prot;
-	sock->sk->sk_socket->ops = peer->tcp.sk_cb.ops;
+	sock->sk->sk_data_ready = tcp->sk_cb.sk_data_ready;
+	sock->sk->sk_write_space = tcp->sk_cb.sk_write_space;
+	sock->sk->sk_prot = tcp->sk_cb.prot;
+	sock->sk->sk_socket->ops = tcp->sk_cb.ops;
+	WRITE_ONCE(tcp_sk(sock->sk)->notsent_lowat, tcp->sk_cb.notsent_lowat);
 	rcu_assign_sk_user_data(sock->sk, NULL);
+	/* the ULP stays until the socket is closed, see ovpn_tcp_ulp_set() */
+	RCU_INIT_POINTER(inet_csk(sock->sk)->icsk_ulp_data, NULL);
 
 	/* cancel any ongoing work. Done after removing the CBs so that these
 	 * workers cannot be re-armed
 	 */
-	cancel_work_sync(&peer->tcp.tx_work);
-	strp_done(&peer->tcp.strp);
+	cancel_work_sync(&tcp->tx_work);
+	cancel_work_sync(&tcp->rx_work);
+	kfree_skb(tcp->rx_skb);
+	tcp->rx_skb = NULL;
+	ovpn_tcp_purge(tcp);
+	/* callbacks that fetched the peer before restoring the CBs may still
+	 * be accessing its TCP state
+	 */
+	kfree_rcu(tcp, rcu);
+	rcu_read_unlock();
+}
+
+/**
+ * ovpn_tcp_enqueue - append a packet to the TX queue of a stream
+ * @tcp: the stream the packet is sent over
+ * @skb: the packet to queue (already prefixed by its length)
+ *
+ * The netdev TX queue feeding the peer is stopped once the backlog grows
+ * above OVPN_TCP_TXQ_STOP_BYTES, so that the stack holds packets back until
+ * the socket makes progress. Packets are dropped only if the backlog hits
+ * OVPN_TCP_TXQ_MAX_BYTES, i.e. when packets already encrypted before
+ * stopping the queue exceed the headroom, or if the interface exhausted its
+ * memory budget.
+ *
+ * Return: true if the packet was queued or false if the queue is full
+ */
+static bool ovpn_tcp_enqueue(struct ovpn_peer_tcp *tcp, struct sk_buff *skb)
+{
+	struct sk_buff_head *queue = &tcp->out_queue;
+	struct ovpn_struct *ovpn = tcp->peer->ovpn;
+	bool stop = false;
+
+	if (unlikely(!ovpn_mem_charge(ovpn, skb->truesize)))
+		return false;
+
+	spin_lock_bh(&queue->lock);
+	if (tcp->out_queue_bytes + skb->len > OVPN_TCP_TXQ_MAX_BYTES) {
+		spin_unlock_bh(&queue->lock);
+		ovpn_mem_uncharge(ovpn, skb->truesize);
+		return false;
+	}
+
+	__skb_queue_tail(queue, skb);
+	tcp->out_queue_bytes += skb->len;
+	if (tcp->out_queue_bytes >= OVPN_TCP_TXQ_STOP_BYTES)
+		stop = true;
+	spin_unlock_bh(&queue->lock);
+
+	if (stop)
+		netif_tx_stop_queue(ovpn_peer_txq(tcp->peer));
+
+	return true;
+}
+
+/* let userspace know that sendmsg can be called again: both blocking senders
+ * and pollers (i.e. io_uring) sleep on the socket wait queue
+ */
+static void ovpn_tcp_wake_writers(struct sock *sk)
+{
+	struct socket_wq *wq;
+
+	rcu_read_lock();
+	wq = rcu_dereference(sk->sk_wq);
+	if (skwq_has_sleeper(wq))
+		wake_up_interruptible_poll(&wq->wait, EPOLLOUT | EPOLLWRNORM |
+						      EPOLLWRBAND);
 	rcu_read_unlock();
 }
 
-static void ovpn_tcp_send_sock(struct ovpn_peer *peer)
+/* pop the next packet to send and restart the netdev TX queue if the backlog
+ * has been drained enough
+ */
+static struct sk_buff *ovpn_tcp_dequeue(struct ovpn_peer_tcp *tcp)
+{
+	struct sk_buff_head *queue = &tcp->out_queue;
+	struct netdev_queue *txq;
+	struct sk_buff *skb;
+	bool wake;
+
+	spin_lock_bh(&queue->lock);
+	skb = __skb_dequeue(queue);
+	if (skb)
+		tcp->out_queue_bytes -= skb->len;
+	wake = tcp->out_queue_bytes <= OVPN_TCP_TXQ_WAKE_BYTES;
+	spin_unlock_bh(&queue->lock);
+
+	if (skb)
+		ovpn_mem_uncharge(tcp->peer->ovpn, skb->truesize);
+
+	txq = ovpn_peer_txq(tcp->peer);
+	if (wake && netif_tx_queue_stopped(txq))
+		netif_tx_wake_queue(txq);
+
+	if (wake && READ_ONCE(tcp->user_tx_wait)) {
+		WRITE_ONCE(tcp->user_tx_wait, false);
+		ovpn_tcp_wake_writers(tcp->sk);
+	}
+
+	return skb;
+}
+
+/* drop all pending packets and make sure the netdev TX queue is not left
+ * stopped on behalf of this stream
+ */
+static void ovpn_tcp_purge(struct ovpn_peer_tcp *tcp)
+{
+	struct sk_buff *skb;
+
+	while ((skb = ovpn_tcp_dequeue(tcp)))
+		ovpn_peer_tx_drop(tcp->peer, skb, OVPN_DROP_TRANSPORT);
+
+	kfree_skb(tcp->out_msg.skb);
+	tcp->out_msg.skb = NULL;
+	tcp->out_msg.len = 0;
+	tcp->out_msg.offset = 0;
+}
+
+/* pick the next queued packet as the one being sent */
+static bool ovpn_tcp_next_msg(struct ovpn_peer_tcp *tcp)
 {
-	struct sk_buff *skb = peer->tcp.out_msg.skb;
+	struct sk_buff *skb = ovpn_tcp_dequeue(tcp);
 
 	if (!skb)
-		return;
+		return false;
+
+	tcp->out_msg.skb = skb;
+	tcp->out_msg.len = skb->len;
+	tcp->out_msg.offset = 0;
+
+	return true;
+}
+
+/* account @written bytes against the packet being sent and the ones that
+ * followed it in the same batch
+ */
+static void ovpn_tcp_advance(struct ovpn_peer_tcp *tcp, size_t written)
+{
+	struct sk_buff *skb;
+	size_t chunk;
+
+	while (written > 0) {
+		if (!tcp->out_msg.skb && !ovpn_tcp_next_msg(tcp))
+			break;
+
+		chunk = min_t(size_t, written, tcp->out_msg.len);
+		tcp->out_msg.len -= chunk;
+		tcp->out_msg.offset += chunk;
+		written -= chunk;
+
+		if (tcp->out_msg.len)
+			break;
+
+		skb = tcp->out_msg.skb;
+		dev_sw_netstats_tx_add(tcp->peer->ovpn->dev, 1, skb->len);
+		consume_skb(skb);
+		tcp->out_msg.skb = NULL;
+		tcp->out_msg.len = 0;
+		tcp->out_msg.offset = 0;
+	}
+}
+
+/**
+ * ovpn_tcp_send_batch - write the current packet and the linear ones queued
+ *			 after it with a single sendmsg call
+ * @tcp: the stream whose packets should be sent
+ *
+ * The current packet (tcp->out_msg) must be linear. Queued packets are
+ * only peeked at and are dequeued by ovpn_tcp_advance() once written.
+ * MSG_MORE is passed when more packets are left in the queue, so that TCP
+ * does not push a partial segment in between batches.
+ *
+ * Return: number of bytes written or a negative error code
+ */
+static int ovpn_tcp_send_batch(struct ovpn_peer_tcp *tcp)
+{
+	struct sk_buff_head *queue = &tcp->out_queue;
+	struct kvec iov[OVPN_TCP_SEND_BATCH];
+	struct msghdr msg = {
+		.msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL,
+	};
+	struct sk_buff *skb, *head;
+	size_t total;
+	int n = 1;
+
+	head = tcp->out_msg.skb;
+	iov[0].iov_base = head->data + tcp->out_msg.offset;
+	iov[0].iov_len = tcp->out_msg.len;
+	total = iov[0].iov_len;
+
+	/* new packets are only appended to the queue, therefore those being
+	 * referenced here are not going anywhere until dequeued by us
+	 */
+	spin_lock_bh(&queue->lock);
+	skb_queue_walk(queue, skb) {
+		if (n == ARRAY_SIZE(iov) || skb_is_nonlinear(skb)) {
+			msg.msg_flags |= MSG_MORE;
+			break;
+		}
+
+		iov[n].iov_base = skb->data;
+		iov[n].iov_len = skb->len;
+		total += skb->len;
+		n++;
+	}
+	spin_unlock_bh(&queue->lock);
+
+	return kernel_sendmsg_locked(tcp->sk, &msg, iov, n, total);
+}
+
+/* write as many queued packets as possible to the socket. Must be called
+ * with the socket lock held
+ */
+static void ovpn_tcp_send_sock(struct ovpn_peer_tcp *tcp)
+{
+	struct ovpn_peer *peer = tcp->peer;
+	struct sk_buff *skb;
+	int ret;
 
-	if (peer->tcp.tx_in_progress)
+	if (tcp->tx_in_progress)
 		return;
 
-	peer->tcp.tx_in_progress = true;
+	tcp->tx_in_progress = true;
+
+	for (;;) {
+		if (!tcp->out_msg.skb && !ovpn_tcp_next_msg(tcp))
+			break;
 
-	do {
-		int ret = skb_send_sock_locked(peer->sock->sock->sk, skb,
-					       peer->tcp.out_msg.offset,
-					       peer->tcp.out_msg.len);
+		skb = tcp->out_msg.skb;
+		if (likely(!skb_is_nonlinear(skb)))
+			ret = ovpn_tcp_send_batch(tcp);
+		else
+			ret = skb_send_sock_locked(tcp->sk, skb,
+						   tcp->out_msg.offset,
+						   tcp->out_msg.len);
 		if (unlikely(ret < 0)) {
-			if (ret == -EAGAIN)
-				goto out;
+			/* resume from here on the next write_space, once
+			 * the unsent data went below notsent_lowat
+			 */
+			if (ret == -EAGAIN) {
+				ovpn_dev_stats_inc(peer->ovpn, tcp_tx_eagain);
+				WRITE_ONCE(tcp->tx_eagain,
+					   tcp->tx_eagain + 1);
+				break;
+			}
 
 			net_warn_ratelimited("%s: TCP error to peer %u: %d\n",
 					     peer->ovpn->dev->name, peer->id,
@@ -249,70 +666,296 @@ static void ovpn_tcp_send_sock(struct ovpn_peer *peer)
 			/* in case of TCP error we can't recover the VPN
 			 * stream therefore we abort the connection
 			 */
+			ovpn_tcp_purge(tcp);
 			ovpn_peer_del(peer,
 				      OVPN_DEL_PEER_REASON_TRANSPORT_ERROR);
 			break;
 		}
 
-		peer->tcp.out_msg.len -= ret;
-		peer->tcp.out_msg.offset += ret;
-	} while (peer->tcp.out_msg.len > 0);
+		ovpn_tcp_advance(tcp, ret);
+	}
+
+	tcp->tx_in_progress = false;
+}
 
-	if (!peer->tcp.out_msg.len)
-		dev_sw_netstats_tx_add(peer->ovpn->dev, 1, skb->len);
+static void ovpn_tcp_tx_work(struct work_struct *work)
+{
+	struct ovpn_peer_tcp *tcp = container_of(work, struct ovpn_peer_tcp,
+						 tx_work);
 
-	kfree_skb(peer->tcp.out_msg.skb);
-	peer->tcp.out_msg.skb = NULL;
-	peer->tcp.out_msg.len = 0;
-	peer->tcp.out_msg.offset = 0;
+	ovpn_tcp_lock_sock(tcp);
+	ovpn_tcp_send_sock(tcp);
+	release_sock(tcp->sk);
+}
 
-out:
-	peer->tcp.tx_in_progress = false;
+/* backlog of a stream, including the rest of the packet being written */
+static unsigned int ovpn_tcp_backlog(const struct ovpn_peer_tcp *tcp)
+{
+	return READ_ONCE(tcp->out_queue_bytes) +
+	       max(READ_ONCE(tcp->out_msg.len), 0);
 }
 
-static void ovpn_tcp_tx_work(struct work_struct *work)
+/* stream number i of the peer whose first stream is tcp, 0 being tcp */
+static struct ovpn_peer_tcp *ovpn_tcp_stripe(struct ovpn_peer_tcp *tcp,
+					     unsigned int i)
 {
-	struct ovpn_peer *peer;
+	return i ? tcp->stripes[i - 1]->tcp : tcp;
+}
 
-	peer = container_of(work, struct ovpn_peer, tcp.tx_work);
+/**
+ * ovpn_tcp_select - pick the stream a packet is sent over
+ * @peer: the peer the packet is directed to
+ * @skb: the packet to send
+ *
+ * As for UDP paths (see ovpn_path_select()), the packets of a flow stick to
+ * one stream, chosen by their hash, so that they reach the peer in order,
+ * while packets carrying no flow hash are spread in a round-robin fashion.
+ * The packets of a stream falling behind, whose backlog went past
+ * OVPN_TCP_TXQ_WAKE_BYTES, are rather sent over the least backlogged stream:
+ * being reordered is cheaper for them than waiting for a congestion window
+ * to reopen. All streams share the key slots, and thus the replay windows,
+ * of the peer: the window must cover the packets in flight over the streams.
+ *
+ * Return: the stream to send skb over
+ */
+static struct ovpn_peer_tcp *ovpn_tcp_select(struct ovpn_peer *peer,
+					     const struct sk_buff *skb)
+{
+	struct ovpn_peer_tcp *tcp = peer->tcp, *best, *cur;
+	unsigned int n, i, slot, backlog, min;
+
+	/* stripes are only added, each one after its slot was filled */
+	n = smp_load_acquire(&tcp->n_stripes);
+	if (likely(!n))
+		return tcp;
+
+	if (skb->l4_hash)
+		slot = reciprocal_scale(skb->hash, n + 1);
+	else
+		slot = (u32)atomic_inc_return(&tcp->tx_rr) % (n + 1);
+
+	best = ovpn_tcp_stripe(tcp, slot);
+	min = ovpn_tcp_backlog(best);
+	if (likely(min <= OVPN_TCP_TXQ_WAKE_BYTES))
+		return best;
+
+	for (i = 0; i <= n; i++) {
+		cur = ovpn_tcp_stripe(tcp, i);
+		backlog = ovpn_tcp_backlog(cur);
+		if (backlog < min) {
+			best = cur;
+			min = backlog;
+		}
+	}
 
-	lock_sock(peer->sock->sock->sk);
-	ovpn_tcp_send_sock(peer);
-	release_sock(peer->sock->sock->sk);
+	return best;
 }
 
-void ovpn_tcp_send_sock_skb(struct ovpn_peer *peer, struct sk_buff *skb)
+/**
+ * ovpn_tcp_send_skb - prepare skb and enqueue it for sending to peer
+ * @peer: the peer the packet is directed to
+ * @skb: the packet to send
+ *
+ * Preparation consist in prepending the skb payload with its size.
+ * Required by the OpenVPN protocol in order to extract packets from
+ * the TCP stream on the receiver side.
+ *
+ * Must be called with BHs disabled.
+ */
+void ovpn_tcp_send_skb(struct ovpn_peer *peer, struct sk_buff *skb)
 {
-	if (peer->tcp.out_msg.skb)
+	struct ovpn_peer_tcp *tcp = ovpn_tcp_select(peer, skb);
+	struct sock *sk = tcp->sk;
+	u16 len = skb->len;
+
+	trace_ovpn_xmit(skb, peer->id, IPPROTO_TCP);
+	ovpn_latency_tx(peer, skb);
+
+	*(__be16 *)__skb_push(skb, sizeof(u16)) = htons(len);
+
+	if (unlikely(!ovpn_tcp_enqueue(tcp, skb))) {
+		ovpn_peer_tx_drop(peer, skb, OVPN_DROP_TRANSPORT);
 		return;
+	}
+
+	bh_lock_sock(sk);
+	/* the socket owner may be in the middle of a send: let the worker
+	 * drain the queue once the lock is released
+	 */
+	if (sock_owned_by_user(sk)) {
+		ovpn_dev_stats_inc(peer->ovpn, lock_tcp_sock_contended);
+		ovpn_tcp_queue_work(sk, &tcp->tx_work);
+	} else {
+		ovpn_tcp_send_sock(tcp);
+	}
+	bh_unlock_sock(sk);
+}
+
+/**
+ * ovpn_tcp_get_info - report the state of the TCP transport of a peer
+ * @peer: the peer, reached over TCP
+ * @info: the report to fill
+ *
+ * Unlike tcp_get_info(), the socket is not locked: the fields are sampled
+ * one by one and may be slightly inconsistent with each other, which is
+ * fine for diagnostics and allows peers to be dumped under RCU.
+ *
+ * With stripes, windows, rates and counters are summed over the streams of
+ * the peer, while the round trip time is the one of the slowest stream.
+ *
+ * Must be called under RCU read lock or with a reference to the peer held.
+ */
+void ovpn_tcp_get_info(const struct ovpn_peer *peer,
+		       struct ovpn_tcp_info *info)
+{
+	const struct tcp_sock *tp;
+	struct ovpn_peer_tcp *tcp;
+	u32 delivered, interval;
+	unsigned int i, n;
+	u64 rate;
+
+	memset(info, 0, sizeof(*info));
+
+	n = smp_load_acquire(&peer->tcp->n_stripes);
+	for (i = 0; i <= n; i++) {
+		tcp = ovpn_tcp_stripe(peer->tcp, i);
+		tp = tcp_sk(tcp->sk);
+		delivered = READ_ONCE(tp->rate_delivered);
+		interval = READ_ONCE(tp->rate_interval_us);
+
+		/* same as the tcpi_delivery_rate of tcp_info */
+		rate = 0;
+		if (delivered && interval) {
+			rate = (u64)delivered * READ_ONCE(tp->mss_cache) *
+			       USEC_PER_SEC;
+			rate = div_u64(rate, interval);
+		}
+
+		info->srtt = max(info->srtt, READ_ONCE(tp->srtt_us) >> 3);
+		info->cwnd += tcp_snd_cwnd(tp);
+		info->total_retrans += READ_ONCE(tp->total_retrans);
+		info->delivery_rate += rate;
+		info->out_queue += ovpn_tcp_backlog(tcp);
+		info->tx_eagain += READ_ONCE(tcp->tx_eagain);
+	}
+	info->streams = n + 1;
+}
+
+/* flags accepted by sendmsg. MSG_EOR and MSG_WAITALL are meaningless on a
+ * stream of complete packets and MSG_ZEROCOPY is served by copying the data
+ */
+#define OVPN_TCP_SENDMSG_FLAGS	(MSG_DONTWAIT | MSG_NOSIGNAL | MSG_MORE | \
+				 MSG_EOR | MSG_WAITALL | MSG_ZEROCOPY)
 
-	peer->tcp.out_msg.skb = skb;
-	peer->tcp.out_msg.len = skb->len;
-	peer->tcp.out_msg.offset = 0;
+static bool ovpn_tcp_has_room(struct ovpn_peer_tcp *tcp, size_t size)
+{
+	return READ_ONCE(tcp->out_queue_bytes) + size <=
+	       OVPN_TCP_TXQ_MAX_BYTES;
+}
+
+/* wait until the TX queue has room for @size bytes coming from userspace.
+ * Must be called with the socket lock held, which is released while sleeping
+ */
+static int ovpn_tcp_wait_room(struct sock *sk, struct ovpn_peer_tcp *tcp,
+			      size_t size, long *timeo)
+{
+	DEFINE_WAIT_FUNC(wait, woken_wake_function);
+	int ret = 0;
+
+	add_wait_queue(sk_sleep(sk), &wait);
+	while (!ovpn_tcp_has_room(tcp, size)) {
+		if (sk->sk_err) {
+			ret = sock_error(sk);
+			break;
+		}
+
+		/* woken up once the queue drains to OVPN_TCP_TXQ_WAKE_BYTES */
+		WRITE_ONCE(tcp->user_tx_wait, true);
+		if (!*timeo) {
+			ret = -EAGAIN;
+			break;
+		}
+
+		if (signal_pending(current)) {
+			ret = sock_intr_errno(*timeo);
+			break;
+		}
+
+		if (sk_wait_event(sk, timeo, ovpn_tcp_has_room(tcp, size) ||
+				  sk->sk_err, &wait) < 0) {
+			ret = -EPIPE;
+			break;
+		}
+	}
+	remove_wait_queue(sk_sleep(sk), &wait);
 
-	ovpn_tcp_send_sock(peer);
+	return ret;
 }
 
+/**
+ * ovpn_tcp_sendmsg - queue data written by userspace to the TCP stream
+ * @sk: the socket being written to
+ * @msg: the data, containing one or more packets
+ * @size: the amount of data
+ *
+ * Userspace provides packets already prefixed by their length, so that any
+ * number of them can be written with a single call, either by sendmsg/
+ * sendmmsg or by batched io_uring submissions. The data is queued as a whole
+ * or not at all, in order to never leave a partial packet in the stream.
+ *
+ * With MSG_MORE the data is written to the socket later by the TX worker,
+ * so that it can be coalesced with the data of the following calls.
+ *
+ * Return: the number of bytes queued or a negative error code
+ */
 static int ovpn_tcp_sendmsg(struct sock *sk, struct msghdr *msg, size_t size)
 {
+	struct ubuf_info *uarg = NULL;
 	struct ovpn_socket *sock;
 	int ret, linear = PAGE_SIZE;
+	struct ovpn_peer_tcp *tcp;
 	struct ovpn_peer *peer;
 	struct sk_buff *skb;
+	long timeo;
+
+	if (msg->msg_flags & ~OVPN_TCP_SENDMSG_FLAGS)
+		return -EOPNOTSUPP;
+
+	/* a packet that can never fit the queue would block forever */
+	if (size > OVPN_TCP_TXQ_MAX_BYTES)
+		return -EMSGSIZE;
 
 	rcu_read_lock();
 	sock = rcu_dereference_sk_user_data(sk);
+	if (!sock || !sock->peer) {
+		rcu_read_unlock();
+		return -EBADF;
+	}
+	/* the peer (and its TCP state) must outlive any wait for room */
+	ovpn_peer_hold(sock->peer);
 	peer = sock->peer;
+	tcp = sock->tcp;
 	rcu_read_unlock();
 
-	if (msg->msg_flags & ~MSG_DONTWAIT)
-		return -EOPNOTSUPP;
+	ovpn_tcp_lock_sock(tcp);
 
-	lock_sock(sk);
-
-	if (peer->tcp.out_msg.skb) {
-		ret = -EAGAIN;
+	timeo = sock_sndtimeo(sk, msg->msg_flags & MSG_DONTWAIT);
+	ret = ovpn_tcp_wait_room(sk, tcp, size, &timeo);
+	if (ret < 0)
 		goto unlock;
+
+	/* data is always copied, but applications enabling SO_ZEROCOPY
+	 * expect a completion: report it as copied. io_uring rather
+	 * provides its own notification in msg_ubuf
+	 */
+	if ((msg->msg_flags & MSG_ZEROCOPY) && size && !msg->msg_ubuf &&
+	    sock_flag(sk, SOCK_ZEROCOPY)) {
+		uarg = msg_zerocopy_realloc(sk, size, NULL);
+		if (!uarg) {
+			ret = -ENOBUFS;
+			goto unlock;
+		}
+		uarg_to_msgzc(uarg)->zerocopy = 0;
 	}
 
 	if (size < linear)
@@ -322,8 +965,8 @@ static int ovpn_tcp_sendmsg(struct sock *sk, struct msghdr *msg, size_t size)
 				   msg->msg_flags & MSG_DONTWAIT, &ret, 0);
 	if (!skb) {
 		net_err_ratelimited("%s: skb alloc failed: %d\n",
-				    sock->peer->ovpn->dev->name, ret);
-		goto unlock;
+				    peer->ovpn->dev->name, ret);
+		goto abort;
 	}
 
 	skb_put(skb, linear);
@@ -334,14 +977,33 @@ static int ovpn_tcp_sendmsg(struct sock *sk, struct msghdr *msg, size_t size)
 	if (ret) {
 		kfree_skb(skb);
 		net_err_ratelimited("%s: skb copy from iter failed: %d\n",
-				    sock->peer->ovpn->dev->name, ret);
-		goto unlock;
+				    peer->ovpn->dev->name, ret);
+		goto abort;
 	}
 
-	ovpn_tcp_send_sock_skb(sock->peer, skb);
+	/* packets written to a stripe go out over it */
+	if (!ovpn_tcp_enqueue(tcp, skb)) {
+		kfree_skb(skb);
+		ret = -EAGAIN;
+		goto abort;
+	}
+
+	if (msg->msg_flags & MSG_MORE)
+		ovpn_tcp_queue_work(sk, &tcp->tx_work);
+	else
+		ovpn_tcp_send_sock(tcp);
+
+	/* user data is not referenced anymore: complete right away */
+	if (uarg)
+		net_zcopy_put(uarg);
 	ret = size;
+	goto unlock;
+abort:
+	if (uarg)
+		net_zcopy_put_abort(uarg, true);
 unlock:
 	release_sock(sk);
+	ovpn_peer_put(peer);
 	return ret;
 }
 
@@ -353,7 +1015,15 @@ static void ovpn_tcp_data_ready(struct sock *sk)
 
 	rcu_read_lock();
 	sock = rcu_dereference_sk_user_data(sk);
-	strp_data_ready(&sock->peer->tcp.strp);
+	/* called with the socket spinlock held: if the socket is owned by
+	 * userspace, defer reading to the worker
+	 */
+	if (sock_owned_by_user(sk)) {
+		ovpn_dev_stats_inc(sock->peer->ovpn, lock_tcp_sock_contended);
+		ovpn_tcp_queue_work(sk, &sock->tcp->rx_work);
+	} else {
+		ovpn_tcp_read_sock(sock->tcp);
+	}
 	rcu_read_unlock();
 }
 
@@ -363,8 +1033,8 @@ static void ovpn_tcp_write_space(struct sock *sk)
 
 	rcu_read_lock();
 	sock = rcu_dereference_sk_user_data(sk);
-	schedule_work(&sock->peer->tcp.tx_work);
-	sock->peer->tcp.sk_cb.sk_write_space(sk);
+	ovpn_tcp_queue_work(sk, &sock->tcp->tx_work);
+	sock->tcp->sk_cb.sk_write_space(sk);
 	rcu_read_unlock();
 }
 
@@ -373,13 +1043,86 @@ static void ovpn_tcp_build_protos(struct proto *ovpn_tcp_prot,
 				  const struct proto *orig_prot,
 				  const struct proto_ops *orig_ops);
 
-/* Set TCP encapsulation callbacks */
-int ovpn_tcp_socket_attach(struct socket *sock, struct ovpn_peer *peer)
+/* Attached sockets run the "ovpn" upper layer protocol, like kTLS sockets
+ * run "tls": this keeps other ULPs and sockmap off the socket while ovpn
+ * owns its queues, and lets socket diagnostics name it. The ULP carries the
+ * TCP state of the peer and is only set by ovpn_tcp_socket_attach(), since
+ * a socket can only be attached to a peer over netlink. Like for kTLS, the
+ * ULP is never removed: a detached socket keeps it, with no data, until it
+ * is closed or attached again.
+ */
+static int ovpn_tcp_ulp_init(struct sock *sk)
+{
+	/* TCP_ULP set by userspace: there is no peer for this socket */
+	if (!rcu_access_pointer(inet_csk(sk)->icsk_ulp_data))
+		return -EOPNOTSUPP;
+
+	return 0;
+}
+
+/* invoked when the socket is destroyed */
+static void ovpn_tcp_ulp_release(struct sock *sk)
 {
-	struct strp_callbacks cb = {
-		.rcv_msg = ovpn_tcp_rcv,
-		.parse_msg = ovpn_tcp_parse,
-	};
+	RCU_INIT_POINTER(inet_csk(sk)->icsk_ulp_data, NULL);
+}
+
+static struct tcp_ulp_ops ovpn_tcp_ulp_ops __read_mostly = {
+	.name		= "ovpn",
+	.owner		= THIS_MODULE,
+	.init		= ovpn_tcp_ulp_init,
+	.release	= ovpn_tcp_ulp_release,
+};
+
+/* make the "ovpn" ULP carry tcp on sk, whose lock is held on entry and on
+ * return. The ULP is set like TCP_ULP does, which takes the socket lock
+ */
+static int ovpn_tcp_ulp_set(struct sock *sk, struct ovpn_peer_tcp *tcp)
+{
+	struct inet_connection_sock *icsk = inet_csk(sk);
+	int ret;
+
+	/* a socket attached before already runs the ULP */
+	if (icsk->icsk_ulp_ops == &ovpn_tcp_ulp_ops &&
+	    !rcu_access_pointer(icsk->icsk_ulp_data)) {
+		rcu_assign_pointer(icsk->icsk_ulp_data, tcp);
+		return 0;
+	}
+
+	/* the state of another ULP must not be overwritten */
+	if (inet_csk_has_ulp(sk))
+		return -EBUSY;
+
+	rcu_assign_pointer(icsk->icsk_ulp_data, tcp);
+	release_sock(sk);
+	ret = tcp_setsockopt(sk, SOL_TCP, TCP_ULP,
+			     KERNEL_SOCKPTR(ovpn_tcp_ulp_ops.name),
+			     sizeof(ovpn_tcp_ulp_ops.name));
+	lock_sock(sk);
+
+	/* userspace may have set a ULP meanwhile */
+	if (icsk->icsk_ulp_ops != &ovpn_tcp_ulp_ops ||
+	    rcu_access_pointer(icsk->icsk_ulp_data) != tcp) {
+		if (!icsk->icsk_ulp_ops)
+			RCU_INIT_POINTER(icsk->icsk_ulp_data, NULL);
+		return ret ?: -EBUSY;
+	}
+
+	return 0;
+}
+
+/**
+ * ovpn_tcp_socket_attach - set TCP encapsulation callbacks
+ * @sock: the connected socket to attach
+ * @peer: the peer reachable over @sock
+ * @stripe: true if @sock carries a further stream of @peer, which keeps
+ *	    sending over its first stream too
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_tcp_socket_attach(struct socket *sock, struct ovpn_peer *peer,
+			   bool stripe)
+{
+	struct ovpn_peer_tcp *tcp;
 	int ret;
 
 	/* make sure no pre-existing encapsulation handler exists */
@@ -403,25 +1146,36 @@ int ovpn_tcp_socket_attach(struct socket *sock, struct ovpn_peer *peer)
 		return -EINVAL;
 	}
 
+	/* UDP peers do not need any of this state, therefore it is only
+	 * allocated for TCP peers
+	 */
+	tcp = kzalloc(sizeof(*tcp), GFP_KERNEL);
+	if (!tcp)
+		return -ENOMEM;
+
+	tcp->peer = peer;
+	tcp->sk = sock->sk;
+	INIT_WORK(&tcp->tx_work, ovpn_tcp_tx_work);
+	INIT_WORK(&tcp->rx_work, ovpn_tcp_rx_work);
+	skb_queue_head_init(&tcp->user_queue);
+	skb_queue_head_init(&tcp->out_queue);
+
 	lock_sock(sock->sk);
 
-	ret = strp_init(&peer->tcp.strp, sock->sk, &cb);
-	if (ret < 0) {
-		DEBUG_NET_WARN_ON_ONCE(1);
-		release_sock(sock->sk);
-		return ret;
-	}
+	ret = ovpn_tcp_ulp_set(sock->sk, tcp);
+	if (ret < 0)
+		goto err;
 
-	INIT_WORK(&peer->tcp.tx_work, ovpn_tcp_tx_work);
 	__sk_dst_reset(sock->sk);
-	strp_check_rcv(&peer->tcp.strp);
-	skb_queue_head_init(&peer->tcp.user_queue);
 
 	/* save current CBs so that they can be restored upon socket release */
-	peer->tcp.sk_cb.sk_data_ready = sock->sk->sk_data_ready;
-	peer->tcp.sk_cb.sk_write_space = sock->sk->sk_write_space;
-	peer->tcp.sk_cb.prot = sock->sk->sk_prot;
-	peer->tcp.sk_cb.ops = sock->sk->sk_socket->ops;
+	tcp->sk_cb.sk_data_ready = sock->sk->sk_data_ready;
+	tcp->sk_cb.sk_write_space = sock->sk->sk_write_space;
+	tcp->sk_cb.prot = sock->sk->sk_prot;
+	tcp->sk_cb.ops = sock->sk->sk_socket->ops;
+	tcp->sk_cb.notsent_lowat = tcp_sk(sock->sk)->notsent_lowat;
+	if (!stripe)
+		peer->tcp = tcp;
 
 	/* assign our static CBs and prot/ops */
 	sock->sk->sk_data_ready = ovpn_tcp_data_ready;
@@ -442,12 +1196,60 @@ int ovpn_tcp_socket_attach(struct socket *sock, struct ovpn_peer *peer)
 		sock->sk->sk_socket->ops = &ovpn_tcp6_ops;
 	}
 
+	/* writes fail with -EAGAIN once the socket holds enough unsent data,
+	 * instead of once its send buffer is full: packets then wait in our
+	 * queue, which stops the netdev TX queue when full, and the write is
+	 * resumed by sk_write_space as unsent data drains
+	 */
+	if (!tcp->sk_cb.notsent_lowat)
+		WRITE_ONCE(tcp_sk(sock->sk)->notsent_lowat,
+			   OVPN_TCP_NOTSENT_LOWAT);
+
 	/* avoid using task_frag */
 	sock->sk->sk_allocation = GFP_ATOMIC;
 	sock->sk->sk_use_task_frag = false;
 
+	/* peer->sock is not assigned yet: data received before attaching is
+	 * parsed once it is, see ovpn_tcp_socket_kick()
+	 */
 	release_sock(sock->sk);
 	return 0;
+err:
+	release_sock(sock->sk);
+	kfree(tcp);
+	return ret;
+}
+
+/**
+ * ovpn_tcp_stripe_add - let a peer send over one more stream
+ * @peer: the peer, whose first stream has fewer than OVPN_TCP_STRIPES_MAX
+ *	  stripes
+ * @sock: the socket carrying the new stream, attached as a stripe of @peer
+ *
+ * The reference to @sock is handed over to the first stream of @peer, which
+ * drops it when detached. Must be called with the config_lock of @peer held.
+ */
+void ovpn_tcp_stripe_add(struct ovpn_peer *peer, struct ovpn_socket *sock)
+{
+	struct ovpn_peer_tcp *tcp = peer->tcp;
+
+	tcp->stripes[tcp->n_stripes] = sock;
+	/* senders read the slot only after seeing the new count */
+	smp_store_release(&tcp->n_stripes, tcp->n_stripes + 1);
+	ovpn_tcp_socket_kick(sock);
+}
+
+/**
+ * ovpn_tcp_socket_kick - parse the data received before attaching a socket
+ * @sock: the socket, just assigned to its peer or added as one of its stripes
+ *
+ * sk_data_ready only fires for new data: what the socket queued before being
+ * attached would otherwise wait for the next segment from the peer, which
+ * may never come. The worker parses it right away instead.
+ */
+void ovpn_tcp_socket_kick(struct ovpn_socket *sock)
+{
+	ovpn_tcp_queue_work(sock->sock->sk, &sock->tcp->rx_work);
 }
 
 static void ovpn_tcp_close(struct sock *sk, long timeout)
@@ -457,8 +1259,7 @@ static void ovpn_tcp_close(struct sock *sk, long timeout)
 	rcu_read_lock();
 	sock = rcu_dereference_sk_user_data(sk);
 
-	strp_stop(&sock->peer->tcp.strp);
-	barrier();
+	WRITE_ONCE(sock->tcp->rx_stopped, true);
 
 	tcp_close(sk, timeout);
 
@@ -466,16 +1267,54 @@ static void ovpn_tcp_close(struct sock *sk, long timeout)
 	rcu_read_unlock();
 }
 
+/**
+ * ovpn_tcp_poll - report the readiness of a TCP socket attached to a peer
+ * @file: the file of the socket
+ * @sock: the socket being polled
+ * @wait: the poll table
+ *
+ * The TCP receive and write queues are owned by the kernel: userspace reads
+ * from the queue of packets directed to it and writes to the TX queue of the
+ * peer, therefore readiness is computed on these rather than on the socket
+ * queues. Pollers are woken up as the TX queue drains below
+ * OVPN_TCP_TXQ_WAKE_BYTES, so that io_uring (or epoll) users do not spin.
+ *
+ * Return: the poll mask
+ */
 static __poll_t ovpn_tcp_poll(struct file *file, struct socket *sock,
 			      poll_table *wait)
 {
-	__poll_t mask = datagram_poll(file, sock, wait);
 	struct ovpn_socket *ovpn_sock;
+	struct sock *sk = sock->sk;
+	struct ovpn_peer_tcp *tcp;
+	__poll_t mask = 0;
+	u8 shutdown;
+
+	sock_poll_wait(file, sock, wait);
+
+	if (READ_ONCE(sk->sk_err) ||
+	    !skb_queue_empty_lockless(&sk->sk_error_queue))
+		mask |= EPOLLERR |
+			(sock_flag(sk, SOCK_SELECT_ERR_QUEUE) ? EPOLLPRI : 0);
+
+	shutdown = READ_ONCE(sk->sk_shutdown);
+	if (shutdown & RCV_SHUTDOWN)
+		mask |= EPOLLRDHUP | EPOLLIN | EPOLLRDNORM;
+	if (shutdown == SHUTDOWN_MASK || READ_ONCE(sk->sk_state) == TCP_CLOSE)
+		mask |= EPOLLHUP;
 
 	rcu_read_lock();
-	ovpn_sock = rcu_dereference_sk_user_data(sock->sk);
-	if (!skb_queue_empty(&ovpn_sock->peer->tcp.user_queue))
-		mask |= EPOLLIN | EPOLLRDNORM;
+	ovpn_sock = rcu_dereference_sk_user_data(sk);
+	if (ovpn_sock && ovpn_sock->peer) {
+		tcp = ovpn_sock->tcp;
+		if (!skb_queue_empty_lockless(&tcp->user_queue))
+			mask |= EPOLLIN | EPOLLRDNORM;
+
+		if (READ_ONCE(tcp->out_queue_bytes) <= OVPN_TCP_TXQ_WAKE_BYTES)
+			mask |= EPOLLOUT | EPOLLWRNORM | EPOLLWRBAND;
+		else
+			WRITE_ONCE(tcp->user_tx_wait, true);
+	}
 	rcu_read_unlock();
 
 	return mask;
@@ -495,8 +1334,32 @@ static void ovpn_tcp_build_protos(struct proto *tcp_prot,
 }
 
 /* Initialize TCP static objects */
-void __init ovpn_tcp_init(void)
+int __init ovpn_tcp_init(void)
 {
+	int ret;
+
+	/* TX latency directly impacts tunnel throughput, therefore do not
+	 * let this work wait behind unrelated work items
+	 */
+	ovpn_tcp_wq = alloc_workqueue("ovpn-tcp", WQ_HIGHPRI | WQ_MEM_RECLAIM,
+				      0);
+	if (!ovpn_tcp_wq)
+		return -ENOMEM;
+
 	ovpn_tcp_build_protos(&ovpn_tcp_prot, &ovpn_tcp_ops, &tcp_prot,
 			      &inet_stream_ops);
+
+	ret = tcp_register_ulp(&ovpn_tcp_ulp_ops);
+	if (ret < 0)
+		destroy_workqueue(ovpn_tcp_wq);
+
+	return ret;
+}
+
+/* Release TCP static objects */
+void ovpn_tcp_cleanup(void)
+{
+	tcp_unregister_ulp(&ovpn_tcp_ulp_ops);
+	static_key_deferred_flush(&ovpn_tcp_enabled);
+	destroy_workqueue(ovpn_tcp_wq);
 }
@@ -12,31 +12,127 @@
 #include <linux/net.h>
 #include <linux/skbuff.h>
 #include <linux/types.h>
+#include <linux/workqueue.h>
 
 #include "peer.h"
 
-void __init ovpn_tcp_init(void);
+/* streams a peer can send over besides its first one */
+#define OVPN_TCP_STRIPES_MAX	7
 
-int ovpn_tcp_socket_attach(struct socket *sock, struct ovpn_peer *peer);
-void ovpn_tcp_socket_detach(struct socket *sock);
-void ovpn_tcp_send_sock_skb(struct ovpn_peer *peer, struct sk_buff *skb);
+struct ovpn_socket;
 
-/* Prepare skb and enqueue it for sending to peer.
- *
- * Preparation consist in prepending the skb payload with its size.
- * Required by the OpenVPN protocol in order to extract packets from
- * the TCP stream on the receiver side.
+/**
+ * struct ovpn_peer_tcp - state of a TCP stream carrying the packets of a peer
+ * @peer: the peer this state belongs to
+ * @sk: the socket carrying the stream
+ * @rx_work: work for deferring incoming data processing
+ * @rx_skb: frame being assembled from the stream
+ * @rx_need: bytes missing to complete the current frame
+ * @rx_hdr: length prefix of the next frame
+ * @rx_hdr_len: bytes of the length prefix read so far
+ * @rx_stopped: true once no more data should be read
+ * @tx_work: work for deferring outgoing packet processing
+ * @user_queue: received packets that have to go to userspace
+ * @user_queue_bytes: memory taken by the packets in user_queue
+ * @user_wake: true if packets were queued to userspace by the current read
+ * @out_queue: packets waiting to be written to the socket
+ * @out_queue_bytes: bytes queued in out_queue
+ * @tx_in_progress: true if TX is already ongoing
+ * @user_tx_wait: true if userspace waits for room in out_queue
+ * @tx_eagain: writes to the socket interrupted by its unsent data (or its
+ *	       send buffer) being full
+ * @out_msg: packet being written to the socket
+ * @out_msg.skb: packet currently being sent
+ * @out_msg.offset: offset where next send should start
+ * @out_msg.len: remaining data to send within packet
+ * @sk_cb: socket callbacks replaced when attaching the socket
+ * @sk_cb.sk_data_ready: pointer to original cb
+ * @sk_cb.sk_write_space: pointer to original cb
+ * @sk_cb.prot: pointer to original prot object
+ * @sk_cb.ops: pointer to the original prot_ops object
+ * @sk_cb.notsent_lowat: original TCP_NOTSENT_LOWAT of the socket
+ * @stripes: further streams the peer sends over (first stream only)
+ * @n_stripes: number of streams in @stripes
+ * @tx_rr: round-robin counter spreading packets without a flow hash
+ * @rcu: used to free the state in an RCU safe way
+ */
+struct ovpn_peer_tcp {
+	struct ovpn_peer *peer;
+	struct sock *sk;
+
+	/* state of the TCP reading. Needed to keep track of how much of a
+	 * single packet has already been read from the stream and how much is
+	 * missing
+	 */
+	struct work_struct rx_work;
+	struct sk_buff *rx_skb;
+	unsigned int rx_need;
+	u8 rx_hdr[2];
+	u8 rx_hdr_len;
+	bool rx_stopped;
+	struct work_struct tx_work;
+	struct sk_buff_head user_queue;
+	unsigned int user_queue_bytes;
+	bool user_wake;
+	struct sk_buff_head out_queue;
+	unsigned int out_queue_bytes;
+	bool tx_in_progress;
+	bool user_tx_wait;
+	u64 tx_eagain;
+
+	struct {
+		struct sk_buff *skb;
+		int offset;
+		int len;
+	} out_msg;
+
+	struct {
+		void (*sk_data_ready)(struct sock *sk);
+		void (*sk_write_space)(struct sock *sk);
+		struct proto *prot;
+		const struct proto_ops *ops;
+		u32 notsent_lowat;
+	} sk_cb;
+
+	struct ovpn_socket *stripes[OVPN_TCP_STRIPES_MAX];
+	unsigned int n_stripes;
+	atomic_t tx_rr;
+
+	struct rcu_head rcu;
+};
+
+/**
+ * struct ovpn_tcp_info - compact subset of the tcp_info of a TCP transport
+ * @srtt: smoothed round trip time, in microseconds
+ * @cwnd: congestion window, in segments
+ * @total_retrans: segments retransmitted since the connection was set up
+ * @delivery_rate: most recent delivery rate, in bytes per second
+ * @out_queue: bytes waiting in ovpn to be written to the socket
+ * @tx_eagain: writes to the socket interrupted by its unsent data (or its
+ *	       send buffer) being full
+ * @streams: number of streams the peer sends over
  */
-static inline void ovpn_tcp_send_skb(struct ovpn_peer *peer,
-				     struct sk_buff *skb)
-{
-	u16 len = skb->len;
+struct ovpn_tcp_info {
+	u32 srtt;
+	u32 cwnd;
+	u32 total_retrans;
+	u64 delivery_rate;
+	u32 out_queue;
+	u64 tx_eagain;
+	u32 streams;
+};
 
-	*(__be16 *)__skb_push(skb, sizeof(u16)) = htons(len);
+int __init ovpn_tcp_init(void);
+void ovpn_tcp_cleanup(void);
 
-	bh_lock_sock(peer->sock->sock->sk);
-	ovpn_tcp_send_sock_skb(peer, skb);
-	bh_unlock_sock(peer->sock->sock->sk);
-}
+int ovpn_tcp_socket_attach(struct socket *sock, struct ovpn_peer *peer,
+			   bool stripe);
+void ovpn_tcp_socket_detach(struct socket *sock);
+void ovpn_tcp_socket_kick(struct ovpn_socket *sock);
+struct ovpn_peer_tcp *ovpn_tcp_stream(const struct sock *sk);
+void ovpn_tcp_stripe_add(struct ovpn_peer *peer, struct ovpn_socket *sock);
+void ovpn_tcp_send_skb(struct ovpn_peer *peer, struct sk_buff *skb);
+void ovpn_tcp_get_info(const struct ovpn_peer *peer,
+		       struct ovpn_tcp_info *info);
 
 #endif /* _NET_OVPN_TCP_H_ */
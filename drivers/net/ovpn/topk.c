@@ -0,0 +1,216 @@
+// SPDX-License-Identifier: GPL-2.0
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include <linux/jiffies.h>
+#include <linux/mm.h>
+#include <linux/sort.h>
+#include <linux/string.h>
+
+#include "ovpnstruct.h"
+#include "topk.h"
+
+/* Each CPU counts the traffic of the peers it handles with a Space-Saving
+ * sketch per direction: the OVPN_TOPK_SIZE heaviest peers are tracked, a
+ * peer not tracked yet takes the place of the lightest one and inherits its
+ * counters. The counters of a peer are thus overestimated by at most the
+ * traffic of the lightest tracked peer, while heavy hitters are never missed.
+ * Sketches are started over every window, queries report the last complete
+ * window.
+ */
+
+/* move the sketches of a CPU forward to the given window */
+static void ovpn_topk_rotate(struct ovpn_topk *t, unsigned long window)
+{
+	write_seqcount_begin(&t->seq);
+	if (window == t->window + 1)
+		memcpy(t->prev, t->cur, sizeof(t->prev));
+	else
+		memset(t->prev, 0, sizeof(t->prev));
+	memset(t->cur, 0, sizeof(t->cur));
+	t->window = window;
+	write_seqcount_end(&t->seq);
+}
+
+/**
+ * __ovpn_topk_account - count a packet in the sketch of the current CPU
+ * @topk: the per-CPU sketches of the interface
+ * @peer_id: the peer the packet is sent to or received from
+ * @tx: whether the packet is sent rather than received
+ * @len: the size of the packet on the link
+ */
+void __ovpn_topk_account(struct ovpn_topk __percpu *topk, u32 peer_id,
+			 bool tx, unsigned int len)
+{
+	unsigned long window = jiffies / OVPN_TOPK_WINDOW;
+	struct ovpn_topk_entry *e, *min;
+	struct ovpn_topk_sketch *s;
+	struct ovpn_topk *t;
+	unsigned long flags;
+	unsigned int i;
+
+	/* the TCP transport may receive from process context */
+	local_irq_save(flags);
+	t = this_cpu_ptr(topk);
+	if (unlikely(t->window != window))
+		ovpn_topk_rotate(t, window);
+
+	s = &t->cur[tx];
+	e = &s->e[s->hint];
+	if (likely(e->bytes && e->peer_id == peer_id))
+		goto found;
+
+	/* entries are never emptied within a window, the used ones come
+	 * first
+	 */
+	min = &s->e[0];
+	for (i = 0; i < OVPN_TOPK_SIZE; i++) {
+		e = &s->e[i];
+		if (!e->bytes) {
+			min = e;
+			break;
+		}
+
+		if (e->peer_id == peer_id)
+			goto found;
+
+		if (e->bytes < min->bytes)
+			min = e;
+	}
+
+	e = min;
+	e->peer_id = peer_id;
+found:
+	s->hint = e - s->e;
+	e->bytes += len;
+	e->packets++;
+	local_irq_restore(flags);
+}
+
+/**
+ * ovpn_topk_init - allocate the heavy hitter sketches of an interface
+ * @ovpn: the instance
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_topk_init(struct ovpn_struct *ovpn)
+{
+	int cpu;
+
+	ovpn->topk = alloc_percpu(struct ovpn_topk);
+	if (!ovpn->topk)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu)
+		seqcount_init(&per_cpu_ptr(ovpn->topk, cpu)->seq);
+
+	return 0;
+}
+
+/**
+ * ovpn_topk_free - release the heavy hitter sketches of an interface
+ * @ovpn: the instance, which must not handle any packet anymore
+ */
+void ovpn_topk_free(struct ovpn_struct *ovpn)
+{
+	free_percpu(ovpn->topk);
+	ovpn->topk = NULL;
+}
+
+static int ovpn_topk_cmp_id(const void *a, const void *b)
+{
+	const struct ovpn_topk_entry *ea = a, *eb = b;
+
+	return (ea->peer_id > eb->peer_id) - (ea->peer_id < eb->peer_id);
+}
+
+static int ovpn_topk_cmp_bytes(const void *a, const void *b)
+{
+	const struct ovpn_topk_entry *ea = a, *eb = b;
+
+	return (ea->bytes < eb->bytes) - (ea->bytes > eb->bytes);
+}
+
+/* copy the sketch of a CPU for the last complete window to e, return the
+ * number of entries copied
+ */
+static unsigned int ovpn_topk_read(struct ovpn_topk *t, unsigned long now,
+				   bool tx, struct ovpn_topk_entry *e)
+{
+	const struct ovpn_topk_sketch *s;
+	unsigned int seq, n;
+
+	do {
+		seq = read_seqcount_begin(&t->seq);
+		if (t->window == now)
+			s = &t->prev[tx];
+		else if (t->window == now - 1)
+			s = &t->cur[tx];
+		else
+			s = NULL;
+
+		if (s)
+			memcpy(e, s->e, sizeof(s->e));
+	} while (read_seqcount_retry(&t->seq, seq));
+
+	if (!s)
+		return 0;
+
+	for (n = 0; n < OVPN_TOPK_SIZE && e[n].bytes; n++)
+		;
+
+	return n;
+}
+
+/**
+ * ovpn_topk_fetch - report the heaviest peers of an interface
+ * @ovpn: the instance, which must track its heavy hitters
+ * @tx: whether peers are ranked by the traffic sent rather than received
+ * @top: where to store the peers, heaviest first
+ * @n: the largest number of peers to report
+ *
+ * The traffic of a peer is the sum of what each CPU counted for it over the
+ * last complete window.
+ *
+ * Return: the number of peers stored in top or a negative error code
+ */
+int ovpn_topk_fetch(struct ovpn_struct *ovpn, bool tx,
+		    struct ovpn_topk_entry *top, unsigned int n)
+{
+	unsigned long now = jiffies / OVPN_TOPK_WINDOW;
+	struct ovpn_topk_entry *all;
+	unsigned int cnt = 0, i, j;
+	int cpu;
+
+	all = kvmalloc_array(num_possible_cpus() * OVPN_TOPK_SIZE,
+			     sizeof(*all), GFP_KERNEL);
+	if (!all)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu)
+		cnt += ovpn_topk_read(per_cpu_ptr(ovpn->topk, cpu), now, tx,
+				      all + cnt);
+
+	/* merge the entries of a same peer coming from different CPUs */
+	sort(all, cnt, sizeof(*all), ovpn_topk_cmp_id, NULL);
+	for (i = 0, j = 0; i < cnt; i++) {
+		if (j && all[j - 1].peer_id == all[i].peer_id) {
+			all[j - 1].bytes += all[i].bytes;
+			all[j - 1].packets += all[i].packets;
+			continue;
+		}
+
+		all[j++] = all[i];
+	}
+
+	sort(all, j, sizeof(*all), ovpn_topk_cmp_bytes, NULL);
+	n = min(n, j);
+	memcpy(top, all, n * sizeof(*top));
+	kvfree(all);
+
+	return n;
+}
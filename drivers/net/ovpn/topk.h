@@ -0,0 +1,86 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_TOPK_H_
+#define _NET_OVPN_TOPK_H_
+
+#include <linux/percpu.h>
+#include <linux/seqlock.h>
+#include <linux/types.h>
+
+#include "ovpnstruct.h"
+#include "peer.h"
+
+/* peers tracked by the sketch of each CPU and direction */
+#define OVPN_TOPK_SIZE		32
+/* length of the windows the traffic is counted over */
+#define OVPN_TOPK_WINDOW	HZ
+/* number of peers a query reports by default, and at most */
+#define OVPN_TOPK_DEFAULT	10
+#define OVPN_TOPK_MAX		64
+
+/**
+ * struct ovpn_topk_entry - traffic of one peer within a window
+ * @peer_id: the peer the traffic belongs to
+ * @packets: packets counted, possibly overestimated
+ * @bytes: bytes counted, possibly overestimated (0 if the entry is unused)
+ */
+struct ovpn_topk_entry {
+	u32 peer_id;
+	u32 packets;
+	u64 bytes;
+};
+
+/**
+ * struct ovpn_topk_sketch - space-saving sketch of the traffic of a window
+ * @e: the entries, one per tracked peer
+ * @hint: entry updated last, checked first since packets come in bursts
+ */
+struct ovpn_topk_sketch {
+	struct ovpn_topk_entry e[OVPN_TOPK_SIZE];
+	unsigned int hint;
+};
+
+/**
+ * struct ovpn_topk - per-CPU heavy hitters of an interface
+ * @seq: lets readers detect a rotation of the windows
+ * @window: number of the window @cur counts the traffic of
+ * @cur: sketches of the current window, for RX and TX
+ * @prev: sketches of the previous window, for RX and TX
+ */
+struct ovpn_topk {
+	seqcount_t seq;
+	unsigned long window;
+	struct ovpn_topk_sketch cur[2];
+	struct ovpn_topk_sketch prev[2];
+};
+
+void __ovpn_topk_account(struct ovpn_topk __percpu *topk, u32 peer_id,
+			 bool tx, unsigned int len);
+
+/**
+ * ovpn_topk_account - count a packet for the heavy hitters of an interface
+ * @peer: the peer the packet is sent to or received from
+ * @tx: whether the packet is sent rather than received
+ * @len: the size of the packet on the link
+ */
+static inline void ovpn_topk_account(struct ovpn_peer *peer, bool tx,
+				     unsigned int len)
+{
+	struct ovpn_topk __percpu *topk = peer->ovpn->topk;
+
+	if (unlikely(topk))
+		__ovpn_topk_account(topk, peer->id, tx, len);
+}
+
+int ovpn_topk_init(struct ovpn_struct *ovpn);
+void ovpn_topk_free(struct ovpn_struct *ovpn);
+int ovpn_topk_fetch(struct ovpn_struct *ovpn, bool tx,
+		    struct ovpn_topk_entry *top, unsigned int n);
+
+#endif /* _NET_OVPN_TOPK_H_ */
@@ -8,30 +8,402 @@
 
 #include <linux/netdevice.h>
 #include <linux/inetdevice.h>
+#include <linux/prefetch.h>
 #include <linux/socket.h>
 #include <net/addrconf.h>
 #include <net/dst_cache.h>
+#include <net/gro.h>
+#include <net/inet_ecn.h>
+#include <net/ip6_checksum.h>
+#include <net/ip6_tunnel.h>
+#include <net/ip_tunnels.h>
+#include <net/lwtunnel.h>
+#include <net/ip6_route.h>
+#include <net/l3mdev.h>
 #include <net/route.h>
-#include <net/ipv6_stubs.h>
 #include <net/udp.h>
 #include <net/udp_tunnel.h>
+#include <trace/events/ovpn.h>
 
 #include "ovpnstruct.h"
 #include "main.h"
 #include "bind.h"
+#include "ctrl.h"
+#include "demux.h"
+#include "drop.h"
 #include "io.h"
+#include "latency.h"
+#include "napi.h"
+#include "packet.h"
 #include "peer.h"
 #include "proto.h"
+#include "route.h"
+#include "skb.h"
 #include "socket.h"
+#include "stats.h"
 #include "udp.h"
+#include "worker.h"
+
+/**
+ * ovpn_udp_gro_complete - finalize a packet aggregated by the UDP GRO layer
+ * @sk: socket over which the packet was received
+ * @skb: the aggregated packet
+ * @nhoff: offset of the OpenVPN payload
+ *
+ * Datagrams of the same flow and size are aggregated by the UDP GRO layer,
+ * enabled on the socket like UDP_GRO does. Having this callback makes the
+ * aggregate a tunnel packet, which the UDP stack hands to the encap handler
+ * in one piece rather than splitting it first.
+ *
+ * Return: always 0
+ */
+static int ovpn_udp_gro_complete(struct sock *sk, struct sk_buff *skb,
+				 int nhoff)
+{
+	skb->csum_start = skb_transport_header(skb) - skb->head;
+	skb->csum_offset = offsetof(struct udphdr, check);
+	skb->ip_summed = CHECKSUM_PARTIAL;
+
+	skb_shinfo(skb)->gso_segs = NAPI_GRO_CB(skb)->count;
+	skb_shinfo(skb)->gso_type |= SKB_GSO_UDP_L4;
+
+	return 0;
+}
+
+/* hand a received packet, holding a reference to peer, over to the crypto
+ * kthread of a threaded interface, to the preferred RX CPU of the peer or
+ * to ovpn_recv() on this CPU
+ */
+static void ovpn_udp_recv(struct ovpn_peer *peer, struct sk_buff *skb)
+{
+	if (peer->ovpn->workers)
+		ovpn_worker_recv(peer, skb);
+	else if (!ovpn_napi_steer(peer, skb))
+		ovpn_recv(peer, skb);
+}
+
+/* split a packet aggregated by GRO, with data pointing at the UDP header, into
+ * a list of datagrams, each with data pointing at its UDP header
+ */
+static struct sk_buff *ovpn_udp_gro_segment(struct sock *sk,
+					    struct sk_buff *skb)
+{
+	bool ipv4 = skb->protocol == htons(ETH_P_IP);
+	struct sk_buff *segs, *next;
+
+	/* the aggregate is marked as tunnel packet by the UDP GRO layer in
+	 * order to reach the encap handler: turn it back into a plain UDP GSO
+	 * packet, so that it can be split like for any other UDP socket
+	 */
+	skb_shinfo(skb)->gso_type &= ~(SKB_GSO_UDP_TUNNEL |
+				       SKB_GSO_UDP_TUNNEL_CSUM);
+	skb->encapsulation = 0;
+
+	/* segmentation starts from the MAC header */
+	__skb_push(skb, -skb_mac_offset(skb));
+	segs = udp_rcv_segment(sk, skb, ipv4);
+	skb_list_walk_safe(segs, skb, next) {
+		__skb_pull(skb, skb_transport_offset(skb));
+		udp_post_segment_fix_csum(skb);
+	}
+
+	return segs;
+}
+
+/* whether an aggregate, with data pointing at the UDP header, is a train of
+ * data packets with the same opcode, key ID and peer ID: the UDP GRO layer
+ * merges any datagrams of a flow of the same size, control packets included
+ */
+static bool ovpn_udp_gro_train(struct sk_buff *skb)
+{
+	unsigned int off, size = skb_shinfo(skb)->gso_size;
+	__be32 *op, *op2, tmp, tmp2;
+
+	op = skb_header_pointer(skb, sizeof(struct udphdr), sizeof(tmp), &tmp);
+	if (!op || (ntohl(*op) >> (24 + OVPN_OPCODE_SHIFT)) != OVPN_DATA_V2)
+		return false;
+
+	for (off = sizeof(struct udphdr) + size; off < skb->len; off += size) {
+		op2 = skb_header_pointer(skb, off, sizeof(tmp2), &tmp2);
+		if (!op2 || *op2 != *op)
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * ovpn_udp_gro_split - split and process a packet aggregated by GRO
+ * @sk: socket over which the packet was received
+ * @peer: the peer all aggregated packets are coming from
+ * @skb: the aggregated packet, with data pointing at the UDP header
+ *
+ * All the resulting packets carry their own reference to the peer and are
+ * decrypted as one burst by ovpn_recv_list(), unless they are handed over
+ * one by one to a kthread or to the preferred RX CPU of the peer. The
+ * reference held by the caller is released.
+ */
+static void ovpn_udp_gro_split(struct sock *sk, struct ovpn_peer *peer,
+			       struct sk_buff *skb)
+{
+	struct sk_buff *segs, *next;
+	struct sk_buff_head list;
+
+	segs = ovpn_udp_gro_segment(sk, skb);
+	if (unlikely(!segs)) {
+		/* the aggregate was released by udp_rcv_segment() */
+		ovpn_drop_count(peer->ovpn, false, OVPN_DROP_SEGMENT);
+		ovpn_peer_put(peer);
+		return;
+	}
+
+	__skb_queue_head_init(&list);
+	skb_list_walk_safe(segs, skb, next) {
+		skb_mark_not_on_list(skb);
+
+		if (unlikely(skb->len < sizeof(struct udphdr) +
+					OVPN_OP_SIZE_V2)) {
+			ovpn_peer_rx_drop(peer, skb, OVPN_DROP_TOO_SMALL);
+			continue;
+		}
+
+		/* pop off outer UDP header */
+		__skb_pull(skb, sizeof(struct udphdr));
+		trace_ovpn_udp_recv(skb, peer->id);
+		__skb_queue_tail(&list, skb);
+	}
+
+	/* each packet carries its own reference to the peer, all taken in
+	 * one go while the one of the caller is still held
+	 */
+	if (likely(!skb_queue_empty(&list)))
+		refcount_add(skb_queue_len(&list), &peer->refcount.refcount);
+
+	if (peer->ovpn->workers || READ_ONCE(peer->rx_cpu) >= 0) {
+		while ((skb = __skb_dequeue(&list)))
+			ovpn_udp_recv(peer, skb);
+	} else {
+		ovpn_recv_list(peer, &list);
+	}
+
+	ovpn_peer_put(peer);
+}
+
+/**
+ * ovpn_udp_reply_sk - get the UDP socket to reply to a peer from
+ * @peer: the destination peer
+ * @bind: the binding related to the destination peer
+ * @sk: the socket of the peer
+ *
+ * Return: the socket the peer was lately reached on, if still attached to
+ * the same instance, or @sk otherwise
+ */
+static struct sock *ovpn_udp_reply_sk(struct ovpn_peer *peer,
+				      struct ovpn_bind *bind, struct sock *sk)
+{
+	if (unlikely(bind->sk) && ovpn_from_udp_sock(bind->sk) == peer->ovpn)
+		return bind->sk;
+
+	return sk;
+}
+
+/**
+ * ovpn_udp_reply_sk_update - track the UDP socket a peer is reached on
+ * @peer: the peer the packet is coming from
+ * @sk: socket over which the packet was received
+ * @skb: the received packet
+ *
+ * When userspace attaches several sockets of a SO_REUSEPORT group to the same
+ * instance, the peer is answered from the socket it was lately seen on.
+ * The socket is switched only for packets coming from the current remote
+ * endpoint, which was confirmed by an authenticated packet: packets from a
+ * new endpoint switch it once the peer has floated.
+ */
+static void ovpn_udp_reply_sk_update(struct ovpn_peer *peer, struct sock *sk,
+				     struct sk_buff *skb)
+{
+	struct ovpn_bind *bind;
+	struct sock *peer_sk;
+	bool update;
+
+	/* peer-id may point to a TCP peer */
+	if (unlikely(!ovpn_peer_is_udp(peer)))
+		return;
+
+	peer_sk = peer->sock->sock->sk;
+
+	rcu_read_lock();
+	bind = rcu_dereference(peer->bind);
+	update = bind && (bind->sk ?: peer_sk) != sk &&
+		 ovpn_bind_skb_src_match(bind, skb);
+	rcu_read_unlock();
+
+	if (likely(!update))
+		return;
+
+	if (ovpn_bind_set_sk(peer, sk))
+		ovpn_dev_stats_inc(peer->ovpn, peer_sock_switch);
+}
+
+/**
+ * ovpn_udp_prefetch - start loading what the datapath needs for a peer
+ * @peer: the peer a data packet was received from
+ *
+ * The bind is checked and the primary key slot is used by the decryption
+ * right after the transport bookkeeping: issue their loads now, so that
+ * they complete meanwhile.
+ */
+static void ovpn_udp_prefetch(struct ovpn_peer *peer)
+{
+	rcu_read_lock();
+	prefetch(rcu_dereference(peer->bind));
+	prefetch(rcu_dereference(peer->crypto.primary));
+	rcu_read_unlock();
+}
+
+/* Retrieve the ovpn object from a socket the encap handlers were invoked on.
+ *
+ * Unlike ovpn_from_udp_sock(), the encap type needs no check: the handlers
+ * are installed by the attach only, with the ovpn_socket stored in the user
+ * data, and the cached sk lives on the same cacheline as the ovpn pointer.
+ * rcu_read_lock must be held on entry
+ */
+static struct ovpn_struct *ovpn_udp_encap_ovpn(struct sock *sk)
+{
+	struct ovpn_socket *ovpn_sock = rcu_dereference_sk_user_data(sk);
+
+	if (unlikely(!ovpn_sock || ovpn_sock->sk != sk))
+		return NULL;
+
+	return ovpn_sock->ovpn;
+}
+
+/* pass a data packet on to the peer it was received from, whose reference
+ * is transferred
+ */
+static void ovpn_udp_deliver(struct sock *sk, struct ovpn_peer *peer,
+			     struct sk_buff *skb)
+{
+	ovpn_udp_prefetch(peer);
+	ovpn_udp_reply_sk_update(peer, sk, skb);
+
+	/* segments of an aggregate inherit its stamp */
+	ovpn_latency_stamp(peer->ovpn, skb);
+
+	/* the packets of a train, see ovpn_udp_gro_train(), share the peer */
+	if (skb_is_gso(skb)) {
+		ovpn_udp_gro_split(sk, peer, skb);
+		return;
+	}
+
+	/* pop off outer UDP header */
+	__skb_pull(skb, sizeof(struct udphdr));
+	trace_ovpn_udp_recv(skb, peer->id);
+	ovpn_udp_recv(peer, skb);
+}
+
+/* whether sk is a socket shared by several instances, see
+ * ovpn_udp_encap_ovpn(). rcu_read_lock must be held on entry
+ */
+static bool ovpn_udp_encap_shared(struct sock *sk)
+{
+	struct ovpn_socket *ovpn_sock = rcu_dereference_sk_user_data(sk);
+
+	return ovpn_sock && ovpn_sock->sk == sk &&
+	       test_bit(OVPN_SOCKET_SHARED, &ovpn_sock->flags);
+}
+
+/**
+ * ovpn_udp_shared_recv - demultiplex a packet received over a shared socket
+ * @sk: the shared socket the packet was received over
+ * @skb: the received packet
+ *
+ * The peer ID of data packets tells the instance they belong to. Packets
+ * carrying none cannot be matched to an instance: they are dropped, while
+ * control packets are left to userspace.
+ *
+ * Return: 0 if skb was consumed or dropped, >0 if skb should be passed up to
+ * userspace as UDP
+ */
+static int ovpn_udp_shared_recv(struct sock *sk, struct sk_buff *skb)
+{
+	enum ovpn_drop_reason reason = OVPN_DROP_TOO_SMALL;
+	struct ovpn_peer *peer;
+	u32 peer_id;
+
+	if (unlikely(skb->len < sizeof(struct udphdr) + OVPN_OP_SIZE_V2))
+		goto drop;
+
+	switch (ovpn_opcode_from_skb(skb, sizeof(struct udphdr))) {
+	case OVPN_DATA_V2:
+		break;
+	case OVPN_DATA_V1:
+		reason = OVPN_DROP_NO_PEER;
+		goto drop;
+	default:
+		return 1;
+	}
+
+	reason = OVPN_DROP_NO_PEER;
+	peer_id = ovpn_peer_id_from_skb(skb, sizeof(struct udphdr));
+	if (unlikely(peer_id == OVPN_PEER_ID_UNDEF))
+		goto drop;
+
+	peer = ovpn_demux_get(sk, peer_id);
+	if (unlikely(!peer)) {
+		net_dbg_ratelimited("%s: received data from unknown peer (id: %d)\n",
+				    __func__, peer_id);
+		goto drop;
+	}
+
+	ovpn_udp_deliver(sk, peer, skb);
+	return 0;
+
+drop:
+	/* no instance to account the drop to */
+	kfree_skb_reason(skb, (enum skb_drop_reason)reason);
+	return 0;
+}
+
+static int ovpn_udp_encap_recv(struct sock *sk, struct sk_buff *skb);
+
+/**
+ * ovpn_udp_gro_unpack - process the datagrams of an aggregate one by one
+ * @sk: socket over which the aggregate was received
+ * @skb: the aggregate, with data pointing at the UDP header
+ *
+ * An aggregate that is no train of data packets, see ovpn_udp_gro_train(),
+ * is split and each of its datagrams goes through ovpn_udp_encap_recv() on
+ * its own. Those left to userspace are queued to the socket right away, as
+ * the UDP stack would only have done for the aggregate as a whole.
+ *
+ * Return: always 0, skb was consumed
+ */
+static int ovpn_udp_gro_unpack(struct sock *sk, struct sk_buff *skb)
+{
+	struct sk_buff *segs, *next;
+
+	segs = ovpn_udp_gro_segment(sk, skb);
+	skb_list_walk_safe(segs, skb, next) {
+		skb_mark_not_on_list(skb);
+		if (ovpn_udp_encap_recv(sk, skb) <= 0)
+			continue;
+
+		if (__udp_enqueue_schedule_skb(sk, skb) < 0)
+			kfree_skb_reason(skb, SKB_DROP_REASON_SOCKET_RCVBUFF);
+	}
+
+	return 0;
+}
 
 /**
  * ovpn_udp_encap_recv - Start processing a received UDP packet.
  * @sk: socket over which the packet was received
  * @skb: the received packet
  *
- * If the first byte of the payload is DATA_V2, the packet is further processed,
- * otherwise it is forwarded to the UDP stack for delivery to user space.
+ * If the first byte of the payload is DATA_V2 or DATA_V1, the packet is further
+ * processed, otherwise it is forwarded to the UDP stack for delivery to user
+ * space.
  *
  * Return:
  *  0 if skb was consumed or dropped
@@ -41,47 +413,72 @@
 static int ovpn_udp_encap_recv(struct sock *sk, struct sk_buff *skb)
 {
 	struct ovpn_peer *peer = NULL;
+	enum ovpn_drop_reason reason;
 	struct ovpn_struct *ovpn;
+	bool cached;
 	u32 peer_id;
 	u8 opcode;
 
-	ovpn = ovpn_from_udp_sock(sk);
+	if (unlikely(skb_is_gso(skb)) && !ovpn_udp_gro_train(skb))
+		return ovpn_udp_gro_unpack(sk, skb);
+
+	ovpn = ovpn_udp_encap_ovpn(sk);
 	if (unlikely(!ovpn)) {
+		/* shared sockets are owned by no instance */
+		if (ovpn_udp_encap_shared(sk))
+			return ovpn_udp_shared_recv(sk, skb);
+
 		net_err_ratelimited("%s: cannot obtain ovpn object from UDP socket\n",
 				    __func__);
-		goto drop;
+		/* no instance to account the drop to */
+		kfree_skb_reason(skb, (enum skb_drop_reason)
+				      OVPN_DROP_NO_TRANSPORT);
+		return 0;
 	}
 
-	/* Make sure the first 4 bytes of the skb data buffer after the UDP
-	 * header are accessible.
-	 * They are required to fetch the OP code, the key ID and the peer ID.
+	/* The first 4 bytes after the UDP header carry the OP code, the key ID
+	 * and the peer ID. They are read in place rather than pulled: with a
+	 * NIC splitting headers from payload they sit in a page fragment,
+	 * which is left there until the payload is decrypted.
 	 */
-	if (unlikely(!pskb_may_pull(skb, sizeof(struct udphdr) +
-				    OVPN_OP_SIZE_V2))) {
+	if (unlikely(skb->len < sizeof(struct udphdr) + OVPN_OP_SIZE_V2)) {
 		net_dbg_ratelimited("%s: packet too small\n", __func__);
+		reason = OVPN_DROP_TOO_SMALL;
 		goto drop;
 	}
 
 	opcode = ovpn_opcode_from_skb(skb, sizeof(struct udphdr));
-	if (unlikely(opcode != OVPN_DATA_V2)) {
-		/* DATA_V1 is not supported */
-		if (opcode == OVPN_DATA_V1)
-			goto drop;
+	if (unlikely(opcode != OVPN_DATA_V2 && opcode != OVPN_DATA_V1)) {
+		/* control packets of known peers may be batched over netlink */
+		if (ovpn->ctrl) {
+			peer = ovpn_peer_get_by_transp_addr(ovpn, skb);
+			if (peer) {
+				ovpn_ctrl_recv(peer, skb, sizeof(struct udphdr));
+				ovpn_peer_put(peer);
+				return 0;
+			}
+		}
 
 		/* unknown or control packet: let it bubble up to userspace */
 		return 1;
 	}
 
-	peer_id = ovpn_peer_id_from_skb(skb, sizeof(struct udphdr));
 	/* some OpenVPN server implementations send data packets with the
-	 * peer-id set to undef. In this case we skip the peer lookup by peer-id
-	 * and we try with the transport address
+	 * peer-id set to undef, and DATA_V1 packets carry none. In this case we
+	 * skip the peer lookup by peer-id and we try with the transport address
 	 */
+	peer_id = OVPN_PEER_ID_UNDEF;
+	if (likely(opcode == OVPN_DATA_V2))
+		peer_id = ovpn_peer_id_from_skb(skb, sizeof(struct udphdr));
 	if (peer_id != OVPN_PEER_ID_UNDEF) {
-		peer = ovpn_peer_get_by_id(ovpn, peer_id);
+		peer = ovpn_peer_get_by_id_rx(ovpn, peer_id, &cached);
 		if (!peer) {
-			net_err_ratelimited("%s: received data from unknown peer (id: %d)\n",
-					    __func__, peer_id);
+			/* report an unknown ID once, not at every packet */
+			if (!cached)
+				net_err_ratelimited("%s: received data from unknown peer (id: %d)\n",
+						    __func__, peer_id);
+			ovpn_dev_stats_inc(ovpn, peer_miss_id);
+			reason = OVPN_DROP_NO_PEER;
 			goto drop;
 		}
 	}
@@ -92,52 +489,456 @@ static int ovpn_udp_encap_recv(struct sock *sk, struct sk_buff *skb)
 		if (unlikely(!peer)) {
 			net_dbg_ratelimited("%s: received data with undef peer-id from unknown source\n",
 					    __func__);
+			ovpn_dev_stats_inc(ovpn, peer_miss_transp_addr);
+			reason = OVPN_DROP_NO_PEER;
 			goto drop;
 		}
 	}
 
-	/* pop off outer UDP header */
-	__skb_pull(skb, sizeof(struct udphdr));
-	ovpn_recv(peer, skb);
-	return 0;
+	ovpn_udp_deliver(sk, peer, skb);
+	return 0;
+
+drop:
+	if (peer)
+		ovpn_peer_put(peer);
+	ovpn_rx_drop(ovpn, skb, reason);
+	return 0;
+}
+
+/* largest overhead of a data packet: opcode/peer ID, packet ID and AEAD tag */
+#define OVPN_UDP_DATA_OVERHEAD	(OVPN_OP_SIZE_V2 + NONCE_WIRE_SIZE_64 + 16)
+
+/* track the largest packet the route to peer carries once encapsulated, the
+ * MTU of the route reflects the ICMP errors received on the socket
+ */
+static void ovpn_udp_pmtu_update(struct ovpn_peer *peer,
+				 struct dst_entry *dst, unsigned int hdr_len)
+{
+	unsigned int mtu = dst_mtu(dst);
+
+	if (mtu > hdr_len + sizeof(struct udphdr) + OVPN_UDP_DATA_OVERHEAD)
+		mtu -= hdr_len + sizeof(struct udphdr) + OVPN_UDP_DATA_OVERHEAD;
+	else
+		mtu = 0;
+
+	if (unlikely(READ_ONCE(peer->pmtu) != mtu))
+		WRITE_ONCE(peer->pmtu, mtu);
+}
+
+/* DS field of the outer header: DSCP is copied from the inner packet and
+ * ECN is set as RFC 6040 (normal mode) dictates
+ */
+static u8 ovpn_udp_tos(const struct ovpn_struct *ovpn, struct sk_buff *skb)
+{
+	u8 inner = ovpn_skb_cb(skb)->dsfield;
+
+	if (!ovpn->inherit_dsfield)
+		return 0;
+
+	return INET_ECN_encapsulate(inner & ~INET_ECN_MASK, inner);
+}
+
+/**
+ * ovpn_udp_encap_err_lookup - match an ICMP error to the instance
+ * @sk: the socket the packet quoted by the error was sent from
+ * @skb: the ICMP error, with the transport header pointing to the UDP header
+ *	 of the quoted packet
+ *
+ * Errors about data packets are accepted only if they were sent to a known
+ * peer. Once accepted, errors reporting a smaller path MTU update the route
+ * to the peer, which ovpn_udp_pmtu_update() picks up on the next packet.
+ *
+ * Return: 0 if the error is about a packet of this instance or a negative
+ * error code otherwise
+ */
+static int ovpn_udp_encap_err_lookup(struct sock *sk, struct sk_buff *skb)
+{
+	unsigned int off = skb_transport_offset(skb) + sizeof(struct udphdr);
+	struct ovpn_struct *ovpn;
+	struct ovpn_peer *peer;
+	u32 peer_id;
+
+	ovpn = ovpn_udp_encap_ovpn(sk);
+	if (unlikely(!ovpn) && !ovpn_udp_encap_shared(sk))
+		return -ENOENT;
+
+	/* routers may quote no more than the UDP header, while control
+	 * packets are sent by userspace over the same socket
+	 */
+	if (!pskb_may_pull(skb, off + OVPN_OP_SIZE_V2) ||
+	    ovpn_opcode_from_skb(skb, off) != OVPN_DATA_V2)
+		return 0;
+
+	peer_id = ovpn_peer_id_from_skb(skb, off);
+	peer = ovpn ? ovpn_peer_get_by_id(ovpn, peer_id) :
+		      ovpn_demux_get(sk, peer_id);
+	if (!peer)
+		return -ENOENT;
+
+	ovpn_peer_put(peer);
+	return 0;
+}
+
+/* outer source port of skb. With a port range configured, flows are spread
+ * over the range by their hash, so that ECMP routers and RSS receivers tell
+ * them apart. Packets carrying no flow hash are sent from the socket port
+ */
+static __be16 ovpn_udp_sport(const struct ovpn_peer *peer,
+			     const struct sk_buff *skb, __be16 sport)
+{
+	struct ovpn_port_range range = READ_ONCE(peer->tx_ports);
+
+	if (likely(!range.min) || !skb->hash)
+		return sport;
+
+	return htons(range.min + reciprocal_scale(skb->hash, range.max -
+						  range.min + 1));
+}
+
+/* paths cache their own route, while the binding uses the route of the peer */
+static struct dst_cache *ovpn_udp_cache_get(struct ovpn_peer *peer,
+					    struct ovpn_path *path,
+					    const struct ovpn_bind *bind,
+					    const struct net *net)
+{
+	if (path)
+		return &path->dst_cache;
+
+	return ovpn_route_cache_get(peer, bind, net);
+}
+
+static void ovpn_udp_cache_reset(struct ovpn_peer *peer,
+				 struct ovpn_path *path)
+{
+	if (path)
+		dst_cache_reset(&path->dst_cache);
+	else
+		ovpn_route_cache_reset(peer);
+}
+
+/* replace the outer headers prebuilt for bind by tmpl, which is then used by
+ * the caller. Concurrent builders publish equivalent templates.
+ * Must be called under RCU read lock
+ */
+static void ovpn_udp_tmpl_set(struct ovpn_bind *bind,
+			      struct ovpn_hdr_tmpl *tmpl)
+{
+	struct ovpn_hdr_tmpl *old;
+
+	old = unrcu_pointer(xchg(&bind->tmpl, RCU_INITIALIZER(tmpl)));
+	if (old)
+		kfree_rcu(old, rcu);
+}
+
+/**
+ * ovpn_udp4_tmpl_get - get the IPv4 headers prebuilt for a binding
+ * @bind: the binding packets are sent to
+ * @fl: the flow of the packet being sent, as routed
+ * @ttl: the TTL of the route of the packet
+ *
+ * The template is built again once the route or the endpoints change.
+ * Must be called under RCU read lock.
+ *
+ * Return: the headers to copy into the packet or NULL if none could be built
+ */
+static const struct ovpn_hdr_tmpl *
+ovpn_udp4_tmpl_get(struct ovpn_bind *bind, const struct flowi4 *fl, u8 ttl)
+{
+	struct ovpn_hdr_tmpl *tmpl = rcu_dereference(bind->tmpl);
+
+	if (likely(tmpl && tmpl->v4.iph.saddr == fl->saddr &&
+		   tmpl->v4.iph.daddr == fl->daddr &&
+		   tmpl->v4.iph.ttl == ttl &&
+		   tmpl->v4.uh.source == fl->fl4_sport &&
+		   tmpl->v4.uh.dest == fl->fl4_dport))
+		return tmpl;
+
+	tmpl = kzalloc(sizeof(*tmpl), GFP_ATOMIC);
+	if (unlikely(!tmpl))
+		return NULL;
+
+	tmpl->v4.iph.version = 4;
+	tmpl->v4.iph.ihl = sizeof(struct iphdr) >> 2;
+	tmpl->v4.iph.ttl = ttl;
+	tmpl->v4.iph.protocol = IPPROTO_UDP;
+	tmpl->v4.iph.saddr = fl->saddr;
+	tmpl->v4.iph.daddr = fl->daddr;
+	tmpl->v4.uh.source = fl->fl4_sport;
+	tmpl->v4.uh.dest = fl->fl4_dport;
+	ovpn_udp_tmpl_set(bind, tmpl);
+
+	return tmpl;
+}
+
+/* interval between two lookups of the link layer header of a template whose
+ * neighbour was not confirmed
+ */
+#define OVPN_UDP_HH_RETRY	HZ
+
+/**
+ * ovpn_udp_tmpl_l2 - get a template carrying the link layer header of a route
+ * @bind: the binding packets are sent to
+ * @tmpl: the current template of @bind
+ * @dev: the lower device of the route
+ * @family: the address family of @nexthop
+ * @nexthop: the next hop of the route
+ *
+ * The header is resolved again once the route moves to another device or
+ * next hop, and whenever a neighbour is updated. A neighbour found
+ * unconfirmed is looked up again after OVPN_UDP_HH_RETRY: meanwhile packets
+ * go through the neighbour output, which confirms it.
+ * Must be called under RCU read lock.
+ *
+ * Return: the template to send with or NULL if none could be built
+ */
+static const struct ovpn_hdr_tmpl *
+ovpn_udp_tmpl_l2(struct ovpn_bind *bind, const struct ovpn_hdr_tmpl *tmpl,
+		 struct net_device *dev, sa_family_t family,
+		 const void *nexthop)
+{
+	const size_t len = family == AF_INET ? sizeof(tmpl->nexthop.ipv4) :
+					       sizeof(tmpl->nexthop.ipv6);
+	u32 gen = ovpn_route_neigh_gen();
+	struct ovpn_hdr_tmpl *new;
+
+	if (likely(tmpl->gen == gen && tmpl->dev == dev &&
+		   !memcmp(&tmpl->nexthop, nexthop, len) &&
+		   (tmpl->hh_len ||
+		    time_before(jiffies, tmpl->hh_stamp + OVPN_UDP_HH_RETRY))))
+		return tmpl;
+
+	new = kmemdup(tmpl, sizeof(*tmpl), GFP_ATOMIC);
+	if (unlikely(!new))
+		return NULL;
+
+	new->dev = dev;
+	memset(&new->nexthop, 0, sizeof(new->nexthop));
+	memcpy(&new->nexthop, nexthop, len);
+	/* read before the header, so that a concurrent update is caught */
+	new->gen = gen;
+	new->hh_stamp = jiffies;
+	new->hh_len = ovpn_route_neigh_hh(dev, family, nexthop, new->hh);
+	ovpn_udp_tmpl_set(bind, new);
+
+	return new;
+}
+
+/**
+ * ovpn_udp_direct_xmit - queue a packet to the lower device right away
+ * @bind: the binding the packet is sent to
+ * @tmpl: the template the outer headers of the packet were copied from
+ * @dst: the route of the packet
+ * @family: the address family of @nexthop
+ * @nexthop: the next hop of @dst
+ * @skb: the packet to send, carrying its final IP header
+ * @err: where to store the result of the transmission
+ *
+ * Packets the IP output path would do more with than forward them are left
+ * to it: those routed over xfrm or a lightweight tunnel, those exceeding the
+ * MTU of the route and those whose link layer header is not known yet.
+ *
+ * Return: true if skb was consumed, false if it has to go through the stack
+ */
+static bool ovpn_udp_direct_xmit(struct ovpn_bind *bind,
+				 const struct ovpn_hdr_tmpl *tmpl,
+				 struct dst_entry *dst, sa_family_t family,
+				 const void *nexthop, struct sk_buff *skb,
+				 int *err)
+{
+	unsigned int mtu = dst_mtu(dst);
+
+	if (unlikely(dst_xfrm(dst) ||
+		     lwtunnel_output_redirect(dst->lwtstate) ||
+		     lwtunnel_xmit_redirect(dst->lwtstate)))
+		return false;
+
+	if (skb_is_gso(skb) ? !skb_gso_validate_network_len(skb, mtu) :
+			      skb->len > mtu)
+		return false;
+
+	tmpl = ovpn_udp_tmpl_l2(bind, tmpl, dst->dev, family, nexthop);
+	if (unlikely(!tmpl || !tmpl->hh_len))
+		return false;
+
+	if (unlikely(skb_cow_head(skb, HH_DATA_MOD)))
+		return false;
+
+	memcpy(skb->data - HH_DATA_MOD, tmpl->hh, HH_DATA_MOD);
+	__skb_push(skb, tmpl->hh_len);
+	skb->dev = dst->dev;
+	*err = dev_queue_xmit(skb);
+
+	return true;
+}
+
+/* like udp_tunnel_xmit_skb(), with the fields shared by all the packets to
+ * the peer copied from tmpl. IP length and checksum are set by
+ * ip_local_out(), unless the packet is queued to the lower device right away
+ * on behalf of a binding
+ */
+static void ovpn_udp4_xmit_tmpl(const struct ovpn_hdr_tmpl *tmpl,
+				struct ovpn_bind *bind, struct rtable *rt,
+				struct sock *sk, struct sk_buff *skb, u8 tos,
+				__be16 df, __be16 sport, bool nocheck)
+{
+	int pkt_len = skb->len - skb_inner_network_offset(skb);
+	struct net *net = dev_net(rt->dst.dev);
+	struct net_device *dev = skb->dev;
+	struct iphdr *iph;
+	struct udphdr *uh;
+	__be32 nexthop;
+	int err;
+
+	uh = __skb_push(skb, sizeof(*uh));
+	skb_reset_transport_header(skb);
+	memcpy(uh, &tmpl->v4.uh, sizeof(*uh));
+	uh->source = sport;
+	uh->len = htons(skb->len);
+	udp_set_csum(nocheck, skb, tmpl->v4.iph.saddr, tmpl->v4.iph.daddr,
+		     skb->len);
+
+	skb_scrub_packet(skb, false);
+	skb_clear_hash_if_not_l4(skb);
+	skb_dst_set(skb, &rt->dst);
+	memset(IPCB(skb), 0, sizeof(*IPCB(skb)));
+
+	iph = skb_push(skb, sizeof(*iph));
+	skb_reset_network_header(skb);
+	memcpy(iph, &tmpl->v4.iph, sizeof(*iph));
+	iph->tos = tos;
+	iph->frag_off = ip_mtu_locked(&rt->dst) ? 0 : df;
+	__ip_select_ident(net, iph, skb_shinfo(skb)->gso_segs ?: 1);
+
+	if (bind && rt->rt_type == RTN_UNICAST) {
+		iph->tot_len = htons(skb->len);
+		ip_send_check(iph);
+		skb->protocol = htons(ETH_P_IP);
+		nexthop = rt_nexthop(rt, iph->daddr);
+		if (ovpn_udp_direct_xmit(bind, tmpl, &rt->dst, AF_INET,
+					 &nexthop, skb, &err))
+			goto out;
+	}
+
+	err = ip_local_out(net, sk, skb);
+out:
+	if (unlikely(net_xmit_eval(err)))
+		pkt_len = 0;
+	iptunnel_xmit_stats(dev, pkt_len);
+}
+
+/**
+ * ovpn_udp_flow_dev - get the devices the route of a packet is looked up by
+ * @sk: the socket the packet is sent over
+ * @oif: set to the device the route must leave over, 0 for any
+ * @l3mdev: set to the L3 master device (VRF) to look the route up in
+ *
+ * Like udp_sendmsg(), packets leave over the device the socket is bound to.
+ * When that device is a VRF or one of its ports, the VRF resolved at attach
+ * is passed along, so that l3mdev_update_flow() has nothing left to resolve
+ * for each route lookup. A socket rebound to another device since is left
+ * to the FIB rules.
+ *
+ * Must be called under RCU read lock.
+ */
+static void ovpn_udp_flow_dev(struct sock *sk, int *oif, int *l3mdev)
+{
+	const struct ovpn_socket *sock = rcu_dereference_sk_user_data(sk);
+	int bound = READ_ONCE(sk->sk_bound_dev_if);
+
+	*oif = bound;
+	*l3mdev = 0;
+	if (!bound || unlikely(!sock) || sock->bound_dev_if != bound)
+		return;
+
+	*l3mdev = sock->l3mdev;
+	/* bound to the VRF itself: the lookup is directed to its table, with
+	 * no oif to match, as l3mdev_update_flow() would do
+	 */
+	if (bound == sock->l3mdev)
+		*oif = 0;
+}
+
+/* the outer mark of a peer selects the route of its packets, which then
+ * carry it, so that the uplink classifies them alike
+ */
+static u32 ovpn_udp_mark(const struct ovpn_peer *peer, const struct sock *sk,
+			 struct sk_buff *skb)
+{
+	u32 mark = READ_ONCE(peer->out_mark);
+
+	if (!mark)
+		return READ_ONCE(sk->sk_mark);
 
-drop:
-	if (peer)
-		ovpn_peer_put(peer);
-	dev_core_stats_rx_dropped_inc(ovpn->dev);
-	kfree_skb(skb);
-	return 0;
+	skb->mark = mark;
+	return mark;
+}
+
+/* whether sk is connected to the endpoints of fl, so that the route it
+ * caches can be used. Paths are never sent over connected sockets
+ */
+static bool ovpn_udp4_sk_connected(const struct sock *sk,
+				   const struct flowi4 *fl)
+{
+	const struct inet_sock *inet = inet_sk(sk);
+
+	return READ_ONCE(sk->sk_state) == TCP_ESTABLISHED &&
+	       inet->inet_daddr == fl->daddr &&
+	       inet->inet_dport == fl->fl4_dport &&
+	       inet->inet_saddr == fl->saddr;
 }
 
 /**
  * ovpn_udp4_output - send IPv4 packet over udp socket
  * @ovpn: the openvpn instance
+ * @peer: the destination peer
+ * @path: the path to send the packet over, NULL for the binding of the peer
  * @bind: the binding related to the destination peer
- * @cache: dst cache
  * @sk: the socket to send the packet over
  * @skb: the packet to send
  *
  * Return: 0 on success or a negative error code otherwise
  */
-static int ovpn_udp4_output(struct ovpn_struct *ovpn, struct ovpn_bind *bind,
-			    struct dst_cache *cache, struct sock *sk,
+static int ovpn_udp4_output(struct ovpn_struct *ovpn, struct ovpn_peer *peer,
+			    struct ovpn_path *path, struct ovpn_bind *bind,
+			    struct sock *sk,
 			    struct sk_buff *skb)
 {
+	const struct ovpn_hdr_tmpl *tmpl;
+	struct dst_cache *cache;
 	struct rtable *rt;
+	bool nocheck;
 	struct flowi4 fl = {
 		.saddr = bind->local.ipv4.s_addr,
 		.daddr = bind->sa.in4.sin_addr.s_addr,
 		.fl4_sport = inet_sk(sk)->inet_sport,
 		.fl4_dport = bind->sa.in4.sin_port,
 		.flowi4_proto = sk->sk_protocol,
-		.flowi4_mark = sk->sk_mark,
+		.flowi4_mark = ovpn_udp_mark(peer, sk, skb),
 	};
-	int ret;
+	bool connected;
+	int genid, ret;
 
 	local_bh_disable();
-	rt = dst_cache_get_ip4(cache, &fl.saddr);
-	if (rt)
-		goto transmit;
+	/* connected sockets carry the route towards their peer, looked up
+	 * with their own mark
+	 */
+	connected = !path && !READ_ONCE(peer->out_mark) &&
+		    ovpn_udp4_sk_connected(sk, &fl);
+	if (connected) {
+		rt = dst_rtable(sk_dst_check(sk, 0));
+		if (rt)
+			goto transmit;
+	}
+
+	cache = ovpn_udp_cache_get(peer, path, bind, sock_net(sk));
+	if (cache) {
+		rt = dst_cache_get_ip4(cache, &fl.saddr);
+		if (rt)
+			goto transmit;
+	}
+
+	genid = ovpn_route_genid(sock_net(sk), AF_INET);
+	ovpn_udp_flow_dev(sk, &fl.flowi4_oif, &fl.flowi4_l3mdev);
 
 	if (unlikely(!inet_confirm_addr(sock_net(sk), NULL, 0, fl.saddr,
 					RT_SCOPE_HOST))) {
@@ -147,14 +948,14 @@ static int ovpn_udp4_output(struct ovpn_struct *ovpn, struct ovpn_bind *bind,
 		 */
 		fl.saddr = 0;
 		bind->local.ipv4.s_addr = 0;
-		dst_cache_reset(cache);
+		ovpn_udp_cache_reset(peer, path);
 	}
 
 	rt = ip_route_output_flow(sock_net(sk), &fl, sk);
 	if (IS_ERR(rt) && PTR_ERR(rt) == -EINVAL) {
 		fl.saddr = 0;
 		bind->local.ipv4.s_addr = 0;
-		dst_cache_reset(cache);
+		ovpn_udp_cache_reset(peer, path);
 
 		rt = ip_route_output_flow(sock_net(sk), &fl, sk);
 	}
@@ -165,12 +966,32 @@ static int ovpn_udp4_output(struct ovpn_struct *ovpn, struct ovpn_bind *bind,
 				    ovpn->dev->name, &bind->sa.in4, ret);
 		goto err;
 	}
-	dst_cache_set_ip4(cache, &rt->dst, fl.saddr);
+	cache = path ? &path->dst_cache :
+		       ovpn_route_cache_set4(peer, genid, rt, &fl);
+	if (cache)
+		dst_cache_set_ip4(cache, &rt->dst, fl.saddr);
+	if (connected && fl.saddr == inet_sk(sk)->inet_saddr)
+		sk_dst_set(sk, dst_clone(&rt->dst));
 
 transmit:
-	udp_tunnel_xmit_skb(rt, sk, skb, fl.saddr, fl.daddr, 0,
-			    ip4_dst_hoplimit(&rt->dst), 0, fl.fl4_sport,
-			    fl.fl4_dport, false, sk->sk_no_check_tx);
+	ovpn_udp_pmtu_update(peer, &rt->dst, sizeof(struct iphdr));
+	tmpl = path ? NULL : ovpn_udp4_tmpl_get(bind, &fl,
+						ip4_dst_hoplimit(&rt->dst));
+	nocheck = sk->sk_no_check_tx ||
+		  (ovpn->udp_zero_csum && !skb_is_gso(skb));
+	if (likely(tmpl))
+		ovpn_udp4_xmit_tmpl(tmpl, ovpn->direct_xmit ? bind : NULL, rt,
+				    sk, skb, ovpn_udp_tos(ovpn, skb),
+				    ovpn_skb_cb(skb)->df ? htons(IP_DF) : 0,
+				    ovpn_udp_sport(peer, skb, fl.fl4_sport),
+				    nocheck);
+	else
+		udp_tunnel_xmit_skb(rt, sk, skb, fl.saddr, fl.daddr,
+				    ovpn_udp_tos(ovpn, skb),
+				    ip4_dst_hoplimit(&rt->dst),
+				    ovpn_skb_cb(skb)->df ? htons(IP_DF) : 0,
+				    ovpn_udp_sport(peer, skb, fl.fl4_sport),
+				    fl.fl4_dport, false, nocheck);
 	ret = 0;
 err:
 	local_bh_enable();
@@ -178,22 +999,113 @@ static int ovpn_udp4_output(struct ovpn_struct *ovpn, struct ovpn_bind *bind,
 }
 
 #if IS_ENABLED(CONFIG_IPV6)
+/* IPv6 counterpart of ovpn_udp4_tmpl_get() */
+static const struct ovpn_hdr_tmpl *
+ovpn_udp6_tmpl_get(struct ovpn_bind *bind, const struct flowi6 *fl, u8 hlim)
+{
+	struct ovpn_hdr_tmpl *tmpl = rcu_dereference(bind->tmpl);
+
+	if (likely(tmpl && ipv6_addr_equal(&tmpl->v6.ip6h.saddr, &fl->saddr) &&
+		   ipv6_addr_equal(&tmpl->v6.ip6h.daddr, &fl->daddr) &&
+		   tmpl->v6.ip6h.hop_limit == hlim &&
+		   tmpl->v6.uh.source == fl->fl6_sport &&
+		   tmpl->v6.uh.dest == fl->fl6_dport))
+		return tmpl;
+
+	tmpl = kzalloc(sizeof(*tmpl), GFP_ATOMIC);
+	if (unlikely(!tmpl))
+		return NULL;
+
+	tmpl->v6.ip6h.version = 6;
+	tmpl->v6.ip6h.nexthdr = IPPROTO_UDP;
+	tmpl->v6.ip6h.hop_limit = hlim;
+	tmpl->v6.ip6h.saddr = fl->saddr;
+	tmpl->v6.ip6h.daddr = fl->daddr;
+	tmpl->v6.uh.source = fl->fl6_sport;
+	tmpl->v6.uh.dest = fl->fl6_dport;
+	ovpn_udp_tmpl_set(bind, tmpl);
+
+	return tmpl;
+}
+
+/* IPv6 counterpart of ovpn_udp4_xmit_tmpl(), like udp_tunnel6_xmit_skb() */
+static void ovpn_udp6_xmit_tmpl(const struct ovpn_hdr_tmpl *tmpl,
+				struct ovpn_bind *bind, struct dst_entry *dst,
+				struct sock *sk, struct sk_buff *skb, u8 prio,
+				__be16 sport, bool nocheck)
+{
+	const struct in6_addr *nexthop;
+	struct net_device *dev;
+	struct ipv6hdr *ip6h;
+	struct udphdr *uh;
+	int pkt_len, err;
+
+	uh = __skb_push(skb, sizeof(*uh));
+	skb_reset_transport_header(skb);
+	memcpy(uh, &tmpl->v6.uh, sizeof(*uh));
+	uh->source = sport;
+	uh->len = htons(skb->len);
+
+	skb_dst_set(skb, dst);
+	udp6_set_csum(nocheck, skb, &tmpl->v6.ip6h.saddr, &tmpl->v6.ip6h.daddr,
+		      skb->len);
+
+	ip6h = __skb_push(skb, sizeof(*ip6h));
+	skb_reset_network_header(skb);
+	memcpy(ip6h, &tmpl->v6.ip6h, sizeof(*ip6h));
+	ip6_flow_hdr(ip6h, prio, 0);
+	ip6h->payload_len = uh->len;
+
+	if (bind && !ipv6_addr_is_multicast(&ip6h->daddr) &&
+	    !(dst_rt6_info(dst)->rt6i_flags & RTF_LOCAL)) {
+		memset(skb->cb, 0, sizeof(struct inet6_skb_parm));
+		skb->protocol = htons(ETH_P_IPV6);
+		pkt_len = skb->len - skb_inner_network_offset(skb);
+		dev = skb->dev;
+		nexthop = rt6_nexthop(dst_rt6_info(dst), &ip6h->daddr);
+		if (ovpn_udp_direct_xmit(bind, tmpl, dst, AF_INET6, nexthop,
+					 skb, &err)) {
+			if (unlikely(net_xmit_eval(err)))
+				pkt_len = -1;
+			iptunnel_xmit_stats(dev, pkt_len);
+			return;
+		}
+	}
+
+	ip6tunnel_xmit(sk, skb, skb->dev);
+}
+
+/* IPv6 counterpart of ovpn_udp4_sk_connected() */
+static bool ovpn_udp6_sk_connected(const struct sock *sk,
+				   const struct flowi6 *fl)
+{
+	return READ_ONCE(sk->sk_state) == TCP_ESTABLISHED &&
+	       ipv6_addr_equal(&sk->sk_v6_daddr, &fl->daddr) &&
+	       inet_sk(sk)->inet_dport == fl->fl6_dport &&
+	       ipv6_addr_equal(&sk->sk_v6_rcv_saddr, &fl->saddr);
+}
+
 /**
  * ovpn_udp6_output - send IPv6 packet over udp socket
  * @ovpn: the openvpn instance
+ * @peer: the destination peer
+ * @path: the path to send the packet over, NULL for the binding of the peer
  * @bind: the binding related to the destination peer
- * @cache: dst cache
  * @sk: the socket to send the packet over
  * @skb: the packet to send
  *
  * Return: 0 on success or a negative error code otherwise
  */
-static int ovpn_udp6_output(struct ovpn_struct *ovpn, struct ovpn_bind *bind,
-			    struct dst_cache *cache, struct sock *sk,
+static int ovpn_udp6_output(struct ovpn_struct *ovpn, struct ovpn_peer *peer,
+			    struct ovpn_path *path, struct ovpn_bind *bind,
+			    struct sock *sk,
 			    struct sk_buff *skb)
 {
+	const struct ovpn_hdr_tmpl *tmpl;
+	struct dst_cache *cache;
 	struct dst_entry *dst;
-	int ret;
+	bool connected, nocheck;
+	int genid, ret;
 
 	struct flowi6 fl = {
 		.saddr = bind->local.ipv6,
@@ -201,14 +1113,30 @@ static int ovpn_udp6_output(struct ovpn_struct *ovpn, struct ovpn_bind *bind,
 		.fl6_sport = inet_sk(sk)->inet_sport,
 		.fl6_dport = bind->sa.in6.sin6_port,
 		.flowi6_proto = sk->sk_protocol,
-		.flowi6_mark = sk->sk_mark,
+		.flowi6_mark = ovpn_udp_mark(peer, sk, skb),
 		.flowi6_oif = bind->sa.in6.sin6_scope_id,
 	};
 
 	local_bh_disable();
-	dst = dst_cache_get_ip6(cache, &fl.saddr);
-	if (dst)
-		goto transmit;
+	connected = !path && !READ_ONCE(peer->out_mark) &&
+		    ovpn_udp6_sk_connected(sk, &fl);
+	if (connected) {
+		dst = sk_dst_check(sk, inet6_sk(sk)->dst_cookie);
+		if (dst)
+			goto transmit;
+	}
+
+	cache = ovpn_udp_cache_get(peer, path, bind, sock_net(sk));
+	if (cache) {
+		dst = dst_cache_get_ip6(cache, &fl.saddr);
+		if (dst)
+			goto transmit;
+	}
+
+	genid = ovpn_route_genid(sock_net(sk), AF_INET6);
+	/* link local peers are reached over the device of their scope */
+	if (!fl.flowi6_oif)
+		ovpn_udp_flow_dev(sk, &fl.flowi6_oif, &fl.flowi6_l3mdev);
 
 	if (unlikely(!ipv6_chk_addr(sock_net(sk), &fl.saddr, NULL, 0))) {
 		/* we may end up here when the cached address is not usable
@@ -217,22 +1145,42 @@ static int ovpn_udp6_output(struct ovpn_struct *ovpn, struct ovpn_bind *bind,
 		 */
 		fl.saddr = in6addr_any;
 		bind->local.ipv6 = in6addr_any;
-		dst_cache_reset(cache);
+		ovpn_udp_cache_reset(peer, path);
 	}
 
-	dst = ipv6_stub->ipv6_dst_lookup_flow(sock_net(sk), sk, &fl, NULL);
+	dst = ovpn_route_lookup6(sock_net(sk), sk, &fl);
 	if (IS_ERR(dst)) {
 		ret = PTR_ERR(dst);
 		net_dbg_ratelimited("%s: no route to host %pISpc: %d\n",
 				    ovpn->dev->name, &bind->sa.in6, ret);
 		goto err;
 	}
-	dst_cache_set_ip6(cache, dst, &fl.saddr);
+	cache = path ? &path->dst_cache :
+		       ovpn_route_cache_set6(peer, genid, dst, &fl);
+	if (cache)
+		dst_cache_set_ip6(cache, dst, &fl.saddr);
+	if (connected && ipv6_addr_equal(&fl.saddr, &sk->sk_v6_rcv_saddr))
+		ip6_dst_store(sk, dst_clone(dst), &sk->sk_v6_daddr,
+			      &inet6_sk(sk)->saddr);
 
 transmit:
-	udp_tunnel6_xmit_skb(dst, sk, skb, skb->dev, &fl.saddr, &fl.daddr, 0,
-			     ip6_dst_hoplimit(dst), 0, fl.fl6_sport,
-			     fl.fl6_dport, udp_get_no_check6_tx(sk));
+	ovpn_udp_pmtu_update(peer, dst, sizeof(struct ipv6hdr));
+	tmpl = path ? NULL : ovpn_udp6_tmpl_get(bind, &fl,
+						ip6_dst_hoplimit(dst));
+	/* RFC 6936: zero checksums are agreed upon with the peer */
+	nocheck = udp_get_no_check6_tx(sk) ||
+		  (ovpn->udp6_zero_csum && !skb_is_gso(skb));
+	if (likely(tmpl))
+		ovpn_udp6_xmit_tmpl(tmpl, ovpn->direct_xmit ? bind : NULL, dst,
+				    sk, skb, ovpn_udp_tos(ovpn, skb),
+				    ovpn_udp_sport(peer, skb, fl.fl6_sport),
+				    nocheck);
+	else
+		udp_tunnel6_xmit_skb(dst, sk, skb, skb->dev, &fl.saddr,
+				     &fl.daddr, ovpn_udp_tos(ovpn, skb),
+				     ip6_dst_hoplimit(dst), 0,
+				     ovpn_udp_sport(peer, skb, fl.fl6_sport),
+				     fl.fl6_dport, nocheck);
 	ret = 0;
 err:
 	local_bh_enable();
@@ -243,8 +1191,9 @@ static int ovpn_udp6_output(struct ovpn_struct *ovpn, struct ovpn_bind *bind,
 /**
  * ovpn_udp_output - transmit skb using udp-tunnel
  * @ovpn: the openvpn instance
+ * @peer: the destination peer
+ * @path: the path to send the packet over, NULL for the binding of the peer
  * @bind: the binding related to the destination peer
- * @cache: dst cache
  * @sk: the socket to send the packet over
  * @skb: the packet to send
  *
@@ -253,9 +1202,9 @@ static int ovpn_udp6_output(struct ovpn_struct *ovpn, struct ovpn_bind *bind,
  *
  * Return: 0 on success or a negative error code otherwise
  */
-static int ovpn_udp_output(struct ovpn_struct *ovpn, struct ovpn_bind *bind,
-			   struct dst_cache *cache, struct sock *sk,
-			   struct sk_buff *skb)
+static int ovpn_udp_output(struct ovpn_struct *ovpn, struct ovpn_peer *peer,
+			   struct ovpn_path *path, struct ovpn_bind *bind,
+			   struct sock *sk, struct sk_buff *skb)
 {
 	int ret;
 
@@ -263,16 +1212,18 @@ static int ovpn_udp_output(struct ovpn_struct *ovpn, struct ovpn_bind *bind,
 	if (!skb->destructor)
 		skb->sk = NULL;
 
-	/* always permit openvpn-created packets to be (outside) fragmented */
-	skb->ignore_df = 1;
+	/* permit openvpn-created packets to be (outside) fragmented, unless
+	 * the path MTU is being discovered on behalf of the inner packet
+	 */
+	skb->ignore_df = !ovpn_skb_cb(skb)->df;
 
 	switch (bind->sa.in4.sin_family) {
 	case AF_INET:
-		ret = ovpn_udp4_output(ovpn, bind, cache, sk, skb);
+		ret = ovpn_udp4_output(ovpn, peer, path, bind, sk, skb);
 		break;
 #if IS_ENABLED(CONFIG_IPV6)
 	case AF_INET6:
-		ret = ovpn_udp6_output(ovpn, bind, cache, sk, skb);
+		ret = ovpn_udp6_output(ovpn, peer, path, bind, sk, skb);
 		break;
 #endif
 	default:
@@ -284,50 +1235,366 @@ static int ovpn_udp_output(struct ovpn_struct *ovpn, struct ovpn_bind *bind,
 }
 
 /**
- * ovpn_udp_send_skb - prepare skb and send it over via UDP
- * @ovpn: the openvpn instance
+ * ovpn_udp_tx_charge - account an outgoing packet to the transport socket
  * @peer: the destination peer
+ * @sk: the socket the packet is sent over
  * @skb: the packet to send
+ *
+ * The packet is charged to the send buffer of the socket until the lower
+ * device is done with it, like any packet sent by userspace. Once the
+ * buffer is half full, the netdev TX queue the packet comes from is stopped,
+ * so that packets are held back by the qdisc of the ovpn device rather than
+ * being dropped further down. The queues are woken up by
+ * ovpn_udp_write_space() once the buffer has drained.
+ *
+ * Must be called under RCU read lock.
  */
-void ovpn_udp_send_skb(struct ovpn_struct *ovpn, struct ovpn_peer *peer,
-		       struct sk_buff *skb)
+static void ovpn_udp_tx_charge(struct ovpn_peer *peer, struct sock *sk,
+			       struct sk_buff *skb)
 {
-	struct ovpn_bind *bind;
-	struct socket *sock;
-	int ret = -1;
+	struct ovpn_socket *sock = rcu_dereference_sk_user_data(sk);
+	struct net_device *dev = peer->ovpn->dev;
+	struct netdev_queue *txq;
+
+	/* the inner socket let go of the packet before encryption */
+	skb_set_owner_w(skb, sk);
+
+	/* the queues of the instances sharing the socket are left running */
+	if (likely(sock_writeable(sk)) || unlikely(!sock || !sock->ovpn))
+		return;
+
+	set_bit(OVPN_SOCKET_TX_STOPPED, &sock->flags);
+	txq = netdev_get_tx_queue(dev, skb_get_queue_mapping(skb));
+	netif_tx_stop_queue(txq);
+	ovpn_dev_stats_inc(peer->ovpn, udp_tx_stop);
+
+	/* the buffer may have drained before the bit was set */
+	smp_mb__after_atomic();
+	if (sock_writeable(sk) &&
+	    test_and_clear_bit(OVPN_SOCKET_TX_STOPPED, &sock->flags))
+		netif_tx_wake_all_queues(dev);
+}
+
+/**
+ * ovpn_udp_xmit - prepare skb and send it to a resolved transport endpoint
+ * @ovpn: the openvpn instance
+ * @peer: the destination peer
+ * @bind: the binding of @peer, NULL if it has none
+ * @sk: the socket to send the packet over, NULL if @peer has none
+ * @skb: the encrypted packet to send
+ *
+ * Peers having paths are reached over the path picked for skb, which is
+ * excluded if sending fails.
+ *
+ * Must be called under RCU read lock.
+ */
+static void ovpn_udp_xmit(struct ovpn_struct *ovpn, struct ovpn_peer *peer,
+			  struct ovpn_bind *bind, struct sock *sk,
+			  struct sk_buff *skb)
+{
+	unsigned int len = skb->len, pkts = 1;
+	struct ovpn_path_set *paths;
+	struct ovpn_path *path = NULL;
+
+	trace_ovpn_xmit(skb, peer->id, IPPROTO_UDP);
+	ovpn_latency_tx(peer, skb);
 
 	skb->dev = ovpn->dev;
-	/* no checksum performed at this layer */
-	skb->ip_summed = CHECKSUM_NONE;
+	if (skb_is_gso(skb)) {
+		/* the UDP checksum of each segment is computed when the GSO
+		 * packet is split, like for UDP_SEGMENT sockets
+		 */
+		skb->ip_summed = CHECKSUM_PARTIAL;
+		skb->csum_start = skb->data - skb->head - sizeof(struct udphdr);
+		skb->csum_offset = offsetof(struct udphdr, check);
+		pkts = skb_shinfo(skb)->gso_segs;
+	} else {
+		/* nothing was checksummed yet: the outer UDP checksum is left
+		 * to the lower device by udp_set_csum(), unless disabled
+		 */
+		skb->ip_summed = CHECKSUM_NONE;
+	}
+
+	if (unlikely(!sk || !bind)) {
+		ovpn_peer_tx_drop(peer, skb, OVPN_DROP_NO_TRANSPORT);
+		return;
+	}
+
+	paths = rcu_dereference(peer->paths);
+	if (unlikely(paths)) {
+		path = ovpn_path_select(paths, skb);
+		if (path)
+			bind = &path->bind;
+	}
 
-	/* get socket info */
-	sock = peer->sock->sock;
+	/* crypto layer -> transport (UDP) */
+	ovpn_udp_tx_charge(peer, sk, skb);
+	if (unlikely(ovpn_udp_output(ovpn, peer, path, bind, sk, skb) < 0)) {
+		if (path)
+			ovpn_path_exclude(path);
+		ovpn_peer_tx_drop(peer, skb, OVPN_DROP_TRANSPORT);
+		return;
+	}
+
+	/* skb is consumed by now: use values saved upfront */
+	dev_sw_netstats_tx_add(ovpn->dev, pkts, len);
+	ovpn_dev_stats_hist(ovpn, udp_tx_train, pkts);
+}
+
+/* resolve the binding of peer and the socket to reach it over, warning if
+ * either is missing. Must be called under RCU read lock
+ */
+static struct ovpn_bind *ovpn_udp_endpoint(struct ovpn_peer *peer,
+					   struct sock **sk)
+{
+	struct socket *sock = peer->sock->sock;
+	struct ovpn_bind *bind;
+
+	*sk = NULL;
 	if (unlikely(!sock)) {
 		net_warn_ratelimited("%s: no sock for remote peer\n", __func__);
-		goto out;
+		return NULL;
 	}
 
-	rcu_read_lock();
-	/* get binding */
 	bind = rcu_dereference(peer->bind);
 	if (unlikely(!bind)) {
 		net_warn_ratelimited("%s: no bind for remote peer\n", __func__);
-		goto out_unlock;
+		return NULL;
 	}
 
-	/* crypto layer -> transport (UDP) */
-	ret = ovpn_udp_output(ovpn, bind, &peer->dst_cache, sock->sk, skb);
+	*sk = ovpn_udp_reply_sk(peer, bind, sock->sk);
+	return bind;
+}
+
+/**
+ * ovpn_udp_send_skb - prepare skb and send it over via UDP
+ * @ovpn: the openvpn instance
+ * @peer: the destination peer
+ * @skb: the packet to send
+ */
+void ovpn_udp_send_skb(struct ovpn_struct *ovpn, struct ovpn_peer *peer,
+		       struct sk_buff *skb)
+{
+	struct ovpn_bind *bind;
+	struct sock *sk;
 
-out_unlock:
+	rcu_read_lock();
+	bind = ovpn_udp_endpoint(peer, &sk);
+	ovpn_udp_xmit(ovpn, peer, bind, sk, skb);
 	rcu_read_unlock();
-out:
-	if (unlikely(ret < 0)) {
-		dev_core_stats_tx_dropped_inc(ovpn->dev);
-		kfree_skb(skb);
+}
+
+/* upper bound for the payload of a coalesced packet, so that the IP length
+ * field cannot overflow regardless of the transport family
+ */
+#define OVPN_UDP_GSO_MAX_SIZE	(GSO_LEGACY_MAX_SIZE - 1 - \
+				 sizeof(struct ipv6hdr) - \
+				 sizeof(struct udphdr))
+
+/* a packet paced by the stack cannot leave along with one due at another
+ * time: segments inherit the delivery time of the train
+ */
+static bool ovpn_udp_train_paced(struct sk_buff *head, struct sk_buff *skb)
+{
+	if (ovpn_skb_cb(head)->own_tstamp && ovpn_skb_cb(skb)->own_tstamp)
+		return false;
+
+	return head->tstamp != skb->tstamp;
+}
+
+/**
+ * ovpn_udp_train_next - coalesce the next train of packets in a list
+ * @list: the list of encrypted packets to pick from
+ * @per_flow: true if packets of different flows must not share a train
+ *
+ * Consecutive packets having the same size, DS field, DF flag and departure
+ * time are chained to the frag_list of the first one, which is then turned
+ * into a UDP GSO packet.
+ * The last packet of a train may be shorter than the others. Each chained
+ * packet keeps its own truesize and destructor.
+ *
+ * Return: the next packet to send or NULL if the list is empty
+ */
+static struct sk_buff *ovpn_udp_train_next(struct sk_buff_head *list,
+					   bool per_flow)
+{
+	struct sk_buff *head, *skb, **tail;
+	unsigned int gso_size, segs = 1;
+
+	head = __skb_dequeue(list);
+	if (!head || skb_has_frag_list(head))
+		return head;
+
+	gso_size = head->len;
+	tail = &skb_shinfo(head)->frag_list;
+
+	while ((skb = skb_peek(list))) {
+		if (skb->len > gso_size || skb_has_frag_list(skb) ||
+		    ovpn_skb_cb(skb)->dsfield != ovpn_skb_cb(head)->dsfield ||
+		    ovpn_skb_cb(skb)->df != ovpn_skb_cb(head)->df ||
+		    (per_flow && skb->hash != head->hash) ||
+		    ovpn_udp_train_paced(head, skb) ||
+		    segs == UDP_MAX_SEGMENTS ||
+		    head->len + skb->len > OVPN_UDP_GSO_MAX_SIZE)
+			break;
+
+		__skb_unlink(skb, list);
+		*tail = skb;
+		tail = &skb->next;
+
+		head->len += skb->len;
+		head->data_len += skb->len;
+		segs++;
+
+		/* a shorter packet terminates the train */
+		if (skb->len < gso_size)
+			break;
+	}
+
+	if (segs > 1) {
+		skb_shinfo(head)->gso_size = gso_size;
+		skb_shinfo(head)->gso_type = SKB_GSO_UDP_L4;
+		skb_shinfo(head)->gso_segs = segs;
+	}
+
+	return head;
+}
+
+/**
+ * ovpn_udp_send_skb_list - send a list of encrypted packets via UDP
+ * @ovpn: the openvpn instance
+ * @peer: the destination peer
+ * @list: the packets to send, emptied on return
+ *
+ * Packets are coalesced into UDP GSO packets whenever possible, so that they
+ * traverse the IP/UDP output path only once. Splitting happens either in the
+ * lower device (if it supports USO) or right before it via software GSO.
+ * The binding and the socket of the peer are resolved once for all trains,
+ * while peers having paths are sent every train over the path picked for it.
+ */
+void ovpn_udp_send_skb_list(struct ovpn_struct *ovpn, struct ovpn_peer *peer,
+			    struct sk_buff_head *list)
+{
+	/* trains are sent from the source port of their first packet */
+	bool per_flow = !!READ_ONCE(peer->tx_ports).min;
+	struct ovpn_bind *bind;
+	struct sk_buff *skb;
+	struct sock *sk;
+
+	rcu_read_lock();
+	bind = ovpn_udp_endpoint(peer, &sk);
+	while ((skb = ovpn_udp_train_next(list, per_flow)))
+		ovpn_udp_xmit(ovpn, peer, bind, sk, skb);
+	rcu_read_unlock();
+}
+
+/**
+ * ovpn_udp_tx_batch_alloc - allocate the per-CPU TX batches of an interface
+ * @ovpn: the instance to allocate the batches for
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_udp_tx_batch_alloc(struct ovpn_struct *ovpn)
+{
+	int cpu;
+
+	ovpn->tx_batch = alloc_percpu(struct ovpn_udp_tx_batch);
+	if (!ovpn->tx_batch)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu)
+		__skb_queue_head_init(&per_cpu_ptr(ovpn->tx_batch, cpu)->list);
+
+	return 0;
+}
+
+/**
+ * ovpn_udp_tx_batch_free - release the per-CPU TX batches of an interface
+ * @ovpn: the instance whose batches should be released
+ *
+ * Packets still waiting are dropped.
+ */
+void ovpn_udp_tx_batch_free(struct ovpn_struct *ovpn)
+{
+	struct ovpn_udp_tx_batch *txb;
+	int cpu;
+
+	if (!ovpn->tx_batch)
 		return;
+
+	for_each_possible_cpu(cpu) {
+		txb = per_cpu_ptr(ovpn->tx_batch, cpu);
+		__skb_queue_purge(&txb->list);
+		if (txb->peer)
+			ovpn_peer_put(txb->peer);
+	}
+
+	free_percpu(ovpn->tx_batch);
+	ovpn->tx_batch = NULL;
+}
+
+/**
+ * ovpn_udp_tx_batch_flush - send the TX batch of the current CPU
+ * @ovpn: the instance whose batch should be sent
+ *
+ * Must be called with BHs disabled.
+ */
+void ovpn_udp_tx_batch_flush(struct ovpn_struct *ovpn)
+{
+	struct ovpn_udp_tx_batch *txb = this_cpu_ptr(ovpn->tx_batch);
+	struct ovpn_peer *peer = txb->peer;
+	struct sk_buff_head list;
+
+	if (!peer)
+		return;
+
+	/* the batch is reusable as soon as it is detached */
+	__skb_queue_head_init(&list);
+	skb_queue_splice_init(&txb->list, &list);
+	txb->peer = NULL;
+
+	ovpn_udp_send_skb_list(ovpn, peer, &list);
+	ovpn_peer_put(peer);
+}
+
+/**
+ * ovpn_udp_tx_batch_add - queue encrypted packets to the TX batch of the CPU
+ * @peer: the peer the packets should be sent to
+ * @list: the packets to queue, emptied on return
+ *
+ * Packets encrypted by consecutive ndo_start_xmit() calls are collected as
+ * long as the stack has more packets to pass down, so that those directed
+ * to the same peer share the endpoint resolution and are coalesced into the
+ * same GSO trains. The batch is sent as soon as packets of another peer are
+ * queued or it holds enough packets for a full train.
+ *
+ * Must be called with BHs disabled.
+ */
+void ovpn_udp_tx_batch_add(struct ovpn_peer *peer, struct sk_buff_head *list)
+{
+	struct ovpn_udp_tx_batch *txb = this_cpu_ptr(peer->ovpn->tx_batch);
+
+	if (txb->peer != peer) {
+		ovpn_udp_tx_batch_flush(peer->ovpn);
+		/* released once the batch is sent */
+		kref_get(&peer->refcount);
+		txb->peer = peer;
 	}
 
-	dev_sw_netstats_tx_add(ovpn->dev, 1, skb->len);
+	skb_queue_splice_tail_init(list, &txb->list);
+	if (skb_queue_len(&txb->list) >= UDP_MAX_SEGMENTS)
+		ovpn_udp_tx_batch_flush(peer->ovpn);
+}
+
+/* sockets shared by the instances of a netns can be attached to any of them
+ * created with a shared socket
+ */
+static bool ovpn_udp_sock_joinable(const struct ovpn_socket *ovpn_sock,
+				   const struct ovpn_struct *ovpn)
+{
+	return ovpn->shared_socket &&
+	       test_bit(OVPN_SOCKET_SHARED, &ovpn_sock->flags) &&
+	       net_eq(sock_net(ovpn_sock->sk), dev_net(ovpn->dev));
 }
 
 /**
@@ -342,10 +1609,15 @@ void ovpn_udp_send_skb(struct ovpn_struct *ovpn, struct ovpn_peer *peer,
  */
 int ovpn_udp_socket_attach(struct socket *sock, struct ovpn_struct *ovpn)
 {
+	/* the user data is set to the ovpn_socket by the caller: until then
+	 * the encap handlers find none and drop
+	 */
 	struct udp_tunnel_sock_cfg cfg = {
-		.sk_user_data = ovpn,
+		.sk_user_data = NULL,
 		.encap_type = UDP_ENCAP_OVPNINUDP,
 		.encap_rcv = ovpn_udp_encap_recv,
+		.encap_err_lookup = ovpn_udp_encap_err_lookup,
+		.gro_complete = ovpn_udp_gro_complete,
 	};
 	struct ovpn_socket *old_data;
 	int ret;
@@ -360,9 +1632,20 @@ int ovpn_udp_socket_attach(struct socket *sock, struct ovpn_struct *ovpn)
 	rcu_read_lock();
 	old_data = rcu_dereference_sk_user_data(sock->sk);
 	if (!old_data) {
-		/* socket is currently unused - we can take it */
 		rcu_read_unlock();
+		/* the peers of shared sockets are looked up in their netns */
+		if (ovpn->shared_socket &&
+		    !net_eq(sock_net(sock->sk), dev_net(ovpn->dev))) {
+			netdev_err(ovpn->dev,
+				   "%s: shared socket must be in the netns of the interface\n",
+				   __func__);
+			return -EINVAL;
+		}
+
+		/* socket is currently unused - we can take it */
 		setup_udp_tunnel_sock(sock_net(sock->sk), sock, &cfg);
+		/* packets aggregated by GRO are split in the encap handler */
+		udp_set_bit(ACCEPT_L4, sock->sk);
 		return 0;
 	}
 
@@ -376,7 +1659,7 @@ int ovpn_udp_socket_attach(struct socket *sock, struct ovpn_struct *ovpn)
 	 * hosts and therefore openvpn instantiates one only for all its peers
 	 */
 	if ((READ_ONCE(udp_sk(sock->sk)->encap_type) == UDP_ENCAP_OVPNINUDP) &&
-	    old_data->ovpn == ovpn) {
+	    (old_data->ovpn == ovpn || ovpn_udp_sock_joinable(old_data, ovpn))) {
 		netdev_dbg(ovpn->dev,
 			   "%s: provided socket already owned by this interface\n",
 			   __func__);
@@ -392,6 +1675,62 @@ int ovpn_udp_socket_attach(struct socket *sock, struct ovpn_struct *ovpn)
 	return ret;
 }
 
+static void ovpn_udp_write_space(struct sock *sk)
+{
+	struct ovpn_socket *sock;
+
+	rcu_read_lock();
+	sock = rcu_dereference_sk_user_data(sk);
+	if (unlikely(!sock))
+		goto unlock;
+
+	/* invoked for every packet released by the lower device */
+	if (test_bit(OVPN_SOCKET_TX_STOPPED, &sock->flags) &&
+	    sock_writeable(sk) &&
+	    test_and_clear_bit(OVPN_SOCKET_TX_STOPPED, &sock->flags) &&
+	    netif_running(sock->ovpn->dev))
+		netif_tx_wake_all_queues(sock->ovpn->dev);
+
+	sock->sk_write_space(sk);
+unlock:
+	rcu_read_unlock();
+}
+
+/**
+ * ovpn_udp_socket_set_cb - set the callbacks of an attached UDP socket
+ * @ovpn_sock: the ovpn socket wrapping the UDP socket
+ *
+ * Must be invoked once the socket user data points to @ovpn_sock.
+ */
+void ovpn_udp_socket_set_cb(struct ovpn_socket *ovpn_sock)
+{
+	struct sock *sk = ovpn_sock->sock->sk;
+	int bound;
+
+	/* the VRF of the socket is resolved once rather than by the FIB rules
+	 * of every route lookup, see ovpn_udp_flow_dev()
+	 */
+	bound = READ_ONCE(sk->sk_bound_dev_if);
+	ovpn_sock->bound_dev_if = bound;
+	ovpn_sock->l3mdev = l3mdev_master_ifindex_by_index(sock_net(sk), bound);
+
+	write_lock_bh(&sk->sk_callback_lock);
+	ovpn_sock->sk_write_space = sk->sk_write_space;
+	sk->sk_write_space = ovpn_udp_write_space;
+	/* the peers of the instance may send IPv6 packets with no checksum */
+	if (ovpn_sock->ovpn && ovpn_sock->ovpn->udp6_zero_csum &&
+	    sk->sk_family == AF_INET6 && !udp_get_no_check6_rx(sk)) {
+		udp_set_no_check6_rx(sk, true);
+		set_bit(OVPN_SOCKET_CSUM6_RX, &ovpn_sock->flags);
+	}
+	/* datagrams are aggregated as for UDP_GRO, see ovpn_udp_gro_complete() */
+	if (!udp_test_bit(GRO_ENABLED, sk)) {
+		udp_set_bit(GRO_ENABLED, sk);
+		set_bit(OVPN_SOCKET_GRO, &ovpn_sock->flags);
+	}
+	write_unlock_bh(&sk->sk_callback_lock);
+}
+
 /**
  * ovpn_udp_socket_detach - clean udp-tunnel status for this socket
  * @sock: the socket to clean
@@ -399,6 +1738,109 @@ int ovpn_udp_socket_attach(struct socket *sock, struct ovpn_struct *ovpn)
 void ovpn_udp_socket_detach(struct socket *sock)
 {
 	struct udp_tunnel_sock_cfg cfg = { };
+	struct ovpn_socket *ovpn_sock;
+
+	/* restore what ovpn_udp_socket_set_cb() changed, if anything */
+	write_lock_bh(&sock->sk->sk_callback_lock);
+	if (sock->sk->sk_write_space == ovpn_udp_write_space) {
+		rcu_read_lock();
+		ovpn_sock = rcu_dereference_sk_user_data(sock->sk);
+		sock->sk->sk_write_space = ovpn_sock->sk_write_space;
+		if (test_bit(OVPN_SOCKET_CSUM6_RX, &ovpn_sock->flags))
+			udp_set_no_check6_rx(sock->sk, false);
+		if (test_bit(OVPN_SOCKET_GRO, &ovpn_sock->flags))
+			udp_clear_bit(GRO_ENABLED, sock->sk);
+		rcu_read_unlock();
+	}
+	write_unlock_bh(&sock->sk->sk_callback_lock);
 
 	setup_udp_tunnel_sock(sock_net(sock->sk), sock, &cfg);
+	/* userspace may still want GSO packets if it enabled UDP_GRO */
+	if (!udp_test_bit(GRO_ENABLED, sock->sk))
+		udp_clear_bit(ACCEPT_L4, sock->sk);
+}
+
+/**
+ * ovpn_udp_sock_create - create a kernel UDP socket to connect to a peer
+ * @peer: the UDP peer the socket will be connected to
+ * @sockp: where to store the new socket
+ *
+ * The socket lives in the netns of the socket of @peer and may share its
+ * local port, as long as the latter allows address reuse (SO_REUSEADDR).
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_udp_sock_create(struct ovpn_peer *peer, struct socket **sockp)
+{
+	struct sock *sk = peer->sock->sock->sk;
+	sa_family_t family = AF_UNSPEC;
+	struct ovpn_bind *bind;
+	int ret;
+
+	rcu_read_lock();
+	bind = rcu_dereference(peer->bind);
+	if (bind)
+		family = bind->sa.in4.sin_family;
+	rcu_read_unlock();
+
+	if (family != AF_INET && family != AF_INET6)
+		return -EDESTADDRREQ;
+
+	ret = sock_create_kern(sock_net(sk), family, SOCK_DGRAM, IPPROTO_UDP,
+			       sockp);
+	if (ret < 0)
+		return ret;
+
+	/* packets are routed like those of the socket of the peer */
+	(*sockp)->sk->sk_reuse = SK_CAN_REUSE;
+	(*sockp)->sk->sk_bound_dev_if = READ_ONCE(sk->sk_bound_dev_if);
+	WRITE_ONCE((*sockp)->sk->sk_mark, READ_ONCE(sk->sk_mark));
+
+	return 0;
+}
+
+/**
+ * ovpn_udp_sock_connect - connect a kernel UDP socket to a peer
+ * @peer: the UDP peer to connect the socket to
+ * @sock: the socket created by ovpn_udp_sock_create()
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_udp_sock_connect(struct ovpn_peer *peer, struct socket *sock)
+{
+	__be16 port = inet_sk(peer->sock->sock->sk)->inet_sport;
+	struct ovpn_sockaddr local = {}, remote;
+	struct ovpn_bind *bind;
+	int ret;
+
+	rcu_read_lock();
+	bind = rcu_dereference(peer->bind);
+	if (unlikely(!bind)) {
+		rcu_read_unlock();
+		return -EDESTADDRREQ;
+	}
+
+	remote = bind->sa;
+	switch (remote.in4.sin_family) {
+	case AF_INET:
+		local.in4.sin_family = AF_INET;
+		local.in4.sin_addr = bind->local.ipv4;
+		local.in4.sin_port = port;
+		break;
+	case AF_INET6:
+		local.in6.sin6_family = AF_INET6;
+		local.in6.sin6_addr = bind->local.ipv6;
+		local.in6.sin6_port = port;
+		local.in6.sin6_scope_id = remote.in6.sin6_scope_id;
+		break;
+	}
+	rcu_read_unlock();
+
+	ret = kernel_bind(sock, (struct sockaddr *)&local, sizeof(local));
+	if (ret < 0)
+		return ret;
+
+	return kernel_connect(sock, (struct sockaddr *)&remote, sizeof(remote),
+			      0);
 }
+
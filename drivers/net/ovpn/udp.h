@@ -13,14 +13,35 @@
 #include <net/sock.h>
 
 struct ovpn_peer;
+struct ovpn_socket;
 struct ovpn_struct;
 struct sk_buff;
 struct socket;
 
+/**
+ * struct ovpn_udp_tx_batch - encrypted packets collected across transmissions
+ * @peer: the peer all packets in @list are directed to, referenced by the
+ *	  batch (NULL if empty)
+ * @list: the packets waiting to be sent
+ */
+struct ovpn_udp_tx_batch {
+	struct ovpn_peer *peer;
+	struct sk_buff_head list;
+};
+
 int ovpn_udp_socket_attach(struct socket *sock, struct ovpn_struct *ovpn);
+void ovpn_udp_socket_set_cb(struct ovpn_socket *ovpn_sock);
 void ovpn_udp_socket_detach(struct socket *sock);
+int ovpn_udp_sock_create(struct ovpn_peer *peer, struct socket **sockp);
+int ovpn_udp_sock_connect(struct ovpn_peer *peer, struct socket *sock);
 void ovpn_udp_send_skb(struct ovpn_struct *ovpn, struct ovpn_peer *peer,
 		       struct sk_buff *skb);
+void ovpn_udp_send_skb_list(struct ovpn_struct *ovpn, struct ovpn_peer *peer,
+			    struct sk_buff_head *list);
 struct ovpn_struct *ovpn_from_udp_sock(struct sock *sk);
+int ovpn_udp_tx_batch_alloc(struct ovpn_struct *ovpn);
+void ovpn_udp_tx_batch_free(struct ovpn_struct *ovpn);
+void ovpn_udp_tx_batch_add(struct ovpn_peer *peer, struct sk_buff_head *list);
+void ovpn_udp_tx_batch_flush(struct ovpn_struct *ovpn);
 
 #endif /* _NET_OVPN_UDP_H_ */
@@ -0,0 +1,264 @@
+// SPDX-License-Identifier: GPL-2.0
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include <linux/cpumask.h>
+#include <linux/kthread.h>
+#include <linux/netdevice.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+#include <linux/sched.h>
+#include <linux/skbuff.h>
+
+#include "ovpnstruct.h"
+#include "main.h"
+#include "drop.h"
+#include "io.h"
+#include "peer.h"
+#include "skb.h"
+#include "udp.h"
+#include "worker.h"
+
+/* On threaded interfaces, like with threaded NAPI, packets are not
+ * encrypted in ndo_start_xmit() nor decrypted by the UDP encap callback:
+ * both queue them to a kthread, so that the crypto work of heavy peers is
+ * accounted to a task rather than to the softirq time of the CPU.
+ *
+ * Every CPU has a kthread of its own, named ovpn/<ifname>-<cpu> and affine
+ * to that CPU by default. The threads can be pinned elsewhere, for example
+ * away from housekeeping cores, and be given a realtime priority like any
+ * other task. A CPU always hands its packets to the same thread, which
+ * keeps the order of the flows it sends or receives. Received packets of a
+ * peer with a preferred RX CPU go to the thread of that CPU instead.
+ *
+ * Queues are bounded by OVPN_QUEUE_LEN: under overload packets are dropped
+ * on enqueue. Received packets carry a reference to their peer, which is
+ * passed to ovpn_recv().
+ */
+
+/* packets a thread processes before it may be preempted */
+#define OVPN_WORKER_BATCH	64
+
+/* send the packets encrypted so far and let softirqs and other tasks run */
+static void ovpn_worker_yield(struct ovpn_struct *ovpn)
+{
+	ovpn_udp_tx_batch_flush(ovpn);
+	rcu_read_unlock_bh();
+	cond_resched();
+	rcu_read_lock_bh();
+}
+
+static void ovpn_worker_poll(struct ovpn_worker *worker)
+{
+	struct ovpn_struct *ovpn = worker->ovpn;
+	struct sk_buff_head rx, tx;
+	struct sk_buff *skb;
+	unsigned int n = 0;
+
+	__skb_queue_head_init(&rx);
+	__skb_queue_head_init(&tx);
+
+	spin_lock_bh(&worker->rx_queue.lock);
+	skb_queue_splice_init(&worker->rx_queue, &rx);
+	spin_unlock_bh(&worker->rx_queue.lock);
+
+	spin_lock_bh(&worker->tx_queue.lock);
+	skb_queue_splice_init(&worker->tx_queue, &tx);
+	spin_unlock_bh(&worker->tx_queue.lock);
+
+	/* BHs are disabled like in the contexts the packets come from */
+	rcu_read_lock_bh();
+	while ((skb = __skb_dequeue(&rx))) {
+		ovpn_recv(ovpn_skb_cb(skb)->peer, skb);
+		if (!(++n % OVPN_WORKER_BATCH))
+			ovpn_worker_yield(ovpn);
+	}
+
+	while ((skb = __skb_dequeue(&tx))) {
+		/* encrypted packets join the TX batch of the CPU */
+		ovpn_send(ovpn, skb, NULL, OVPN_TX_XMIT);
+		if (!(++n % OVPN_WORKER_BATCH))
+			ovpn_worker_yield(ovpn);
+	}
+	ovpn_udp_tx_batch_flush(ovpn);
+	rcu_read_unlock_bh();
+}
+
+static int ovpn_worker_fn(void *data)
+{
+	struct ovpn_worker *worker = data;
+
+	while (!kthread_should_stop()) {
+		/* the state is set before checking the queues, so that a
+		 * packet queued in the meantime wakes the thread up
+		 */
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (skb_queue_empty_lockless(&worker->rx_queue) &&
+		    skb_queue_empty_lockless(&worker->tx_queue)) {
+			schedule();
+			continue;
+		}
+		__set_current_state(TASK_RUNNING);
+
+		ovpn_worker_poll(worker);
+		cond_resched();
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return 0;
+}
+
+/* queue skb to worker, return false if the queue is full */
+static bool ovpn_worker_queue(struct ovpn_worker *worker,
+			      struct sk_buff_head *queue, struct sk_buff *skb)
+{
+	bool wake;
+
+	spin_lock(&queue->lock);
+	if (unlikely(skb_queue_len(queue) >= OVPN_QUEUE_LEN)) {
+		spin_unlock(&queue->lock);
+		return false;
+	}
+
+	__skb_queue_tail(queue, skb);
+	/* the thread empties the queue before sleeping: a non-empty queue
+	 * means the thread is already awake
+	 */
+	wake = skb_queue_len(queue) == 1;
+	spin_unlock(&queue->lock);
+
+	if (wake)
+		wake_up_process(worker->task);
+
+	return true;
+}
+
+/**
+ * ovpn_worker_init - create the per-CPU crypto kthreads of an interface
+ * @ovpn: the instance to create the kthreads for
+ *
+ * Must be called once the name of the interface is known.
+ *
+ * Return: 0 on success or a negative error code otherwise
+ */
+int ovpn_worker_init(struct ovpn_struct *ovpn)
+{
+	struct ovpn_worker *worker;
+	int cpu;
+
+	ovpn->workers = alloc_percpu(struct ovpn_worker);
+	if (!ovpn->workers)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		worker = per_cpu_ptr(ovpn->workers, cpu);
+
+		skb_queue_head_init(&worker->rx_queue);
+		skb_queue_head_init(&worker->tx_queue);
+		worker->ovpn = ovpn;
+		worker->task = kthread_create_on_node(ovpn_worker_fn, worker,
+						      cpu_to_node(cpu),
+						      "ovpn/%s-%d",
+						      ovpn->dev->name, cpu);
+		if (IS_ERR(worker->task)) {
+			int ret = PTR_ERR(worker->task);
+
+			worker->task = NULL;
+			ovpn_worker_destroy(ovpn);
+			return ret;
+		}
+
+		/* unlike kthread_bind(), the affinity can be changed later */
+		if (cpu_online(cpu))
+			set_cpus_allowed_ptr(worker->task, cpumask_of(cpu));
+		wake_up_process(worker->task);
+	}
+
+	return 0;
+}
+
+/**
+ * ovpn_worker_destroy - stop the crypto kthreads of an interface
+ * @ovpn: the instance whose kthreads should be stopped
+ *
+ * Packets still waiting are dropped and the references to their peers are
+ * released.
+ */
+void ovpn_worker_destroy(struct ovpn_struct *ovpn)
+{
+	struct ovpn_worker *worker;
+	struct sk_buff *skb;
+	int cpu;
+
+	if (!ovpn->workers)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		worker = per_cpu_ptr(ovpn->workers, cpu);
+		if (!worker->task)
+			continue;
+
+		kthread_stop(worker->task);
+
+		while ((skb = skb_dequeue(&worker->rx_queue))) {
+			ovpn_peer_put(ovpn_skb_cb(skb)->peer);
+			kfree_skb(skb);
+		}
+		skb_queue_purge(&worker->tx_queue);
+	}
+
+	free_percpu(ovpn->workers);
+	ovpn->workers = NULL;
+}
+
+/**
+ * ovpn_worker_recv - queue a received packet for decryption by a kthread
+ * @peer: the peer the packet was received from
+ * @skb: the encrypted packet, holding a reference to @peer
+ *
+ * The packet goes to the kthread of the preferred RX CPU of @peer, if any,
+ * or to the one of the current CPU. Must be called with BHs disabled.
+ *
+ * The packet is consumed (queued or dropped) together with the reference
+ * to @peer.
+ */
+void ovpn_worker_recv(struct ovpn_peer *peer, struct sk_buff *skb)
+{
+	struct ovpn_struct *ovpn = peer->ovpn;
+	int cpu = READ_ONCE(peer->rx_cpu);
+	struct ovpn_worker *worker;
+
+	if (likely(cpu < 0))
+		cpu = smp_processor_id();
+	worker = per_cpu_ptr(ovpn->workers, cpu);
+
+	ovpn_skb_cb(skb)->peer = peer;
+	if (likely(ovpn_worker_queue(worker, &worker->rx_queue, skb)))
+		return;
+
+	ovpn_peer_rx_drop(peer, skb, OVPN_DROP_WORKER_BACKLOG);
+	ovpn_peer_put(peer);
+}
+
+/**
+ * ovpn_worker_xmit - queue a packet of the stack for encryption by a kthread
+ * @ovpn: the instance the packet is sent on
+ * @skb: the packet to send
+ *
+ * Called by ndo_start_xmit(), the packet goes to the kthread of the current
+ * CPU.
+ */
+void ovpn_worker_xmit(struct ovpn_struct *ovpn, struct sk_buff *skb)
+{
+	struct ovpn_worker *worker = this_cpu_ptr(ovpn->workers);
+
+	if (likely(ovpn_worker_queue(worker, &worker->tx_queue, skb)))
+		return;
+
+	skb_tx_error(skb);
+	ovpn_tx_drop(ovpn, skb, OVPN_DROP_WORKER_BACKLOG);
+}
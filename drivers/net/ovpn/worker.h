@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_WORKER_H_
+#define _NET_OVPN_WORKER_H_
+
+#include <linux/sched.h>
+#include <linux/skbuff.h>
+
+struct ovpn_peer;
+struct ovpn_struct;
+
+/**
+ * struct ovpn_worker - per-CPU crypto kthread of a threaded interface
+ * @rx_queue: received packets waiting to be decrypted
+ * @tx_queue: packets of the stack waiting to be encrypted
+ * @ovpn: the instance the worker belongs to
+ * @task: the kthread draining the queues
+ */
+struct ovpn_worker {
+	struct sk_buff_head rx_queue;
+	struct sk_buff_head tx_queue;
+	struct ovpn_struct *ovpn;
+	struct task_struct *task;
+};
+
+int ovpn_worker_init(struct ovpn_struct *ovpn);
+void ovpn_worker_destroy(struct ovpn_struct *ovpn);
+void ovpn_worker_recv(struct ovpn_peer *peer, struct sk_buff *skb);
+void ovpn_worker_xmit(struct ovpn_struct *ovpn, struct sk_buff *skb);
+
+#endif /* _NET_OVPN_WORKER_H_ */
@@ -0,0 +1,266 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel offload
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ovpn
+
+#if !defined(_TRACE_OVPN_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_OVPN_H
+
+#include <linux/in.h>
+#include <linux/skbuff.h>
+#include <linux/tracepoint.h>
+
+TRACE_DEFINE_ENUM(IPPROTO_UDP);
+TRACE_DEFINE_ENUM(IPPROTO_TCP);
+
+/* Packets are identified by their skb address along the steps that keep the
+ * same skb, and by (peer_id, key_id, pktid) across encryption/decryption,
+ * which may move the packet to a new skb. The latency of a crypto request is
+ * the time between its submit and done events.
+ */
+
+DECLARE_EVENT_CLASS(ovpn_skb_class,
+
+	TP_PROTO(const struct sk_buff *skb, u32 peer_id),
+
+	TP_ARGS(skb, peer_id),
+
+	TP_STRUCT__entry(
+		__field(const void *,	skbaddr)
+		__field(u32,		peer_id)
+		__field(unsigned int,	len)
+	),
+
+	TP_fast_assign(
+		__entry->skbaddr = skb;
+		__entry->peer_id = peer_id;
+		__entry->len = skb->len;
+	),
+
+	TP_printk("skbaddr=%p peer_id=%u len=%u",
+		  __entry->skbaddr, __entry->peer_id, __entry->len)
+);
+
+/* a DATA_V2 packet was received over a UDP socket (GRO aggregates are
+ * reported once per segment)
+ */
+DEFINE_EVENT(ovpn_skb_class, ovpn_udp_recv,
+	TP_PROTO(const struct sk_buff *skb, u32 peer_id),
+	TP_ARGS(skb, peer_id)
+);
+
+/* a DATA_V2 packet was extracted from a TCP stream */
+DEFINE_EVENT(ovpn_skb_class, ovpn_tcp_recv,
+	TP_PROTO(const struct sk_buff *skb, u32 peer_id),
+	TP_ARGS(skb, peer_id)
+);
+
+/* a decrypted packet is delivered to the ovpn interface */
+DEFINE_EVENT(ovpn_skb_class, ovpn_netdev_rx,
+	TP_PROTO(const struct sk_buff *skb, u32 peer_id),
+	TP_ARGS(skb, peer_id)
+);
+
+/* an encrypted packet is handed to the transport socket */
+TRACE_EVENT(ovpn_xmit,
+
+	TP_PROTO(const struct sk_buff *skb, u32 peer_id, u8 proto),
+
+	TP_ARGS(skb, peer_id, proto),
+
+	TP_STRUCT__entry(
+		__field(const void *,	skbaddr)
+		__field(u32,		peer_id)
+		__field(unsigned int,	len)
+		__field(u8,		proto)
+	),
+
+	TP_fast_assign(
+		__entry->skbaddr = skb;
+		__entry->peer_id = peer_id;
+		__entry->len = skb->len;
+		__entry->proto = proto;
+	),
+
+	TP_printk("skbaddr=%p peer_id=%u len=%u proto=%s",
+		  __entry->skbaddr, __entry->peer_id, __entry->len,
+		  __print_symbolic(__entry->proto,
+				   { IPPROTO_UDP, "UDP" },
+				   { IPPROTO_TCP, "TCP" }))
+);
+
+/* the key slot used for a packet (or list of packets, on TX) was looked up */
+TRACE_EVENT(ovpn_key_select,
+
+	TP_PROTO(u32 peer_id, u8 key_id, bool tx, bool found),
+
+	TP_ARGS(peer_id, key_id, tx, found),
+
+	TP_STRUCT__entry(
+		__field(u32,	peer_id)
+		__field(u8,	key_id)
+		__field(bool,	tx)
+		__field(bool,	found)
+	),
+
+	TP_fast_assign(
+		__entry->peer_id = peer_id;
+		__entry->key_id = key_id;
+		__entry->tx = tx;
+		__entry->found = found;
+	),
+
+	TP_printk("peer_id=%u key_id=%u dir=%s found=%d", __entry->peer_id,
+		  __entry->key_id, __entry->tx ? "tx" : "rx", __entry->found)
+);
+
+DECLARE_EVENT_CLASS(ovpn_crypto_submit_class,
+
+	TP_PROTO(const struct sk_buff *skb, u32 peer_id, u8 key_id, u64 pktid,
+		 bool async),
+
+	TP_ARGS(skb, peer_id, key_id, pktid, async),
+
+	TP_STRUCT__entry(
+		__field(const void *,	skbaddr)
+		__field(u64,		pktid)
+		__field(u32,		peer_id)
+		__field(unsigned int,	len)
+		__field(u8,		key_id)
+		__field(bool,		async)
+	),
+
+	TP_fast_assign(
+		__entry->skbaddr = skb;
+		__entry->pktid = pktid;
+		__entry->peer_id = peer_id;
+		__entry->len = skb->len;
+		__entry->key_id = key_id;
+		__entry->async = async;
+	),
+
+	TP_printk("skbaddr=%p peer_id=%u key_id=%u pktid=%llu len=%u async=%d",
+		  __entry->skbaddr, __entry->peer_id, __entry->key_id,
+		  __entry->pktid, __entry->len, __entry->async)
+);
+
+/* a packet is handed to the crypto engine, async tells whether the engine
+ * may complete the request asynchronously
+ */
+DEFINE_EVENT(ovpn_crypto_submit_class, ovpn_encrypt_submit,
+	TP_PROTO(const struct sk_buff *skb, u32 peer_id, u8 key_id, u64 pktid,
+		 bool async),
+	TP_ARGS(skb, peer_id, key_id, pktid, async)
+);
+
+DEFINE_EVENT(ovpn_crypto_submit_class, ovpn_decrypt_submit,
+	TP_PROTO(const struct sk_buff *skb, u32 peer_id, u8 key_id, u64 pktid,
+		 bool async),
+	TP_ARGS(skb, peer_id, key_id, pktid, async)
+);
+
+DECLARE_EVENT_CLASS(ovpn_crypto_done_class,
+
+	TP_PROTO(const struct sk_buff *skb, u32 peer_id, u8 key_id, u64 pktid,
+		 bool async, int ret),
+
+	TP_ARGS(skb, peer_id, key_id, pktid, async, ret),
+
+	TP_STRUCT__entry(
+		__field(const void *,	skbaddr)
+		__field(u64,		pktid)
+		__field(u32,		peer_id)
+		__field(unsigned int,	len)
+		__field(int,		ret)
+		__field(u8,		key_id)
+		__field(bool,		async)
+	),
+
+	TP_fast_assign(
+		__entry->skbaddr = skb;
+		__entry->pktid = pktid;
+		__entry->peer_id = peer_id;
+		__entry->len = skb->len;
+		__entry->ret = ret;
+		__entry->key_id = key_id;
+		__entry->async = async;
+	),
+
+	TP_printk("skbaddr=%p peer_id=%u key_id=%u pktid=%llu len=%u async=%d ret=%d",
+		  __entry->skbaddr, __entry->peer_id, __entry->key_id,
+		  __entry->pktid, __entry->len, __entry->async, __entry->ret)
+);
+
+/* the crypto engine is done with a packet, ret is its result */
+DEFINE_EVENT(ovpn_crypto_done_class, ovpn_encrypt_done,
+	TP_PROTO(const struct sk_buff *skb, u32 peer_id, u8 key_id, u64 pktid,
+		 bool async, int ret),
+	TP_ARGS(skb, peer_id, key_id, pktid, async, ret)
+);
+
+DEFINE_EVENT(ovpn_crypto_done_class, ovpn_decrypt_done,
+	TP_PROTO(const struct sk_buff *skb, u32 peer_id, u8 key_id, u64 pktid,
+		 bool async, int ret),
+	TP_ARGS(skb, peer_id, key_id, pktid, async, ret)
+);
+
+/* verdict of the replay protection on an authenticated packet */
+TRACE_EVENT(ovpn_replay_check,
+
+	TP_PROTO(u32 peer_id, u8 key_id, u64 pktid, int ret),
+
+	TP_ARGS(peer_id, key_id, pktid, ret),
+
+	TP_STRUCT__entry(
+		__field(u64,	pktid)
+		__field(u32,	peer_id)
+		__field(int,	ret)
+		__field(u8,	key_id)
+	),
+
+	TP_fast_assign(
+		__entry->pktid = pktid;
+		__entry->peer_id = peer_id;
+		__entry->ret = ret;
+		__entry->key_id = key_id;
+	),
+
+	TP_printk("peer_id=%u key_id=%u pktid=%llu ret=%d", __entry->peer_id,
+		  __entry->key_id, __entry->pktid, __entry->ret)
+);
+
+/* verdict of the reverse path filter on a decrypted packet */
+TRACE_EVENT(ovpn_rpf_check,
+
+	TP_PROTO(const struct sk_buff *skb, u32 peer_id, bool pass),
+
+	TP_ARGS(skb, peer_id, pass),
+
+	TP_STRUCT__entry(
+		__field(const void *,	skbaddr)
+		__field(u32,		peer_id)
+		__field(unsigned int,	len)
+		__field(bool,		pass)
+	),
+
+	TP_fast_assign(
+		__entry->skbaddr = skb;
+		__entry->peer_id = peer_id;
+		__entry->len = skb->len;
+		__entry->pass = pass;
+	),
+
+	TP_printk("skbaddr=%p peer_id=%u len=%u pass=%d", __entry->skbaddr,
+		  __entry->peer_id, __entry->len, __entry->pass)
+);
+
+#endif /* _TRACE_OVPN_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -10,11 +10,15 @@
 #define OVPN_FAMILY_VERSION	1
 
 #define OVPN_NONCE_TAIL_SIZE	8
+#define OVPN_EPOCH_SECRET_SIZE	32
+#define OVPN_LATENCY_BUCKETS	32
+#define OVPN_REORDER_BUCKETS	17
 
 enum ovpn_cipher_alg {
 	OVPN_CIPHER_ALG_NONE,
 	OVPN_CIPHER_ALG_AES_GCM,
 	OVPN_CIPHER_ALG_CHACHA20_POLY1305,
+	OVPN_CIPHER_ALG_AES_CBC_HMAC_SHA256,
 };
 
 enum ovpn_del_peer_reason {
@@ -30,11 +34,63 @@ enum ovpn_key_slot {
 	OVPN_KEY_SLOT_SECONDARY,
 };
 
+enum ovpn_rekey_reason {
+	OVPN_REKEY_REASON_PKTID,
+	OVPN_REKEY_REASON_SOFT_LIMIT,
+	OVPN_REKEY_REASON_HARD_LIMIT,
+};
+
 enum ovpn_mode {
 	OVPN_MODE_P2P,
 	OVPN_MODE_MP,
 };
 
+enum ovpn_comp_stub {
+	OVPN_COMP_STUB_NONE,
+	OVPN_COMP_STUB_LZO,
+	OVPN_COMP_STUB_SWAP,
+	OVPN_COMP_STUB_V2,
+};
+
+enum ovpn_peer_info {
+	OVPN_PEER_INFO_ADDRS = 1,
+	OVPN_PEER_INFO_CONFIG = 2,
+	OVPN_PEER_INFO_KEYS = 4,
+	OVPN_PEER_INFO_VPN_STATS = 8,
+	OVPN_PEER_INFO_LINK_STATS = 16,
+	OVPN_PEER_INFO_ERRORS = 32,
+	OVPN_PEER_INFO_LATENCY = 64,
+	OVPN_PEER_INFO_PROBE = 128,
+	OVPN_PEER_INFO_TCP = 256,
+	OVPN_PEER_INFO_CPU_TIME = 512,
+};
+
+/**
+ * struct ovpn_stats_record - traffic of a peer since the previous record
+ * @peer_id: the peer the record refers to
+ * @vpn_rx_packets: packets received over the tunnel
+ * @vpn_tx_packets: packets sent over the tunnel
+ * @link_rx_packets: packets received over the transport
+ * @link_tx_packets: packets sent over the transport
+ * @pad: reserved
+ * @vpn_rx_bytes: bytes received over the tunnel
+ * @vpn_tx_bytes: bytes sent over the tunnel
+ * @link_rx_bytes: bytes received over the transport
+ * @link_tx_bytes: bytes sent over the transport
+ */
+struct ovpn_stats_record {
+	__u32 peer_id;
+	__u32 vpn_rx_packets;
+	__u32 vpn_tx_packets;
+	__u32 link_rx_packets;
+	__u32 link_tx_packets;
+	__u32 pad;
+	__u64 vpn_rx_bytes;
+	__u64 vpn_tx_bytes;
+	__u64 link_rx_bytes;
+	__u64 link_tx_bytes;
+};
+
 enum {
 	OVPN_A_PEER_ID = 1,
 	OVPN_A_PEER_SOCKADDR_REMOTE,
@@ -55,6 +111,65 @@ enum {
 	OVPN_A_PEER_LINK_TX_BYTES,
 	OVPN_A_PEER_LINK_RX_PACKETS,
 	OVPN_A_PEER_LINK_TX_PACKETS,
+	OVPN_A_PEER_REPLAY_WINDOW,
+	OVPN_A_PEER_STATS_GEN,
+	OVPN_A_PEER_REKEY_THRESHOLD,
+	OVPN_A_PEER_CRYPTO_DRIVER,
+	OVPN_A_PEER_TX_LATENCY,
+	OVPN_A_PEER_RX_LATENCY,
+	OVPN_A_PEER_DECRYPT_ERRORS,
+	OVPN_A_PEER_REPLAY_ERRORS,
+	OVPN_A_PEER_REPLAY_MAX_BACKTRACK,
+	OVPN_A_PEER_RPF_DROPS,
+	OVPN_A_PEER_NO_KEY_DROPS,
+	OVPN_A_PEER_TX_DROPS,
+	OVPN_A_PEER_KEYSTATE,
+	OVPN_A_PEER_IROUTE,
+	OVPN_A_PEER_SCHED_WEIGHT,
+	OVPN_A_PEER_TX_RATE,
+	OVPN_A_PEER_TX_BURST,
+	OVPN_A_PEER_RX_RATE,
+	OVPN_A_PEER_RX_BURST,
+	OVPN_A_PEER_MTU,
+	OVPN_A_PEER_MSS_CLAMP,
+	OVPN_A_PEER_RX_CPU,
+	OVPN_A_PEER_IDLE_TIMEOUT,
+	OVPN_A_PEER_PATH,
+	OVPN_A_PEER_TX_PORT_MIN,
+	OVPN_A_PEER_TX_PORT_MAX,
+	OVPN_A_PEER_RX_PORT_MIN,
+	OVPN_A_PEER_RX_PORT_MAX,
+	OVPN_A_PEER_COMP_STUB,
+	OVPN_A_PEER_CONNECTED_SOCKET,
+	OVPN_A_PEER_DECRYPT_RATE,
+	OVPN_A_PEER_DECRYPT_BURST,
+	OVPN_A_PEER_DECRYPT_BUDGET_DROPS,
+	OVPN_A_PEER_AUTH_FAIL_RATE,
+	OVPN_A_PEER_QUARANTINED,
+	OVPN_A_PEER_KEEPALIVE_INTERVAL_MS,
+	OVPN_A_PEER_KEEPALIVE_TIMEOUT_MS,
+	OVPN_A_PEER_PROBE_INTERVAL,
+	OVPN_A_PEER_PROBE_SRTT,
+	OVPN_A_PEER_PROBE_RTTVAR,
+	OVPN_A_PEER_PROBE_LOSS,
+	OVPN_A_PEER_PROBE_TX,
+	OVPN_A_PEER_PROBE_RX,
+	OVPN_A_PEER_TCP_SRTT,
+	OVPN_A_PEER_TCP_CWND,
+	OVPN_A_PEER_TCP_TOTAL_RETRANS,
+	OVPN_A_PEER_TCP_DELIVERY_RATE,
+	OVPN_A_PEER_TCP_OUT_QUEUE,
+	OVPN_A_PEER_TCP_TX_EAGAIN,
+	OVPN_A_PEER_ENCRYPT_NS,
+	OVPN_A_PEER_DECRYPT_NS,
+	OVPN_A_PEER_MIRROR_IFINDEX,
+	OVPN_A_PEER_MIRROR_SNAPLEN,
+	OVPN_A_PEER_MIRROR_SAMPLE,
+	OVPN_A_PEER_MIRROR_CIPHERTEXT,
+	OVPN_A_PEER_TCP_STRIPE,
+	OVPN_A_PEER_TCP_STREAMS,
+	OVPN_A_PEER_RESET,
+	OVPN_A_PEER_OUT_MARK,
 
 	__OVPN_A_PEER_MAX,
 	OVPN_A_PEER_MAX = (__OVPN_A_PEER_MAX - 1)
@@ -66,24 +181,141 @@ enum {
 	OVPN_A_KEYCONF_CIPHER_ALG,
 	OVPN_A_KEYCONF_ENCRYPT_DIR,
 	OVPN_A_KEYCONF_DECRYPT_DIR,
+	OVPN_A_KEYCONF_PKTID_64,
+	OVPN_A_KEYCONF_ASYNC,
+	OVPN_A_KEYCONF_DATA_V1,
+	OVPN_A_KEYCONF_SOFT_BYTES,
+	OVPN_A_KEYCONF_HARD_BYTES,
+	OVPN_A_KEYCONF_SOFT_PACKETS,
+	OVPN_A_KEYCONF_HARD_PACKETS,
 
 	__OVPN_A_KEYCONF_MAX,
 	OVPN_A_KEYCONF_MAX = (__OVPN_A_KEYCONF_MAX - 1)
 };
 
+enum {
+	OVPN_A_KEYSTATE_SLOT = 1,
+	OVPN_A_KEYSTATE_KEY_ID,
+	OVPN_A_KEYSTATE_REPLAY_WINDOW,
+	OVPN_A_KEYSTATE_RX_PKTID,
+	OVPN_A_KEYSTATE_RX_PKTID_FLOOR,
+	OVPN_A_KEYSTATE_MAX_BACKTRACK,
+	OVPN_A_KEYSTATE_FLOOR_UPDATES,
+	OVPN_A_KEYSTATE_REORDER,
+	OVPN_A_KEYSTATE_TX_PKTID,
+	OVPN_A_KEYSTATE_TX_PKTID_GAP,
+	OVPN_A_KEYSTATE_BYTES,
+	OVPN_A_KEYSTATE_PACKETS,
+
+	__OVPN_A_KEYSTATE_MAX,
+	OVPN_A_KEYSTATE_MAX = (__OVPN_A_KEYSTATE_MAX - 1)
+};
+
 enum {
 	OVPN_A_KEYDIR_CIPHER_KEY = 1,
 	OVPN_A_KEYDIR_NONCE_TAIL,
+	OVPN_A_KEYDIR_EPOCH_SECRET,
+	OVPN_A_KEYDIR_HMAC_KEY,
 
 	__OVPN_A_KEYDIR_MAX,
 	OVPN_A_KEYDIR_MAX = (__OVPN_A_KEYDIR_MAX - 1)
 };
 
+enum {
+	OVPN_A_IROUTE_PEER_ID = 1,
+	OVPN_A_IROUTE_IPV4,
+	OVPN_A_IROUTE_IPV6,
+	OVPN_A_IROUTE_PREFIX_LEN,
+
+	__OVPN_A_IROUTE_MAX,
+	OVPN_A_IROUTE_MAX = (__OVPN_A_IROUTE_MAX - 1)
+};
+
+enum {
+	OVPN_A_PEER_RESULT_ID = 1,
+	OVPN_A_PEER_RESULT_ERROR,
+	OVPN_A_PEER_RESULT_KEY_ID,
+
+	__OVPN_A_PEER_RESULT_MAX,
+	OVPN_A_PEER_RESULT_MAX = (__OVPN_A_PEER_RESULT_MAX - 1)
+};
+
+enum {
+	OVPN_A_MCAST_PEER_ID = 1,
+	OVPN_A_MCAST_IPV4,
+	OVPN_A_MCAST_IPV6,
+
+	__OVPN_A_MCAST_MAX,
+	OVPN_A_MCAST_MAX = (__OVPN_A_MCAST_MAX - 1)
+};
+
+enum {
+	OVPN_A_PATH_SOCKADDR_REMOTE = 1,
+	OVPN_A_PATH_LOCAL_IP,
+	OVPN_A_PATH_WEIGHT,
+	OVPN_A_PATH_EXCLUDED,
+
+	__OVPN_A_PATH_MAX,
+	OVPN_A_PATH_MAX = (__OVPN_A_PATH_MAX - 1)
+};
+
 enum {
 	OVPN_A_IFINDEX = 1,
 	OVPN_A_IFNAME,
 	OVPN_A_MODE,
 	OVPN_A_PEER,
+	OVPN_A_NUM_TX_QUEUES,
+	OVPN_A_NUM_RX_QUEUES,
+	OVPN_A_PEER_TABLE_SIZE,
+	OVPN_A_IROUTE,
+	OVPN_A_PEERS,
+	OVPN_A_PEER_RESULT,
+	OVPN_A_STATS_GEN,
+	OVPN_A_SHARED_DST_CACHE,
+	OVPN_A_PARALLEL_RX,
+	OVPN_A_PARALLEL_TX,
+	OVPN_A_PARALLEL_CPUS,
+	OVPN_A_COMPACT_KEYS,
+	OVPN_A_AES_GCM_DRIVER,
+	OVPN_A_CHACHA20_POLY1305_DRIVER,
+	OVPN_A_LIB_CRYPTO_MAX_LEN,
+	OVPN_A_LATENCY_HIST,
+	OVPN_A_FAIR_QUEUE,
+	OVPN_A_INHERIT_DSFIELD,
+	OVPN_A_PMTU_DISC,
+	OVPN_A_CTRL_NETLINK,
+	OVPN_A_CTRL_PACKET,
+	OVPN_A_STATS_INTERVAL,
+	OVPN_A_STATS_RECORDS,
+	OVPN_A_PEER_INFO,
+	OVPN_A_CLIENT_TO_CLIENT,
+	OVPN_A_MCAST,
+	OVPN_A_THREADED,
+	OVPN_A_COMPACT,
+	OVPN_A_SHARED_SOCKET,
+	OVPN_A_SHARED_NAPI,
+	OVPN_A_IFACE_COUNT,
+	OVPN_A_DIRECT_XMIT,
+	OVPN_A_UDP_ZERO_CSUM,
+	OVPN_A_UDP6_ZERO_CSUM,
+	OVPN_A_CPU_TIME,
+	OVPN_A_TOP_TALKERS,
+	OVPN_A_TOP_N,
+	OVPN_A_TOP_TX,
+	OVPN_A_SAMPLE_RATE,
+	OVPN_A_SAMPLE_KEY_ID,
+	OVPN_A_SAMPLE_TX,
+	OVPN_A_SAMPLE_LEN,
+	OVPN_A_SAMPLE_HEADER,
+	OVPN_A_REKEY_REASON,
+	OVPN_A_REKEY_KEY_ID,
+	OVPN_A_PARALLEL_RX_ADAPTIVE,
+	OVPN_A_LINK_IFINDEX,
+	OVPN_A_LINK_UP,
+	OVPN_A_LINK_PATHS_EXCLUDED,
+	OVPN_A_MEM_BUDGET,
+	OVPN_A_MEM_USED,
+	OVPN_A_MEM_PEAK,
 
 	__OVPN_A_MAX,
 	OVPN_A_MAX = (__OVPN_A_MAX - 1)
@@ -98,11 +330,30 @@ enum {
 	OVPN_CMD_SET_KEY,
 	OVPN_CMD_SWAP_KEYS,
 	OVPN_CMD_DEL_KEY,
+	OVPN_CMD_NEW_IROUTE,
+	OVPN_CMD_DEL_IROUTE,
+	OVPN_CMD_NEW_PEERS,
+	OVPN_CMD_CTRL_PACKET,
+	OVPN_CMD_PEER_STATS,
+	OVPN_CMD_SET_KEYS,
+	OVPN_CMD_SWAP_KEYS_BULK,
+	OVPN_CMD_PEER_FLOAT,
+	OVPN_CMD_NEW_MCAST,
+	OVPN_CMD_DEL_MCAST,
+	OVPN_CMD_SET_KEYSTATE,
+	OVPN_CMD_DEL_IFACES,
+	OVPN_CMD_GET_TOP_PEERS,
+	OVPN_CMD_PACKET_SAMPLE,
+	OVPN_CMD_LINK_CHANGE,
 
 	__OVPN_CMD_MAX,
 	OVPN_CMD_MAX = (__OVPN_CMD_MAX - 1)
 };
 
 #define OVPN_MCGRP_PEERS	"peers"
+#define OVPN_MCGRP_CTRL		"ctrl"
+#define OVPN_MCGRP_STATS	"stats"
+#define OVPN_MCGRP_FLOATS	"floats"
+#define OVPN_MCGRP_SAMPLES	"samples"
 
 #endif /* _UAPI_LINUX_OVPN_H */
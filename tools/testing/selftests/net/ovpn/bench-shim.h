@@ -0,0 +1,181 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*  OpenVPN data channel accelerator
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+/* Minimal userspace implementation of the kernel API used by pktid.c,
+ * pktid.h and proto.h, so that they can be compiled and benchmarked as is.
+ * The benchmark is single threaded: locks are no-ops and there is a single
+ * possible CPU. Atomics are real, so that their cost is measured too.
+ */
+
+#ifndef _OVPN_BENCH_SHIM_H_
+#define _OVPN_BENCH_SHIM_H_
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t s32;
+typedef int64_t s64;
+typedef uint32_t __u32;
+typedef uint64_t __u64;
+typedef uint32_t __be32;
+typedef uint64_t __be64;
+
+#define __force
+#define __percpu
+#define likely(x)	__builtin_expect(!!(x), 1)
+#define unlikely(x)	__builtin_expect(!!(x), 0)
+#define BUILD_BUG_ON(cond) _Static_assert(!(cond), #cond)
+
+#define READ_ONCE(x)	(*(const volatile typeof(x) *)&(x))
+#define WRITE_ONCE(x, val) (*(volatile typeof(x) *)&(x) = (val))
+
+#define BIT(nr)		(1UL << (nr))
+#define BIT_ULL(nr)	(1ULL << (nr))
+#define S64_MAX		INT64_MAX
+
+#define min(a, b)	((a) < (b) ? (a) : (b))
+#define max(a, b)	((a) > (b) ? (a) : (b))
+#define min_t(type, a, b) min((type)(a), (type)(b))
+#define max_t(type, a, b) max((type)(a), (type)(b))
+#define clamp_t(type, val, lo, hi) min_t(type, max_t(type, val, lo), hi)
+
+static inline int fls(unsigned int x)
+{
+	return x ? 32 - __builtin_clz(x) : 0;
+}
+
+static inline unsigned long roundup_pow_of_two(unsigned long n)
+{
+	return n <= 1 ? 1 : 1UL << (64 - __builtin_clzl(n - 1));
+}
+
+static inline u64 div_u64(u64 dividend, u32 divisor)
+{
+	return dividend / divisor;
+}
+
+/* time does not flow within the benchmark */
+#define HZ 1000
+static unsigned long jiffies;
+#define time_after_eq(a, b) ((long)((a) - (b)) >= 0)
+
+typedef struct {
+	s64 counter;
+} atomic64_t;
+
+typedef struct {
+	long counter;
+} atomic_long_t;
+
+static inline s64 atomic64_read(const atomic64_t *v)
+{
+	return __atomic_load_n(&v->counter, __ATOMIC_RELAXED);
+}
+
+static inline void atomic64_set(atomic64_t *v, s64 i)
+{
+	__atomic_store_n(&v->counter, i, __ATOMIC_RELAXED);
+}
+
+static inline bool atomic64_try_cmpxchg(atomic64_t *v, s64 *old, s64 new)
+{
+	return __atomic_compare_exchange_n(&v->counter, old, new, false,
+					   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static inline s64 atomic64_fetch_add_unless(atomic64_t *v, s64 a, s64 u)
+{
+	s64 c = atomic64_read(v);
+
+	do {
+		if (unlikely(c == u))
+			break;
+	} while (!atomic64_try_cmpxchg(v, &c, c + a));
+
+	return c;
+}
+
+static inline void atomic_long_inc(atomic_long_t *v)
+{
+	__atomic_fetch_add(&v->counter, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline bool test_bit(long nr, const unsigned long *addr)
+{
+	return (READ_ONCE(*addr) >> nr) & 1;
+}
+
+static inline bool test_and_set_bit(long nr, unsigned long *addr)
+{
+	return (__atomic_fetch_or(addr, BIT(nr), __ATOMIC_SEQ_CST) >> nr) & 1;
+}
+
+typedef int spinlock_t;
+#define spin_lock_init(lock)	(*(lock) = 0)
+#define spin_lock_bh(lock)	((void)(lock))
+#define spin_unlock_bh(lock)	((void)(lock))
+
+#define GFP_KERNEL 0
+#define kcalloc_node(n, size, gfp, node) calloc(n, size)
+#define kfree(ptr) free(ptr)
+
+#define alloc_percpu(type)	((type *)calloc(1, sizeof(type)))
+#define free_percpu(ptr)	free(ptr)
+#define per_cpu_ptr(ptr, cpu)	((void)(cpu), (ptr))
+#define this_cpu_inc(x)		((x)++)
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < 1; (cpu)++)
+
+static inline u32 get_unaligned_be32(const void *p)
+{
+	u32 v;
+
+	memcpy(&v, p, sizeof(v));
+	return ntohl(v);
+}
+
+static inline u64 get_unaligned_be64(const void *p)
+{
+	u64 v;
+
+	memcpy(&v, p, sizeof(v));
+	return be64toh(v);
+}
+
+static inline void put_unaligned_be64(u64 val, void *p)
+{
+	val = htobe64(val);
+	memcpy(p, &val, sizeof(val));
+}
+
+/* only the head is used by the framing helpers */
+struct sk_buff {
+	unsigned char *data;
+	unsigned int len;
+};
+
+/* packets of the benchmark are linear */
+static inline void *skb_header_pointer(const struct sk_buff *skb, int offset,
+				       int len, void *buffer)
+{
+	if (offset + len > (int)skb->len)
+		return NULL;
+
+	return skb->data + offset;
+}
+
+#endif /* _OVPN_BENCH_SHIM_H_ */
@@ -0,0 +1,156 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0
+# Copyright (C) 2024 OpenVPN, Inc.
+#
+#  Author:	Antonio Quartulli <antonio@openvpn.net>
+#
+# Measure how many reconnections per second an MP interface sustains and how
+# much they disturb the peers that keep sending traffic.
+#
+# peer0 hosts the MP server, FLOWS P2P peers run iperf3 and ping through it.
+# Each phase is measured once on a quiet control plane and twice while
+# ovpn-cli churn reconnects CHURN_PEERS synthetic peers on the server: peer
+# deletion and creation, key installation, key swap and float. The reset
+# phase recycles the peers in place of deleting them. Results are appended
+# as CSV to RESULTS:
+#
+#   phase,metric,value
+
+#set -x
+set -e
+
+OVPN_CLI=${OVPN_CLI:-./ovpn-cli}
+ALG=${ALG:-aes}
+FLOWS=${FLOWS:-2}
+CHURN_PEERS=${CHURN_PEERS:-1024}
+DURATION=${DURATION:-10}
+PINGS=${PINGS:-1000}
+RESULTS=${RESULTS:-churn-results.csv}
+TMP_DIR=$(mktemp -d)
+
+vpn_addr() {
+	echo "5.5.0.$((${1} + 1))"
+}
+
+cleanup() {
+	for p in $(seq 0 ${FLOWS}); do
+		ip netns exec peer${p} ${OVPN_CLI} del_iface tun${p} 2>/dev/null || true
+		ip netns del peer${p} 2>/dev/null || true
+	done
+}
+
+setup_ns() {
+	ip netns add peer${1}
+	ip netns exec peer${1} ${OVPN_CLI} new_iface tun${1} ${2}
+	ip -n peer${1} addr add $(vpn_addr ${1})/16 dev tun${1}
+	ip -n peer${1} link set tun${1} up
+}
+
+setup() {
+	setup_ns 0 MP
+
+	for p in $(seq 1 ${FLOWS}); do
+		setup_ns ${p} P2P
+
+		ip link add veth${p} netns peer0 type veth peer name veth${p} netns peer${p}
+
+		ip -n peer0 addr add 10.10.${p}.1/24 dev veth${p}
+		ip -n peer0 link set veth${p} up
+
+		ip -n peer${p} addr add 10.10.${p}.2/24 dev veth${p}
+		ip -n peer${p} link set veth${p} up
+
+		echo "${p} 10.10.${p}.2 1 $(vpn_addr ${p})"
+	done > ${TMP_DIR}/udp_peers.txt
+
+	ip netns exec peer0 ${OVPN_CLI} new_peers_bulk tun0 1 ${TMP_DIR}/udp_peers.txt \
+		${ALG} 0 data64.key
+
+	for p in $(seq 1 ${FLOWS}); do
+		ip netns exec peer${p} ${OVPN_CLI} new_peer tun${p} 1 ${p} 10.10.${p}.1 1 $(vpn_addr 0)
+		ip netns exec peer${p} ${OVPN_CLI} new_key tun${p} ${p} 1 0 ${ALG} 1 data64.key
+		ip netns exec peer0 ping -qfc 100 -w 5 $(vpn_addr ${p}) >/dev/null
+	done
+}
+
+report() {
+	echo "${PHASE},${1},${2}" | tee -a ${RESULTS}
+}
+
+# reconnect the synthetic peers for the whole duration of a phase, their
+# IDs and addresses do not overlap with the ones of the real peers
+start_churn() {
+	local mode=""
+
+	[ "${PHASE}" == "reset" ] && mode="RESET"
+	ip netns exec peer0 ${OVPN_CLI} churn tun0 2 1000 ${CHURN_PEERS} ${1} \
+		${ALG} 0 data64.key 10.30.0.0 1 5.6.0.0 ${mode} > ${TMP_DIR}/churn.txt &
+	CHURN_PID=$!
+}
+
+report_churn() {
+	wait ${CHURN_PID}
+
+	report reconnects_per_s $(sed -n 's/.*, \([0-9.]*\) reconnects\/s$/\1/p' \
+		${TMP_DIR}/churn.txt)
+	awk -F"[:,] *" '/ ops\/s/ { sub(/^\t/, "", $1); sub(/ ops\/s/, "", $3);
+		print $1 "_ops_per_s", $3 }' ${TMP_DIR}/churn.txt | \
+	while read metric value; do
+		report ${metric} ${value}
+	done
+}
+
+measure_throughput() {
+	local bps
+
+	for p in $(seq 1 ${FLOWS}); do
+		ip netns exec peer0 iperf3 -1 -s -p $((5200 + ${p})) >/dev/null &
+	done
+	sleep 1
+
+	[ "${PHASE}" != "baseline" ] && start_churn ${DURATION}
+	for p in $(seq 1 ${FLOWS}); do
+		ip netns exec peer${p} iperf3 -J -Z -t ${DURATION} -p $((5200 + ${p})) \
+			-c $(vpn_addr 0) > ${TMP_DIR}/iperf${p}.json &
+	done
+	wait $(jobs -p | grep -vx "${CHURN_PID}")
+	[ "${PHASE}" != "baseline" ] && report_churn
+
+	bps=$(cat ${TMP_DIR}/iperf*.json | jq -s 'map(.end.sum_received.bits_per_second) | add')
+	report throughput_bps $(printf "%.0f" ${bps})
+}
+
+measure_latency() {
+	[ "${PHASE}" != "baseline" ] && start_churn $((${PINGS} / 1000 + 1))
+	ip netns exec peer1 ping -c ${PINGS} -i 0.001 $(vpn_addr 0) | \
+		sed -n 's/.*time=\([0-9.]*\) ms/\1/p' | sort -n > ${TMP_DIR}/rtt.txt
+	[ "${PHASE}" != "baseline" ] && wait ${CHURN_PID}
+
+	for pct in 50 99 99.9; do
+		report rtt_p${pct}_ms $(awk -v pct=${pct} '{ rtt[NR] = $1 }
+			END { i = int(NR * pct / 100); if (i < 1) i = 1; print rtt[i] }' \
+			${TMP_DIR}/rtt.txt)
+	done
+}
+
+for tool in iperf3 jq; do
+	if ! command -v ${tool} >/dev/null; then
+		echo "${tool} is required"
+		exit 4
+	fi
+done
+
+trap "cleanup; rm -rf ${TMP_DIR}" EXIT
+
+[ -s ${RESULTS} ] || echo "phase,metric,value" > ${RESULTS}
+
+cleanup
+setup
+
+for PHASE in baseline churn reset; do
+	CHURN_PID=
+	measure_throughput
+	measure_latency
+done
+
+cleanup
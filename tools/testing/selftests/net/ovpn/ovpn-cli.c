@@ -11,10 +11,13 @@
 #include <stdbool.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <net/if.h>
 #include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
 
 #include <linux/ovpn.h>
 #include <linux/types.h>
@@ -27,7 +30,9 @@
 #include <netlink/genl/ctrl.h>
 
 #include <mbedtls/base64.h>
+#include <mbedtls/chachapoly.h>
 #include <mbedtls/error.h>
+#include <mbedtls/gcm.h>
 
 #include <sys/socket.h>
 
@@ -95,12 +100,19 @@ struct ovpn_ctx {
 	char ifname[IFNAMSIZ];
 	enum ovpn_mode mode;
 	bool mode_set;
+	bool parallel_rx;
+	bool parallel_rx_adaptive;
+	__u32 mem_budget;
+	bool reset_peer;
 
 	int socket;
 	int cli_socket;
 
 	__u32 keepalive_interval;
 	__u32 keepalive_timeout;
+	__u32 replay_window;
+	__u32 out_mark;
+	bool out_mark_set;
 
 	enum ovpn_key_direction key_dir;
 	enum ovpn_key_slot key_slot;
@@ -655,6 +667,11 @@ static int ovpn_set_peer(struct ovpn_ctx *ovpn)
 		    ovpn->keepalive_interval);
 	NLA_PUT_U32(ctx->nl_msg, OVPN_A_PEER_KEEPALIVE_TIMEOUT,
 		    ovpn->keepalive_timeout);
+	if (ovpn->replay_window)
+		NLA_PUT_U32(ctx->nl_msg, OVPN_A_PEER_REPLAY_WINDOW,
+			    ovpn->replay_window);
+	if (ovpn->out_mark_set)
+		NLA_PUT_U32(ctx->nl_msg, OVPN_A_PEER_OUT_MARK, ovpn->out_mark);
 	nla_nest_end(ctx->nl_msg, attr);
 
 	ret = ovpn_nl_msg_send(ctx, NULL);
@@ -776,6 +793,10 @@ static int ovpn_handle_peer(struct nl_msg *msg, void *arg)
 		fprintf(stderr, "\tKeepalive timeout: %u sec\n",
 			nla_get_u32(attrs_peer[OVPN_A_PEER_KEEPALIVE_TIMEOUT]));
 
+	if (attrs_peer[OVPN_A_PEER_OUT_MARK])
+		fprintf(stderr, "\tOuter mark: 0x%x\n",
+			nla_get_u32(attrs_peer[OVPN_A_PEER_OUT_MARK]));
+
 	if (attrs_peer[OVPN_A_PEER_VPN_RX_BYTES])
 		fprintf(stderr, "\tVPN RX bytes: %" PRIu64 "\n",
 			nla_get_uint(attrs_peer[OVPN_A_PEER_VPN_RX_BYTES]));
@@ -808,6 +829,21 @@ static int ovpn_handle_peer(struct nl_msg *msg, void *arg)
 		fprintf(stderr, "\tLINK TX packets: %" PRIu64 "\n",
 			nla_get_uint(attrs_peer[OVPN_A_PEER_LINK_TX_PACKETS]));
 
+	if (attrs_peer[OVPN_A_PEER_DECRYPT_ERRORS])
+		fprintf(stderr, "\tdecrypt errors: %" PRIu64 "\n",
+			nla_get_uint(attrs_peer[OVPN_A_PEER_DECRYPT_ERRORS]));
+
+	if (attrs_peer[OVPN_A_PEER_REPLAY_ERRORS])
+		fprintf(stderr, "\treplay errors: %" PRIu64 "\n",
+			nla_get_uint(attrs_peer[OVPN_A_PEER_REPLAY_ERRORS]));
+
+	if (attrs_peer[OVPN_A_PEER_REPLAY_MAX_BACKTRACK]) {
+		void *p = attrs_peer[OVPN_A_PEER_REPLAY_MAX_BACKTRACK];
+
+		fprintf(stderr, "\treplay max backtrack: %u\n",
+			nla_get_u32(p));
+	}
+
 	return NL_SKIP;
 }
 
@@ -836,40 +872,51 @@ static int ovpn_get_peer(struct ovpn_ctx *ovpn)
 	return ret;
 }
 
-static int ovpn_new_key(struct ovpn_ctx *ovpn)
+/* append the attributes of a SET_KEY request to msg */
+static int ovpn_put_key(struct nl_msg *msg, struct ovpn_ctx *ovpn)
 {
 	struct nlattr *peer, *keyconf, *key_dir;
-	struct nl_ctx *ctx;
-	int ret = -1;
 
-	ctx = nl_ctx_alloc(ovpn, OVPN_CMD_SET_KEY);
-	if (!ctx)
-		return -ENOMEM;
+	peer = nla_nest_start(msg, OVPN_A_PEER);
+	NLA_PUT_U32(msg, OVPN_A_PEER_ID, ovpn->peer_id);
 
-	peer = nla_nest_start(ctx->nl_msg, OVPN_A_PEER);
-	NLA_PUT_U32(ctx->nl_msg, OVPN_A_PEER_ID, ovpn->peer_id);
+	keyconf = nla_nest_start(msg, OVPN_A_PEER_KEYCONF);
+	NLA_PUT_U32(msg, OVPN_A_KEYCONF_SLOT, ovpn->key_slot);
+	NLA_PUT_U32(msg, OVPN_A_KEYCONF_KEY_ID, ovpn->key_id);
+	NLA_PUT_U32(msg, OVPN_A_KEYCONF_CIPHER_ALG, ovpn->cipher);
 
-	keyconf = nla_nest_start(ctx->nl_msg, OVPN_A_PEER_KEYCONF);
-	NLA_PUT_U32(ctx->nl_msg, OVPN_A_KEYCONF_SLOT, ovpn->key_slot);
-	NLA_PUT_U32(ctx->nl_msg, OVPN_A_KEYCONF_KEY_ID, ovpn->key_id);
-	NLA_PUT_U32(ctx->nl_msg, OVPN_A_KEYCONF_CIPHER_ALG, ovpn->cipher);
-
-	key_dir = nla_nest_start(ctx->nl_msg, OVPN_A_KEYCONF_ENCRYPT_DIR);
-	NLA_PUT(ctx->nl_msg, OVPN_A_KEYDIR_CIPHER_KEY, KEY_LEN, ovpn->key_enc);
-	NLA_PUT(ctx->nl_msg, OVPN_A_KEYDIR_NONCE_TAIL, NONCE_LEN, ovpn->nonce);
-	nla_nest_end(ctx->nl_msg, key_dir);
+	key_dir = nla_nest_start(msg, OVPN_A_KEYCONF_ENCRYPT_DIR);
+	NLA_PUT(msg, OVPN_A_KEYDIR_CIPHER_KEY, KEY_LEN, ovpn->key_enc);
+	NLA_PUT(msg, OVPN_A_KEYDIR_NONCE_TAIL, NONCE_LEN, ovpn->nonce);
+	nla_nest_end(msg, key_dir);
 
-	key_dir = nla_nest_start(ctx->nl_msg, OVPN_A_KEYCONF_DECRYPT_DIR);
-	NLA_PUT(ctx->nl_msg, OVPN_A_KEYDIR_CIPHER_KEY, KEY_LEN, ovpn->key_dec);
-	NLA_PUT(ctx->nl_msg, OVPN_A_KEYDIR_NONCE_TAIL, NONCE_LEN, ovpn->nonce);
-	nla_nest_end(ctx->nl_msg, key_dir);
+	key_dir = nla_nest_start(msg, OVPN_A_KEYCONF_DECRYPT_DIR);
+	NLA_PUT(msg, OVPN_A_KEYDIR_CIPHER_KEY, KEY_LEN, ovpn->key_dec);
+	NLA_PUT(msg, OVPN_A_KEYDIR_NONCE_TAIL, NONCE_LEN, ovpn->nonce);
+	nla_nest_end(msg, key_dir);
 
-	nla_nest_end(ctx->nl_msg, keyconf);
+	nla_nest_end(msg, keyconf);
 
-	nla_nest_end(ctx->nl_msg, peer);
+	nla_nest_end(msg, peer);
 
-	ret = ovpn_nl_msg_send(ctx, NULL);
+	return 0;
 nla_put_failure:
+	return -EMSGSIZE;
+}
+
+static int ovpn_new_key(struct ovpn_ctx *ovpn)
+{
+	struct nl_ctx *ctx;
+	int ret;
+
+	ctx = nl_ctx_alloc(ovpn, OVPN_CMD_SET_KEY);
+	if (!ctx)
+		return -ENOMEM;
+
+	ret = ovpn_put_key(ctx->nl_msg, ovpn);
+	if (!ret)
+		ret = ovpn_nl_msg_send(ctx, NULL);
+
 	nl_ctx_free(ctx);
 	return ret;
 }
@@ -953,6 +1000,15 @@ static int ovpn_new_iface(struct ovpn_ctx *ovpn)
 	if (ovpn->mode_set)
 		NLA_PUT_U32(ctx->nl_msg, OVPN_A_MODE, ovpn->mode);
 
+	if (ovpn->parallel_rx)
+		NLA_PUT_FLAG(ctx->nl_msg, OVPN_A_PARALLEL_RX);
+
+	if (ovpn->parallel_rx_adaptive)
+		NLA_PUT_FLAG(ctx->nl_msg, OVPN_A_PARALLEL_RX_ADAPTIVE);
+
+	if (ovpn->mem_budget)
+		NLA_PUT_U32(ctx->nl_msg, OVPN_A_MEM_BUDGET, ovpn->mem_budget);
+
 	fprintf(stdout, "Creating interface %s with mode %u\n", ovpn->ifname,
 		ovpn->mode);
 
@@ -1084,6 +1140,19 @@ static int ovpn_handle_msg(struct nl_msg *msg, void *arg)
 		 */
 		fprintf(stdout, "received CMD_DEL_PEER\n");
 		break;
+	case OVPN_CMD_LINK_CHANGE:
+		if (!attrs[OVPN_A_LINK_IFINDEX]) {
+			fprintf(stderr, "no link in LINK_CHANGE message\n");
+			return NL_STOP;
+		}
+
+		fprintf(stdout,
+			"received CMD_LINK_CHANGE, ifname: %s link: %u %s paths excluded: %u\n",
+			ifname, nla_get_u32(attrs[OVPN_A_LINK_IFINDEX]),
+			attrs[OVPN_A_LINK_UP] ? "up" : "down",
+			attrs[OVPN_A_LINK_PATHS_EXCLUDED] ?
+			nla_get_u32(attrs[OVPN_A_LINK_PATHS_EXCLUDED]) : 0);
+		break;
 	default:
 		fprintf(stderr, "received unknown command: %d\n", gnlh->cmd);
 		return NL_STOP;
@@ -1194,7 +1263,7 @@ static void usage(const char *cmd)
 {
 	fprintf(stderr, "Error: invalid arguments.\n\n");
 	fprintf(stderr,
-		"Usage %s <iface> <connect|listen|new_peer|new_multi_peer|set_peer|del_peer|new_key|del_key|recv|send|listen_mcast> [arguments..]\n",
+		"Usage %s <iface> <connect|listen|new_peer|new_multi_peer|new_peers_bulk|gen_peers|gen_data|churn|set_peer|del_peer|new_key|del_key|recv|send|listen_mcast> [arguments..]\n",
 		cmd);
 	fprintf(stderr, "\tiface: tun interface name\n\n");
 
@@ -1229,12 +1298,46 @@ static void usage(const char *cmd)
 	fprintf(stderr, "\t\t<peer-id> <raddr> <rport> <vpnaddr>\n\n");
 
 	fprintf(stderr,
-		"* set_peer <peer-id> <keepalive_interval> <keepalive_timeout>: set peer attributes\n");
+		"* new_peers_bulk <lport> <file> [<cipher> <key_dir> <key_file>]: add the peers listed in the file, as new_multi_peer, in batches\n");
+	fprintf(stderr, "\tlport: local UDP port to bind to\n");
+	fprintf(stderr,
+		"\tcipher, key_dir, key_file: primary key installed on every peer, as with new_key\n\n");
+
+	fprintf(stderr,
+		"* gen_peers <file> <count> [<raddr> <rport> <vpnaddr>]: write a new_multi_peer file with count synthetic peers, no iface is needed\n");
+	fprintf(stderr,
+		"\traddr, vpnaddr: IPv4 base addresses, peer N gets base + N\n");
+	fprintf(stderr, "\trport: remote UDP port of all peers\n\n");
+
+	fprintf(stderr,
+		"* gen_data <file> <peer-id> <key_id> <cipher> <key_dir> <key_file> <count> <size> <laddr> <lport> <raddr> <rport> <vpn-saddr> <vpn-daddr>: write a pcap (raw IPv4) of count DATA_V2 packets with packet IDs 1..count, no iface is needed\n");
+	fprintf(stderr,
+		"\tpeer-id, key_id, cipher, key_dir, key_file: sending peer and key, as with new_key\n");
+	fprintf(stderr,
+		"\tsize: size of the encrypted IPv4/UDP packet from vpn-saddr to vpn-daddr\n");
+	fprintf(stderr,
+		"\tladdr, lport, raddr, rport: outer IPv4/UDP addresses of each packet\n\n");
+
+	fprintf(stderr,
+		"* churn <lport> <peer-id> <count> <seconds> <cipher> <key_dir> <key_file> <raddr> <rport> <vpnaddr> [RESET]: reconnect count peers in a loop and report the rate of each operation\n");
+	fprintf(stderr,
+		"\tpeer-id, count: the peers get IDs peer-id .. peer-id + count - 1\n");
+	fprintf(stderr,
+		"\traddr, vpnaddr: IPv4 base addresses, peer N gets base + N\n");
+	fprintf(stderr,
+		"\tcipher, key_dir, key_file: keys installed on every peer, as with new_key\n\n");
+
+	fprintf(stderr,
+		"* set_peer <peer-id> <keepalive_interval> <keepalive_timeout> [<replay_window> [<out_mark>]]: set peer attributes\n");
 	fprintf(stderr, "\tpeer-id: peer ID of the peer to modify\n");
 	fprintf(stderr,
 		"\tkeepalive_interval: interval for sending ping messages\n");
 	fprintf(stderr,
-		"\tkeepalive_timeout: time after which a peer is timed out\n\n");
+		"\tkeepalive_timeout: time after which a peer is timed out\n");
+	fprintf(stderr,
+		"\treplay_window: size of the replay window of the keys installed next, 0 to leave it unchanged\n");
+	fprintf(stderr,
+		"\tout_mark: firewall mark of the outer packets sent to the peer, 0 for the one of the socket\n\n");
 
 	fprintf(stderr, "* del_peer <peer-id>: delete peer\n");
 	fprintf(stderr, "\tpeer-id: peer ID of the peer to delete\n\n");
@@ -1322,6 +1425,751 @@ static int ovpn_parse_new_peer(struct ovpn_ctx *ovpn, const char *peer_id,
 	return ovpn_parse_remote(ovpn, raddr, rport, vpnip);
 }
 
+/* NEW_PEERS messages carry up to BULK_PEERS peers each and up to
+ * BULK_INFLIGHT of them are sent before waiting for their ACKs
+ */
+#define BULK_PEERS 256
+#define BULK_INFLIGHT 8
+#define BULK_MSG_SIZE (BULK_PEERS * 256)
+
+struct ovpn_bulk {
+	unsigned int inflight;
+	unsigned int failed;
+	int error;
+};
+
+static int ovpn_bulk_cb_error(struct sockaddr_nl *nla, struct nlmsgerr *err,
+			      void *arg)
+{
+	struct ovpn_bulk *bulk = arg;
+	int ret;
+
+	ovpn_nl_cb_error(nla, err, &ret);
+	fprintf(stderr, "cannot add batch of peers: %s (%d)\n",
+		strerror(-ret), ret);
+
+	bulk->error = ret;
+	bulk->inflight--;
+
+	return NL_SKIP;
+}
+
+static int ovpn_bulk_cb_ack(struct nl_msg (*msg)__attribute__((unused)),
+			    void *arg)
+{
+	struct ovpn_bulk *bulk = arg;
+
+	bulk->inflight--;
+	return NL_OK;
+}
+
+/* the reply to NEW_PEERS lists the peers that could not be added */
+static int ovpn_bulk_cb_result(struct nl_msg *msg, void *arg)
+{
+	struct nlattr *res[OVPN_A_PEER_RESULT_MAX + 1];
+	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+	struct ovpn_bulk *bulk = arg;
+	struct nlattr *attr;
+	int rem, err;
+
+	nla_for_each_attr(attr, genlmsg_attrdata(gnlh, 0),
+			  genlmsg_attrlen(gnlh, 0), rem) {
+		if (nla_type(attr) != OVPN_A_PEER_RESULT)
+			continue;
+
+		nla_parse_nested(res, OVPN_A_PEER_RESULT_MAX, attr, NULL);
+		if (!res[OVPN_A_PEER_RESULT_ERROR])
+			continue;
+
+		err = (int)nla_get_u32(res[OVPN_A_PEER_RESULT_ERROR]);
+		fprintf(stderr, "cannot add peer %u: %s (%d)\n",
+			res[OVPN_A_PEER_RESULT_ID] ?
+			nla_get_u32(res[OVPN_A_PEER_RESULT_ID]) : PEER_ID_UNDEF,
+			strerror(-err), err);
+		bulk->failed++;
+	}
+
+	return NL_OK;
+}
+
+static struct nl_msg *ovpn_bulk_msg_alloc(struct nl_ctx *ctx,
+					  struct ovpn_ctx *ovpn)
+{
+	struct nl_msg *msg;
+
+	msg = nlmsg_alloc_size(BULK_MSG_SIZE);
+	if (!msg)
+		return NULL;
+
+	genlmsg_put(msg, 0, 0, ctx->ovpn_dco_id, 0, 0, OVPN_CMD_NEW_PEERS, 0);
+	NLA_PUT_U32(msg, OVPN_A_IFINDEX, ovpn->ifindex);
+
+	return msg;
+nla_put_failure:
+	nlmsg_free(msg);
+	return NULL;
+}
+
+/* append a peer, with its primary key if with_key is set, to a NEW_PEERS
+ * message (type OVPN_A_PEERS) or, without key, to a SET_PEER one (type
+ * OVPN_A_PEER)
+ */
+static int ovpn_bulk_put_peer(struct nl_msg *msg, int type,
+			      struct ovpn_ctx *peer, bool with_key)
+{
+	struct nlattr *attr, *keyconf, *key_dir;
+	size_t alen;
+
+	attr = nla_nest_start(msg, type);
+	NLA_PUT_U32(msg, OVPN_A_PEER_ID, peer->peer_id);
+	NLA_PUT_U32(msg, OVPN_A_PEER_SOCKET, peer->socket);
+
+	switch (peer->remote.in4.sin_family) {
+	case AF_INET:
+		alen = sizeof(struct sockaddr_in);
+		break;
+	case AF_INET6:
+		alen = sizeof(struct sockaddr_in6);
+		break;
+	default:
+		fprintf(stderr, "Invalid family for remote socket address\n");
+		return -1;
+	}
+	NLA_PUT(msg, OVPN_A_PEER_SOCKADDR_REMOTE, alen, &peer->remote);
+
+	switch (peer->peer_ip.in4.sin_family) {
+	case AF_INET:
+		NLA_PUT_U32(msg, OVPN_A_PEER_VPN_IPV4,
+			    peer->peer_ip.in4.sin_addr.s_addr);
+		break;
+	case AF_INET6:
+		NLA_PUT(msg, OVPN_A_PEER_VPN_IPV6, sizeof(struct in6_addr),
+			&peer->peer_ip.in6.sin6_addr);
+		break;
+	default:
+		fprintf(stderr, "Invalid family for peer address\n");
+		return -1;
+	}
+
+	if (peer->reset_peer)
+		NLA_PUT_FLAG(msg, OVPN_A_PEER_RESET);
+
+	if (with_key) {
+		keyconf = nla_nest_start(msg, OVPN_A_PEER_KEYCONF);
+		NLA_PUT_U32(msg, OVPN_A_KEYCONF_SLOT, OVPN_KEY_SLOT_PRIMARY);
+		NLA_PUT_U32(msg, OVPN_A_KEYCONF_KEY_ID, peer->key_id);
+		NLA_PUT_U32(msg, OVPN_A_KEYCONF_CIPHER_ALG, peer->cipher);
+
+		key_dir = nla_nest_start(msg, OVPN_A_KEYCONF_ENCRYPT_DIR);
+		NLA_PUT(msg, OVPN_A_KEYDIR_CIPHER_KEY, KEY_LEN, peer->key_enc);
+		NLA_PUT(msg, OVPN_A_KEYDIR_NONCE_TAIL, NONCE_LEN, peer->nonce);
+		nla_nest_end(msg, key_dir);
+
+		key_dir = nla_nest_start(msg, OVPN_A_KEYCONF_DECRYPT_DIR);
+		NLA_PUT(msg, OVPN_A_KEYDIR_CIPHER_KEY, KEY_LEN, peer->key_dec);
+		NLA_PUT(msg, OVPN_A_KEYDIR_NONCE_TAIL, NONCE_LEN, peer->nonce);
+		nla_nest_end(msg, key_dir);
+
+		nla_nest_end(msg, keyconf);
+	}
+
+	nla_nest_end(msg, attr);
+
+	return 0;
+nla_put_failure:
+	fprintf(stderr, "NEW_PEERS message too small\n");
+	return -1;
+}
+
+/* send the pending NEW_PEERS message without waiting for its ACK, unless too
+ * many messages are already in flight
+ */
+static int ovpn_bulk_flush(struct nl_ctx *ctx, struct ovpn_ctx *ovpn,
+			   struct ovpn_bulk *bulk)
+{
+	int ret;
+
+	ret = nl_send_auto(ctx->nl_sock, ctx->nl_msg);
+	if (ret < 0) {
+		fprintf(stderr, "cannot send netlink message: %s\n",
+			nl_geterror(ret));
+		return ret;
+	}
+	bulk->inflight++;
+
+	nlmsg_free(ctx->nl_msg);
+	ctx->nl_msg = ovpn_bulk_msg_alloc(ctx, ovpn);
+	if (!ctx->nl_msg)
+		return -ENOMEM;
+
+	while (bulk->inflight >= BULK_INFLIGHT)
+		if (ovpn_nl_recvmsgs(ctx) < 0)
+			return -EIO;
+
+	return 0;
+}
+
+/* add the peers listed in fp, in the new_multi_peer format, with as few
+ * netlink round trips as possible. Returns the number of peers that could
+ * not be added or a negative error code
+ */
+static int ovpn_new_peers_bulk(struct ovpn_ctx *ovpn, FILE *fp, bool with_key)
+{
+	char peer_id[10], raddr[128], rport[10], vpnip[100];
+	struct ovpn_bulk bulk = { 0 };
+	unsigned int n = 0;
+	struct nl_ctx *ctx;
+	int ret = 0;
+
+	ctx = nl_ctx_alloc(ovpn, OVPN_CMD_NEW_PEERS);
+	if (!ctx)
+		return -ENOMEM;
+
+	nl_socket_set_buffer_size(ctx->nl_sock, BULK_INFLIGHT * BULK_MSG_SIZE,
+				  BULK_INFLIGHT * BULK_MSG_SIZE);
+	/* replies are matched by counting ACKs, not by sequence number */
+	nl_socket_disable_seq_check(ctx->nl_sock);
+	nl_cb_err(ctx->nl_cb, NL_CB_CUSTOM, ovpn_bulk_cb_error, &bulk);
+	nl_cb_set(ctx->nl_cb, NL_CB_ACK, NL_CB_CUSTOM, ovpn_bulk_cb_ack, &bulk);
+	nl_cb_set(ctx->nl_cb, NL_CB_VALID, NL_CB_CUSTOM, ovpn_bulk_cb_result,
+		  &bulk);
+
+	nlmsg_free(ctx->nl_msg);
+	ctx->nl_msg = ovpn_bulk_msg_alloc(ctx, ovpn);
+	if (!ctx->nl_msg) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	while (fscanf(fp, "%s %s %s %s\n", peer_id, raddr, rport, vpnip) == 4) {
+		struct ovpn_ctx peer_ctx = *ovpn;
+
+		peer_ctx.sa_family = AF_UNSPEC;
+
+		ret = ovpn_parse_new_peer(&peer_ctx, peer_id, raddr, rport,
+					  vpnip);
+		if (ret < 0) {
+			fprintf(stderr, "error while parsing line: %s %s %s %s\n",
+				peer_id, raddr, rport, vpnip);
+			goto wait;
+		}
+
+		ret = ovpn_bulk_put_peer(ctx->nl_msg, OVPN_A_PEERS, &peer_ctx,
+					 with_key);
+		if (ret < 0)
+			goto wait;
+
+		if (++n == BULK_PEERS) {
+			ret = ovpn_bulk_flush(ctx, ovpn, &bulk);
+			if (ret < 0)
+				goto wait;
+			n = 0;
+		}
+	}
+
+	if (n)
+		ret = ovpn_bulk_flush(ctx, ovpn, &bulk);
+
+wait:
+	/* collect the ACKs of the messages that were sent in any case */
+	while (bulk.inflight)
+		if (ovpn_nl_recvmsgs(ctx) < 0)
+			break;
+
+	if (!ret)
+		ret = bulk.error ?: bulk.failed;
+out:
+	nl_ctx_free(ctx);
+	return ret;
+}
+
+/* write count synthetic peers in the new_multi_peer format to file. Peer N
+ * gets ID N, remote address raddr + N and VPN address vpnip + N
+ */
+static int ovpn_gen_peers(const char *file, unsigned int count,
+			  const char *raddr, const char *rport,
+			  const char *vpnip)
+{
+	struct in_addr remote, vpn, addr;
+	char rbuf[INET_ADDRSTRLEN], vbuf[INET_ADDRSTRLEN];
+	unsigned int i;
+	FILE *fp;
+
+	if (inet_pton(AF_INET, raddr, &remote) != 1 ||
+	    inet_pton(AF_INET, vpnip, &vpn) != 1) {
+		fprintf(stderr, "invalid IPv4 base address\n");
+		return -1;
+	}
+
+	if (!count || count >= PEER_ID_UNDEF) {
+		fprintf(stderr, "peer count out of range\n");
+		return -1;
+	}
+
+	fp = fopen(file, "w");
+	if (!fp) {
+		fprintf(stderr, "cannot open file: %s\n", file);
+		return -1;
+	}
+
+	for (i = 1; i <= count; i++) {
+		addr.s_addr = htonl(ntohl(remote.s_addr) + i);
+		inet_ntop(AF_INET, &addr, rbuf, sizeof(rbuf));
+		addr.s_addr = htonl(ntohl(vpn.s_addr) + i);
+		inet_ntop(AF_INET, &addr, vbuf, sizeof(vbuf));
+
+		fprintf(fp, "%u %s %s %s\n", i, rbuf, rport, vbuf);
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+/* control plane churn benchmark: count peers are kept on the interface and
+ * reconnected one after the other for duration seconds. A reconnection
+ * deletes the peer, adds it back, installs its primary and secondary keys,
+ * swaps them and floats the peer to a new remote port. In reset mode the
+ * peer is recycled by adding it back with OVPN_A_PEER_RESET instead of being
+ * deleted. All requests go through a single netlink socket and wait for
+ * their ACK
+ */
+enum ovpn_churn_op {
+	CHURN_DEL_PEER,
+	CHURN_NEW_PEER,
+	CHURN_NEW_KEY,
+	CHURN_SWAP_KEYS,
+	CHURN_FLOAT,
+	CHURN_OPS,
+};
+
+static const struct {
+	const char *name;
+	int cmd;
+} ovpn_churn_ops[CHURN_OPS] = {
+	[CHURN_DEL_PEER] = { "del_peer", OVPN_CMD_DEL_PEER },
+	[CHURN_NEW_PEER] = { "new_peer", OVPN_CMD_SET_PEER },
+	[CHURN_NEW_KEY] = { "new_key", OVPN_CMD_SET_KEY },
+	[CHURN_SWAP_KEYS] = { "swap_keys", OVPN_CMD_SWAP_KEYS },
+	[CHURN_FLOAT] = { "float", OVPN_CMD_SET_PEER },
+};
+
+struct ovpn_churn {
+	unsigned long ops[CHURN_OPS];
+	double usecs[CHURN_OPS];
+};
+
+static double ovpn_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* append the ID of a peer, with its remote endpoint if remote is set */
+static int ovpn_churn_put_peer(struct nl_msg *msg, struct ovpn_ctx *peer,
+			       bool remote)
+{
+	struct nlattr *attr;
+
+	attr = nla_nest_start(msg, OVPN_A_PEER);
+	NLA_PUT_U32(msg, OVPN_A_PEER_ID, peer->peer_id);
+	if (remote)
+		NLA_PUT(msg, OVPN_A_PEER_SOCKADDR_REMOTE,
+			sizeof(peer->remote.in4), &peer->remote.in4);
+	nla_nest_end(msg, attr);
+
+	return 0;
+nla_put_failure:
+	return -EMSGSIZE;
+}
+
+/* send a churn request over ctx and account for the time it took */
+static int ovpn_churn_op(struct nl_ctx *ctx, struct ovpn_ctx *peer,
+			 enum ovpn_churn_op op, struct ovpn_churn *churn)
+{
+	double start;
+	int ret;
+
+	nlmsg_free(ctx->nl_msg);
+	ctx->nl_msg = nlmsg_alloc();
+	if (!ctx->nl_msg)
+		return -ENOMEM;
+
+	genlmsg_put(ctx->nl_msg, 0, 0, ctx->ovpn_dco_id, 0, 0,
+		    ovpn_churn_ops[op].cmd, 0);
+	NLA_PUT_U32(ctx->nl_msg, OVPN_A_IFINDEX, peer->ifindex);
+
+	switch (op) {
+	case CHURN_NEW_PEER:
+		ret = ovpn_bulk_put_peer(ctx->nl_msg, OVPN_A_PEER, peer, false);
+		break;
+	case CHURN_NEW_KEY:
+		ret = ovpn_put_key(ctx->nl_msg, peer);
+		break;
+	case CHURN_FLOAT:
+		ret = ovpn_churn_put_peer(ctx->nl_msg, peer, true);
+		break;
+	default:
+		ret = ovpn_churn_put_peer(ctx->nl_msg, peer, false);
+		break;
+	}
+	if (ret < 0)
+		return ret;
+
+	start = ovpn_now();
+	ret = ovpn_nl_msg_send(ctx, NULL);
+	churn->usecs[op] += (ovpn_now() - start) * 1e6;
+	churn->ops[op]++;
+
+	if (ret < 0)
+		fprintf(stderr, "%s failed for peer %u\n",
+			ovpn_churn_ops[op].name, peer->peer_id);
+
+	return ret;
+nla_put_failure:
+	return -EMSGSIZE;
+}
+
+static int ovpn_churn_reconnect(struct nl_ctx *ctx, struct ovpn_ctx *peer,
+				bool del, struct ovpn_churn *churn)
+{
+	int ret;
+
+	if (del && !peer->reset_peer) {
+		ret = ovpn_churn_op(ctx, peer, CHURN_DEL_PEER, churn);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = ovpn_churn_op(ctx, peer, CHURN_NEW_PEER, churn);
+	if (ret < 0)
+		return ret;
+
+	peer->key_slot = OVPN_KEY_SLOT_PRIMARY;
+	peer->key_id = 0;
+	ret = ovpn_churn_op(ctx, peer, CHURN_NEW_KEY, churn);
+	if (ret < 0)
+		return ret;
+
+	peer->key_slot = OVPN_KEY_SLOT_SECONDARY;
+	peer->key_id = 1;
+	ret = ovpn_churn_op(ctx, peer, CHURN_NEW_KEY, churn);
+	if (ret < 0)
+		return ret;
+
+	ret = ovpn_churn_op(ctx, peer, CHURN_SWAP_KEYS, churn);
+	if (ret < 0)
+		return ret;
+
+	peer->remote.in4.sin_port = htons(ntohs(peer->remote.in4.sin_port) + 1);
+	return ovpn_churn_op(ctx, peer, CHURN_FLOAT, churn);
+}
+
+/* peer N, counting from the peer ID of ovpn, gets remote address and VPN
+ * address of ovpn + N, as with gen_peers
+ */
+static int ovpn_churn(struct ovpn_ctx *ovpn, unsigned int count,
+		      unsigned int duration)
+{
+	struct in_addr remote = ovpn->remote.in4.sin_addr;
+	struct in_addr vpn = ovpn->peer_ip.in4.sin_addr;
+	struct ovpn_churn churn = { 0 };
+	unsigned long rounds = 0;
+	double start, elapsed;
+	struct nl_ctx *ctx;
+	unsigned int i;
+	int ret = 0;
+
+	ctx = nl_ctx_alloc(ovpn, OVPN_CMD_SET_PEER);
+	if (!ctx)
+		return -ENOMEM;
+
+	start = ovpn_now();
+	while (!ret && ovpn_now() - start < duration) {
+		struct ovpn_ctx peer = *ovpn;
+
+		i = rounds % count;
+		peer.peer_id = ovpn->peer_id + i;
+		peer.remote.in4.sin_addr.s_addr = htonl(ntohl(remote.s_addr) +
+							i);
+		peer.peer_ip.in4.sin_addr.s_addr = htonl(ntohl(vpn.s_addr) + i);
+
+		ret = ovpn_churn_reconnect(ctx, &peer, rounds >= count, &churn);
+		if (!ret)
+			rounds++;
+	}
+	elapsed = ovpn_now() - start;
+
+	printf("churn: %lu reconnects of %u peers in %.2f s, %.1f reconnects/s\n",
+	       rounds, count, elapsed, rounds / elapsed);
+	for (i = 0; i < CHURN_OPS; i++) {
+		if (!churn.ops[i])
+			continue;
+
+		printf("\t%s: %lu ops, %.1f ops/s, %.1f us avg\n",
+		       ovpn_churn_ops[i].name, churn.ops[i],
+		       churn.ops[i] / elapsed, churn.usecs[i] / churn.ops[i]);
+	}
+
+	/* leave the interface as it was found */
+	for (i = 0; i < count && i < rounds; i++) {
+		struct ovpn_ctx peer = *ovpn;
+
+		peer.peer_id = ovpn->peer_id + i;
+		ovpn_churn_op(ctx, &peer, CHURN_DEL_PEER, &churn);
+	}
+
+	nl_ctx_free(ctx);
+	return ret;
+}
+
+/* DATA_V2 wire format: opcode/key ID (1B), peer ID (3B), packet ID (4B),
+ * auth tag (16B), encrypted payload
+ */
+#define DATA_V2_OPCODE 9
+#define DATA_V2_OP_LEN 4
+#define DATA_V2_PKTID_LEN 4
+#define DATA_V2_TAG_LEN 16
+#define DATA_V2_HEAD_LEN (DATA_V2_OP_LEN + DATA_V2_PKTID_LEN + DATA_V2_TAG_LEN)
+#define DATA_V2_MAX_PAYLOAD 65000
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_LINKTYPE_RAW 101
+
+struct pcap_file_hdr {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_pkt_hdr {
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+struct ovpn_ring_ctx {
+	mbedtls_gcm_context gcm;
+	mbedtls_chachapoly_context chachapoly;
+	struct in_addr laddr, raddr, vpn_saddr, vpn_daddr;
+	__u16 lport, rport;
+};
+
+static __u16 ovpn_ip_csum(const void *data, size_t len)
+{
+	const __u16 *p = data;
+	__u32 sum = 0;
+
+	for (; len > 1; len -= 2)
+		sum += *p++;
+	if (len)
+		sum += *(const __u8 *)p;
+
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return ~sum;
+}
+
+/* write an IPv4/UDP header for a packet of len bytes in total */
+static void ovpn_put_ip_udp(__u8 *buf, size_t len, struct in_addr saddr,
+			    struct in_addr daddr, __u16 sport, __u16 dport)
+{
+	struct iphdr *iph = (struct iphdr *)buf;
+	struct udphdr *udph = (struct udphdr *)(iph + 1);
+
+	memset(iph, 0, sizeof(*iph) + sizeof(*udph));
+	iph->version = 4;
+	iph->ihl = sizeof(*iph) / 4;
+	iph->ttl = 64;
+	iph->protocol = IPPROTO_UDP;
+	iph->tot_len = htons(len);
+	iph->saddr = saddr.s_addr;
+	iph->daddr = daddr.s_addr;
+	iph->check = ovpn_ip_csum(iph, sizeof(*iph));
+
+	/* no UDP checksum, which is valid over IPv4 */
+	udph->source = htons(sport);
+	udph->dest = htons(dport);
+	udph->len = htons(len - sizeof(*iph));
+}
+
+/* encrypt the plaintext of len bytes into a DATA_V2 packet at out */
+static int ovpn_encrypt_data_v2(struct ovpn_ctx *ovpn,
+				struct ovpn_ring_ctx *ring, __u32 pktid,
+				const __u8 *in, size_t len, __u8 *out)
+{
+	__u32 op = ((DATA_V2_OPCODE << 3 | (ovpn->key_id & 0x07)) << 24) |
+		   (ovpn->peer_id & PEER_ID_UNDEF);
+	__u8 *pid = out + DATA_V2_OP_LEN, *tag = pid + DATA_V2_PKTID_LEN;
+	__u8 iv[DATA_V2_PKTID_LEN + NONCE_LEN];
+
+	op = htonl(op);
+	memcpy(out, &op, sizeof(op));
+	pktid = htonl(pktid);
+	memcpy(pid, &pktid, sizeof(pktid));
+
+	/* the IV is the packet ID followed by the nonce tail */
+	memcpy(iv, pid, DATA_V2_PKTID_LEN);
+	memcpy(iv + DATA_V2_PKTID_LEN, ovpn->nonce, NONCE_LEN);
+
+	switch (ovpn->cipher) {
+	case OVPN_CIPHER_ALG_AES_GCM:
+		return mbedtls_gcm_crypt_and_tag(&ring->gcm, MBEDTLS_GCM_ENCRYPT,
+						 len, iv, sizeof(iv), out,
+						 DATA_V2_OP_LEN +
+						 DATA_V2_PKTID_LEN, in,
+						 out + DATA_V2_HEAD_LEN,
+						 DATA_V2_TAG_LEN, tag);
+	case OVPN_CIPHER_ALG_CHACHA20_POLY1305:
+		return mbedtls_chachapoly_encrypt_and_tag(&ring->chachapoly,
+							  len, iv, out,
+							  DATA_V2_OP_LEN +
+							  DATA_V2_PKTID_LEN,
+							  in,
+							  out + DATA_V2_HEAD_LEN,
+							  tag);
+	default:
+		return -ENOTSUP;
+	}
+}
+
+/* write count DATA_V2 packets with packet IDs 1..count to a pcap file, as
+ * raw IPv4 datagrams from laddr:lport to raddr:rport. Each packet carries an
+ * encrypted IPv4/UDP packet of size bytes from vpn_saddr to vpn_daddr.
+ * Packet IDs are accepted once by the replay protection, therefore the ring
+ * must be large enough to cover a whole benchmark run
+ */
+static int ovpn_gen_data_ring(struct ovpn_ctx *ovpn, struct ovpn_ring_ctx *ring,
+			      const char *file, unsigned int count,
+			      unsigned int size)
+{
+	size_t outer = sizeof(struct iphdr) + sizeof(struct udphdr);
+	size_t len = outer + DATA_V2_HEAD_LEN + size;
+	struct pcap_file_hdr fhdr = {
+		.magic = PCAP_MAGIC,
+		.version_major = 2,
+		.version_minor = 4,
+		.snaplen = len,
+		.linktype = PCAP_LINKTYPE_RAW,
+	};
+	struct pcap_pkt_hdr phdr = {
+		.incl_len = len,
+		.orig_len = len,
+	};
+	__u8 *plain, *pkt;
+	unsigned int i;
+	int ret = -1;
+	FILE *fp;
+
+	if (size < outer || size > DATA_V2_MAX_PAYLOAD) {
+		fprintf(stderr, "packet size out of range\n");
+		return -1;
+	}
+
+	plain = calloc(1, size);
+	pkt = calloc(1, len);
+	if (!plain || !pkt)
+		goto out;
+
+	ovpn_put_ip_udp(plain, size, ring->vpn_saddr, ring->vpn_daddr, 9, 9);
+	ovpn_put_ip_udp(pkt, len, ring->laddr, ring->raddr, ring->lport,
+			ring->rport);
+
+	fp = fopen(file, "w");
+	if (!fp) {
+		fprintf(stderr, "cannot open file: %s\n", file);
+		goto out;
+	}
+
+	if (fwrite(&fhdr, sizeof(fhdr), 1, fp) != 1)
+		goto err_write;
+
+	for (i = 1; i <= count; i++) {
+		ret = ovpn_encrypt_data_v2(ovpn, ring, i, plain, size,
+					   pkt + outer);
+		if (ret) {
+			fprintf(stderr, "cannot encrypt packet: %d\n", ret);
+			goto out_close;
+		}
+
+		if (fwrite(&phdr, sizeof(phdr), 1, fp) != 1 ||
+		    fwrite(pkt, len, 1, fp) != 1)
+			goto err_write;
+	}
+
+	ret = 0;
+	goto out_close;
+err_write:
+	fprintf(stderr, "cannot write to file: %s\n", file);
+	ret = -1;
+out_close:
+	fclose(fp);
+out:
+	free(plain);
+	free(pkt);
+	return ret;
+}
+
+static int ovpn_parse_gen_data(struct ovpn_ctx *ovpn,
+			       struct ovpn_ring_ctx *ring, char *argv[])
+{
+	const char *addrs[] = { argv[10], argv[12], argv[14], argv[15] };
+	struct in_addr *dst[] = { &ring->laddr, &ring->raddr,
+				  &ring->vpn_saddr, &ring->vpn_daddr };
+	unsigned int i;
+	int ret;
+
+	ovpn->peer_id = strtoul(argv[3], NULL, 10);
+	ovpn->key_id = strtoul(argv[4], NULL, 10);
+	if (ovpn->peer_id >= PEER_ID_UNDEF || ovpn->key_id > 7) {
+		fprintf(stderr, "peer ID or key ID out of range\n");
+		return -1;
+	}
+
+	ret = ovpn_read_cipher(argv[5], ovpn);
+	if (ret < 0)
+		return ret;
+
+	ret = ovpn_read_key_direction(argv[6], ovpn);
+	if (ret < 0)
+		return ret;
+
+	ret = ovpn_read_key(argv[7], ovpn);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < sizeof(addrs) / sizeof(addrs[0]); i++) {
+		if (inet_pton(AF_INET, addrs[i], dst[i]) != 1) {
+			fprintf(stderr, "invalid IPv4 address: %s\n", addrs[i]);
+			return -1;
+		}
+	}
+
+	ring->lport = strtoul(argv[11], NULL, 10);
+	ring->rport = strtoul(argv[13], NULL, 10);
+
+	switch (ovpn->cipher) {
+	case OVPN_CIPHER_ALG_AES_GCM:
+		mbedtls_gcm_init(&ring->gcm);
+		return mbedtls_gcm_setkey(&ring->gcm, MBEDTLS_CIPHER_ID_AES,
+					  ovpn->key_enc, KEY_LEN * 8);
+	case OVPN_CIPHER_ALG_CHACHA20_POLY1305:
+		mbedtls_chachapoly_init(&ring->chachapoly);
+		return mbedtls_chachapoly_setkey(&ring->chachapoly,
+						 ovpn->key_enc);
+	default:
+		fprintf(stderr, "cipher not supported for data generation\n");
+		return -1;
+	}
+}
+
 static void ovpn_send_tcp_data(int socket)
 {
 	uint16_t len = htons(1000);
@@ -1384,6 +2232,23 @@ static int ovpn_parse_set_peer(struct ovpn_ctx *ovpn, int argc, char *argv[])
 		return -1;
 	}
 
+	if (argc > 5) {
+		ovpn->replay_window = strtoul(argv[5], NULL, 10);
+		if (errno == ERANGE) {
+			fprintf(stderr, "replay window value out of range\n");
+			return -1;
+		}
+	}
+
+	if (argc > 6) {
+		ovpn->out_mark = strtoul(argv[6], NULL, 0);
+		if (errno == ERANGE) {
+			fprintf(stderr, "outer mark value out of range\n");
+			return -1;
+		}
+		ovpn->out_mark_set = true;
+	}
+
 	return 0;
 }
 
@@ -1407,8 +2272,11 @@ int main(int argc, char *argv[])
 		ovpn.ifname[IFNAMSIZ - 1] = '\0';
 	}
 
-	/* all commands except new_iface expect a valid ifindex */
-	if (strcmp(argv[1], "new_iface")) {
+	/* all commands except new_iface, gen_peers and gen_data expect a valid
+	 * ifindex
+	 */
+	if (strcmp(argv[1], "new_iface") && strcmp(argv[1], "gen_peers") &&
+	    strcmp(argv[1], "gen_data")) {
 		/* in this case a ifname MUST be defined */
 		if (argc < 3) {
 			usage(argv[0]);
@@ -1437,6 +2305,19 @@ int main(int argc, char *argv[])
 			ovpn.mode_set = true;
 		}
 
+		if (argc > 4) {
+			if (!strcmp(argv[4], "PARALLEL_RX")) {
+				ovpn.parallel_rx = true;
+			} else if (!strcmp(argv[4], "PARALLEL_RX_ADAPTIVE")) {
+				ovpn.parallel_rx_adaptive = true;
+			} else if (sscanf(argv[4], "MEM_BUDGET=%u",
+					  &ovpn.mem_budget) != 1) {
+				fprintf(stderr, "Cannot parse iface flag: %s\n",
+					argv[4]);
+				return -1;
+			}
+		}
+
 		ret = ovpn_new_iface(&ovpn);
 		if (ret < 0) {
 			fprintf(stderr, "Cannot create interface %s: %d\n",
@@ -1636,6 +2517,129 @@ int main(int argc, char *argv[])
 				return ret;
 			}
 		}
+	} else if (!strcmp(argv[1], "new_peers_bulk")) {
+		bool with_key = argc > 7;
+		FILE *fp;
+
+		if (argc < 5) {
+			usage(argv[0]);
+			return -1;
+		}
+
+		ovpn.lport = strtoul(argv[3], NULL, 10);
+		if (errno == ERANGE || ovpn.lport > 65535) {
+			fprintf(stderr, "lport value out of range\n");
+			return -1;
+		}
+
+		if (with_key) {
+			ovpn.key_slot = OVPN_KEY_SLOT_PRIMARY;
+			ovpn.key_id = 0;
+
+			ret = ovpn_read_cipher(argv[5], &ovpn);
+			if (ret < 0)
+				return ret;
+
+			ret = ovpn_read_key_direction(argv[6], &ovpn);
+			if (ret < 0)
+				return ret;
+
+			ret = ovpn_read_key(argv[7], &ovpn);
+			if (ret)
+				return ret;
+		}
+
+		fp = fopen(argv[4], "r");
+		if (!fp) {
+			fprintf(stderr, "cannot open file: %s\n", argv[4]);
+			return -1;
+		}
+
+		ret = ovpn_udp_socket(&ovpn, AF_INET6);
+		if (ret < 0)
+			return ret;
+
+		ret = ovpn_new_peers_bulk(&ovpn, fp, with_key);
+		fclose(fp);
+		if (ret) {
+			fprintf(stderr, "cannot add all peers to VPN: %d\n",
+				ret);
+			return -1;
+		}
+	} else if (!strcmp(argv[1], "gen_peers")) {
+		if (argc < 4) {
+			usage(argv[0]);
+			return -1;
+		}
+
+		ret = ovpn_gen_peers(argv[2], strtoul(argv[3], NULL, 10),
+				     argc > 4 ? argv[4] : "10.128.0.0",
+				     argc > 5 ? argv[5] : "1",
+				     argc > 6 ? argv[6] : "5.0.0.0");
+	} else if (!strcmp(argv[1], "churn")) {
+		unsigned int count, duration;
+
+		if (argc < 13) {
+			usage(argv[0]);
+			return -1;
+		}
+
+		ovpn.lport = strtoul(argv[3], NULL, 10);
+		if (errno == ERANGE || ovpn.lport > 65535) {
+			fprintf(stderr, "lport value out of range\n");
+			return -1;
+		}
+
+		ovpn.peer_id = strtoul(argv[4], NULL, 10);
+		count = strtoul(argv[5], NULL, 10);
+		if (!count || ovpn.peer_id + count >= PEER_ID_UNDEF) {
+			fprintf(stderr, "peer range out of range\n");
+			return -1;
+		}
+
+		duration = strtoul(argv[6], NULL, 10);
+
+		ret = ovpn_read_cipher(argv[7], &ovpn);
+		if (ret < 0)
+			return ret;
+
+		ret = ovpn_read_key_direction(argv[8], &ovpn);
+		if (ret < 0)
+			return ret;
+
+		ret = ovpn_read_key(argv[9], &ovpn);
+		if (ret)
+			return ret;
+
+		ret = ovpn_parse_remote(&ovpn, argv[10], argv[11], argv[12]);
+		if (ret < 0 || ovpn.remote.in4.sin_family != AF_INET ||
+		    ovpn.peer_ip.in4.sin_family != AF_INET) {
+			fprintf(stderr, "invalid IPv4 base address\n");
+			return -1;
+		}
+
+		ret = ovpn_udp_socket(&ovpn, AF_INET6);
+		if (ret < 0)
+			return ret;
+
+		ovpn.reset_peer = argc > 13 && !strcmp(argv[13], "RESET");
+		ret = ovpn_churn(&ovpn, count, duration);
+	} else if (!strcmp(argv[1], "gen_data")) {
+		struct ovpn_ring_ctx ring = { 0 };
+
+		if (argc < 16) {
+			usage(argv[0]);
+			return -1;
+		}
+
+		ret = ovpn_parse_gen_data(&ovpn, &ring, argv);
+		if (!ret)
+			ret = ovpn_gen_data_ring(&ovpn, &ring, argv[2],
+						 strtoul(argv[8], NULL, 10),
+						 strtoul(argv[9], NULL, 10));
+
+		mbedtls_gcm_free(&ring.gcm);
+		mbedtls_chachapoly_free(&ring.chachapoly);
 	} else if (!strcmp(argv[1], "set_peer")) {
 		ovpn.peer_id = strtoul(argv[3], NULL, 10);
 		if (errno == ERANGE) {
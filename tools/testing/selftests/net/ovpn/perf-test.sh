@@ -0,0 +1,208 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0
+# Copyright (C) 2024 OpenVPN, Inc.
+#
+#  Author:	Antonio Quartulli <antonio@openvpn.net>
+#
+# Measure throughput, packet rate, CPU cost and latency of the datapath across
+# topologies, transports, ciphers, MTUs and amount of peers.
+#
+# peer0 hosts the server, in P2P mode for the single peer runs and in MP mode
+# otherwise. Only up to FLOWS peers get their own namespace and generate
+# traffic, the other peers are idle entries of the server tables (UDP only,
+# TCP peers must be connected). Results are appended as CSV to RESULTS:
+#
+#   mode,proto,cipher,mtu,peers,flows,metric,value
+
+#set -x
+set -e
+
+OVPN_CLI=${OVPN_CLI:-./ovpn-cli}
+PROTOS=${PROTOS:-"UDP TCP"}
+ALGS=${ALGS:-"aes chachapoly"}
+MTUS=${MTUS:-"1420 8920"}
+PEERS=${PEERS:-"1 16 256 4096"}
+FLOWS=${FLOWS:-4}
+DURATION=${DURATION:-10}
+PINGS=${PINGS:-1000}
+RESULTS=${RESULTS:-perf-results.csv}
+TMP_DIR=$(mktemp -d)
+
+vpn_addr() {
+	echo "5.5.$(((${1} + 1) / 256)).$(((${1} + 1) % 256))"
+}
+
+cleanup() {
+	for ns in $(ip netns list | awk '/^peer[0-9]+/ { print $1 }'); do
+		ip netns exec ${ns} ${OVPN_CLI} del_iface tun${ns#peer} 2>/dev/null || true
+		ip netns del ${ns} 2>/dev/null || true
+	done
+}
+
+setup_ns() {
+	ip netns add peer${1}
+	ip netns exec peer${1} ${OVPN_CLI} new_iface tun${1} ${2}
+	ip -n peer${1} addr add $(vpn_addr ${1})/16 dev tun${1}
+	ip -n peer${1} link set tun${1} mtu ${MTU} up
+}
+
+setup() {
+	setup_ns 0 ${MODE}
+
+	for p in $(seq 1 ${NUM_FLOWS}); do
+		setup_ns ${p} P2P
+
+		ip link add veth${p} netns peer0 mtu $((${MTU} + 100)) type veth \
+			peer name veth${p} netns peer${p} mtu $((${MTU} + 100))
+
+		ip -n peer0 addr add 10.10.${p}.1/24 dev veth${p}
+		ip -n peer0 link set veth${p} up
+
+		ip -n peer${p} addr add 10.10.${p}.2/24 dev veth${p}
+		ip -n peer${p} link set veth${p} up
+	done
+
+	if [ "${PROTO}" == "UDP" ]; then
+		if [ "${MODE}" == "P2P" ]; then
+			ip netns exec peer0 ${OVPN_CLI} new_peer tun0 1 1 10.10.1.2 1 $(vpn_addr 1)
+			ip netns exec peer0 ${OVPN_CLI} new_key tun0 1 1 0 ${ALG} 0 data64.key
+		else
+			for p in $(seq 1 ${NUM_PEERS}); do
+				if [ ${p} -le ${NUM_FLOWS} ]; then
+					echo "${p} 10.10.${p}.2 1 $(vpn_addr ${p})"
+				else
+					echo "${p} 10.20.$((${p} / 256)).$((${p} % 256)) 1 $(vpn_addr ${p})"
+				fi
+			done > ${TMP_DIR}/udp_peers.txt
+			ip netns exec peer0 ${OVPN_CLI} new_peers_bulk tun0 1 ${TMP_DIR}/udp_peers.txt \
+				${ALG} 0 data64.key
+		fi
+
+		for p in $(seq 1 ${NUM_FLOWS}); do
+			ip netns exec peer${p} ${OVPN_CLI} new_peer tun${p} 1 ${p} 10.10.${p}.1 1 $(vpn_addr 0)
+			ip netns exec peer${p} ${OVPN_CLI} new_key tun${p} ${p} 1 0 ${ALG} 1 data64.key
+		done
+	else
+		for p in $(seq 1 ${NUM_FLOWS}); do
+			echo "${p} $(vpn_addr ${p})"
+		done > ${TMP_DIR}/tcp_peers.txt
+
+		(ip netns exec peer0 ${OVPN_CLI} listen tun0 1 ${TMP_DIR}/tcp_peers.txt && {
+			for p in $(seq 1 ${NUM_FLOWS}); do
+				ip netns exec peer0 ${OVPN_CLI} new_key tun0 ${p} 1 0 ${ALG} 0 data64.key
+			done
+		}) &
+		sleep 5
+
+		for p in $(seq 1 ${NUM_FLOWS}); do
+			ip netns exec peer${p} ${OVPN_CLI} connect tun${p} ${p} 10.10.${p}.1 1 $(vpn_addr 0) data64.key
+		done
+		wait
+	fi
+
+	for p in $(seq 1 ${NUM_FLOWS}); do
+		ip netns exec peer0 ping -qfc 100 -w 5 $(vpn_addr ${p}) >/dev/null
+	done
+}
+
+report() {
+	echo "${MODE},${PROTO},${ALG},${MTU},${NUM_PEERS},${NUM_FLOWS},${1},${2}" | tee -a ${RESULTS}
+}
+
+# busy and total jiffies of all CPUs
+cpu_time() {
+	awk '/^cpu / { print $2 + $3 + $4 + $7 + $8 + $9, $2 + $3 + $4 + $5 + $6 + $7 + $8 + $9 }' /proc/stat
+}
+
+# run iperf3 from every flow towards peer0 in parallel, extra arguments are
+# passed to the iperf3 clients
+run_iperf() {
+	for p in $(seq 1 ${NUM_FLOWS}); do
+		ip netns exec peer0 iperf3 -1 -s -p $((5200 + ${p})) >/dev/null &
+	done
+	sleep 1
+
+	read busy0 total0 <<< $(cpu_time)
+	for p in $(seq 1 ${NUM_FLOWS}); do
+		ip netns exec peer${p} iperf3 -J -Z -t ${DURATION} -p $((5200 + ${p})) \
+			-c $(vpn_addr 0) "$@" > ${TMP_DIR}/iperf${p}.json &
+	done
+	wait
+	read busy1 total1 <<< $(cpu_time)
+
+	CPUS_BUSY=$(awk -v b=$((${busy1} - ${busy0})) -v t=$((${total1} - ${total0})) \
+		-v n=$(nproc) 'BEGIN { printf "%.3f", t ? n * b / t : 0 }')
+}
+
+measure_throughput() {
+	local bps
+
+	run_iperf
+	bps=$(cat ${TMP_DIR}/iperf*.json | jq -s 'map(.end.sum_received.bits_per_second) | add')
+
+	report throughput_bps $(printf "%.0f" ${bps})
+	report cpus_busy ${CPUS_BUSY}
+	report cpus_per_gbit $(awk -v c=${CPUS_BUSY} -v b=${bps} \
+		'BEGIN { printf "%.3f", b ? c * 1e9 / b : 0 }')
+}
+
+measure_pps() {
+	local pps
+
+	run_iperf -u -b 0 -l 64
+	pps=$(cat ${TMP_DIR}/iperf*.json | \
+		jq -s 'map((.end.sum.packets - .end.sum.lost_packets) / .end.sum.seconds) | add')
+
+	report pps_64 $(printf "%.0f" ${pps})
+}
+
+measure_latency() {
+	ip netns exec peer1 ping -c ${PINGS} -i 0.001 $(vpn_addr 0) | \
+		sed -n 's/.*time=\([0-9.]*\) ms/\1/p' | sort -n > ${TMP_DIR}/rtt.txt
+
+	for pct in 50 90 99 99.9; do
+		report rtt_p${pct}_ms $(awk -v pct=${pct} '{ rtt[NR] = $1 }
+			END { i = int(NR * pct / 100); if (i < 1) i = 1; print rtt[i] }' \
+			${TMP_DIR}/rtt.txt)
+	done
+}
+
+run() {
+	NUM_FLOWS=$((${NUM_PEERS} < ${FLOWS} ? ${NUM_PEERS} : ${FLOWS}))
+
+	if [ "${PROTO}" == "TCP" ] && [ ${NUM_PEERS} -gt ${NUM_FLOWS} ]; then
+		echo "skipping ${MODE} ${PROTO} with ${NUM_PEERS} peers: idle peers need UDP"
+		return
+	fi
+
+	cleanup
+	setup
+	measure_throughput
+	measure_pps
+	measure_latency
+	cleanup
+}
+
+for tool in iperf3 jq; do
+	if ! command -v ${tool} >/dev/null; then
+		echo "${tool} is required"
+		exit 4
+	fi
+done
+
+trap "cleanup; rm -rf ${TMP_DIR}" EXIT
+
+[ -s ${RESULTS} ] || echo "mode,proto,cipher,mtu,peers,flows,metric,value" > ${RESULTS}
+
+for PROTO in ${PROTOS}; do
+	for ALG in ${ALGS}; do
+		for MTU in ${MTUS}; do
+			for NUM_PEERS in ${PEERS}; do
+				if [ ${NUM_PEERS} -eq 1 ]; then
+					MODE=P2P run
+				fi
+				MODE=MP run
+			done
+		done
+	done
+done
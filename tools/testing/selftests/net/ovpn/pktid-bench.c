@@ -0,0 +1,305 @@
+// SPDX-License-Identifier: GPL-2.0
+/*  OpenVPN data channel accelerator
+ *
+ *  Copyright (C) 2024 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+/* Userspace benchmark of the replay protection and of the packet framing
+ * helpers of the ovpn driver: pktid.c, pktid.h and proto.h are compiled as
+ * they are against bench-shim.h, so that changes to the window algorithm can
+ * be measured without rebuilding and loading the module.
+ *
+ * Each ID sequence is generated before being timed. The accepted and
+ * rejected counts are reported along with the timings, so that a change in
+ * behaviour shows up as well.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "bench-shim.h"
+#include "../../../../../include/uapi/linux/ovpn.h"
+
+/* the headers below are not needed by the code under test */
+#define _NET_OVPN_OVPNSTRUCT_H_
+#define _NET_OVPN_MAIN_H_
+
+#include "../../../../../drivers/net/ovpn/pktid.c"
+#include "../../../../../drivers/net/ovpn/proto.h"
+
+#define BENCH_IDS_DEFAULT	(1 << 22)
+/* IDs of the reordered sequence are shuffled within blocks of this size */
+#define BENCH_REORDER_SPAN	16
+
+struct bench_clock {
+	struct timespec ts;
+	u64 cycles;
+};
+
+static u64 bench_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static void bench_start(struct bench_clock *clock)
+{
+	clock_gettime(CLOCK_MONOTONIC, &clock->ts);
+	clock->cycles = bench_cycles();
+}
+
+static void bench_stop(const struct bench_clock *clock, const char *name,
+		       unsigned long ops, const char *extra)
+{
+	u64 cycles = bench_cycles() - clock->cycles;
+	struct timespec ts;
+	double ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ns = (ts.tv_sec - clock->ts.tv_sec) * 1e9 +
+	     (ts.tv_nsec - clock->ts.tv_nsec);
+
+	printf("%-28s %8.2f ns/op %8.2f cycles/op  %s\n", name, ns / ops,
+	       (double)cycles / ops, extra);
+}
+
+static u64 *bench_seq_inorder(unsigned long n, unsigned int window)
+{
+	u64 *ids = malloc(n * sizeof(*ids));
+	unsigned long i;
+
+	for (i = 0; i < n; i++)
+		ids[i] = i + 1;
+
+	return ids;
+}
+
+/* in-order IDs, shuffled within small blocks as a multi-queue NIC or a
+ * parallel decryption would do
+ */
+static u64 *bench_seq_reordered(unsigned long n, unsigned int window)
+{
+	u64 *ids = bench_seq_inorder(n, window);
+	unsigned long i, j, base;
+	u64 tmp;
+
+	for (base = 0; base < n; base += BENCH_REORDER_SPAN) {
+		for (i = min(n - base, BENCH_REORDER_SPAN) - 1; i > 0; i--) {
+			j = random() % (i + 1);
+			tmp = ids[base + i];
+			ids[base + i] = ids[base + j];
+			ids[base + j] = tmp;
+		}
+	}
+
+	return ids;
+}
+
+/* IDs moving forward by gaps of up to twice the window, as after losses */
+static u64 *bench_seq_jumping(unsigned long n, unsigned int window)
+{
+	u64 *ids = malloc(n * sizeof(*ids));
+	unsigned long i;
+	u64 id = 0;
+
+	for (i = 0; i < n; i++) {
+		id += 1 + random() % (2 * window);
+		ids[i] = id;
+	}
+
+	return ids;
+}
+
+/* every ID of a block within the window is received twice */
+static u64 *bench_seq_replayed(unsigned long n, unsigned int window)
+{
+	u64 *ids = malloc(n * sizeof(*ids));
+	unsigned long i, block = window / 2;
+
+	for (i = 0; i < n; i++)
+		ids[i] = (i / (2 * block)) * block + i % block + 1;
+
+	return ids;
+}
+
+static const struct {
+	const char *name;
+	u64 *(*gen)(unsigned long n, unsigned int window);
+} bench_seqs[] = {
+	{ "in-order", bench_seq_inorder },
+	{ "reordered", bench_seq_reordered },
+	{ "jumping", bench_seq_jumping },
+	{ "replayed", bench_seq_replayed },
+};
+
+static void bench_pktid_check(const char *name,
+			      const struct ovpn_pktid_recv *pr,
+			      const u64 *ids, unsigned long n)
+{
+	struct bench_clock clock;
+	unsigned long i, ok = 0;
+	char extra[64];
+
+	bench_start(&clock);
+	for (i = 0; i < n; i++)
+		ok += !ovpn_pktid_recv_check(pr, ids[i]);
+	snprintf(extra, sizeof(extra), "passed %lu rejected %lu", ok, n - ok);
+	bench_stop(&clock, name, n, extra);
+}
+
+static void bench_pktid(const char *seq, const u64 *ids, unsigned long n,
+			unsigned int window)
+{
+	struct ovpn_pktid_recv pr, fresh;
+	struct bench_clock clock;
+	unsigned long i, ok = 0;
+	char name[64], extra[64];
+
+	if (ovpn_pktid_recv_init(&pr, window, 0) < 0 ||
+	    ovpn_pktid_recv_init(&fresh, window, 0) < 0) {
+		fprintf(stderr, "cannot allocate the replay window\n");
+		exit(1);
+	}
+
+	bench_start(&clock);
+	for (i = 0; i < n; i++)
+		ok += !ovpn_pktid_recv(&pr, ids[i], 0);
+	snprintf(name, sizeof(name), "recv/%s", seq);
+	snprintf(extra, sizeof(extra), "accepted %lu rejected %lu", ok,
+		 n - ok);
+	bench_stop(&clock, name, n, extra);
+
+	/* the check does not update the window: time it once against a
+	 * window that has seen nothing, where the IDs pass, and once against
+	 * the window the sequence left behind, where they are replays
+	 */
+	snprintf(name, sizeof(name), "recv_check/%s/pass", seq);
+	bench_pktid_check(name, &fresh, ids, n);
+	snprintf(name, sizeof(name), "recv_check/%s/replay", seq);
+	bench_pktid_check(name, &pr, ids, n);
+
+	ovpn_pktid_recv_release(&fresh);
+	ovpn_pktid_recv_release(&pr);
+}
+
+static void bench_framing(unsigned long n)
+{
+	struct ovpn_nonce_tail nt = { .u8 = { 1, 2, 3, 4, 5, 6, 7, 8 } };
+	unsigned char head[OVPN_OP_SIZE_V2 + NONCE_WIRE_SIZE_64];
+	unsigned char iv[NONCE_SIZE];
+	struct ovpn_pktid_xmit pid;
+	struct sk_buff skb = {
+		.data = head,
+		.len = sizeof(head),
+	};
+	struct bench_clock clock;
+	unsigned long i;
+	u64 sum = 0, id;
+	u32 op;
+
+	ovpn_pktid_xmit_init(&pid, false, OVPN_REKEY_THRESHOLD);
+	bench_start(&clock);
+	for (i = 0; i < n; i++) {
+		if (ovpn_pktid_xmit_next(&pid, &id) < 0)
+			break;
+		op = htonl(ovpn_opcode_compose(OVPN_DATA_V2, i, i));
+		memcpy(head, &op, sizeof(op));
+		ovpn_pktid_aead_write(id, &nt, iv);
+		memcpy(head + OVPN_OP_SIZE_V2, iv, NONCE_WIRE_SIZE);
+		sum += iv[0];
+	}
+	bench_stop(&clock, "xmit/framing", n, "");
+
+	/* 64-bit IDs are reserved the same way, from a fresh counter */
+	ovpn_pktid_xmit_init(&pid, true, OVPN_REKEY_THRESHOLD);
+	bench_start(&clock);
+	for (i = 0; i < n; i++) {
+		if (ovpn_pktid_xmit_next(&pid, &id) < 0)
+			break;
+		op = htonl(ovpn_opcode_compose(OVPN_DATA_V2, i, i));
+		memcpy(head, &op, sizeof(op));
+		ovpn_pktid_aead_write64(id, &nt, iv);
+		memcpy(head + OVPN_OP_SIZE_V2, iv, NONCE_WIRE_SIZE_64);
+		sum += iv[0];
+	}
+	bench_stop(&clock, "xmit/framing64", n, "");
+
+	bench_start(&clock);
+	for (i = 0; i < n; i++) {
+		head[3] = i;
+		head[OVPN_OP_SIZE_V2 + 3] = i;
+		sum += ovpn_opcode_from_skb(&skb, 0) +
+		       ovpn_key_id_from_skb(&skb) +
+		       ovpn_peer_id_from_skb(&skb, 0) +
+		       ovpn_pktid_from_wire(head + OVPN_OP_SIZE_V2,
+					    NONCE_WIRE_SIZE);
+	}
+	bench_stop(&clock, "recv/parsing", n, "");
+
+	/* keep the loops from being optimized out */
+	if (sum == 42)
+		printf("\n");
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n ids] [-w window] [-s seed]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long n = BENCH_IDS_DEFAULT;
+	unsigned int window = REPLAY_WINDOW_SIZE;
+	unsigned int seed = 1;
+	unsigned int i;
+	u64 *ids;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:w:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			n = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			window = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (!n || window < REPLAY_WINDOW_MIN || window > REPLAY_WINDOW_MAX)
+		usage(argv[0]);
+
+	window = roundup_pow_of_two(window);
+	srandom(seed);
+	printf("%lu IDs, replay window of %u packets\n", n, window);
+
+	for (i = 0; i < sizeof(bench_seqs) / sizeof(bench_seqs[0]); i++) {
+		ids = bench_seqs[i].gen(n, window);
+		if (!ids) {
+			fprintf(stderr, "cannot allocate the ID sequence\n");
+			return 1;
+		}
+
+		bench_pktid(bench_seqs[i].name, ids, n, window);
+		free(ids);
+	}
+
+	bench_framing(n);
+
+	return 0;
+}
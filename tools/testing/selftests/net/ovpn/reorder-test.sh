@@ -0,0 +1,133 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0
+# Copyright (C) 2024 OpenVPN, Inc.
+#
+#  Author:	Antonio Quartulli <antonio@openvpn.net>
+#
+# Measure how the replay protection copes with a reordering and lossy
+# underlay: netem delays, reorders and drops the packets on the veth pair
+# between two P2P peers while iperf3 runs through the tunnel, for every
+# combination of netem profile, replay window size and parallel RX.
+#
+# Traffic flows from peer1 to peer0, whose replay drops are reported along
+# with the throughput. Results are appended as CSV to RESULTS:
+#
+#   profile,window,parallel_rx,metric,value
+
+#set -x
+set -e
+
+OVPN_CLI=${OVPN_CLI:-./ovpn-cli}
+ALG=${ALG:-aes}
+WINDOWS=${WINDOWS:-"64 256 2048 16384"}
+PARALLEL=${PARALLEL:-"0 1"}
+DURATION=${DURATION:-10}
+RESULTS=${RESULTS:-reorder-results.csv}
+TMP_DIR=$(mktemp -d)
+
+# netem arguments of each profile, "none" leaves the underlay clean
+if [ -z "${PROFILES}" ]; then
+	PROFILES=("none"
+		  "delay 1ms reorder 25% 50%"
+		  "delay 2ms reorder 5% loss 0.5%"
+		  "delay 5ms 2ms distribution normal"
+		  "delay 10ms 5ms loss 1%")
+else
+	IFS=";" read -r -a PROFILES <<< "${PROFILES}"
+fi
+
+cleanup() {
+	for p in 0 1; do
+		ip netns exec peer${p} ${OVPN_CLI} del_iface tun${p} 2>/dev/null || true
+		ip netns del peer${p} 2>/dev/null || true
+	done
+}
+
+setup_ns() {
+	local flags=""
+
+	[ ${PARALLEL_RX} -eq 1 ] && flags="PARALLEL_RX"
+
+	ip netns add peer${1}
+	ip netns exec peer${1} ${OVPN_CLI} new_iface tun${1} P2P ${flags}
+	ip -n peer${1} addr add 5.5.5.$((${1} + 1))/24 dev tun${1}
+	ip -n peer${1} link set tun${1} up
+}
+
+setup() {
+	setup_ns 0
+	setup_ns 1
+
+	ip link add veth1 netns peer0 type veth peer name veth1 netns peer1
+	for p in 0 1; do
+		ip -n peer${p} addr add 10.10.1.$((${p} + 1))/24 dev veth1
+		ip -n peer${p} link set veth1 up
+		if [ "${PROFILE}" != "none" ]; then
+			ip netns exec peer${p} tc qdisc replace dev veth1 root netem ${PROFILE}
+		fi
+	done
+
+	# the window size applies to the keys installed afterwards
+	ip netns exec peer0 ${OVPN_CLI} new_peer tun0 1 1 10.10.1.2 1 5.5.5.2
+	ip netns exec peer0 ${OVPN_CLI} set_peer tun0 1 60 120 ${WINDOW}
+	ip netns exec peer0 ${OVPN_CLI} new_key tun0 1 1 0 ${ALG} 0 data64.key
+
+	ip netns exec peer1 ${OVPN_CLI} new_peer tun1 1 1 10.10.1.1 1 5.5.5.1
+	ip netns exec peer1 ${OVPN_CLI} set_peer tun1 1 60 120 ${WINDOW}
+	ip netns exec peer1 ${OVPN_CLI} new_key tun1 1 1 0 ${ALG} 1 data64.key
+
+	ip netns exec peer1 ping -qc 10 -i 0.1 -w 10 5.5.5.1 >/dev/null
+}
+
+report() {
+	echo "${PROFILE},${WINDOW},${PARALLEL_RX},${1},${2}" | tee -a ${RESULTS}
+}
+
+# value of a counter in the get_peer output of peer0
+peer_counter() {
+	ip netns exec peer0 ${OVPN_CLI} get_peer tun0 1 2>&1 | \
+		awk -F": " -v name="${1}" '$1 ~ "^\t" name "$" { print $2 }'
+}
+
+run() {
+	local replay0 replay1 bps
+
+	cleanup
+	setup
+
+	replay0=$(peer_counter "replay errors")
+
+	ip netns exec peer0 iperf3 -1 -s >/dev/null &
+	sleep 1
+	ip netns exec peer1 iperf3 -J -Z -t ${DURATION} -c 5.5.5.1 > ${TMP_DIR}/iperf.json
+	wait
+
+	replay1=$(peer_counter "replay errors")
+	bps=$(jq '.end.sum_received.bits_per_second' ${TMP_DIR}/iperf.json)
+
+	report throughput_bps $(printf "%.0f" ${bps})
+	report retransmits $(jq '.end.sum_sent.retransmits' ${TMP_DIR}/iperf.json)
+	report replay_drops $((${replay1:-0} - ${replay0:-0}))
+	report replay_max_backtrack $(peer_counter "replay max backtrack")
+
+	cleanup
+}
+
+for tool in iperf3 jq tc; do
+	if ! command -v ${tool} >/dev/null; then
+		echo "${tool} is required"
+		exit 4
+	fi
+done
+
+trap "cleanup; rm -rf ${TMP_DIR}" EXIT
+
+[ -s ${RESULTS} ] || echo "profile,window,parallel_rx,metric,value" > ${RESULTS}
+
+for PROFILE in "${PROFILES[@]}"; do
+	for WINDOW in ${WINDOWS}; do
+		for PARALLEL_RX in ${PARALLEL}; do
+			run
+		done
+	done
+done